@@ -50,8 +50,7 @@
 #define RANDOM_SIZE 20
 #define MAX_SIGSIZE 256
 
-static void list_keys(const char *title,
-	const PKCS11_KEY *keys, const unsigned int nkeys);
+static int list_keys(const char *title, PKCS11_KEY_ITER *iter);
 static void error_queue(const char *name);
 
 #define CHECK_ERR(cond, txt, code) \
@@ -67,9 +66,9 @@ int main(int argc, char *argv[])
 {
 	PKCS11_CTX *ctx=NULL;
 	PKCS11_SLOT *slots=NULL, *slot;
-	PKCS11_KEY *keys;
-	unsigned int nslots, nkeys;
-	int rc = 0;
+	PKCS11_KEY_ITER *iter;
+	unsigned int nslots;
+	int nkeys, rc = 0;
 
 	if (argc < 2) {
 		fprintf(stderr,
@@ -103,12 +102,15 @@ int main(int argc, char *argv[])
 	printf("Slot token model.......: %s\n", slot->token->model);
 	printf("Slot token serialnr....: %s\n", slot->token->serialnr);
 
-	/* get public keys */
-	rc = PKCS11_enumerate_public_keys(slot->token, &keys, &nkeys);
-	error_queue("PKCS11_enumerate_public_keys");
-	CHECK_ERR(rc < 0, "PKCS11_enumerate_public_keys failed", 4);
+	/* list public keys as they are found */
+	iter = PKCS11_public_key_iter_new(slot->token, NULL);
+	error_queue("PKCS11_public_key_iter_new");
+	CHECK_ERR(!iter, "PKCS11_public_key_iter_new failed", 4);
+	nkeys = list_keys("Public keys", iter);
+	PKCS11_key_iter_free(iter);
+	error_queue("PKCS11_key_iter_next");
+	CHECK_ERR(nkeys < 0, "PKCS11_key_iter_next failed", 4);
 	CHECK_ERR(nkeys == 0, "No public keys found", 5);
-	list_keys("Public keys", keys, nkeys);
 
 	if (slot->token->loginRequired && argc > 2) {
 		/* perform pkcs #11 login */
@@ -117,12 +119,15 @@ int main(int argc, char *argv[])
 		CHECK_ERR(rc < 0, "PKCS11_login failed", 6);
 	}
 
-	/* get private keys */
-	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
-	error_queue("PKCS11_enumerate_keys");
-	CHECK_ERR(rc < 0, "PKCS11_enumerate_keys failed", 7);
+	/* list private keys as they are found */
+	iter = PKCS11_key_iter_new(slot->token, NULL);
+	error_queue("PKCS11_key_iter_new");
+	CHECK_ERR(!iter, "PKCS11_key_iter_new failed", 7);
+	nkeys = list_keys("Private keys", iter);
+	PKCS11_key_iter_free(iter);
+	error_queue("PKCS11_key_iter_next");
+	CHECK_ERR(nkeys < 0, "PKCS11_key_iter_next failed", 7);
 	CHECK_ERR(nkeys == 0, "No private keys found", 8);
-	list_keys("Private keys", keys, nkeys);
 
 end:
 	if (slots)
@@ -139,14 +144,19 @@ end:
 	return rc;
 }
 
-static void list_keys(const char *title, const PKCS11_KEY *keys,
-		const unsigned int nkeys) {
-	unsigned int i;
+static int list_keys(const char *title, PKCS11_KEY_ITER *iter) {
+	PKCS11_KEY *key;
+	int nkeys = 0;
 
 	printf("\n%s:\n", title);
-	for (i = 0; i < nkeys; i++)
+	while (PKCS11_key_iter_next(iter, &key) == 0) {
+		if (!key)
+			return nkeys;
 		printf(" * %s key: %s\n",
-			keys[i].isPrivate ? "Private" : "Public", keys[i].label);
+			key->isPrivate ? "Private" : "Public", key->label);
+		nkeys++;
+	}
+	return -1;
 }
 
 static void error_queue(const char *name)
@@ -5,11 +5,14 @@ TOPDIR = ..
 LIBP11_OBJECTS = libpkcs11.obj p11_attr.obj p11_cert.obj \
 	p11_err.obj p11_ckr.obj p11_key.obj p11_load.obj p11_misc.obj \
 	p11_rsa.obj p11_ec.obj p11_pkey.obj p11_slot.obj p11_front.obj \
-	p11_atfork.obj
+	p11_atfork.obj p11_async.obj p11_index.obj p11_stats.obj \
+	p11_arena.obj p11_rand.obj p11_provision.obj p11_cache.obj \
+	p11_cipher.obj p11_sign.obj
 LIBP11_LIB = libp11.lib
 LIBP11_TARGET = libp11.dll
 
-PKCS11_OBJECTS = eng_front.obj eng_back.obj eng_parse.obj eng_err.obj
+PKCS11_OBJECTS = eng_front.obj eng_back.obj eng_parse.obj eng_err.obj \
+	eng_cache.obj eng_cipher.obj
 PKCS11_TARGET = pkcs11.dll
 
 OBJECTS = $(LIBP11_OBJECTS) $(PKCS11_OBJECTS)
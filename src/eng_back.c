@@ -30,6 +30,11 @@
 #include "p11_pthread.h"
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #if defined(_WIN32) || defined(_WIN64)
 #define strncasecmp _strnicmp
@@ -38,6 +43,24 @@
 /* The maximum length of an internally-allocated PIN */
 #define MAX_PIN_LENGTH   32
 #define MAX_VALUE_LEN	200
+/* The number of locks serializing the object searches on the tokens */
+#define TOKEN_LOCKS	16
+/* The separator of the modules listed in MODULE_PATH */
+#ifdef _WIN32
+#define MODULE_SEPARATOR ';'
+#else
+#define MODULE_SEPARATOR ':'
+#endif
+
+/* A PKCS#11 module loaded by the engine */
+typedef struct st_engine_module {
+	ENGINE_CTX *ctx;
+	char *path;
+	PKCS11_CTX *pkcs11_ctx;
+	PKCS11_SLOT *slot_list;
+	unsigned int slot_count;
+	int rv; /* result of the initialization */
+} ENGINE_MODULE;
 
 struct st_engine_ctx {
 	/* Engine configuration */
@@ -55,11 +78,56 @@ struct st_engine_ctx {
 	UI_METHOD *ui_method;
 	void *callback_data;
 	int force_login;
+	int load_balance;
+	unsigned int find_batch;
+	long session_timeout;
+	unsigned int session_prewarm;
+	unsigned int session_reserve, starvation_limit;
+	unsigned int enum_threads;
+	long watch_interval; /* milliseconds between the slot checks */
+	long auth_pin_ttl;
+	unsigned int auth_pin_max_uses;
+	unsigned int rand_buffer, rand_watermark; /* bytes buffered per slot */
+	long rand_mix; /* bytes between the reseeds of the OpenSSL generator */
+	char *metadata_dir, *metadata_generation; /* token metadata cache */
+	char *cipher_key; /* URI of the secret key of the ciphers */
+	int cipher_import; /* import the keys of EVP_CipherInit_ex() */
+	unsigned int cipher_chunk; /* bytes per multi-part cipher call */
+	unsigned int sign_chunk; /* bytes per C_SignUpdate() call */
+	long rand_unmixed; /* protected by lock */
+	int rand_seeded; /* protected by lock */
+	ENGINE_CACHE *cache; /* objects loaded by URI */
+
+	/*
+	 * Object loads hold rwlock for reading, so that they only serialize
+	 * on login_lock (the PIN and the login state) and on the lock of the
+	 * searched token.  Updating the slot list requires rwlock for writing.
+	 * Lock order: rwlock, lock, token_locks (by index), login_lock.
+	 */
+	pthread_rwlock_t rwlock;
+	pthread_mutex_t login_lock;
+	pthread_mutex_t token_locks[TOKEN_LOCKS];
 	pthread_mutex_t lock;
 
-	/* Current operations */
-	PKCS11_CTX *pkcs11_ctx;
-	PKCS11_SLOT *slot_list;
+	/* Slot watcher thread, protected by lock */
+	pthread_cond_t watch_cond;
+	int watch_running, watch_stop;
+#ifndef _WIN32
+	pid_t watch_pid; /* the watcher does not survive fork() */
+#endif
+
+	/* Background initialization requested with PRELOAD, protected by lock */
+	char *preload; /* the private key URIs to be loaded */
+	pthread_cond_t preload_cond;
+	int preload_running, preload_finish;
+#ifndef _WIN32
+	pid_t preload_pid; /* the preload does not survive fork() */
+#endif
+
+	/* Current operations, protected by rwlock */
+	ENGINE_MODULE *modules; /* also written with lock held */
+	unsigned int module_count;
+	PKCS11_SLOT **slot_list; /* the slots of all the modules */
 	unsigned int slot_count;
 };
 
@@ -67,6 +135,29 @@ struct st_engine_ctx {
 /* Utility functions                                                          */
 /******************************************************************************/
 
+/*
+ * Set while the thread uses the PKCS#11 module, so that the random numbers
+ * requested by the module itself are generated by OpenSSL instead of
+ * waiting for rwlock or recursing into the module
+ */
+static P11_THREAD_LOCAL int ctx_rand_busy = 0;
+
+/* Set in the preload thread, so that its own loads do not wait for it */
+static P11_THREAD_LOCAL int ctx_preloading = 0;
+
+/* Acquire rwlock for updating the libp11 data */
+static void ctx_wrlock(ENGINE_CTX *ctx)
+{
+	pthread_rwlock_wrlock(&ctx->rwlock);
+	ctx_rand_busy++;
+}
+
+static void ctx_wrunlock(ENGINE_CTX *ctx)
+{
+	ctx_rand_busy--;
+	pthread_rwlock_unlock(&ctx->rwlock);
+}
+
 void ctx_log(ENGINE_CTX *ctx, int level, const char *format, ...)
 {
 	va_list ap;
@@ -214,12 +305,21 @@ ENGINE_CTX *ctx_new()
 {
 	ENGINE_CTX *ctx;
 	char *mod;
+	int n;
 
 	ctx = OPENSSL_malloc(sizeof(ENGINE_CTX));
 	if (!ctx)
 		return NULL;
 	memset(ctx, 0, sizeof(ENGINE_CTX));
+	pthread_rwlock_init(&ctx->rwlock, 0);
+	pthread_mutex_init(&ctx->login_lock, 0);
+	for (n = 0; n < TOKEN_LOCKS; n++)
+		pthread_mutex_init(&ctx->token_locks[n], 0);
 	pthread_mutex_init(&ctx->lock, 0);
+	pthread_cond_init(&ctx->watch_cond, 0);
+	pthread_cond_init(&ctx->preload_cond, 0);
+	ctx->cache = cache_new();
+	ctx->session_timeout = -1;
 
 	mod = getenv("PKCS11_MODULE_PATH");
 	if (mod) {
@@ -235,80 +335,545 @@ ENGINE_CTX *ctx_new()
 	return ctx;
 }
 
+/* Whether the preload thread is still running, called with lock held */
+static int ctx_preload_running_unlocked(ENGINE_CTX *ctx)
+{
+#ifndef _WIN32
+	if (ctx->preload_running && ctx->preload_pid != getpid()) {
+		ctx->preload_running = 0;
+		ctx->preload_finish = 0;
+	}
+#endif
+	return ctx->preload_running;
+}
+
 /* Destroy the context allocated with ctx_new() */
 int ctx_destroy(ENGINE_CTX *ctx)
 {
+	int n;
+
 	if (ctx) {
+		/* ENGINE_free() unloads the engine, the preload must complete */
+		pthread_mutex_lock(&ctx->lock);
+		while (ctx_preload_running_unlocked(ctx))
+			pthread_cond_wait(&ctx->preload_cond, &ctx->lock);
+		pthread_mutex_unlock(&ctx->lock);
 		ctx_destroy_pin(ctx);
 		OPENSSL_free(ctx->module);
 		OPENSSL_free(ctx->init_args);
+		OPENSSL_free(ctx->preload);
+		OPENSSL_free(ctx->metadata_dir);
+		OPENSSL_free(ctx->metadata_generation);
+		OPENSSL_free(ctx->cipher_key);
+		cache_free(ctx->cache);
+		pthread_cond_destroy(&ctx->preload_cond);
+		pthread_cond_destroy(&ctx->watch_cond);
 		pthread_mutex_destroy(&ctx->lock);
+		for (n = 0; n < TOKEN_LOCKS; n++)
+			pthread_mutex_destroy(&ctx->token_locks[n]);
+		pthread_mutex_destroy(&ctx->login_lock);
+		pthread_rwlock_destroy(&ctx->rwlock);
 		OPENSSL_free(ctx);
 	}
 	return 1;
 }
 
-static int ctx_enumerate_slots_unlocked(ENGINE_CTX *ctx, PKCS11_CTX *pkcs11_ctx)
+/* Rebuild the slot list of all the modules, rwlock held for writing */
+static void ctx_merge_slots_unlocked(ENGINE_CTX *ctx)
+{
+	PKCS11_SLOT **slots = NULL;
+	unsigned int n, i, count = 0;
+
+	for (n = 0; n < ctx->module_count; n++)
+		count += ctx->modules[n].slot_count;
+	if (count)
+		slots = OPENSSL_malloc(count * sizeof(PKCS11_SLOT *));
+	OPENSSL_free(ctx->slot_list);
+	ctx->slot_list = slots;
+	ctx->slot_count = 0;
+	if (!slots)
+		return;
+	for (n = 0; n < ctx->module_count; n++)
+		for (i = 0; i < ctx->modules[n].slot_count; i++)
+			slots[ctx->slot_count++] = ctx->modules[n].slot_list + i;
+}
+
+/*
+ * Update the slot list of a module, keeping the slots whose token did
+ * not change
+ * Returns the number of changed slots, or -1 on error
+ */
+static int ctx_enumerate_module(ENGINE_CTX *ctx, ENGINE_MODULE *mod)
+{
+	int changed;
+
+	/* PKCS11_update_slots() uses C_GetSlotList() via libp11 */
+	changed = PKCS11_update_slots(mod->pkcs11_ctx,
+		&mod->slot_list, &mod->slot_count);
+	if (changed < 0) {
+		ctx_log(ctx, 0, "Failed to enumerate slots of %s\n", mod->path);
+		return -1;
+	}
+	ctx_log(ctx, 1, "Found %u slot%s in %s, %d changed\n", mod->slot_count,
+		mod->slot_count <= 1 ? "" : "s", mod->path, changed);
+	return changed;
+}
+
+/*
+ * Update the slot lists of the modules, or only of mod if not NULL
+ * The cached objects are only flushed when a token changed.
+ */
+static int ctx_enumerate_slots_unlocked(ENGINE_CTX *ctx, ENGINE_MODULE *mod)
+{
+	unsigned int n;
+	int changed = 0, failed = 0, rv;
+
+	for (n = 0; n < ctx->module_count; n++) {
+		if (mod && mod != ctx->modules + n)
+			continue;
+		rv = ctx_enumerate_module(ctx, ctx->modules + n);
+		if (rv < 0)
+			failed = 1;
+		else
+			changed += rv;
+	}
+
+	/* The ctx->rwlock write lock ensures thread safety for this operation */
+	if (failed || changed)
+		cache_flush(ctx->cache);
+	ctx_merge_slots_unlocked(ctx);
+	return !failed;
+}
+
+/* Absolute time after the timeout in milliseconds */
+static void ctx_get_deadline(struct timespec *deadline, long timeout)
+{
+#ifdef _WIN32
+	timespec_get(deadline, TIME_UTC);
+#else
+	clock_gettime(CLOCK_REALTIME, deadline);
+#endif
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ * Update the slots after the events reported by C_WaitForSlotEvent(),
+ * or check all of them with the modules not reporting the events
+ */
+static void ctx_watch_slots(ENGINE_CTX *ctx)
+{
+	ENGINE_MODULE *mod;
+	unsigned long slotid;
+	unsigned int n, events;
+	int rv;
+
+	ctx_wrlock(ctx);
+	if (!ctx->modules) { /* Released by ctx_finish() */
+		ctx_wrunlock(ctx);
+		return;
+	}
+	for (n = 0; n < ctx->module_count; n++) {
+		mod = ctx->modules + n;
+		events = 0;
+		rv = 0;
+		/* Coalesce the pending events into a single update */
+		while (events <= mod->slot_count &&
+				(rv = PKCS11_get_slot_event(mod->pkcs11_ctx, &slotid)) > 0) {
+			ctx_log(ctx, 1, "Token inserted or removed in slot %lu of %s\n",
+				slotid, mod->path);
+			events++;
+		}
+		if (rv < 0 || events)
+			ctx_enumerate_slots_unlocked(ctx, mod);
+	}
+	ctx_wrunlock(ctx);
+	/* Nobody reads the errors of this thread */
+	ERR_clear_error();
+}
+
+static void *ctx_watch_thread(void *arg)
 {
-	PKCS11_SLOT *slot_list = NULL;
-	unsigned int slot_count = 0;
+	ENGINE_CTX *ctx = arg;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (!ctx->watch_stop && ctx->watch_interval > 0) {
+		ctx_get_deadline(&deadline, ctx->watch_interval);
+		/* Woken up early when stopped or when the interval changed */
+		if (pthread_cond_timedwait(&ctx->watch_cond, &ctx->lock,
+				&deadline) == ETIMEDOUT && !ctx->watch_stop) {
+			/* ctx_finish() waits for us before releasing the slots */
+			pthread_mutex_unlock(&ctx->lock);
+			ctx_watch_slots(ctx);
+			pthread_mutex_lock(&ctx->lock);
+		}
+	}
+	ctx->watch_running = 0;
+	pthread_cond_broadcast(&ctx->watch_cond);
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
 
+/* Start the slot watcher configured with WATCH_SLOTS, if not running */
+static void ctx_watch_start_unlocked(ENGINE_CTX *ctx)
+{
+	pthread_t thread;
+
+	if (ctx->watch_running || ctx->watch_interval <= 0 || !ctx->modules)
+		return;
+	ctx->watch_stop = 0;
+	if (pthread_create(&thread, NULL, ctx_watch_thread, ctx)) {
+		ctx_log(ctx, 0, "Failed to start the slot watcher\n");
+		return;
+	}
+	pthread_detach(thread);
+	ctx->watch_running = 1;
+#ifndef _WIN32
+	ctx->watch_pid = getpid();
+#endif
+}
+
+/* Stop the slot watcher and wait until it no longer uses the slots */
+static void ctx_watch_stop_unlocked(ENGINE_CTX *ctx)
+{
+#ifndef _WIN32
+	if (ctx->watch_running && ctx->watch_pid != getpid())
+		ctx->watch_running = 0;
+#endif
+	ctx->watch_stop = 1;
+	pthread_cond_broadcast(&ctx->watch_cond);
+	while (ctx->watch_running)
+		pthread_cond_wait(&ctx->watch_cond, &ctx->lock);
+}
+
+/*
+ * Load a module into its new libp11 context and enumerate its slots
+ * Called in a thread of its own when several modules are loaded.
+ */
+static void *ctx_load_module(void *arg)
+{
+	ENGINE_MODULE *mod = arg;
+	ENGINE_CTX *ctx = mod->ctx;
+	PKCS11_CTX *pkcs11_ctx = mod->pkcs11_ctx;
+
+	/* The random numbers requested by the module are generated by OpenSSL */
+	ctx_rand_busy++;
+	mod->rv = -1;
+	PKCS11_CTX_init_args(pkcs11_ctx, ctx->init_args);
+	PKCS11_CTX_set_find_batch(pkcs11_ctx, ctx->find_batch);
+	PKCS11_CTX_set_session_timeout(pkcs11_ctx, ctx->session_timeout);
+	PKCS11_CTX_set_session_prewarm(pkcs11_ctx, ctx->session_prewarm);
+	PKCS11_CTX_set_session_reserve(pkcs11_ctx,
+		ctx->session_reserve, ctx->starvation_limit);
+	PKCS11_CTX_set_auth_pin_cache(pkcs11_ctx,
+		ctx->auth_pin_ttl, ctx->auth_pin_max_uses);
+	PKCS11_CTX_set_random_buffer(pkcs11_ctx,
+		ctx->rand_buffer, ctx->rand_watermark);
+	PKCS11_CTX_set_enum_threads(pkcs11_ctx, ctx->enum_threads);
+	PKCS11_CTX_set_metadata_cache(pkcs11_ctx,
+		ctx->metadata_dir, ctx->metadata_generation);
+	PKCS11_CTX_set_cipher_chunk(pkcs11_ctx, ctx->cipher_chunk);
+	PKCS11_CTX_set_sign_chunk(pkcs11_ctx, ctx->sign_chunk);
+	/* The engine only needs the certificates it loads */
+	PKCS11_CTX_set_lazy_x509(pkcs11_ctx, 1);
+	PKCS11_set_ui_method(pkcs11_ctx, ctx->ui_method, ctx->callback_data);
 
 	/* PKCS11_CTX_load() uses C_GetSlotList() via p11-kit */
-	if (PKCS11_CTX_load(pkcs11_ctx, ctx->module) < 0) {
-		ctx_log(ctx, 0, "Unable to load module %s\n", ctx->module);
+	if (PKCS11_CTX_load(pkcs11_ctx, mod->path) < 0) {
+		ctx_log(ctx, 0, "Unable to load module %s\n", mod->path);
 		PKCS11_CTX_free(pkcs11_ctx);
-		return 0;
+		mod->pkcs11_ctx = NULL;
+		goto done;
 	}
-
-	/* PKCS11_enumerate_slots() uses C_GetSlotList() via libp11 */
-	if (PKCS11_enumerate_slots(pkcs11_ctx, &slot_list, &slot_count) < 0) {
-		ctx_log(ctx, 0, "Failed to enumerate slots\n");
+	if (ctx_enumerate_module(ctx, mod) < 0) {
 		PKCS11_CTX_unload(pkcs11_ctx);
 		PKCS11_CTX_free(pkcs11_ctx);
-		return 0;
+		mod->pkcs11_ctx = NULL;
+		goto done;
+	}
+	mod->rv = 0;
+done:
+	ctx_rand_busy--;
+	return NULL;
+}
+
+/* Split the MODULE_PATH list into the modules to be loaded */
+static ENGINE_MODULE *ctx_new_modules(ENGINE_CTX *ctx, unsigned int *count)
+{
+	ENGINE_MODULE *mods;
+	const char *p, *end;
+	unsigned int n = 1;
+
+	for (p = ctx->module; *p; p++)
+		if (*p == MODULE_SEPARATOR)
+			n++;
+	mods = OPENSSL_malloc(n * sizeof(ENGINE_MODULE));
+	if (!mods)
+		return NULL;
+	memset(mods, 0, n * sizeof(ENGINE_MODULE));
+	n = 0;
+	for (p = ctx->module; ; p = end + 1) {
+		end = strchr(p, MODULE_SEPARATOR);
+		if (!end)
+			end = p + strlen(p);
+		if (end > p) {
+			mods[n].ctx = ctx;
+			mods[n].path = OPENSSL_malloc(end - p + 1);
+			if (!mods[n].path)
+				break;
+			memcpy(mods[n].path, p, end - p);
+			mods[n].path[end - p] = '\0';
+			n++;
+		}
+		if (!*end) {
+			*count = n;
+			return mods;
+		}
 	}
+	while (n > 0)
+		OPENSSL_free(mods[--n].path);
+	OPENSSL_free(mods);
+	return NULL;
+}
 
-	ctx_log(ctx, 1, "Found %u slot%s\n", slot_count,
-		slot_count <= 1 ? "" : "s");
+static void ctx_free_modules(ENGINE_MODULE *mods, unsigned int count)
+{
+	unsigned int n;
+
+	for (n = 0; n < count; n++) {
+		if (mods[n].slot_list)
+			PKCS11_release_all_slots(mods[n].pkcs11_ctx,
+				mods[n].slot_list, mods[n].slot_count);
+		if (mods[n].pkcs11_ctx) {
+			PKCS11_CTX_unload(mods[n].pkcs11_ctx);
+			PKCS11_CTX_free(mods[n].pkcs11_ctx);
+		}
+		OPENSSL_free(mods[n].path);
+	}
+	OPENSSL_free(mods);
+}
 
-	/* The ctx->lock mutex ensures thread safety for this operation */
-	PKCS11_release_all_slots(pkcs11_ctx, ctx->slot_list, ctx->slot_count);
-	ctx->slot_list = slot_list;
-	ctx->slot_count = slot_count;
+/*
+ * Initialize libp11 data: ctx->modules and ctx->slot_list
+ * The modules listed in MODULE_PATH are initialized in parallel, and
+ * the ones that fail to load are skipped.
+ */
+static int ctx_init_libp11_unlocked(ENGINE_CTX *ctx)
+{
+	ENGINE_MODULE *mods;
+	pthread_t *threads = NULL;
+	unsigned int n, m, count = 0, started;
+
+	if (ctx->modules) {
+		/* No slots were found yet */
+		if (!ctx->slot_list)
+			ctx_enumerate_slots_unlocked(ctx, NULL);
+		return ctx->slot_list ? 0 : -1;
+	}
 
-	return 1;
+	ctx_log(ctx, 1, "PKCS#11: Initializing the engine\n");
+
+	if (!ctx->module) {
+		ctx_log(ctx, 0, "No PKCS#11 module specified\n");
+		return -1;
+	}
+	mods = ctx_new_modules(ctx, &count);
+	if (!mods)
+		return -1;
+	/* The error strings are not loaded concurrently */
+	for (n = 0; n < count; n++) {
+		mods[n].pkcs11_ctx = PKCS11_CTX_new();
+		if (!mods[n].pkcs11_ctx) {
+			ctx_free_modules(mods, count);
+			return -1;
+		}
+	}
+
+	/* The last module is loaded by the calling thread */
+	if (count > 1)
+		threads = OPENSSL_malloc((count - 1) * sizeof(pthread_t));
+	for (started = 0; threads && started + 1 < count; started++)
+		if (pthread_create(threads + started, NULL,
+				ctx_load_module, mods + started))
+			break;
+	for (n = started; n < count; n++)
+		ctx_load_module(mods + n);
+	for (n = 0; n < started; n++)
+		pthread_join(threads[n], NULL);
+	OPENSSL_free(threads);
+
+	/* Keep the modules that were loaded, in the configured order */
+	for (n = 0, m = 0; n < count; n++) {
+		if (mods[n].rv) {
+			OPENSSL_free(mods[n].path);
+			continue;
+		}
+		mods[m++] = mods[n];
+	}
+	if (!m) {
+		OPENSSL_free(mods);
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->modules = mods;
+	ctx->module_count = m;
+	ctx_merge_slots_unlocked(ctx);
+	ctx_watch_start_unlocked(ctx);
+	pthread_mutex_unlock(&ctx->lock);
+	return ctx->slot_list ? 0 : -1;
+}
+
+static int ctx_enumerate_slots(ENGINE_CTX *ctx)
+{
+	int rv;
+
+	ctx_wrlock(ctx);
+	if (ctx->modules)
+		rv = ctx_enumerate_slots_unlocked(ctx, NULL);
+	else
+		rv = ctx_init_libp11_unlocked(ctx) ? 0 : 1;
+	ctx_wrunlock(ctx);
+	return rv;
 }
 
-static int ctx_enumerate_slots(ENGINE_CTX *ctx, PKCS11_CTX *pkcs11_ctx)
+/* Acquire the read lock on the initialized libp11 data */
+static int ctx_rdlock_libp11(ENGINE_CTX *ctx)
 {
 	int rv;
 
+	pthread_rwlock_rdlock(&ctx->rwlock);
+	while (!ctx->modules || !ctx->slot_list) {
+		/* Delayed libp11 initialization */
+		pthread_rwlock_unlock(&ctx->rwlock);
+		ctx_wrlock(ctx);
+		rv = ctx_init_libp11_unlocked(ctx);
+		ctx_wrunlock(ctx);
+		if (rv)
+			return -1;
+		/* Released again if ctx_finish() was called in the meantime */
+		pthread_rwlock_rdlock(&ctx->rwlock);
+	}
+	return 0;
+}
+
+/* Release the modules and the slots, rwlock not held */
+static void ctx_release(ENGINE_CTX *ctx)
+{
+	ENGINE_MODULE *mods;
+	unsigned int count;
+
+	/* The watcher needs the write lock to finish its update */
 	pthread_mutex_lock(&ctx->lock);
-	rv = ctx_enumerate_slots_unlocked(ctx, pkcs11_ctx);
+	ctx_watch_stop_unlocked(ctx);
 	pthread_mutex_unlock(&ctx->lock);
-	return rv;
+	ctx_wrlock(ctx);
+	cache_flush(ctx->cache);
+	OPENSSL_free(ctx->slot_list);
+	ctx->slot_list = NULL;
+	ctx->slot_count = 0;
+	if (ctx->modules) {
+		mods = ctx->modules;
+		count = ctx->module_count;
+		pthread_mutex_lock(&ctx->lock);
+		ctx->modules = NULL;
+		ctx->module_count = 0;
+		pthread_mutex_unlock(&ctx->lock);
+		ctx_free_modules(mods, count);
+	}
+	ctx_wrunlock(ctx);
 }
 
-/* Initialize libp11 data: ctx->pkcs11_ctx and ctx->slot_list */
-static int ctx_init_libp11_unlocked(ENGINE_CTX *ctx)
+/*
+ * Initialize libp11 and load the PRELOAD private keys into the cache
+ * The keys are logged in to with the user interface set before ENGINE_init().
+ */
+static void *ctx_preload_thread(void *arg)
 {
-	PKCS11_CTX *pkcs11_ctx;
+	ENGINE_CTX *ctx = arg;
+	char *uris, *uri, *next;
+	EVP_PKEY *pkey;
+	int rv, stop;
 
-	if (ctx->pkcs11_ctx && ctx->slot_list)
-		return 0;
+	ctx_preloading = 1;
+	pthread_mutex_lock(&ctx->lock);
+	uris = OPENSSL_strdup(ctx->preload);
+	pthread_mutex_unlock(&ctx->lock);
 
-	ctx_log(ctx, 1, "PKCS#11: Initializing the engine\n");
+	ctx_wrlock(ctx);
+	rv = ctx->modules ? 0 : ctx_init_libp11_unlocked(ctx);
+	ctx_wrunlock(ctx);
+
+	for (uri = uris; rv == 0 && uri && *uri; uri = next) {
+		uri += strspn(uri, " \t\r\n");
+		next = uri + strcspn(uri, " \t\r\n");
+		if (*next)
+			*next++ = '\0';
+		if (strncmp(uri, "pkcs11:", 7))
+			continue;
+		pthread_mutex_lock(&ctx->lock);
+		stop = ctx->preload_finish;
+		pthread_mutex_unlock(&ctx->lock);
+		if (stop)
+			break;
+		pkey = ctx_load_privkey(ctx, uri, ctx->ui_method, ctx->callback_data);
+		EVP_PKEY_free(pkey); /* still referenced by the cache */
+	}
+	OPENSSL_free(uris);
+	/* The failed loads are logged, and repeated by the application */
+	ERR_clear_error();
 
-	pkcs11_ctx = PKCS11_CTX_new();
-	PKCS11_CTX_init_args(pkcs11_ctx, ctx->init_args);
-	PKCS11_set_ui_method(pkcs11_ctx, ctx->ui_method, ctx->callback_data);
+	pthread_mutex_lock(&ctx->lock);
+	/* ctx_finish() left the cleanup to us */
+	while (ctx->preload_finish) {
+		ctx->preload_finish = 0;
+		pthread_mutex_unlock(&ctx->lock);
+		ctx_release(ctx);
+		pthread_mutex_lock(&ctx->lock);
+	}
+	ctx->preload_running = 0;
+	pthread_cond_broadcast(&ctx->preload_cond);
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
 
-	if (ctx_enumerate_slots_unlocked(ctx, pkcs11_ctx) != 1)
-		return -1;
+/* Start the preload configured with PRELOAD, called with lock held */
+static void ctx_preload_start_unlocked(ENGINE_CTX *ctx)
+{
+	pthread_t thread;
+
+	if (ctx_preload_running_unlocked(ctx)) {
+		/* ENGINE_init() again before the preload completed */
+		ctx->preload_finish = 0;
+		return;
+	}
+	if (!ctx->preload)
+		return;
+	if (pthread_create(&thread, NULL, ctx_preload_thread, ctx)) {
+		ctx_log(ctx, 0, "Failed to start the preload thread\n");
+		return;
+	}
+	pthread_detach(thread);
+	ctx->preload_running = 1;
+#ifndef _WIN32
+	ctx->preload_pid = getpid();
+#endif
+}
 
-	ctx->pkcs11_ctx = pkcs11_ctx;
-	return ctx->pkcs11_ctx && ctx->slot_list ? 0 : -1;
+/* Wait until the preload no longer initializes libp11 or loads keys */
+static void ctx_preload_wait(ENGINE_CTX *ctx)
+{
+	if (ctx_preloading)
+		return;
+	pthread_mutex_lock(&ctx->lock);
+	while (ctx_preload_running_unlocked(ctx) && !ctx->preload_finish)
+		pthread_cond_wait(&ctx->preload_cond, &ctx->lock);
+	pthread_mutex_unlock(&ctx->lock);
 }
 
 /* Function called from ENGINE_init() */
@@ -317,9 +882,13 @@ int ctx_init(ENGINE_CTX *ctx)
 	/* OpenSC implicitly locks CRYPTO_LOCK_ENGINE during C_GetSlotList().
 	 * OpenSSL also locks CRYPTO_LOCK_ENGINE in ENGINE_init().
 	 * Double-locking a non-recursive rwlock causes the application to
-	 * crash or hang, depending on the locking library implementation. */
+	 * crash or hang, depending on the locking library implementation.
+	 * The PRELOAD initialization therefore runs in a thread of its own,
+	 * which is never waited for with CRYPTO_LOCK_ENGINE held. */
 
-	(void)ctx; /* squash the unused parameter warning */
+	pthread_mutex_lock(&ctx->lock);
+	ctx_preload_start_unlocked(ctx);
+	pthread_mutex_unlock(&ctx->lock);
 	return 1;
 }
 
@@ -327,17 +896,17 @@ int ctx_init(ENGINE_CTX *ctx)
 int ctx_finish(ENGINE_CTX *ctx)
 {
 	if (ctx) {
-		if (ctx->slot_list) {
-			PKCS11_release_all_slots(ctx->pkcs11_ctx,
-				ctx->slot_list, ctx->slot_count);
-			ctx->slot_list = NULL;
-			ctx->slot_count = 0;
-		}
-		if (ctx->pkcs11_ctx) {
-			PKCS11_CTX_unload(ctx->pkcs11_ctx);
-			PKCS11_CTX_free(ctx->pkcs11_ctx);
-			ctx->pkcs11_ctx = NULL;
+		/* Our caller may hold CRYPTO_LOCK_ENGINE, which the preload
+		 * may be waiting for, so the preload releases libp11 itself */
+		pthread_mutex_lock(&ctx->lock);
+		if (ctx_preload_running_unlocked(ctx)) {
+			ctx->preload_finish = 1;
+			pthread_cond_broadcast(&ctx->preload_cond);
+			pthread_mutex_unlock(&ctx->lock);
+			return 1;
 		}
+		pthread_mutex_unlock(&ctx->lock);
+		ctx_release(ctx);
 	}
 	return 1;
 }
@@ -346,10 +915,66 @@ int ctx_finish(ENGINE_CTX *ctx)
 /* Utilities common to public, private key and certificate handling           */
 /******************************************************************************/
 
+static void *match_private_key(ENGINE_CTX *ctx, PKCS11_TOKEN *tok,
+	const unsigned char *obj_id, size_t obj_id_len, const char *obj_label);
+
+/* The first slot with a token, in the order of the modules */
+static PKCS11_SLOT *ctx_find_token(ENGINE_CTX *ctx)
+{
+	ENGINE_MODULE *mod;
+	PKCS11_SLOT *slot;
+	unsigned int n;
+
+	for (n = 0; n < ctx->module_count; n++) {
+		mod = ctx->modules + n;
+		slot = PKCS11_find_token(mod->pkcs11_ctx,
+			mod->slot_list, mod->slot_count);
+		if (slot)
+			return slot;
+	}
+	return NULL;
+}
+
+/* The token lock serializing the object searches on the slot */
+static unsigned int ctx_token_lock(PKCS11_SLOT *slot)
+{
+	return PKCS11_get_slotid_from_slot(slot) % TOKEN_LOCKS;
+}
+
+/* Lock the tokens of several slots in a consistent order */
+static unsigned long ctx_lock_tokens(ENGINE_CTX *ctx,
+		PKCS11_SLOT **slots, size_t count)
+{
+	unsigned long mask = 0;
+	unsigned int n;
+
+	for (n = 0; n < count; n++)
+		mask |= 1UL << ctx_token_lock(slots[n]);
+	for (n = 0; n < TOKEN_LOCKS; n++)
+		if (mask & (1UL << n))
+			pthread_mutex_lock(&ctx->token_locks[n]);
+	return mask;
+}
+
+static void ctx_unlock_tokens(ENGINE_CTX *ctx, unsigned long mask)
+{
+	unsigned int n;
+
+	for (n = 0; n < TOKEN_LOCKS; n++)
+		if (mask & (1UL << n))
+			pthread_mutex_unlock(&ctx->token_locks[n]);
+}
+
+/*
+ * The objects found by match_func() are only valid while the searched
+ * token is locked, so they are converted with export_func() before
+ * the token is unlocked.
+ */
 static void *ctx_try_load_object(ENGINE_CTX *ctx,
 		const char *object_typestr,
 		void *(*match_func)(ENGINE_CTX *, PKCS11_TOKEN *,
 				const unsigned char *, size_t, const char *),
+		void *(*export_func)(void *),
 		const char *object_uri, const int login,
 		UI_METHOD *ui_method, void *callback_data)
 {
@@ -365,7 +990,12 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 	int slot_nr = -1;
 	char flags[64];
 	size_t matched_count = 0;
-	void *object = NULL;
+	void *object = NULL, *replica;
+	pthread_mutex_t *token_lock;
+	unsigned long token_mask = 0;
+	int rv;
+	/* Load the private key from all the matching tokens */
+	int group = ctx->load_balance && match_func == match_private_key;
 
 	if (object_uri && *object_uri) {
 		if (!strncasecmp(object_uri, "pkcs11:", 7)) {
@@ -380,6 +1010,7 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 				goto error;
 			}
 			if (tmp_pin_len > 0 && tmp_pin[0] != 0) {
+				pthread_mutex_lock(&ctx->login_lock);
 				ctx_destroy_pin(ctx);
 				ctx->pin = OPENSSL_malloc(MAX_PIN_LENGTH+1);
 				if (ctx->pin) {
@@ -387,6 +1018,7 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 					memcpy(ctx->pin, tmp_pin, tmp_pin_len);
 					ctx->pin_length = tmp_pin_len;
 				}
+				pthread_mutex_unlock(&ctx->login_lock);
 			}
 		} else {
 			n = parse_slot_id_string(ctx, object_uri, &slot_nr,
@@ -423,7 +1055,7 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 	}
 
 	for (n = 0; n < ctx->slot_count; n++) {
-		slot = ctx->slot_list + n;
+		slot = ctx->slot_list[n];
 		flags[0] = '\0';
 		if (slot->token) {
 			if (!slot->token->initialized)
@@ -489,8 +1121,7 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 			ctx_log(ctx, 0, "Invalid slot number: %d\n", slot_nr);
 			goto error;
 		} else {
-			found_slot = PKCS11_find_token(ctx->pkcs11_ctx,
-								ctx->slot_list, ctx->slot_count);
+			found_slot = ctx_find_token(ctx);
 			/* Ignore if the the token is not initialized */
 			if (found_slot && found_slot->token &&
 					found_slot->token->initialized) {
@@ -503,6 +1134,10 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 		}
 	}
 
+	/* The replicas are added to the key found on the first token */
+	if (group)
+		token_mask = ctx_lock_tokens(ctx, matched_slots, matched_count);
+
 	for (n = 0; n < matched_count; n++) {
 		slot = matched_slots[n];
 		tok = slot->token;
@@ -520,9 +1155,17 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 			if (tok->loginRequired) {
 				/* Only try to login if a single slot matched to avoiding trying
 				 * the PIN against all matching slots */
-				if (matched_count == 1) {
-					if (!ctx_login(ctx, slot, tok,
-							ui_method, callback_data)) {
+				if (matched_count == 1 || group) {
+					pthread_mutex_lock(&ctx->login_lock);
+					rv = ctx_login(ctx, slot, tok, ui_method, callback_data);
+					pthread_mutex_unlock(&ctx->login_lock);
+					if (!rv) {
+						if (object) {
+							/* Keep the tokens loaded so far */
+							ctx_log(ctx, 0, "Login to token failed, "
+								"skipping the remaining tokens\n");
+							break;
+						}
 						ctx_log(ctx, 0, "Login to token failed, returning NULL...\n");
 						goto error;
 					}
@@ -542,12 +1185,33 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 			}
 		}
 
-		object = match_func(ctx, tok, obj_id, obj_id_len, obj_label);
-		if (object)
-			break;
+		if (!group) {
+			token_lock = ctx->token_locks + ctx_token_lock(slot);
+			pthread_mutex_lock(token_lock);
+			object = match_func(ctx, tok, obj_id, obj_id_len, obj_label);
+			if (object)
+				object = export_func(object);
+			pthread_mutex_unlock(token_lock);
+			if (object)
+				break;
+			continue;
+		}
+		replica = match_func(ctx, tok, obj_id, obj_id_len, obj_label);
+		if (!replica)
+			continue;
+		if (!object)
+			object = replica;
+		else if (PKCS11_add_key_replica(object, replica))
+			ctx_log(ctx, 0, "Unable to use the key on token %s\n",
+				tok->label);
+		else
+			ctx_log(ctx, 1, "Using the key on token %s\n", tok->label);
 	}
+	if (group && object)
+		object = export_func(object);
 
 error:
+	ctx_unlock_tokens(ctx, token_mask);
 	/* Free the searched token data */
 	if (match_tok) {
 		OPENSSL_free(match_tok->model);
@@ -568,36 +1232,35 @@ static void *ctx_load_object(ENGINE_CTX *ctx,
 		const char *object_typestr,
 		void *(*match_func)(ENGINE_CTX *, PKCS11_TOKEN *,
 				const unsigned char *, size_t, const char *),
+		void *(*export_func)(void *),
 		const char *object_uri, UI_METHOD *ui_method, void *callback_data)
 {
 	void *obj = NULL;
 
-	pthread_mutex_lock(&ctx->lock);
-
-	/* Delayed libp11 initialization */
-	if (ctx_init_libp11_unlocked(ctx)) {
+	if (ctx_rdlock_libp11(ctx)) {
 		ENGerr(ENG_F_CTX_LOAD_OBJECT, ENG_R_INVALID_PARAMETER);
-		pthread_mutex_unlock(&ctx->lock);
 		return NULL;
 	}
+	ctx_rand_busy++;
 
 	if (!ctx->force_login) {
 		ERR_clear_error();
 		obj = ctx_try_load_object(ctx, object_typestr, match_func,
-			object_uri, 0, ui_method, callback_data);
+			export_func, object_uri, 0, ui_method, callback_data);
 	}
 
 	if (!obj) {
 		/* Try again with login */
 		ERR_clear_error();
 		obj = ctx_try_load_object(ctx, object_typestr, match_func,
-			object_uri, 1, ui_method, callback_data);
+			export_func, object_uri, 1, ui_method, callback_data);
 		if (!obj) {
 			ctx_log(ctx, 0, "The %s was not found.\n", object_typestr);
 		}
 	}
 
-	pthread_mutex_unlock(&ctx->lock);
+	ctx_rand_busy--;
+	pthread_rwlock_unlock(&ctx->rwlock);
 	return obj;
 }
 
@@ -605,16 +1268,12 @@ static void *ctx_load_object(ENGINE_CTX *ctx,
 /* Certificate handling                                                       */
 /******************************************************************************/
 
-static void *match_cert(ENGINE_CTX *ctx, PKCS11_TOKEN *tok,
+static void *select_cert(ENGINE_CTX *ctx, PKCS11_CERT *certs, unsigned int cert_count,
 		const unsigned char *obj_id, size_t obj_id_len, const char *obj_label)
 {
-	PKCS11_CERT *certs, *selected_cert = NULL;
-	unsigned int m, cert_count;
+	PKCS11_CERT *selected_cert = NULL;
+	unsigned int m;
 
-	if (PKCS11_enumerate_certs(tok, &certs, &cert_count)) {
-		ctx_log(ctx, 0, "Unable to enumerate certificates\n");
-		return NULL;
-	}
 	if (cert_count == 0)
 		return NULL;
 
@@ -643,13 +1302,69 @@ static void *match_cert(ENGINE_CTX *ctx, PKCS11_TOKEN *tok,
 	return selected_cert;
 }
 
+static void *match_cert(ENGINE_CTX *ctx, PKCS11_TOKEN *tok,
+		const unsigned char *obj_id, size_t obj_id_len, const char *obj_label)
+{
+	PKCS11_CERT *certs, cert_template;
+	unsigned int cert_count;
+	void *selected_cert;
+
+	/* Only search the token for the specified certificate */
+	if (obj_id_len != 0 || obj_label) {
+		memset(&cert_template, 0, sizeof cert_template);
+		cert_template.id = (unsigned char *)obj_id;
+		cert_template.id_len = obj_id_len;
+		cert_template.label = (char *)obj_label;
+		if (!PKCS11_enumerate_certs_ext(tok, &cert_template,
+				&certs, &cert_count)) {
+			selected_cert = select_cert(ctx, certs, cert_count,
+				obj_id, obj_id_len, obj_label);
+			if (selected_cert)
+				return selected_cert;
+		}
+	}
+
+	/* Fall back to enumerating all the certificates */
+	if (PKCS11_enumerate_certs(tok, &certs, &cert_count)) {
+		ctx_log(ctx, 0, "Unable to enumerate certificates\n");
+		return NULL;
+	}
+	return select_cert(ctx, certs, cert_count, obj_id, obj_id_len, obj_label);
+}
+
+static void *export_cert(void *cert)
+{
+	X509 *x509 = PKCS11_get_x509(cert);
+
+	return x509 ? X509_dup(x509) : NULL;
+}
+
+X509 *ctx_load_cert(ENGINE_CTX *ctx, const char *s_cert_id,
+		UI_METHOD *ui_method, void *callback_data)
+{
+	X509 *cert;
+
+	ctx_preload_wait(ctx);
+	cert = cache_get(ctx->cache, CACHE_CERT, s_cert_id);
+	if (cert)
+		return cert;
+	cert = ctx_load_object(ctx, "certificate", match_cert,
+		export_cert, s_cert_id, ui_method, callback_data);
+	if (!cert) {
+		if (!ERR_peek_last_error())
+			ENGerr(ENG_F_CTX_LOAD_CERT, ENG_R_OBJECT_NOT_FOUND);
+		return NULL;
+	}
+	cache_put(ctx->cache, CACHE_CERT, s_cert_id, cert);
+	return cert;
+}
+
 static int ctx_ctrl_load_cert(ENGINE_CTX *ctx, void *p)
 {
 	struct {
 		const char *s_slot_cert_id;
 		X509 *cert;
 	} *parms = p;
-	PKCS11_CERT *cert;
 
 	if (!parms) {
 		ENGerr(ENG_F_CTX_CTRL_LOAD_CERT, ERR_R_PASSED_NULL_PARAMETER);
@@ -660,15 +1375,9 @@ static int ctx_ctrl_load_cert(ENGINE_CTX *ctx, void *p)
 		return 0;
 	}
 
-	cert = ctx_load_object(ctx, "certificate", match_cert, parms->s_slot_cert_id,
+	parms->cert = ctx_load_cert(ctx, parms->s_slot_cert_id,
 		ctx->ui_method, ctx->callback_data);
-	if (!cert) {
-		if (!ERR_peek_last_error())
-			ENGerr(ENG_F_CTX_CTRL_LOAD_CERT, ENG_R_OBJECT_NOT_FOUND);
-		return 0;
-	}
-	parms->cert = X509_dup(cert->x509);
-	return 1;
+	return parms->cert ? 1 : 0;
 }
 
 /******************************************************************************/
@@ -709,64 +1418,279 @@ static void *match_key(ENGINE_CTX *ctx, const char *key_type,
 	return selected_key;
 }
 
-static void *match_public_key(ENGINE_CTX *ctx, PKCS11_TOKEN *tok,
+static void *match_key_type(ENGINE_CTX *ctx, PKCS11_TOKEN *tok, int isPrivate,
 		const unsigned char *obj_id, size_t obj_id_len, const char *obj_label)
 {
-	PKCS11_KEY *keys;
+	const char *key_type = isPrivate ? "private" : "public";
+	PKCS11_KEY *keys, key_template;
 	unsigned int key_count;
+	void *selected_key;
+	int rv;
 
-	/* Make sure there is at least one public key on the token */
-	if (PKCS11_enumerate_public_keys(tok, &keys, &key_count)) {
-		ctx_log(ctx, 0, "Unable to enumerate public keys\n");
+	/* Only search the token for the specified key */
+	if (obj_id_len != 0 || obj_label) {
+		memset(&key_template, 0, sizeof key_template);
+		key_template.id = (unsigned char *)obj_id;
+		key_template.id_len = obj_id_len;
+		key_template.label = (char *)obj_label;
+		rv = isPrivate ?
+			PKCS11_enumerate_keys_ext(tok, &key_template, &keys, &key_count) :
+			PKCS11_enumerate_public_keys_ext(tok, &key_template, &keys, &key_count);
+		if (!rv) {
+			selected_key = match_key(ctx, key_type, keys, key_count,
+				obj_id, obj_id_len, obj_label);
+			if (selected_key)
+				return selected_key;
+		}
+	}
+
+	/* Fall back to enumerating all the keys, and make sure there
+	 * is at least one key of the requested type on the token */
+	rv = isPrivate ?
+		PKCS11_enumerate_keys(tok, &keys, &key_count) :
+		PKCS11_enumerate_public_keys(tok, &keys, &key_count);
+	if (rv) {
+		ctx_log(ctx, 0, "Unable to enumerate %s keys\n", key_type);
 		return 0;
 	}
-	return match_key(ctx, "public", keys, key_count, obj_id, obj_id_len, obj_label);
+	return match_key(ctx, key_type, keys, key_count, obj_id, obj_id_len, obj_label);
+}
+
+static void *match_public_key(ENGINE_CTX *ctx, PKCS11_TOKEN *tok,
+		const unsigned char *obj_id, size_t obj_id_len, const char *obj_label)
+{
+	return match_key_type(ctx, tok, 0, obj_id, obj_id_len, obj_label);
 }
 
 static void *match_private_key(ENGINE_CTX *ctx, PKCS11_TOKEN *tok,
 		const unsigned char *obj_id, size_t obj_id_len, const char *obj_label)
 {
-	PKCS11_KEY *keys;
-	unsigned int key_count;
+	return match_key_type(ctx, tok, 1, obj_id, obj_id_len, obj_label);
+}
 
-	/* Make sure there is at least one private key on the token */
-	if (PKCS11_enumerate_keys(tok, &keys, &key_count)) {
-		ctx_log(ctx, 0, "Unable to enumerate private keys\n");
-		return 0;
-	}
-	return match_key(ctx, "private", keys, key_count, obj_id, obj_id_len, obj_label);
+static void *export_public_key(void *key)
+{
+	return PKCS11_get_public_key(key);
+}
+
+static void *export_private_key(void *key)
+{
+	return PKCS11_get_private_key(key);
 }
 
 EVP_PKEY *ctx_load_pubkey(ENGINE_CTX *ctx, const char *s_key_id,
 		UI_METHOD *ui_method, void *callback_data)
 {
-	PKCS11_KEY *key;
-
-	key = ctx_load_object(ctx, "public key", match_public_key, s_key_id,
-		ui_method, callback_data);
-	if (!key) {
+	EVP_PKEY *pk;
+
+	ctx_preload_wait(ctx);
+	pk = cache_get(ctx->cache, CACHE_PUBKEY, s_key_id);
+	if (pk)
+		return pk;
+	pk = ctx_load_object(ctx, "public key", match_public_key,
+		export_public_key, s_key_id, ui_method, callback_data);
+	if (!pk) {
 		ctx_log(ctx, 0, "PKCS11_load_public_key returned NULL\n");
 		if (!ERR_peek_last_error())
 			ENGerr(ENG_F_CTX_LOAD_PUBKEY, ENG_R_OBJECT_NOT_FOUND);
 		return NULL;
 	}
-	return PKCS11_get_public_key(key);
+	cache_put(ctx->cache, CACHE_PUBKEY, s_key_id, pk);
+	return pk;
 }
 
 EVP_PKEY *ctx_load_privkey(ENGINE_CTX *ctx, const char *s_key_id,
 		UI_METHOD *ui_method, void *callback_data)
 {
-	PKCS11_KEY *key;
-
-	key = ctx_load_object(ctx, "private key", match_private_key, s_key_id,
-		ui_method, callback_data);
-	if (!key) {
+	EVP_PKEY *pk;
+
+	ctx_preload_wait(ctx);
+	pk = cache_get(ctx->cache, CACHE_PRIVKEY, s_key_id);
+	if (pk)
+		return pk;
+	pk = ctx_load_object(ctx, "private key", match_private_key,
+		export_private_key, s_key_id, ui_method, callback_data);
+	if (!pk) {
 		ctx_log(ctx, 0, "PKCS11_get_private_key returned NULL\n");
 		if (!ERR_peek_last_error())
 			ENGerr(ENG_F_CTX_LOAD_PRIVKEY, ENG_R_OBJECT_NOT_FOUND);
 		return NULL;
 	}
-	return PKCS11_get_private_key(key);
+	cache_put(ctx->cache, CACHE_PRIVKEY, s_key_id, pk);
+	return pk;
+}
+
+/******************************************************************************/
+/* Secret key handling                                                        */
+/******************************************************************************/
+
+static void *match_secret_key(ENGINE_CTX *ctx, PKCS11_TOKEN *tok,
+		const unsigned char *obj_id, size_t obj_id_len, const char *obj_label)
+{
+	(void)ctx;
+	return PKCS11_cipher_new(tok, obj_label, obj_id, obj_id_len);
+}
+
+static void *export_secret_key(void *cipher)
+{
+	return cipher;
+}
+
+/*
+ * Open a cipher with the CIPHER_KEY secret key of the token, or if
+ * CIPHER_IMPORT is set, with the key imported into the first token
+ */
+PKCS11_CIPHER *ctx_cipher_new(ENGINE_CTX *ctx,
+		const unsigned char *key, size_t key_len)
+{
+	PKCS11_SLOT *slot;
+	PKCS11_CIPHER *cipher = NULL;
+
+	if (!ctx_cipher_enabled(ctx)) {
+		ENGerr(ENG_F_CTX_CIPHER_NEW, ENG_R_INVALID_PARAMETER);
+		return NULL;
+	}
+	ctx_preload_wait(ctx);
+	if (ctx->cipher_key) {
+		cipher = ctx_load_object(ctx, "secret key", match_secret_key,
+			export_secret_key, ctx->cipher_key,
+			ctx->ui_method, ctx->callback_data);
+	} else {
+		if (ctx_rdlock_libp11(ctx)) {
+			ENGerr(ENG_F_CTX_CIPHER_NEW, ENG_R_INVALID_PARAMETER);
+			return NULL;
+		}
+		ctx_rand_busy++;
+		slot = ctx_find_token(ctx);
+		if (slot)
+			cipher = PKCS11_cipher_import(slot->token, key, key_len);
+		ctx_rand_busy--;
+		pthread_rwlock_unlock(&ctx->rwlock);
+	}
+	if (!cipher && !ERR_peek_last_error())
+		ENGerr(ENG_F_CTX_CIPHER_NEW, ENG_R_OBJECT_NOT_FOUND);
+	return cipher;
+}
+
+/* The ciphers are only provided once a key source is configured */
+int ctx_cipher_enabled(ENGINE_CTX *ctx)
+{
+	return ctx->cipher_key || ctx->cipher_import;
+}
+
+/******************************************************************************/
+/* Random number generation                                                   */
+/******************************************************************************/
+
+/* The token bytes added to the OpenSSL generator with each reseed */
+#define RAND_MIX_SEED	32
+
+/* The first slot with a token generating random numbers, rwlock held */
+static PKCS11_SLOT *ctx_rand_slot(ENGINE_CTX *ctx)
+{
+	unsigned int n;
+
+	for (n = 0; n < ctx->slot_count; n++)
+		if (ctx->slot_list[n]->token && ctx->slot_list[n]->token->hasRng)
+			return ctx->slot_list[n];
+	return NULL;
+}
+
+/*
+ * Acquire the read lock for generating random numbers
+ * Waiting for rwlock could deadlock with a slot update waiting for
+ * a PKCS#11 call that requests random numbers, so OpenSSL generates them
+ * while the slots are updated.  Only the delayed libp11 initialization
+ * is waited for.
+ */
+static int ctx_rand_rdlock(ENGINE_CTX *ctx)
+{
+	if (pthread_rwlock_tryrdlock(&ctx->rwlock))
+		return -1;
+	if (ctx->modules && ctx->slot_list)
+		return 0;
+	pthread_rwlock_unlock(&ctx->rwlock);
+	if (!ctx->module)
+		return -1;
+	return ctx_rdlock_libp11(ctx);
+}
+
+/*
+ * Generate random numbers with the token
+ * Returns 1 on success, 0 on error, or -1 if no token is available
+ */
+static int ctx_rand_token(ENGINE_CTX *ctx, unsigned char *buf, int num)
+{
+	PKCS11_SLOT *slot;
+	int rv = -1;
+
+	if (ctx_rand_busy || num < 0)
+		return -1;
+	ERR_set_mark();
+	if (ctx_rand_rdlock(ctx) == 0) {
+		ctx_rand_busy++;
+		slot = ctx_rand_slot(ctx);
+		if (slot)
+			rv = PKCS11_generate_random(slot, buf, (unsigned int)num) ? 0 : 1;
+		ctx_rand_busy--;
+		pthread_rwlock_unlock(&ctx->rwlock);
+	}
+	if (rv < 0) /* Not an error, OpenSSL generates the numbers instead */
+		ERR_pop_to_mark();
+	else
+		ERR_clear_last_mark();
+	return rv;
+}
+
+/*
+ * Generate random numbers for the RAND_METHOD of the engine
+ * Without RAND_MIX, the numbers are generated by the token, or by OpenSSL
+ * if no token has a random number generator.  With RAND_MIX, they are
+ * generated by OpenSSL, which is reseeded with random numbers of the
+ * token after every RAND_MIX bytes.
+ */
+int ctx_rand_bytes(ENGINE_CTX *ctx, unsigned char *buf, int num)
+{
+	unsigned char seed[RAND_MIX_SEED];
+	int reseed = 0, rv;
+
+	if (ctx->rand_mix <= 0) {
+		rv = ctx_rand_token(ctx, buf, num);
+		if (rv >= 0)
+			return rv;
+		return RAND_OpenSSL()->bytes(buf, num);
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->rand_unmixed += num;
+	if (!ctx->rand_seeded || ctx->rand_unmixed >= ctx->rand_mix) {
+		ctx->rand_seeded = 1;
+		ctx->rand_unmixed = 0;
+		reseed = 1;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	if (reseed) {
+		if (ctx_rand_token(ctx, seed, sizeof seed) == 1)
+			RAND_OpenSSL()->add(seed, sizeof seed, (double)sizeof seed);
+		OPENSSL_cleanse(seed, sizeof seed);
+	}
+	return RAND_OpenSSL()->bytes(buf, num);
+}
+
+/* Whether the random numbers are generated by a token */
+int ctx_rand_status(ENGINE_CTX *ctx)
+{
+	int rv = 0;
+
+	if (ctx->rand_mix > 0 || ctx_rand_busy)
+		return 0;
+	ERR_set_mark();
+	if (ctx_rand_rdlock(ctx) == 0) {
+		rv = ctx_rand_slot(ctx) != NULL;
+		pthread_rwlock_unlock(&ctx->rwlock);
+	}
+	ERR_pop_to_mark();
+	return rv;
 }
 
 /******************************************************************************/
@@ -804,14 +1728,17 @@ static int ctx_ctrl_set_pin(ENGINE_CTX *ctx, const char *pin)
 
 	/* Copy the PIN. If the string cannot be copied, NULL
 	 * shall be returned and errno shall be set. */
+	pthread_mutex_lock(&ctx->login_lock);
 	ctx_destroy_pin(ctx);
 	ctx->pin = OPENSSL_strdup(pin);
 	if (!ctx->pin) {
+		pthread_mutex_unlock(&ctx->login_lock);
 		ENGerr(ENG_F_CTX_CTRL_SET_PIN, ERR_R_MALLOC_FAILURE);
 		errno = ENOMEM;
 		return 0;
 	}
 	ctx->pin_length = strlen(ctx->pin);
+	pthread_mutex_unlock(&ctx->login_lock);
 	return 1;
 }
 
@@ -827,6 +1754,124 @@ static int ctx_ctrl_set_quiet(ENGINE_CTX *ctx)
 	return 1;
 }
 
+static int ctx_ctrl_set_preload(ENGINE_CTX *ctx, const char *uris)
+{
+	pthread_mutex_lock(&ctx->lock);
+	OPENSSL_free(ctx->preload);
+	ctx->preload = uris ? OPENSSL_strdup(uris) : NULL;
+	pthread_mutex_unlock(&ctx->lock);
+	return 1;
+}
+
+static int ctx_ctrl_set_metadata(ENGINE_CTX *ctx, char **field,
+		const char *value)
+{
+	char *copy = NULL;
+	unsigned int n;
+
+	if (value) {
+		copy = OPENSSL_strdup(value);
+		if (!copy) {
+			ENGerr(ENG_F_CTX_ENGINE_CTRL, ERR_R_MALLOC_FAILURE);
+			return 0;
+		}
+	}
+	OPENSSL_free(*field);
+	*field = copy;
+	for (n = 0; n < ctx->module_count; n++)
+		if (PKCS11_CTX_set_metadata_cache(ctx->modules[n].pkcs11_ctx,
+				ctx->metadata_dir, ctx->metadata_generation)) {
+			ENGerr(ENG_F_CTX_ENGINE_CTRL, ERR_R_MALLOC_FAILURE);
+			return 0;
+		}
+	return 1;
+}
+
+static int ctx_ctrl_set_cipher_key(ENGINE_CTX *ctx, const char *uri)
+{
+	OPENSSL_free(ctx->cipher_key);
+	ctx->cipher_key = uri ? OPENSSL_strdup(uri) : NULL;
+	return 1;
+}
+
+static int ctx_ctrl_cipher_import(ENGINE_CTX *ctx)
+{
+	ctx->cipher_import = 1;
+	return 1;
+}
+
+static int ctx_ctrl_set_cipher_chunk(ENGINE_CTX *ctx, long size)
+{
+	unsigned int n;
+
+	if (size < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->cipher_chunk = (unsigned int)size;
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_CTX_set_cipher_chunk(ctx->modules[n].pkcs11_ctx,
+			ctx->cipher_chunk);
+	return 1;
+}
+
+static int ctx_ctrl_set_sign_chunk(ENGINE_CTX *ctx, long size)
+{
+	unsigned int n;
+
+	if (size < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->sign_chunk = (unsigned int)size;
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_CTX_set_sign_chunk(ctx->modules[n].pkcs11_ctx,
+			ctx->sign_chunk);
+	return 1;
+}
+
+static int ctx_ctrl_set_session_reserve(ENGINE_CTX *ctx, long count)
+{
+	unsigned int n;
+
+	if (count < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->session_reserve = (unsigned int)count;
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_CTX_set_session_reserve(ctx->modules[n].pkcs11_ctx,
+			ctx->session_reserve, ctx->starvation_limit);
+	return 1;
+}
+
+static int ctx_ctrl_set_starvation_limit(ENGINE_CTX *ctx, long count)
+{
+	unsigned int n;
+
+	if (count < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->starvation_limit = (unsigned int)count;
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_CTX_set_session_reserve(ctx->modules[n].pkcs11_ctx,
+			ctx->session_reserve, ctx->starvation_limit);
+	return 1;
+}
+
+/* The priority class applies to the calling thread only */
+static int ctx_ctrl_set_priority(ENGINE_CTX *ctx, long priority)
+{
+	(void)ctx;
+	if (priority < PKCS11_PRIORITY_HIGH || priority > PKCS11_PRIORITY_LOW ||
+			PKCS11_set_thread_priority((int)priority) < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	return 1;
+}
+
 static int ctx_ctrl_set_init_args(ENGINE_CTX *ctx, const char *init_args_orig)
 {
 	OPENSSL_free(ctx->init_args);
@@ -836,18 +1881,22 @@ static int ctx_ctrl_set_init_args(ENGINE_CTX *ctx, const char *init_args_orig)
 
 static int ctx_ctrl_set_user_interface(ENGINE_CTX *ctx, UI_METHOD *ui_method)
 {
+	unsigned int n;
+
 	ctx->ui_method = ui_method;
-	if (ctx->pkcs11_ctx) /* libp11 is already initialized */
-		PKCS11_set_ui_method(ctx->pkcs11_ctx,
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_set_ui_method(ctx->modules[n].pkcs11_ctx,
 			ctx->ui_method, ctx->callback_data);
 	return 1;
 }
 
 static int ctx_ctrl_set_callback_data(ENGINE_CTX *ctx, void *callback_data)
 {
+	unsigned int n;
+
 	ctx->callback_data = callback_data;
-	if (ctx->pkcs11_ctx) /* libp11 is already initialized */
-		PKCS11_set_ui_method(ctx->pkcs11_ctx,
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_set_ui_method(ctx->modules[n].pkcs11_ctx,
 			ctx->ui_method, ctx->callback_data);
 	return 1;
 }
@@ -858,9 +1907,253 @@ static int ctx_ctrl_force_login(ENGINE_CTX *ctx)
 	return 1;
 }
 
+static int ctx_ctrl_load_balance(ENGINE_CTX *ctx)
+{
+	ctx->load_balance = 1;
+	return 1;
+}
+
+static int ctx_ctrl_set_find_batch(ENGINE_CTX *ctx, long size)
+{
+	unsigned int n;
+
+	if (size < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->find_batch = (unsigned int)size;
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_CTX_set_find_batch(ctx->modules[n].pkcs11_ctx,
+			ctx->find_batch);
+	return 1;
+}
+
+static int ctx_ctrl_set_session_timeout(ENGINE_CTX *ctx, long timeout)
+{
+	unsigned int n;
+
+	ctx->session_timeout = timeout;
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_CTX_set_session_timeout(ctx->modules[n].pkcs11_ctx,
+			timeout);
+	return 1;
+}
+
+static int ctx_ctrl_set_session_prewarm(ENGINE_CTX *ctx, long count)
+{
+	unsigned int n;
+
+	if (count < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->session_prewarm = (unsigned int)count;
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_CTX_set_session_prewarm(ctx->modules[n].pkcs11_ctx,
+			ctx->session_prewarm);
+	return 1;
+}
+
+static int ctx_ctrl_set_enum_threads(ENGINE_CTX *ctx, long threads)
+{
+	unsigned int n;
+
+	if (threads < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->enum_threads = (unsigned int)threads;
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_CTX_set_enum_threads(ctx->modules[n].pkcs11_ctx,
+			ctx->enum_threads);
+	return 1;
+}
+
+static int ctx_ctrl_set_watch_slots(ENGINE_CTX *ctx, long interval)
+{
+	if (interval < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	pthread_mutex_lock(&ctx->lock);
+	ctx->watch_interval = interval;
+	if (!interval)
+		ctx_watch_stop_unlocked(ctx);
+	else if (ctx->watch_running)
+		pthread_cond_broadcast(&ctx->watch_cond); /* Use the new interval */
+	else
+		ctx_watch_start_unlocked(ctx);
+	pthread_mutex_unlock(&ctx->lock);
+	return 1;
+}
+
+static int ctx_ctrl_set_auth_pin_cache(ENGINE_CTX *ctx, long ttl)
+{
+	unsigned int n;
+
+	if (ttl < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->auth_pin_ttl = ttl;
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_CTX_set_auth_pin_cache(ctx->modules[n].pkcs11_ctx,
+			ctx->auth_pin_ttl, ctx->auth_pin_max_uses);
+	return 1;
+}
+
+static int ctx_ctrl_set_auth_pin_max_uses(ENGINE_CTX *ctx, long uses)
+{
+	unsigned int n;
+
+	if (uses < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->auth_pin_max_uses = (unsigned int)uses;
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_CTX_set_auth_pin_cache(ctx->modules[n].pkcs11_ctx,
+			ctx->auth_pin_ttl, ctx->auth_pin_max_uses);
+	return 1;
+}
+
+static int ctx_ctrl_set_rand_buffer(ENGINE_CTX *ctx, long size)
+{
+	unsigned int n;
+
+	if (size < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->rand_buffer = (unsigned int)size;
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_CTX_set_random_buffer(ctx->modules[n].pkcs11_ctx,
+			ctx->rand_buffer, ctx->rand_watermark);
+	return 1;
+}
+
+static int ctx_ctrl_set_rand_watermark(ENGINE_CTX *ctx, long watermark)
+{
+	unsigned int n;
+
+	if (watermark < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->rand_watermark = (unsigned int)watermark;
+	for (n = 0; n < ctx->module_count; n++)
+		PKCS11_CTX_set_random_buffer(ctx->modules[n].pkcs11_ctx,
+			ctx->rand_buffer, ctx->rand_watermark);
+	return 1;
+}
+
+static int ctx_ctrl_set_rand_mix(ENGINE_CTX *ctx, long bytes)
+{
+	if (bytes < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	pthread_mutex_lock(&ctx->lock);
+	ctx->rand_mix = bytes;
+	ctx->rand_unmixed = 0;
+	ctx->rand_seeded = 0;
+	pthread_mutex_unlock(&ctx->lock);
+	return 1;
+}
+
+static int ctx_ctrl_set_cache_ttl(ENGINE_CTX *ctx, long ttl)
+{
+	cache_set_ttl(ctx->cache, ttl);
+	return 1;
+}
+
+static const char *ctx_stats_ops[PKCS11_STATS_OPS] = {
+	"sign", "decrypt", "encrypt", "derive", "find", "verify"
+};
+
+static void ctx_print_latency(BIO *out, const unsigned long *latency)
+{
+	int i;
+
+	BIO_printf(out, " latency");
+	for (i = 0; i < PKCS11_STATS_BUCKETS; i++)
+		BIO_printf(out, "%c%lu", i ? ',' : ' ', latency[i]);
+	BIO_printf(out, "\n");
+}
+
+/*
+ * Print the statistics of the slots, one line per counter:
+ *   slot <id> op <name> calls <n> errors <n> latency <histogram>
+ *   slot <id> op <name> mechanism <CKM> calls <n> errors <n> latency <...>
+ *   slot <id> error <CKR> <reason> count <n>
+ *   slot <id> session_waits <n> latency <histogram>
+ *   slot <id> session_timeouts <n>
+ * latency[i] counts the calls shorter than 2^i microseconds.
+ * With several modules loaded, the lines start with "module <index> ",
+ * as the slot IDs of the modules may be the same.
+ */
+static void ctx_print_slot_stats(BIO *out, const char *prefix,
+		PKCS11_SLOT *slot)
+{
+	PKCS11_STATS stats;
+	unsigned long id = PKCS11_get_slotid_from_slot(slot);
+	unsigned int i;
+
+	if (PKCS11_get_stats(slot, &stats) < 0)
+		return;
+	for (i = 0; i < PKCS11_STATS_OPS; i++) {
+		BIO_printf(out, "%sslot %lu op %s calls %lu errors %lu",
+			prefix, id, ctx_stats_ops[i],
+			stats.ops[i].calls, stats.ops[i].errors);
+		ctx_print_latency(out, stats.ops[i].latency);
+	}
+	for (i = 0; i < stats.nmechs; i++) {
+		PKCS11_MECH_STATS *mech = stats.mechs + i;
+
+		BIO_printf(out, "%sslot %lu op %s mechanism 0x%lx calls %lu errors %lu",
+			prefix, id, ctx_stats_ops[mech->op], mech->mechanism,
+			mech->stats.calls, mech->stats.errors);
+		ctx_print_latency(out, mech->stats.latency);
+	}
+	for (i = 0; i < stats.nerrors; i++) {
+		const char *reason = ERR_reason_error_string(
+			ERR_PACK(ERR_get_CKR_code(), 0, stats.errors[i].rv));
+
+		BIO_printf(out, "%sslot %lu error 0x%lx \"%s\" count %lu\n",
+			prefix, id, stats.errors[i].rv, reason ? reason : "unknown",
+			stats.errors[i].count);
+	}
+	BIO_printf(out, "%sslot %lu session_waits %lu",
+		prefix, id, stats.session_waits);
+	ctx_print_latency(out, stats.session_wait_latency);
+	BIO_printf(out, "%sslot %lu session_timeouts %lu\n",
+		prefix, id, stats.session_timeouts);
+}
+
+static int ctx_ctrl_get_stats(ENGINE_CTX *ctx, BIO *out)
+{
+	ENGINE_MODULE *mod;
+	char prefix[32] = "";
+	unsigned int n, i;
+
+	if (!out) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ERR_R_PASSED_NULL_PARAMETER);
+		return 0;
+	}
+	pthread_rwlock_rdlock(&ctx->rwlock);
+	for (n = 0; n < ctx->module_count; n++) {
+		mod = ctx->modules + n;
+		if (ctx->module_count > 1)
+			BIO_snprintf(prefix, sizeof prefix, "module %u ", n);
+		for (i = 0; i < mod->slot_count; i++)
+			ctx_print_slot_stats(out, prefix, mod->slot_list + i);
+	}
+	pthread_rwlock_unlock(&ctx->rwlock);
+	return 1;
+}
+
 int ctx_engine_ctrl(ENGINE_CTX *ctx, int cmd, long i, void *p, void (*f)())
 {
-	(void)i; /* We don't currently take integer parameters */
 	(void)f; /* We don't currently take callback parameters */
 	/*int initialised = ((pkcs11_dso == NULL) ? 0 : 1); */
 	switch (cmd) {
@@ -885,7 +2178,55 @@ int ctx_engine_ctrl(ENGINE_CTX *ctx, int cmd, long i, void *p, void (*f)())
 	case CMD_FORCE_LOGIN:
 		return ctx_ctrl_force_login(ctx);
 	case CMD_RE_ENUMERATE:
-		return ctx_enumerate_slots(ctx, ctx->pkcs11_ctx);
+		return ctx_enumerate_slots(ctx);
+	case CMD_LOAD_BALANCE:
+		return ctx_ctrl_load_balance(ctx);
+	case CMD_FIND_BATCH:
+		return ctx_ctrl_set_find_batch(ctx, i);
+	case CMD_CACHE_TTL:
+		return ctx_ctrl_set_cache_ttl(ctx, i);
+	case CMD_GET_STATS:
+		return ctx_ctrl_get_stats(ctx, (BIO *)p);
+	case CMD_SESSION_TIMEOUT:
+		return ctx_ctrl_set_session_timeout(ctx, i);
+	case CMD_SESSION_PREWARM:
+		return ctx_ctrl_set_session_prewarm(ctx, i);
+	case CMD_ENUM_THREADS:
+		return ctx_ctrl_set_enum_threads(ctx, i);
+	case CMD_WATCH_SLOTS:
+		return ctx_ctrl_set_watch_slots(ctx, i);
+	case CMD_AUTH_PIN_CACHE:
+		return ctx_ctrl_set_auth_pin_cache(ctx, i);
+	case CMD_AUTH_PIN_MAX_USES:
+		return ctx_ctrl_set_auth_pin_max_uses(ctx, i);
+	case CMD_RAND_BUFFER:
+		return ctx_ctrl_set_rand_buffer(ctx, i);
+	case CMD_RAND_WATERMARK:
+		return ctx_ctrl_set_rand_watermark(ctx, i);
+	case CMD_RAND_MIX:
+		return ctx_ctrl_set_rand_mix(ctx, i);
+	case CMD_PRELOAD:
+		return ctx_ctrl_set_preload(ctx, (const char *)p);
+	case CMD_METADATA_CACHE:
+		return ctx_ctrl_set_metadata(ctx, &ctx->metadata_dir,
+			(const char *)p);
+	case CMD_METADATA_GENERATION:
+		return ctx_ctrl_set_metadata(ctx, &ctx->metadata_generation,
+			(const char *)p);
+	case CMD_CIPHER_KEY:
+		return ctx_ctrl_set_cipher_key(ctx, (const char *)p);
+	case CMD_CIPHER_CHUNK:
+		return ctx_ctrl_set_cipher_chunk(ctx, i);
+	case CMD_CIPHER_IMPORT:
+		return ctx_ctrl_cipher_import(ctx);
+	case CMD_SIGN_CHUNK:
+		return ctx_ctrl_set_sign_chunk(ctx, i);
+	case CMD_SESSION_RESERVE:
+		return ctx_ctrl_set_session_reserve(ctx, i);
+	case CMD_STARVATION_LIMIT:
+		return ctx_ctrl_set_starvation_limit(ctx, i);
+	case CMD_PRIORITY:
+		return ctx_ctrl_set_priority(ctx, i);
 	default:
 		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_UNKNOWN_COMMAND);
 		break;
@@ -0,0 +1,276 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Cache of the objects loaded with a PKCS#11 URI
+ *
+ * The cache maps a URI (without its PIN) to the EVP_PKEY or X509 object
+ * loaded with this URI.  Objects are shared by reference counting, so
+ * that loading the same URI again does not access the token.
+ */
+
+#include "engine.h"
+#include "p11_pthread.h"
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32) || defined(_WIN64)
+#define strncasecmp _strnicmp
+#endif
+
+#define CACHE_BUCKETS 64
+
+typedef struct st_cache_entry {
+	struct st_cache_entry *next;
+	unsigned long hash;
+	int type;
+	char *uri;
+	void *object;
+	time_t expires;
+} CACHE_ENTRY;
+
+struct st_engine_cache {
+	pthread_mutex_t lock;
+	CACHE_ENTRY *buckets[CACHE_BUCKETS];
+	long ttl;
+#ifndef _WIN32
+	pid_t pid;
+#endif
+};
+
+static void *cache_ref(int type, void *object)
+{
+	if (type == CACHE_CERT) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100003L && !defined(LIBRESSL_VERSION_NUMBER)
+		X509_up_ref(object);
+#else
+		CRYPTO_add(&((X509 *)object)->references, 1, CRYPTO_LOCK_X509);
+#endif
+	} else {
+#if OPENSSL_VERSION_NUMBER >= 0x10100003L && !defined(LIBRESSL_VERSION_NUMBER)
+		EVP_PKEY_up_ref(object);
+#else
+		CRYPTO_add(&((EVP_PKEY *)object)->references, 1, CRYPTO_LOCK_EVP_PKEY);
+#endif
+	}
+	return object;
+}
+
+static void cache_unref(int type, void *object)
+{
+	if (type == CACHE_CERT)
+		X509_free(object);
+	else
+		EVP_PKEY_free(object);
+}
+
+/* Remove the PIN from the URI, so that it is not kept in memory */
+static char *cache_normalize(const char *uri)
+{
+	char *norm, *out;
+	const char *p, *end;
+
+	norm = OPENSSL_malloc(strlen(uri) + 1);
+	if (!norm)
+		return NULL;
+	out = norm;
+	if (!strncasecmp(uri, "pkcs11:", 7)) {
+		memcpy(out, "pkcs11:", 7);
+		out += 7;
+		uri += 7;
+	}
+	for (p = uri; *p; p = end) {
+		/* Each attribute starts with its separator, if any */
+		end = p + 1;
+		while (*end && !strchr(";?&", *end))
+			end++;
+		if (!strncmp(*p && strchr(";?&", *p) ? p + 1 : p, "pin-value=", 10))
+			continue;
+		memcpy(out, p, end - p);
+		out += end - p;
+	}
+	*out = '\0';
+	return norm;
+}
+
+static unsigned long cache_hash(int type, const char *uri)
+{
+	unsigned long h = 2166136261UL ^ (unsigned long)type; /* FNV-1a */
+
+	while (*uri) {
+		h ^= (unsigned char)*uri++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+static void cache_flush_unlocked(ENGINE_CACHE *cache)
+{
+	CACHE_ENTRY *entry;
+	int i;
+
+	for (i = 0; i < CACHE_BUCKETS; i++) {
+		while ((entry = cache->buckets[i])) {
+			cache->buckets[i] = entry->next;
+			cache_unref(entry->type, entry->object);
+			OPENSSL_free(entry->uri);
+			OPENSSL_free(entry);
+		}
+	}
+}
+
+ENGINE_CACHE *cache_new(void)
+{
+	ENGINE_CACHE *cache;
+
+	cache = OPENSSL_malloc(sizeof(ENGINE_CACHE));
+	if (!cache)
+		return NULL;
+	memset(cache, 0, sizeof(ENGINE_CACHE));
+	pthread_mutex_init(&cache->lock, 0);
+	cache->ttl = -1;
+#ifndef _WIN32
+	cache->pid = getpid();
+#endif
+	return cache;
+}
+
+void cache_free(ENGINE_CACHE *cache)
+{
+	if (!cache)
+		return;
+	cache_flush_unlocked(cache);
+	pthread_mutex_destroy(&cache->lock);
+	OPENSSL_free(cache);
+}
+
+/* Remove all the objects from the cache */
+void cache_flush(ENGINE_CACHE *cache)
+{
+	if (!cache)
+		return;
+	pthread_mutex_lock(&cache->lock);
+	cache_flush_unlocked(cache);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Set the lifetime of cached objects in seconds, 0 disables the cache,
+ * and a negative value keeps the objects until the cache is flushed
+ * The objects cached with another lifetime are flushed. */
+void cache_set_ttl(ENGINE_CACHE *cache, long ttl)
+{
+	if (!cache)
+		return;
+	pthread_mutex_lock(&cache->lock);
+	if (ttl != cache->ttl)
+		cache_flush_unlocked(cache);
+	cache->ttl = ttl;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Return a new reference to the object loaded with the URI, or NULL */
+void *cache_get(ENGINE_CACHE *cache, int type, const char *uri)
+{
+	CACHE_ENTRY **prev, *entry;
+	unsigned long hash;
+	void *object = NULL;
+	char *norm;
+
+	if (!cache || !uri || !cache->ttl)
+		return NULL;
+	norm = cache_normalize(uri);
+	if (!norm)
+		return NULL;
+	hash = cache_hash(type, norm);
+
+	pthread_mutex_lock(&cache->lock);
+#ifndef _WIN32
+	/* Objects loaded by the parent process are reloaded after fork() */
+	if (cache->pid != getpid()) {
+		cache_flush_unlocked(cache);
+		cache->pid = getpid();
+	}
+#endif
+	prev = &cache->buckets[hash % CACHE_BUCKETS];
+	while ((entry = *prev)) {
+		if (entry->hash == hash && entry->type == type &&
+				!strcmp(entry->uri, norm)) {
+			if (entry->expires && entry->expires <= time(NULL)) {
+				*prev = entry->next;
+				cache_unref(entry->type, entry->object);
+				OPENSSL_free(entry->uri);
+				OPENSSL_free(entry);
+				break;
+			}
+			object = cache_ref(type, entry->object);
+			break;
+		}
+		prev = &entry->next;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	OPENSSL_free(norm);
+	return object;
+}
+
+/* Add a reference to the object loaded with the URI */
+void cache_put(ENGINE_CACHE *cache, int type, const char *uri, void *object)
+{
+	CACHE_ENTRY *entry, *old, **bucket;
+
+	if (!cache || !uri || !object || !cache->ttl)
+		return;
+	entry = OPENSSL_malloc(sizeof(CACHE_ENTRY));
+	if (!entry)
+		return;
+	memset(entry, 0, sizeof(CACHE_ENTRY));
+	entry->uri = cache_normalize(uri);
+	if (!entry->uri) {
+		OPENSSL_free(entry);
+		return;
+	}
+	entry->hash = cache_hash(type, entry->uri);
+	entry->type = type;
+
+	pthread_mutex_lock(&cache->lock);
+	bucket = &cache->buckets[entry->hash % CACHE_BUCKETS];
+	for (old = *bucket; old; old = old->next)
+		if (old->hash == entry->hash && old->type == type &&
+				!strcmp(old->uri, entry->uri))
+			break;
+	if (old) { /* Already added by another thread */
+		pthread_mutex_unlock(&cache->lock);
+		OPENSSL_free(entry->uri);
+		OPENSSL_free(entry);
+		return;
+	}
+	if (cache->ttl > 0)
+		entry->expires = time(NULL) + cache->ttl;
+	entry->object = cache_ref(type, object);
+	entry->next = *bucket;
+	*bucket = entry;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,514 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * AES ciphers of the engine
+ *
+ * The EVP_CIPHERs stream the data through the multi-part operations of
+ * the token.  Each EVP_CIPHER_CTX holds its own PKCS11_CIPHER, and thus
+ * its own session, from the key setup until it is freed.  The buffers of
+ * the caller are passed to the token as they are; only the additional
+ * authenticated data of GCM is kept until the operation is started.
+ */
+
+#include "engine.h"
+#include "p11_pthread.h"
+#include "pkcs11.h"
+#include <openssl/evp.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+
+#define CIPHER_BLOCK_LEN	16
+#define CIPHER_TAG_LEN	16
+
+typedef struct {
+	PKCS11_CIPHER *cipher;
+	unsigned char iv[EVP_MAX_IV_LENGTH];
+	size_t iv_len; /* 0 for the default length */
+	int iv_set;
+	unsigned char *aad;
+	size_t aad_len;
+	unsigned char tag[CIPHER_TAG_LEN];
+	size_t tag_len;
+	int started, finished;
+	size_t in_total, out_total; /* the difference is kept by the token */
+} CIPHER_DATA;
+
+static const struct {
+	int nid;
+	int key_len;
+	unsigned long mode;
+} cipher_types[] = {
+	{NID_aes_128_cbc, 16, EVP_CIPH_CBC_MODE},
+	{NID_aes_192_cbc, 24, EVP_CIPH_CBC_MODE},
+	{NID_aes_256_cbc, 32, EVP_CIPH_CBC_MODE},
+	{NID_aes_128_gcm, 16, EVP_CIPH_GCM_MODE},
+	{NID_aes_192_gcm, 24, EVP_CIPH_GCM_MODE},
+	{NID_aes_256_gcm, 32, EVP_CIPH_GCM_MODE},
+};
+
+#define CIPHER_COUNT	(sizeof cipher_types / sizeof cipher_types[0])
+
+static const int cipher_nids[CIPHER_COUNT] = {
+	NID_aes_128_cbc, NID_aes_192_cbc, NID_aes_256_cbc,
+	NID_aes_128_gcm, NID_aes_192_gcm, NID_aes_256_gcm,
+};
+
+/*
+ * The ciphers of each initialized engine, as cipher_init() only knows
+ * the engine of the EVP_CIPHER_CTX by the methods of its EVP_CIPHER
+ */
+typedef struct cipher_engine_st {
+	struct cipher_engine_st *next;
+	ENGINE *engine;
+	EVP_CIPHER *methods[CIPHER_COUNT];
+} CIPHER_ENGINE;
+
+static CIPHER_ENGINE *cipher_engines = NULL;
+
+/* Kept until the library is unloaded, as cipher_get_ctx() may still use it */
+static CRYPTO_RWLOCK *cipher_lock = NULL;
+static CRYPTO_ONCE cipher_lock_once = CRYPTO_ONCE_STATIC_INIT;
+
+/*
+ * Set while the thread uses the PKCS#11 module for a cipher, so that a
+ * module implementing AES with OpenSSL, which uses the engine when it is
+ * the default one, fails instead of recursing into the engine
+ */
+static P11_THREAD_LOCAL int cipher_busy = 0;
+
+static int cipher_gcm(EVP_CIPHER_CTX *evp)
+{
+	return EVP_CIPHER_CTX_mode(evp) == EVP_CIPH_GCM_MODE;
+}
+
+static size_t cipher_iv_len(EVP_CIPHER_CTX *evp, CIPHER_DATA *data)
+{
+	if (data->iv_len)
+		return data->iv_len;
+	return (size_t)EVP_CIPHER_iv_length(EVP_CIPHER_CTX_cipher(evp));
+}
+
+/* The context of the engine providing the EVP_CIPHER of the operation */
+static ENGINE_CTX *cipher_get_ctx(EVP_CIPHER_CTX *evp)
+{
+	const EVP_CIPHER *method = EVP_CIPHER_CTX_cipher(evp);
+	CIPHER_ENGINE *entry;
+	ENGINE *engine = NULL;
+	size_t n;
+
+	if (!cipher_lock || !CRYPTO_THREAD_read_lock(cipher_lock))
+		return NULL;
+	for (entry = cipher_engines; entry && !engine; entry = entry->next)
+		for (n = 0; n < CIPHER_COUNT; n++)
+			if (entry->methods[n] == method)
+				engine = entry->engine;
+	CRYPTO_THREAD_unlock(cipher_lock);
+	return engine ? engine_get_ctx(engine) : NULL;
+}
+
+/* Forget the operation in progress, which is abandoned by the next one */
+static void cipher_reset(CIPHER_DATA *data)
+{
+	if (data->aad)
+		OPENSSL_cleanse(data->aad, data->aad_len);
+	data->aad_len = 0;
+	data->tag_len = 0;
+	data->started = 0;
+	data->finished = 0;
+	data->in_total = 0;
+	data->out_total = 0;
+}
+
+static int cipher_init(EVP_CIPHER_CTX *evp, const unsigned char *key,
+		const unsigned char *iv, int enc)
+{
+	CIPHER_DATA *data = EVP_CIPHER_CTX_get_cipher_data(evp);
+	ENGINE_CTX *ctx;
+
+	(void)enc; /* EVP_CIPHER_CTX_encrypting() is used when started */
+	if (cipher_busy)
+		return 0;
+	if (key) {
+		ctx = cipher_get_ctx(evp);
+		if (!ctx)
+			return 0;
+		cipher_busy++;
+		PKCS11_cipher_free(data->cipher);
+		data->cipher = ctx_cipher_new(ctx, key,
+			(size_t)EVP_CIPHER_CTX_key_length(evp));
+		cipher_busy--;
+		if (!data->cipher)
+			return 0;
+	}
+	if (iv) {
+		memcpy(data->iv, iv, cipher_iv_len(evp, data));
+		data->iv_set = 1;
+	}
+	cipher_reset(data);
+	return 1;
+}
+
+/* Keep the additional authenticated data until the operation starts */
+static int cipher_add_aad(CIPHER_DATA *data,
+		const unsigned char *in, size_t inl)
+{
+	unsigned char *aad;
+
+	if (data->started)
+		return -1;
+	aad = OPENSSL_realloc(data->aad, data->aad_len + inl);
+	if (!aad)
+		return -1;
+	memcpy(aad + data->aad_len, in, inl);
+	data->aad = aad;
+	data->aad_len += inl;
+	return (int)inl;
+}
+
+static int cipher_start(EVP_CIPHER_CTX *evp, CIPHER_DATA *data)
+{
+	unsigned long mechanism;
+
+	if (!data->cipher || !data->iv_set)
+		return -1;
+	if (cipher_gcm(evp))
+		mechanism = CKM_AES_GCM;
+	else if (EVP_CIPHER_CTX_test_flags(evp, EVP_CIPH_NO_PADDING))
+		mechanism = CKM_AES_CBC;
+	else
+		mechanism = CKM_AES_CBC_PAD;
+	if (PKCS11_cipher_init(data->cipher, mechanism,
+			EVP_CIPHER_CTX_encrypting(evp),
+			data->iv, cipher_iv_len(evp, data),
+			data->aad, data->aad_len))
+		return -1;
+	data->started = 1;
+	return 0;
+}
+
+/*
+ * The token may keep any part of the data until the operation is
+ * finished, up to the length of the output buffer of the caller
+ */
+static int cipher_final(EVP_CIPHER_CTX *evp, CIPHER_DATA *data,
+		unsigned char *out)
+{
+	size_t withheld = data->in_total - data->out_total, len, n;
+	unsigned char *tail;
+
+	data->finished = 1;
+	if (!cipher_gcm(evp)) {
+		len = CIPHER_BLOCK_LEN;
+		if (PKCS11_cipher_final(data->cipher, out, &len))
+			return -1;
+		return (int)len;
+	}
+
+	if (!EVP_CIPHER_CTX_encrypting(evp)) {
+		/* The token expects the tag at the end of the ciphertext */
+		if (data->tag_len != CIPHER_TAG_LEN)
+			return -1;
+		n = withheld;
+		if (PKCS11_cipher_update(data->cipher,
+				data->tag, CIPHER_TAG_LEN, out, &n))
+			return -1;
+		len = withheld - n;
+		if (PKCS11_cipher_final(data->cipher, out + n, &len))
+			return -1;
+		return (int)(n + len);
+	}
+
+	/* The token appends the tag to the rest of the ciphertext */
+	len = withheld + CIPHER_TAG_LEN;
+	tail = OPENSSL_malloc(len);
+	if (!tail)
+		return -1;
+	if (PKCS11_cipher_final(data->cipher, tail, &len) ||
+			len < CIPHER_TAG_LEN) {
+		OPENSSL_free(tail);
+		return -1;
+	}
+	len -= CIPHER_TAG_LEN;
+	memcpy(out, tail, len);
+	memcpy(data->tag, tail + len, CIPHER_TAG_LEN);
+	data->tag_len = CIPHER_TAG_LEN;
+	OPENSSL_free(tail);
+	return (int)len;
+}
+
+static int cipher_update(EVP_CIPHER_CTX *evp, CIPHER_DATA *data,
+		unsigned char *out, const unsigned char *in, size_t inl)
+{
+	size_t len;
+
+	if (in && !out) {
+		/* The additional authenticated data */
+		if (!cipher_gcm(evp))
+			return -1;
+		return cipher_add_aad(data, in, inl);
+	}
+	if (!data->started && cipher_start(evp, data) < 0)
+		return -1;
+	if (!in)
+		return cipher_final(evp, data, out);
+
+	len = cipher_gcm(evp) ? inl : inl + CIPHER_BLOCK_LEN - 1;
+	if (PKCS11_cipher_update(data->cipher, in, inl, out, &len))
+		return -1;
+	data->in_total += inl;
+	data->out_total += len;
+	return (int)len;
+}
+
+static int cipher_do_cipher(EVP_CIPHER_CTX *evp, unsigned char *out,
+		const unsigned char *in, size_t inl)
+{
+	CIPHER_DATA *data = EVP_CIPHER_CTX_get_cipher_data(evp);
+	int rv;
+
+	if (cipher_busy || data->finished)
+		return -1;
+	cipher_busy++;
+	rv = cipher_update(evp, data, out, in, inl);
+	cipher_busy--;
+	return rv;
+}
+
+static int cipher_ctrl(EVP_CIPHER_CTX *evp, int type, int arg, void *ptr)
+{
+	CIPHER_DATA *data = EVP_CIPHER_CTX_get_cipher_data(evp);
+	CIPHER_DATA *copy;
+
+	switch (type) {
+#ifdef EVP_CTRL_GET_IVLEN
+	case EVP_CTRL_GET_IVLEN:
+		*(int *)ptr = (int)cipher_iv_len(evp, data);
+		return 1;
+#endif
+	case EVP_CTRL_AEAD_SET_IVLEN:
+		if (!cipher_gcm(evp) || arg <= 0 || arg > EVP_MAX_IV_LENGTH)
+			return 0;
+		data->iv_len = (size_t)arg;
+		data->iv_set = 0;
+		return 1;
+	case EVP_CTRL_AEAD_SET_TAG:
+		if (!cipher_gcm(evp) || EVP_CIPHER_CTX_encrypting(evp) ||
+				arg != CIPHER_TAG_LEN || !ptr)
+			return 0;
+		memcpy(data->tag, ptr, CIPHER_TAG_LEN);
+		data->tag_len = CIPHER_TAG_LEN;
+		return 1;
+	case EVP_CTRL_AEAD_GET_TAG:
+		if (!cipher_gcm(evp) || !EVP_CIPHER_CTX_encrypting(evp) ||
+				!data->finished || arg <= 0 ||
+				(size_t)arg > data->tag_len)
+			return 0;
+		memcpy(ptr, data->tag, (size_t)arg);
+		return 1;
+	case EVP_CTRL_COPY:
+		/* The state of the operation is kept by the session */
+		copy = EVP_CIPHER_CTX_get_cipher_data((EVP_CIPHER_CTX *)ptr);
+		if (copy) {
+			copy->cipher = NULL;
+			copy->aad = NULL;
+		}
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static int cipher_cleanup(EVP_CIPHER_CTX *evp)
+{
+	CIPHER_DATA *data = EVP_CIPHER_CTX_get_cipher_data(evp);
+
+	if (data) {
+		cipher_reset(data);
+		cipher_busy++;
+		PKCS11_cipher_free(data->cipher);
+		cipher_busy--;
+		OPENSSL_free(data->aad);
+		data->cipher = NULL;
+		data->aad = NULL;
+	}
+	return 1;
+}
+
+static void cipher_free_entry(CIPHER_ENGINE *entry)
+{
+	size_t n;
+
+	for (n = 0; n < CIPHER_COUNT; n++)
+		EVP_CIPHER_meth_free(entry->methods[n]);
+	OPENSSL_free(entry);
+}
+
+static EVP_CIPHER *cipher_new_method(int nid, int key_len, unsigned long mode)
+{
+	EVP_CIPHER *method;
+	int gcm = mode == EVP_CIPH_GCM_MODE;
+	unsigned long flags = mode | EVP_CIPH_FLAG_CUSTOM_CIPHER |
+		EVP_CIPH_ALWAYS_CALL_INIT | EVP_CIPH_CUSTOM_IV |
+		EVP_CIPH_CUSTOM_COPY;
+
+	if (gcm) {
+		flags |= EVP_CIPH_FLAG_AEAD_CIPHER;
+#ifdef EVP_CIPH_CUSTOM_IV_LENGTH
+		flags |= EVP_CIPH_CUSTOM_IV_LENGTH;
+#endif
+	}
+	method = EVP_CIPHER_meth_new(nid, gcm ? 1 : CIPHER_BLOCK_LEN, key_len);
+	if (!method)
+		return NULL;
+	if (!EVP_CIPHER_meth_set_iv_length(method, gcm ? 12 : CIPHER_BLOCK_LEN) ||
+			!EVP_CIPHER_meth_set_flags(method, flags) ||
+			!EVP_CIPHER_meth_set_init(method, cipher_init) ||
+			!EVP_CIPHER_meth_set_do_cipher(method, cipher_do_cipher) ||
+			!EVP_CIPHER_meth_set_ctrl(method, cipher_ctrl) ||
+			!EVP_CIPHER_meth_set_cleanup(method, cipher_cleanup) ||
+			!EVP_CIPHER_meth_set_impl_ctx_size(method,
+				sizeof(CIPHER_DATA))) {
+		EVP_CIPHER_meth_free(method);
+		return NULL;
+	}
+	return method;
+}
+
+/* The ENGINE_CIPHERS_PTR of the engine */
+int cipher_engine_ciphers(ENGINE *engine, const EVP_CIPHER **cipher,
+		const int **nids, int nid)
+{
+	ENGINE_CTX *ctx = engine_get_ctx(engine);
+	CIPHER_ENGINE *entry;
+	size_t n;
+
+	/* Not the default AES of OpenSSL until a key source is configured */
+	if (!ctx || !ctx_cipher_enabled(ctx)) {
+		if (!cipher) {
+			*nids = NULL;
+			return 0;
+		}
+		*cipher = NULL;
+		return 0;
+	}
+	if (!cipher) {
+		*nids = cipher_nids;
+		return (int)CIPHER_COUNT;
+	}
+	*cipher = NULL;
+	if (!cipher_lock || !CRYPTO_THREAD_read_lock(cipher_lock))
+		return 0;
+	for (entry = cipher_engines; entry; entry = entry->next)
+		if (entry->engine == engine)
+			break;
+	for (n = 0; entry && n < CIPHER_COUNT; n++)
+		if (cipher_types[n].nid == nid)
+			*cipher = entry->methods[n];
+	CRYPTO_THREAD_unlock(cipher_lock);
+	return *cipher != NULL;
+}
+
+static void cipher_lock_init(void)
+{
+	cipher_lock = CRYPTO_THREAD_lock_new();
+}
+
+/* Called by engine_init() with the engine lock held */
+void cipher_add_engine(ENGINE *engine)
+{
+	CIPHER_ENGINE *entry;
+	size_t n;
+
+	if (!CRYPTO_THREAD_run_once(&cipher_lock_once, cipher_lock_init) ||
+			!cipher_lock)
+		return;
+	for (entry = cipher_engines; entry; entry = entry->next)
+		if (entry->engine == engine)
+			return;
+	entry = OPENSSL_zalloc(sizeof(CIPHER_ENGINE));
+	if (!entry)
+		return;
+	entry->engine = engine;
+	for (n = 0; n < CIPHER_COUNT; n++)
+		entry->methods[n] = cipher_new_method(cipher_types[n].nid,
+			cipher_types[n].key_len, cipher_types[n].mode);
+	if (!CRYPTO_THREAD_write_lock(cipher_lock)) {
+		cipher_free_entry(entry);
+		return;
+	}
+	entry->next = cipher_engines;
+	cipher_engines = entry;
+	CRYPTO_THREAD_unlock(cipher_lock);
+}
+
+/*
+ * Called by engine_destroy() with the engine lock held, once none of
+ * the EVP_CIPHER_CTX holds a reference to the engine
+ */
+void cipher_remove_engine(ENGINE *engine)
+{
+	CIPHER_ENGINE **prev, *entry = NULL;
+
+	if (!cipher_lock || !CRYPTO_THREAD_write_lock(cipher_lock))
+		return;
+	for (prev = &cipher_engines; *prev; prev = &(*prev)->next) {
+		if ((*prev)->engine == engine) {
+			entry = *prev;
+			*prev = entry->next;
+			break;
+		}
+	}
+	CRYPTO_THREAD_unlock(cipher_lock);
+	if (entry)
+		cipher_free_entry(entry);
+}
+
+#else
+
+/* EVP_CIPHER_meth_new() is not available */
+int cipher_engine_ciphers(ENGINE *engine, const EVP_CIPHER **cipher,
+		const int **nids, int nid)
+{
+	(void)engine;
+	(void)nid;
+	if (!cipher) {
+		*nids = NULL;
+		return 0;
+	}
+	*cipher = NULL;
+	return 0;
+}
+
+void cipher_add_engine(ENGINE *engine)
+{
+	(void)engine;
+}
+
+void cipher_remove_engine(ENGINE *engine)
+{
+	(void)engine;
+}
+
+#endif
+
+/* vim: set noexpandtab: */
@@ -28,6 +28,7 @@ void ERR_ENG_error(int function, int reason, char *file, int line);
 /* Error codes for the ENG functions. */
 
 /* Function codes. */
+# define ENG_F_CTX_CIPHER_NEW                             108
 # define ENG_F_CTX_CTRL_LOAD_CERT                         102
 # define ENG_F_CTX_CTRL_SET_PIN                           106
 # define ENG_F_CTX_ENGINE_CTRL                            105
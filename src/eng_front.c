@@ -30,6 +30,10 @@
 
 static int pkcs11_idx = -1;
 
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+static int rand_atexit_set = 0;
+#endif
+
 /* The definitions for control commands specific to this engine */
 
 /* need to add function to pass in reader id? or user reader:key as key id string? */
@@ -41,7 +45,7 @@ static const ENGINE_CMD_DEFN engine_cmd_defns[] = {
 		ENGINE_CMD_FLAG_STRING},
 	{CMD_MODULE_PATH,
 		"MODULE_PATH",
-		"Specifies the path to the PKCS#11 module shared library",
+		"Specifies the path to the PKCS#11 module shared library, or a list of modules",
 		ENGINE_CMD_FLAG_STRING},
 	{CMD_PIN,
 		"PIN",
@@ -79,9 +83,185 @@ static const ENGINE_CMD_DEFN engine_cmd_defns[] = {
 		"RE_ENUMERATE",
 		"re enumerate slots",
 		ENGINE_CMD_FLAG_NO_INPUT},
+	{CMD_LOAD_BALANCE,
+		"LOAD_BALANCE",
+		"Distribute private key operations over all matching tokens",
+		ENGINE_CMD_FLAG_NO_INPUT},
+	{CMD_FIND_BATCH,
+		"FIND_BATCH",
+		"Number of object handles retrieved with each C_FindObjects() call",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_CACHE_TTL,
+		"CACHE_TTL",
+		"Lifetime in seconds of the objects cached by URI (0 disables the cache)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_GET_STATS,
+		"GET_STATS",
+		"Print the statistics of the PKCS#11 calls to a BIO",
+		ENGINE_CMD_FLAG_INTERNAL},
+	{CMD_SESSION_TIMEOUT,
+		"SESSION_TIMEOUT",
+		"Maximum time in milliseconds to wait for a session (negative waits forever)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_SESSION_PREWARM,
+		"SESSION_PREWARM",
+		"Number of sessions opened in advance when logging in",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_ENUM_THREADS,
+		"ENUM_THREADS",
+		"Number of slots initialized concurrently when enumerating the slots",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_WATCH_SLOTS,
+		"WATCH_SLOTS",
+		"Interval in milliseconds between the checks for inserted or removed tokens (0 = never)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_AUTH_PIN_CACHE,
+		"AUTH_PIN_CACHE",
+		"Lifetime in seconds of the cached context-specific PINs (0 = no caching)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_AUTH_PIN_MAX_USES,
+		"AUTH_PIN_MAX_USES",
+		"Number of operations a cached context-specific PIN is used for (0 = unlimited)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_RAND_BUFFER,
+		"RAND_BUFFER",
+		"Number of random bytes generated in advance for each slot (0 = no buffering)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_RAND_WATERMARK,
+		"RAND_WATERMARK",
+		"Number of buffered random bytes below which the buffer is refilled (0 = half the buffer)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_RAND_MIX,
+		"RAND_MIX",
+		"Number of random bytes generated by OpenSSL between the reseeds with the token (0 = use the token directly)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_PRELOAD,
+		"PRELOAD",
+		"Initialize the modules in the background at ENGINE_init(), and load the listed private key URIs",
+		ENGINE_CMD_FLAG_STRING},
+	{CMD_METADATA_CACHE,
+		"METADATA_CACHE",
+		"Directory of the files caching the keys and certificates of the tokens",
+		ENGINE_CMD_FLAG_STRING},
+	{CMD_METADATA_GENERATION,
+		"METADATA_GENERATION",
+		"Version of the token contents, changed to invalidate the METADATA_CACHE files",
+		ENGINE_CMD_FLAG_STRING},
+	{CMD_CIPHER_KEY,
+		"CIPHER_KEY",
+		"PKCS#11 URI of the AES key used by the ciphers instead of the key passed to EVP_CipherInit_ex()",
+		ENGINE_CMD_FLAG_STRING},
+	{CMD_CIPHER_CHUNK,
+		"CIPHER_CHUNK",
+		"Maximum number of bytes passed to each multi-part cipher call (0 = no limit)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_SIGN_CHUNK,
+		"SIGN_CHUNK",
+		"Maximum number of bytes passed to each C_SignUpdate() call (0 = no limit)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_SESSION_RESERVE,
+		"SESSION_RESERVE",
+		"Number of sessions per slot reserved for the high-priority operations",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_STARVATION_LIMIT,
+		"STARVATION_LIMIT",
+		"Number of sessions granted to higher priorities before a waiting lower priority (0 = default)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_PRIORITY,
+		"PRIORITY",
+		"Priority of the operations of the calling thread (0 = high, 1 = normal, 2 = low)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_CIPHER_IMPORT,
+		"CIPHER_IMPORT",
+		"Import the keys passed to EVP_CipherInit_ex() into the token when CIPHER_KEY is not set",
+		ENGINE_CMD_FLAG_NO_INPUT},
 	{0, NULL, NULL, 0}
 };
 
+/* The seed is used by OpenSSL, also when the token generates the numbers */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static int rand_seed(const void *buf, int num)
+{
+	return RAND_OpenSSL()->seed(buf, num);
+}
+
+static int rand_add(const void *buf, int num, double entropy)
+{
+	return RAND_OpenSSL()->add(buf, num, entropy);
+}
+#else
+static void rand_seed(const void *buf, int num)
+{
+	RAND_OpenSSL()->seed(buf, num);
+}
+
+static void rand_add(const void *buf, int num, double entropy)
+{
+	RAND_OpenSSL()->add(buf, num, entropy);
+}
+#endif
+
+/*
+ * The RAND_METHOD has no engine parameter, and its callbacks may run while
+ * OpenSSL holds the engine lock, e.g. within the module of engine_init(),
+ * so its context is found with the engine initialized last rather than
+ * with ENGINE_get_default_RAND()
+ */
+static ENGINE *rand_engine = NULL;
+
+static ENGINE_CTX *rand_get_ctx(void)
+{
+	ENGINE *engine = rand_engine;
+
+	return engine ? engine_get_ctx(engine) : NULL;
+}
+
+static int rand_bytes(unsigned char *buf, int num)
+{
+	ENGINE_CTX *ctx = rand_get_ctx();
+
+	if (!ctx)
+		return RAND_OpenSSL()->bytes(buf, num);
+	return ctx_rand_bytes(ctx, buf, num);
+}
+
+static int rand_status(void)
+{
+	ENGINE_CTX *ctx = rand_get_ctx();
+
+	if (ctx && ctx_rand_status(ctx))
+		return 1;
+	return RAND_OpenSSL()->status();
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+/* Stop the buffer refills, which may use OpenSSL, before it is released */
+static void rand_atexit(void)
+{
+	ENGINE_CTX *ctx = rand_get_ctx();
+
+	if (ctx)
+		ctx_engine_ctrl(ctx, CMD_RAND_BUFFER, 0, NULL, NULL);
+}
+#endif
+
+static RAND_METHOD rand_method = {
+	rand_seed,
+	rand_bytes,
+	NULL,
+	rand_add,
+	rand_bytes,
+	rand_status
+};
+
+/* The context of an engine, without creating it */
+ENGINE_CTX *engine_get_ctx(ENGINE *engine)
+{
+	if (pkcs11_idx < 0)
+		return NULL;
+	return ENGINE_get_ex_data(engine, pkcs11_idx);
+}
+
 static ENGINE_CTX *get_ctx(ENGINE *engine)
 {
 	ENGINE_CTX *ctx;
@@ -122,6 +302,9 @@ static int engine_destroy(ENGINE *engine)
 	rv &= ctx_finish(ctx);
 #endif
 
+	if (rand_engine == engine)
+		rand_engine = NULL;
+	cipher_remove_engine(engine);
 	rv &= ctx_destroy(ctx);
 	ENGINE_set_ex_data(engine, pkcs11_idx, NULL);
 	ERR_unload_ENG_strings();
@@ -135,6 +318,12 @@ static int engine_init(ENGINE *engine)
 	ctx = get_ctx(engine);
 	if (!ctx)
 		return 0;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+	if (!rand_atexit_set)
+		rand_atexit_set = OPENSSL_atexit(rand_atexit);
+#endif
+	rand_engine = engine;
+	cipher_add_engine(engine);
 	return ctx_init(ctx);
 }
 
@@ -162,6 +351,8 @@ static int engine_finish(ENGINE *engine)
 #if OPENSSL_VERSION_NUMBER >= 0x10100005L && !defined(LIBRESSL_VERSION_NUMBER)
 	rv &= ctx_finish(ctx);
 #endif
+	if (rand_engine == engine)
+		rand_engine = NULL;
 
 	return rv;
 }
@@ -236,6 +427,8 @@ static int bind_helper(ENGINE *e)
 #endif
 #endif /* OPENSSL_VERSION_NUMBER */
 			!ENGINE_set_pkey_meths(e, PKCS11_pkey_meths) ||
+			!ENGINE_set_RAND(e, &rand_method) ||
+			!ENGINE_set_ciphers(e, cipher_engine_ciphers) ||
 			!ENGINE_set_load_pubkey_function(e, load_pubkey) ||
 			!ENGINE_set_load_privkey_function(e, load_privkey)) {
 		return 0;
@@ -39,8 +39,13 @@
 #include <openssl/crypto.h>
 #include <openssl/objects.h>
 #include <openssl/engine.h>
+#include <openssl/rand.h>
 #include <openssl/ui.h>
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define RAND_OpenSSL RAND_SSLeay
+#endif
+
 #define CMD_SO_PATH		ENGINE_CMD_BASE
 #define CMD_MODULE_PATH 	(ENGINE_CMD_BASE+1)
 #define CMD_PIN		(ENGINE_CMD_BASE+2)
@@ -52,8 +57,37 @@
 #define CMD_SET_CALLBACK_DATA	(ENGINE_CMD_BASE + 8)
 #define CMD_FORCE_LOGIN	(ENGINE_CMD_BASE+9)
 #define CMD_RE_ENUMERATE	(ENGINE_CMD_BASE+10)
+#define CMD_LOAD_BALANCE	(ENGINE_CMD_BASE+11)
+#define CMD_FIND_BATCH	(ENGINE_CMD_BASE+12)
+#define CMD_CACHE_TTL	(ENGINE_CMD_BASE+13)
+#define CMD_GET_STATS	(ENGINE_CMD_BASE+14)
+#define CMD_SESSION_TIMEOUT	(ENGINE_CMD_BASE+15)
+#define CMD_SESSION_PREWARM	(ENGINE_CMD_BASE+16)
+#define CMD_ENUM_THREADS	(ENGINE_CMD_BASE+17)
+#define CMD_WATCH_SLOTS	(ENGINE_CMD_BASE+18)
+#define CMD_AUTH_PIN_CACHE	(ENGINE_CMD_BASE+19)
+#define CMD_AUTH_PIN_MAX_USES	(ENGINE_CMD_BASE+20)
+#define CMD_RAND_BUFFER	(ENGINE_CMD_BASE+21)
+#define CMD_RAND_WATERMARK	(ENGINE_CMD_BASE+22)
+#define CMD_RAND_MIX	(ENGINE_CMD_BASE+23)
+#define CMD_PRELOAD	(ENGINE_CMD_BASE+24)
+#define CMD_METADATA_CACHE	(ENGINE_CMD_BASE+25)
+#define CMD_METADATA_GENERATION	(ENGINE_CMD_BASE+26)
+#define CMD_CIPHER_KEY	(ENGINE_CMD_BASE+27)
+#define CMD_CIPHER_CHUNK	(ENGINE_CMD_BASE+28)
+#define CMD_SIGN_CHUNK	(ENGINE_CMD_BASE+29)
+#define CMD_SESSION_RESERVE	(ENGINE_CMD_BASE+30)
+#define CMD_STARVATION_LIMIT	(ENGINE_CMD_BASE+31)
+#define CMD_PRIORITY	(ENGINE_CMD_BASE+32)
+#define CMD_CIPHER_IMPORT	(ENGINE_CMD_BASE+33)
+
+/* Types of cached objects */
+#define CACHE_PRIVKEY	0
+#define CACHE_PUBKEY	1
+#define CACHE_CERT	2
 
 typedef struct st_engine_ctx ENGINE_CTX; /* opaque */
+typedef struct st_engine_cache ENGINE_CACHE; /* opaque */
 
 /* defined in eng_back.c */
 
@@ -73,12 +107,51 @@ EVP_PKEY *ctx_load_pubkey(ENGINE_CTX *ctx, const char *s_key_id,
 EVP_PKEY *ctx_load_privkey(ENGINE_CTX *ctx, const char *s_key_id,
 	UI_METHOD * ui_method, void *callback_data);
 
+X509 *ctx_load_cert(ENGINE_CTX *ctx, const char *s_cert_id,
+	UI_METHOD * ui_method, void *callback_data);
+
+int ctx_rand_bytes(ENGINE_CTX *ctx, unsigned char *buf, int num);
+
+int ctx_rand_status(ENGINE_CTX *ctx);
+
+PKCS11_CIPHER *ctx_cipher_new(ENGINE_CTX *ctx,
+	const unsigned char *key, size_t key_len);
+
+int ctx_cipher_enabled(ENGINE_CTX *ctx);
+
 void ctx_log(ENGINE_CTX *ctx, int level, const char *format, ...)
 #ifdef __GNUC__
 	__attribute__((format(printf, 3, 4)))
 #endif
 	;
 
+/* defined in eng_cache.c */
+
+ENGINE_CACHE *cache_new(void);
+
+void cache_free(ENGINE_CACHE *cache);
+
+void cache_flush(ENGINE_CACHE *cache);
+
+void cache_set_ttl(ENGINE_CACHE *cache, long ttl);
+
+void *cache_get(ENGINE_CACHE *cache, int type, const char *uri);
+
+void cache_put(ENGINE_CACHE *cache, int type, const char *uri, void *object);
+
+/* defined in eng_cipher.c */
+
+int cipher_engine_ciphers(ENGINE *engine, const EVP_CIPHER **cipher,
+	const int **nids, int nid);
+
+void cipher_add_engine(ENGINE *engine);
+
+void cipher_remove_engine(ENGINE *engine);
+
+/* defined in eng_front.c */
+
+ENGINE_CTX *engine_get_ctx(ENGINE *engine);
+
 /* defined in eng_parse.c */
 
 int parse_pkcs11_uri(ENGINE_CTX *ctx,
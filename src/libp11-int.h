@@ -30,9 +30,57 @@
 #include "pkcs11.h"
 
 #include "p11_pthread.h"
+#include <time.h>
 
 /* get private implementations of PKCS11 structures */
 
+/*
+ * Work item for the context worker threads (see p11_async.c)
+ * It is meant to be embedded in a larger caller-owned structure.
+ */
+typedef struct pkcs11_task {
+	void (*run)(struct pkcs11_task *);
+	struct pkcs11_task *next;
+} PKCS11_TASK;
+
+/* Worker threads are only started on demand */
+#define PKCS11_MAX_WORKERS 32
+
+/* Initial capacity of the key and certificate arrays of a token */
+#define PKCS11_OBJECTS_MIN_ALLOC 16
+
+/* Default number of object handles per C_FindObjects() call */
+#define PKCS11_FIND_BATCH_DEFAULT 64
+
+/* Capacity of the session pools of a slot */
+#define PKCS11_MAX_SESSIONS 16
+
+/* Default limit of the read-write sessions of a slot */
+#define PKCS11_MAX_RW_SESSIONS 4
+
+/* Upper limit of the number of sessions used by a single batch */
+#define PKCS11_MAX_BATCH_LANES 32
+
+/* Surplus sessions are closed after this time without waits, in microseconds */
+#define PKCS11_SESSION_IDLE_TIME 60000000UL
+
+/* Number of PKCS11_PRIORITY_xxx classes of the session waiters */
+#define PKCS11_PRIORITIES 3
+
+/* Default number of sessions granted to higher priority classes while
+ * a lower one waits, before the lower one is served */
+#define PKCS11_STARVATION_LIMIT_DEFAULT 16
+
+/* Slot list replaced by pkcs11_update_slots(), kept while the operations
+ * in progress may still use its slots, see pkcs11_retire_slots() */
+typedef struct pkcs11_retired_slots {
+	struct pkcs11_retired_slots *next;
+	PKCS11_SLOT *slots;
+} PKCS11_RETIRED_SLOTS;
+
+/* Number of the most recently retired slot lists that are kept */
+#define PKCS11_RETIRED_SLOT_LISTS 4
+
 /*
  * PKCS11_CTX: context for a PKCS11 implementation
  */
@@ -44,36 +92,210 @@ typedef struct pkcs11_ctx_private {
 	void *ui_user_data;
 	unsigned int forkid;
 	pthread_mutex_t fork_lock;
+	unsigned int find_batch; /* object handles per C_FindObjects() call */
+	long session_timeout; /* milliseconds, negative waits forever */
+	unsigned int session_prewarm; /* sessions opened by PKCS11_login() */
+	unsigned int session_reserve; /* only used by PKCS11_PRIORITY_HIGH */
+	unsigned int starvation_limit; /* see pkcs11_session_turn() */
+	int lazy_x509; /* certificates decoded on first use */
+	int token_verify; /* signatures verified with C_Verify() */
+	unsigned int enum_threads; /* slots initialized concurrently */
+	unsigned int enum_flags; /* PKCS11_ENUM_xxx */
+	/* context-specific PINs cached per key, see p11_key.c */
+	pthread_mutex_t auth_pin_lock;
+	long auth_pin_ttl; /* seconds, 0 disables the cache */
+	unsigned int auth_pin_max_uses; /* 0 for unlimited */
+	/* random numbers buffered per slot, see p11_rand.c */
+	unsigned int rand_buffer_size; /* bytes, 0 disables the buffer */
+	unsigned int rand_watermark; /* refill level, 0 for half the buffer */
+	/* token metadata cache files, see p11_cache.c */
+	char *metadata_dir; /* NULL disables the cache */
+	char *metadata_generation;
+	pthread_mutex_t metadata_lock; /* held by the first enumerations */
+	unsigned int cipher_chunk; /* bytes per C_EncryptUpdate(), 0 for all */
+	unsigned int sign_chunk; /* bytes per C_SignUpdate(), 0 for all */
+	/* slots reinitialized by PKCS11_CTX_child_init() */
+	PKCS11_SLOT *fork_slots;
+	unsigned int fork_nslots;
+	/* lists replaced by pkcs11_update_slots(), the most recent first */
+	struct pkcs11_retired_slots *retired_slots;
+
+	/* worker threads */
+	pthread_mutex_t task_lock;
+	pthread_cond_t task_cond;
+	PKCS11_TASK *task_head, *task_tail;
+	unsigned int num_tasks, num_workers, idle_workers;
+	int workers_stopped;
+	pthread_t threads[PKCS11_MAX_WORKERS]; /* joined when stopped */
+	unsigned int num_threads;
 } PKCS11_CTX_private;
 #define PRIVCTX(ctx)		((PKCS11_CTX_private *) ((ctx)->_private))
 
+/* Claimed entries of the per-slot statistics, see p11_stats.c */
+typedef struct pkcs11_stats_mech {
+	unsigned long key; /* mechanism * PKCS11_STATS_OPS + op + 1, or 0 */
+	PKCS11_OP_STATS stats;
+} PKCS11_STATS_MECH;
+
+typedef struct pkcs11_stats_error {
+	unsigned long key; /* rv + 1, or 0 */
+	unsigned long count;
+} PKCS11_STATS_ERROR;
+
+typedef struct pkcs11_slot_stats {
+	PKCS11_OP_STATS ops[PKCS11_STATS_OPS];
+	PKCS11_STATS_MECH mechs[PKCS11_STATS_MECHS];
+	PKCS11_STATS_ERROR errors[PKCS11_STATS_ERRORS];
+	unsigned long session_waits;
+	unsigned long session_wait_latency[PKCS11_STATS_BUCKETS];
+	unsigned long session_timeouts;
+} PKCS11_SLOT_STATS;
+
+#define PKCS11_STATS_NO_MECHANISM ((CK_MECHANISM_TYPE)-1)
+
+/* Sessions of a slot opened in the same mode, see pkcs11_get_session() */
+typedef struct pkcs11_session_pool {
+	pthread_cond_t cond[PKCS11_PRIORITIES]; /* waiters of each class */
+	CK_SESSION_HANDLE *sessions; /* ring buffer of the idle sessions */
+	unsigned int head, tail, size;
+	unsigned int num_sessions, max_sessions;
+	unsigned int min_sessions; /* pre-opened sessions kept open */
+	unsigned long last_wait; /* pkcs11_stats_time() of the last wait */
+	/* lock-free per-thread session cache */
+	CK_SESSION_HANDLE *cache;
+	unsigned int cachesize, waiters;
+	/* waiting operations of each PKCS11_PRIORITY_xxx class */
+	unsigned int queued[PKCS11_PRIORITIES];
+	/* sessions granted to higher classes while the class was waiting */
+	unsigned int bypassed[PKCS11_PRIORITIES];
+} PKCS11_SESSION_POOL;
+
+/* Pool a session was opened for, see pkcs11_put_session() */
+typedef struct pkcs11_session_tag {
+	CK_SESSION_HANDLE session; /* CK_INVALID_HANDLE for an unused entry */
+	int pool; /* index in the pools of the slot, or -1 once closed */
+	unsigned int generation; /* of the pools when the session was opened */
+} PKCS11_SESSION_TAG;
+
+/* Entries of the session tags of a slot, more than the sessions of both pools */
+#define PKCS11_SESSION_TAGS (8 * PKCS11_MAX_SESSIONS)
+
+/* Random numbers generated in advance, see p11_rand.c */
+typedef struct pkcs11_rand_buffer {
+	PKCS11_TASK task; /* the refill queued on the worker threads */
+	PKCS11_SLOT *slot;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* signaled when a refill completes */
+	unsigned char *data; /* ring buffer of the random numbers */
+	unsigned char *block; /* output of C_GenerateRandom() */
+	unsigned int size, head, count;
+	int refilling;
+} PKCS11_RAND_BUFFER;
+
+/* Temporary objects destroyed before their sessions are reused */
+typedef struct pkcs11_destroy_entry {
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE object;
+} PKCS11_DESTROY_ENTRY;
+
+typedef struct pkcs11_destroy_queue {
+	PKCS11_TASK task; /* the destruction queued on the worker threads */
+	PKCS11_SLOT *slot;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* signaled when the queue is drained */
+	PKCS11_DESTROY_ENTRY *entries;
+	unsigned int count, size;
+	int running;
+} PKCS11_DESTROY_QUEUE;
+
+/* Mechanism reported by the token, see pkcs11_check_mechanism() */
+typedef struct pkcs11_mechanism_info {
+	CK_MECHANISM_TYPE type;
+	CK_FLAGS flags; /* PKCS11_MECHANISM_FLAGS_UNSET until queried */
+} PKCS11_MECHANISM_INFO;
+#define PKCS11_MECHANISM_FLAGS_UNSET ((CK_FLAGS)-1)
+
 typedef struct pkcs11_slot_private {
 	PKCS11_CTX *parent;
-	pthread_mutex_t lock;
-	pthread_cond_t cond;
+	pthread_mutex_t lock; /* protects both session pools */
 	int8_t rw_mode, logged_in;
 	CK_SLOT_ID id;
-	CK_SESSION_HANDLE *session_pool;
-	unsigned int session_head, session_tail, session_poolsize;
-	unsigned int num_sessions, max_sessions;
+	PKCS11_SESSION_POOL pools[2]; /* read-only and read-write sessions */
+	PKCS11_SESSION_TAG tags[PKCS11_SESSION_TAGS]; /* hashed by handle */
+	unsigned int generation; /* of the pools, see pkcs11_flush_sessions() */
+	int token_info_pending; /* C_GetTokenInfo() postponed */
 	unsigned int forkid;
+	PKCS11_SLOT_STATS stats;
+	PKCS11_RAND_BUFFER rand;
+	PKCS11_DESTROY_QUEUE destroy;
+	/* mechanisms of the token sorted by type, protected by lock */
+	PKCS11_MECHANISM_INFO *mechs;
+	CK_ULONG num_mechs;
+	int mechs_loaded;
 
 	/* options used in last PKCS11_login */
 	char *prev_pin;
 } PKCS11_SLOT_private;
 #define PRIVSLOT(slot)		((PKCS11_SLOT_private *) ((slot)->_private))
+/* All the sessions are read-write while the SO is logged in */
+#define SESSION_POOL(spriv, rw)	(&(spriv)->pools[(rw) || (spriv)->logged_in == 1])
 #define SLOT2CTX(slot)		(PRIVSLOT(slot)->parent)
 
+/* Hash index of the positions of objects in an array, see p11_index.c */
+typedef struct pkcs11_index_entry {
+	unsigned long hash;
+	unsigned int item; /* position + 1, or 0 for an empty entry */
+} PKCS11_INDEX_ENTRY;
+
+typedef struct pkcs11_index {
+	PKCS11_INDEX_ENTRY *entries;
+	unsigned int size, count;
+} PKCS11_INDEX;
+
+/* Memory released all at once, see p11_arena.c */
+typedef struct pkcs11_arena_chunk PKCS11_ARENA_CHUNK;
+
+typedef struct pkcs11_arena {
+	PKCS11_ARENA_CHUNK *chunks;
+} PKCS11_ARENA;
+
+/*
+ * The keys live in the arena and never move.  The contiguous array handed
+ * out by PKCS11_enumerate_keys() holds copies of them, and is relocated
+ * when it grows.
+ */
 typedef struct pkcs11_keys {
-	int num;
-	PKCS11_KEY *keys;
+	int num, alloc;
+	PKCS11_KEY *keys; /* copies of the keys, indexed by by_handle and by_id */
+	PKCS11_INDEX by_handle, by_id;
+	PKCS11_ARENA arena; /* keys, private data, labels and IDs */
 } PKCS11_keys;
 
+/* States of the metadata cache of a token */
+#define PKCS11_METADATA_NONE	0	/* not used yet */
+#define PKCS11_METADATA_DONE	1	/* loaded, saved, or not available */
+
+/* Object classes served from the metadata cache */
+#define PKCS11_METADATA_PRV	0x01
+#define PKCS11_METADATA_PUB	0x02
+#define PKCS11_METADATA_CERTS	0x04
+
+/* Objects of a token loaded from the metadata cache, see p11_cache.c */
+typedef struct pkcs11_metadata {
+	void *map; /* cache file contents referenced by the objects */
+	size_t size;
+	int state; /* PKCS11_METADATA_NONE or PKCS11_METADATA_DONE */
+	unsigned int cached; /* PKCS11_METADATA_xxx classes not searched */
+} PKCS11_METADATA;
+
 typedef struct pkcs11_token_private {
 	PKCS11_SLOT *parent;
 	PKCS11_keys prv, pub;
-	int ncerts;
+	int ncerts, certs_alloc;
 	PKCS11_CERT *certs;
+	PKCS11_INDEX certs_by_handle, certs_by_id;
+	PKCS11_ARENA certs_arena; /* private data, labels and IDs of the certs */
+	PKCS11_METADATA metadata;
 } PKCS11_TOKEN_private;
 #define PRIVTOKEN(token)	((PKCS11_TOKEN_private *) ((token)->_private))
 #define TOKEN2SLOT(token)	(PRIVTOKEN(token)->parent)
@@ -82,35 +304,99 @@ typedef struct pkcs11_token_private {
 typedef struct pkcs11_key_ops {
 	int type; /* EVP_PKEY_xxx */
 	EVP_PKEY *(*get_evp_key) (PKCS11_KEY *);
-	void (*update_ex_data) (PKCS11_KEY *);
 } PKCS11_KEY_ops;
 
+/* The maximum number of replicas of a single key */
+#define PKCS11_MAX_REPLICAS 16
+
+/* The same private key stored on another token */
+typedef struct pkcs11_key_replica {
+	PKCS11_SLOT *slot; /* NULL once its token was removed */
+	CK_OBJECT_HANDLE object;
+	unsigned int forkid;
+	unsigned int inflight;
+} PKCS11_KEY_REPLICA;
+
+/* Parameters of the private key operations, computed once when the
+ * key material is retrieved, so that they are not looked up again on
+ * every operation.  A zero size means they are not yet known. */
+typedef struct pkcs11_key_desc {
+	unsigned int size; /* RSA modulus or EC group order length in bytes */
+	unsigned int bits; /* RSA modulus or EC group order length in bits */
+	unsigned int sig_size; /* raw signature length in bytes */
+} PKCS11_KEY_DESC;
+
+/* CKA_MODULUS and CKA_PUBLIC_EXPONENT, or CKA_EC_PARAMS and CKA_EC_POINT */
+#define PKCS11_KEY_CACHED_ATTRS 2
+
 typedef struct pkcs11_key_private {
 	PKCS11_TOKEN *parent;
+	PKCS11_KEY *stable; /* the key at its address in the arena */
 	CK_OBJECT_HANDLE object;
 	CK_BBOOL always_authenticate;
-	unsigned char id[255];
+	unsigned char *id; /* the same bytes as the public id */
 	size_t id_len;
 	PKCS11_KEY_ops *ops;
 	unsigned int forkid;
+	/* load-balanced replicas, see pkcs11_private_op() */
+	PKCS11_KEY_REPLICA *replicas;
+	unsigned int num_replicas, inflight;
+	PKCS11_KEY_DESC desc;
+	/* (1 << PKCS11_OP_xxx) functions denied by the key attributes */
+	unsigned int denied;
+	int priority; /* PKCS11_PRIORITY_xxx + 1, 0 for the thread priority */
+	/* cached context-specific PIN, protected by auth_pin_lock */
+	char *auth_pin;
+	time_t auth_pin_expires;
+	unsigned int auth_pin_uses;
+	/* public components loaded from the metadata cache */
+	CK_ATTRIBUTE cached[PKCS11_KEY_CACHED_ATTRS];
+	unsigned int ncached;
+	int cached_checked; /* compared with the token by pkcs11_reload_key() */
 } PKCS11_KEY_private;
 #define PRIVKEY(key)		((PKCS11_KEY_private *) (key)->_private)
 #define KEY2SLOT(key)		TOKEN2SLOT(KEY2TOKEN(key))
 #define KEY2TOKEN(key)		(PRIVKEY(key)->parent)
 #define KEY2CTX(key)		TOKEN2CTX(KEY2TOKEN(key))
+#define KEY2STABLE(key)		(PRIVKEY(key)->stable)
 
 typedef struct pkcs11_cert_private {
 	PKCS11_TOKEN *parent;
 	CK_OBJECT_HANDLE object;
-	unsigned char id[255];
+	unsigned char *id; /* the same bytes as the public id */
 	size_t id_len;
 	unsigned int forkid;
+	const unsigned char *der; /* value loaded from the metadata cache */
+	size_t der_len;
 } PKCS11_CERT_private;
 #define PRIVCERT(cert)		((PKCS11_CERT_private *) (cert)->_private)
 #define CERT2SLOT(cert)		TOKEN2SLOT(CERT2TOKEN(cert))
 #define CERT2TOKEN(cert)	(PRIVCERT(cert)->parent)
 #define CERT2CTX(cert)		TOKEN2CTX(CERT2TOKEN(cert))
 
+/* Paged C_FindObjects() search holding a session, see p11_misc.c */
+typedef struct pkcs11_object_iter {
+	PKCS11_TOKEN *token;
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE *objs;
+	CK_ULONG batch, count, pos;
+	int function, active;
+} PKCS11_OBJECT_ITER;
+
+/* Only the current object is kept by the iterators */
+struct PKCS11_key_iter_st {
+	PKCS11_OBJECT_ITER objects;
+	CK_OBJECT_CLASS type;
+	PKCS11_KEY key;
+	PKCS11_KEY_private kpriv;
+};
+
+struct PKCS11_cert_iter_st {
+	PKCS11_OBJECT_ITER objects;
+	PKCS11_CERT cert;
+	PKCS11_CERT_private cpriv;
+};
+
 extern PKCS11_KEY_ops pkcs11_rsa_ops;
 extern PKCS11_KEY_ops *pkcs11_ec_ops;
 
@@ -129,11 +415,45 @@ extern PKCS11_KEY_ops *pkcs11_ec_ops;
 	PRIVCTX(ctx)->method->func_and_args
 extern int ERR_load_CKR_strings(void);
 
+/* Hash indexes of objects */
+extern unsigned long pkcs11_hash_handle(CK_OBJECT_HANDLE handle);
+extern unsigned long pkcs11_hash_bytes(const unsigned char *data, size_t len);
+extern int pkcs11_index_reserve(PKCS11_INDEX *index, unsigned int n);
+extern void pkcs11_index_insert(PKCS11_INDEX *index, unsigned long hash,
+	unsigned int item);
+extern int pkcs11_index_find(const PKCS11_INDEX *index, unsigned long hash,
+	int (*match)(const void *, unsigned int), const void *arg);
+extern void pkcs11_index_free(PKCS11_INDEX *index);
+extern void *pkcs11_arena_alloc(PKCS11_ARENA *arena, size_t len);
+extern void *pkcs11_arena_memdup(PKCS11_ARENA *arena, const void *data, size_t len);
+extern void pkcs11_arena_free(PKCS11_ARENA *arena);
+
 /* Memory allocation */
 #define PKCS11_DUP(s) \
 	pkcs11_strdup((char *) s, sizeof(s))
 extern char *pkcs11_strdup(char *, size_t);
 
+/* Search objects and call a function for each object found */
+/* Statistics of the PKCS#11 calls */
+extern unsigned long pkcs11_stats_time(void);
+extern void pkcs11_stats_record(PKCS11_SLOT *slot, int op,
+	CK_MECHANISM_TYPE mechanism, CK_RV rv, unsigned long start);
+extern void pkcs11_stats_wait(PKCS11_SLOT *slot, unsigned long start);
+extern void pkcs11_get_stats(PKCS11_SLOT *slot, PKCS11_STATS *stats);
+
+extern int pkcs11_check_object(PKCS11_CTX *ctx, CK_SESSION_HANDLE session,
+	CK_OBJECT_HANDLE object, CK_OBJECT_CLASS class,
+	const unsigned char *id, size_t id_len);
+extern int pkcs11_find_objects(PKCS11_TOKEN *, CK_SESSION_HANDLE,
+	CK_ATTRIBUTE *, CK_ULONG, int,
+	int (*)(PKCS11_TOKEN *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE, void *),
+	void *);
+extern int pkcs11_object_iter_init(PKCS11_OBJECT_ITER *iter,
+	PKCS11_TOKEN *token, CK_ATTRIBUTE *attrs, CK_ULONG nattrs, int function);
+extern int pkcs11_object_iter_next(PKCS11_OBJECT_ITER *iter,
+	CK_OBJECT_HANDLE *object);
+extern void pkcs11_object_iter_release(PKCS11_OBJECT_ITER *iter);
+
 /* Emulate the OpenSSL 1.1 getters */
 #if OPENSSL_VERSION_NUMBER < 0x10100003L || defined(LIBRESSL_VERSION_NUMBER)
 #define EVP_PKEY_get0_RSA(key) ((key)->pkey.rsa)
@@ -147,6 +467,9 @@ extern int check_slot_fork(PKCS11_SLOT *slot);
 extern int check_token_fork(PKCS11_TOKEN *token);
 extern int check_key_fork(PKCS11_KEY *key);
 extern int check_cert_fork(PKCS11_CERT *cert);
+extern void pkcs11_CTX_prepare_fork(PKCS11_CTX *ctx,
+	PKCS11_SLOT *slots, unsigned int nslots);
+extern int pkcs11_CTX_child_init(PKCS11_CTX *ctx);
 
 /* Other internal functions */
 extern void *C_LoadModule(const char *name, CK_FUNCTION_LIST_PTR_PTR);
@@ -154,9 +477,31 @@ extern CK_RV C_UnloadModule(void *module);
 extern void pkcs11_destroy_keys(PKCS11_TOKEN *, unsigned int);
 extern void pkcs11_destroy_certs(PKCS11_TOKEN *);
 extern int pkcs11_reload_key(PKCS11_KEY *);
+extern int pkcs11_reload_replica(PKCS11_KEY *, PKCS11_KEY_REPLICA *);
+extern void pkcs11_move_replicas(PKCS11_SLOT *slots, unsigned int nslots,
+	PKCS11_SLOT *from, PKCS11_SLOT *to);
 extern int pkcs11_reload_certificate(PKCS11_CERT *cert);
 extern int pkcs11_reload_slot(PKCS11_SLOT * slot);
 
+/* Token metadata cache */
+extern int pkcs11_metadata_enumerate(PKCS11_TOKEN *token, unsigned int type);
+extern void pkcs11_metadata_stale(PKCS11_TOKEN *token);
+extern void pkcs11_metadata_free(PKCS11_TOKEN *token);
+
+/* Buffered random numbers */
+extern void pkcs11_rand_init(PKCS11_SLOT *slot);
+extern void pkcs11_rand_free(PKCS11_SLOT *slot);
+extern void pkcs11_rand_reset(PKCS11_SLOT *slot);
+extern int pkcs11_rand_bytes(PKCS11_SLOT *slot, unsigned char *r, unsigned int len);
+
+/* Worker threads and OpenSSL ASYNC_JOB support */
+extern void pkcs11_workers_init(PKCS11_CTX *ctx);
+extern void pkcs11_workers_stop(PKCS11_CTX *ctx);
+extern void pkcs11_workers_restart(PKCS11_CTX *ctx);
+extern void pkcs11_workers_free(PKCS11_CTX *ctx);
+extern int pkcs11_task_submit(PKCS11_CTX *ctx, PKCS11_TASK *task);
+extern CK_RV pkcs11_async_call(PKCS11_CTX *ctx, CK_RV (*fn)(void *), void *arg);
+
 /* Managing object attributes */
 extern int pkcs11_getattr_var(PKCS11_CTX *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE,
 	CK_ATTRIBUTE_TYPE, CK_BYTE *, size_t *);
@@ -164,6 +509,9 @@ extern int pkcs11_getattr_val(PKCS11_CTX *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE,
 	CK_ATTRIBUTE_TYPE, void *, size_t);
 extern int pkcs11_getattr_alloc(PKCS11_CTX *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE,
 	CK_ATTRIBUTE_TYPE, CK_BYTE **, size_t *);
+extern int pkcs11_getattr_list(PKCS11_CTX *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE,
+	CK_ATTRIBUTE *, unsigned int);
+extern int pkcs11_attr_bn(const CK_ATTRIBUTE *, BIGNUM **);
 /*
  * Caution: the BIGNUM ** shall reference either a NULL pointer or a
  * pointer to a valid BIGNUM.
@@ -188,6 +536,53 @@ extern PKCS11_CTX *pkcs11_CTX_new(void);
 /* Specify any private PKCS#11 module initialization args, if necessary */
 extern void pkcs11_CTX_init_args(PKCS11_CTX * ctx, const char * init_args);
 
+/* Set the number of object handles retrieved with each C_FindObjects() call */
+extern void pkcs11_CTX_set_find_batch(PKCS11_CTX * ctx, unsigned int size);
+
+/* Retrieve and decode the certificates on first use */
+extern void pkcs11_CTX_set_lazy_x509(PKCS11_CTX * ctx, int lazy);
+
+/* Verify the signatures with the token instead of OpenSSL */
+extern void pkcs11_CTX_set_token_verify(PKCS11_CTX * ctx, int token);
+
+/* Set the number of slots initialized concurrently */
+extern void pkcs11_CTX_set_enum_threads(PKCS11_CTX * ctx, unsigned int threads);
+
+/* Set the PKCS11_ENUM_xxx slot enumeration flags */
+extern void pkcs11_CTX_set_enum_flags(PKCS11_CTX * ctx, unsigned int flags);
+
+/* Set the maximum time to wait for a session */
+extern void pkcs11_CTX_set_session_timeout(PKCS11_CTX * ctx, long timeout);
+
+/* Set the number of sessions opened by PKCS11_login() */
+extern void pkcs11_CTX_set_session_prewarm(PKCS11_CTX * ctx, unsigned int count);
+
+/* Reserve sessions for the high-priority operations */
+extern void pkcs11_CTX_set_session_reserve(PKCS11_CTX *ctx,
+	unsigned int reserve, unsigned int starvation_limit);
+
+/* Set the priority class of the operations of the calling thread */
+extern int pkcs11_set_thread_priority(int priority);
+
+/* Get the priority class of the operations of the calling thread */
+extern int pkcs11_get_thread_priority(void);
+
+/* Cache the context-specific PINs */
+extern void pkcs11_CTX_set_auth_pin_cache(PKCS11_CTX *ctx, long ttl,
+	unsigned int max_uses);
+extern void pkcs11_CTX_set_random_buffer(PKCS11_CTX *ctx, unsigned int size,
+	unsigned int watermark);
+
+/* Save the objects of the tokens in cache files */
+extern int pkcs11_CTX_set_metadata_cache(PKCS11_CTX *ctx, const char *dir,
+	const char *generation);
+
+/* Split the multi-part cipher input into chunks */
+extern void pkcs11_CTX_set_cipher_chunk(PKCS11_CTX *ctx, unsigned int size);
+
+/* Split the multi-part signature input into chunks */
+extern void pkcs11_CTX_set_sign_chunk(PKCS11_CTX *ctx, unsigned int size);
+
 /* Load a PKCS#11 module */
 extern int pkcs11_CTX_load(PKCS11_CTX * ctx, const char * ident);
 
@@ -206,13 +601,49 @@ extern int pkcs11_open_session(PKCS11_SLOT * slot, int rw);
 /* Acquire a session from the slot specific session pool */
 extern int pkcs11_get_session(PKCS11_SLOT * slot, int rw, CK_SESSION_HANDLE *sessionp);
 
+/* Get a session waiting at most timeout milliseconds, returns 1 on timeout */
+extern int pkcs11_get_session_timed(PKCS11_SLOT * slot, int rw,
+	CK_SESSION_HANDLE *sessionp, long timeout);
+
+/* Get a session for an operation of a PKCS11_PRIORITY_xxx class */
+extern int pkcs11_get_session_prio(PKCS11_SLOT *slot, int rw,
+	CK_SESSION_HANDLE *sessionp, long timeout, int priority);
+
+/* Get a session for an operation of a class within the session timeout */
+extern int pkcs11_get_session_class(PKCS11_SLOT *slot, int rw,
+	CK_SESSION_HANDLE *sessionp, int priority);
+
+/* Number of sessions available for operations of the given mode */
+extern unsigned int pkcs11_session_limit(PKCS11_SLOT *slot, int rw);
+
+/* Report a failure to acquire a session within the session timeout */
+extern void pkcs11_session_timeout(PKCS11_SLOT *slot);
+
+/* Open the sessions configured with pkcs11_CTX_set_session_prewarm() */
+extern void pkcs11_prewarm_sessions(PKCS11_SLOT *slot);
+
 /* Return a session the the slot specific session pool */
-extern void pkcs11_put_session(PKCS11_SLOT * slot, CK_SESSION_HANDLE session);
+extern void pkcs11_put_session(PKCS11_SLOT * slot, int rw, CK_SESSION_HANDLE session);
+
+/* Return a session after an operation, updating the cached login state */
+extern void pkcs11_put_session_rv(PKCS11_SLOT *slot, int rw,
+	CK_SESSION_HANDLE session, CK_RV rv);
+
+/* Destroy a temporary object, then return its read-only session */
+extern void pkcs11_destroy_later(PKCS11_SLOT *slot, CK_SESSION_HANDLE session,
+	CK_OBJECT_HANDLE object);
 
 /* Get a list of all slots */
 extern int pkcs11_enumerate_slots(PKCS11_CTX * ctx,
 			PKCS11_SLOT **slotsp, unsigned int *nslotsp);
 
+/* Reinitialize the slots whose token was inserted, removed or replaced */
+extern int pkcs11_update_slots(PKCS11_CTX * ctx,
+			PKCS11_SLOT **slotsp, unsigned int *nslotsp);
+
+/* Check for a slot event without blocking */
+extern int pkcs11_get_slot_event(PKCS11_CTX * ctx, unsigned long *slotid);
+
 /* Get the slot_id from a slot as it is stored in private */
 extern unsigned long pkcs11_get_slotid_from_slot(PKCS11_SLOT *slot);
 
@@ -220,6 +651,13 @@ extern unsigned long pkcs11_get_slotid_from_slot(PKCS11_SLOT *slot);
 extern void pkcs11_release_all_slots(PKCS11_CTX * ctx,
 			PKCS11_SLOT *slots, unsigned int nslots);
 
+/* Retrieve the token information postponed by PKCS11_ENUM_LAZY_TOKEN_INFO */
+extern int pkcs11_load_token_info(PKCS11_SLOT *slot);
+
+/* Check whether the token supports a mechanism for a CKF_xxx function */
+extern CK_RV pkcs11_check_mechanism(PKCS11_SLOT *slot,
+			CK_MECHANISM_TYPE type, CK_FLAGS function);
+
 /* Find the first slot with a token */
 extern PKCS11_SLOT *pkcs11_find_token(PKCS11_CTX * ctx,
 			PKCS11_SLOT *slots, unsigned int nslots);
@@ -235,15 +673,63 @@ extern int pkcs11_is_logged_in(PKCS11_SLOT * slot, int so, int * res);
 /* Authenticate to the card */
 extern int pkcs11_login(PKCS11_SLOT * slot, int so, const char *pin);
 
+/* Log in again as the user after the login state was lost */
+extern int pkcs11_relogin(PKCS11_SLOT *slot);
+
 /* De-authenticate from the card */
 extern int pkcs11_logout(PKCS11_SLOT * slot);
 
-/* Authenticate a private the key operation if needed */
-int pkcs11_authenticate(PKCS11_KEY *key, CK_SESSION_HANDLE session);
+/* Authenticate a private the key operation in a session of the slot */
+int pkcs11_authenticate(PKCS11_KEY *key, PKCS11_SLOT *slot,
+	CK_SESSION_HANDLE session);
+
+/* Single-part key operations performed by pkcs11_private_op() */
+#define PKCS11_OP_SIGN		0
+#define PKCS11_OP_DECRYPT	1
+#define PKCS11_OP_ENCRYPT	2
+#define PKCS11_OP_VERIFY	3	/* out is the signature to verify */
+#define PKCS11_OP_DERIVE	4	/* only checked by pkcs11_check_key_op() */
+
+/* Perform a private key operation in a pooled session */
+extern CK_RV pkcs11_private_op(PKCS11_KEY *key, int op, CK_MECHANISM *mechanism,
+	const unsigned char *in, CK_ULONG inlen,
+	unsigned char *out, CK_ULONG *outlen);
+
+/* Check whether the key and its token permit an operation */
+extern CK_RV pkcs11_check_key_op(PKCS11_KEY *key, int op,
+	CK_MECHANISM_TYPE mechanism);
+
+/* Verify a signature with the public key object of the token */
+extern int pkcs11_verify_token(PKCS11_KEY *key, CK_MECHANISM *mechanism,
+	const unsigned char *in, CK_ULONG inlen,
+	const unsigned char *sig, CK_ULONG siglen);
+
+/* Set the priority class of the operations with the key */
+extern int pkcs11_set_key_priority(PKCS11_KEY *key, int priority);
+
+/* Priority class of an operation with the key in the calling thread */
+extern int pkcs11_key_priority(PKCS11_KEY *key);
+
+/* Add a replica of the private key stored on another token */
+extern int pkcs11_add_key_replica(PKCS11_KEY *key, PKCS11_KEY *replica);
+
+/* Sign a vector of requests using multiple sessions */
+extern int pkcs11_sign_batch(PKCS11_KEY *key, unsigned long mechanism,
+	PKCS11_SIGN_REQ *reqs, unsigned int count);
 
 /* Get a list of keys associated with this token */
 extern int pkcs11_enumerate_keys(PKCS11_TOKEN *token, unsigned int type,
-	PKCS11_KEY **keys, unsigned int *nkeys);
+	const PKCS11_KEY *key_template, PKCS11_KEY **keys, unsigned int *nkeys);
+
+/* Add the keys found on the token, regardless of the metadata cache */
+extern int pkcs11_search_keys(PKCS11_TOKEN *token, unsigned int type,
+	const PKCS11_KEY *key_template);
+
+/* Iterate over the keys of the token without storing them */
+extern PKCS11_KEY_ITER *pkcs11_key_iter_new(PKCS11_TOKEN *token,
+	unsigned int type, const PKCS11_KEY *key_template);
+extern int pkcs11_key_iter_next(PKCS11_KEY_ITER *iter, PKCS11_KEY **key);
+extern void pkcs11_key_iter_free(PKCS11_KEY_ITER *iter);
 
 /* Remove a key from the token */
 extern int pkcs11_remove_key(PKCS11_KEY *key);
@@ -263,9 +749,22 @@ extern PKCS11_KEY *pkcs11_find_key(PKCS11_CERT *cert);
 /* Find the corresponding key (if any)  pub <-> priv base on ID */
 extern PKCS11_KEY *pkcs11_find_key_from_key(PKCS11_KEY *key);
 
-/* Get a list of all certificates associated with this token */
+/* Get a list of certificates associated with this token */
 extern int pkcs11_enumerate_certs(PKCS11_TOKEN *token,
-	PKCS11_CERT **certs, unsigned int *ncerts);
+	const PKCS11_CERT *cert_template, PKCS11_CERT **certs, unsigned int *ncerts);
+
+/* Add the certificates found on the token, regardless of the metadata cache */
+extern int pkcs11_search_certs(PKCS11_TOKEN *token,
+	const PKCS11_CERT *cert_template);
+
+/* Iterate over the certificates of the token without storing them */
+extern PKCS11_CERT_ITER *pkcs11_cert_iter_new(PKCS11_TOKEN *token,
+	const PKCS11_CERT *cert_template);
+extern int pkcs11_cert_iter_next(PKCS11_CERT_ITER *iter, PKCS11_CERT **cert);
+extern void pkcs11_cert_iter_free(PKCS11_CERT_ITER *iter);
+
+/* Get the X.509 certificate, retrieving it from the token on first use */
+extern X509 *pkcs11_get_x509(PKCS11_CERT *cert);
 
 /* Remove a certificate from the token */
 extern int pkcs11_remove_certificate(PKCS11_CERT *key);
@@ -298,6 +797,75 @@ extern int pkcs11_store_certificate(PKCS11_TOKEN * token, X509 * x509,
 		char *label, unsigned char *id, size_t id_len,
 		PKCS11_CERT **ret_cert);
 
+/* Generate or store a vector of keys and certificates concurrently */
+extern int pkcs11_provision_batch(PKCS11_TOKEN *token,
+	PKCS11_PROVISION_REQ *reqs, unsigned int count);
+
+/* Multi-part encryption and decryption with AES keys */
+extern PKCS11_CIPHER *pkcs11_cipher_new(PKCS11_TOKEN *token,
+	const char *label, const unsigned char *id, size_t id_len);
+extern PKCS11_CIPHER *pkcs11_cipher_import(PKCS11_TOKEN *token,
+	const unsigned char *key, size_t key_len);
+extern int pkcs11_cipher_init(PKCS11_CIPHER *cipher,
+	CK_MECHANISM_TYPE mechanism, int encrypt,
+	const unsigned char *iv, size_t iv_len,
+	const unsigned char *aad, size_t aad_len);
+extern int pkcs11_cipher_update(PKCS11_CIPHER *cipher,
+	const unsigned char *in, size_t in_len,
+	unsigned char *out, size_t *out_len);
+extern int pkcs11_cipher_final(PKCS11_CIPHER *cipher,
+	unsigned char *out, size_t *out_len);
+extern void pkcs11_cipher_free(PKCS11_CIPHER *cipher);
+
+/* Multi-part signing with hash-and-sign mechanisms, see p11_sign.c */
+typedef struct pkcs11_sign_st PKCS11_SIGN;
+extern CK_RV pkcs11_sign_init(PKCS11_KEY *key, CK_MECHANISM *mechanism,
+	PKCS11_SIGN **signp);
+extern CK_RV pkcs11_sign_update(PKCS11_SIGN *sign,
+	const unsigned char *in, size_t in_len);
+extern CK_RV pkcs11_sign_final(PKCS11_SIGN *sign,
+	unsigned char *sig, size_t *sig_len);
+extern void pkcs11_sign_free(PKCS11_SIGN *sign);
+
+/* Build the templates of an RSA key pair generated on the token */
+extern void pkcs11_keygen_templates(unsigned int bits,
+	const char *label, const unsigned char *id, size_t id_len,
+	CK_ATTRIBUTE *pubkey_attrs, unsigned int *n_pub,
+	CK_ATTRIBUTE *privkey_attrs, unsigned int *n_priv);
+
+/* Build the template of a key object, returns -1 if not supported */
+extern int pkcs11_key_create_template(CK_ATTRIBUTE *attrs, EVP_PKEY *pk,
+	CK_OBJECT_CLASS type, const char *label,
+	const unsigned char *id, size_t id_len);
+
+/* Build the template of a certificate object */
+extern unsigned int pkcs11_cert_create_template(CK_ATTRIBUTE *attrs,
+	X509 *x509, const char *label, const unsigned char *id, size_t id_len);
+
+/* Add a key created by this process without reading its attributes */
+extern int pkcs11_add_key(PKCS11_TOKEN *token, CK_OBJECT_HANDLE obj,
+	CK_OBJECT_CLASS type, CK_KEY_TYPE key_type, const char *label,
+	const unsigned char *id, size_t id_len, PKCS11_KEY **ret);
+
+/* Add a certificate created by this process without reading it back */
+extern int pkcs11_add_cert(PKCS11_TOKEN *token, CK_OBJECT_HANDLE obj,
+	X509 *x509, const char *label, const unsigned char *id, size_t id_len,
+	PKCS11_CERT **ret);
+
+/* Add the objects loaded from the metadata cache, without a handle yet */
+extern int pkcs11_add_cached_key(PKCS11_TOKEN *token, CK_OBJECT_CLASS type,
+	CK_KEY_TYPE key_type, const char *label,
+	const unsigned char *id, size_t id_len,
+	CK_BBOOL always_authenticate, unsigned int denied,
+	const CK_ATTRIBUTE *pub, unsigned int npub);
+extern int pkcs11_add_cached_cert(PKCS11_TOKEN *token, const char *label,
+	const unsigned char *id, size_t id_len,
+	const unsigned char *der, size_t der_len);
+
+/* Get the attributes of a key, from the metadata cache when loaded there */
+extern int pkcs11_key_getattr(PKCS11_KEY *key, CK_SESSION_HANDLE session,
+	CK_ATTRIBUTE *attrs, unsigned int n);
+
 /* Access the random number generator */
 extern int pkcs11_seed_random(PKCS11_SLOT *, const unsigned char *s, unsigned int s_len);
 extern int pkcs11_generate_random(PKCS11_SLOT *, unsigned char *r, unsigned int r_len);
@@ -323,11 +891,15 @@ extern int pkcs11_sign(int type,
 	const unsigned char *m, unsigned int m_len,
 	unsigned char *sigret, unsigned int *siglen, PKCS11_KEY * key);
 
-/* This function has never been implemented */
+/* Verify a PKCS#1 v1.5 RSA or an ECDSA signature */
 extern int pkcs11_verify(int type,
 	const unsigned char *m, unsigned int m_len,
 	unsigned char *signature, unsigned int siglen, PKCS11_KEY * key);
 
+/* Verify a DER-encoded ECDSA signature */
+extern int pkcs11_ecdsa_verify(const unsigned char *m, unsigned int m_len,
+	const unsigned char *signature, unsigned int siglen, PKCS11_KEY * key);
+
 /* Encrypts data using the private key */
 extern int pkcs11_private_encrypt(
 	int flen, const unsigned char *from,
@@ -338,6 +910,20 @@ extern int pkcs11_private_decrypt(
 	int flen, const unsigned char *from,
 	unsigned char *to, PKCS11_KEY * key, int padding);
 
+/* DER-encoded DigestInfo of a PKCS#1 v1.5 signature */
+extern int pkcs11_digest_info(int type, const unsigned char *m,
+	unsigned int m_len, unsigned char **der);
+
+#ifndef OPENSSL_NO_EC
+/* Derive an ECDH shared secret with the private key */
+extern int pkcs11_ecdh_compute_key(unsigned char **buf, size_t *buflen,
+	const EC_POINT *peer_point, const EC_KEY *ecdh, PKCS11_KEY *key);
+#endif
+
+/* PKCS#11 hash and MGF1 types of a digest, 0 if not supported */
+extern CK_MECHANISM_TYPE pkcs11_md2ckm(const EVP_MD *md);
+extern CK_RSA_PKCS_MGF_TYPE pkcs11_md2ckg(const EVP_MD *md);
+
 /* Retrieve PKCS11_KEY from an RSA key */
 extern PKCS11_KEY *pkcs11_get_ex_data_rsa(const RSA *rsa);
 
@@ -73,6 +73,15 @@ typedef struct PKCS11_cert_st {
 	void *_private;
 } PKCS11_CERT;
 
+/** Iterator over the keys of a token, see PKCS11_key_iter_new() */
+typedef struct PKCS11_key_iter_st PKCS11_KEY_ITER;
+
+/** Iterator over the certificates of a token, see PKCS11_cert_iter_new() */
+typedef struct PKCS11_cert_iter_st PKCS11_CERT_ITER;
+
+/** Multi-part encryption with a secret key, see PKCS11_cipher_new() */
+typedef struct PKCS11_cipher_st PKCS11_CIPHER;
+
 /** PKCS11 token: smart card or USB key */
 typedef struct PKCS11_token_st {
 	char *label;
@@ -112,6 +121,84 @@ typedef struct PKCS11_ctx_st {
 	void *_private;
 } PKCS11_CTX;
 
+/** PKCS11_sign_batch() request */
+typedef struct PKCS11_sign_req_st {
+	const unsigned char *tbs;	/**< data to be signed, e.g. a digest */
+	size_t tbslen;
+	unsigned char *sig;		/**< output buffer */
+	size_t siglen;			/**< size of sig, set to the signature length */
+	unsigned long rv;		/**< PKCS#11 return value of this request */
+} PKCS11_SIGN_REQ;
+
+/* Jobs of PKCS11_provision_batch() */
+#define PKCS11_PROVISION_GENERATE	0	/**< generate an RSA key pair */
+#define PKCS11_PROVISION_PRIVATE_KEY	1	/**< store pkey as a private key */
+#define PKCS11_PROVISION_PUBLIC_KEY	2	/**< store pkey as a public key */
+#define PKCS11_PROVISION_CERT	3	/**< store x509 */
+
+/** PKCS11_provision_batch() request */
+typedef struct PKCS11_provision_req_st {
+	int job;			/**< one of PKCS11_PROVISION_* */
+	unsigned int bits;		/**< modulus size of the generated key */
+	EVP_PKEY *pkey;			/**< key to be stored */
+	X509 *x509;			/**< certificate to be stored */
+	char *label;
+	unsigned char *id;
+	size_t id_len;
+	PKCS11_KEY *key;		/**< set to the new (private) key */
+	PKCS11_CERT *cert;		/**< set to the new certificate */
+	unsigned long rv;		/**< PKCS#11 return value of this request */
+} PKCS11_PROVISION_REQ;
+
+/* Operations recorded in PKCS11_STATS */
+#define PKCS11_STATS_SIGN	0	/**< C_Sign() */
+#define PKCS11_STATS_DECRYPT	1	/**< C_Decrypt() */
+#define PKCS11_STATS_ENCRYPT	2	/**< C_Encrypt() */
+#define PKCS11_STATS_DERIVE	3	/**< C_DeriveKey() */
+#define PKCS11_STATS_FIND	4	/**< C_FindObjects() */
+#define PKCS11_STATS_VERIFY	5	/**< C_Verify() */
+#define PKCS11_STATS_OPS	6
+
+#define PKCS11_STATS_BUCKETS	24	/**< latency histogram size */
+#define PKCS11_STATS_MECHS	16	/**< maximum number of mechanisms */
+#define PKCS11_STATS_ERRORS	16	/**< maximum number of error codes */
+
+/** Statistics of an operation */
+typedef struct PKCS11_op_stats_st {
+	unsigned long calls;
+	unsigned long errors;
+	/** latency[i] counts the calls shorter than 2^i microseconds,
+	 * the last entry counts the longer calls */
+	unsigned long latency[PKCS11_STATS_BUCKETS];
+} PKCS11_OP_STATS;
+
+/** Statistics of an operation with a mechanism */
+typedef struct PKCS11_mech_stats_st {
+	int op;				/**< PKCS11_STATS_xxx */
+	unsigned long mechanism;	/**< CKM_xxx */
+	PKCS11_OP_STATS stats;
+} PKCS11_MECH_STATS;
+
+/** Number of failed calls with an error code */
+typedef struct PKCS11_error_stats_st {
+	unsigned long rv;		/**< CKR_xxx */
+	unsigned long count;
+} PKCS11_ERROR_STATS;
+
+/** PKCS11_get_stats() snapshot of the statistics of a slot */
+typedef struct PKCS11_stats_st {
+	PKCS11_OP_STATS ops[PKCS11_STATS_OPS];
+	unsigned int nmechs;
+	PKCS11_MECH_STATS mechs[PKCS11_STATS_MECHS];
+	unsigned int nerrors;
+	PKCS11_ERROR_STATS errors[PKCS11_STATS_ERRORS];
+	/** waits for a session of the slot to become available */
+	unsigned long session_waits;
+	unsigned long session_wait_latency[PKCS11_STATS_BUCKETS];
+	/** operations failed after the session timeout */
+	unsigned long session_timeouts;
+} PKCS11_STATS;
+
 /**
  * Create a new libp11 context
  *
@@ -127,6 +214,253 @@ extern PKCS11_CTX *PKCS11_CTX_new(void);
  */
 extern void PKCS11_CTX_init_args(PKCS11_CTX * ctx, const char * init_args);
 
+/**
+ * Set the number of object handles retrieved with each C_FindObjects() call
+ *
+ * Larger batches reduce the number of round trips to network tokens
+ * when enumerating keys and certificates.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param size number of object handles, or 0 to restore the default
+ * @return none
+ */
+extern void PKCS11_CTX_set_find_batch(PKCS11_CTX * ctx, unsigned int size);
+
+/**
+ * Decode certificates on first use instead of when they are found
+ *
+ * The x509 field of the certificates returned by PKCS11_enumerate_certs()
+ * and the certificate iterators is then initially NULL, and the DER
+ * value is only retrieved from the token and decoded by PKCS11_get_x509().
+ * This saves most of the enumeration time of tokens with many
+ * certificates when only a few of them are used.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param lazy 1 to decode the certificates on first use, 0 to decode
+ *   them when they are found (the default)
+ * @return none
+ */
+extern void PKCS11_CTX_set_lazy_x509(PKCS11_CTX * ctx, int lazy);
+
+/**
+ * Verify the signatures with the token instead of OpenSSL
+ *
+ * By default PKCS11_verify() uses the public key components retrieved
+ * from the token, without a round trip to the token for every signature.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param token 1 to verify the signatures with C_Verify(), 0 to verify
+ *   them with OpenSSL (the default)
+ * @return none
+ */
+extern void PKCS11_CTX_set_token_verify(PKCS11_CTX * ctx, int token);
+
+/**
+ * Set the number of slots initialized concurrently by PKCS11_enumerate_slots()
+ *
+ * The C_GetSlotInfo() and C_GetTokenInfo() calls of the slots are then
+ * distributed over the context worker threads, which reduces the
+ * enumeration time of network HSMs exposing many partitions.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param threads number of slots initialized concurrently (at most 32),
+ *   or 0 to initialize them one at a time (the default)
+ * @return none
+ */
+extern void PKCS11_CTX_set_enum_threads(PKCS11_CTX * ctx, unsigned int threads);
+
+/* Flags of PKCS11_CTX_set_enum_flags() */
+#define PKCS11_ENUM_TOKEN_PRESENT	0x01	/**< only the slots with a token */
+#define PKCS11_ENUM_LAZY_TOKEN_INFO	0x02	/**< see PKCS11_load_token_info() */
+
+/**
+ * Select the slots and the token information retrieved by
+ * PKCS11_enumerate_slots()
+ *
+ * With PKCS11_ENUM_TOKEN_PRESENT the slots without a token are omitted.
+ * With PKCS11_ENUM_LAZY_TOKEN_INFO the C_GetTokenInfo() call of each
+ * token is postponed until the token is used, see PKCS11_load_token_info().
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param flags PKCS11_ENUM_xxx flags, or 0 for all the slots with the
+ *   token information retrieved up front (the default)
+ * @return none
+ */
+extern void PKCS11_CTX_set_enum_flags(PKCS11_CTX * ctx, unsigned int flags);
+
+/**
+ * Set the maximum time to wait for a session when all the sessions are busy
+ *
+ * An operation that cannot get a session in time fails with the
+ * P11_R_SESSION_TIMEOUT error, and the private key operations of keys
+ * with replicas use the replicas with a session available instead.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param timeout milliseconds, 0 to fail immediately, or a negative value
+ *   to wait until a session is available (the default)
+ * @return none
+ */
+extern void PKCS11_CTX_set_session_timeout(PKCS11_CTX * ctx, long timeout);
+
+/**
+ * Set the number of sessions opened in advance by PKCS11_login()
+ *
+ * The sessions are opened concurrently, so that the first operations
+ * do not pay for opening them.  The count is limited by the session
+ * counts reported by the token.  Surplus sessions opened on demand are
+ * closed again when they have not been needed for a while.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param count number of sessions per slot, 0 opens them on demand
+ *   (the default)
+ * @return none
+ */
+extern void PKCS11_CTX_set_session_prewarm(PKCS11_CTX * ctx, unsigned int count);
+
+/* Priority classes of the operations waiting for a session */
+#define PKCS11_PRIORITY_HIGH	0	/**< latency-critical operations */
+#define PKCS11_PRIORITY_NORMAL	1	/**< the default */
+#define PKCS11_PRIORITY_LOW	2	/**< bulk operations */
+
+/**
+ * Reserve sessions for the high-priority operations
+ *
+ * When all the sessions of a slot are busy, the waiting operations are
+ * served by priority class (see PKCS11_set_thread_priority() and
+ * PKCS11_set_key_priority()), and in no particular order within a class.
+ * A class still waiting after starvation_limit sessions were granted to
+ * higher classes is served next.  The reserved sessions are only used by
+ * PKCS11_PRIORITY_HIGH operations, so that they do not wait behind the
+ * other ones; at least one session of each slot remains usable by all.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param reserve number of sessions per slot, 0 reserves none
+ *   (the default)
+ * @param starvation_limit number of sessions granted to higher classes
+ *   while a lower class waits, 0 for the default of 16
+ * @return none
+ */
+extern void PKCS11_CTX_set_session_reserve(PKCS11_CTX *ctx,
+	unsigned int reserve, unsigned int starvation_limit);
+
+/**
+ * Set the priority class of the operations of the calling thread
+ *
+ * The class applies to all the contexts, except for the keys with
+ * a class set with PKCS11_set_key_priority().  It is passed on to the
+ * worker threads performing the operations of the thread.
+ * @param priority PKCS11_PRIORITY_HIGH, PKCS11_PRIORITY_NORMAL (the
+ *   default) or PKCS11_PRIORITY_LOW
+ * @return the previous class of the thread, or -1 if priority is invalid
+ */
+extern int PKCS11_set_thread_priority(int priority);
+
+/**
+ * Cache the context-specific PINs of the keys with CKA_ALWAYS_AUTHENTICATE
+ *
+ * Without the cache, the PIN is requested with the UI_METHOD of
+ * PKCS11_set_ui_method() for each private key operation.  A cached PIN
+ * is kept in the OpenSSL secure heap when it is available, and wiped
+ * after it expired, reached its use limit, or was rejected by the token,
+ * or when the key is released.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param ttl number of seconds a PIN is cached, 0 disables the cache
+ *   (the default)
+ * @param max_uses number of operations a PIN is used for, 0 for unlimited
+ * @return none
+ */
+extern void PKCS11_CTX_set_auth_pin_cache(PKCS11_CTX *ctx, long ttl,
+	unsigned int max_uses);
+
+/**
+ * Buffer the random numbers generated by the tokens
+ *
+ * The PKCS11_generate_random() requests of up to half the buffer size
+ * are served from a per-slot buffer, which a worker thread refills with
+ * a single C_GenerateRandom() call once fewer than watermark bytes are
+ * left.  The larger requests, and the requests made while the buffer is
+ * being refilled, are passed to the token.  The buffered bytes are wiped
+ * once consumed, and discarded after fork().  Disabling the buffer waits
+ * for the refills in progress.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param size number of bytes buffered per slot, 0 disables the buffer
+ *   (the default)
+ * @param watermark refill level in bytes, 0 for half the buffer size
+ * @return none
+ */
+extern void PKCS11_CTX_set_random_buffer(PKCS11_CTX *ctx, unsigned int size,
+	unsigned int watermark);
+
+/**
+ * Cache the keys and the certificates of the tokens in files
+ *
+ * The first enumeration of a token after the login lists all its keys
+ * and certificates, and saves their labels, IDs and public components,
+ * and the certificates, in a file of the directory named after the model,
+ * serial number and label of the token.  The next processes map the file
+ * instead of searching the token again, and only look up the object
+ * handle of each key and certificate by its CKA_ID when it is first used.
+ * The objects created on the token by other processes are therefore not
+ * found while the cache is valid: the host changes the generation string
+ * whenever it modifies the tokens.  An object that is no longer found on
+ * the token removes the cache file, and the next enumerations search the
+ * token.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param dir existing directory of the cache files, or NULL to disable
+ *   the cache (the default)
+ * @param generation the version of the token contents, or NULL
+ * @return 0 on success, -1 on memory allocation failure
+ */
+extern int PKCS11_CTX_set_metadata_cache(PKCS11_CTX *ctx, const char *dir,
+	const char *generation);
+
+/**
+ * Split the data passed to PKCS11_cipher_update() into chunks
+ *
+ * Each chunk is passed to the token with a separate C_EncryptUpdate() or
+ * C_DecryptUpdate() call, for the tokens limiting the size of the data
+ * of a single call.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param size maximum number of bytes per call, 0 to pass the data with
+ *   a single call (the default)
+ * @return none
+ */
+extern void PKCS11_CTX_set_cipher_chunk(PKCS11_CTX *ctx, unsigned int size);
+
+/**
+ * Split the data of the multi-part signatures into chunks
+ *
+ * EVP_DigestSignUpdate() with a private key of a token passes the data to
+ * the token with C_SignUpdate(), one call per chunk, when the engine
+ * EVP_PKEY_METHODs of PKCS11_pkey_meths() are used with a hash-and-sign
+ * mechanism of the token.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param size maximum number of bytes per call, 0 to pass the data with
+ *   a single call (the default)
+ * @return none
+ */
+extern void PKCS11_CTX_set_sign_chunk(PKCS11_CTX *ctx, unsigned int size);
+
+/**
+ * Prepare the context for fork()
+ *
+ * Waits for the operations in progress in the worker threads, and records
+ * the slots to be reinitialized by PKCS11_CTX_child_init() in the child
+ * processes.  Call it in the parent process before fork().
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param slots slots returned by PKCS11_enumerate_slots(), or NULL
+ * @param nslots number of slots
+ * @return none
+ */
+extern void PKCS11_CTX_prepare_fork(PKCS11_CTX * ctx,
+	PKCS11_SLOT * slots, unsigned int nslots);
+
+/**
+ * Reinitialize the context in a child process
+ *
+ * Logs in again, opens a session, and reloads the object handles of the
+ * slots recorded by PKCS11_CTX_prepare_fork(), so that this does not
+ * delay the first operation.  The slots are processed in parallel.
+ * Object handles still valid in the child process are not searched again.
+ * Without this call, everything is reloaded on first use.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_CTX_child_init(PKCS11_CTX * ctx);
+
 /**
  * Load a PKCS#11 module
  *
@@ -172,6 +506,39 @@ extern int PKCS11_open_session(PKCS11_SLOT * slot, int rw);
 extern int PKCS11_enumerate_slots(PKCS11_CTX * ctx,
 			PKCS11_SLOT **slotsp, unsigned int *nslotsp);
 
+/**
+ * Update a list of slots after tokens were inserted, removed or replaced
+ *
+ * Only the slots whose token changed are reinitialized: the keys and
+ * certificates of the other tokens, and the sessions of their slots,
+ * are kept.  A token is considered replaced when its label, serial
+ * number or initialization state changed.  The list is reallocated
+ * when slots appeared or disappeared, in which case the remaining
+ * slots move to the new list, while their tokens and keys stay at the
+ * same address.  The caller serializes the updates with any other use
+ * of the list.
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param slotsp pointer on a list of slots allocated by
+ *   PKCS11_enumerate_slots() or PKCS11_update_slots(), or on NULL
+ *   to enumerate the slots
+ * @param nslotsp size of the list
+ * @return the number of slots added, removed or with a changed token,
+ *   or -1 on error, in which case the list remains usable
+ */
+extern int PKCS11_update_slots(PKCS11_CTX * ctx,
+			PKCS11_SLOT **slotsp, unsigned int *nslotsp);
+
+/**
+ * Check for a slot event without blocking
+ *
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param slotid the slot where a token was inserted or removed
+ * @retval 1 an event occurred
+ * @retval 0 no event occurred
+ * @retval -1 error, including modules without C_WaitForSlotEvent()
+ */
+extern int PKCS11_get_slot_event(PKCS11_CTX * ctx, unsigned long *slotid);
+
 /**
  * Get the slot_id from a slot as it is stored in private
  *
@@ -180,6 +547,20 @@ extern int PKCS11_enumerate_slots(PKCS11_CTX * ctx,
  */
 extern unsigned long PKCS11_get_slotid_from_slot(PKCS11_SLOT *slotp);
 
+/**
+ * Get a snapshot of the statistics of the PKCS#11 calls made on a slot
+ *
+ * The statistics are recorded without locking, so the snapshot is not
+ * guaranteed to be consistent with the calls in progress.
+ * The error codes can be converted to strings with
+ * ERR_reason_error_string(ERR_PACK(ERR_get_CKR_code(), 0, rv)).
+ * @param slot slot returned by PKCS11_enumerate_slots()
+ * @param stats the returned statistics
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_get_stats(PKCS11_SLOT *slot, PKCS11_STATS *stats);
+
 /**
  * Free the list of slots allocated by PKCS11_enumerate_slots()
  *
@@ -190,6 +571,19 @@ extern unsigned long PKCS11_get_slotid_from_slot(PKCS11_SLOT *slotp);
 extern void PKCS11_release_all_slots(PKCS11_CTX * ctx,
 			PKCS11_SLOT *slots, unsigned int nslots);
 
+/**
+ * Retrieve the token information postponed by PKCS11_ENUM_LAZY_TOKEN_INFO
+ *
+ * The label, manufacturer, model, serialnr and flags of the token are
+ * only set once this function succeeds.  The token information is also
+ * retrieved on first use by PKCS11_find_token() and by the operations
+ * opening a session with the token.
+ * @param slot slot returned by PKCS11_enumerate_slots()
+ * @retval 0 success, or the slot has no token
+ * @retval -1 error
+ */
+extern int PKCS11_load_token_info(PKCS11_SLOT *slot);
+
 /**
  * Find the first slot with a token
  *
@@ -251,6 +645,24 @@ extern int PKCS11_logout(PKCS11_SLOT * slot);
 extern int PKCS11_enumerate_keys(PKCS11_TOKEN *,
 	PKCS11_KEY **, unsigned int *);
 
+/**
+ * Get a list of private keys associated with this token
+ *
+ * Only the keys matching the id and label of the template are searched
+ * on the token, which is faster than enumerating all the keys.
+ * The returned list also contains the keys found by previous calls.
+ *
+ * @param token token returned by PKCS11_find_token()
+ * @param key_template the id, id_len and label of the searched keys,
+ *   unset fields match any key
+ * @param keys the returned list of keys
+ * @param nkeys the number of keys in the list
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_enumerate_keys_ext(PKCS11_TOKEN *token,
+	const PKCS11_KEY *key_template, PKCS11_KEY **keys, unsigned int *nkeys);
+
 /* Remove the key from this token */
 extern int PKCS11_remove_key(PKCS11_KEY *);
 
@@ -258,6 +670,48 @@ extern int PKCS11_remove_key(PKCS11_KEY *);
 extern int PKCS11_enumerate_public_keys(PKCS11_TOKEN *,
 	PKCS11_KEY **, unsigned int *);
 
+/* Get a list of public keys matching a template, see PKCS11_enumerate_keys_ext() */
+extern int PKCS11_enumerate_public_keys_ext(PKCS11_TOKEN *token,
+	const PKCS11_KEY *key_template, PKCS11_KEY **keys, unsigned int *nkeys);
+
+/**
+ * Iterate over the private keys of a token without storing them
+ *
+ * The keys are retrieved from the token in batches as the iteration
+ * proceeds, so that processing can start at once and memory use does not
+ * depend on the number of keys.  A session of the slot is held until
+ * the last key was returned or the iterator is freed.
+ *
+ * @param token token returned by PKCS11_find_token()
+ * @param key_template the id, id_len and label of the searched keys,
+ *   or NULL to iterate over all the keys
+ * @return the iterator, or NULL on error
+ */
+extern PKCS11_KEY_ITER *PKCS11_key_iter_new(PKCS11_TOKEN *token,
+	const PKCS11_KEY *key_template);
+
+/* Iterate over the public keys of a token, see PKCS11_key_iter_new() */
+extern PKCS11_KEY_ITER *PKCS11_public_key_iter_new(PKCS11_TOKEN *token,
+	const PKCS11_KEY *key_template);
+
+/**
+ * Get the next key of a key iterator
+ *
+ * The returned key is only valid until the next call or until the
+ * iterator is freed.  Its label, id and type can be inspected, and the
+ * key can be obtained for cryptographic operations with
+ * PKCS11_enumerate_keys_ext() using its id.
+ *
+ * @param iter iterator returned by PKCS11_key_iter_new()
+ * @param key the returned key, NULL after the last key
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_key_iter_next(PKCS11_KEY_ITER *iter, PKCS11_KEY **key);
+
+/* Free a key iterator */
+extern void PKCS11_key_iter_free(PKCS11_KEY_ITER *iter);
+
 /* Get the key type (as EVP_PKEY_XXX) */
 extern int PKCS11_get_key_type(PKCS11_KEY *);
 
@@ -279,15 +733,135 @@ extern EVP_PKEY *PKCS11_get_private_key(PKCS11_KEY *key);
  */
 extern EVP_PKEY *PKCS11_get_public_key(PKCS11_KEY *key);
 
+/**
+ * Verify a PKCS#1 v1.5 RSA or a DER-encoded ECDSA signature of a digest
+ *
+ * The signature is verified by OpenSSL with the public key components,
+ * or with the matching public key object of the token if configured
+ * with PKCS11_CTX_set_token_verify().
+ *
+ * @param type NID of the digest algorithm (ignored for ECDSA)
+ * @param m digest
+ * @param m_len length of the digest
+ * @param signature signature to verify
+ * @param siglen length of the signature
+ * @param key private or public key object
+ * @retval 1 valid signature
+ * @retval 0 invalid signature
+ * @retval -1 error
+ */
+extern int PKCS11_verify(int type,
+	const unsigned char *m, unsigned int m_len,
+	unsigned char *signature, unsigned int siglen, PKCS11_KEY * key);
+
+/**
+ * Add a replica of a private key
+ *
+ * The replica is the same private key stored on another token, e.g. a
+ * cloned HSM partition, possibly in another context loading another
+ * PKCS#11 module.  Private key operations with the key are then directed
+ * to the key or replica with the fewest outstanding operations, failing
+ * over to the other ones on device errors.  The replicas are reinitialized
+ * after fork() with the context of the key locked, so if the keys of
+ * a context have replicas in another context, the keys of the other
+ * context must not have replicas in the first one.
+ *
+ * @param key private key object
+ * @param replica the same private key on another token
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_add_key_replica(PKCS11_KEY *key, PKCS11_KEY *replica);
+
+/**
+ * Set the priority class of the private key operations with a key
+ *
+ * See PKCS11_CTX_set_session_reserve().
+ * @param key private key object
+ * @param priority PKCS11_PRIORITY_xxx, or -1 to use the class of the
+ *   calling thread (the default)
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_set_key_priority(PKCS11_KEY *key, int priority);
+
+/**
+ * Sign a vector of requests with the private key
+ *
+ * The requests are distributed over up to max_sessions sessions of the slot
+ * and signed concurrently by the context worker threads.
+ * Mechanisms requiring parameters are not supported.
+ *
+ * @param key private key object
+ * @param mechanism PKCS#11 mechanism type, e.g. CKM_RSA_PKCS or CKM_ECDSA
+ * @param reqs requests, the status of each request is set in reqs[i].rv
+ * @param count number of requests
+ * @retval 0 all the requests succeeded
+ * @retval -1 error
+ */
+extern int PKCS11_sign_batch(PKCS11_KEY *key, unsigned long mechanism,
+	PKCS11_SIGN_REQ *reqs, unsigned int count);
+
 /* Find the corresponding certificate (if any) */
 extern PKCS11_CERT *PKCS11_find_certificate(PKCS11_KEY *);
 
-/* Find the corresponding key (if any) */
+/* Find the corresponding key (if any), valid until the token is released */
 extern PKCS11_KEY *PKCS11_find_key(PKCS11_CERT *);
 
 /* Get a list of all certificates associated with this token */
 extern int PKCS11_enumerate_certs(PKCS11_TOKEN *, PKCS11_CERT **, unsigned int *);
 
+/**
+ * Get a list of certificates associated with this token
+ *
+ * Only the certificates matching the id and label of the template are
+ * searched on the token.
+ * The returned list also contains the certificates found by previous calls.
+ *
+ * @param token token returned by PKCS11_find_token()
+ * @param cert_template the id, id_len and label of the searched
+ *   certificates, unset fields match any certificate
+ * @param certs the returned list of certificates
+ * @param ncerts the number of certificates in the list
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_enumerate_certs_ext(PKCS11_TOKEN *token,
+	const PKCS11_CERT *cert_template, PKCS11_CERT **certs, unsigned int *ncerts);
+
+/**
+ * Iterate over the certificates of a token without storing them
+ *
+ * Works like PKCS11_key_iter_new().  The returned certificate is only
+ * valid until the next call to PKCS11_cert_iter_next() or until the
+ * iterator is freed.
+ *
+ * @param token token returned by PKCS11_find_token()
+ * @param cert_template the id, id_len and label of the searched
+ *   certificates, or NULL to iterate over all the certificates
+ * @return the iterator, or NULL on error
+ */
+extern PKCS11_CERT_ITER *PKCS11_cert_iter_new(PKCS11_TOKEN *token,
+	const PKCS11_CERT *cert_template);
+
+/* Get the next certificate, NULL after the last one, see PKCS11_key_iter_next() */
+extern int PKCS11_cert_iter_next(PKCS11_CERT_ITER *iter, PKCS11_CERT **cert);
+
+/* Free a certificate iterator */
+extern void PKCS11_cert_iter_free(PKCS11_CERT_ITER *iter);
+
+/**
+ * Get the X.509 certificate of a certificate object
+ *
+ * The certificate is retrieved and decoded on the first call, see
+ * PKCS11_CTX_set_lazy_x509().  Concurrent calls are safe, and return
+ * the same certificate, owned by the certificate object.
+ *
+ * @param cert certificate object
+ * @return the certificate, or NULL on error
+ */
+extern X509 *PKCS11_get_x509(PKCS11_CERT *cert);
+
 /* Remove the certificate from this token */
 extern int PKCS11_remove_certificate(PKCS11_CERT *);
 
@@ -371,6 +945,114 @@ extern int PKCS11_store_certificate(PKCS11_TOKEN * token, X509 * x509,
 		char *label, unsigned char *id, size_t id_len,
 		PKCS11_CERT **ret_cert);
 
+/**
+ * Generate or store a vector of keys and certificates on a token
+ *
+ * The requests are distributed over the read-write sessions of the slot
+ * and processed concurrently by the context worker threads.
+ * The new objects are added to the keys and certificates of the token
+ * without reading back their attributes, and remain valid until the next
+ * enumeration of the token objects.
+ * Only RSA keys are supported.
+ *
+ * @param token token returned by PKCS11_find_token()
+ * @param reqs requests, the status of each request is set in reqs[i].rv
+ * @param count number of requests
+ * @retval 0 all the requests succeeded
+ * @retval -1 error
+ */
+extern int PKCS11_provision_batch(PKCS11_TOKEN *token,
+	PKCS11_PROVISION_REQ *reqs, unsigned int count);
+
+/**
+ * Use an AES secret key of a token for multi-part operations
+ *
+ * The cipher holds a session of the slot until it is freed, as the
+ * state of the operations in progress is kept by the session.
+ * A cipher is used by a single thread at a time, and not after fork().
+ *
+ * @param token token returned by PKCS11_find_token()
+ * @param label label of the key, or NULL
+ * @param id ID of the key, or NULL
+ * @param id_len length of the ID
+ * @return the cipher, or NULL if the key was not found
+ */
+extern PKCS11_CIPHER *PKCS11_cipher_new(PKCS11_TOKEN *token,
+	const char *label, const unsigned char *id, size_t id_len);
+
+/**
+ * Import an AES key as a session object for multi-part operations
+ *
+ * The session object is destroyed with the cipher.
+ *
+ * @param token token returned by PKCS11_find_token()
+ * @param key the key value
+ * @param key_len length of the key: 16, 24 or 32 bytes
+ * @return the cipher, or NULL on error
+ */
+extern PKCS11_CIPHER *PKCS11_cipher_import(PKCS11_TOKEN *token,
+	const unsigned char *key, size_t key_len);
+
+/**
+ * Start an encryption or a decryption
+ *
+ * An operation still in progress is abandoned.  CKM_AES_GCM uses 128-bit
+ * tags: the encryption appends the tag to the output of
+ * PKCS11_cipher_final(), and the decryption expects it at the end of the
+ * input, like the token.
+ *
+ * @param cipher cipher returned by PKCS11_cipher_new()
+ * @param mechanism CKM_AES_CBC, CKM_AES_CBC_PAD or CKM_AES_GCM
+ * @param encrypt 1 to encrypt, 0 to decrypt
+ * @param iv the initialization vector
+ * @param iv_len length of the initialization vector
+ * @param aad additional authenticated data of CKM_AES_GCM, or NULL
+ * @param aad_len length of the additional authenticated data
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_cipher_init(PKCS11_CIPHER *cipher, unsigned long mechanism,
+	int encrypt, const unsigned char *iv, size_t iv_len,
+	const unsigned char *aad, size_t aad_len);
+
+/**
+ * Encrypt or decrypt the next part of the data
+ *
+ * The data is passed to the token without being copied, in chunks of the
+ * size set with PKCS11_CTX_set_cipher_chunk().
+ *
+ * @param cipher cipher started with PKCS11_cipher_init()
+ * @param in input data
+ * @param in_len length of the input data
+ * @param out output buffer
+ * @param out_len size of the output buffer, set to the output length
+ * @retval 0 success
+ * @retval -1 error, the operation is abandoned
+ */
+extern int PKCS11_cipher_update(PKCS11_CIPHER *cipher,
+	const unsigned char *in, size_t in_len,
+	unsigned char *out, size_t *out_len);
+
+/**
+ * Finish an encryption or a decryption
+ *
+ * @param cipher cipher started with PKCS11_cipher_init()
+ * @param out output buffer
+ * @param out_len size of the output buffer, set to the output length
+ * @retval 0 success
+ * @retval -1 error, e.g. an invalid padding or tag
+ */
+extern int PKCS11_cipher_final(PKCS11_CIPHER *cipher,
+	unsigned char *out, size_t *out_len);
+
+/**
+ * Free a cipher and return its session
+ *
+ * @param cipher cipher returned by PKCS11_cipher_new(), or NULL
+ * @return none
+ */
+extern void PKCS11_cipher_free(PKCS11_CIPHER *cipher);
+
 /* Access the random number generator */
 extern int PKCS11_seed_random(PKCS11_SLOT *slot, const unsigned char *s, unsigned int s_len);
 extern int PKCS11_generate_random(PKCS11_SLOT *slot, unsigned char *r, unsigned int r_len);
@@ -462,11 +1144,6 @@ P11_DEPRECATED_FUNC extern int PKCS11_sign(int type,
 	const unsigned char *m, unsigned int m_len,
 	unsigned char *sigret, unsigned int *siglen, PKCS11_KEY * key);
 
-/* This function has never been implemented */
-P11_DEPRECATED_FUNC extern int PKCS11_verify(int type,
-	const unsigned char *m, unsigned int m_len,
-	unsigned char *signature, unsigned int siglen, PKCS11_KEY * key);
-
 /* Encrypts data using the private key */
 P11_DEPRECATED_FUNC extern int PKCS11_private_encrypt(
 	int flen, const unsigned char *from,
@@ -519,6 +1196,19 @@ P11_DEPRECATED_FUNC extern int PKCS11_private_decrypt(
 # define CKR_F_PKCS11_GENERATE_KEY                        130
 # define CKR_F_PKCS11_RELOAD_CERTIFICATE                  131
 # define CKR_F_PKCS11_GET_SESSION                         132
+# define CKR_F_PKCS11_SIGN_BATCH                          133
+# define CKR_F_PKCS11_GETATTR_LIST                        134
+# define CKR_F_PKCS11_VERIFY                              135
+# define CKR_F_PKCS11_UPDATE_SLOTS                        136
+# define CKR_F_PKCS11_GET_SLOT_EVENT                      137
+# define CKR_F_PKCS11_PROVISION_BATCH                     138
+# define CKR_F_PKCS11_CIPHER_NEW                          139
+# define CKR_F_PKCS11_CIPHER_INIT                         140
+# define CKR_F_PKCS11_CIPHER_UPDATE                       141
+# define CKR_F_PKCS11_CIPHER_FINAL                        142
+# define CKR_F_PKCS11_SIGN_UPDATE                         143
+# define CKR_F_PKCS11_SIGN_FINAL                          144
+# define CKR_F_PKCS11_SET_KEY_PRIORITY                    145
 
 /* Backward compatibility of error function codes */
 #define PKCS11_F_PKCS11_CHANGE_PIN CKR_F_PKCS11_CHANGE_PIN
@@ -0,0 +1,104 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Arenas holding the metadata of the keys and certificates of a token
+ *
+ * Memory is carved out of chunks of geometrically growing size, and
+ * never moves or gets freed before the whole arena is released, which
+ * matches the lifetime of the object arrays.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+
+#define PKCS11_ARENA_MIN_CHUNK 4096
+#define PKCS11_ARENA_MAX_CHUNK (1024 * 1024)
+
+/* Alignment suitable for any of the structures stored in an arena */
+#define PKCS11_ARENA_ALIGN (2 * sizeof(void *))
+
+struct pkcs11_arena_chunk {
+	PKCS11_ARENA_CHUNK *next;
+	size_t size, used;
+};
+
+/* The data follows the aligned chunk header */
+#define PKCS11_ARENA_HEADER \
+	((sizeof(PKCS11_ARENA_CHUNK) + PKCS11_ARENA_ALIGN - 1) & \
+		~(PKCS11_ARENA_ALIGN - 1))
+
+/*
+ * Allocate len bytes
+ * Returns NULL on memory allocation failure
+ */
+void *pkcs11_arena_alloc(PKCS11_ARENA *arena, size_t len)
+{
+	PKCS11_ARENA_CHUNK *chunk = arena->chunks;
+	size_t size;
+	void *ptr;
+
+	len = (len + PKCS11_ARENA_ALIGN - 1) & ~(PKCS11_ARENA_ALIGN - 1);
+	if (!chunk || chunk->size - chunk->used < len) {
+		/* Each chunk is twice as large as the previous one */
+		size = chunk ? 2 * chunk->size : PKCS11_ARENA_MIN_CHUNK;
+		if (size > PKCS11_ARENA_MAX_CHUNK)
+			size = PKCS11_ARENA_MAX_CHUNK;
+		if (size < len)
+			size = len;
+		chunk = OPENSSL_malloc(PKCS11_ARENA_HEADER + size);
+		if (!chunk)
+			return NULL;
+		chunk->size = size;
+		chunk->used = 0;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	ptr = (unsigned char *)chunk + PKCS11_ARENA_HEADER + chunk->used;
+	chunk->used += len;
+	return ptr;
+}
+
+/*
+ * Copy len bytes followed by a terminating zero byte
+ * Returns NULL on memory allocation failure
+ */
+void *pkcs11_arena_memdup(PKCS11_ARENA *arena, const void *data, size_t len)
+{
+	unsigned char *ptr;
+
+	ptr = pkcs11_arena_alloc(arena, len + 1);
+	if (!ptr)
+		return NULL;
+	if (len)
+		memcpy(ptr, data, len);
+	ptr[len] = 0;
+	return ptr;
+}
+
+void pkcs11_arena_free(PKCS11_ARENA *arena)
+{
+	PKCS11_ARENA_CHUNK *chunk, *next;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		OPENSSL_free(chunk);
+	}
+	arena->chunks = NULL;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,350 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * This file implements the context worker threads and the support
+ * for OpenSSL ASYNC_JOB: a PKCS#11 call made within an asynchronous job
+ * is performed by a worker thread, while the job is paused and the
+ * application is notified with an async wait fd.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER) && !defined(_WIN32)
+#define PKCS11_ASYNC
+#include <openssl/async.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+/* Set in the worker threads, which run the tasks they submit themselves */
+static P11_THREAD_LOCAL int pkcs11_is_worker = 0;
+
+void pkcs11_workers_init(PKCS11_CTX *ctx)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	pthread_mutex_init(&cpriv->task_lock, 0);
+	pthread_cond_init(&cpriv->task_cond, 0);
+	cpriv->task_head = cpriv->task_tail = NULL;
+	cpriv->num_tasks = cpriv->num_workers = cpriv->idle_workers = 0;
+	cpriv->num_threads = 0;
+	cpriv->workers_stopped = 0;
+}
+
+static void *pkcs11_worker(void *arg)
+{
+	PKCS11_CTX_private *cpriv = arg;
+	PKCS11_TASK *task;
+
+	pkcs11_is_worker = 1;
+	pthread_mutex_lock(&cpriv->task_lock);
+	for (;;) {
+		while (!cpriv->task_head && !cpriv->workers_stopped) {
+			cpriv->idle_workers++;
+			pthread_cond_wait(&cpriv->task_cond, &cpriv->task_lock);
+			cpriv->idle_workers--;
+		}
+		task = cpriv->task_head;
+		if (!task) /* Stopped with no pending tasks */
+			break;
+		cpriv->task_head = task->next;
+		if (!cpriv->task_head)
+			cpriv->task_tail = NULL;
+		cpriv->num_tasks--;
+		pthread_mutex_unlock(&cpriv->task_lock);
+
+		task->run(task);
+
+		pthread_mutex_lock(&cpriv->task_lock);
+	}
+	cpriv->num_workers--;
+	pthread_cond_broadcast(&cpriv->task_cond);
+	pthread_mutex_unlock(&cpriv->task_lock);
+	return NULL;
+}
+
+/*
+ * Queue a task for the worker threads
+ * Returns 0 on success, or -1 if the caller has to run the task itself
+ * Tasks are not queued by the worker threads, as waiting for them could
+ * deadlock when all the workers are busy.
+ */
+int pkcs11_task_submit(PKCS11_CTX *ctx, PKCS11_TASK *task)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+	pthread_t thread;
+
+	if (pkcs11_is_worker)
+		return -1;
+	pthread_mutex_lock(&cpriv->task_lock);
+	if (cpriv->workers_stopped) {
+		pthread_mutex_unlock(&cpriv->task_lock);
+		return -1;
+	}
+	if (cpriv->num_tasks + 1 > cpriv->idle_workers &&
+			cpriv->num_workers < PKCS11_MAX_WORKERS) {
+		if (pthread_create(&thread, NULL, pkcs11_worker, cpriv) == 0) {
+			cpriv->threads[cpriv->num_threads++] = thread;
+			cpriv->num_workers++;
+		} else if (!cpriv->num_workers) {
+			pthread_mutex_unlock(&cpriv->task_lock);
+			return -1;
+		}
+	}
+	task->next = NULL;
+	if (cpriv->task_tail)
+		cpriv->task_tail->next = task;
+	else
+		cpriv->task_head = task;
+	cpriv->task_tail = task;
+	cpriv->num_tasks++;
+	pthread_cond_signal(&cpriv->task_cond);
+	pthread_mutex_unlock(&cpriv->task_lock);
+	return 0;
+}
+
+/*
+ * Wait for the pending tasks to complete and terminate the workers
+ */
+void pkcs11_workers_stop(PKCS11_CTX *ctx)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+	pthread_t threads[PKCS11_MAX_WORKERS];
+	unsigned int i, num_threads;
+
+	if (cpriv->forkid != get_forkid()) {
+		/* The worker threads did not survive fork() */
+		pkcs11_workers_init(ctx);
+		cpriv->workers_stopped = 1;
+		return;
+	}
+	pthread_mutex_lock(&cpriv->task_lock);
+	cpriv->workers_stopped = 1;
+	pthread_cond_broadcast(&cpriv->task_cond);
+	while (cpriv->num_workers)
+		pthread_cond_wait(&cpriv->task_cond, &cpriv->task_lock);
+	num_threads = cpriv->num_threads;
+	memcpy(threads, cpriv->threads, num_threads * sizeof(pthread_t));
+	cpriv->num_threads = 0;
+	pthread_mutex_unlock(&cpriv->task_lock);
+	/* The module may be unloaded once the threads have exited */
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/*
+ * Allow new worker threads to be started after pkcs11_workers_stop()
+ */
+void pkcs11_workers_restart(PKCS11_CTX *ctx)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	pthread_mutex_lock(&cpriv->task_lock);
+	cpriv->workers_stopped = 0;
+	pthread_mutex_unlock(&cpriv->task_lock);
+}
+
+void pkcs11_workers_free(PKCS11_CTX *ctx)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	pthread_mutex_destroy(&cpriv->task_lock);
+	pthread_cond_destroy(&cpriv->task_cond);
+}
+
+#ifdef PKCS11_ASYNC
+
+/* Maximum number of errors of a worker thread moved to the job */
+#define PKCS11_ASYNC_ERRORS 8
+
+/* An error reported on a worker thread */
+typedef struct pkcs11_async_error {
+	unsigned long code;
+	const char *file;
+	int line;
+} PKCS11_ASYNC_ERROR;
+
+typedef struct pkcs11_async_task {
+	PKCS11_TASK task;
+	CK_RV (*fn)(void *);
+	void *arg;
+	CK_RV rv;
+	int fd;
+	PKCS11_ASYNC_ERROR errors[PKCS11_ASYNC_ERRORS];
+	unsigned int num_errors;
+} PKCS11_ASYNC_TASK;
+
+static const char pkcs11_async_key[] = "libp11";
+
+/* Move the errors of the worker thread to the task, oldest first */
+static void pkcs11_async_save_errors(PKCS11_ASYNC_TASK *atask)
+{
+	PKCS11_ASYNC_ERROR *e;
+	unsigned long code;
+	const char *file;
+	int line;
+
+	atask->num_errors = 0;
+	for (;;) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		code = ERR_get_error_all(&file, &line, NULL, NULL, NULL);
+#else
+		code = ERR_get_error_line(&file, &line);
+#endif
+		if (!code)
+			break;
+		if (atask->num_errors >= PKCS11_ASYNC_ERRORS)
+			continue;
+		e = atask->errors + atask->num_errors++;
+		e->code = code;
+		e->file = file;
+		e->line = line;
+	}
+}
+
+/* Report the errors of the worker thread in the calling thread */
+static void pkcs11_async_restore_errors(PKCS11_ASYNC_TASK *atask)
+{
+	PKCS11_ASYNC_ERROR *e;
+	unsigned int i;
+
+	for (i = 0; i < atask->num_errors; i++) {
+		e = atask->errors + i;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		ERR_new();
+		ERR_set_debug(e->file, e->line, NULL);
+		ERR_set_error(ERR_GET_LIB(e->code), ERR_GET_REASON(e->code), NULL);
+#else
+		ERR_put_error(ERR_GET_LIB(e->code), ERR_GET_FUNC(e->code),
+			ERR_GET_REASON(e->code), e->file, e->line);
+#endif
+	}
+}
+
+static void pkcs11_async_run(PKCS11_TASK *task)
+{
+	PKCS11_ASYNC_TASK *atask = (PKCS11_ASYNC_TASK *)task;
+	char c = 0;
+
+	/* Only the errors of fn are moved to the job */
+	ERR_clear_error();
+	atask->rv = atask->fn(atask->arg);
+	pkcs11_async_save_errors(atask);
+	/* Wake up the paused job */
+	while (write(atask->fd, &c, 1) < 0 && errno == EINTR)
+		;
+}
+
+static void pkcs11_async_cleanup(ASYNC_WAIT_CTX *waitctx, const void *key,
+		OSSL_ASYNC_FD readfd, void *custom)
+{
+	(void)waitctx;
+	(void)key;
+	close(readfd);
+	close(*(int *)custom);
+	OPENSSL_free(custom);
+}
+
+/*
+ * Get the wait fd pair of an ASYNC_WAIT_CTX, creating it the first time
+ */
+static int pkcs11_async_fds(ASYNC_WAIT_CTX *waitctx, int *readfd, int *writefd)
+{
+	void *custom;
+	int fds[2];
+
+	if (ASYNC_WAIT_CTX_get_fd(waitctx, pkcs11_async_key, readfd, &custom)) {
+		*writefd = *(int *)custom;
+		return 0;
+	}
+	if (pipe(fds) < 0)
+		return -1;
+	custom = OPENSSL_malloc(sizeof(int));
+	if (!custom)
+		goto fail;
+	*(int *)custom = fds[1];
+	if (fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0 ||
+			fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0 ||
+			!ASYNC_WAIT_CTX_set_wait_fd(waitctx, pkcs11_async_key,
+				fds[0], custom, pkcs11_async_cleanup)) {
+		OPENSSL_free(custom);
+		goto fail;
+	}
+	*readfd = fds[0];
+	*writefd = fds[1];
+	return 0;
+fail:
+	close(fds[0]);
+	close(fds[1]);
+	return -1;
+}
+
+#endif /* PKCS11_ASYNC */
+
+/*
+ * Call fn(arg) on a worker thread if the caller runs within an ASYNC_JOB,
+ * and directly otherwise
+ * Errors reported by fn to the OpenSSL error queue of a worker thread are
+ * reported again in the calling thread when the job resumes.
+ */
+CK_RV pkcs11_async_call(PKCS11_CTX *ctx, CK_RV (*fn)(void *), void *arg)
+{
+#ifdef PKCS11_ASYNC
+	ASYNC_JOB *job = ASYNC_get_current_job();
+	ASYNC_WAIT_CTX *waitctx;
+	PKCS11_ASYNC_TASK atask;
+	struct pollfd pfd;
+	int readfd;
+	char c;
+
+	if (!job)
+		return fn(arg);
+	waitctx = ASYNC_get_wait_ctx(job);
+	if (!waitctx || pkcs11_async_fds(waitctx, &readfd, &atask.fd) < 0)
+		return fn(arg);
+
+	memset(&atask.task, 0, sizeof(atask.task));
+	atask.task.run = pkcs11_async_run;
+	atask.fn = fn;
+	atask.arg = arg;
+	atask.rv = CKR_GENERAL_ERROR;
+	atask.num_errors = 0;
+	if (pkcs11_task_submit(ctx, &atask.task) < 0)
+		return fn(arg);
+
+	/* Return to the application until the worker wakes us up */
+	while (read(readfd, &c, 1) != 1) {
+		if (!ASYNC_pause_job()) {
+			/* Unable to pause: just wait for the worker */
+			pfd.fd = readfd;
+			pfd.events = POLLIN;
+			poll(&pfd, 1, -1);
+		}
+	}
+	pkcs11_async_restore_errors(&atask);
+	return atask.rv;
+#else
+	(void)ctx;
+	return fn(arg);
+#endif
+}
+
+/* vim: set noexpandtab: */
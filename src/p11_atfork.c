@@ -21,6 +21,7 @@
  */
 
 #include "libp11-int.h"
+#include <string.h>
 
 #ifndef _WIN32
 
@@ -60,13 +61,17 @@ static unsigned int _P11_update_forkid(void)
 
 #endif /* HAVE_PTHREAD */
 
+/*
+ * The forkid of an object is only stored after the object was reloaded,
+ * with fork_lock held.  An atomic load is enough to detect the unchanged
+ * case, and the lock is only taken to reload the object after fork().
+ */
 #define CHECK_FORKID(ctx, forkid, function_call) \
 	do { \
 		int rv = 0; \
-		_P11_update_forkid(); \
-		if (forkid != P11_forkid) { \
+		if (p11_atomic_load(&(forkid)) != _P11_update_forkid()) { \
 			pthread_mutex_lock(&PRIVCTX(ctx)->fork_lock); \
-			function_call; \
+			rv = function_call; \
 			pthread_mutex_unlock(&PRIVCTX(ctx)->fork_lock); \
 		} \
 		return rv; \
@@ -98,7 +103,7 @@ static int check_fork_int(PKCS11_CTX *ctx)
 	if (cpriv->forkid != P11_forkid) {
 		if (pkcs11_CTX_reload(ctx) < 0)
 			return -1;
-		cpriv->forkid = P11_forkid;
+		p11_atomic_store(&cpriv->forkid, P11_forkid);
 	}
 	return 0;
 }
@@ -118,11 +123,22 @@ static int check_slot_fork_int(PKCS11_SLOT *slot)
 	if (spriv->forkid != cpriv->forkid) {
 		if (pkcs11_reload_slot(slot) < 0)
 			return -1;
-		spriv->forkid = cpriv->forkid;
+		p11_atomic_store(&spriv->forkid, cpriv->forkid);
 	}
 	return 0;
 }
 
+/*
+ * PKCS#11 reinitialization of the slot of a key replica
+ * A replica stored in another context is checked with its own fork_lock.
+ */
+static int check_replica_fork_int(PKCS11_KEY *key, PKCS11_SLOT *slot)
+{
+	if (SLOT2CTX(slot) == KEY2CTX(key))
+		return check_slot_fork_int(slot);
+	return check_slot_fork(slot);
+}
+
 /*
  * PKCS#11 reinitialization after fork
  * Also reloads the key
@@ -132,13 +148,26 @@ static int check_key_fork_int(PKCS11_KEY *key)
 	PKCS11_SLOT *slot = KEY2SLOT(key);
 	PKCS11_KEY_private *kpriv = PRIVKEY(key);
 	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	unsigned int i;
 
 	if (check_slot_fork_int(slot) < 0)
 		return -1;
 	if (spriv->forkid != kpriv->forkid) {
 		if (pkcs11_reload_key(key) < 0)
 			return -1;
-		kpriv->forkid = spriv->forkid;
+		p11_atomic_store(&kpriv->forkid, spriv->forkid);
+	}
+	for (i = 0; i < kpriv->num_replicas; i++) {
+		PKCS11_KEY_REPLICA *replica = kpriv->replicas + i;
+
+		if (!replica->slot) /* Its token was removed */
+			continue;
+		/* A failed replica is skipped by the load balancing */
+		if (check_replica_fork_int(key, replica->slot) < 0)
+			continue;
+		if (PRIVSLOT(replica->slot)->forkid != replica->forkid &&
+				pkcs11_reload_replica(key, replica) == 0)
+			replica->forkid = PRIVSLOT(replica->slot)->forkid;
 	}
 	return 0;
 }
@@ -159,7 +188,7 @@ static int check_cert_fork_int(PKCS11_CERT *cert)
 	if (spriv->forkid != cpriv->forkid) {
 		if (pkcs11_reload_certificate(cert) < 0)
 			return -1;
-		cpriv->forkid = spriv->forkid;
+		p11_atomic_store(&cpriv->forkid, spriv->forkid);
 	}
 	return 0;
 }
@@ -217,4 +246,201 @@ int check_cert_fork(PKCS11_CERT *cert)
 		check_cert_fork_int(cert));
 }
 
+/*
+ * Record the slots to be reinitialized by pkcs11_CTX_child_init(),
+ * and wait for the operations in progress in the worker threads,
+ * so that fork() is not called in the middle of a PKCS#11 call
+ */
+void pkcs11_CTX_prepare_fork(PKCS11_CTX *ctx,
+		PKCS11_SLOT *slots, unsigned int nslots)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	pthread_mutex_lock(&cpriv->fork_lock);
+	cpriv->fork_slots = slots;
+	cpriv->fork_nslots = slots ? nslots : 0;
+	pthread_mutex_unlock(&cpriv->fork_lock);
+	pkcs11_workers_stop(ctx);
+	pkcs11_workers_restart(ctx);
+}
+
+#ifndef _WIN32
+
+typedef struct pkcs11_child_init {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int running;
+	int (*reload)(PKCS11_SLOT *);
+} PKCS11_CHILD_INIT;
+
+typedef struct pkcs11_child_lane {
+	PKCS11_TASK task;
+	PKCS11_CHILD_INIT *init;
+	PKCS11_SLOT *slot;
+	int rv;
+} PKCS11_CHILD_LANE;
+
+/*
+ * Log in again and open a session ahead of the first operation
+ */
+static int pkcs11_child_init_slot(PKCS11_SLOT *slot)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	CK_SESSION_HANDLE session;
+
+	if (check_slot_fork_int(slot) < 0)
+		return -1;
+	/* Only needed if the parent has used the slot */
+	if (spriv->rw_mode < 0)
+		return 0;
+	if (pkcs11_get_session(slot, 0, &session))
+		return -1;
+	pkcs11_put_session(slot, 0, session);
+	return 0;
+}
+
+/*
+ * Reload the object handles of the keys and certificates of a token
+ */
+static int pkcs11_child_init_objects(PKCS11_SLOT *slot)
+{
+	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(slot->token);
+	int i, rv = 0;
+
+	for (i = 0; i < tpriv->prv.num; i++)
+		if (check_key_fork_int(tpriv->prv.keys + i) < 0)
+			rv = -1;
+	for (i = 0; i < tpriv->pub.num; i++)
+		if (check_key_fork_int(tpriv->pub.keys + i) < 0)
+			rv = -1;
+	for (i = 0; i < tpriv->ncerts; i++)
+		if (check_cert_fork_int(tpriv->certs + i) < 0)
+			rv = -1;
+	return rv;
+}
+
+static void pkcs11_child_init_run(PKCS11_TASK *task)
+{
+	PKCS11_CHILD_LANE *lane = (PKCS11_CHILD_LANE *)task;
+	PKCS11_CHILD_INIT *init = lane->init;
+
+	lane->rv = init->reload(lane->slot);
+	pthread_mutex_lock(&init->lock);
+	if (--init->running == 0)
+		pthread_cond_signal(&init->cond);
+	pthread_mutex_unlock(&init->lock);
+}
+
+/*
+ * Apply the reload function to every slot with a token in parallel
+ * The calling thread processes the first slot
+ */
+static int pkcs11_child_init_all(PKCS11_CTX *ctx, PKCS11_CHILD_LANE *lanes,
+		unsigned int nlanes, int (*reload)(PKCS11_SLOT *))
+{
+	PKCS11_CHILD_INIT init;
+	unsigned int i;
+	int rv = 0;
+
+	memset(&init, 0, sizeof init);
+	pthread_mutex_init(&init.lock, 0);
+	pthread_cond_init(&init.cond, 0);
+	init.reload = reload;
+	for (i = 0; i < nlanes; i++) {
+		lanes[i].task.run = pkcs11_child_init_run;
+		lanes[i].init = &init;
+		lanes[i].rv = 0;
+	}
+	for (i = 1; i < nlanes; i++) {
+		pthread_mutex_lock(&init.lock);
+		init.running++;
+		pthread_mutex_unlock(&init.lock);
+		if (pkcs11_task_submit(ctx, &lanes[i].task) < 0) {
+			pthread_mutex_lock(&init.lock);
+			init.running--;
+			pthread_mutex_unlock(&init.lock);
+			lanes[i].rv = reload(lanes[i].slot);
+		}
+	}
+	if (nlanes)
+		lanes[0].rv = reload(lanes[0].slot);
+
+	pthread_mutex_lock(&init.lock);
+	while (init.running)
+		pthread_cond_wait(&init.cond, &init.lock);
+	pthread_mutex_unlock(&init.lock);
+	pthread_mutex_destroy(&init.lock);
+	pthread_cond_destroy(&init.cond);
+
+	for (i = 0; i < nlanes; i++)
+		if (lanes[i].rv < 0)
+			rv = -1;
+	return rv;
+}
+
+/*
+ * Reinitialize the context and the slots recorded by
+ * pkcs11_CTX_prepare_fork() in a child process
+ * The slots are processed in parallel by the worker threads.
+ * The fork lock is held, so the objects are not reloaded concurrently
+ * by the other threads.
+ */
+int pkcs11_CTX_child_init(PKCS11_CTX *ctx)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+	PKCS11_CHILD_LANE *lanes = NULL;
+	unsigned int i, j, n = 0;
+	int rv = -1;
+
+	_P11_update_forkid();
+	pthread_mutex_lock(&cpriv->fork_lock);
+	if (check_fork_int(ctx) < 0)
+		goto done;
+	if (cpriv->fork_nslots) {
+		lanes = OPENSSL_malloc(cpriv->fork_nslots * sizeof(PKCS11_CHILD_LANE));
+		if (!lanes)
+			goto done;
+	}
+	for (i = 0; i < cpriv->fork_nslots; i++)
+		if (cpriv->fork_slots[i].token)
+			lanes[n++].slot = cpriv->fork_slots + i;
+
+	/* Log in again and reopen the sessions */
+	rv = pkcs11_child_init_all(ctx, lanes, n, pkcs11_child_init_slot);
+
+	/* The slots of the key replicas are also needed to reload the keys */
+	for (i = 0; i < n; i++) {
+		PKCS11_TOKEN_private *tpriv = PRIVTOKEN(lanes[i].slot->token);
+
+		for (j = 0; j < (unsigned int)tpriv->prv.num; j++) {
+			PKCS11_KEY *key = tpriv->prv.keys + j;
+			PKCS11_KEY_private *kpriv = PRIVKEY(key);
+			unsigned int k;
+
+			for (k = 0; k < kpriv->num_replicas; k++)
+				if (kpriv->replicas[k].slot)
+					check_replica_fork_int(key,
+						kpriv->replicas[k].slot);
+		}
+	}
+
+	/* Reload the object handles */
+	if (pkcs11_child_init_all(ctx, lanes, n, pkcs11_child_init_objects) < 0)
+		rv = -1;
+done:
+	pthread_mutex_unlock(&cpriv->fork_lock);
+	OPENSSL_free(lanes);
+	return rv;
+}
+
+#else /* !_WIN32 */
+
+int pkcs11_CTX_child_init(PKCS11_CTX *ctx)
+{
+	(void)ctx;
+	return 0;
+}
+
+#endif /* !_WIN32 */
+
 /* vim: set noexpandtab: */
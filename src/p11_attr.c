@@ -82,6 +82,99 @@ int pkcs11_getattr_alloc(PKCS11_CTX *ctx, CK_SESSION_HANDLE session,
 	return 0;
 }
 
+/* Marks the attributes not processed by a broken PKCS#11 module */
+#define ATTR_LEN_UNSET ((CK_ULONG)-2)
+
+/*
+ * Query a template of attributes with one C_GetAttributeValue() call
+ * to retrieve the sizes, and one more call to retrieve the values.
+ * The values are allocated and null-terminated, and must be released
+ * with pkcs11_zap_attrs().  Attributes that are unavailable (invalid
+ * or sensitive) are returned with a NULL pValue and ulValueLen set to
+ * CK_UNAVAILABLE_INFORMATION.
+ */
+int pkcs11_getattr_list(PKCS11_CTX *ctx, CK_SESSION_HANDLE session,
+		CK_OBJECT_HANDLE object, CK_ATTRIBUTE *attrs, unsigned int n)
+{
+	CK_ATTRIBUTE *avail;
+	unsigned int i, m;
+	int rv;
+
+	for (i = 0; i < n; i++) {
+		attrs[i].pValue = NULL;
+		attrs[i].ulValueLen = ATTR_LEN_UNSET;
+	}
+	rv = CRYPTOKI_call(ctx, C_GetAttributeValue(session, object, attrs, n));
+	if (rv != CKR_OK && rv != CKR_ATTRIBUTE_SENSITIVE &&
+			rv != CKR_ATTRIBUTE_TYPE_INVALID) {
+		CKRerr(CKR_F_PKCS11_GETATTR_LIST, rv);
+		return -1;
+	}
+
+	/* Some modules stop processing the template at the first unavailable
+	 * attribute, so the remaining attributes are queried one by one */
+	for (i = 0; i < n; i++) {
+		if (attrs[i].ulValueLen != ATTR_LEN_UNSET)
+			continue;
+		rv = CRYPTOKI_call(ctx,
+			C_GetAttributeValue(session, object, attrs + i, 1));
+		if (rv != CKR_OK)
+			attrs[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
+	}
+
+	avail = OPENSSL_malloc(n * sizeof(CK_ATTRIBUTE));
+	if (!avail) {
+		CKRerr(CKR_F_PKCS11_GETATTR_LIST, CKR_HOST_MEMORY);
+		return -1;
+	}
+	for (i = 0, m = 0; i < n; i++) {
+		if (attrs[i].ulValueLen == CK_UNAVAILABLE_INFORMATION)
+			continue;
+		attrs[i].pValue = OPENSSL_malloc(attrs[i].ulValueLen + 1);
+		if (!attrs[i].pValue) {
+			CKRerr(CKR_F_PKCS11_GETATTR_LIST, CKR_HOST_MEMORY);
+			goto failure;
+		}
+		/* also null-terminate the allocated data */
+		memset(attrs[i].pValue, 0, attrs[i].ulValueLen + 1);
+		avail[m++] = attrs[i];
+	}
+
+	/* Retrieve the values of the available attributes */
+	if (m) {
+		rv = CRYPTOKI_call(ctx,
+			C_GetAttributeValue(session, object, avail, m));
+		if (rv != CKR_OK) {
+			CKRerr(CKR_F_PKCS11_GETATTR_LIST, rv);
+			goto failure;
+		}
+	}
+	for (i = 0, m = 0; i < n; i++)
+		if (attrs[i].pValue)
+			attrs[i].ulValueLen = avail[m++].ulValueLen;
+	OPENSSL_free(avail);
+	return 0;
+
+failure:
+	OPENSSL_free(avail);
+	for (i = 0; i < n; i++) {
+		OPENSSL_free(attrs[i].pValue);
+		attrs[i].pValue = NULL;
+	}
+	return -1;
+}
+
+/*
+ * Convert an attribute retrieved with pkcs11_getattr_list() into a BIGNUM
+ */
+int pkcs11_attr_bn(const CK_ATTRIBUTE *attr, BIGNUM **bn)
+{
+	if (!attr->pValue)
+		return -1;
+	*bn = BN_bin2bn(attr->pValue, (int)attr->ulValueLen, *bn);
+	return *bn ? 0 : -1;
+}
+
 int pkcs11_getattr_bn(PKCS11_CTX *ctx, CK_SESSION_HANDLE session,
 		CK_OBJECT_HANDLE object, CK_ATTRIBUTE_TYPE type, BIGNUM **bn)
 {
@@ -0,0 +1,592 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Per-token cache file of the keys and the certificates
+ *
+ * The first enumeration of a token after the login lists all its keys
+ * and certificates, and saves their labels, IDs, flags and public
+ * components, and the certificate values, in a file named after the
+ * model, serial number and label of the token.  The next processes map
+ * the file instead of searching the token, and the objects are given
+ * their handle by check_key_fork() and check_cert_fork() when they are
+ * first used.  The cache is only valid for the same generation string,
+ * which the host changes when it modifies the tokens.  An object that
+ * is no longer found on the token, or a key with other public components
+ * than the cached ones, deletes the file, and the objects are searched
+ * on the token again.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+#include <stdio.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define PKCS11_METADATA_MAGIC "P11META1"
+#define PKCS11_METADATA_MAGIC_LEN 8
+/* Also rejects the files written with the other byte order */
+#define PKCS11_METADATA_ORDER 0x01020304UL
+/* Length of the absent values, the others are followed by a null byte */
+#define PKCS11_METADATA_ABSENT 0xffffffffUL
+#define PKCS11_METADATA_PATH_MAX 4096
+
+typedef struct pkcs11_metadata_reader {
+	const unsigned char *p, *end;
+} PKCS11_METADATA_READER;
+
+/*
+ * Set the directory of the cache files, and the generation of the tokens
+ */
+int pkcs11_CTX_set_metadata_cache(PKCS11_CTX *ctx, const char *dir,
+		const char *generation)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+	char *d = NULL, *g = NULL;
+
+	if (dir) {
+		d = OPENSSL_strdup(dir);
+		if (!d)
+			return -1;
+	}
+	if (generation) {
+		g = OPENSSL_strdup(generation);
+		if (!g) {
+			OPENSSL_free(d);
+			return -1;
+		}
+	}
+	OPENSSL_free(cpriv->metadata_dir);
+	OPENSSL_free(cpriv->metadata_generation);
+	cpriv->metadata_dir = d;
+	cpriv->metadata_generation = g;
+	return 0;
+}
+
+static unsigned int pkcs11_metadata_class(unsigned int type)
+{
+	switch (type) {
+	case CKO_PRIVATE_KEY:
+		return PKCS11_METADATA_PRV;
+	case CKO_PUBLIC_KEY:
+		return PKCS11_METADATA_PUB;
+	default:
+		return PKCS11_METADATA_CERTS;
+	}
+}
+
+/* The cache file of the token */
+static int pkcs11_metadata_path(PKCS11_TOKEN *token, char *path, size_t size)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(TOKEN2CTX(token));
+	char name[256];
+	int n;
+
+	if (!cpriv->metadata_dir || !token->model || !token->serialnr ||
+			!token->label)
+		return -1;
+	snprintf(name, sizeof name, "%s\n%s\n%s",
+		token->model, token->serialnr, token->label);
+	n = snprintf(path, size, "%s/libp11-%08lx.cache", cpriv->metadata_dir,
+		pkcs11_hash_bytes((unsigned char *)name, strlen(name)) &
+			0xffffffffUL);
+	return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+/******************************************************************************/
+/* Loading                                                                    */
+/******************************************************************************/
+
+static int pkcs11_metadata_map(const char *path, void **map, size_t *size)
+{
+#ifndef _WIN32
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+	*map = p;
+	*size = (size_t)st.st_size;
+	return 0;
+#else
+	unsigned char *p;
+	long len;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return -1;
+	if (fseek(f, 0, SEEK_END) || (len = ftell(f)) <= 0 ||
+			fseek(f, 0, SEEK_SET)) {
+		fclose(f);
+		return -1;
+	}
+	p = OPENSSL_malloc((size_t)len);
+	if (!p || fread(p, 1, (size_t)len, f) != (size_t)len) {
+		OPENSSL_free(p);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	*map = p;
+	*size = (size_t)len;
+	return 0;
+#endif
+}
+
+static void pkcs11_metadata_unmap(void *map, size_t size)
+{
+#ifndef _WIN32
+	munmap(map, size);
+#else
+	(void)size;
+	OPENSSL_free(map);
+#endif
+}
+
+static int pkcs11_metadata_get_u32(PKCS11_METADATA_READER *r,
+		unsigned long *value)
+{
+	uint32_t v;
+
+	if ((size_t)(r->end - r->p) < sizeof v)
+		return -1;
+	memcpy(&v, r->p, sizeof v);
+	r->p += sizeof v;
+	*value = v;
+	return 0;
+}
+
+/* A value in the file, or NULL if absent */
+static int pkcs11_metadata_get_bytes(PKCS11_METADATA_READER *r,
+		const unsigned char **data, size_t *len)
+{
+	unsigned long n;
+
+	if (pkcs11_metadata_get_u32(r, &n))
+		return -1;
+	if (n == PKCS11_METADATA_ABSENT) {
+		*data = NULL;
+		*len = 0;
+		return 0;
+	}
+	if ((size_t)(r->end - r->p) <= n || r->p[n])
+		return -1;
+	*data = r->p;
+	*len = n;
+	r->p += n + 1;
+	return 0;
+}
+
+/* Whether the next value is the string s, or the empty string for NULL */
+static int pkcs11_metadata_check_string(PKCS11_METADATA_READER *r,
+		const char *s)
+{
+	const unsigned char *data;
+	size_t len;
+
+	if (!s)
+		s = "";
+	return pkcs11_metadata_get_bytes(r, &data, &len) == 0 && data &&
+		len == strlen(s) && !memcmp(data, s, len);
+}
+
+static int pkcs11_metadata_key(PKCS11_TOKEN *token,
+		PKCS11_METADATA_READER *r, CK_OBJECT_CLASS type, int add)
+{
+	CK_ATTRIBUTE pub[PKCS11_KEY_CACHED_ATTRS];
+	const unsigned char *label, *id, *value;
+	unsigned long key_type, always_authenticate, denied, attr_type;
+	size_t label_len, id_len, len;
+	unsigned int i;
+
+	if (pkcs11_metadata_get_u32(r, &key_type) ||
+			pkcs11_metadata_get_u32(r, &always_authenticate) ||
+			pkcs11_metadata_get_u32(r, &denied) ||
+			pkcs11_metadata_get_bytes(r, &label, &label_len) ||
+			pkcs11_metadata_get_bytes(r, &id, &id_len))
+		return -1;
+	for (i = 0; i < PKCS11_KEY_CACHED_ATTRS; i++) {
+		if (pkcs11_metadata_get_u32(r, &attr_type) ||
+				pkcs11_metadata_get_bytes(r, &value, &len))
+			return -1;
+		pub[i].type = attr_type;
+		pub[i].pValue = (void *)value;
+		pub[i].ulValueLen = value ? len : CK_UNAVAILABLE_INFORMATION;
+	}
+	if (!add)
+		return 0;
+	return pkcs11_add_cached_key(token, type, key_type,
+		(const char *)label, id, id_len,
+		always_authenticate ? CK_TRUE : CK_FALSE, (unsigned int)denied,
+		pub, PKCS11_KEY_CACHED_ATTRS);
+}
+
+static int pkcs11_metadata_cert(PKCS11_TOKEN *token,
+		PKCS11_METADATA_READER *r, int add)
+{
+	const unsigned char *label, *id, *der;
+	size_t label_len, id_len, der_len;
+
+	if (pkcs11_metadata_get_bytes(r, &label, &label_len) ||
+			pkcs11_metadata_get_bytes(r, &id, &id_len) ||
+			pkcs11_metadata_get_bytes(r, &der, &der_len) || !der)
+		return -1;
+	if (!add)
+		return 0;
+	return pkcs11_add_cached_cert(token, (const char *)label, id, id_len,
+		der, der_len);
+}
+
+/*
+ * Check the cache file of the token, and add the objects of the classes
+ * specified with PKCS11_METADATA_xxx flags
+ */
+static int pkcs11_metadata_parse(PKCS11_TOKEN *token,
+		const unsigned char *data, size_t size, unsigned int classes)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(TOKEN2CTX(token));
+	PKCS11_METADATA_READER r;
+	unsigned long order, nprv, npub, ncerts, i;
+
+	r.p = data;
+	r.end = data + size;
+	if (size < PKCS11_METADATA_MAGIC_LEN ||
+			memcmp(r.p, PKCS11_METADATA_MAGIC, PKCS11_METADATA_MAGIC_LEN))
+		return -1;
+	r.p += PKCS11_METADATA_MAGIC_LEN;
+	if (pkcs11_metadata_get_u32(&r, &order) ||
+			order != PKCS11_METADATA_ORDER ||
+			!pkcs11_metadata_check_string(&r, token->model) ||
+			!pkcs11_metadata_check_string(&r, token->serialnr) ||
+			!pkcs11_metadata_check_string(&r, token->label) ||
+			!pkcs11_metadata_check_string(&r,
+				cpriv->metadata_generation) ||
+			pkcs11_metadata_get_u32(&r, &nprv) ||
+			pkcs11_metadata_get_u32(&r, &npub) ||
+			pkcs11_metadata_get_u32(&r, &ncerts))
+		return -1;
+	for (i = 0; i < nprv; i++)
+		if (pkcs11_metadata_key(token, &r, CKO_PRIVATE_KEY,
+				classes & PKCS11_METADATA_PRV))
+			return -1;
+	for (i = 0; i < npub; i++)
+		if (pkcs11_metadata_key(token, &r, CKO_PUBLIC_KEY,
+				classes & PKCS11_METADATA_PUB))
+			return -1;
+	for (i = 0; i < ncerts; i++)
+		if (pkcs11_metadata_cert(token, &r,
+				classes & PKCS11_METADATA_CERTS))
+			return -1;
+	return r.p == r.end ? 0 : -1;
+}
+
+/*
+ * Add the objects of the cache file to the classes without objects yet
+ */
+static int pkcs11_metadata_load(PKCS11_TOKEN *token)
+{
+	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(token);
+	PKCS11_METADATA *md = &tpriv->metadata;
+	char path[PKCS11_METADATA_PATH_MAX];
+	unsigned int classes = 0;
+	size_t size;
+	void *map;
+
+	if (pkcs11_metadata_path(token, path, sizeof path) ||
+			pkcs11_metadata_map(path, &map, &size))
+		return -1;
+	/* The whole file is checked before adding any object */
+	if (pkcs11_metadata_parse(token, map, size, 0)) {
+		pkcs11_metadata_unmap(map, size);
+		return -1;
+	}
+	if (!tpriv->prv.num)
+		classes |= PKCS11_METADATA_PRV;
+	if (!tpriv->pub.num)
+		classes |= PKCS11_METADATA_PUB;
+	if (!tpriv->ncerts)
+		classes |= PKCS11_METADATA_CERTS;
+	md->map = map;
+	md->size = size;
+	if (pkcs11_metadata_parse(token, map, size, classes)) {
+		/* Memory allocation failure */
+		if (classes & PKCS11_METADATA_PRV)
+			pkcs11_destroy_keys(token, CKO_PRIVATE_KEY);
+		if (classes & PKCS11_METADATA_PUB)
+			pkcs11_destroy_keys(token, CKO_PUBLIC_KEY);
+		if (classes & PKCS11_METADATA_CERTS)
+			pkcs11_destroy_certs(token);
+		return -1;
+	}
+	p11_atomic_store(&md->cached, classes);
+	return 0;
+}
+
+/******************************************************************************/
+/* Saving                                                                     */
+/******************************************************************************/
+
+static void pkcs11_metadata_put_u32(FILE *f, unsigned long value)
+{
+	uint32_t v = (uint32_t)value;
+
+	fwrite(&v, sizeof v, 1, f);
+}
+
+static void pkcs11_metadata_put_bytes(FILE *f, const void *data, size_t len)
+{
+	if (!data) {
+		pkcs11_metadata_put_u32(f, PKCS11_METADATA_ABSENT);
+		return;
+	}
+	pkcs11_metadata_put_u32(f, len);
+	fwrite(data, 1, len, f);
+	fputc(0, f);
+}
+
+static void pkcs11_metadata_put_string(FILE *f, const char *s)
+{
+	if (!s)
+		s = "";
+	pkcs11_metadata_put_bytes(f, s, strlen(s));
+}
+
+static int pkcs11_metadata_save_key(FILE *f, PKCS11_KEY *key,
+		CK_SESSION_HANDLE session)
+{
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+	int rsa = kpriv->ops->type == EVP_PKEY_RSA;
+	CK_ATTRIBUTE attrs[PKCS11_KEY_CACHED_ATTRS] = {
+		{rsa ? CKA_MODULUS : CKA_EC_PARAMS, NULL, 0},
+		{rsa ? CKA_PUBLIC_EXPONENT : CKA_EC_POINT, NULL, 0}
+	};
+	unsigned int i;
+
+	if (pkcs11_key_getattr(key, session, attrs, PKCS11_KEY_CACHED_ATTRS))
+		return -1;
+	pkcs11_metadata_put_u32(f, rsa ? CKK_RSA : CKK_EC);
+	pkcs11_metadata_put_u32(f, kpriv->always_authenticate);
+	pkcs11_metadata_put_u32(f, kpriv->denied);
+	pkcs11_metadata_put_string(f, key->label);
+	pkcs11_metadata_put_bytes(f, key->id_len ? key->id : NULL, key->id_len);
+	for (i = 0; i < PKCS11_KEY_CACHED_ATTRS; i++) {
+		pkcs11_metadata_put_u32(f, attrs[i].type);
+		pkcs11_metadata_put_bytes(f, attrs[i].pValue, attrs[i].ulValueLen);
+	}
+	pkcs11_zap_attrs(attrs, PKCS11_KEY_CACHED_ATTRS);
+	return 0;
+}
+
+static int pkcs11_metadata_save_cert(FILE *f, PKCS11_CERT *cert,
+		CK_SESSION_HANDLE session)
+{
+	PKCS11_CERT_private *cpriv = PRIVCERT(cert);
+	unsigned char *der = NULL;
+	size_t len;
+	int n;
+
+	if (cpriv->der) {
+		der = OPENSSL_malloc(cpriv->der_len);
+		if (der)
+			memcpy(der, cpriv->der, cpriv->der_len);
+		len = cpriv->der_len;
+	} else if (cert->x509) {
+		n = i2d_X509(cert->x509, &der);
+		len = n > 0 ? (size_t)n : 0;
+	} else if (pkcs11_getattr_alloc(CERT2CTX(cert), session,
+			cpriv->object, CKA_VALUE, &der, &len)) {
+		der = NULL;
+	}
+	if (!der)
+		return -1;
+	pkcs11_metadata_put_string(f, cert->label);
+	pkcs11_metadata_put_bytes(f, cert->id_len ? cert->id : NULL,
+		cert->id_len);
+	pkcs11_metadata_put_bytes(f, der, len);
+	OPENSSL_free(der);
+	return 0;
+}
+
+/*
+ * Write the objects of the token to its cache file
+ * The file is replaced at once, so that other processes never map
+ * a partially written file.
+ */
+static int pkcs11_metadata_save(PKCS11_TOKEN *token)
+{
+	PKCS11_SLOT *slot = TOKEN2SLOT(token);
+	PKCS11_CTX_private *cpriv = PRIVCTX(SLOT2CTX(slot));
+	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(token);
+	char path[PKCS11_METADATA_PATH_MAX], tmp[PKCS11_METADATA_PATH_MAX + 8];
+	CK_SESSION_HANDLE session;
+	FILE *f;
+	int i, rv = 0;
+#ifndef _WIN32
+	int fd;
+#endif
+
+	if (pkcs11_metadata_path(token, path, sizeof path))
+		return -1;
+#ifndef _WIN32
+	snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return -1;
+	f = fdopen(fd, "wb");
+	if (!f) {
+		close(fd);
+		remove(tmp);
+		return -1;
+	}
+#else
+	snprintf(tmp, sizeof tmp, "%s.tmp", path);
+	f = fopen(tmp, "wb");
+	if (!f)
+		return -1;
+#endif
+	if (pkcs11_get_session(slot, 0, &session)) {
+		fclose(f);
+		remove(tmp);
+		return -1;
+	}
+
+	fwrite(PKCS11_METADATA_MAGIC, 1, PKCS11_METADATA_MAGIC_LEN, f);
+	pkcs11_metadata_put_u32(f, PKCS11_METADATA_ORDER);
+	pkcs11_metadata_put_string(f, token->model);
+	pkcs11_metadata_put_string(f, token->serialnr);
+	pkcs11_metadata_put_string(f, token->label);
+	pkcs11_metadata_put_string(f, cpriv->metadata_generation);
+	pkcs11_metadata_put_u32(f, (unsigned long)tpriv->prv.num);
+	pkcs11_metadata_put_u32(f, (unsigned long)tpriv->pub.num);
+	pkcs11_metadata_put_u32(f, (unsigned long)tpriv->ncerts);
+	for (i = 0; i < tpriv->prv.num && rv == 0; i++)
+		rv = pkcs11_metadata_save_key(f, tpriv->prv.keys + i, session);
+	for (i = 0; i < tpriv->pub.num && rv == 0; i++)
+		rv = pkcs11_metadata_save_key(f, tpriv->pub.keys + i, session);
+	for (i = 0; i < tpriv->ncerts && rv == 0; i++)
+		rv = pkcs11_metadata_save_cert(f, tpriv->certs + i, session);
+	pkcs11_put_session(slot, 0, session);
+
+	if (fflush(f) || ferror(f))
+		rv = -1;
+	if (fclose(f))
+		rv = -1;
+#ifdef _WIN32
+	if (rv == 0)
+		remove(path);
+#endif
+	if (rv || rename(tmp, path)) {
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************/
+/* Enumeration                                                                */
+/******************************************************************************/
+
+/*
+ * Whether the objects of a class are served from the metadata cache
+ * The first call after the login either loads the cache file, or lists
+ * all the objects of the token and saves them in the cache file.  The
+ * other enumerations wait until the objects are added.
+ * Returns 1 if the objects are not to be searched on the token
+ */
+int pkcs11_metadata_enumerate(PKCS11_TOKEN *token, unsigned int type)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(TOKEN2CTX(token));
+	PKCS11_SLOT_private *spriv = PRIVSLOT(TOKEN2SLOT(token));
+	PKCS11_METADATA *md = &PRIVTOKEN(token)->metadata;
+	int rv = 0;
+
+	if (!cpriv->metadata_dir)
+		return 0;
+	if (p11_atomic_load(&md->state) == PKCS11_METADATA_NONE) {
+		/* The private objects are only listed after the login */
+		if ((token->loginRequired && spriv->logged_in < 0) ||
+				p11_atomic_load(&spriv->token_info_pending))
+			return 0;
+		pthread_mutex_lock(&cpriv->metadata_lock);
+		if (md->state != PKCS11_METADATA_NONE) {
+			/* Loaded while waiting for the lock */
+		} else if (pkcs11_metadata_load(token) == 0) {
+			p11_atomic_store(&md->state, PKCS11_METADATA_DONE);
+		} else {
+			/* The errors are reported by the search of the caller */
+			ERR_set_mark();
+			rv = pkcs11_search_keys(token, CKO_PRIVATE_KEY, NULL) == 0 &&
+				pkcs11_search_keys(token, CKO_PUBLIC_KEY, NULL) == 0 &&
+				pkcs11_search_certs(token, NULL) == 0;
+			/* A cache file that cannot be written is not an error */
+			if (rv)
+				pkcs11_metadata_save(token);
+			ERR_pop_to_mark();
+			p11_atomic_store(&md->state, PKCS11_METADATA_DONE);
+		}
+		pthread_mutex_unlock(&cpriv->metadata_lock);
+		if (rv)
+			return 1;
+	}
+	return (p11_atomic_load(&md->cached) & pkcs11_metadata_class(type)) != 0;
+}
+
+/*
+ * Remove the cache file not matching the token anymore
+ * The next enumerations search the objects on the token, and find the
+ * handles of the objects loaded from the cache file.
+ */
+void pkcs11_metadata_stale(PKCS11_TOKEN *token)
+{
+	PKCS11_METADATA *md = &PRIVTOKEN(token)->metadata;
+	char path[PKCS11_METADATA_PATH_MAX];
+
+	if (!p11_atomic_load(&md->cached))
+		return;
+	p11_atomic_store(&md->cached, 0);
+	if (pkcs11_metadata_path(token, path, sizeof path) == 0)
+		remove(path);
+}
+
+/*
+ * Release the cache file after the objects of the token were destroyed
+ */
+void pkcs11_metadata_free(PKCS11_TOKEN *token)
+{
+	PKCS11_METADATA *md = &PRIVTOKEN(token)->metadata;
+
+	if (md->map)
+		pkcs11_metadata_unmap(md->map, md->size);
+	memset(md, 0, sizeof(PKCS11_METADATA));
+}
+
+/* vim: set noexpandtab: */
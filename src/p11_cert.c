@@ -26,31 +26,49 @@
 #include "libp11-int.h"
 #include <string.h>
 
-static int pkcs11_find_certs(PKCS11_TOKEN *, CK_SESSION_HANDLE);
-static int pkcs11_next_cert(PKCS11_CTX *, PKCS11_TOKEN *, CK_SESSION_HANDLE);
+static int pkcs11_find_certs(PKCS11_TOKEN *, CK_SESSION_HANDLE,
+	const PKCS11_CERT *);
+static int pkcs11_next_cert(PKCS11_TOKEN *, CK_SESSION_HANDLE,
+	CK_OBJECT_HANDLE, void *);
 static int pkcs11_init_cert(PKCS11_CTX *ctx, PKCS11_TOKEN *token,
 	CK_SESSION_HANDLE session, CK_OBJECT_HANDLE o, PKCS11_CERT **);
 
 /*
- * Enumerate all certs on the card
+ * Add the certs matching the template found on the token
+ * All the certs are destroyed on failure
  */
-int pkcs11_enumerate_certs(PKCS11_TOKEN *token,
-		PKCS11_CERT **certp, unsigned int *countp)
+int pkcs11_search_certs(PKCS11_TOKEN *token, const PKCS11_CERT *cert_template)
 {
 	PKCS11_SLOT *slot = TOKEN2SLOT(token);
-	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(token);
 	CK_SESSION_HANDLE session;
 	int rv;
 
 	if (pkcs11_get_session(slot, 0, &session))
 		return -1;
-
-	rv = pkcs11_find_certs(token, session);
-	pkcs11_put_session(slot, session);
+	rv = pkcs11_find_certs(token, session, cert_template);
+	pkcs11_put_session(slot, 0, session);
 	if (rv < 0) {
 		pkcs11_destroy_certs(token);
 		return -1;
 	}
+	return 0;
+}
+
+/*
+ * Enumerate the certs on the card
+ * Only the certs matching the template are searched on the token,
+ * but the returned array also contains the certs found previously
+ */
+int pkcs11_enumerate_certs(PKCS11_TOKEN *token,
+		const PKCS11_CERT *cert_template,
+		PKCS11_CERT **certp, unsigned int *countp)
+{
+	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(token);
+
+	/* The certs loaded from the metadata cache are not searched again */
+	if (!pkcs11_metadata_enumerate(token, CKO_CERTIFICATE) &&
+			pkcs11_search_certs(token, cert_template))
+		return -1;
 
 	if (certp)
 		*certp = tpriv->certs;
@@ -74,148 +92,469 @@ int pkcs11_remove_certificate(PKCS11_CERT *cert)
 		return -1;
 
 	rv = CRYPTOKI_call(ctx, C_DestroyObject(session, cpriv->object));
-	pkcs11_put_session(slot, session);
+	pkcs11_put_session(slot, 1, session);
 
 	CRYPTOKI_checkerr(CKR_F_PKCS11_REMOVE_CERTIFICATE, rv);
 	return 0;
 }
 
+/* Lookup arguments for the certificate indexes */
+typedef struct {
+	const PKCS11_TOKEN_private *tpriv;
+	CK_OBJECT_HANDLE object;
+	const unsigned char *id;
+	size_t id_len;
+} PKCS11_CERT_MATCH;
+
+static int pkcs11_match_cert_handle(const void *arg, unsigned int item)
+{
+	const PKCS11_CERT_MATCH *m = arg;
+
+	return PRIVCERT(m->tpriv->certs + item)->object == m->object;
+}
+
+static int pkcs11_match_cert_id(const void *arg, unsigned int item)
+{
+	const PKCS11_CERT_MATCH *m = arg;
+	PKCS11_CERT_private *cpriv = PRIVCERT(m->tpriv->certs + item);
+
+	return cpriv->id_len == m->id_len && !memcmp(cpriv->id, m->id, m->id_len);
+}
+
 /*
  * Find certificate matching a key
  */
 PKCS11_CERT *pkcs11_find_certificate(PKCS11_KEY *key)
 {
-	PKCS11_KEY_private *kpriv;
-	PKCS11_CERT_private *cpriv;
-	PKCS11_CERT *cert;
-	unsigned int n, count;
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(KEY2TOKEN(key));
+	PKCS11_CERT_MATCH m;
+	PKCS11_CERT cert_template;
+	int i;
 
-	kpriv = PRIVKEY(key);
-	if (PKCS11_enumerate_certs(KEY2TOKEN(key), &cert, &count))
+	/* Only search the token for certificates with the specified ID */
+	memset(&cert_template, 0, sizeof cert_template);
+	cert_template.id = kpriv->id;
+	cert_template.id_len = kpriv->id_len;
+	if (pkcs11_enumerate_certs(KEY2TOKEN(key),
+			kpriv->id_len ? &cert_template : NULL, NULL, NULL))
 		return NULL;
-	for (n = 0; n < count; n++, cert++) {
-		cpriv = PRIVCERT(cert);
-		if (cpriv->id_len == kpriv->id_len
-				&& !memcmp(cpriv->id, kpriv->id, kpriv->id_len))
-			return cert;
+	m.tpriv = tpriv;
+	m.id = kpriv->id;
+	m.id_len = kpriv->id_len;
+	i = pkcs11_index_find(&tpriv->certs_by_id,
+		pkcs11_hash_bytes(kpriv->id, kpriv->id_len),
+		pkcs11_match_cert_id, &m);
+	return i < 0 ? NULL : tpriv->certs + i;
+}
+
+/*
+ * Build the search template of the certs matching cert_template
+ * Returns the number of attributes, at most 3
+ */
+static CK_ULONG pkcs11_cert_search_attrs(CK_ATTRIBUTE *cert_search_attrs,
+		const PKCS11_CERT *cert_template)
+{
+	static CK_OBJECT_CLASS cert_search_class = CKO_CERTIFICATE;
+	CK_ULONG n = 0;
+
+	cert_search_attrs[n].type = CKA_CLASS;
+	cert_search_attrs[n].pValue = &cert_search_class;
+	cert_search_attrs[n++].ulValueLen = sizeof(cert_search_class);
+	if (cert_template && cert_template->id_len) {
+		cert_search_attrs[n].type = CKA_ID;
+		cert_search_attrs[n].pValue = cert_template->id;
+		cert_search_attrs[n++].ulValueLen = cert_template->id_len;
+	}
+	if (cert_template && cert_template->label) {
+		cert_search_attrs[n].type = CKA_LABEL;
+		cert_search_attrs[n].pValue = cert_template->label;
+		cert_search_attrs[n++].ulValueLen = strlen(cert_template->label);
 	}
-	return NULL;
+	return n;
 }
 
 /*
  * Find all certs of a given type (public or private)
  */
-static int pkcs11_find_certs(PKCS11_TOKEN *token, CK_SESSION_HANDLE session)
+static int pkcs11_find_certs(PKCS11_TOKEN *token, CK_SESSION_HANDLE session,
+		const PKCS11_CERT *cert_template)
 {
-	PKCS11_SLOT *slot = TOKEN2SLOT(token);
-	PKCS11_CTX *ctx = SLOT2CTX(slot);
-	CK_OBJECT_CLASS cert_search_class;
-	CK_ATTRIBUTE cert_search_attrs[] = {
-		{CKA_CLASS, &cert_search_class, sizeof(cert_search_class)},
-	};
-	int rv, res = -1;
+	CK_ATTRIBUTE cert_search_attrs[3];
+	CK_ULONG n;
 
-	/* Tell the PKCS11 lib to enumerate all matching objects */
-	cert_search_class = CKO_CERTIFICATE;
-	rv = CRYPTOKI_call(ctx, C_FindObjectsInit(session, cert_search_attrs, 1));
-	CRYPTOKI_checkerr(CKR_F_PKCS11_FIND_CERTS, rv);
+	n = pkcs11_cert_search_attrs(cert_search_attrs, cert_template);
+	return pkcs11_find_objects(token, session, cert_search_attrs, n,
+		CKR_F_PKCS11_FIND_CERTS, pkcs11_next_cert, NULL);
+}
 
-	do {
-		res = pkcs11_next_cert(ctx, token, session);
-	} while (res == 0);
+/* Forget the current certificate of the iterator */
+static void pkcs11_cert_iter_clear(PKCS11_CERT_ITER *iter)
+{
+	if (iter->cert.x509)
+		X509_free(iter->cert.x509);
+	OPENSSL_free(iter->cert.label);
+	OPENSSL_free(iter->cert.id);
+	memset(&iter->cert, 0, sizeof(PKCS11_CERT));
+	memset(&iter->cpriv, 0, sizeof(PKCS11_CERT_private));
+}
 
-	CRYPTOKI_call(ctx, C_FindObjectsFinal(session));
+/*
+ * Start iterating over the certs matching cert_template
+ */
+PKCS11_CERT_ITER *pkcs11_cert_iter_new(PKCS11_TOKEN *token,
+		const PKCS11_CERT *cert_template)
+{
+	PKCS11_CERT_ITER *iter;
+	CK_ATTRIBUTE cert_search_attrs[3];
+	CK_ULONG n;
 
-	return (res < 0) ? -1 : 0;
+	iter = OPENSSL_malloc(sizeof(PKCS11_CERT_ITER));
+	if (!iter)
+		return NULL;
+	memset(iter, 0, sizeof(PKCS11_CERT_ITER));
+	n = pkcs11_cert_search_attrs(cert_search_attrs, cert_template);
+	if (pkcs11_object_iter_init(&iter->objects, token, cert_search_attrs, n,
+			CKR_F_PKCS11_FIND_CERTS)) {
+		OPENSSL_free(iter);
+		return NULL;
+	}
+	return iter;
 }
 
-static int pkcs11_next_cert(PKCS11_CTX *ctx, PKCS11_TOKEN *token,
-		CK_SESSION_HANDLE session)
+/*
+ * Get the next X.509 certificate
+ * Only the attributes of the current certificate are retrieved, and the
+ * certificate is valid until the next call or until the iterator is freed.
+ * Returns 0 on success with *cert set to NULL after the last certificate,
+ * or -1 on error
+ */
+int pkcs11_cert_iter_next(PKCS11_CERT_ITER *iter, PKCS11_CERT **cert)
 {
+	PKCS11_TOKEN *token = iter->objects.token;
+	PKCS11_CTX *ctx = TOKEN2CTX(token);
+	CK_ATTRIBUTE attrs[] = {
+		{CKA_CERTIFICATE_TYPE, NULL, 0},
+		{CKA_LABEL, NULL, 0},
+		{CKA_ID, NULL, 0},
+		{CKA_VALUE, NULL, 0}
+	};
 	CK_OBJECT_HANDLE obj;
-	CK_ULONG count;
 	int rv;
 
-	/* Get the next matching object */
-	rv = CRYPTOKI_call(ctx, C_FindObjects(session, &obj, 1, &count));
-	CRYPTOKI_checkerr(CKR_F_PKCS11_NEXT_CERT, rv);
+	pkcs11_cert_iter_clear(iter);
+	*cert = NULL;
+	do {
+		rv = pkcs11_object_iter_next(&iter->objects, &obj);
+		if (rv <= 0)
+			return rv;
+		if (pkcs11_getattr_list(ctx, iter->objects.session, obj, attrs, 4))
+			return -1;
+		/* Skip the certificates of other types */
+		if (attrs[0].ulValueLen == sizeof(CK_CERTIFICATE_TYPE) &&
+				*(CK_CERTIFICATE_TYPE *)attrs[0].pValue == CKC_X_509)
+			break;
+		pkcs11_zap_attrs(attrs, 4);
+	} while (1);
+
+	iter->cert.label = attrs[1].pValue;
+	attrs[1].pValue = NULL;
+	if (attrs[2].pValue) {
+		iter->cert.id = attrs[2].pValue;
+		iter->cert.id_len = attrs[2].ulValueLen;
+		attrs[2].pValue = NULL;
+	}
+	if (attrs[3].pValue) {
+		const unsigned char *p = attrs[3].pValue;
+
+		iter->cert.x509 = d2i_X509(NULL, &p, (long)attrs[3].ulValueLen);
+	}
+	pkcs11_zap_attrs(attrs, 4);
+
+	iter->cert._private = &iter->cpriv;
+	iter->cpriv.object = obj;
+	iter->cpriv.parent = token;
+	iter->cpriv.id = iter->cert.id;
+	iter->cpriv.id_len = iter->cert.id_len;
+	iter->cpriv.forkid = get_forkid();
+	*cert = &iter->cert;
+	return 0;
+}
+
+void pkcs11_cert_iter_free(PKCS11_CERT_ITER *iter)
+{
+	if (!iter)
+		return;
+	pkcs11_cert_iter_clear(iter);
+	pkcs11_object_iter_release(&iter->objects);
+	OPENSSL_free(iter);
+}
 
-	if (count == 0)
-		return 1;
+static int pkcs11_next_cert(PKCS11_TOKEN *token, CK_SESSION_HANDLE session,
+		CK_OBJECT_HANDLE obj, void *arg)
+{
+	(void)arg;
 
-	if (pkcs11_init_cert(ctx, token, session, obj, NULL))
+	if (pkcs11_init_cert(TOKEN2CTX(token), token, session, obj, NULL))
 		return -1;
-
 	return 0;
 }
 
-static int pkcs11_init_cert(PKCS11_CTX *ctx, PKCS11_TOKEN *token,
-		CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj, PKCS11_CERT ** ret)
+/* Whether the object handle was already added to the certificates */
+static int pkcs11_cert_known(PKCS11_TOKEN_private *tpriv, CK_OBJECT_HANDLE obj)
 {
-	PKCS11_TOKEN_private *tpriv;
-	PKCS11_CERT_private *cpriv;
-	PKCS11_CERT *cert, *tmp;
-	unsigned char *data;
-	CK_CERTIFICATE_TYPE cert_type;
-	size_t size;
+	CK_OBJECT_HANDLE object;
+	PKCS11_CERT_MATCH m;
 	int i;
 
-	(void)ctx;
-	(void)session;
-
-	/* Ignore unknown certificate types */
-	size = sizeof(CK_CERTIFICATE_TYPE);
-	if (pkcs11_getattr_var(ctx, session, obj, CKA_CERTIFICATE_TYPE, (CK_BYTE *)&cert_type, &size))
-		return -1;
-	if (cert_type != CKC_X_509)
-		return 0;
+	if (!tpriv->certs_by_handle.size && tpriv->ncerts) {
+		/* Rebuild the handle index invalidated by reloading a certificate,
+		 * without the certificates of the metadata cache not found yet */
+		if (pkcs11_index_reserve(&tpriv->certs_by_handle, tpriv->ncerts))
+			return -1;
+		for (i = 0; i < tpriv->ncerts; i++) {
+			object = PRIVCERT(tpriv->certs + i)->object;
+			if (object != CK_INVALID_HANDLE)
+				pkcs11_index_insert(&tpriv->certs_by_handle,
+					pkcs11_hash_handle(object), i);
+		}
+	}
+	m.tpriv = tpriv;
+	m.object = obj;
+	return pkcs11_index_find(&tpriv->certs_by_handle, pkcs11_hash_handle(obj),
+		pkcs11_match_cert_handle, &m) >= 0;
+}
 
-	/* Prevent re-adding existing PKCS#11 object handles */
-	/* TODO: Rewrite the O(n) algorithm as O(log n),
-	 * or it may be too slow with a large number of certificates */
-	for (i=0; i < PRIVTOKEN(token)->ncerts; ++i)
-		if (PRIVCERT(PRIVTOKEN(token)->certs + i)->object == obj)
-			return 0;
+/*
+ * Add a certificate with its label and ID, and the decoded x509 if known
+ * The label and the ID remain owned by the caller, and x509 is taken over.
+ */
+static int pkcs11_new_cert(PKCS11_TOKEN *token, CK_OBJECT_HANDLE obj,
+		const char *label_in, size_t label_len,
+		const unsigned char *id_in, size_t id_len,
+		X509 *x509, PKCS11_CERT **ret)
+{
+	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(token);
+	PKCS11_CERT_private *cpriv;
+	PKCS11_CERT *cert, *tmp;
+	PKCS11_CERT_MATCH m;
+	unsigned long id_hash;
+	unsigned char *id;
+	char *label;
+	int alloc;
 
 	/* Allocate memory */
-	cpriv = OPENSSL_malloc(sizeof(PKCS11_CERT_private));
-	if (!cpriv)
-		return -1;
-	memset(cpriv, 0, sizeof(PKCS11_CERT_private));
-	tpriv = PRIVTOKEN(token);
-	tmp = OPENSSL_realloc(tpriv->certs,
-		(tpriv->ncerts + 1) * sizeof(PKCS11_CERT));
-	if (!tmp) {
-		OPENSSL_free(cpriv);
-		return -1;
+	if (pkcs11_index_reserve(&tpriv->certs_by_handle, 1) ||
+			pkcs11_index_reserve(&tpriv->certs_by_id, 1))
+		goto fail;
+	if (tpriv->ncerts == tpriv->certs_alloc) {
+		/* Grow geometrically to avoid copying the array for each cert */
+		alloc = tpriv->certs_alloc ?
+			2 * tpriv->certs_alloc : PKCS11_OBJECTS_MIN_ALLOC;
+		tmp = OPENSSL_realloc(tpriv->certs, alloc * sizeof(PKCS11_CERT));
+		if (!tmp)
+			goto fail;
+		tpriv->certs = tmp;
+		tpriv->certs_alloc = alloc;
 	}
-	tpriv->certs = tmp;
+	cpriv = pkcs11_arena_alloc(&tpriv->certs_arena, sizeof(PKCS11_CERT_private));
+	label = label_in ? pkcs11_arena_memdup(&tpriv->certs_arena,
+		label_in, label_len) : NULL;
+	id = id_in ? pkcs11_arena_memdup(&tpriv->certs_arena,
+		id_in, id_len) : NULL;
+	if (!cpriv || (label_in && !label) || (id_in && !id))
+		goto fail;
+	memset(cpriv, 0, sizeof(PKCS11_CERT_private));
 	cert = tpriv->certs + tpriv->ncerts++;
 	memset(cert, 0, sizeof(PKCS11_CERT));
 
 	/* Fill public properties */
-	pkcs11_getattr_alloc(ctx, session, obj, CKA_LABEL, (CK_BYTE **)&cert->label, NULL);
-	size = 0;
-	if (!pkcs11_getattr_alloc(ctx, session, obj, CKA_VALUE, &data, &size)) {
-		const unsigned char *p = data;
-
-		cert->x509 = d2i_X509(NULL, &p, (long)size);
-		OPENSSL_free(data);
+	cert->label = label;
+	if (id) {
+		cert->id = id;
+		cert->id_len = id_len;
 	}
-	cert->id_len = 0;
-	pkcs11_getattr_alloc(ctx, session, obj, CKA_ID, &cert->id, &cert->id_len);
+	cert->x509 = x509;
 
 	/* Fill private properties */
 	cert->_private = cpriv;
 	cpriv->object = obj;
 	cpriv->parent = token;
-	cpriv->id_len = sizeof cpriv->id;
-	if (pkcs11_getattr_var(ctx, session, obj, CKA_ID, cpriv->id, &cpriv->id_len))
-		cpriv->id_len = 0;
+	cpriv->id = cert->id;
+	cpriv->id_len = cert->id_len;
+
+	/* Only the first certificate with a given CKA_ID is indexed by its ID */
+	if (obj != CK_INVALID_HANDLE)
+		pkcs11_index_insert(&tpriv->certs_by_handle,
+			pkcs11_hash_handle(obj), tpriv->ncerts - 1);
+	m.tpriv = tpriv;
+	m.id = cpriv->id;
+	m.id_len = cpriv->id_len;
+	id_hash = pkcs11_hash_bytes(cpriv->id, cpriv->id_len);
+	if (pkcs11_index_find(&tpriv->certs_by_id, id_hash,
+			pkcs11_match_cert_id, &m) < 0)
+		pkcs11_index_insert(&tpriv->certs_by_id, id_hash, tpriv->ncerts - 1);
 
 	if (ret)
 		*ret = cert;
 	return 0;
+
+fail:
+	if (x509)
+		X509_free(x509);
+	return -1;
+}
+
+/*
+ * Assign the handle of a certificate found on the token to the certificate
+ * with the same CKA_ID loaded from the metadata cache, if it has no handle yet
+ * Returns 1 if the certificate was assigned the handle, 0 if there is no
+ * such certificate, or -1 on memory allocation failure
+ */
+static int pkcs11_resolve_cached_cert(PKCS11_TOKEN *token,
+		CK_OBJECT_HANDLE obj, const CK_ATTRIBUTE *id)
+{
+	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(token);
+	PKCS11_CERT_private *cpriv;
+	PKCS11_CERT_MATCH m;
+	int i;
+
+	if (!tpriv->metadata.map || !id->pValue)
+		return 0;
+	m.tpriv = tpriv;
+	m.id = id->pValue;
+	m.id_len = id->ulValueLen;
+	i = pkcs11_index_find(&tpriv->certs_by_id,
+		pkcs11_hash_bytes(m.id, m.id_len), pkcs11_match_cert_id, &m);
+	if (i < 0)
+		return 0;
+	cpriv = PRIVCERT(tpriv->certs + i);
+	if (cpriv->object != CK_INVALID_HANDLE)
+		return 0;
+	if (pkcs11_index_reserve(&tpriv->certs_by_handle, 1))
+		return -1;
+	cpriv->object = obj;
+	pkcs11_index_insert(&tpriv->certs_by_handle, pkcs11_hash_handle(obj), i);
+	p11_atomic_store(&cpriv->forkid, PRIVSLOT(TOKEN2SLOT(token))->forkid);
+	return 1;
+}
+
+static int pkcs11_init_cert(PKCS11_CTX *ctx, PKCS11_TOKEN *token,
+		CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj, PKCS11_CERT ** ret)
+{
+	CK_ATTRIBUTE attrs[] = {
+		{CKA_CERTIFICATE_TYPE, NULL, 0},
+		{CKA_LABEL, NULL, 0},
+		{CKA_ID, NULL, 0},
+		{CKA_VALUE, NULL, 0}
+	};
+	/* The value of lazily decoded certificates is retrieved later */
+	unsigned int nattrs = PRIVCTX(ctx)->lazy_x509 ? 3 : 4;
+	X509 *x509 = NULL;
+	int rv;
+
+	/* Prevent re-adding existing PKCS#11 object handles */
+	rv = pkcs11_cert_known(PRIVTOKEN(token), obj);
+	if (rv)
+		return rv > 0 ? 0 : -1;
+
+	/* Retrieve all the attributes at once */
+	if (pkcs11_getattr_list(ctx, session, obj, attrs, nattrs))
+		return -1;
+
+	/* Ignore unknown certificate types */
+	if (attrs[0].ulValueLen != sizeof(CK_CERTIFICATE_TYPE)) {
+		pkcs11_zap_attrs(attrs, nattrs);
+		return -1;
+	}
+	if (*(CK_CERTIFICATE_TYPE *)attrs[0].pValue != CKC_X_509) {
+		pkcs11_zap_attrs(attrs, nattrs);
+		return 0;
+	}
+	rv = pkcs11_resolve_cached_cert(token, obj, &attrs[2]);
+	if (rv) {
+		pkcs11_zap_attrs(attrs, nattrs);
+		return rv > 0 ? 0 : -1;
+	}
+
+	if (nattrs > 3 && attrs[3].pValue) {
+		const unsigned char *p = attrs[3].pValue;
+
+		x509 = d2i_X509(NULL, &p, (long)attrs[3].ulValueLen);
+	}
+	rv = pkcs11_new_cert(token, obj, attrs[1].pValue, attrs[1].ulValueLen,
+		attrs[2].pValue, attrs[2].ulValueLen, x509, ret);
+	pkcs11_zap_attrs(attrs, nattrs);
+	return rv;
+}
+
+/*
+ * Add a certificate created on the token by this process, without
+ * reading back its attributes
+ * A copy of x509 is kept unless the certificates are decoded lazily.
+ */
+int pkcs11_add_cert(PKCS11_TOKEN *token, CK_OBJECT_HANDLE obj, X509 *x509,
+		const char *label, const unsigned char *id, size_t id_len,
+		PKCS11_CERT **ret)
+{
+	X509 *copy = NULL;
+	int rv;
+
+	rv = pkcs11_cert_known(PRIVTOKEN(token), obj);
+	if (rv)
+		return rv > 0 ? 0 : -1;
+	if (!PRIVCTX(TOKEN2CTX(token))->lazy_x509) {
+		copy = X509_dup(x509);
+		if (!copy)
+			return -1;
+	}
+	return pkcs11_new_cert(token, obj, label, label ? strlen(label) : 0,
+		id && id_len ? id : NULL, id_len, copy, ret);
+}
+
+/*
+ * Get the X.509 certificate, decoding it on first use
+ * Concurrent callers may both decode it, but only one copy is kept
+ */
+X509 *pkcs11_get_x509(PKCS11_CERT *cert)
+{
+	PKCS11_SLOT *slot = CERT2SLOT(cert);
+	PKCS11_CTX *ctx = CERT2CTX(cert);
+	PKCS11_CERT_private *cpriv = PRIVCERT(cert);
+	CK_SESSION_HANDLE session;
+	const unsigned char *p;
+	CK_BYTE *data;
+	size_t size;
+	X509 *x509;
+	int rv;
+
+	x509 = p11_atomic_load_ptr(&cert->x509);
+	if (x509)
+		return x509;
+
+	if (cpriv->der) { /* Loaded from the metadata cache */
+		p = cpriv->der;
+		x509 = d2i_X509(NULL, &p, (long)cpriv->der_len);
+	} else {
+		if (pkcs11_get_session(slot, 0, &session))
+			return NULL;
+		rv = pkcs11_getattr_alloc(ctx, session, cpriv->object,
+			CKA_VALUE, &data, &size);
+		pkcs11_put_session(slot, 0, session);
+		if (rv)
+			return NULL;
+		p = data;
+		x509 = d2i_X509(NULL, &p, (long)size);
+		OPENSSL_free(data);
+	}
+	if (!x509)
+		return NULL;
+
+	if (!p11_atomic_cas_ptr(&cert->x509, NULL, x509)) {
+		X509_free(x509);
+		x509 = p11_atomic_load_ptr(&cert->x509);
+	}
+	return x509;
 }
 
 /*
@@ -226,15 +565,23 @@ int pkcs11_reload_certificate(PKCS11_CERT *cert)
 	PKCS11_SLOT *slot = CERT2SLOT(cert);
 	PKCS11_CTX *ctx = CERT2CTX(cert);
 	PKCS11_CERT_private *cpriv = PRIVCERT(cert);
+	CK_OBJECT_HANDLE object = cpriv->object;
 	CK_ULONG count = 0;
 	CK_ATTRIBUTE search_parameters[32];
 	CK_SESSION_HANDLE session;
+	unsigned long start;
 	unsigned int n = 0;
 	int rv;
 
 	if (pkcs11_get_session(slot, 0, &session))
 		return -1;
 
+	/* Keep the handle if it still refers to the certificate */
+	if (pkcs11_check_object(ctx, session, object, CKO_CERTIFICATE,
+			cpriv->id, cpriv->id_len)) {
+		pkcs11_put_session(slot, 0, session);
+		return 0;
+	}
 	pkcs11_addattr_int(search_parameters + n++, CKA_CLASS, CKO_CERTIFICATE);
 	if (cert->id && cert->id_len) {
 		pkcs11_addattr(search_parameters + n++, CKA_ID, cert->id, cert->id_len);
@@ -246,16 +593,60 @@ int pkcs11_reload_certificate(PKCS11_CERT *cert)
 	rv = CRYPTOKI_call(ctx,
 		C_FindObjectsInit(session, search_parameters, n));
 	if (rv == CKR_OK) {
+		start = pkcs11_stats_time();
 		rv = CRYPTOKI_call(ctx,
 			C_FindObjects(session, &cpriv->object, 1, &count));
+		pkcs11_stats_record(slot, PKCS11_STATS_FIND,
+			PKCS11_STATS_NO_MECHANISM, rv, start);
 		CRYPTOKI_call(ctx, C_FindObjectsFinal(session));
 	}
-	pkcs11_put_session(slot, session);
+	pkcs11_put_session(slot, 0, session);
 	pkcs11_zap_attrs(search_parameters, n);
 	CRYPTOKI_checkerr(CKR_F_PKCS11_RELOAD_CERTIFICATE, rv);
 
-	if (count != 1)
+	/* The handle index is rebuilt on the next enumeration */
+	if (cpriv->object != object)
+		pkcs11_index_free(&PRIVTOKEN(CERT2TOKEN(cert))->certs_by_handle);
+	if (count != 1) {
+		/* A certificate of the metadata cache no longer on the token */
+		if (cpriv->object == CK_INVALID_HANDLE) {
+			pkcs11_metadata_stale(CERT2TOKEN(cert));
+			CKRerr(CKR_F_PKCS11_RELOAD_CERTIFICATE,
+				CKR_OBJECT_HANDLE_INVALID);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Add a certificate loaded from the metadata cache
+ * The certificate has no object handle until check_cert_fork() reloads it
+ * on first use, and the DER value remains owned by the cache.
+ */
+int pkcs11_add_cached_cert(PKCS11_TOKEN *token, const char *label,
+		const unsigned char *id, size_t id_len,
+		const unsigned char *der, size_t der_len)
+{
+	PKCS11_CERT_private *cpriv;
+	PKCS11_CERT *cert = NULL;
+	X509 *x509 = NULL;
+	const unsigned char *p = der;
+
+	if (!PRIVCTX(TOKEN2CTX(token))->lazy_x509) {
+		x509 = d2i_X509(NULL, &p, (long)der_len);
+		if (!x509)
+			return -1;
+	}
+	if (pkcs11_new_cert(token, CK_INVALID_HANDLE, label,
+			label ? strlen(label) : 0, id_len ? id : NULL, id_len,
+			x509, &cert))
 		return -1;
+	cpriv = PRIVCERT(cert);
+	cpriv->der = der;
+	cpriv->der_len = der_len;
+	/* Any other value than the forkid of the slot triggers the reload */
+	cpriv->forkid = PRIVSLOT(TOKEN2SLOT(token))->forkid - 1;
 	return 0;
 }
 
@@ -271,31 +662,29 @@ void pkcs11_destroy_certs(PKCS11_TOKEN *token)
 
 		if (cert->x509)
 			X509_free(cert->x509);
-		OPENSSL_free(cert->label);
-		if (cert->id)
-			OPENSSL_free(cert->id);
-		if (cert->_private)
-			OPENSSL_free(cert->_private);
 	}
 	if (tpriv->certs)
 		OPENSSL_free(tpriv->certs);
 	tpriv->certs = NULL;
-	tpriv->ncerts = 0;
+	tpriv->ncerts = tpriv->certs_alloc = 0;
+	pkcs11_index_free(&tpriv->certs_by_handle);
+	pkcs11_index_free(&tpriv->certs_by_id);
+	/* The private data, labels and IDs of all the certificates */
+	pkcs11_arena_free(&tpriv->certs_arena);
 }
 
 /*
  * Store certificate
  */
-int pkcs11_store_certificate(PKCS11_TOKEN *token, X509 *x509, char *label,
-		unsigned char *id, size_t id_len, PKCS11_CERT ** ret_cert)
+/*
+ * Build the template of a certificate object
+ * The template is released with pkcs11_zap_attrs()
+ * Returns the number of attributes
+ */
+unsigned int pkcs11_cert_create_template(CK_ATTRIBUTE *attrs, X509 *x509,
+		const char *label, const unsigned char *id, size_t id_len)
 {
-	PKCS11_SLOT *slot = TOKEN2SLOT(token);
-	PKCS11_CTX *ctx = SLOT2CTX(slot);
-	CK_SESSION_HANDLE session;
-	CK_OBJECT_HANDLE object;
-	CK_ATTRIBUTE attrs[32];
-	unsigned int n = 0, r = -1;
-	int rv;
+	unsigned int n = 0;
 	int signature_nid;
 	int evp_md_nid = NID_sha1;
 	const EVP_MD* evp_md;
@@ -303,10 +692,6 @@ int pkcs11_store_certificate(PKCS11_TOKEN *token, X509 *x509, char *label,
 	unsigned char md[EVP_MAX_MD_SIZE];
 	unsigned int md_len;
 
-	/* First, make sure we have a session */
-	if (pkcs11_get_session(slot, 1, &session))
-		return -1;
-
 	/* Now build the template */
 	pkcs11_addattr_int(attrs + n++, CKA_CLASS, CKO_CERTIFICATE);
 	pkcs11_addattr_bool(attrs + n++, CKA_TOKEN, TRUE);
@@ -356,6 +741,25 @@ int pkcs11_store_certificate(PKCS11_TOKEN *token, X509 *x509, char *label,
 		pkcs11_addattr_s(attrs + n++, CKA_LABEL, label);
 	if (id && id_len)
 		pkcs11_addattr(attrs + n++, CKA_ID, id, id_len);
+	return n;
+}
+
+int pkcs11_store_certificate(PKCS11_TOKEN *token, X509 *x509, char *label,
+		unsigned char *id, size_t id_len, PKCS11_CERT ** ret_cert)
+{
+	PKCS11_SLOT *slot = TOKEN2SLOT(token);
+	PKCS11_CTX *ctx = SLOT2CTX(slot);
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE object;
+	CK_ATTRIBUTE attrs[32];
+	unsigned int n, r = -1;
+	int rv;
+
+	/* First, make sure we have a session */
+	if (pkcs11_get_session(slot, 1, &session))
+		return -1;
+
+	n = pkcs11_cert_create_template(attrs, x509, label, id, id_len);
 
 	/* Now call the pkcs11 module to create the object */
 	rv = CRYPTOKI_call(ctx, C_CreateObject(session, attrs, n, &object));
@@ -367,7 +771,7 @@ int pkcs11_store_certificate(PKCS11_TOKEN *token, X509 *x509, char *label,
 	if (rv == CKR_OK) {
 		r = pkcs11_init_cert(ctx, token, session, object, ret_cert);
 	}
-	pkcs11_put_session(slot, session);
+	pkcs11_put_session(slot, 1, session);
 
 	CRYPTOKI_checkerr(CKR_F_PKCS11_STORE_CERTIFICATE, rv);
 	return r;
@@ -0,0 +1,394 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Multi-part encryption and decryption with the AES keys of a token
+ *
+ * A cipher holds a session of the slot from its creation until it is
+ * freed, as the token keeps the state of a multi-part operation in the
+ * session, and the imported keys are session objects destroyed with the
+ * session that created them.  The data is passed to C_EncryptUpdate() and
+ * C_DecryptUpdate() in place, split into chunks only when the context
+ * limits their size.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+
+/* Extra room for the final block or tag of an abandoned operation */
+#define PKCS11_CIPHER_SLACK 64
+
+struct PKCS11_cipher_st {
+	PKCS11_TOKEN *token; /* its slot may move to another slot list */
+	CK_SESSION_HANDLE session; /* CK_INVALID_HANDLE once closed */
+	CK_OBJECT_HANDLE object;
+	int imported; /* a session object destroyed with the cipher */
+	unsigned int forkid;
+	CK_RV rv; /* of the last failed call, for returning the session */
+	/* operation in progress */
+	int active, encrypt;
+	CK_MECHANISM_TYPE mechanism;
+	unsigned long start;
+	size_t in_total, out_total; /* for the output withheld by the token */
+};
+#define CIPHER2SLOT(cipher)	TOKEN2SLOT((cipher)->token)
+
+/*
+ * Set the maximum number of bytes passed with each C_EncryptUpdate()
+ * or C_DecryptUpdate() call
+ */
+void pkcs11_CTX_set_cipher_chunk(PKCS11_CTX *ctx, unsigned int size)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	p11_atomic_store(&cpriv->cipher_chunk, size);
+}
+
+/* Allocate a cipher holding a session of the slot of the token */
+static PKCS11_CIPHER *pkcs11_cipher_alloc(PKCS11_TOKEN *token)
+{
+	PKCS11_SLOT *slot = TOKEN2SLOT(token);
+	PKCS11_CIPHER *cipher;
+
+	cipher = OPENSSL_malloc(sizeof(PKCS11_CIPHER));
+	if (!cipher) {
+		CKRerr(CKR_F_PKCS11_CIPHER_NEW, CKR_HOST_MEMORY);
+		return NULL;
+	}
+	memset(cipher, 0, sizeof(PKCS11_CIPHER));
+	cipher->token = token;
+	cipher->object = CK_INVALID_HANDLE;
+	cipher->forkid = get_forkid();
+	if (pkcs11_get_session(slot, 0, &cipher->session)) {
+		OPENSSL_free(cipher);
+		return NULL;
+	}
+	return cipher;
+}
+
+PKCS11_CIPHER *pkcs11_cipher_new(PKCS11_TOKEN *token,
+		const char *label, const unsigned char *id, size_t id_len)
+{
+	PKCS11_CTX *ctx = TOKEN2CTX(token);
+	PKCS11_CIPHER *cipher;
+	CK_OBJECT_CLASS class = CKO_SECRET_KEY;
+	CK_KEY_TYPE key_type = CKK_AES;
+	CK_ATTRIBUTE attrs[4] = {
+		{CKA_CLASS, &class, sizeof(class)},
+		{CKA_KEY_TYPE, &key_type, sizeof(key_type)},
+	};
+	CK_ULONG n = 2, count = 0;
+	unsigned long start;
+	int rv;
+
+	if (label) {
+		attrs[n].type = CKA_LABEL;
+		attrs[n].pValue = (void *)label;
+		attrs[n++].ulValueLen = strlen(label);
+	}
+	if (id && id_len) {
+		attrs[n].type = CKA_ID;
+		attrs[n].pValue = (void *)id;
+		attrs[n++].ulValueLen = id_len;
+	}
+
+	cipher = pkcs11_cipher_alloc(token);
+	if (!cipher)
+		return NULL;
+	rv = CRYPTOKI_call(ctx, C_FindObjectsInit(cipher->session, attrs, n));
+	if (rv == CKR_OK) {
+		start = pkcs11_stats_time();
+		rv = CRYPTOKI_call(ctx,
+			C_FindObjects(cipher->session, &cipher->object, 1, &count));
+		pkcs11_stats_record(CIPHER2SLOT(cipher), PKCS11_STATS_FIND,
+			PKCS11_STATS_NO_MECHANISM, rv, start);
+		CRYPTOKI_call(ctx, C_FindObjectsFinal(cipher->session));
+	}
+	if (rv == CKR_OK && count == 0)
+		rv = CKR_KEY_HANDLE_INVALID;
+	if (rv != CKR_OK) {
+		pkcs11_cipher_free(cipher);
+		CKRerr(CKR_F_PKCS11_CIPHER_NEW, rv);
+		return NULL;
+	}
+	return cipher;
+}
+
+PKCS11_CIPHER *pkcs11_cipher_import(PKCS11_TOKEN *token,
+		const unsigned char *key, size_t key_len)
+{
+	PKCS11_CTX *ctx = TOKEN2CTX(token);
+	PKCS11_CIPHER *cipher;
+	CK_OBJECT_CLASS class = CKO_SECRET_KEY;
+	CK_KEY_TYPE key_type = CKK_AES;
+	CK_BBOOL _true = TRUE, _false = FALSE;
+	CK_ATTRIBUTE attrs[] = {
+		{CKA_CLASS, &class, sizeof(class)},
+		{CKA_KEY_TYPE, &key_type, sizeof(key_type)},
+		{CKA_TOKEN, &_false, sizeof(_false)},
+		{CKA_PRIVATE, &_false, sizeof(_false)},
+		{CKA_SENSITIVE, &_true, sizeof(_true)},
+		{CKA_ENCRYPT, &_true, sizeof(_true)},
+		{CKA_DECRYPT, &_true, sizeof(_true)},
+		{CKA_VALUE, (void *)key, key_len},
+	};
+	int rv;
+
+	if (key_len != 16 && key_len != 24 && key_len != 32) {
+		CKRerr(CKR_F_PKCS11_CIPHER_NEW, CKR_KEY_SIZE_RANGE);
+		return NULL;
+	}
+	cipher = pkcs11_cipher_alloc(token);
+	if (!cipher)
+		return NULL;
+	rv = CRYPTOKI_call(ctx, C_CreateObject(cipher->session,
+		attrs, sizeof(attrs) / sizeof(CK_ATTRIBUTE), &cipher->object));
+	if (rv != CKR_OK) {
+		pkcs11_cipher_free(cipher);
+		CKRerr(CKR_F_PKCS11_CIPHER_NEW, rv);
+		return NULL;
+	}
+	cipher->imported = 1;
+	return cipher;
+}
+
+/* The output the token may still return when the operation is finished */
+static size_t pkcs11_cipher_withheld(PKCS11_CIPHER *cipher)
+{
+	return cipher->in_total > cipher->out_total ?
+		cipher->in_total - cipher->out_total : 0;
+}
+
+/* Close the session of an operation that could not be terminated */
+static void pkcs11_cipher_close(PKCS11_CIPHER *cipher)
+{
+	CRYPTOKI_call(SLOT2CTX(CIPHER2SLOT(cipher)), C_CloseSession(cipher->session));
+	pkcs11_put_session_rv(CIPHER2SLOT(cipher), 0, cipher->session,
+		CKR_SESSION_CLOSED);
+	cipher->session = CK_INVALID_HANDLE;
+	cipher->object = CK_INVALID_HANDLE;
+	cipher->active = 0;
+}
+
+/*
+ * Terminate the operation in progress
+ * PKCS#11 2.x cannot cancel an operation, but any result of the final
+ * call other than CKR_BUFFER_TOO_SMALL terminates it.
+ */
+static void pkcs11_cipher_abort(PKCS11_CIPHER *cipher)
+{
+	PKCS11_CTX *ctx = SLOT2CTX(CIPHER2SLOT(cipher));
+	unsigned char *buf;
+	size_t size;
+	CK_ULONG len;
+	CK_RV rv = CKR_HOST_MEMORY;
+
+	if (!cipher->active)
+		return;
+	size = pkcs11_cipher_withheld(cipher) + PKCS11_CIPHER_SLACK;
+	len = (CK_ULONG)size;
+	buf = OPENSSL_malloc(size);
+	if (buf) {
+		if (cipher->encrypt)
+			rv = CRYPTOKI_call(ctx,
+				C_EncryptFinal(cipher->session, buf, &len));
+		else
+			rv = CRYPTOKI_call(ctx,
+				C_DecryptFinal(cipher->session, buf, &len));
+		OPENSSL_cleanse(buf, size);
+		OPENSSL_free(buf);
+	}
+	switch (rv) {
+	case CKR_BUFFER_TOO_SMALL:
+	case CKR_HOST_MEMORY:
+		pkcs11_cipher_close(cipher);
+		break;
+	default:
+		cipher->active = 0;
+	}
+}
+
+/* The session of the cipher does not survive fork() */
+static int pkcs11_cipher_check(PKCS11_CIPHER *cipher, int function)
+{
+	if (cipher->forkid != get_forkid() ||
+			cipher->session == CK_INVALID_HANDLE) {
+		CKRerr(function, CKR_SESSION_HANDLE_INVALID);
+		return -1;
+	}
+	return 0;
+}
+
+int pkcs11_cipher_init(PKCS11_CIPHER *cipher, CK_MECHANISM_TYPE mechanism,
+		int encrypt, const unsigned char *iv, size_t iv_len,
+		const unsigned char *aad, size_t aad_len)
+{
+	PKCS11_CTX *ctx = SLOT2CTX(CIPHER2SLOT(cipher));
+	CK_MECHANISM mech;
+	CK_GCM_PARAMS gcm;
+	int rv;
+
+	if (pkcs11_cipher_check(cipher, CKR_F_PKCS11_CIPHER_INIT))
+		return -1;
+	pkcs11_cipher_abort(cipher);
+	if (cipher->session == CK_INVALID_HANDLE) {
+		CKRerr(CKR_F_PKCS11_CIPHER_INIT, CKR_SESSION_HANDLE_INVALID);
+		return -1;
+	}
+
+	memset(&mech, 0, sizeof(mech));
+	mech.mechanism = mechanism;
+	switch (mechanism) {
+	case CKM_AES_CBC:
+	case CKM_AES_CBC_PAD:
+		mech.pParameter = (void *)iv;
+		mech.ulParameterLen = iv_len;
+		break;
+	case CKM_AES_GCM:
+		memset(&gcm, 0, sizeof(gcm));
+		gcm.pIv = (void *)iv;
+		gcm.ulIvLen = iv_len;
+		gcm.ulIvBits = iv_len * 8;
+		gcm.pAAD = (void *)aad;
+		gcm.ulAADLen = aad_len;
+		gcm.ulTagBits = 128;
+		mech.pParameter = &gcm;
+		mech.ulParameterLen = sizeof(gcm);
+		break;
+	default:
+		CKRerr(CKR_F_PKCS11_CIPHER_INIT, CKR_MECHANISM_INVALID);
+		return -1;
+	}
+	rv = pkcs11_check_mechanism(CIPHER2SLOT(cipher), mechanism,
+		encrypt ? CKF_ENCRYPT : CKF_DECRYPT);
+	if (rv == CKR_OK) {
+		if (encrypt)
+			rv = CRYPTOKI_call(ctx, C_EncryptInit(cipher->session,
+				&mech, cipher->object));
+		else
+			rv = CRYPTOKI_call(ctx, C_DecryptInit(cipher->session,
+				&mech, cipher->object));
+	}
+	CRYPTOKI_checkerr(CKR_F_PKCS11_CIPHER_INIT, rv);
+
+	cipher->active = 1;
+	cipher->encrypt = encrypt;
+	cipher->mechanism = mechanism;
+	cipher->start = pkcs11_stats_time();
+	cipher->in_total = cipher->out_total = 0;
+	return 0;
+}
+
+/* Record a finished or failed operation */
+static void pkcs11_cipher_done(PKCS11_CIPHER *cipher, CK_RV rv)
+{
+	pkcs11_stats_record(CIPHER2SLOT(cipher),
+		cipher->encrypt ? PKCS11_STATS_ENCRYPT : PKCS11_STATS_DECRYPT,
+		cipher->mechanism, rv, cipher->start);
+	if (rv != CKR_OK)
+		cipher->rv = rv;
+	if (rv == CKR_BUFFER_TOO_SMALL)
+		pkcs11_cipher_abort(cipher);
+	cipher->active = 0;
+}
+
+int pkcs11_cipher_update(PKCS11_CIPHER *cipher,
+		const unsigned char *in, size_t in_len,
+		unsigned char *out, size_t *out_len)
+{
+	PKCS11_CTX *ctx = SLOT2CTX(CIPHER2SLOT(cipher));
+	size_t chunk = p11_atomic_load(&PRIVCTX(ctx)->cipher_chunk);
+	size_t done = 0, size = *out_len, n;
+	CK_ULONG len;
+	CK_RV rv = CKR_OK;
+
+	*out_len = 0;
+	if (pkcs11_cipher_check(cipher, CKR_F_PKCS11_CIPHER_UPDATE))
+		return -1;
+	if (!cipher->active) {
+		CKRerr(CKR_F_PKCS11_CIPHER_UPDATE, CKR_OPERATION_NOT_INITIALIZED);
+		return -1;
+	}
+	if (chunk == 0)
+		chunk = in_len;
+	while (done < in_len) {
+		n = in_len - done < chunk ? in_len - done : chunk;
+		len = (CK_ULONG)(size - *out_len);
+		if (cipher->encrypt)
+			rv = CRYPTOKI_call(ctx, C_EncryptUpdate(cipher->session,
+				(CK_BYTE *)in + done, n, out + *out_len, &len));
+		else
+			rv = CRYPTOKI_call(ctx, C_DecryptUpdate(cipher->session,
+				(CK_BYTE *)in + done, n, out + *out_len, &len));
+		if (rv != CKR_OK)
+			break;
+		done += n;
+		*out_len += len;
+	}
+	cipher->in_total += done;
+	cipher->out_total += *out_len;
+	if (rv != CKR_OK) {
+		pkcs11_cipher_done(cipher, rv);
+		CKRerr(CKR_F_PKCS11_CIPHER_UPDATE, rv);
+		return -1;
+	}
+	return 0;
+}
+
+int pkcs11_cipher_final(PKCS11_CIPHER *cipher,
+		unsigned char *out, size_t *out_len)
+{
+	PKCS11_CTX *ctx = SLOT2CTX(CIPHER2SLOT(cipher));
+	CK_ULONG len = (CK_ULONG)*out_len;
+	CK_RV rv;
+
+	*out_len = 0;
+	if (pkcs11_cipher_check(cipher, CKR_F_PKCS11_CIPHER_FINAL))
+		return -1;
+	if (!cipher->active) {
+		CKRerr(CKR_F_PKCS11_CIPHER_FINAL, CKR_OPERATION_NOT_INITIALIZED);
+		return -1;
+	}
+	if (cipher->encrypt)
+		rv = CRYPTOKI_call(ctx, C_EncryptFinal(cipher->session, out, &len));
+	else
+		rv = CRYPTOKI_call(ctx, C_DecryptFinal(cipher->session, out, &len));
+	pkcs11_cipher_done(cipher, rv);
+	CRYPTOKI_checkerr(CKR_F_PKCS11_CIPHER_FINAL, rv);
+	*out_len = len;
+	return 0;
+}
+
+void pkcs11_cipher_free(PKCS11_CIPHER *cipher)
+{
+	if (!cipher)
+		return;
+	/* The child process only releases the memory */
+	if (cipher->forkid == get_forkid() &&
+			cipher->session != CK_INVALID_HANDLE) {
+		pkcs11_cipher_abort(cipher);
+		if (cipher->imported && cipher->session != CK_INVALID_HANDLE)
+			CRYPTOKI_call(SLOT2CTX(CIPHER2SLOT(cipher)),
+				C_DestroyObject(cipher->session, cipher->object));
+		if (cipher->session != CK_INVALID_HANDLE)
+			pkcs11_put_session_rv(CIPHER2SLOT(cipher), 0, cipher->session,
+				cipher->rv);
+	}
+	OPENSSL_free(cipher);
+}
+
+/* vim: set noexpandtab: */
@@ -57,6 +57,19 @@ static ERR_STRING_DATA CKR_str_functs[] = {
 	{ERR_FUNC(CKR_F_PKCS11_STORE_KEY), "pkcs11_store_key"},
 	{ERR_FUNC(CKR_F_PKCS11_RELOAD_CERTIFICATE), "pkcs11_reload_certificate"},
 	{ERR_FUNC(CKR_F_PKCS11_GET_SESSION), "pkcs11_get_session"},
+	{ERR_FUNC(CKR_F_PKCS11_SIGN_BATCH), "pkcs11_sign_batch"},
+	{ERR_FUNC(CKR_F_PKCS11_GETATTR_LIST), "pkcs11_getattr_list"},
+	{ERR_FUNC(CKR_F_PKCS11_VERIFY), "pkcs11_verify"},
+	{ERR_FUNC(CKR_F_PKCS11_UPDATE_SLOTS), "pkcs11_update_slots"},
+	{ERR_FUNC(CKR_F_PKCS11_GET_SLOT_EVENT), "pkcs11_get_slot_event"},
+	{ERR_FUNC(CKR_F_PKCS11_PROVISION_BATCH), "pkcs11_provision_batch"},
+	{ERR_FUNC(CKR_F_PKCS11_CIPHER_NEW), "pkcs11_cipher_new"},
+	{ERR_FUNC(CKR_F_PKCS11_CIPHER_INIT), "pkcs11_cipher_init"},
+	{ERR_FUNC(CKR_F_PKCS11_CIPHER_UPDATE), "pkcs11_cipher_update"},
+	{ERR_FUNC(CKR_F_PKCS11_CIPHER_FINAL), "pkcs11_cipher_final"},
+	{ERR_FUNC(CKR_F_PKCS11_SIGN_UPDATE), "pkcs11_sign_update"},
+	{ERR_FUNC(CKR_F_PKCS11_SIGN_FINAL), "pkcs11_sign_final"},
+	{ERR_FUNC(CKR_F_PKCS11_SET_KEY_PRIORITY), "pkcs11_set_key_priority"},
 	{0, NULL}
 };
 
@@ -185,37 +185,27 @@ static void free_ec_ex_index()
 
 /********** EVP_PKEY retrieval */
 
-/* Retrieve EC parameters from key into ec
+/* Retrieve EC parameters from the CKA_EC_PARAMS attribute into ec
  * return nonzero on error */
-static int pkcs11_get_params(EC_KEY *ec, PKCS11_KEY *key, CK_SESSION_HANDLE session)
+static int pkcs11_get_params(EC_KEY *ec, const CK_ATTRIBUTE *attr)
 {
-	CK_BYTE *params;
-	size_t params_len = 0;
-	const unsigned char *a;
-	int rv;
+	const unsigned char *a = attr->pValue;
 
-	if (pkcs11_getattr_alloc(KEY2CTX(key), session, PRIVKEY(key)->object,
-			CKA_EC_PARAMS, &params, &params_len))
+	if (!a)
 		return -1;
-
-	a = params;
-	rv = d2i_ECParameters(&ec, &a, (long)params_len) == NULL;
-	OPENSSL_free(params);
-	return rv;
+	return d2i_ECParameters(&ec, &a, (long)attr->ulValueLen) == NULL;
 }
 
-/* Retrieve EC point from key into ec
+/* Retrieve EC point from the CKA_EC_POINT attribute into ec
  * return nonzero on error */
-static int pkcs11_get_point_key(EC_KEY *ec, PKCS11_KEY *key, CK_SESSION_HANDLE session)
+static int pkcs11_get_point(EC_KEY *ec, const CK_ATTRIBUTE *attr)
 {
-	CK_BYTE *point;
-	size_t point_len = 0;
-	const unsigned char *a;
+	const unsigned char *point = attr->pValue, *a;
+	size_t point_len = attr->ulValueLen;
 	ASN1_OCTET_STRING *os;
 	int rv = -1;
 
-	if (!key || pkcs11_getattr_alloc(KEY2CTX(key), session, PRIVKEY(key)->object,
-			CKA_EC_POINT, &point, &point_len))
+	if (!point)
 		return -1;
 
 	/* PKCS#11-compliant modules should return ASN1_OCTET_STRING */
@@ -230,7 +220,6 @@ static int pkcs11_get_point_key(EC_KEY *ec, PKCS11_KEY *key, CK_SESSION_HANDLE s
 		a = point;
 		rv = o2i_ECPublicKey(&ec, &a, (long)point_len) == NULL;
 	}
-	OPENSSL_free(point);
 	return rv;
 }
 
@@ -246,9 +235,9 @@ static int pkcs11_get_point_cert(EC_KEY *ec, PKCS11_CERT *cert)
 	if (!cert)
 		goto error;
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
-	pubkey = X509_get0_pubkey(cert->x509);
+	pubkey = X509_get0_pubkey(pkcs11_get_x509(cert));
 #else
-	pubkey = X509_get_pubkey(cert->x509);
+	pubkey = X509_get_pubkey(pkcs11_get_x509(cert));
 #endif
 	if (!pubkey)
 		goto error;
@@ -272,6 +261,11 @@ static EC_KEY *pkcs11_get_ec(PKCS11_KEY *key)
 {
 	PKCS11_SLOT *slot = KEY2SLOT(key);
 	CK_SESSION_HANDLE session;
+	CK_ATTRIBUTE attrs[] = {
+		{CKA_EC_PARAMS, NULL, 0},
+		{CKA_EC_POINT, NULL, 0}
+	};
+	PKCS11_KEY *pubkey;
 	EC_KEY *ec;
 	int no_params, no_point;
 
@@ -288,13 +282,26 @@ static EC_KEY *pkcs11_get_ec(PKCS11_KEY *key)
 		EC_KEY_free(ec);
 		return NULL;
 	}
-	no_params = pkcs11_get_params(ec, key, session);
-	no_point = pkcs11_get_point_key(ec, key, session);
-	if (no_point && key->isPrivate) /* Retry with the public key */
-		no_point = pkcs11_get_point_key(ec, pkcs11_find_key_from_key(key), session);
+	/* Missing attributes are reported when decoding them */
+	pkcs11_key_getattr(key, session, attrs, 2);
+	pkcs11_put_session(slot, 0, session);
+	no_params = pkcs11_get_params(ec, &attrs[0]);
+	no_point = pkcs11_get_point(ec, &attrs[1]);
+	pkcs11_zap_attrs(attrs, 2);
+	/* The session is released first, as searching the token needs one */
+	if (no_point && key->isPrivate) { /* Retry with the public key */
+		pubkey = pkcs11_find_key_from_key(key);
+		if (pubkey && check_key_fork(pubkey) == 0 &&
+				!pkcs11_get_session(slot, 0, &session)) {
+			if (!pkcs11_key_getattr(pubkey, session, attrs + 1, 1)) {
+				no_point = pkcs11_get_point(ec, &attrs[1]);
+				pkcs11_zap_attrs(attrs + 1, 1);
+			}
+			pkcs11_put_session(slot, 0, session);
+		}
+	}
 	if (no_point && key->isPrivate) /* Retry with the certificate */
 		no_point = pkcs11_get_point_cert(ec, pkcs11_find_certificate(key));
-	pkcs11_put_session(slot, session);
 
 	if (key->isPrivate && EC_KEY_get0_private_key(ec) == NULL) {
 		BIGNUM *bn = BN_new();
@@ -329,18 +336,27 @@ static void pkcs11_set_ex_data_ec(EC_KEY *ec, PKCS11_KEY *key)
 #endif
 }
 
-static void pkcs11_update_ex_data_ec(PKCS11_KEY *key)
+/*
+ * Precompute the parameters of the private key operations
+ */
+static void pkcs11_set_desc_ec(PKCS11_KEY *key, EC_KEY *ec)
 {
-	EVP_PKEY *evp = key->evp_key;
-	EC_KEY *ec;
-	if (!evp)
+	PKCS11_KEY_DESC *desc = &PRIVKEY(key)->desc;
+	const EC_GROUP *group = EC_KEY_get0_group(ec);
+	BIGNUM *order;
+
+	/* The group is unknown if the token did not provide CKA_EC_PARAMS */
+	if (!group)
 		return;
-	if (EVP_PKEY_base_id(evp) != EVP_PKEY_EC)
+	order = BN_new();
+	if (!order)
 		return;
-
-	ec = EVP_PKEY_get1_EC_KEY(evp);
-	pkcs11_set_ex_data_ec(ec, key);
-	EC_KEY_free(ec);
+	if (EC_GROUP_get_order(group, order, NULL)) {
+		desc->bits = BN_num_bits(order);
+		desc->sig_size = 2 * ((desc->bits + 7) / 8);
+		desc->size = (desc->bits + 7) / 8;
+	}
+	BN_free(order);
 }
 
 /*
@@ -378,6 +394,7 @@ static EVP_PKEY *pkcs11_get_evp_key_ec(PKCS11_KEY *key)
 	 * unless the key has the "sensitive" attribute set */
 
 	pkcs11_set_ex_data_ec(ec, key);
+	pkcs11_set_desc_ec(key, ec);
 	EVP_PKEY_set1_EC_KEY(pk, ec); /* Also increments the ec ref count */
 	EC_KEY_free(ec); /* Drops our reference to it */
 	return pk;
@@ -390,11 +407,7 @@ static EVP_PKEY *pkcs11_get_evp_key_ec(PKCS11_KEY *key)
 static int pkcs11_ecdsa_sign(const unsigned char *msg, unsigned int msg_len,
 		unsigned char *sigret, unsigned int *siglen, PKCS11_KEY *key)
 {
-	int rv;
-	PKCS11_SLOT *slot = KEY2SLOT(key);
-	PKCS11_CTX *ctx = KEY2CTX(key);
-	PKCS11_KEY_private *kpriv = PRIVKEY(key);
-	CK_SESSION_HANDLE session;
+	CK_RV rv;
 	CK_MECHANISM mechanism;
 	CK_ULONG ck_sigsize;
 
@@ -403,17 +416,8 @@ static int pkcs11_ecdsa_sign(const unsigned char *msg, unsigned int msg_len,
 	memset(&mechanism, 0, sizeof(mechanism));
 	mechanism.mechanism = CKM_ECDSA;
 
-	if (pkcs11_get_session(slot, 0, &session))
-		return -1;
-
-	rv = CRYPTOKI_call(ctx,
-		C_SignInit(session, &mechanism, kpriv->object));
-	if (!rv && kpriv->always_authenticate == CK_TRUE)
-		rv = pkcs11_authenticate(key, session);
-	if (!rv)
-		rv = CRYPTOKI_call(ctx,
-			C_Sign(session, (CK_BYTE *)msg, msg_len, sigret, &ck_sigsize));
-	pkcs11_put_session(slot, session);
+	rv = pkcs11_private_op(key, PKCS11_OP_SIGN, &mechanism,
+		msg, msg_len, sigret, &ck_sigsize);
 
 	if (rv) {
 		CKRerr(CKR_F_PKCS11_ECDSA_SIGN, rv);
@@ -437,11 +441,12 @@ static int pkcs11_ecdsa_sign(const unsigned char *msg, unsigned int msg_len,
 static ECDSA_SIG *pkcs11_ecdsa_sign_sig(const unsigned char *dgst, int dlen,
 		const BIGNUM *kinv, const BIGNUM *rp, EC_KEY *ec)
 {
-	unsigned char sigret[512]; /* HACK for now */
+	unsigned char sigret[512]; /* more than enough for any curve */
 	ECDSA_SIG *sig;
 	PKCS11_KEY *key;
+	PKCS11_KEY_DESC *desc;
 	unsigned int siglen;
-	BIGNUM *r, *s, *order;
+	BIGNUM *r, *s;
 
 	(void)kinv; /* Precomputed values are not used for PKCS#11 */
 	(void)rp; /* Precomputed values are not used for PKCS#11 */
@@ -461,18 +466,13 @@ static ECDSA_SIG *pkcs11_ecdsa_sign_sig(const unsigned char *dgst, int dlen,
 	}
 
 	/* Truncate digest if its byte size is longer than needed */
-	order = BN_new();
-	if (order) {
-		const EC_GROUP *group = EC_KEY_get0_group(ec);
-		if (group && EC_GROUP_get_order(group, order, NULL)) {
-			int klen = BN_num_bits(order);
-			if (klen < 8*dlen)
-				dlen = (klen+7)/8;
-		}
-		BN_free(order);
-	}
+	desc = &PRIVKEY(key)->desc;
+	if (desc->bits && desc->bits < 8 * (unsigned int)dlen)
+		dlen = (desc->bits + 7) / 8;
 
-	siglen = sizeof sigret;
+	/* Request the exact signature size if the group order is known */
+	siglen = desc->sig_size && desc->sig_size <= sizeof sigret ?
+		desc->sig_size : sizeof sigret;
 	if (pkcs11_ecdsa_sign(dgst, dlen, sigret, &siglen, key) <= 0)
 		return NULL;
 
@@ -492,48 +492,196 @@ static ECDSA_SIG *pkcs11_ecdsa_sign_sig(const unsigned char *dgst, int dlen,
 	return sig;
 }
 
+/*
+ * ECDSA signature verification
+ * The DER-encoded signature is converted to the concatenation of r
+ * and s expected by the token for C_Verify().
+ * Returns 1 for a valid signature, 0 for an invalid one, or -1 on error
+ */
+int pkcs11_ecdsa_verify(const unsigned char *m, unsigned int m_len,
+		const unsigned char *signature, unsigned int siglen, PKCS11_KEY *key)
+{
+	PKCS11_KEY_DESC *desc = &PRIVKEY(key)->desc;
+	CK_MECHANISM mechanism;
+	const unsigned char *p = signature;
+	unsigned char *raw;
+	const BIGNUM *r, *s;
+	ECDSA_SIG *sig;
+	EVP_PKEY *evp;
+	EC_KEY *ec;
+	int rv;
+
+	evp = pkcs11_get_key(key, key->isPrivate);
+	if (!evp)
+		return -1;
+	ec = EVP_PKEY_get1_EC_KEY(evp);
+	EVP_PKEY_free(evp);
+	if (!ec)
+		return -1;
+	if (!PRIVCTX(KEY2CTX(key))->token_verify) {
+		rv = ECDSA_verify(0, m, (int)m_len, p, (int)siglen, ec) == 1;
+		EC_KEY_free(ec);
+		return rv;
+	}
+	EC_KEY_free(ec);
+
+	/* The group order is needed to encode the signature */
+	if (!desc->size) {
+		P11err(P11_F_PKCS11_VERIFY, P11_R_NOT_SUPPORTED);
+		return -1;
+	}
+	sig = d2i_ECDSA_SIG(NULL, &p, (long)siglen);
+	if (!sig)
+		return 0;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+	ECDSA_SIG_get0(sig, &r, &s);
+#else
+	r = sig->r;
+	s = sig->s;
+#endif
+	if ((unsigned int)BN_num_bytes(r) > desc->size ||
+			(unsigned int)BN_num_bytes(s) > desc->size) {
+		ECDSA_SIG_free(sig);
+		return 0;
+	}
+	raw = OPENSSL_malloc(2 * desc->size);
+	if (!raw) {
+		ECDSA_SIG_free(sig);
+		return -1;
+	}
+	memset(raw, 0, 2 * desc->size);
+	BN_bn2bin(r, raw + desc->size - BN_num_bytes(r));
+	BN_bn2bin(s, raw + 2 * desc->size - BN_num_bytes(s));
+	ECDSA_SIG_free(sig);
+
+	/* Truncate digest if its byte size is longer than needed */
+	if (desc->bits && desc->bits < 8 * m_len)
+		m_len = (desc->bits + 7) / 8;
+
+	memset(&mechanism, 0, sizeof(mechanism));
+	mechanism.mechanism = CKM_ECDSA;
+	rv = pkcs11_verify_token(key, &mechanism, m, m_len, raw, 2 * desc->size);
+	OPENSSL_free(raw);
+	return rv;
+}
+
 /********** ECDH key derivation */
 
-static CK_ECDH1_DERIVE_PARAMS *pkcs11_ecdh_params_alloc(
-		const EC_GROUP *group, const EC_POINT *point)
+/* The uncompressed encoding of the largest supported curve point */
+#define PKCS11_EC_POINT_MAX (1 + 2 * ((OPENSSL_ECC_MAX_FIELD_BITS + 7) / 8))
+
+/* The public point is encoded into the caller buffer of
+ * PKCS11_EC_POINT_MAX bytes, so that no allocation is needed */
+static int pkcs11_ecdh_params_init(CK_ECDH1_DERIVE_PARAMS *parms,
+		unsigned char *buf, const EC_GROUP *group, const EC_POINT *point)
 {
-	CK_ECDH1_DERIVE_PARAMS *parms;
 	size_t len;
-	unsigned char *buf = NULL;
 
 	if (!group || !point)
-		return NULL;
+		return -1;
 	len = EC_POINT_point2oct(group, point,
-		POINT_CONVERSION_UNCOMPRESSED, NULL, 0, NULL);
+		POINT_CONVERSION_UNCOMPRESSED, buf, PKCS11_EC_POINT_MAX, NULL);
 	if (len == 0)
-		return NULL;
-	buf = OPENSSL_malloc(len);
-	if (!buf)
-		return NULL;
-	len = EC_POINT_point2oct(group, point,
-		POINT_CONVERSION_UNCOMPRESSED, buf, len, NULL);
-	if (len == 0) {
-		OPENSSL_free(buf);
-		return NULL;
-	}
-
-	parms = OPENSSL_malloc(sizeof(CK_ECDH1_DERIVE_PARAMS));
-	if (!parms) {
-		OPENSSL_free(buf);
-		return NULL;
-	}
+		return -1;
 	parms->kdf = CKD_NULL;
 	parms->pSharedData = NULL;
 	parms->ulSharedDataLen = 0;
 	parms->pPublicData = buf;
 	parms->ulPublicDataLen = len;
-	return parms;
+	return 0;
 }
 
-static void pkcs11_ecdh_params_free(CK_ECDH1_DERIVE_PARAMS *parms)
+typedef struct pkcs11_ecdh_derive_args {
+	PKCS11_KEY *key;
+	CK_MECHANISM *mechanism;
+	CK_ATTRIBUTE *template;
+	CK_ULONG ntemplate;
+	size_t key_len;
+	unsigned char **out;
+	size_t *outlen;
+	CK_OBJECT_HANDLE *newkey;
+	int priority; /* of the calling thread */
+} PKCS11_ECDH_DERIVE_ARGS;
+
+/*
+ * Read the value of the derived key into a buffer sized from the curve
+ * with a single C_GetAttributeValue() call, only querying the size first
+ * if the module returns a longer value
+ */
+static CK_RV pkcs11_ecdh_get_value(PKCS11_ECDH_DERIVE_ARGS *args,
+		CK_SESSION_HANDLE session, CK_OBJECT_HANDLE newkey)
+{
+	PKCS11_CTX *ctx = KEY2CTX(args->key);
+	CK_ATTRIBUTE templ;
+	unsigned char *value;
+	CK_RV rv;
+
+	value = OPENSSL_malloc(args->key_len + 1);
+	if (!value)
+		return CKR_HOST_MEMORY;
+	templ.type = CKA_VALUE;
+	templ.pValue = value;
+	templ.ulValueLen = args->key_len;
+	rv = CRYPTOKI_call(ctx, C_GetAttributeValue(session, newkey, &templ, 1));
+	if (rv == CKR_BUFFER_TOO_SMALL) {
+		OPENSSL_free(value);
+		if (pkcs11_getattr_alloc(ctx, session, newkey, CKA_VALUE,
+				args->out, args->outlen))
+			return CKR_ATTRIBUTE_VALUE_INVALID;
+		return CKR_OK;
+	}
+	if (rv != CKR_OK) {
+		OPENSSL_free(value);
+		return CKR_ATTRIBUTE_VALUE_INVALID;
+	}
+	value[templ.ulValueLen] = 0;
+	*args->out = value;
+	*args->outlen = templ.ulValueLen;
+	return CKR_OK;
+}
+
+static CK_RV pkcs11_ecdh_derive_run(void *arg)
 {
-	OPENSSL_free(parms->pPublicData);
-	OPENSSL_free(parms);
+	PKCS11_ECDH_DERIVE_ARGS *args = arg;
+	PKCS11_SLOT *slot = KEY2SLOT(args->key);
+	PKCS11_CTX *ctx = KEY2CTX(args->key);
+	PKCS11_KEY_private *kpriv = PRIVKEY(args->key);
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE newkey = CK_INVALID_HANDLE;
+	unsigned long start;
+	CK_RV rv;
+
+	if (pkcs11_get_session_class(slot, 0, &session, args->priority))
+		return CKR_GENERAL_ERROR;
+
+	start = pkcs11_stats_time();
+	rv = CRYPTOKI_call(ctx, C_DeriveKey(session, args->mechanism,
+		kpriv->object, args->template, args->ntemplate, &newkey));
+	pkcs11_stats_record(slot, PKCS11_STATS_DERIVE,
+		args->mechanism->mechanism, rv, start);
+	if (rv != CKR_OK)
+		goto done;
+
+	/* Return the value of the secret key and/or the object handle of the secret key */
+	if (args->out && args->outlen) { /* pkcs11_ec_ckey only asks for the value */
+		rv = pkcs11_ecdh_get_value(args, session, newkey);
+		if (rv != CKR_OK) {
+			CRYPTOKI_call(ctx, C_DestroyObject(session, newkey));
+			goto done;
+		}
+	}
+	if (args->newkey) { /* For future use (not used by pkcs11_ec_ckey) */
+		*args->newkey = newkey;
+	} else {
+		/* The temporary key is destroyed after the result is returned,
+		 * and the session is only reused afterwards */
+		pkcs11_destroy_later(slot, session, newkey);
+		return rv;
+	}
+
+done:
+	pkcs11_put_session_rv(slot, 0, session, rv);
+	return rv;
 }
 
 /* initial code will only support what is needed for pkcs11_ec_ckey
@@ -551,20 +699,15 @@ static int pkcs11_ecdh_derive(unsigned char **out, size_t *outlen,
 		void *outnewkey,
 		PKCS11_KEY *key)
 {
-	PKCS11_SLOT *slot = KEY2SLOT(key);
-	PKCS11_CTX *ctx = KEY2CTX(key);
-	PKCS11_KEY_private *kpriv = PRIVKEY(key);
-	CK_SESSION_HANDLE session;
+	PKCS11_ECDH_DERIVE_ARGS args;
 	CK_MECHANISM mechanism;
-	int rv;
+	CK_RV rv;
 
 	CK_BBOOL true = TRUE;
 	CK_BBOOL false = FALSE;
-	CK_OBJECT_HANDLE newkey = CK_INVALID_HANDLE;
 	CK_OBJECT_CLASS newkey_class= CKO_SECRET_KEY;
 	CK_KEY_TYPE newkey_type = CKK_GENERIC_SECRET;
 	CK_ULONG newkey_len = key_len;
-	CK_OBJECT_HANDLE *tmpnewkey = (CK_OBJECT_HANDLE *)outnewkey;
 	CK_ATTRIBUTE newkey_template[] = {
 		{CKA_TOKEN, &false, sizeof(false)}, /* session only object */
 		{CKA_CLASS, &newkey_class, sizeof(newkey_class)},
@@ -595,49 +738,38 @@ static int pkcs11_ecdh_derive(unsigned char **out, size_t *outlen,
 			return -1;
 	}
 
-	if (pkcs11_get_session(slot, 0, &session))
+	args.key = key;
+	args.mechanism = &mechanism;
+	args.template = newkey_template;
+	args.ntemplate = sizeof(newkey_template)/sizeof(*newkey_template);
+	args.key_len = key_len;
+	args.out = out;
+	args.outlen = outlen;
+	args.newkey = (CK_OBJECT_HANDLE *)outnewkey;
+	args.priority = pkcs11_key_priority(key);
+	rv = pkcs11_check_key_op(key, PKCS11_OP_DERIVE, ecdh_mechanism);
+	if (rv == CKR_OK)
+		rv = pkcs11_async_call(KEY2CTX(key), pkcs11_ecdh_derive_run, &args);
+	if (rv != CKR_OK) {
+		CKRerr(CKR_F_PKCS11_ECDH_DERIVE, rv);
 		return -1;
-
-	rv = CRYPTOKI_call(ctx, C_DeriveKey(session, &mechanism, kpriv->object,
-		newkey_template, sizeof(newkey_template)/sizeof(*newkey_template), &newkey));
-	if (rv != CKR_OK)
-		goto error;
-
-	/* Return the value of the secret key and/or the object handle of the secret key */
-	if (out && outlen) { /* pkcs11_ec_ckey only asks for the value */
-		if (pkcs11_getattr_alloc(ctx, session, newkey, CKA_VALUE, out, outlen)) {
-			CRYPTOKI_call(ctx, C_DestroyObject(session, newkey));
-			goto error;
-		}
 	}
-	if (tmpnewkey) /* For future use (not used by pkcs11_ec_ckey) */
-		*tmpnewkey = newkey;
-	else /* Destroy the temporary key */
-		CRYPTOKI_call(ctx, C_DestroyObject(session, newkey));
-
-	pkcs11_put_session(slot, session);
-
 	return 0;
-error:
-	pkcs11_put_session(slot, session);
-	CKRerr(CKR_F_PKCS11_ECDH_DERIVE, rv);
-	return -1;
 }
 
-static int pkcs11_ecdh_compute_key(unsigned char **buf, size_t *buflen,
+int pkcs11_ecdh_compute_key(unsigned char **buf, size_t *buflen,
 		const EC_POINT *peer_point, const EC_KEY *ecdh, PKCS11_KEY *key)
 {
 	const EC_GROUP *group = EC_KEY_get0_group(ecdh);
 	const int key_len = (EC_GROUP_get_degree(group) + 7) / 8;
-	/* both peer and ecdh use same group parameters */
-	CK_ECDH1_DERIVE_PARAMS *parms = pkcs11_ecdh_params_alloc(group, peer_point);
-	int rv;
+	CK_ECDH1_DERIVE_PARAMS parms;
+	unsigned char point[PKCS11_EC_POINT_MAX];
 
-	if (!parms)
+	/* both peer and ecdh use same group parameters */
+	if (pkcs11_ecdh_params_init(&parms, point, group, peer_point))
 		return -1;
-	rv = pkcs11_ecdh_derive(buf, buflen, key_len, CKM_ECDH1_DERIVE, parms, NULL, key);
-	pkcs11_ecdh_params_free(parms);
-	return rv;
+	return pkcs11_ecdh_derive(buf, buflen, key_len, CKM_ECDH1_DERIVE,
+		&parms, NULL, key);
 }
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100004L && !defined(LIBRESSL_VERSION_NUMBER)
@@ -790,7 +922,6 @@ ECDH_METHOD *PKCS11_get_ecdh_method(void)
 PKCS11_KEY_ops pkcs11_ec_ops_s = {
 	EVP_PKEY_EC,
 	pkcs11_get_evp_key_ec,
-	pkcs11_update_ex_data_ec,
 };
 PKCS11_KEY_ops *pkcs11_ec_ops = {&pkcs11_ec_ops_s};
 
@@ -808,6 +939,19 @@ ECDSA_METHOD *PKCS11_get_ecdsa_method(void)
 	return NULL;
 }
 
+int pkcs11_ecdsa_verify(const unsigned char *m, unsigned int m_len,
+		const unsigned char *signature, unsigned int siglen, PKCS11_KEY *key)
+{
+	(void)m;
+	(void)m_len;
+	(void)signature;
+	(void)siglen;
+	(void)key;
+
+	P11err(P11_F_PKCS11_VERIFY, P11_R_NOT_SUPPORTED);
+	return -1;
+}
+
 #endif /* OPENSSL_NO_EC */
 
 /* TODO: remove this function in libp11 0.5.0 */
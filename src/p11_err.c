@@ -26,6 +26,7 @@ static ERR_STRING_DATA P11_str_functs[] = {
     {ERR_FUNC(P11_F_PKCS11_CTX_RELOAD), "pkcs11_CTX_reload"},
     {ERR_FUNC(P11_F_PKCS11_ECDH_DERIVE), "pkcs11_ecdh_derive"},
     {ERR_FUNC(P11_F_PKCS11_GENERATE_RANDOM), "pkcs11_generate_random"},
+    {ERR_FUNC(P11_F_PKCS11_GET_SESSION), "pkcs11_get_session"},
     {ERR_FUNC(P11_F_PKCS11_INIT_PIN), "pkcs11_init_pin"},
     {ERR_FUNC(P11_F_PKCS11_LOGOUT), "pkcs11_logout"},
     {ERR_FUNC(P11_F_PKCS11_MECHANISM), "pkcs11_mechanism"},
@@ -40,6 +41,7 @@ static ERR_STRING_DATA P11_str_reasons[] = {
     {ERR_REASON(P11_R_LOAD_MODULE_ERROR), "Unable to load PKCS#11 module"},
     {ERR_REASON(P11_R_NOT_SUPPORTED), "Not supported"},
     {ERR_REASON(P11_R_NO_SESSION), "No session open"},
+    {ERR_REASON(P11_R_SESSION_TIMEOUT), "Timed out waiting for a session"},
     {ERR_REASON(P11_R_UI_FAILED), "UI request failed"},
     {ERR_REASON(P11_R_UNSUPPORTED_PADDING_TYPE), "Unsupported padding type"},
     {0, NULL}
@@ -36,6 +36,7 @@ void ERR_P11_error(int function, int reason, char *file, int line);
 # define P11_F_PKCS11_INIT_PIN                            106
 # define P11_F_PKCS11_LOGOUT                              107
 # define P11_F_PKCS11_MECHANISM                           111
+# define P11_F_PKCS11_GET_SESSION                         112
 # define P11_F_PKCS11_SEED_RANDOM                         108
 # define P11_F_PKCS11_STORE_KEY                           109
 # define P11_F_PKCS11_VERIFY                              110
@@ -45,6 +46,7 @@ void ERR_P11_error(int function, int reason, char *file, int line);
 # define P11_R_LOAD_MODULE_ERROR                          1025
 # define P11_R_NOT_SUPPORTED                              1028
 # define P11_R_NO_SESSION                                 1029
+# define P11_R_SESSION_TIMEOUT                            1032
 # define P11_R_UI_FAILED                                  1031
 # define P11_R_UNSUPPORTED_PADDING_TYPE                   1026
 
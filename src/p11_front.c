@@ -39,6 +39,121 @@ void PKCS11_CTX_init_args(PKCS11_CTX *ctx, const char *init_args)
 	pkcs11_CTX_init_args(ctx, init_args);
 }
 
+void PKCS11_CTX_set_find_batch(PKCS11_CTX *ctx, unsigned int size)
+{
+	if (check_fork(ctx) < 0)
+		return;
+	pkcs11_CTX_set_find_batch(ctx, size);
+}
+
+void PKCS11_CTX_set_lazy_x509(PKCS11_CTX *ctx, int lazy)
+{
+	if (check_fork(ctx) < 0)
+		return;
+	pkcs11_CTX_set_lazy_x509(ctx, lazy);
+}
+
+void PKCS11_CTX_set_token_verify(PKCS11_CTX *ctx, int token)
+{
+	if (check_fork(ctx) < 0)
+		return;
+	pkcs11_CTX_set_token_verify(ctx, token);
+}
+
+void PKCS11_CTX_set_enum_threads(PKCS11_CTX *ctx, unsigned int threads)
+{
+	if (check_fork(ctx) < 0)
+		return;
+	pkcs11_CTX_set_enum_threads(ctx, threads);
+}
+
+void PKCS11_CTX_set_enum_flags(PKCS11_CTX *ctx, unsigned int flags)
+{
+	if (check_fork(ctx) < 0)
+		return;
+	pkcs11_CTX_set_enum_flags(ctx, flags);
+}
+
+void PKCS11_CTX_set_session_timeout(PKCS11_CTX *ctx, long timeout)
+{
+	if (check_fork(ctx) < 0)
+		return;
+	pkcs11_CTX_set_session_timeout(ctx, timeout);
+}
+
+void PKCS11_CTX_set_session_prewarm(PKCS11_CTX *ctx, unsigned int count)
+{
+	if (check_fork(ctx) < 0)
+		return;
+	pkcs11_CTX_set_session_prewarm(ctx, count);
+}
+
+void PKCS11_CTX_set_session_reserve(PKCS11_CTX *ctx, unsigned int reserve,
+		unsigned int starvation_limit)
+{
+	if (check_fork(ctx) < 0)
+		return;
+	pkcs11_CTX_set_session_reserve(ctx, reserve, starvation_limit);
+}
+
+int PKCS11_set_thread_priority(int priority)
+{
+	return pkcs11_set_thread_priority(priority);
+}
+
+void PKCS11_CTX_set_auth_pin_cache(PKCS11_CTX *ctx, long ttl,
+		unsigned int max_uses)
+{
+	if (check_fork(ctx) < 0)
+		return;
+	pkcs11_CTX_set_auth_pin_cache(ctx, ttl, max_uses);
+}
+
+void PKCS11_CTX_set_random_buffer(PKCS11_CTX *ctx, unsigned int size,
+		unsigned int watermark)
+{
+	if (check_fork(ctx) < 0)
+		return;
+	pkcs11_CTX_set_random_buffer(ctx, size, watermark);
+}
+
+int PKCS11_CTX_set_metadata_cache(PKCS11_CTX *ctx, const char *dir,
+		const char *generation)
+{
+	if (check_fork(ctx) < 0)
+		return -1;
+	return pkcs11_CTX_set_metadata_cache(ctx, dir, generation);
+}
+
+void PKCS11_CTX_set_cipher_chunk(PKCS11_CTX *ctx, unsigned int size)
+{
+	if (check_fork(ctx) < 0)
+		return;
+	pkcs11_CTX_set_cipher_chunk(ctx, size);
+}
+
+void PKCS11_CTX_set_sign_chunk(PKCS11_CTX *ctx, unsigned int size)
+{
+	if (check_fork(ctx) < 0)
+		return;
+	pkcs11_CTX_set_sign_chunk(ctx, size);
+}
+
+void PKCS11_CTX_prepare_fork(PKCS11_CTX *ctx,
+		PKCS11_SLOT *slots, unsigned int nslots)
+{
+	if (check_fork(ctx) < 0)
+		return;
+	pkcs11_CTX_prepare_fork(ctx, slots, nslots);
+}
+
+int PKCS11_CTX_child_init(PKCS11_CTX *ctx)
+{
+	if (!ctx)
+		return -1;
+	return pkcs11_CTX_child_init(ctx);
+}
+
 int PKCS11_CTX_load(PKCS11_CTX *ctx, const char *ident)
 {
 	if (check_fork(ctx) < 0)
@@ -75,6 +190,21 @@ int PKCS11_enumerate_slots(PKCS11_CTX *ctx,
 	return pkcs11_enumerate_slots(ctx, slotsp, nslotsp);
 }
 
+int PKCS11_update_slots(PKCS11_CTX *ctx,
+		PKCS11_SLOT **slotsp, unsigned int *nslotsp)
+{
+	if (check_fork(ctx) < 0 || !slotsp || !nslotsp)
+		return -1;
+	return pkcs11_update_slots(ctx, slotsp, nslotsp);
+}
+
+int PKCS11_get_slot_event(PKCS11_CTX *ctx, unsigned long *slotid)
+{
+	if (check_fork(ctx) < 0)
+		return -1;
+	return pkcs11_get_slot_event(ctx, slotid);
+}
+
 unsigned long PKCS11_get_slotid_from_slot(PKCS11_SLOT *slot)
 {
 	if (check_slot_fork(slot) < 0)
@@ -82,6 +212,14 @@ unsigned long PKCS11_get_slotid_from_slot(PKCS11_SLOT *slot)
 	return pkcs11_get_slotid_from_slot(slot);
 }
 
+int PKCS11_get_stats(PKCS11_SLOT *slot, PKCS11_STATS *stats)
+{
+	if (check_slot_fork(slot) < 0 || !stats)
+		return -1;
+	pkcs11_get_stats(slot, stats);
+	return 0;
+}
+
 void PKCS11_release_all_slots(PKCS11_CTX *ctx,
 		PKCS11_SLOT *slots, unsigned int nslots)
 {
@@ -90,6 +228,13 @@ void PKCS11_release_all_slots(PKCS11_CTX *ctx,
 	pkcs11_release_all_slots(ctx, slots, nslots);
 }
 
+int PKCS11_load_token_info(PKCS11_SLOT *slot)
+{
+	if (check_slot_fork(slot) < 0)
+		return -1;
+	return pkcs11_load_token_info(slot);
+}
+
 PKCS11_SLOT *PKCS11_find_token(PKCS11_CTX *ctx,
 		PKCS11_SLOT *slots, unsigned int nslots)
 {
@@ -133,7 +278,43 @@ int PKCS11_enumerate_keys(PKCS11_TOKEN *token,
 {
 	if (check_token_fork(token) < 0)
 		return -1;
-	return pkcs11_enumerate_keys(token, CKO_PRIVATE_KEY, keys, nkeys);
+	return pkcs11_enumerate_keys(token, CKO_PRIVATE_KEY, NULL, keys, nkeys);
+}
+
+int PKCS11_enumerate_keys_ext(PKCS11_TOKEN *token,
+		const PKCS11_KEY *key_template,
+		PKCS11_KEY **keys, unsigned int *nkeys)
+{
+	if (check_token_fork(token) < 0)
+		return -1;
+	return pkcs11_enumerate_keys(token, CKO_PRIVATE_KEY, key_template,
+		keys, nkeys);
+}
+
+PKCS11_KEY_ITER *PKCS11_key_iter_new(PKCS11_TOKEN *token,
+		const PKCS11_KEY *key_template)
+{
+	if (check_token_fork(token) < 0)
+		return NULL;
+	return pkcs11_key_iter_new(token, CKO_PRIVATE_KEY, key_template);
+}
+
+PKCS11_KEY_ITER *PKCS11_public_key_iter_new(PKCS11_TOKEN *token,
+		const PKCS11_KEY *key_template)
+{
+	if (check_token_fork(token) < 0)
+		return NULL;
+	return pkcs11_key_iter_new(token, CKO_PUBLIC_KEY, key_template);
+}
+
+int PKCS11_key_iter_next(PKCS11_KEY_ITER *iter, PKCS11_KEY **key)
+{
+	return pkcs11_key_iter_next(iter, key);
+}
+
+void PKCS11_key_iter_free(PKCS11_KEY_ITER *iter)
+{
+	pkcs11_key_iter_free(iter);
 }
 
 int PKCS11_remove_key(PKCS11_KEY *key)
@@ -148,7 +329,17 @@ int PKCS11_enumerate_public_keys(PKCS11_TOKEN *token,
 {
 	if (check_token_fork(token) < 0)
 		return -1;
-	return pkcs11_enumerate_keys(token, CKO_PUBLIC_KEY, keys, nkeys);
+	return pkcs11_enumerate_keys(token, CKO_PUBLIC_KEY, NULL, keys, nkeys);
+}
+
+int PKCS11_enumerate_public_keys_ext(PKCS11_TOKEN *token,
+		const PKCS11_KEY *key_template,
+		PKCS11_KEY **keys, unsigned int *nkeys)
+{
+	if (check_token_fork(token) < 0)
+		return -1;
+	return pkcs11_enumerate_keys(token, CKO_PUBLIC_KEY, key_template,
+		keys, nkeys);
 }
 
 int PKCS11_get_key_type(PKCS11_KEY *key)
@@ -172,6 +363,28 @@ EVP_PKEY *PKCS11_get_public_key(PKCS11_KEY *key)
 	return pkcs11_get_key(key, 0);
 }
 
+int PKCS11_add_key_replica(PKCS11_KEY *key, PKCS11_KEY *replica)
+{
+	if (check_key_fork(key) < 0 || check_key_fork(replica) < 0)
+		return -1;
+	return pkcs11_add_key_replica(key, replica);
+}
+
+int PKCS11_set_key_priority(PKCS11_KEY *key, int priority)
+{
+	if (check_key_fork(key) < 0)
+		return -1;
+	return pkcs11_set_key_priority(key, priority);
+}
+
+int PKCS11_sign_batch(PKCS11_KEY *key, unsigned long mechanism,
+		PKCS11_SIGN_REQ *reqs, unsigned int count)
+{
+	if (check_key_fork(key) < 0)
+		return -1;
+	return pkcs11_sign_batch(key, mechanism, reqs, count);
+}
+
 PKCS11_CERT *PKCS11_find_certificate(PKCS11_KEY *key)
 {
 	if (check_key_fork(key) < 0)
@@ -191,7 +404,41 @@ int PKCS11_enumerate_certs(PKCS11_TOKEN *token,
 {
 	if (check_token_fork(token) < 0)
 		return -1;
-	return pkcs11_enumerate_certs(token, certs, ncerts);
+	return pkcs11_enumerate_certs(token, NULL, certs, ncerts);
+}
+
+int PKCS11_enumerate_certs_ext(PKCS11_TOKEN *token,
+		const PKCS11_CERT *cert_template,
+		PKCS11_CERT **certs, unsigned int *ncerts)
+{
+	if (check_token_fork(token) < 0)
+		return -1;
+	return pkcs11_enumerate_certs(token, cert_template, certs, ncerts);
+}
+
+PKCS11_CERT_ITER *PKCS11_cert_iter_new(PKCS11_TOKEN *token,
+		const PKCS11_CERT *cert_template)
+{
+	if (check_token_fork(token) < 0)
+		return NULL;
+	return pkcs11_cert_iter_new(token, cert_template);
+}
+
+int PKCS11_cert_iter_next(PKCS11_CERT_ITER *iter, PKCS11_CERT **cert)
+{
+	return pkcs11_cert_iter_next(iter, cert);
+}
+
+void PKCS11_cert_iter_free(PKCS11_CERT_ITER *iter)
+{
+	pkcs11_cert_iter_free(iter);
+}
+
+X509 *PKCS11_get_x509(PKCS11_CERT *cert)
+{
+	if (check_cert_fork(cert) < 0)
+		return NULL;
+	return pkcs11_get_x509(cert);
 }
 
 int PKCS11_remove_certificate(PKCS11_CERT *cert)
@@ -249,6 +496,56 @@ int PKCS11_store_certificate(PKCS11_TOKEN *token, X509 *x509,
 	return pkcs11_store_certificate(token, x509, label, id, id_len, ret_cert);
 }
 
+int PKCS11_provision_batch(PKCS11_TOKEN *token,
+		PKCS11_PROVISION_REQ *reqs, unsigned int count)
+{
+	if (check_token_fork(token) < 0)
+		return -1;
+	return pkcs11_provision_batch(token, reqs, count);
+}
+
+PKCS11_CIPHER *PKCS11_cipher_new(PKCS11_TOKEN *token,
+		const char *label, const unsigned char *id, size_t id_len)
+{
+	if (check_token_fork(token) < 0)
+		return NULL;
+	return pkcs11_cipher_new(token, label, id, id_len);
+}
+
+PKCS11_CIPHER *PKCS11_cipher_import(PKCS11_TOKEN *token,
+		const unsigned char *key, size_t key_len)
+{
+	if (check_token_fork(token) < 0)
+		return NULL;
+	return pkcs11_cipher_import(token, key, key_len);
+}
+
+int PKCS11_cipher_init(PKCS11_CIPHER *cipher, unsigned long mechanism,
+		int encrypt, const unsigned char *iv, size_t iv_len,
+		const unsigned char *aad, size_t aad_len)
+{
+	return pkcs11_cipher_init(cipher, mechanism, encrypt,
+		iv, iv_len, aad, aad_len);
+}
+
+int PKCS11_cipher_update(PKCS11_CIPHER *cipher,
+		const unsigned char *in, size_t in_len,
+		unsigned char *out, size_t *out_len)
+{
+	return pkcs11_cipher_update(cipher, in, in_len, out, out_len);
+}
+
+int PKCS11_cipher_final(PKCS11_CIPHER *cipher,
+		unsigned char *out, size_t *out_len)
+{
+	return pkcs11_cipher_final(cipher, out, out_len);
+}
+
+void PKCS11_cipher_free(PKCS11_CIPHER *cipher)
+{
+	pkcs11_cipher_free(cipher);
+}
+
 int PKCS11_seed_random(PKCS11_SLOT *slot, const unsigned char *s, unsigned int s_len)
 {
 	if (check_slot_fork(slot) < 0)
@@ -338,16 +635,9 @@ int PKCS11_private_decrypt(int flen, const unsigned char *from, unsigned char *t
 int PKCS11_verify(int type, const unsigned char *m, unsigned int m_len,
 		unsigned char *signature, unsigned int siglen, PKCS11_KEY *key)
 {
-	(void)type;
-	(void)m;
-	(void)m_len;
-	(void)signature;
-	(void)siglen;
-	(void)key;
-
-	/* PKCS11 calls go here */
-	P11err(P11_F_PKCS11_VERIFY, P11_R_NOT_SUPPORTED);
-	return -1;
+	if (check_key_fork(key) < 0)
+		return -1;
+	return pkcs11_verify(type, m, m_len, signature, siglen, key);
 }
 
 /* vim: set noexpandtab: */
@@ -0,0 +1,128 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Hash indexes of the key and certificate arrays of a token
+ *
+ * An index maps a hash value to the position of an object in its array.
+ * Open addressing with linear probing is used, and the index only grows
+ * until it is freed, which matches the lifetime of the object arrays.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+
+#define PKCS11_INDEX_MIN_SIZE 64
+
+unsigned long pkcs11_hash_handle(CK_OBJECT_HANDLE handle)
+{
+	unsigned long h = (unsigned long)handle;
+
+	/* Handles are often sequential, so mix the bits */
+	h ^= h >> 16;
+	h *= 0x45d9f3bUL;
+	h ^= h >> 16;
+	return h;
+}
+
+unsigned long pkcs11_hash_bytes(const unsigned char *data, size_t len)
+{
+	unsigned long h = 2166136261UL; /* FNV-1a */
+
+	while (len--) {
+		h ^= *data++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+static void pkcs11_index_put(PKCS11_INDEX_ENTRY *entries, unsigned int size,
+		unsigned long hash, unsigned int item)
+{
+	unsigned int i = (unsigned int)hash & (size - 1);
+
+	while (entries[i].item)
+		i = (i + 1) & (size - 1);
+	entries[i].hash = hash;
+	entries[i].item = item + 1;
+}
+
+/*
+ * Make room for n more objects, so that pkcs11_index_insert() cannot fail
+ * Returns 0 on success, or -1 on memory allocation failure
+ */
+int pkcs11_index_reserve(PKCS11_INDEX *index, unsigned int n)
+{
+	PKCS11_INDEX_ENTRY *entries;
+	unsigned int i, size;
+
+	/* Keep the load factor below 1/2 */
+	if (2 * (index->count + n) <= index->size)
+		return 0;
+	size = index->size ? index->size : PKCS11_INDEX_MIN_SIZE;
+	while (2 * (index->count + n) > size)
+		size *= 2;
+	entries = OPENSSL_malloc(size * sizeof(PKCS11_INDEX_ENTRY));
+	if (!entries)
+		return -1;
+	memset(entries, 0, size * sizeof(PKCS11_INDEX_ENTRY));
+	for (i = 0; i < index->size; i++)
+		if (index->entries[i].item)
+			pkcs11_index_put(entries, size, index->entries[i].hash,
+				index->entries[i].item - 1);
+	OPENSSL_free(index->entries);
+	index->entries = entries;
+	index->size = size;
+	return 0;
+}
+
+/*
+ * Add an object to the index
+ */
+void pkcs11_index_insert(PKCS11_INDEX *index, unsigned long hash,
+		unsigned int item)
+{
+	pkcs11_index_put(index->entries, index->size, hash, item);
+	index->count++;
+}
+
+/*
+ * Find an object with a matching hash value accepted by the match callback
+ * Returns the position of the object, or -1 if not found
+ */
+int pkcs11_index_find(const PKCS11_INDEX *index, unsigned long hash,
+		int (*match)(const void *, unsigned int), const void *arg)
+{
+	unsigned int i;
+
+	if (!index->size)
+		return -1;
+	for (i = (unsigned int)hash & (index->size - 1); index->entries[i].item;
+			i = (i + 1) & (index->size - 1))
+		if (index->entries[i].hash == hash &&
+				match(arg, index->entries[i].item - 1))
+			return (int)index->entries[i].item - 1;
+	return -1;
+}
+
+void pkcs11_index_free(PKCS11_INDEX *index)
+{
+	OPENSSL_free(index->entries);
+	memset(index, 0, sizeof(PKCS11_INDEX));
+}
+
+/* vim: set noexpandtab: */
@@ -29,9 +29,21 @@
 /* The maximum length of PIN */
 #define MAX_PIN_LENGTH   32
 
-static int pkcs11_find_keys(PKCS11_TOKEN *, CK_SESSION_HANDLE, unsigned int);
-static int pkcs11_next_key(PKCS11_CTX *ctx, PKCS11_TOKEN *token,
-	CK_SESSION_HANDLE session, CK_OBJECT_CLASS type);
+/* The cached context-specific PINs are kept in the secure heap */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+#define pkcs11_secure_malloc(n) OPENSSL_secure_malloc(n)
+#define pkcs11_secure_clear_free(p, n) OPENSSL_secure_clear_free((p), (n))
+#else
+#define pkcs11_secure_malloc(n) OPENSSL_malloc(n)
+#define pkcs11_secure_clear_free(p, n) \
+	do { OPENSSL_cleanse((p), (n)); OPENSSL_free(p); } while (0)
+#endif
+
+static int pkcs11_find_keys(PKCS11_TOKEN *, CK_SESSION_HANDLE, unsigned int,
+	const PKCS11_KEY *);
+static int pkcs11_next_key(PKCS11_TOKEN *, CK_SESSION_HANDLE,
+	CK_OBJECT_HANDLE, void *);
+static PKCS11_KEY_ops *pkcs11_key_type_ops(CK_KEY_TYPE);
 static int pkcs11_init_key(PKCS11_CTX *ctx, PKCS11_TOKEN *token,
 	CK_SESSION_HANDLE session, CK_OBJECT_HANDLE o,
 	CK_OBJECT_CLASS type, PKCS11_KEY **);
@@ -50,24 +62,65 @@ int pkcs11_set_ui_method(PKCS11_CTX *ctx,
 	return 0;
 }
 
+/* Lookup arguments for the key indexes */
+typedef struct {
+	const PKCS11_keys *keys;
+	CK_OBJECT_HANDLE object;
+	const unsigned char *id;
+	size_t id_len;
+} PKCS11_KEY_MATCH;
+
+static int pkcs11_match_key_handle(const void *arg, unsigned int item)
+{
+	const PKCS11_KEY_MATCH *m = arg;
+
+	return PRIVKEY(m->keys->keys + item)->object == m->object;
+}
+
+static int pkcs11_match_key_id(const void *arg, unsigned int item)
+{
+	const PKCS11_KEY_MATCH *m = arg;
+	PKCS11_KEY_private *kpriv = PRIVKEY(m->keys->keys + item);
+
+	return kpriv->id_len == m->id_len && !memcmp(kpriv->id, m->id, m->id_len);
+}
+
+/*
+ * Find the first key of a given type with the specified CKA_ID
+ */
+static PKCS11_KEY *pkcs11_find_key_by_id(PKCS11_TOKEN *token, unsigned int type,
+		const unsigned char *id, size_t id_len)
+{
+	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(token);
+	PKCS11_keys *keys = (type == CKO_PRIVATE_KEY) ? &tpriv->prv : &tpriv->pub;
+	PKCS11_KEY_MATCH m;
+	PKCS11_KEY key_template;
+	int i;
+
+	/* Only search the token for keys with the specified ID */
+	memset(&key_template, 0, sizeof key_template);
+	key_template.id = (unsigned char *)id;
+	key_template.id_len = id_len;
+	if (pkcs11_enumerate_keys(token, type, id_len ? &key_template : NULL,
+			NULL, NULL))
+		return NULL;
+	m.keys = keys;
+	m.id = id;
+	m.id_len = id_len;
+	i = pkcs11_index_find(&keys->by_id, pkcs11_hash_bytes(id, id_len),
+		pkcs11_match_key_id, &m);
+	return i < 0 ? NULL : KEY2STABLE(keys->keys + i);
+}
+
 /*
  * Find private key matching a certificate
  */
 PKCS11_KEY *pkcs11_find_key(PKCS11_CERT *cert)
 {
 	PKCS11_CERT_private *cpriv = PRIVCERT(cert);
-	PKCS11_KEY *keys;
-	unsigned int n, count;
 
-	if (pkcs11_enumerate_keys(CERT2TOKEN(cert), CKO_PRIVATE_KEY, &keys, &count))
-		return NULL;
-	for (n = 0; n < count; n++) {
-		PKCS11_KEY_private *kpriv = PRIVKEY(&keys[n]);
-		if (kpriv && cpriv->id_len == kpriv->id_len
-				&& !memcmp(cpriv->id, kpriv->id, cpriv->id_len))
-			return &keys[n];
-	}
-	return NULL;
+	return pkcs11_find_key_by_id(CERT2TOKEN(cert), CKO_PRIVATE_KEY,
+		cpriv->id, cpriv->id_len);
 }
 
 /*
@@ -76,77 +129,257 @@ PKCS11_KEY *pkcs11_find_key(PKCS11_CERT *cert)
 PKCS11_KEY *pkcs11_find_key_from_key(PKCS11_KEY *keyin)
 {
 	PKCS11_KEY_private *kinpriv = PRIVKEY(keyin);
-	PKCS11_KEY *keys;
-	unsigned int n, count, type =
-		keyin->isPrivate ? CKO_PUBLIC_KEY : CKO_PRIVATE_KEY;
 
-	if (pkcs11_enumerate_keys(KEY2TOKEN(keyin), type, &keys, &count))
-		return NULL;
-	for (n = 0; n < count; n++) {
-		PKCS11_KEY_private *kpriv = PRIVKEY(&keys[n]);
-		if (kpriv && kinpriv->id_len == kpriv->id_len
-				&& !memcmp(kinpriv->id, kpriv->id, kinpriv->id_len))
-			return &keys[n];
-	}
-	return NULL;
+	return pkcs11_find_key_by_id(KEY2TOKEN(keyin),
+		keyin->isPrivate ? CKO_PUBLIC_KEY : CKO_PRIVATE_KEY,
+		kinpriv->id, kinpriv->id_len);
 }
 
 /*
- * Reopens the object associated with the key
+ * Find the object handle of a key by its class and ID
+ * The current handle is kept if it still refers to the key
  */
-int pkcs11_reload_key(PKCS11_KEY *key)
+static int pkcs11_find_key_object(PKCS11_SLOT *slot, CK_OBJECT_CLASS class,
+		unsigned char *id, size_t id_len, CK_OBJECT_HANDLE *object)
 {
-	PKCS11_KEY_private *kpriv = PRIVKEY(key);
-	PKCS11_SLOT *slot = KEY2SLOT(key);
 	PKCS11_CTX *ctx = SLOT2CTX(slot);
 	CK_SESSION_HANDLE session;
-	CK_OBJECT_CLASS key_search_class =
-		key->isPrivate ? CKO_PRIVATE_KEY : CKO_PUBLIC_KEY;
 	CK_ATTRIBUTE key_search_attrs[2] = {
-		{CKA_CLASS, &key_search_class, sizeof(key_search_class)},
-		{CKA_ID, kpriv->id, kpriv->id_len},
+		{CKA_CLASS, &class, sizeof(class)},
+		{CKA_ID, id, id_len},
 	};
 	CK_ULONG count;
+	unsigned long start;
 	int rv;
 
 	if (pkcs11_get_session(slot, 0, &session))
 		return -1;
 
+	if (pkcs11_check_object(ctx, session, *object, class, id, id_len)) {
+		pkcs11_put_session(slot, 0, session);
+		return 0;
+	}
 	rv = CRYPTOKI_call(ctx,
 		C_FindObjectsInit(session, key_search_attrs, 2));
 	if (rv == CKR_OK) {
+		start = pkcs11_stats_time();
 		rv = CRYPTOKI_call(ctx,
-			C_FindObjects(session, &kpriv->object, 1, &count));
+			C_FindObjects(session, object, 1, &count));
+		pkcs11_stats_record(slot, PKCS11_STATS_FIND,
+			PKCS11_STATS_NO_MECHANISM, rv, start);
 		CRYPTOKI_call(ctx, C_FindObjectsFinal(session));
 	}
+	pkcs11_put_session(slot, 0, session);
 	CRYPTOKI_checkerr(CKR_F_PKCS11_RELOAD_KEY, rv);
 
 	return 0;
 }
 
-/**
- * Generate a key pair directly on token
+/*
+ * Compare the public components loaded from the metadata cache with
+ * the values of the token, once the key has a handle
+ * Returns 0 if they match, 1 if they differ, or -1 on error
  */
-int pkcs11_generate_key(PKCS11_TOKEN *token, int algorithm, unsigned int bits,
-		char *label, unsigned char* id, size_t id_len) {
-
-	PKCS11_SLOT *slot = TOKEN2SLOT(token);
-	PKCS11_CTX *ctx = TOKEN2CTX(token);
+static int pkcs11_check_cached_key(PKCS11_KEY *key)
+{
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+	PKCS11_SLOT *slot = KEY2SLOT(key);
+	CK_ATTRIBUTE attrs[PKCS11_KEY_CACHED_ATTRS];
+	const CK_ATTRIBUTE *cached;
 	CK_SESSION_HANDLE session;
-	CK_ATTRIBUTE pubkey_attrs[32];
-	CK_ATTRIBUTE privkey_attrs[32];
-	unsigned int n_pub = 0, n_priv = 0;
-	CK_MECHANISM mechanism = {
-		CKM_RSA_PKCS_KEY_PAIR_GEN, NULL_PTR, 0
-	};
-	CK_BYTE public_exponent[] = { 1, 0, 1 };
-	CK_OBJECT_HANDLE pub_key_obj, priv_key_obj;
+	unsigned int i, n = kpriv->ncached;
 	int rv;
 
-	(void)algorithm; /* squash the unused parameter warning */
+	for (i = 0; i < n; i++)
+		attrs[i].type = kpriv->cached[i].type;
+	if (pkcs11_get_session(slot, 0, &session))
+		return -1;
+	rv = pkcs11_getattr_list(KEY2CTX(key), session, kpriv->object, attrs, n);
+	pkcs11_put_session(slot, 0, session);
+	if (rv)
+		return -1;
+	for (i = 0; i < n; i++) {
+		cached = kpriv->cached + i;
+		if (!attrs[i].pValue != !cached->pValue || (cached->pValue &&
+				(attrs[i].ulValueLen != cached->ulValueLen ||
+				memcmp(attrs[i].pValue, cached->pValue,
+					cached->ulValueLen))))
+			rv = 1;
+	}
+	pkcs11_zap_attrs(attrs, n);
+	return rv;
+}
 
-	if (pkcs11_get_session(slot, 1, &session))
+/*
+ * Reopens the object associated with the key
+ * The first reload of a key of the metadata cache checks its public
+ * components, which are otherwise read from the token.
+ */
+int pkcs11_reload_key(PKCS11_KEY *key)
+{
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(KEY2TOKEN(key));
+	CK_OBJECT_HANDLE object = kpriv->object;
+	int rv;
+
+	rv = pkcs11_find_key_object(KEY2SLOT(key),
+		key->isPrivate ? CKO_PRIVATE_KEY : CKO_PUBLIC_KEY,
+		kpriv->id, kpriv->id_len, &kpriv->object);
+	if (rv == 0 && kpriv->object == CK_INVALID_HANDLE) {
+		/* A key of the metadata cache no longer on the token */
+		pkcs11_metadata_stale(KEY2TOKEN(key));
+		CKRerr(CKR_F_PKCS11_RELOAD_KEY, CKR_KEY_HANDLE_INVALID);
+		return -1;
+	}
+	/* The handle index is rebuilt on the next enumeration */
+	if (kpriv->object != object)
+		pkcs11_index_free(key->isPrivate ?
+			&tpriv->prv.by_handle : &tpriv->pub.by_handle);
+	if (rv == 0 && kpriv->ncached && !kpriv->cached_checked) {
+		switch (pkcs11_check_cached_key(key)) {
+		case 0:
+			p11_atomic_store(&kpriv->cached_checked, 1);
+			break;
+		case 1: /* The token was modified with the same generation */
+			p11_atomic_store(&kpriv->ncached, 0);
+			pkcs11_metadata_stale(KEY2TOKEN(key));
+			break;
+		default:
+			return -1;
+		}
+	}
+	return rv;
+}
+
+/*
+ * Reopens the object associated with a replica of the key
+ */
+int pkcs11_reload_replica(PKCS11_KEY *key, PKCS11_KEY_REPLICA *replica)
+{
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+
+	return pkcs11_find_key_object(replica->slot, CKO_PRIVATE_KEY,
+		kpriv->id, kpriv->id_len, &replica->object);
+}
+
+/*
+ * Set the priority class of the operations with the key, or -1 to use
+ * the class of the calling thread
+ */
+int pkcs11_set_key_priority(PKCS11_KEY *key, int priority)
+{
+	if (priority < -1 || priority >= PKCS11_PRIORITIES) {
+		CKRerr(CKR_F_PKCS11_SET_KEY_PRIORITY, CKR_ARGUMENTS_BAD);
+		return -1;
+	}
+	p11_atomic_store(&PRIVKEY(key)->priority, priority + 1);
+	return 0;
+}
+
+int pkcs11_key_priority(PKCS11_KEY *key)
+{
+	int priority = p11_atomic_load(&PRIVKEY(key)->priority);
+
+	return priority ? priority - 1 : pkcs11_get_thread_priority();
+}
+
+/*
+ * Register the same private key stored on another token
+ * Private key operations are then distributed among the key and its replicas.
+ * The token may belong to another context, i.e. to another PKCS#11 module.
+ */
+int pkcs11_add_key_replica(PKCS11_KEY *key, PKCS11_KEY *replica)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(KEY2CTX(key));
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+	PKCS11_KEY_private *rpriv = PRIVKEY(replica);
+	PKCS11_SLOT *slot = KEY2SLOT(replica);
+	PKCS11_KEY_REPLICA *r;
+	unsigned int n;
+	int rv = -1;
+
+	if (!key->isPrivate || !replica->isPrivate ||
+			pkcs11_get_key_type(key) != pkcs11_get_key_type(replica))
 		return -1;
+	if (slot == KEY2SLOT(key))
+		return 0; /* Already included */
+
+	/* Serialized with the reinitialization after fork */
+	pthread_mutex_lock(&cpriv->fork_lock);
+	for (n = 0; n < kpriv->num_replicas; n++)
+		if (kpriv->replicas[n].slot == slot)
+			break;
+	if (n < kpriv->num_replicas) { /* Already included */
+		rv = 0;
+		goto done;
+	}
+	/* Reuse the entry of a replica whose token was removed */
+	for (n = 0; n < kpriv->num_replicas; n++)
+		if (!kpriv->replicas[n].slot)
+			break;
+	if (n >= PKCS11_MAX_REPLICAS)
+		goto done;
+	if (!kpriv->replicas) {
+		/* Never reallocated, so readers need no locking */
+		kpriv->replicas = OPENSSL_malloc(PKCS11_MAX_REPLICAS *
+			sizeof(PKCS11_KEY_REPLICA));
+		if (!kpriv->replicas)
+			goto done;
+	}
+	r = kpriv->replicas + n;
+	r->object = rpriv->object;
+	r->forkid = rpriv->forkid;
+	if (n == kpriv->num_replicas)
+		r->inflight = 0;
+	/* The operations skip the entry until its slot is set */
+	p11_atomic_store_ptr(&r->slot, slot);
+	if (n == kpriv->num_replicas)
+		p11_atomic_store(&kpriv->num_replicas, n + 1);
+	rv = 0;
+done:
+	pthread_mutex_unlock(&cpriv->fork_lock);
+	return rv;
+}
+
+/*
+ * Update the replicas of the private keys of a slot list after the slot
+ * of the replicas was moved to a new list, or its token was removed when
+ * "to" is NULL, so that the replicas never refer to a released slot
+ * The replicas stored in other contexts are not updated.
+ * The caller holds the fork_lock of the context.
+ */
+void pkcs11_move_replicas(PKCS11_SLOT *slots, unsigned int nslots,
+		PKCS11_SLOT *from, PKCS11_SLOT *to)
+{
+	PKCS11_TOKEN_private *tpriv;
+	PKCS11_KEY_private *kpriv;
+	unsigned int i, k;
+	int j;
+
+	for (i = 0; i < nslots; i++) {
+		if (!slots[i].token || !slots[i].token->_private)
+			continue;
+		tpriv = PRIVTOKEN(slots[i].token);
+		for (j = 0; j < tpriv->prv.num; j++) {
+			kpriv = PRIVKEY(tpriv->prv.keys + j);
+			for (k = 0; k < kpriv->num_replicas; k++)
+				if (kpriv->replicas[k].slot == from)
+					p11_atomic_store_ptr(&kpriv->replicas[k].slot, to);
+		}
+	}
+}
+
+/*
+ * Build the templates of an RSA key pair generated on the token
+ * The templates are released with pkcs11_zap_attrs()
+ */
+void pkcs11_keygen_templates(unsigned int bits,
+		const char *label, const unsigned char *id, size_t id_len,
+		CK_ATTRIBUTE *pubkey_attrs, unsigned int *n_pubp,
+		CK_ATTRIBUTE *privkey_attrs, unsigned int *n_privp)
+{
+	CK_BYTE public_exponent[] = { 1, 0, 1 };
+	unsigned int n_pub = 0, n_priv = 0;
 
 	/* pubkey attributes */
 	pkcs11_addattr(pubkey_attrs + n_pub++, CKA_ID, id, id_len);
@@ -171,6 +404,36 @@ int pkcs11_generate_key(PKCS11_TOKEN *token, int algorithm, unsigned int bits,
 	pkcs11_addattr_bool(privkey_attrs + n_priv++, CKA_SIGN, TRUE);
 	pkcs11_addattr_bool(privkey_attrs + n_priv++, CKA_UNWRAP, TRUE);
 
+	*n_pubp = n_pub;
+	*n_privp = n_priv;
+}
+
+/**
+ * Generate a key pair directly on token
+ */
+int pkcs11_generate_key(PKCS11_TOKEN *token, int algorithm, unsigned int bits,
+		char *label, unsigned char* id, size_t id_len) {
+
+	PKCS11_SLOT *slot = TOKEN2SLOT(token);
+	PKCS11_CTX *ctx = TOKEN2CTX(token);
+	CK_SESSION_HANDLE session;
+	CK_ATTRIBUTE pubkey_attrs[32];
+	CK_ATTRIBUTE privkey_attrs[32];
+	unsigned int n_pub = 0, n_priv = 0;
+	CK_MECHANISM mechanism = {
+		CKM_RSA_PKCS_KEY_PAIR_GEN, NULL_PTR, 0
+	};
+	CK_OBJECT_HANDLE pub_key_obj, priv_key_obj;
+	int rv;
+
+	(void)algorithm; /* squash the unused parameter warning */
+
+	if (pkcs11_get_session(slot, 1, &session))
+		return -1;
+
+	pkcs11_keygen_templates(bits, label, id, id_len,
+		pubkey_attrs, &n_pub, privkey_attrs, &n_priv);
+
 	/* call the pkcs11 module to create the key pair */
 	rv = CRYPTOKI_call(ctx, C_GenerateKeyPair(
 		session,
@@ -182,7 +445,7 @@ int pkcs11_generate_key(PKCS11_TOKEN *token, int algorithm, unsigned int bits,
 		&pub_key_obj,
 		&priv_key_obj
 	));
-	pkcs11_put_session(slot, session);
+	pkcs11_put_session(slot, 1, session);
 
 	/* zap all memory allocated when building the template */
 	pkcs11_zap_attrs(privkey_attrs, n_priv);
@@ -213,19 +476,15 @@ int pkcs11_store_public_key(PKCS11_TOKEN *token, EVP_PKEY *pk,
 }
 
 /*
- * Store private key
+ * Build the template of a key object created from an EVP_PKEY
+ * The template is released with pkcs11_zap_attrs()
+ * Returns the number of attributes, or -1 if the key type is not supported
  */
-static int pkcs11_store_key(PKCS11_TOKEN *token, EVP_PKEY *pk,
-		unsigned int type, char *label, unsigned char *id, size_t id_len,
-		PKCS11_KEY ** ret_key)
+int pkcs11_key_create_template(CK_ATTRIBUTE *attrs, EVP_PKEY *pk,
+		CK_OBJECT_CLASS type, const char *label,
+		const unsigned char *id, size_t id_len)
 {
-	PKCS11_SLOT *slot = TOKEN2SLOT(token);
-	PKCS11_CTX *ctx = TOKEN2CTX(token);
-	CK_SESSION_HANDLE session;
-	CK_OBJECT_HANDLE object;
-	CK_ATTRIBUTE attrs[32];
 	unsigned int n = 0;
-	int rv, r = -1;
 	const BIGNUM *rsa_n, *rsa_e, *rsa_d, *rsa_p, *rsa_q, *rsa_dmp1, *rsa_dmq1, *rsa_iqmp;
 
 	/* Now build the key attrs */
@@ -285,6 +544,27 @@ static int pkcs11_store_key(PKCS11_TOKEN *token, EVP_PKEY *pk,
 		P11err(P11_F_PKCS11_STORE_KEY, P11_R_NOT_SUPPORTED);
 		return -1;
 	}
+	return (int)n;
+}
+
+/*
+ * Store private key
+ */
+static int pkcs11_store_key(PKCS11_TOKEN *token, EVP_PKEY *pk,
+		unsigned int type, char *label, unsigned char *id, size_t id_len,
+		PKCS11_KEY ** ret_key)
+{
+	PKCS11_SLOT *slot = TOKEN2SLOT(token);
+	PKCS11_CTX *ctx = TOKEN2CTX(token);
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE object;
+	CK_ATTRIBUTE attrs[32];
+	int n;
+	int rv, r = -1;
+
+	n = pkcs11_key_create_template(attrs, pk, type, label, id, id_len);
+	if (n < 0)
+		return -1;
 
 	if (pkcs11_get_session(slot, 1, &session)) {
 		pkcs11_zap_attrs(attrs, n);
@@ -301,7 +581,7 @@ static int pkcs11_store_key(PKCS11_TOKEN *token, EVP_PKEY *pk,
 		/* Gobble the key object */
 		r = pkcs11_init_key(ctx, token, session, object, type, ret_key);
 	}
-	pkcs11_put_session(slot, session);
+	pkcs11_put_session(slot, 1, session);
 
 	CRYPTOKI_checkerr(CKR_F_PKCS11_STORE_KEY, rv);
 	return r;
@@ -322,18 +602,27 @@ int pkcs11_get_key_type(PKCS11_KEY *key)
  * Create an EVP_PKEY OpenSSL object for a given key
  * Returns private or public key depending on isPrivate
  */
-EVP_PKEY *pkcs11_get_key(PKCS11_KEY *key, int isPrivate)
+EVP_PKEY *pkcs11_get_key(PKCS11_KEY *keyin, int isPrivate)
 {
-	if (key->isPrivate != isPrivate)
-		key = pkcs11_find_key_from_key(key);
-	if (!key)
+	PKCS11_KEY *key;
+
+	if (keyin->isPrivate != isPrivate) {
+		keyin = pkcs11_find_key_from_key(keyin);
+		/* A key of the metadata cache gets its handle */
+		if (keyin && check_key_fork(keyin) < 0)
+			return NULL;
+	}
+	if (!keyin)
 		return NULL;
+	/* The EVP_PKEY refers to the key that does not move */
+	key = KEY2STABLE(keyin);
 	if (!key->evp_key) {
 		PKCS11_KEY_private *kpriv = PRIVKEY(key);
 		key->evp_key = kpriv->ops->get_evp_key(key);
 		if (!key->evp_key)
 			return NULL;
 	}
+	keyin->evp_key = key->evp_key;
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
 	EVP_PKEY_up_ref(key->evp_key);
 #else
@@ -346,10 +635,73 @@ EVP_PKEY *pkcs11_get_key(PKCS11_KEY *key, int isPrivate)
  * Authenticate a private the key operation if needed
  * This function *only* handles CKU_CONTEXT_SPECIFIC logins.
  */
-int pkcs11_authenticate(PKCS11_KEY *key, CK_SESSION_HANDLE session)
+/* Wipe the cached context-specific PIN of the key */
+static void pkcs11_auth_pin_clear(PKCS11_KEY_private *kpriv)
 {
-	PKCS11_TOKEN *token = KEY2TOKEN(key);
-	PKCS11_SLOT *slot = TOKEN2SLOT(token);
+	if (kpriv->auth_pin) {
+		pkcs11_secure_clear_free(kpriv->auth_pin, MAX_PIN_LENGTH+1);
+		kpriv->auth_pin = NULL;
+	}
+}
+
+/* Copy the cached PIN of the key if it is still valid, returns 1 if found */
+static int pkcs11_auth_pin_get(PKCS11_KEY *key, char *pin)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(KEY2CTX(key));
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+	int found = 0;
+
+	pthread_mutex_lock(&cpriv->auth_pin_lock);
+	if (kpriv->auth_pin) {
+		if (cpriv->auth_pin_ttl > 0 &&
+				time(NULL) < kpriv->auth_pin_expires &&
+				(!cpriv->auth_pin_max_uses ||
+					kpriv->auth_pin_uses < cpriv->auth_pin_max_uses)) {
+			memcpy(pin, kpriv->auth_pin, MAX_PIN_LENGTH+1);
+			kpriv->auth_pin_uses++;
+			found = 1;
+		} else {
+			pkcs11_auth_pin_clear(kpriv);
+		}
+	}
+	pthread_mutex_unlock(&cpriv->auth_pin_lock);
+	return found;
+}
+
+/* Cache the PIN accepted by the token, if enabled */
+static void pkcs11_auth_pin_put(PKCS11_KEY *key, const char *pin)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(KEY2CTX(key));
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+
+	pthread_mutex_lock(&cpriv->auth_pin_lock);
+	if (cpriv->auth_pin_ttl > 0) {
+		if (!kpriv->auth_pin)
+			kpriv->auth_pin = pkcs11_secure_malloc(MAX_PIN_LENGTH+1);
+		if (kpriv->auth_pin) {
+			memcpy(kpriv->auth_pin, pin, MAX_PIN_LENGTH+1);
+			kpriv->auth_pin_expires = time(NULL) + cpriv->auth_pin_ttl;
+			kpriv->auth_pin_uses = 1;
+		}
+	}
+	pthread_mutex_unlock(&cpriv->auth_pin_lock);
+}
+
+/* Forget a cached PIN rejected by the token */
+static void pkcs11_auth_pin_reject(PKCS11_KEY *key)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(KEY2CTX(key));
+
+	pthread_mutex_lock(&cpriv->auth_pin_lock);
+	pkcs11_auth_pin_clear(PRIVKEY(key));
+	pthread_mutex_unlock(&cpriv->auth_pin_lock);
+}
+
+/* The slot is the one of the key, or of a replica of the key */
+int pkcs11_authenticate(PKCS11_KEY *key, PKCS11_SLOT *slot,
+		CK_SESSION_HANDLE session)
+{
+	PKCS11_TOKEN *token = slot->token;
 	PKCS11_CTX *ctx = SLOT2CTX(slot);
 	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
 	char pin[MAX_PIN_LENGTH+1];
@@ -364,6 +716,17 @@ int pkcs11_authenticate(PKCS11_KEY *key, CK_SESSION_HANDLE session)
 		return rv == CKR_USER_ALREADY_LOGGED_IN ? 0 : rv;
 	}
 
+	/* Use the cached PIN, or ask again if the token rejected it */
+	if (pkcs11_auth_pin_get(key, pin)) {
+		rv = CRYPTOKI_call(ctx,
+			C_Login(session, CKU_CONTEXT_SPECIFIC,
+				(CK_UTF8CHAR *)pin, strlen(pin)));
+		OPENSSL_cleanse(pin, MAX_PIN_LENGTH+1);
+		if (rv == CKR_OK || rv == CKR_USER_ALREADY_LOGGED_IN)
+			return 0;
+		pkcs11_auth_pin_reject(key);
+	}
+
 	/* Call UI to ask for a PIN */
 	ui = UI_new_method(cpriv->ui_method);
 	if (!ui)
@@ -393,43 +756,619 @@ int pkcs11_authenticate(PKCS11_KEY *key, CK_SESSION_HANDLE session)
 	rv = CRYPTOKI_call(ctx,
 		C_Login(session, CKU_CONTEXT_SPECIFIC,
 			(CK_UTF8CHAR *)pin, strlen(pin)));
+	if (rv == CKR_OK || rv == CKR_USER_ALREADY_LOGGED_IN)
+		pkcs11_auth_pin_put(key, pin);
 	OPENSSL_cleanse(pin, MAX_PIN_LENGTH+1);
 	return rv == CKR_USER_ALREADY_LOGGED_IN ? 0 : rv;
 }
 
+typedef struct pkcs11_private_op_args {
+	PKCS11_KEY *key;
+	PKCS11_SLOT *slot; /* slot of the key or its replica */
+	CK_OBJECT_HANDLE object;
+	int op;
+	CK_MECHANISM *mechanism;
+	const unsigned char *in;
+	CK_ULONG inlen;
+	unsigned char *out;
+	CK_ULONG *outlen;
+	long timeout; /* see pkcs11_get_session_prio() */
+	int priority; /* of the calling thread, not of the worker thread */
+	int no_session; /* 1 on timeout, -1 on other errors */
+	int logged_in; /* login state of the slot before the operation */
+} PKCS11_PRIVATE_OP_ARGS;
+
+static CK_RV pkcs11_private_op_run(void *arg)
+{
+	PKCS11_PRIVATE_OP_ARGS *args = arg;
+	PKCS11_KEY *key = args->key;
+	PKCS11_SLOT *slot = args->slot;
+	PKCS11_CTX *ctx = SLOT2CTX(slot); /* the replica may use another module */
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+	CK_SESSION_HANDLE session;
+	CK_BYTE_PTR in = (CK_BYTE_PTR)args->in;
+	unsigned long start;
+	int op;
+	CK_RV rv;
+
+	args->no_session = pkcs11_get_session_prio(slot, 0, &session,
+		args->timeout, args->priority);
+	if (args->no_session)
+		return CKR_GENERAL_ERROR;
+	args->logged_in = PRIVSLOT(slot)->logged_in;
+
+	start = pkcs11_stats_time();
+	switch (args->op) {
+	case PKCS11_OP_SIGN:
+		op = PKCS11_STATS_SIGN;
+		rv = CRYPTOKI_call(ctx,
+			C_SignInit(session, args->mechanism, args->object));
+		if (!rv && kpriv->always_authenticate == CK_TRUE)
+			rv = pkcs11_authenticate(key, slot, session);
+		if (!rv)
+			rv = CRYPTOKI_call(ctx,
+				C_Sign(session, in, args->inlen, args->out, args->outlen));
+		break;
+	case PKCS11_OP_DECRYPT:
+		op = PKCS11_STATS_DECRYPT;
+		rv = CRYPTOKI_call(ctx,
+			C_DecryptInit(session, args->mechanism, args->object));
+		if (!rv && kpriv->always_authenticate == CK_TRUE)
+			rv = pkcs11_authenticate(key, slot, session);
+		if (!rv)
+			rv = CRYPTOKI_call(ctx,
+				C_Decrypt(session, in, args->inlen, args->out, args->outlen));
+		break;
+	case PKCS11_OP_ENCRYPT:
+		op = PKCS11_STATS_ENCRYPT;
+		rv = CRYPTOKI_call(ctx,
+			C_EncryptInit(session, args->mechanism, args->object));
+		if (!rv && kpriv->always_authenticate == CK_TRUE)
+			rv = pkcs11_authenticate(key, slot, session);
+		if (!rv)
+			rv = CRYPTOKI_call(ctx,
+				C_Encrypt(session, in, args->inlen, args->out, args->outlen));
+		break;
+	case PKCS11_OP_VERIFY:
+		op = PKCS11_STATS_VERIFY;
+		rv = CRYPTOKI_call(ctx,
+			C_VerifyInit(session, args->mechanism, args->object));
+		if (!rv)
+			rv = CRYPTOKI_call(ctx,
+				C_Verify(session, in, args->inlen, args->out, *args->outlen));
+		break;
+	default:
+		pkcs11_put_session(slot, 0, session);
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	}
+	pkcs11_stats_record(slot, op, args->mechanism->mechanism, rv, start);
+	pkcs11_put_session_rv(slot, 0, session, rv);
+	return rv;
+}
+
+static CK_RV pkcs11_private_op_dispatch(PKCS11_PRIVATE_OP_ARGS *args)
+{
+	PKCS11_KEY *key = args->key;
+
+	if (PRIVKEY(key)->always_authenticate == CK_TRUE &&
+			!args->slot->token->secureLogin)
+		return pkcs11_private_op_run(args);
+	return pkcs11_async_call(SLOT2CTX(args->slot), pkcs11_private_op_run, args);
+}
+
+/* Errors indicating that the login state of the slot was lost */
+static int pkcs11_login_lost(CK_RV rv)
+{
+	return rv == CKR_USER_NOT_LOGGED_IN ||
+		rv == CKR_SESSION_HANDLE_INVALID || rv == CKR_SESSION_CLOSED;
+}
+
+static CK_RV pkcs11_private_op_call(PKCS11_PRIVATE_OP_ARGS *args)
+{
+	CK_ULONG size = *args->outlen;
+	CK_RV rv;
+
+	args->logged_in = -1;
+	rv = pkcs11_private_op_dispatch(args);
+	/* Retry once after the user was logged out behind our back */
+	if (pkcs11_login_lost(rv) && args->logged_in == 0 &&
+			pkcs11_relogin(args->slot) == 0) {
+		*args->outlen = size;
+		rv = pkcs11_private_op_dispatch(args);
+	}
+	return rv;
+}
+
+/* Errors indicating that another replica should be tried */
+static int pkcs11_replica_failed(PKCS11_PRIVATE_OP_ARGS *args, CK_RV rv)
+{
+	return args->no_session || rv == CKR_DEVICE_ERROR ||
+		rv == CKR_DEVICE_REMOVED || rv == CKR_TOKEN_NOT_PRESENT ||
+		rv == CKR_KEY_HANDLE_INVALID;
+}
+
+/* Select the member with the fewest outstanding operations, or n + 1 */
+static unsigned int pkcs11_replica_select(PKCS11_KEY_private *kpriv,
+		unsigned int n, unsigned int skip)
+{
+	unsigned int i, *inflight, best = n + 1, best_inflight = 0;
+
+	/* Member 0 is the key itself, members 1..n are its replicas */
+	for (i = 0; i <= n; i++) {
+		if (skip & (1U << i))
+			continue;
+		if (i && !p11_atomic_load_ptr(&kpriv->replicas[i - 1].slot))
+			continue; /* Its token was removed */
+		inflight = i ? &kpriv->replicas[i - 1].inflight :
+			&kpriv->inflight;
+		if (best > n || p11_atomic_load(inflight) < best_inflight) {
+			best = i;
+			best_inflight = p11_atomic_load(inflight);
+		}
+	}
+	return best;
+}
+
 /*
- * Return keys of a given type (public or private)
- * Use the cached values if available
+ * Check whether an operation would be rejected by the token, so that
+ * the callers select another function, or fall back, without calling it.
+ * Only the token of the key is checked for replicated keys.
+ * Returns CKR_OK, CKR_KEY_FUNCTION_NOT_PERMITTED, or CKR_MECHANISM_INVALID
  */
-int pkcs11_enumerate_keys(PKCS11_TOKEN *token, unsigned int type,
-		PKCS11_KEY ** keyp, unsigned int *countp)
+CK_RV pkcs11_check_key_op(PKCS11_KEY *key, int op,
+		CK_MECHANISM_TYPE mechanism)
+{
+	static const CK_FLAGS functions[] = {
+		CKF_SIGN, CKF_DECRYPT, CKF_ENCRYPT, CKF_VERIFY, CKF_DERIVE
+	};
+
+	if (PRIVKEY(key)->denied & (1U << op))
+		return CKR_KEY_FUNCTION_NOT_PERMITTED;
+	return pkcs11_check_mechanism(KEY2SLOT(key), mechanism, functions[op]);
+}
+
+/*
+ * Perform a single-part private key operation
+ * Within an ASYNC_JOB the operation is performed by a worker thread,
+ * unless a context-specific PIN needs to be requested via the UI.
+ * If the key has replicas, the replica with the fewest outstanding
+ * operations is used, and the remaining ones are tried on device errors.
+ * Replicas without a session available are skipped, and the session
+ * timeout is only waited for when all of them are busy.
+ * The operations rejected by pkcs11_check_key_op() fail immediately.
+ * Returns the PKCS#11 return value; errors are not reported here,
+ * except for the session timeout.
+ */
+CK_RV pkcs11_private_op(PKCS11_KEY *key, int op, CK_MECHANISM *mechanism,
+		const unsigned char *in, CK_ULONG inlen,
+		unsigned char *out, CK_ULONG *outlen)
+{
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+	PKCS11_PRIVATE_OP_ARGS args;
+	unsigned int n, *inflight, best, tried = 0, busy = 0;
+	long timeout = p11_atomic_load(&PRIVCTX(KEY2CTX(key))->session_timeout);
+	int wait = 0;
+	CK_ULONG size = *outlen;
+	CK_RV rv;
+
+	rv = pkcs11_check_key_op(key, op, mechanism->mechanism);
+	if (rv != CKR_OK)
+		return rv;
+	rv = CKR_GENERAL_ERROR;
+
+	args.key = key;
+	args.slot = KEY2SLOT(key);
+	args.object = kpriv->object;
+	args.op = op;
+	args.mechanism = mechanism;
+	args.in = in;
+	args.inlen = inlen;
+	args.out = out;
+	args.outlen = outlen;
+	args.timeout = timeout;
+	args.priority = pkcs11_key_priority(key);
+	args.no_session = 0;
+
+	n = p11_atomic_load(&kpriv->num_replicas);
+	if (!n) {
+		rv = pkcs11_private_op_call(&args);
+		if (args.no_session > 0)
+			pkcs11_session_timeout(args.slot);
+		return rv;
+	}
+
+	for (;;) {
+		best = pkcs11_replica_select(kpriv, n, wait ? tried : tried | busy);
+		if (best > n) {
+			if (wait || !busy) /* All the members failed */
+				return rv;
+			wait = 1; /* All the remaining members are busy */
+			continue;
+		}
+		if (best) {
+			args.slot = p11_atomic_load_ptr(&kpriv->replicas[best - 1].slot);
+			args.object = kpriv->replicas[best - 1].object;
+			inflight = &kpriv->replicas[best - 1].inflight;
+			if (!args.slot) { /* Removed meanwhile */
+				tried |= 1U << best;
+				continue;
+			}
+		} else {
+			args.slot = KEY2SLOT(key);
+			args.object = kpriv->object;
+			inflight = &kpriv->inflight;
+		}
+		args.timeout = wait ? timeout : 0;
+		args.no_session = 0;
+		*outlen = size;
+
+		p11_atomic_add(inflight, 1);
+		rv = pkcs11_private_op_call(&args);
+		p11_atomic_add(inflight, -1);
+		if (args.no_session > 0) {
+			if (wait) {
+				pkcs11_session_timeout(args.slot);
+				return rv;
+			}
+			busy |= 1U << best;
+			continue;
+		}
+		tried |= 1U << best;
+		if (!pkcs11_replica_failed(&args, rv))
+			return rv;
+	}
+}
+
+/*
+ * Verify a signature with the public key object of the token
+ * The matching public key object is looked up for private keys.
+ * Returns 1 for a valid signature, 0 for an invalid one, or -1 on error
+ */
+int pkcs11_verify_token(PKCS11_KEY *key, CK_MECHANISM *mechanism,
+		const unsigned char *in, CK_ULONG inlen,
+		const unsigned char *sig, CK_ULONG siglen)
+{
+	CK_RV rv;
+
+	if (key->isPrivate)
+		key = pkcs11_find_key_from_key(key);
+	if (!key) {
+		P11err(P11_F_PKCS11_VERIFY, P11_R_NOT_SUPPORTED);
+		return -1;
+	}
+	rv = pkcs11_private_op(key, PKCS11_OP_VERIFY, mechanism,
+		in, inlen, (unsigned char *)sig, &siglen);
+	if (rv == CKR_SIGNATURE_INVALID || rv == CKR_SIGNATURE_LEN_RANGE)
+		return 0;
+	if (rv) {
+		CKRerr(CKR_F_PKCS11_VERIFY, rv);
+		return -1;
+	}
+	return 1;
+}
+
+/* Results of a lane of a batch */
+#define PKCS11_LANE_DONE 0 /* no requests left */
+#define PKCS11_LANE_BUSY 1 /* no session available within the timeout */
+#define PKCS11_LANE_FAILED 2 /* the session or the token cannot be used */
+
+typedef struct pkcs11_sign_batch {
+	PKCS11_KEY *key;
+	CK_MECHANISM mechanism;
+	PKCS11_SIGN_REQ *reqs;
+	unsigned int count;
+	int priority; /* of the calling thread */
+	unsigned int next; /* next request to be processed */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int running; /* lanes submitted to the worker threads */
+	CK_RV error; /* of the last failed lane, protected by lock */
+	/* requests of the retired lanes, protected by lock */
+	unsigned int retry[PKCS11_MAX_BATCH_LANES + PKCS11_MAX_REPLICAS + 1];
+	unsigned int num_retry;
+} PKCS11_SIGN_BATCH;
+
+typedef struct pkcs11_sign_lane {
+	PKCS11_TASK task;
+	PKCS11_SIGN_BATCH *batch;
+	unsigned int member; /* 0 for the key, or 1 + the index of a replica */
+} PKCS11_SIGN_LANE;
+
+/* Errors retiring a lane, since its session or token cannot be used */
+static int pkcs11_lane_failed(CK_RV rv)
+{
+	return pkcs11_login_lost(rv) || rv == CKR_DEVICE_ERROR ||
+		rv == CKR_DEVICE_REMOVED || rv == CKR_TOKEN_NOT_PRESENT ||
+		rv == CKR_KEY_HANDLE_INVALID;
+}
+
+/* Next request to be processed, the ones of the retired lanes first */
+static unsigned int pkcs11_sign_batch_next(PKCS11_SIGN_BATCH *batch)
+{
+	unsigned int i = batch->count;
+
+	if (p11_atomic_load(&batch->num_retry)) {
+		pthread_mutex_lock(&batch->lock);
+		if (batch->num_retry) {
+			i = batch->retry[batch->num_retry - 1];
+			p11_atomic_store(&batch->num_retry, batch->num_retry - 1);
+		}
+		pthread_mutex_unlock(&batch->lock);
+		if (i < batch->count)
+			return i;
+	}
+	return p11_atomic_add(&batch->next, 1) - 1;
+}
+
+/*
+ * Sign the pending batch requests with a single session of a member
+ * The lane is retired on the first error of the session or the token,
+ * and its failed request is retried by the other lanes.
+ * Each lane is retired at most once, so that the retry list cannot
+ * overflow, and the requests are retried at most once per lane.
+ * Returns PKCS11_LANE_DONE, PKCS11_LANE_BUSY or PKCS11_LANE_FAILED
+ */
+static int pkcs11_sign_batch_lane(PKCS11_SIGN_BATCH *batch,
+		unsigned int member, long timeout)
+{
+	PKCS11_KEY *key = batch->key;
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+	PKCS11_SLOT *slot = KEY2SLOT(key);
+	CK_OBJECT_HANDLE object = kpriv->object;
+	unsigned int *inflight = &kpriv->inflight;
+	PKCS11_CTX *ctx;
+	CK_SESSION_HANDLE session;
+	PKCS11_SIGN_REQ *req;
+	CK_ULONG size;
+	unsigned long start;
+	unsigned int i;
+	int ret = PKCS11_LANE_DONE;
+	CK_RV rv = CKR_OK;
+
+	if (member) {
+		slot = p11_atomic_load_ptr(&kpriv->replicas[member - 1].slot);
+		object = kpriv->replicas[member - 1].object;
+		inflight = &kpriv->replicas[member - 1].inflight;
+		if (!slot) /* Its token was removed */
+			return PKCS11_LANE_FAILED;
+	}
+	ctx = SLOT2CTX(slot); /* the replica may use another module */
+	switch (pkcs11_get_session_prio(slot, 0, &session, timeout,
+			batch->priority)) {
+	case 0:
+		break;
+	case 1:
+		return PKCS11_LANE_BUSY; /* Other lanes will process the requests */
+	default:
+		return PKCS11_LANE_FAILED;
+	}
+	p11_atomic_add(inflight, 1);
+	while ((i = pkcs11_sign_batch_next(batch)) < batch->count) {
+		req = batch->reqs + i;
+		size = req->siglen;
+		start = pkcs11_stats_time();
+		rv = CRYPTOKI_call(ctx,
+			C_SignInit(session, &batch->mechanism, object));
+		if (!rv && kpriv->always_authenticate == CK_TRUE)
+			rv = pkcs11_authenticate(key, slot, session);
+		if (!rv)
+			rv = CRYPTOKI_call(ctx,
+				C_Sign(session, (CK_BYTE_PTR)req->tbs, req->tbslen,
+					req->sig, &size));
+		pkcs11_stats_record(slot, PKCS11_STATS_SIGN,
+			batch->mechanism.mechanism, rv, start);
+		req->siglen = size;
+		req->rv = rv;
+		if (pkcs11_lane_failed(rv)) {
+			pthread_mutex_lock(&batch->lock);
+			batch->error = rv;
+			batch->retry[batch->num_retry] = i;
+			p11_atomic_store(&batch->num_retry, batch->num_retry + 1);
+			pthread_mutex_unlock(&batch->lock);
+			ret = PKCS11_LANE_FAILED;
+			break;
+		}
+	}
+	p11_atomic_add(inflight, -1);
+	pkcs11_put_session_rv(slot, 0, session, rv);
+	return ret;
+}
+
+static void pkcs11_sign_batch_run(PKCS11_TASK *task)
+{
+	PKCS11_SIGN_LANE *lane = (PKCS11_SIGN_LANE *)task;
+	PKCS11_SIGN_BATCH *batch = lane->batch;
+
+	/* Worker threads never wait for a session */
+	pkcs11_sign_batch_lane(batch, lane->member, 0);
+	pthread_mutex_lock(&batch->lock);
+	if (--batch->running == 0)
+		pthread_cond_signal(&batch->cond);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/*
+ * Assign the lanes to the key and its replicas in turn, each of them
+ * with at most as many lanes as its token allows sessions
+ * Returns the number of lanes, lane 0 being assigned to the key
+ */
+static unsigned int pkcs11_sign_batch_lanes(PKCS11_KEY *key,
+		PKCS11_SIGN_LANE *lanes, unsigned int max_lanes)
+{
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+	PKCS11_SLOT *slot;
+	unsigned int limits[PKCS11_MAX_REPLICAS + 1];
+	unsigned int m, n, nlanes = 0;
+	int assigned;
+
+	n = p11_atomic_load(&kpriv->num_replicas);
+	limits[0] = pkcs11_session_limit(KEY2SLOT(key), 0);
+	for (m = 1; m <= n; m++) {
+		slot = p11_atomic_load_ptr(&kpriv->replicas[m - 1].slot);
+		limits[m] = slot ? pkcs11_session_limit(slot, 0) : 0;
+	}
+	do {
+		assigned = 0;
+		for (m = 0; m <= n && nlanes < max_lanes; m++) {
+			if (!limits[m])
+				continue;
+			limits[m]--;
+			lanes[nlanes++].member = m;
+			assigned = 1;
+		}
+	} while (assigned && nlanes < max_lanes);
+	return nlanes;
+}
+
+/*
+ * Sign a vector of requests using as many sessions as the slots of the
+ * key and its replicas allow
+ * The calling thread fails over to the other members when its lane is
+ * retired, so that the requests are processed while any member works.
+ * Returns 0 if all the requests succeeded, or -1 otherwise
+ */
+int pkcs11_sign_batch(PKCS11_KEY *key, unsigned long mechanism,
+		PKCS11_SIGN_REQ *reqs, unsigned int count)
+{
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+	PKCS11_SIGN_BATCH batch;
+	PKCS11_SIGN_LANE lanes[PKCS11_MAX_BATCH_LANES];
+	PKCS11_SLOT *slot;
+	unsigned int i, nlanes, max_lanes, member, tried = 0;
+	int ret;
+	CK_RV rv;
+
+	if (!count)
+		return 0;
+	rv = pkcs11_check_key_op(key, PKCS11_OP_SIGN, mechanism);
+	for (i = 0; i < count; i++)
+		reqs[i].rv = rv == CKR_OK ? CKR_GENERAL_ERROR : rv;
+	if (rv != CKR_OK) {
+		CKRerr(CKR_F_PKCS11_SIGN_BATCH, rv);
+		return -1;
+	}
+
+	memset(&batch, 0, sizeof(batch));
+	batch.key = key;
+	batch.mechanism.mechanism = mechanism;
+	batch.reqs = reqs;
+	batch.count = count;
+	batch.priority = pkcs11_key_priority(key);
+	pthread_mutex_init(&batch.lock, 0);
+	pthread_cond_init(&batch.cond, 0);
+
+	max_lanes = count < PKCS11_MAX_BATCH_LANES ?
+		count : PKCS11_MAX_BATCH_LANES;
+	/* The context-specific PIN has to be requested in the calling thread */
+	if (kpriv->always_authenticate == CK_TRUE &&
+			!KEY2TOKEN(key)->secureLogin)
+		max_lanes = 1;
+	nlanes = pkcs11_sign_batch_lanes(key, lanes, max_lanes);
+
+	/* The calling thread processes one of the lanes */
+	for (i = 1; i < nlanes; i++) {
+		lanes[i].task.run = pkcs11_sign_batch_run;
+		lanes[i].batch = &batch;
+		pthread_mutex_lock(&batch.lock);
+		batch.running++;
+		pthread_mutex_unlock(&batch.lock);
+		if (pkcs11_task_submit(KEY2CTX(key), &lanes[i].task) < 0) {
+			pthread_mutex_lock(&batch.lock);
+			batch.running--;
+			pthread_mutex_unlock(&batch.lock);
+			break;
+		}
+	}
+	member = 0;
+	for (;;) {
+		ret = pkcs11_sign_batch_lane(&batch, member,
+			p11_atomic_load(&PRIVCTX(KEY2CTX(key))->session_timeout));
+		if (ret == PKCS11_LANE_FAILED) {
+			tried |= 1U << member;
+			member = pkcs11_replica_select(kpriv,
+				p11_atomic_load(&kpriv->num_replicas), tried);
+			if (member > p11_atomic_load(&kpriv->num_replicas))
+				break;
+			continue;
+		}
+		/* Retry the requests of the lanes retired meanwhile */
+		pthread_mutex_lock(&batch.lock);
+		while (batch.running)
+			pthread_cond_wait(&batch.cond, &batch.lock);
+		pthread_mutex_unlock(&batch.lock);
+		if (ret == PKCS11_LANE_BUSY || !batch.num_retry)
+			break;
+	}
+
+	pthread_mutex_lock(&batch.lock);
+	while (batch.running)
+		pthread_cond_wait(&batch.cond, &batch.lock);
+	pthread_mutex_unlock(&batch.lock);
+	pthread_mutex_destroy(&batch.lock);
+	pthread_cond_destroy(&batch.cond);
+
+	/* The requests left by the retired lanes failed with them */
+	if (batch.error != CKR_OK)
+		for (i = batch.next; i < count; i++)
+			reqs[i].rv = batch.error;
+	for (i = 0; i < count; i++) {
+		if (reqs[i].rv != CKR_OK) {
+			if (ret == PKCS11_LANE_BUSY) {
+				slot = member ? p11_atomic_load_ptr(
+					&kpriv->replicas[member - 1].slot) : NULL;
+				pkcs11_session_timeout(slot ? slot : KEY2SLOT(key));
+			}
+			/* Report the first failure, see reqs[].rv for the others */
+			CKRerr(CKR_F_PKCS11_SIGN_BATCH, reqs[i].rv);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Add the keys of a given type matching the template found on the token
+ * All the keys are destroyed on failure
+ */
+int pkcs11_search_keys(PKCS11_TOKEN *token, unsigned int type,
+		const PKCS11_KEY *key_template)
 {
 	PKCS11_SLOT *slot = TOKEN2SLOT(token);
-	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(token);
-	PKCS11_keys *keys = (type == CKO_PRIVATE_KEY) ? &tpriv->prv : &tpriv->pub;
-	PKCS11_KEY *first_key_prev = keys->keys;
 	CK_SESSION_HANDLE session;
 	int rv;
-	int i;
 
 	if (pkcs11_get_session(slot, 0, &session))
 		return -1;
-
-	rv = pkcs11_find_keys(token, session, type);
-	pkcs11_put_session(slot, session);
+	rv = pkcs11_find_keys(token, session, type, key_template);
+	pkcs11_put_session(slot, 0, session);
 	if (rv < 0) {
 		pkcs11_destroy_keys(token, type);
 		return -1;
 	}
+	return 0;
+}
 
-	/* Always update key references if the keys pointer changed */
-	if (first_key_prev && first_key_prev != keys->keys) {
-		for (i = 0; i < keys->num; ++i) {
-			PKCS11_KEY *key = keys->keys + i;
-			PKCS11_KEY_private *kpriv = PRIVKEY(key);
-			kpriv->ops->update_ex_data(key);
-		}
-	}
+/*
+ * Return keys of a given type (public or private)
+ * Only the keys matching the template are searched on the token,
+ * but the returned array also contains the keys found previously
+ */
+int pkcs11_enumerate_keys(PKCS11_TOKEN *token, unsigned int type,
+		const PKCS11_KEY *key_template,
+		PKCS11_KEY ** keyp, unsigned int *countp)
+{
+	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(token);
+	PKCS11_keys *keys = (type == CKO_PRIVATE_KEY) ? &tpriv->prv : &tpriv->pub;
+	int i;
+
+	/* The keys loaded from the metadata cache are not searched again */
+	if (!pkcs11_metadata_enumerate(token, type) &&
+			pkcs11_search_keys(token, type, key_template))
+		return -1;
+
+	/* The copies get the EVP_PKEY loaded since they were made */
+	for (i = 0; i < keys->num; ++i)
+		keys->keys[i].evp_key = KEY2STABLE(keys->keys + i)->evp_key;
 
 	if (keyp)
 		*keyp = keys->keys;
@@ -453,136 +1392,369 @@ int pkcs11_remove_key(PKCS11_KEY *key)
 		return -1;
 
 	rv = CRYPTOKI_call(ctx, C_DestroyObject(session, kpriv->object));
-	pkcs11_put_session(slot, session);
+	pkcs11_put_session(slot, 1, session);
 	CRYPTOKI_checkerr(CKR_F_PKCS11_REMOVE_KEY, rv);
 
 	return 0;
 }
 
+/*
+ * Build the search template of the keys of the class matching key_template
+ * Returns the number of attributes, at most 3
+ */
+static CK_ULONG pkcs11_key_search_attrs(CK_ATTRIBUTE *key_search_attrs,
+		CK_OBJECT_CLASS *key_search_class, const PKCS11_KEY *key_template)
+{
+	CK_ULONG n = 0;
+
+	key_search_attrs[n].type = CKA_CLASS;
+	key_search_attrs[n].pValue = key_search_class;
+	key_search_attrs[n++].ulValueLen = sizeof(CK_OBJECT_CLASS);
+	if (key_template && key_template->id_len) {
+		key_search_attrs[n].type = CKA_ID;
+		key_search_attrs[n].pValue = key_template->id;
+		key_search_attrs[n++].ulValueLen = key_template->id_len;
+	}
+	if (key_template && key_template->label) {
+		key_search_attrs[n].type = CKA_LABEL;
+		key_search_attrs[n].pValue = key_template->label;
+		key_search_attrs[n++].ulValueLen = strlen(key_template->label);
+	}
+	return n;
+}
+
 /*
  * Find all keys of a given type (public or private)
  */
-static int pkcs11_find_keys(PKCS11_TOKEN *token, CK_SESSION_HANDLE session, unsigned int type)
+static int pkcs11_find_keys(PKCS11_TOKEN *token, CK_SESSION_HANDLE session,
+		unsigned int type, const PKCS11_KEY *key_template)
 {
-	PKCS11_CTX *ctx = TOKEN2CTX(token);
-	CK_OBJECT_CLASS key_search_class;
-	CK_ATTRIBUTE key_search_attrs[1] = {
-		{CKA_CLASS, &key_search_class, sizeof(key_search_class)},
+	CK_OBJECT_CLASS key_search_class = type;
+	CK_ATTRIBUTE key_search_attrs[3];
+	CK_ULONG n;
+
+	n = pkcs11_key_search_attrs(key_search_attrs, &key_search_class,
+		key_template);
+	return pkcs11_find_objects(token, session, key_search_attrs, n,
+		CKR_F_PKCS11_FIND_KEYS, pkcs11_next_key, &key_search_class);
+}
+
+#define PKCS11_KEY_ATTRS 7
+
+/*
+ * Template of the attributes retrieved at once for each key
+ * The first three are common to all the keys, and CKA_ALWAYS_AUTHENTICATE
+ * is the fourth attribute of the private keys.  The remaining ones are
+ * the functions permitted by the key.
+ * Returns the number of attributes
+ */
+static unsigned int pkcs11_key_template(CK_ATTRIBUTE *attrs,
+		CK_OBJECT_CLASS type)
+{
+	static const CK_ATTRIBUTE_TYPE prv[] = {
+		CKA_KEY_TYPE, CKA_LABEL, CKA_ID, CKA_ALWAYS_AUTHENTICATE,
+		CKA_SIGN, CKA_DECRYPT, CKA_DERIVE
 	};
-	int rv, res = -1;
+	static const CK_ATTRIBUTE_TYPE pub[] = {
+		CKA_KEY_TYPE, CKA_LABEL, CKA_ID, CKA_VERIFY, CKA_ENCRYPT
+	};
+	const CK_ATTRIBUTE_TYPE *types = type == CKO_PRIVATE_KEY ? prv : pub;
+	unsigned int i, n = type == CKO_PRIVATE_KEY ?
+		sizeof(prv) / sizeof(*prv) : sizeof(pub) / sizeof(*pub);
+
+	for (i = 0; i < n; i++) {
+		attrs[i].type = types[i];
+		attrs[i].pValue = NULL;
+		attrs[i].ulValueLen = 0;
+	}
+	return n;
+}
 
-	/* Tell the PKCS11 lib to enumerate all matching objects */
-	key_search_class = type;
-	rv = CRYPTOKI_call(ctx,
-		C_FindObjectsInit(session, key_search_attrs, 1));
-	CRYPTOKI_checkerr(CKR_F_PKCS11_FIND_KEYS, rv);
+/*
+ * The functions explicitly denied by the attributes of a key
+ * The attributes the token does not report are assumed to permit them.
+ */
+static unsigned int pkcs11_key_denied(const CK_ATTRIBUTE *attrs,
+		unsigned int n)
+{
+	unsigned int i, denied = 0;
+
+	for (i = 0; i < n; i++) {
+		if (attrs[i].ulValueLen != sizeof(CK_BBOOL) ||
+				*(CK_BBOOL *)attrs[i].pValue)
+			continue;
+		switch (attrs[i].type) {
+		case CKA_SIGN:
+			denied |= 1U << PKCS11_OP_SIGN;
+			break;
+		case CKA_DECRYPT:
+			denied |= 1U << PKCS11_OP_DECRYPT;
+			break;
+		case CKA_ENCRYPT:
+			denied |= 1U << PKCS11_OP_ENCRYPT;
+			break;
+		case CKA_VERIFY:
+			denied |= 1U << PKCS11_OP_VERIFY;
+			break;
+		case CKA_DERIVE:
+			denied |= 1U << PKCS11_OP_DERIVE;
+			break;
+		}
+	}
+	return denied;
+}
 
-	do {
-		res = pkcs11_next_key(ctx, token, session, type);
-	} while (res == 0);
+/* Forget the current key of the iterator */
+static void pkcs11_key_iter_clear(PKCS11_KEY_ITER *iter)
+{
+	if (iter->key.evp_key)
+		EVP_PKEY_free(iter->key.evp_key);
+	pkcs11_auth_pin_clear(&iter->kpriv);
+	OPENSSL_free(iter->key.label);
+	OPENSSL_free(iter->key.id);
+	memset(&iter->key, 0, sizeof(PKCS11_KEY));
+	memset(&iter->kpriv, 0, sizeof(PKCS11_KEY_private));
+}
 
-	CRYPTOKI_call(ctx, C_FindObjectsFinal(session));
+/*
+ * Start iterating over the keys of a given type (public or private)
+ * matching key_template
+ */
+PKCS11_KEY_ITER *pkcs11_key_iter_new(PKCS11_TOKEN *token, unsigned int type,
+		const PKCS11_KEY *key_template)
+{
+	PKCS11_KEY_ITER *iter;
+	CK_ATTRIBUTE key_search_attrs[3];
+	CK_ULONG n;
 
-	return (res < 0) ? -1 : 0;
+	iter = OPENSSL_malloc(sizeof(PKCS11_KEY_ITER));
+	if (!iter)
+		return NULL;
+	memset(iter, 0, sizeof(PKCS11_KEY_ITER));
+	iter->type = type;
+	n = pkcs11_key_search_attrs(key_search_attrs, &iter->type, key_template);
+	if (pkcs11_object_iter_init(&iter->objects, token, key_search_attrs, n,
+			CKR_F_PKCS11_FIND_KEYS)) {
+		OPENSSL_free(iter);
+		return NULL;
+	}
+	return iter;
 }
 
-static int pkcs11_next_key(PKCS11_CTX *ctx, PKCS11_TOKEN *token,
-		CK_SESSION_HANDLE session, CK_OBJECT_CLASS type)
+/*
+ * Get the next key of a supported type
+ * Only the attributes of the current key are retrieved, and the key is
+ * valid until the next call or until the iterator is freed.
+ * Returns 0 on success with *key set to NULL after the last key,
+ * or -1 on error
+ */
+int pkcs11_key_iter_next(PKCS11_KEY_ITER *iter, PKCS11_KEY **key)
 {
+	PKCS11_TOKEN *token = iter->objects.token;
+	PKCS11_CTX *ctx = TOKEN2CTX(token);
+	CK_ATTRIBUTE attrs[PKCS11_KEY_ATTRS];
+	unsigned int nattrs = pkcs11_key_template(attrs, iter->type);
 	CK_OBJECT_HANDLE obj;
-	CK_ULONG count;
+	PKCS11_KEY_ops *ops = NULL;
 	int rv;
 
-	/* Get the next matching object */
-	rv = CRYPTOKI_call(ctx, C_FindObjects(session, &obj, 1, &count));
-	CRYPTOKI_checkerr(CKR_F_PKCS11_NEXT_KEY, rv);
+	pkcs11_key_iter_clear(iter);
+	*key = NULL;
+	while (!ops) {
+		rv = pkcs11_object_iter_next(&iter->objects, &obj);
+		if (rv <= 0)
+			return rv;
+		if (pkcs11_getattr_list(ctx, iter->objects.session, obj,
+				attrs, nattrs))
+			return -1;
+		/* Skip the keys we don't understand */
+		if (attrs[0].ulValueLen == sizeof(CK_KEY_TYPE))
+			ops = pkcs11_key_type_ops(*(CK_KEY_TYPE *)attrs[0].pValue);
+		if (!ops)
+			pkcs11_zap_attrs(attrs, nattrs);
+	}
+
+	iter->key.label = attrs[1].pValue;
+	attrs[1].pValue = NULL;
+	if (attrs[2].pValue) {
+		iter->key.id = attrs[2].pValue;
+		iter->key.id_len = attrs[2].ulValueLen;
+		attrs[2].pValue = NULL;
+	}
+	iter->key.isPrivate = (iter->type == CKO_PRIVATE_KEY);
+	if (iter->key.isPrivate && attrs[3].ulValueLen == sizeof(CK_BBOOL))
+		iter->kpriv.always_authenticate = *(CK_BBOOL *)attrs[3].pValue;
+	iter->kpriv.denied = pkcs11_key_denied(attrs, nattrs);
+	pkcs11_zap_attrs(attrs, nattrs);
+
+	iter->key._private = &iter->kpriv;
+	iter->kpriv.object = obj;
+	iter->kpriv.parent = token;
+	iter->kpriv.stable = &iter->key;
+	iter->kpriv.id = iter->key.id;
+	iter->kpriv.id_len = iter->key.id_len;
+	iter->kpriv.ops = ops;
+	iter->kpriv.forkid = get_forkid();
+	*key = &iter->key;
+	return 0;
+}
+
+void pkcs11_key_iter_free(PKCS11_KEY_ITER *iter)
+{
+	if (!iter)
+		return;
+	pkcs11_key_iter_clear(iter);
+	pkcs11_object_iter_release(&iter->objects);
+	OPENSSL_free(iter);
+}
 
-	if (count == 0)
-		return 1;
+static int pkcs11_next_key(PKCS11_TOKEN *token, CK_SESSION_HANDLE session,
+		CK_OBJECT_HANDLE obj, void *arg)
+{
+	CK_OBJECT_CLASS type = *(CK_OBJECT_CLASS *)arg;
 
-	if (pkcs11_init_key(ctx, token, session, obj, type, NULL))
+	if (pkcs11_init_key(TOKEN2CTX(token), token, session, obj, type, NULL))
 		return -1;
+	return 0;
+}
 
+/*
+ * Rebuild the handle index if it was invalidated by reloading a key
+ * The keys of the metadata cache without a handle yet are not indexed.
+ */
+static int pkcs11_index_key_handles(PKCS11_keys *keys)
+{
+	CK_OBJECT_HANDLE object;
+	int i;
+
+	if (keys->by_handle.size || !keys->num)
+		return 0;
+	if (pkcs11_index_reserve(&keys->by_handle, keys->num))
+		return -1;
+	for (i = 0; i < keys->num; i++) {
+		object = PRIVKEY(keys->keys + i)->object;
+		if (object != CK_INVALID_HANDLE)
+			pkcs11_index_insert(&keys->by_handle,
+				pkcs11_hash_handle(object), i);
+	}
 	return 0;
 }
 
-static int pkcs11_init_key(PKCS11_CTX *ctx, PKCS11_TOKEN *token,
-		CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj,
-		CK_OBJECT_CLASS type, PKCS11_KEY ** ret)
+/* Returns the operations of the key type, or NULL if not supported */
+static PKCS11_KEY_ops *pkcs11_key_type_ops(CK_KEY_TYPE type)
+{
+	switch (type) {
+	case CKK_RSA:
+		return &pkcs11_rsa_ops;
+	case CKK_EC:
+		return pkcs11_ec_ops;
+	default:
+		return NULL;
+	}
+}
+
+/* Whether the object handle was already added to the keys */
+static int pkcs11_key_known(PKCS11_keys *keys, CK_OBJECT_HANDLE obj)
+{
+	PKCS11_KEY_MATCH m;
+
+	m.keys = keys;
+	m.object = obj;
+	return pkcs11_index_find(&keys->by_handle, pkcs11_hash_handle(obj),
+		pkcs11_match_key_handle, &m) >= 0;
+}
+
+/*
+ * Add a key with the attributes of pkcs11_key_template()
+ * The attributes remain owned by the caller.
+ */
+static int pkcs11_new_key(PKCS11_TOKEN *token, CK_OBJECT_HANDLE obj,
+		CK_OBJECT_CLASS type, CK_ATTRIBUTE *attrs, unsigned int nattrs,
+		PKCS11_KEY **ret)
 {
 	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(token);
 	PKCS11_keys *keys = (type == CKO_PRIVATE_KEY) ? &tpriv->prv : &tpriv->pub;
 	PKCS11_KEY_private *kpriv;
 	PKCS11_KEY *key, *tmp;
-	CK_KEY_TYPE key_type;
+	PKCS11_KEY_MATCH m;
 	PKCS11_KEY_ops *ops;
-	size_t size;
-	int i;
-
-	(void)ctx;
-	(void)session;
+	unsigned long id_hash;
+	unsigned char *id;
+	char *label;
+	int alloc;
 
 	/* Ignore unknown key types */
-	size = sizeof(CK_KEY_TYPE);
-	if (pkcs11_getattr_var(ctx, session, obj, CKA_KEY_TYPE, (CK_BYTE *)&key_type, &size))
+	if (attrs[0].ulValueLen != sizeof(CK_KEY_TYPE))
 		return -1;
-	switch (key_type) {
-	case CKK_RSA:
-		ops = &pkcs11_rsa_ops;
-		break;
-	case CKK_EC:
-		ops = pkcs11_ec_ops;
-		if (!ops)
-			return 0; /* not supported */
-		break;
-	default:
-		/* Ignore any keys we don't understand */
+	ops = pkcs11_key_type_ops(*(CK_KEY_TYPE *)attrs[0].pValue);
+	if (!ops)
 		return 0;
-	}
-
-	/* Prevent re-adding existing PKCS#11 object handles */
-	/* TODO: Rewrite the O(n) algorithm as O(log n),
-	 * or it may be too slow with a large number of keys */
-	for (i=0; i < keys->num; ++i)
-		if (PRIVKEY(keys->keys + i)->object == obj)
-			return 0;
 
 	/* Allocate memory */
-	kpriv = OPENSSL_malloc(sizeof(PKCS11_KEY_private));
-	if (!kpriv)
-		return -1;
-	memset(kpriv, 0, sizeof(PKCS11_KEY_private));
-	tmp = OPENSSL_realloc(keys->keys, (keys->num + 1) * sizeof(PKCS11_KEY));
-	if (!tmp) {
-		OPENSSL_free(kpriv);
+	if (pkcs11_index_reserve(&keys->by_handle, 1) ||
+			pkcs11_index_reserve(&keys->by_id, 1))
 		return -1;
+	if (keys->num == keys->alloc) {
+		/* Grow geometrically to avoid copying the array for each key */
+		alloc = keys->alloc ? 2 * keys->alloc : PKCS11_OBJECTS_MIN_ALLOC;
+		tmp = OPENSSL_realloc(keys->keys, alloc * sizeof(PKCS11_KEY));
+		if (!tmp)
+			return -1;
+		keys->keys = tmp;
+		keys->alloc = alloc;
 	}
-	keys->keys = tmp;
-	key = keys->keys + keys->num++;
+	key = pkcs11_arena_alloc(&keys->arena, sizeof(PKCS11_KEY));
+	kpriv = pkcs11_arena_alloc(&keys->arena, sizeof(PKCS11_KEY_private));
+	label = attrs[1].pValue ? pkcs11_arena_memdup(&keys->arena,
+		attrs[1].pValue, attrs[1].ulValueLen) : NULL;
+	id = attrs[2].pValue ? pkcs11_arena_memdup(&keys->arena,
+		attrs[2].pValue, attrs[2].ulValueLen) : NULL;
+	if (!key || !kpriv || (attrs[1].pValue && !label) ||
+			(attrs[2].pValue && !id))
+		return -1;
+	memset(kpriv, 0, sizeof(PKCS11_KEY_private));
 	memset(key, 0, sizeof(PKCS11_KEY));
 
 	/* Fill public properties */
-	pkcs11_getattr_alloc(ctx, session, obj, CKA_LABEL, (CK_BYTE **)&key->label, NULL);
-	key->id_len = 0;
-	pkcs11_getattr_alloc(ctx, session, obj, CKA_ID, &key->id, &key->id_len);
+	key->label = label;
+	if (id) {
+		key->id = id;
+		key->id_len = attrs[2].ulValueLen;
+	}
 	key->isPrivate = (type == CKO_PRIVATE_KEY);
-	if (key->isPrivate && pkcs11_getattr_val(ctx, session, obj,
-			CKA_ALWAYS_AUTHENTICATE,
-			&kpriv->always_authenticate, sizeof(CK_BBOOL))) {
+	if (key->isPrivate) {
+		if (attrs[3].ulValueLen == sizeof(CK_BBOOL)) {
+			kpriv->always_authenticate = *(CK_BBOOL *)attrs[3].pValue;
+		} else {
 #ifdef DEBUG
-		fprintf(stderr, "Missing CKA_ALWAYS_AUTHENTICATE attribute\n");
+			fprintf(stderr, "Missing CKA_ALWAYS_AUTHENTICATE attribute\n");
 #endif
+		}
 	}
+	kpriv->denied = pkcs11_key_denied(attrs, nattrs);
 
 	/* Fill private properties */
 	key->_private = kpriv;
 	kpriv->object = obj;
 	kpriv->parent = token;
-	kpriv->id_len = sizeof kpriv->id;
-	if (pkcs11_getattr_var(ctx, session, obj, CKA_ID, kpriv->id, &kpriv->id_len))
-		kpriv->id_len = 0;
+	kpriv->stable = key;
+	kpriv->id = key->id;
+	kpriv->id_len = key->id_len;
 	kpriv->ops = ops;
 	kpriv->forkid = get_forkid();
+	keys->keys[keys->num++] = *key;
+
+	/* Only the first key with a given CKA_ID is indexed by its ID */
+	if (obj != CK_INVALID_HANDLE)
+		pkcs11_index_insert(&keys->by_handle, pkcs11_hash_handle(obj),
+			keys->num - 1);
+	m.keys = keys;
+	m.id = kpriv->id;
+	m.id_len = kpriv->id_len;
+	id_hash = pkcs11_hash_bytes(kpriv->id, kpriv->id_len);
+	if (pkcs11_index_find(&keys->by_id, id_hash,
+			pkcs11_match_key_id, &m) < 0)
+		pkcs11_index_insert(&keys->by_id, id_hash, keys->num - 1);
 
 	if (ret)
 		*ret = key;
@@ -590,6 +1762,179 @@ static int pkcs11_init_key(PKCS11_CTX *ctx, PKCS11_TOKEN *token,
 	return 0;
 }
 
+/*
+ * Assign the handle of a key found on the token to the key with the same
+ * CKA_ID loaded from the metadata cache, if it has no handle yet
+ * Returns 1 if the key was assigned the handle, 0 if there is no such key,
+ * or -1 on memory allocation failure
+ */
+static int pkcs11_resolve_cached_key(PKCS11_TOKEN *token, PKCS11_keys *keys,
+		CK_OBJECT_HANDLE obj, const CK_ATTRIBUTE *attrs)
+{
+	PKCS11_KEY_private *kpriv;
+	PKCS11_KEY_MATCH m;
+	int i;
+
+	if (!PRIVTOKEN(token)->metadata.map || !attrs[2].pValue)
+		return 0;
+	m.keys = keys;
+	m.id = attrs[2].pValue;
+	m.id_len = attrs[2].ulValueLen;
+	i = pkcs11_index_find(&keys->by_id, pkcs11_hash_bytes(m.id, m.id_len),
+		pkcs11_match_key_id, &m);
+	if (i < 0)
+		return 0;
+	kpriv = PRIVKEY(keys->keys + i);
+	if (kpriv->object != CK_INVALID_HANDLE)
+		return 0;
+	if (pkcs11_index_reserve(&keys->by_handle, 1))
+		return -1;
+	kpriv->object = obj;
+	pkcs11_index_insert(&keys->by_handle, pkcs11_hash_handle(obj), i);
+	p11_atomic_store(&kpriv->forkid, PRIVSLOT(TOKEN2SLOT(token))->forkid);
+	return 1;
+}
+
+static int pkcs11_init_key(PKCS11_CTX *ctx, PKCS11_TOKEN *token,
+		CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj,
+		CK_OBJECT_CLASS type, PKCS11_KEY ** ret)
+{
+	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(token);
+	PKCS11_keys *keys = (type == CKO_PRIVATE_KEY) ? &tpriv->prv : &tpriv->pub;
+	CK_ATTRIBUTE attrs[PKCS11_KEY_ATTRS];
+	unsigned int nattrs = pkcs11_key_template(attrs, type);
+	int rv;
+
+	/* Prevent re-adding existing PKCS#11 object handles */
+	if (pkcs11_index_key_handles(keys))
+		return -1;
+	if (pkcs11_key_known(keys, obj))
+		return 0;
+
+	/* Retrieve all the attributes at once */
+	if (pkcs11_getattr_list(ctx, session, obj, attrs, nattrs))
+		return -1;
+	rv = pkcs11_resolve_cached_key(token, keys, obj, attrs);
+	if (rv == 0)
+		rv = pkcs11_new_key(token, obj, type, attrs, nattrs, ret);
+	pkcs11_zap_attrs(attrs, nattrs);
+	return rv < 0 ? -1 : 0;
+}
+
+/*
+ * Add a key created on the token by this process, without reading back
+ * the attributes: the functions of the key are those of its template,
+ * and the always authenticate flag is cleared.
+ */
+int pkcs11_add_key(PKCS11_TOKEN *token, CK_OBJECT_HANDLE obj,
+		CK_OBJECT_CLASS type, CK_KEY_TYPE key_type, const char *label,
+		const unsigned char *id, size_t id_len, PKCS11_KEY **ret)
+{
+	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(token);
+	PKCS11_keys *keys = (type == CKO_PRIVATE_KEY) ? &tpriv->prv : &tpriv->pub;
+	CK_ATTRIBUTE attrs[PKCS11_KEY_ATTRS];
+	unsigned int nattrs = pkcs11_key_template(attrs, type);
+
+	if (pkcs11_index_key_handles(keys))
+		return -1;
+	if (pkcs11_key_known(keys, obj))
+		return 0;
+
+	attrs[0].pValue = &key_type;
+	attrs[0].ulValueLen = sizeof(CK_KEY_TYPE);
+	if (label) {
+		attrs[1].pValue = (void *)label;
+		attrs[1].ulValueLen = strlen(label);
+	}
+	if (id && id_len) {
+		attrs[2].pValue = (void *)id;
+		attrs[2].ulValueLen = id_len;
+	}
+	return pkcs11_new_key(token, obj, type, attrs, nattrs, ret);
+}
+
+/*
+ * Add a key loaded from the metadata cache
+ * The key has no object handle until check_key_fork() reloads it on first
+ * use, and pkcs11_key_getattr() then returns the cached public components
+ * found on the token.
+ */
+int pkcs11_add_cached_key(PKCS11_TOKEN *token, CK_OBJECT_CLASS type,
+		CK_KEY_TYPE key_type, const char *label,
+		const unsigned char *id, size_t id_len,
+		CK_BBOOL always_authenticate, unsigned int denied,
+		const CK_ATTRIBUTE *pub, unsigned int npub)
+{
+	PKCS11_KEY_private *kpriv;
+	PKCS11_KEY *key = NULL;
+	unsigned int i;
+
+	if (npub > PKCS11_KEY_CACHED_ATTRS)
+		return -1;
+	if (pkcs11_add_key(token, CK_INVALID_HANDLE, type, key_type,
+			label, id, id_len, &key))
+		return -1;
+	if (!key) /* Not supported by this build */
+		return 0;
+	kpriv = PRIVKEY(key);
+	kpriv->always_authenticate = always_authenticate;
+	kpriv->denied = denied;
+	for (i = 0; i < npub; i++)
+		kpriv->cached[i] = pub[i];
+	kpriv->ncached = npub;
+	/* Any other value than the forkid of the slot triggers the reload */
+	kpriv->forkid = PRIVSLOT(TOKEN2SLOT(token))->forkid - 1;
+	return 0;
+}
+
+/*
+ * Retrieve the attributes of a key like pkcs11_getattr_list(), without
+ * a round trip to the token when they were loaded from the metadata cache
+ */
+int pkcs11_key_getattr(PKCS11_KEY *key, CK_SESSION_HANDLE session,
+		CK_ATTRIBUTE *attrs, unsigned int n)
+{
+	PKCS11_KEY_private *kpriv = PRIVKEY(key);
+	const CK_ATTRIBUTE *cached[PKCS11_KEY_CACHED_ATTRS];
+	unsigned int i, j;
+
+	/* Only the values checked by pkcs11_reload_key() are trusted */
+	if (!p11_atomic_load(&kpriv->cached_checked) ||
+			n > p11_atomic_load(&kpriv->ncached))
+		return pkcs11_getattr_list(KEY2CTX(key), session,
+			kpriv->object, attrs, n);
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < kpriv->ncached; j++)
+			if (kpriv->cached[j].type == attrs[i].type)
+				break;
+		if (j == kpriv->ncached)
+			return pkcs11_getattr_list(KEY2CTX(key), session,
+				kpriv->object, attrs, n);
+		cached[i] = kpriv->cached + j;
+	}
+	for (i = 0; i < n; i++) {
+		attrs[i].pValue = NULL;
+		attrs[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
+	}
+	for (i = 0; i < n; i++) {
+		if (!cached[i]->pValue)
+			continue;
+		/* Null-terminated like the values of pkcs11_getattr_list() */
+		attrs[i].pValue = OPENSSL_malloc(cached[i]->ulValueLen + 1);
+		if (!attrs[i].pValue) {
+			pkcs11_zap_attrs(attrs, i);
+			for (j = 0; j < i; j++)
+				attrs[j].pValue = NULL;
+			CKRerr(CKR_F_PKCS11_GETATTR_LIST, CKR_HOST_MEMORY);
+			return -1;
+		}
+		memcpy(attrs[i].pValue, cached[i]->pValue, cached[i]->ulValueLen);
+		((unsigned char *)attrs[i].pValue)[cached[i]->ulValueLen] = 0;
+		attrs[i].ulValueLen = cached[i]->ulValueLen;
+	}
+	return 0;
+}
+
 /*
  * Destroy all keys of a given type (public or private)
  */
@@ -599,21 +1944,23 @@ void pkcs11_destroy_keys(PKCS11_TOKEN *token, unsigned int type)
 	PKCS11_keys *keys = (type == CKO_PRIVATE_KEY) ? &tpriv->prv : &tpriv->pub;
 
 	while (keys->num > 0) {
-		PKCS11_KEY *key = &keys->keys[--(keys->num)];
+		PKCS11_KEY *key = KEY2STABLE(&keys->keys[--(keys->num)]);
 
 		if (key->evp_key)
 			EVP_PKEY_free(key->evp_key);
-		if (key->label)
-			OPENSSL_free(key->label);
-		if (key->id)
-			OPENSSL_free(key->id);
-		if (key->_private)
-			OPENSSL_free(key->_private);
+		if (key->_private) {
+			OPENSSL_free(PRIVKEY(key)->replicas);
+			pkcs11_auth_pin_clear(PRIVKEY(key));
+		}
 	}
 	if (keys->keys)
 		OPENSSL_free(keys->keys);
 	keys->keys = NULL;
-	keys->num = 0;
+	keys->num = keys->alloc = 0;
+	pkcs11_index_free(&keys->by_handle);
+	pkcs11_index_free(&keys->by_id);
+	/* The private data, labels and IDs of all the keys */
+	pkcs11_arena_free(&keys->arena);
 }
 
 /* vim: set noexpandtab: */
@@ -41,6 +41,12 @@ PKCS11_CTX *pkcs11_CTX_new(void)
 	ctx->_private = cpriv;
 	cpriv->forkid = get_forkid();
 	pthread_mutex_init(&cpriv->fork_lock, 0);
+	pthread_mutex_init(&cpriv->auth_pin_lock, 0);
+	pthread_mutex_init(&cpriv->metadata_lock, 0);
+	cpriv->find_batch = PKCS11_FIND_BATCH_DEFAULT;
+	cpriv->session_timeout = -1;
+	cpriv->starvation_limit = PKCS11_STARVATION_LIMIT_DEFAULT;
+	pkcs11_workers_init(ctx);
 
 	return ctx;
 fail:
@@ -62,6 +68,123 @@ void pkcs11_CTX_init_args(PKCS11_CTX *ctx, const char *init_args)
 	cpriv->init_args = init_args ? OPENSSL_strdup(init_args) : NULL;
 }
 
+/*
+ * Set the number of object handles retrieved with each C_FindObjects() call
+ */
+void pkcs11_CTX_set_find_batch(PKCS11_CTX *ctx, unsigned int size)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	cpriv->find_batch = size ? size : PKCS11_FIND_BATCH_DEFAULT;
+}
+
+/*
+ * Only retrieve the label and ID of certificates when they are found
+ */
+void pkcs11_CTX_set_lazy_x509(PKCS11_CTX *ctx, int lazy)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	cpriv->lazy_x509 = lazy;
+}
+
+/*
+ * Verify the signatures with C_Verify() instead of OpenSSL
+ */
+void pkcs11_CTX_set_token_verify(PKCS11_CTX *ctx, int token)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	cpriv->token_verify = token;
+}
+
+/*
+ * Initialize up to threads slots concurrently in pkcs11_enumerate_slots()
+ */
+void pkcs11_CTX_set_enum_threads(PKCS11_CTX *ctx, unsigned int threads)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	cpriv->enum_threads = threads;
+}
+
+/*
+ * Select the slots and the token information retrieved by
+ * pkcs11_enumerate_slots()
+ */
+void pkcs11_CTX_set_enum_flags(PKCS11_CTX *ctx, unsigned int flags)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	cpriv->enum_flags = flags;
+}
+
+/*
+ * Set the maximum time in milliseconds to wait for a session
+ */
+void pkcs11_CTX_set_session_timeout(PKCS11_CTX *ctx, long timeout)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	p11_atomic_store(&cpriv->session_timeout, timeout);
+}
+
+/*
+ * Set the number of sessions opened in advance by PKCS11_login()
+ */
+void pkcs11_CTX_set_session_prewarm(PKCS11_CTX *ctx, unsigned int count)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	cpriv->session_prewarm = count;
+}
+
+/*
+ * Reserve sessions of each slot for the PKCS11_PRIORITY_HIGH operations
+ */
+void pkcs11_CTX_set_session_reserve(PKCS11_CTX *ctx, unsigned int reserve,
+		unsigned int starvation_limit)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	p11_atomic_store(&cpriv->session_reserve, reserve);
+	p11_atomic_store(&cpriv->starvation_limit, starvation_limit ?
+		starvation_limit : PKCS11_STARVATION_LIMIT_DEFAULT);
+}
+
+/*
+ * Cache the context-specific PINs of the keys for ttl seconds,
+ * and for at most max_uses operations (0 for unlimited)
+ */
+void pkcs11_CTX_set_auth_pin_cache(PKCS11_CTX *ctx, long ttl,
+		unsigned int max_uses)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	pthread_mutex_lock(&cpriv->auth_pin_lock);
+	cpriv->auth_pin_ttl = ttl > 0 ? ttl : 0;
+	cpriv->auth_pin_max_uses = max_uses;
+	pthread_mutex_unlock(&cpriv->auth_pin_lock);
+}
+
+/*
+ * Keep up to size random bytes generated in advance for each slot,
+ * refilled when fewer than watermark bytes are left
+ */
+void pkcs11_CTX_set_random_buffer(PKCS11_CTX *ctx, unsigned int size,
+		unsigned int watermark)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	p11_atomic_store(&cpriv->rand_buffer_size, size);
+	p11_atomic_store(&cpriv->rand_watermark, watermark);
+	if (size == 0 && cpriv->handle) {
+		/* Wait for the refills in progress */
+		pkcs11_workers_stop(ctx);
+		pkcs11_workers_restart(ctx);
+	}
+}
+
 /*
  * Load the shared library, and initialize it.
  */
@@ -72,6 +195,7 @@ int pkcs11_CTX_load(PKCS11_CTX *ctx, const char *name)
 	CK_INFO ck_info;
 	int rv;
 
+	cpriv->workers_stopped = 0;
 	cpriv->handle = C_LoadModule(name, &cpriv->method);
 	if (!cpriv->handle) {
 		P11err(P11_F_PKCS11_CTX_LOAD, P11_R_LOAD_MODULE_ERROR);
@@ -118,6 +242,9 @@ int pkcs11_CTX_reload(PKCS11_CTX *ctx)
 	CK_C_INITIALIZE_ARGS *args = NULL;
 	int rv;
 
+	/* The worker threads are not inherited by the child process */
+	pkcs11_workers_init(ctx);
+
 	if (!cpriv->method) /* Module not loaded */
 		return 0;
 
@@ -143,6 +270,9 @@ void pkcs11_CTX_unload(PKCS11_CTX *ctx)
 {
 	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
 
+	/* Wait for the operations still in progress */
+	pkcs11_workers_stop(ctx);
+
 	/* Tell the PKCS11 library to shut down */
 	if (cpriv->forkid == get_forkid())
 		cpriv->method->C_Finalize(NULL);
@@ -158,6 +288,7 @@ void pkcs11_CTX_unload(PKCS11_CTX *ctx)
 void pkcs11_CTX_free(PKCS11_CTX *ctx)
 {
 	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+	PKCS11_RETIRED_SLOTS *retired;
 
 	/* TODO: Move the global methods and ex_data indexes into
 	 * the ctx structure, so they can be safely deallocated here:
@@ -170,7 +301,17 @@ void pkcs11_CTX_free(PKCS11_CTX *ctx)
 	if (cpriv->handle) {
 		OPENSSL_free(cpriv->handle);
 	}
+	OPENSSL_free(cpriv->metadata_dir);
+	OPENSSL_free(cpriv->metadata_generation);
+	while ((retired = cpriv->retired_slots) != NULL) {
+		cpriv->retired_slots = retired->next;
+		OPENSSL_free(retired->slots);
+		OPENSSL_free(retired);
+	}
+	pthread_mutex_destroy(&cpriv->auth_pin_lock);
+	pthread_mutex_destroy(&cpriv->metadata_lock);
 	pthread_mutex_destroy(&cpriv->fork_lock);
+	pkcs11_workers_free(ctx);
 	OPENSSL_free(ctx->manufacturer);
 	OPENSSL_free(ctx->description);
 	OPENSSL_free(ctx->_private);
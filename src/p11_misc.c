@@ -39,4 +39,169 @@ char *pkcs11_strdup(char *mem, size_t size)
 	return res;
 }
 
+/*
+ * Call the found function for each object matching the search template
+ * The object handles are retrieved in batches to reduce the number
+ * of C_FindObjects() calls, which may each be a round trip to the token
+ */
+int pkcs11_find_objects(PKCS11_TOKEN *token, CK_SESSION_HANDLE session,
+		CK_ATTRIBUTE *attrs, CK_ULONG nattrs, int function,
+		int (*found)(PKCS11_TOKEN *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE, void *),
+		void *arg)
+{
+	PKCS11_CTX *ctx = TOKEN2CTX(token);
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+	CK_ULONG batch = cpriv->find_batch, count, n;
+	CK_OBJECT_HANDLE *objs;
+	unsigned long start;
+	int rv, res = 0;
+
+	objs = OPENSSL_malloc(batch * sizeof(CK_OBJECT_HANDLE));
+	if (!objs) {
+		CKRerr(function, CKR_HOST_MEMORY);
+		return -1;
+	}
+
+	/* Tell the PKCS11 lib to enumerate all matching objects */
+	rv = CRYPTOKI_call(ctx, C_FindObjectsInit(session, attrs, nattrs));
+	if (rv != CKR_OK) {
+		OPENSSL_free(objs);
+		CKRerr(function, rv);
+		return -1;
+	}
+
+	do {
+		start = pkcs11_stats_time();
+		rv = CRYPTOKI_call(ctx, C_FindObjects(session, objs, batch, &count));
+		pkcs11_stats_record(TOKEN2SLOT(token), PKCS11_STATS_FIND,
+			PKCS11_STATS_NO_MECHANISM, rv, start);
+		if (rv != CKR_OK) {
+			CKRerr(function, rv);
+			res = -1;
+			break;
+		}
+		for (n = 0; n < count && res == 0; n++)
+			res = found(token, session, objs[n], arg);
+		/* A short batch does not always mean the end of the search */
+	} while (res == 0 && count > 0);
+
+	CRYPTOKI_call(ctx, C_FindObjectsFinal(session));
+	OPENSSL_free(objs);
+	return res;
+}
+
+/*
+ * Start a search for the objects matching the template
+ * A session is held until the search ends, so that the calling thread
+ * can process each object with pkcs11_object_iter_next() as it arrives.
+ * Returns 0 on success, or -1 on error
+ */
+int pkcs11_object_iter_init(PKCS11_OBJECT_ITER *iter, PKCS11_TOKEN *token,
+		CK_ATTRIBUTE *attrs, CK_ULONG nattrs, int function)
+{
+	PKCS11_SLOT *slot = TOKEN2SLOT(token);
+	PKCS11_CTX *ctx = TOKEN2CTX(token);
+	int rv;
+
+	memset(iter, 0, sizeof(PKCS11_OBJECT_ITER));
+	iter->token = token;
+	iter->function = function;
+	iter->batch = PRIVCTX(ctx)->find_batch;
+	iter->objs = OPENSSL_malloc(iter->batch * sizeof(CK_OBJECT_HANDLE));
+	if (!iter->objs) {
+		CKRerr(function, CKR_HOST_MEMORY);
+		return -1;
+	}
+	if (pkcs11_get_session(slot, 0, &iter->session)) {
+		OPENSSL_free(iter->objs);
+		iter->objs = NULL;
+		return -1;
+	}
+	rv = CRYPTOKI_call(ctx, C_FindObjectsInit(iter->session, attrs, nattrs));
+	if (rv != CKR_OK) {
+		pkcs11_put_session(slot, 0, iter->session);
+		OPENSSL_free(iter->objs);
+		iter->objs = NULL;
+		CKRerr(function, rv);
+		return -1;
+	}
+	iter->active = 1;
+	return 0;
+}
+
+/* Finish the search and return its session as soon as possible */
+static void pkcs11_object_iter_finish(PKCS11_OBJECT_ITER *iter)
+{
+	if (!iter->active)
+		return;
+	CRYPTOKI_call(TOKEN2CTX(iter->token), C_FindObjectsFinal(iter->session));
+	pkcs11_put_session(TOKEN2SLOT(iter->token), 0, iter->session);
+	iter->active = 0;
+}
+
+/*
+ * Get the next object found, retrieving a batch of handles when needed
+ * Returns 1 if an object was found, 0 at the end of the search,
+ * or -1 on error
+ */
+int pkcs11_object_iter_next(PKCS11_OBJECT_ITER *iter, CK_OBJECT_HANDLE *object)
+{
+	PKCS11_CTX *ctx = TOKEN2CTX(iter->token);
+	unsigned long start;
+	int rv;
+
+	while (iter->pos == iter->count) {
+		if (!iter->active)
+			return 0;
+		start = pkcs11_stats_time();
+		rv = CRYPTOKI_call(ctx, C_FindObjects(iter->session,
+			iter->objs, iter->batch, &iter->count));
+		pkcs11_stats_record(TOKEN2SLOT(iter->token), PKCS11_STATS_FIND,
+			PKCS11_STATS_NO_MECHANISM, rv, start);
+		iter->pos = 0;
+		if (rv != CKR_OK) {
+			iter->count = 0;
+			pkcs11_object_iter_finish(iter);
+			CKRerr(iter->function, rv);
+			return -1;
+		}
+		/* A short batch does not always mean the end of the search */
+		if (iter->count == 0)
+			pkcs11_object_iter_finish(iter);
+	}
+	*object = iter->objs[iter->pos++];
+	return 1;
+}
+
+void pkcs11_object_iter_release(PKCS11_OBJECT_ITER *iter)
+{
+	pkcs11_object_iter_finish(iter);
+	OPENSSL_free(iter->objs);
+	iter->objs = NULL;
+}
+
+/*
+ * Check that an object handle still refers to the object of the given
+ * class and ID, as many modules keep the handles valid after fork()
+ * Returns 1 if it does, or 0 if the object has to be searched again
+ */
+int pkcs11_check_object(PKCS11_CTX *ctx, CK_SESSION_HANDLE session,
+		CK_OBJECT_HANDLE object, CK_OBJECT_CLASS class,
+		const unsigned char *id, size_t id_len)
+{
+	CK_OBJECT_CLASS obj_class;
+	unsigned char obj_id[255];
+	CK_ATTRIBUTE attrs[2] = {
+		{CKA_CLASS, &obj_class, sizeof obj_class},
+		{CKA_ID, obj_id, sizeof obj_id},
+	};
+
+	if (object == CK_INVALID_HANDLE || !id_len)
+		return 0;
+	if (CRYPTOKI_call(ctx, C_GetAttributeValue(session, object, attrs, 2)))
+		return 0;
+	return obj_class == class && attrs[1].ulValueLen == id_len &&
+		!memcmp(obj_id, id, id_len);
+}
+
 /* vim: set noexpandtab: */
@@ -184,7 +184,7 @@ static void EVP_PKEY_meth_get_decrypt(EVP_PKEY_METHOD *pmeth,
 }
 #endif
 
-static CK_MECHANISM_TYPE pkcs11_md2ckm(const EVP_MD *md)
+CK_MECHANISM_TYPE pkcs11_md2ckm(const EVP_MD *md)
 {
 	switch (EVP_MD_type(md)) {
 	case NID_sha1:
@@ -202,7 +202,7 @@ static CK_MECHANISM_TYPE pkcs11_md2ckm(const EVP_MD *md)
 	}
 }
 
-static CK_RSA_PKCS_MGF_TYPE pkcs11_md2ckg(const EVP_MD *md)
+CK_RSA_PKCS_MGF_TYPE pkcs11_md2ckg(const EVP_MD *md)
 {
 	switch (EVP_MD_type(md)) {
 	case NID_sha1:
@@ -300,11 +300,7 @@ static int pkcs11_try_pkey_rsa_sign(EVP_PKEY_CTX *evp_pkey_ctx,
 	PKCS11_KEY *key;
 	int rv = 0, padding;
 	CK_ULONG size = *siglen;
-	PKCS11_SLOT *slot;
-	PKCS11_CTX *ctx;
-	PKCS11_KEY_private *kpriv;
 	const EVP_MD *sig_md;
-	CK_SESSION_HANDLE session;
 	CK_MECHANISM mechanism;
 	CK_RSA_PKCS_PSS_PARAMS pss_params;
 
@@ -327,10 +323,6 @@ static int pkcs11_try_pkey_rsa_sign(EVP_PKEY_CTX *evp_pkey_ctx,
 	key = pkcs11_get_ex_data_rsa(rsa);
 	if (check_key_fork(key) < 0)
 		return -1;
-	slot = KEY2SLOT(key);
-	ctx = KEY2CTX(key);
-	kpriv = PRIVKEY(key);
-
 	if (!evp_pkey_ctx)
 		return -1;
 	if (EVP_PKEY_CTX_get_signature_md(evp_pkey_ctx, &sig_md) <= 0)
@@ -360,17 +352,8 @@ static int pkcs11_try_pkey_rsa_sign(EVP_PKEY_CTX *evp_pkey_ctx,
 		return -1;
 	} /* end switch(padding) */
 
-	if (pkcs11_get_session(slot, 0, &session))
-		return -1;
-
-	rv = CRYPTOKI_call(ctx,
-		C_SignInit(session, &mechanism, kpriv->object));
-	if (!rv && kpriv->always_authenticate == CK_TRUE)
-		rv = pkcs11_authenticate(key, session);
-	if (!rv)
-		rv = CRYPTOKI_call(ctx,
-			C_Sign(session, (CK_BYTE_PTR)tbs, tbslen, sig, &size));
-	pkcs11_put_session(slot, session);
+	rv = pkcs11_private_op(key, PKCS11_OP_SIGN, &mechanism,
+		tbs, tbslen, sig, &size);
 #ifdef DEBUG
 	fprintf(stderr, "%s:%d C_SignInit or C_Sign rv=%d\n",
 		__FILE__, __LINE__, rv);
@@ -403,10 +386,6 @@ static int pkcs11_try_pkey_rsa_decrypt(EVP_PKEY_CTX *evp_pkey_ctx,
 	PKCS11_KEY *key;
 	int rv = 0, padding;
 	CK_ULONG size = *outlen;
-	PKCS11_SLOT *slot;
-	PKCS11_CTX *ctx;
-	PKCS11_KEY_private *kpriv;
-	CK_SESSION_HANDLE session;
 	CK_MECHANISM mechanism;
 	CK_RSA_PKCS_OAEP_PARAMS oaep_params;
 
@@ -429,10 +408,6 @@ static int pkcs11_try_pkey_rsa_decrypt(EVP_PKEY_CTX *evp_pkey_ctx,
 	key = pkcs11_get_ex_data_rsa(rsa);
 	if (check_key_fork(key) < 0)
 		return -1;
-	slot = KEY2SLOT(key);
-	ctx = KEY2CTX(key);
-	kpriv = PRIVKEY(key);
-
 	if (!evp_pkey_ctx)
 		return -1;
 
@@ -455,6 +430,7 @@ static int pkcs11_try_pkey_rsa_decrypt(EVP_PKEY_CTX *evp_pkey_ctx,
 		fprintf(stderr, "%s:%d padding=CKM_RSA_PKCS\n",
 			__FILE__, __LINE__);
 #endif
+		mechanism.mechanism = CKM_RSA_PKCS;
 		mechanism.pParameter = NULL;
 		mechanism.ulParameterLen = 0;
 		break;
@@ -466,17 +442,8 @@ static int pkcs11_try_pkey_rsa_decrypt(EVP_PKEY_CTX *evp_pkey_ctx,
 		return -1;
 	} /* end switch(padding) */
 
-	if (pkcs11_get_session(slot, 0, &session))
-		return -1;
-
-	rv = CRYPTOKI_call(ctx,
-		C_DecryptInit(session, &mechanism, kpriv->object));
-	if (!rv && kpriv->always_authenticate == CK_TRUE)
-		rv = pkcs11_authenticate(key, session);
-	if (!rv)
-		rv = CRYPTOKI_call(ctx,
-			C_Decrypt(session, (CK_BYTE_PTR)in, inlen, out, &size));
-	pkcs11_put_session(slot, session);
+	rv = pkcs11_private_op(key, PKCS11_OP_DECRYPT, &mechanism,
+		in, inlen, out, &size);
 #ifdef DEBUG
 	fprintf(stderr, "%s:%d C_DecryptInit or C_Decrypt rv=%d\n",
 		__FILE__, __LINE__, rv);
@@ -500,6 +467,345 @@ static int pkcs11_pkey_rsa_decrypt(EVP_PKEY_CTX *evp_pkey_ctx,
 	return ret;
 }
 
+#ifndef OPENSSL_NO_EC
+
+/* Convert the raw r|s signature of the token into DER in place */
+static int pkcs11_ecdsa_sig_der(unsigned char *sig, size_t size,
+		size_t *siglen)
+{
+	ECDSA_SIG *ossl_sig;
+	BIGNUM *r, *s;
+
+	ossl_sig = ECDSA_SIG_new();
+	if (!ossl_sig)
+		return -1;
+	r = BN_bin2bn(sig, size/2, NULL);
+	s = BN_bin2bn(sig + size/2, size/2, NULL);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+	ECDSA_SIG_set0(ossl_sig, r, s);
+#else
+	BN_free(ossl_sig->r);
+	ossl_sig->r = r;
+	BN_free(ossl_sig->s);
+	ossl_sig->s = s;
+#endif
+	*siglen = i2d_ECDSA_SIG(ossl_sig, &sig);
+	ECDSA_SIG_free(ossl_sig);
+	return 1;
+}
+
+#endif /* OPENSSL_NO_EC */
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+
+/*
+ * EVP_DigestSign() with the private keys of a token
+ *
+ * The digest_custom() method replaces the digest of the EVP_MD_CTX with
+ * pkcs11_stream_md, so that EVP_DigestSignUpdate() passes the data to
+ * C_SignUpdate() of a hash-and-sign mechanism, and the signctx() method
+ * finishes the signature with C_SignFinal().  The token operation is
+ * started with the first data, after the padding was set.  If the token
+ * does not support the mechanism, the data is hashed by OpenSSL, and the
+ * digest is signed with EVP_PKEY_sign() as usual.
+ */
+
+typedef struct pkcs11_stream_st {
+	unsigned int refs; /* copies of the EVP_MD_CTX sharing the operation */
+	PKCS11_KEY *key;
+	int started;
+	PKCS11_SIGN *sign; /* NULL unless signed by the token */
+	EVP_MD_CTX *md_ctx; /* NULL unless hashed by OpenSSL */
+} PKCS11_STREAM;
+
+static EVP_MD *pkcs11_stream_md = NULL;
+
+static PKCS11_STREAM *pkcs11_stream_get(const EVP_MD_CTX *mctx)
+{
+	if (!pkcs11_stream_md || EVP_MD_CTX_md(mctx) != pkcs11_stream_md)
+		return NULL;
+	return *(PKCS11_STREAM **)EVP_MD_CTX_md_data(mctx);
+}
+
+static void pkcs11_stream_free(PKCS11_STREAM *stream)
+{
+	if (!stream || p11_atomic_add(&stream->refs, -1) > 0)
+		return;
+	pkcs11_sign_free(stream->sign);
+	EVP_MD_CTX_free(stream->md_ctx);
+	OPENSSL_free(stream);
+}
+
+/* The private key of the token signing with the context, or NULL */
+static PKCS11_KEY *pkcs11_stream_key(EVP_PKEY_CTX *ctx)
+{
+	EVP_PKEY *pkey = EVP_PKEY_CTX_get0_pkey(ctx);
+	PKCS11_KEY *key = NULL;
+
+	if (!pkey || EVP_PKEY_CTX_get_operation(ctx) != EVP_PKEY_OP_SIGN)
+		return NULL;
+	switch (EVP_PKEY_base_id(pkey)) {
+	case EVP_PKEY_RSA:
+		key = pkcs11_get_ex_data_rsa(EVP_PKEY_get0_RSA(pkey));
+		break;
+#ifndef OPENSSL_NO_EC
+	case EVP_PKEY_EC:
+		key = pkcs11_get_ex_data_ec(EVP_PKEY_get0_EC_KEY(pkey));
+		break;
+#endif /* OPENSSL_NO_EC */
+	}
+	if (check_key_fork(key) < 0)
+		return NULL;
+	return key;
+}
+
+/* Select the hash-and-sign mechanism of the context */
+static int pkcs11_stream_mechanism(CK_MECHANISM *mechanism,
+		CK_RSA_PKCS_PSS_PARAMS *pss, EVP_PKEY_CTX *ctx, const EVP_MD *md)
+{
+	static const struct {
+		int nid;
+		CK_MECHANISM_TYPE pkcs, pss, ecdsa;
+	} mechs[] = {
+		{NID_sha1, CKM_SHA1_RSA_PKCS, CKM_SHA1_RSA_PKCS_PSS, CKM_ECDSA_SHA1},
+		{NID_sha224, CKM_SHA224_RSA_PKCS, CKM_SHA224_RSA_PKCS_PSS, CKM_ECDSA_SHA224},
+		{NID_sha256, CKM_SHA256_RSA_PKCS, CKM_SHA256_RSA_PKCS_PSS, CKM_ECDSA_SHA256},
+		{NID_sha384, CKM_SHA384_RSA_PKCS, CKM_SHA384_RSA_PKCS_PSS, CKM_ECDSA_SHA384},
+		{NID_sha512, CKM_SHA512_RSA_PKCS, CKM_SHA512_RSA_PKCS_PSS, CKM_ECDSA_SHA512},
+	};
+	unsigned int i;
+	int padding = RSA_PKCS1_PADDING;
+
+	for (i = 0; i < sizeof(mechs) / sizeof(mechs[0]); i++)
+		if (mechs[i].nid == EVP_MD_type(md))
+			break;
+	if (i == sizeof(mechs) / sizeof(mechs[0]))
+		return -1;
+
+	memset(mechanism, 0, sizeof(CK_MECHANISM));
+	if (EVP_PKEY_base_id(EVP_PKEY_CTX_get0_pkey(ctx)) == EVP_PKEY_EC) {
+		mechanism->mechanism = mechs[i].ecdsa;
+		return 0;
+	}
+	EVP_PKEY_CTX_get_rsa_padding(ctx, &padding);
+	switch (padding) {
+	case RSA_PKCS1_PADDING:
+		mechanism->mechanism = mechs[i].pkcs;
+		return 0;
+	case RSA_PKCS1_PSS_PADDING:
+		if (pkcs11_params_pss(pss, ctx) < 0)
+			return -1;
+		mechanism->mechanism = mechs[i].pss;
+		mechanism->pParameter = pss;
+		mechanism->ulParameterLen = sizeof(CK_RSA_PKCS_PSS_PARAMS);
+		return 0;
+	}
+	return -1;
+}
+
+/* Start signing with the token, or hashing with OpenSSL */
+static int pkcs11_stream_start(PKCS11_STREAM *stream, EVP_PKEY_CTX *ctx)
+{
+	CK_MECHANISM mechanism;
+	CK_RSA_PKCS_PSS_PARAMS pss;
+	const EVP_MD *md;
+
+	stream->started = 1;
+	if (EVP_PKEY_CTX_get_signature_md(ctx, &md) <= 0 || !md)
+		return 0;
+	if (pkcs11_stream_mechanism(&mechanism, &pss, ctx, md) == 0 &&
+			pkcs11_sign_init(stream->key, &mechanism,
+				&stream->sign) == CKR_OK)
+		return 1;
+	stream->md_ctx = EVP_MD_CTX_new();
+	return stream->md_ctx && EVP_DigestInit_ex(stream->md_ctx, md, NULL);
+}
+
+static int pkcs11_stream_init(EVP_MD_CTX *mctx)
+{
+	(void)mctx;
+	return 1;
+}
+
+static int pkcs11_stream_update(EVP_MD_CTX *mctx,
+		const void *data, size_t count)
+{
+	PKCS11_STREAM *stream = pkcs11_stream_get(mctx);
+	CK_RV rv;
+
+	if (!stream)
+		return 0;
+	if (!stream->started &&
+			!pkcs11_stream_start(stream, EVP_MD_CTX_pkey_ctx(mctx)))
+		return 0;
+	if (stream->md_ctx)
+		return EVP_DigestUpdate(stream->md_ctx, data, count);
+	rv = stream->sign ? pkcs11_sign_update(stream->sign, data, count) :
+		CKR_OPERATION_NOT_INITIALIZED;
+	if (rv != CKR_OK) {
+		CKRerr(CKR_F_PKCS11_SIGN_UPDATE, rv);
+		return 0;
+	}
+	return 1;
+}
+
+/* The digest is only retrieved by the signctx() method */
+static int pkcs11_stream_final(EVP_MD_CTX *mctx, unsigned char *md)
+{
+	(void)mctx;
+	(void)md;
+	return 0;
+}
+
+/* The copies share the token operation, which is only finished once */
+static int pkcs11_stream_copy(EVP_MD_CTX *to, const EVP_MD_CTX *from)
+{
+	PKCS11_STREAM *stream = pkcs11_stream_get(from), *copy;
+	PKCS11_STREAM **streamp = EVP_MD_CTX_md_data(to);
+
+	if (!stream)
+		return 1;
+	if (stream->sign) {
+		p11_atomic_add(&stream->refs, 1);
+		return 1;
+	}
+	*streamp = NULL;
+	copy = OPENSSL_zalloc(sizeof(PKCS11_STREAM));
+	if (!copy)
+		return 0;
+	copy->refs = 1;
+	copy->key = stream->key;
+	copy->started = stream->started;
+	if (stream->md_ctx) {
+		copy->md_ctx = EVP_MD_CTX_new();
+		if (!copy->md_ctx ||
+				!EVP_MD_CTX_copy_ex(copy->md_ctx, stream->md_ctx)) {
+			pkcs11_stream_free(copy);
+			return 0;
+		}
+	}
+	*streamp = copy;
+	return 1;
+}
+
+static int pkcs11_stream_cleanup(EVP_MD_CTX *mctx)
+{
+	PKCS11_STREAM **streamp = EVP_MD_CTX_md_data(mctx);
+
+	if (streamp) {
+		pkcs11_stream_free(*streamp);
+		*streamp = NULL;
+	}
+	return 1;
+}
+
+static EVP_MD *pkcs11_stream_md_new(void)
+{
+	EVP_MD *md;
+
+	md = EVP_MD_meth_new(NID_undef, NID_undef);
+	if (!md)
+		return NULL;
+	if (!EVP_MD_meth_set_result_size(md, EVP_MAX_MD_SIZE) ||
+			!EVP_MD_meth_set_app_datasize(md, sizeof(PKCS11_STREAM *)) ||
+			!EVP_MD_meth_set_init(md, pkcs11_stream_init) ||
+			!EVP_MD_meth_set_update(md, pkcs11_stream_update) ||
+			!EVP_MD_meth_set_final(md, pkcs11_stream_final) ||
+			!EVP_MD_meth_set_copy(md, pkcs11_stream_copy) ||
+			!EVP_MD_meth_set_cleanup(md, pkcs11_stream_cleanup)) {
+		EVP_MD_meth_free(md);
+		return NULL;
+	}
+	return md;
+}
+
+/* Stream the data of EVP_DigestSignUpdate() with a key of a token */
+static int pkcs11_pkey_digest_custom(EVP_PKEY_CTX *ctx, EVP_MD_CTX *mctx)
+{
+	PKCS11_KEY *key = pkcs11_stream_key(ctx);
+	PKCS11_STREAM *stream;
+
+	if (!key || !pkcs11_stream_md)
+		return 1; /* Hashed by OpenSSL */
+	stream = OPENSSL_zalloc(sizeof(PKCS11_STREAM));
+	if (!stream)
+		return 0;
+	stream->refs = 1;
+	stream->key = key;
+	if (!EVP_DigestInit_ex(mctx, pkcs11_stream_md, NULL)) {
+		OPENSSL_free(stream);
+		return 0;
+	}
+	*(PKCS11_STREAM **)EVP_MD_CTX_md_data(mctx) = stream;
+	return 1;
+}
+
+static int pkcs11_pkey_signctx(EVP_PKEY_CTX *ctx,
+		unsigned char *sig, size_t *siglen, EVP_MD_CTX *mctx)
+{
+	PKCS11_STREAM *stream = pkcs11_stream_get(mctx);
+	EVP_PKEY *pkey = EVP_PKEY_CTX_get0_pkey(ctx);
+	EVP_MD_CTX *tmp;
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len = 0;
+	size_t size;
+	CK_RV rv;
+	int ok;
+
+	if (!stream) {
+		/* Same as EVP_DigestSignFinal() without the signctx() method */
+		if (!sig)
+			return EVP_PKEY_sign(ctx, NULL, siglen, NULL,
+				(size_t)EVP_MD_CTX_size(mctx)) > 0;
+		return EVP_DigestFinal_ex(mctx, md, &md_len) &&
+			EVP_PKEY_sign(ctx, sig, siglen, md, md_len) > 0;
+	}
+	if (!sig) {
+		*siglen = (size_t)EVP_PKEY_size(pkey);
+		return 1;
+	}
+	if (!stream->started && !pkcs11_stream_start(stream, ctx))
+		return 0;
+	if (stream->md_ctx) {
+		/* Keep the digest for another EVP_DigestSignFinal() */
+		tmp = EVP_MD_CTX_new();
+		ok = tmp && EVP_MD_CTX_copy_ex(tmp, stream->md_ctx) &&
+			EVP_DigestFinal_ex(tmp, md, &md_len);
+		EVP_MD_CTX_free(tmp);
+		return ok && EVP_PKEY_sign(ctx, sig, siglen, md, md_len) > 0;
+	}
+
+	size = *siglen;
+	rv = stream->sign ? pkcs11_sign_final(stream->sign, sig, &size) :
+		CKR_OPERATION_NOT_INITIALIZED;
+	if (rv != CKR_BUFFER_TOO_SMALL) {
+		/* The operation is finished, return the session now */
+		pkcs11_sign_free(stream->sign);
+		stream->sign = NULL;
+	}
+	if (rv != CKR_OK) {
+		CKRerr(CKR_F_PKCS11_SIGN_FINAL, rv);
+		return 0;
+	}
+#ifndef OPENSSL_NO_EC
+	if (EVP_PKEY_base_id(pkey) == EVP_PKEY_EC)
+		return pkcs11_ecdsa_sig_der(sig, size, siglen) > 0;
+#endif /* OPENSSL_NO_EC */
+	*siglen = size;
+	return 1;
+}
+
+/* Stream the data of EVP_DigestSign() to the tokens */
+static void pkcs11_pkey_meth_set_stream(EVP_PKEY_METHOD *meth)
+{
+	if (!pkcs11_stream_md)
+		pkcs11_stream_md = pkcs11_stream_md_new();
+	EVP_PKEY_meth_set_signctx(meth, NULL, pkcs11_pkey_signctx);
+	EVP_PKEY_meth_set_digest_custom(meth, pkcs11_pkey_digest_custom);
+}
+
+#endif
+
 static EVP_PKEY_METHOD *pkcs11_pkey_method_rsa()
 {
 	EVP_PKEY_METHOD *orig_meth, *new_meth;
@@ -525,6 +831,9 @@ static EVP_PKEY_METHOD *pkcs11_pkey_method_rsa()
 		orig_pkey_rsa_sign_init, pkcs11_pkey_rsa_sign);
 	EVP_PKEY_meth_set_decrypt(new_meth,
 		orig_pkey_rsa_decrypt_init, pkcs11_pkey_rsa_decrypt);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+	pkcs11_pkey_meth_set_stream(new_meth);
+#endif
 
 	return new_meth;
 }
@@ -538,14 +847,9 @@ static int pkcs11_try_pkey_ec_sign(EVP_PKEY_CTX *evp_pkey_ctx,
 	EVP_PKEY *pkey;
 	EC_KEY *eckey;
 	PKCS11_KEY *key;
-	int rv = CKR_GENERAL_ERROR;
+	int rv;
 	CK_ULONG size = *siglen;
-	PKCS11_SLOT *slot;
-	PKCS11_CTX *ctx;
-	PKCS11_KEY_private *kpriv;
-	CK_SESSION_HANDLE session;
 	const EVP_MD *sig_md;
-	ECDSA_SIG *ossl_sig;
 	CK_MECHANISM mechanism;
 
 #ifdef DEBUG
@@ -554,92 +858,54 @@ static int pkcs11_try_pkey_ec_sign(EVP_PKEY_CTX *evp_pkey_ctx,
 		__FILE__, __LINE__, sig, *siglen, tbs, tbslen);
 #endif
 
-	ossl_sig = ECDSA_SIG_new();
-	if (!ossl_sig)
-		goto error;
-
 	pkey = EVP_PKEY_CTX_get0_pkey(evp_pkey_ctx);
 	if (!pkey)
-		goto error;
+		return -1;
 
 	eckey = (EC_KEY *)EVP_PKEY_get0_EC_KEY(pkey);
 	if (!eckey)
-		goto error;
+		return -1;
 
 	if (!sig) {
 		*siglen = (size_t)ECDSA_size(eckey);
-		rv = CKR_OK;
-		goto error;
-	}
-
-	if (sig == NULL) {
-		*siglen = (size_t)ECDSA_size(eckey);
-		rv = CKR_OK;
-		goto error;
+		return 1;
 	}
 
 	if (*siglen < (size_t)ECDSA_size(eckey))
-		goto error;
+		return -1;
 
 	key = pkcs11_get_ex_data_ec(eckey);
 	if (check_key_fork(key) < 0)
-		goto error;
-
-	slot = KEY2SLOT(key);
-	ctx = KEY2CTX(key);
-	kpriv = PRIVKEY(key);
+		return -1;
 
 	if (!evp_pkey_ctx)
-		goto error;
+		return -1;
 
 	if (EVP_PKEY_CTX_get_signature_md(evp_pkey_ctx, &sig_md) <= 0)
-		goto error;
+		return -1;
 
 	if (tbslen < (size_t)EVP_MD_size(sig_md))
-		goto error;
+		return -1;
+
+	/* The raw signature is shorter than its DER encoding */
+	if (PRIVKEY(key)->desc.sig_size)
+		size = PRIVKEY(key)->desc.sig_size;
 
-	rv = 0;
 	memset(&mechanism, 0, sizeof mechanism);
 	mechanism.mechanism = CKM_ECDSA;
 
-	if (pkcs11_get_session(slot, 0, &session))
-		return -1;
-	rv = CRYPTOKI_call(ctx,
-		C_SignInit(session, &mechanism, kpriv->object));
-	if (!rv && kpriv->always_authenticate == CK_TRUE)
-		rv = pkcs11_authenticate(key, session);
-	if (!rv)
-		rv = CRYPTOKI_call(ctx,
-			C_Sign(session, (CK_BYTE_PTR)tbs, tbslen, sig, &size));
-	pkcs11_put_session(slot, session);
+	rv = pkcs11_private_op(key, PKCS11_OP_SIGN, &mechanism,
+		tbs, tbslen, sig, &size);
 
 #ifdef DEBUG
 	fprintf(stderr, "%s:%d C_SignInit or C_Sign rv=%d\n",
 		__FILE__, __LINE__, rv);
 #endif
 
-	if (rv == CKR_OK) {
-		BIGNUM *r = BN_bin2bn(sig, size/2, NULL);
-		BIGNUM *s = BN_bin2bn(sig + size/2, size/2, NULL);
-
-#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
-		ECDSA_SIG_set0(ossl_sig, r, s);
-#else
-		BN_free(ossl_sig->r);
-		ossl_sig->r = r;
-		BN_free(ossl_sig->s);
-		ossl_sig->s = s;
-#endif
-		*siglen = i2d_ECDSA_SIG(ossl_sig, &sig);
-	}
-
-error:
-	ECDSA_SIG_free(ossl_sig);
-
 	if (rv != CKR_OK)
 		return -1;
 
-	return 1;
+	return pkcs11_ecdsa_sig_der(sig, size, siglen);
 }
 
 static int pkcs11_pkey_ec_sign(EVP_PKEY_CTX *evp_pkey_ctx,
@@ -673,6 +939,9 @@ static EVP_PKEY_METHOD *pkcs11_pkey_method_ec()
 
 	EVP_PKEY_meth_set_sign(new_meth,
 		orig_pkey_ec_sign_init, pkcs11_pkey_ec_sign);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+	pkcs11_pkey_meth_set_stream(new_meth);
+#endif
 
 	return new_meth;
 }
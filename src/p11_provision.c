@@ -0,0 +1,302 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Batched key generation and object import
+ *
+ * The requests are consumed by lanes, each holding one read-write session,
+ * like the requests of pkcs11_sign_batch().  The lanes only call
+ * C_GenerateKeyPair() and C_CreateObject(), and record the new object
+ * handles.  The calling thread then adds the keys and certificates to the
+ * token from the values of the requests, as the templates determine the
+ * attributes that pkcs11_init_key() and pkcs11_init_cert() would read back.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+
+/* The objects created for a request */
+typedef struct pkcs11_provision_item {
+	CK_OBJECT_HANDLE objects[2]; /* the private or only object first */
+	PKCS11_KEY *key; /* the new key, which does not move */
+	int index; /* of the new certificate in the token array */
+} PKCS11_PROVISION_ITEM;
+
+typedef struct pkcs11_provision_batch {
+	PKCS11_TOKEN *token;
+	PKCS11_PROVISION_REQ *reqs;
+	PKCS11_PROVISION_ITEM *items;
+	unsigned int count;
+	unsigned int next; /* next request to be processed */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int running; /* lanes submitted to the worker threads */
+} PKCS11_PROVISION_BATCH;
+
+typedef struct pkcs11_provision_lane {
+	PKCS11_TASK task;
+	PKCS11_PROVISION_BATCH *batch;
+} PKCS11_PROVISION_LANE;
+
+/* Check a request before it is submitted to the lanes */
+static CK_RV pkcs11_provision_check(const PKCS11_PROVISION_REQ *req)
+{
+	switch (req->job) {
+	case PKCS11_PROVISION_GENERATE:
+		return req->bits ? CKR_OK : CKR_ARGUMENTS_BAD;
+	case PKCS11_PROVISION_PRIVATE_KEY:
+	case PKCS11_PROVISION_PUBLIC_KEY:
+		if (!req->pkey)
+			return CKR_ARGUMENTS_BAD;
+		/* Reported here, as errors of the worker threads are lost */
+		if (EVP_PKEY_base_id(req->pkey) != EVP_PKEY_RSA)
+			return CKR_KEY_TYPE_INCONSISTENT;
+		return CKR_OK;
+	case PKCS11_PROVISION_CERT:
+		return req->x509 ? CKR_OK : CKR_ARGUMENTS_BAD;
+	default:
+		return CKR_ARGUMENTS_BAD;
+	}
+}
+
+/* Create the objects of a single request */
+static CK_RV pkcs11_provision_run(PKCS11_CTX *ctx, CK_SESSION_HANDLE session,
+		PKCS11_PROVISION_REQ *req, CK_OBJECT_HANDLE *objects)
+{
+	CK_MECHANISM mechanism = {
+		CKM_RSA_PKCS_KEY_PAIR_GEN, NULL_PTR, 0
+	};
+	CK_ATTRIBUTE attrs[32], pub_attrs[32];
+	unsigned int n, n_pub;
+	int r;
+	CK_RV rv;
+
+	switch (req->job) {
+	case PKCS11_PROVISION_GENERATE:
+		pkcs11_keygen_templates(req->bits, req->label, req->id,
+			req->id_len, pub_attrs, &n_pub, attrs, &n);
+		rv = CRYPTOKI_call(ctx, C_GenerateKeyPair(session, &mechanism,
+			pub_attrs, n_pub, attrs, n, objects + 1, objects));
+		pkcs11_zap_attrs(pub_attrs, n_pub);
+		break;
+	case PKCS11_PROVISION_CERT:
+		n = pkcs11_cert_create_template(attrs, req->x509, req->label,
+			req->id, req->id_len);
+		rv = CRYPTOKI_call(ctx, C_CreateObject(session, attrs, n, objects));
+		break;
+	default:
+		r = pkcs11_key_create_template(attrs, req->pkey,
+			req->job == PKCS11_PROVISION_PRIVATE_KEY ?
+				CKO_PRIVATE_KEY : CKO_PUBLIC_KEY,
+			req->label, req->id, req->id_len);
+		if (r < 0)
+			return CKR_KEY_TYPE_INCONSISTENT;
+		n = (unsigned int)r;
+		rv = CRYPTOKI_call(ctx, C_CreateObject(session, attrs, n, objects));
+		break;
+	}
+	pkcs11_zap_attrs(attrs, n);
+	return rv;
+}
+
+/*
+ * Process the pending batch requests with a single session
+ * Returns 1 if no session was available within the timeout
+ */
+static int pkcs11_provision_lane(PKCS11_PROVISION_BATCH *batch, long timeout)
+{
+	PKCS11_SLOT *slot = TOKEN2SLOT(batch->token);
+	PKCS11_CTX *ctx = SLOT2CTX(slot);
+	CK_SESSION_HANDLE session;
+	unsigned int i;
+	CK_RV rv = CKR_OK;
+
+	if (pkcs11_get_session_timed(slot, 1, &session, timeout))
+		return 1; /* Other lanes will process the requests */
+	/* Give up the session once it or the login is lost */
+	while (rv != CKR_USER_NOT_LOGGED_IN &&
+			rv != CKR_SESSION_HANDLE_INVALID && rv != CKR_SESSION_CLOSED &&
+			(i = p11_atomic_add(&batch->next, 1) - 1) < batch->count) {
+		if (batch->reqs[i].rv != CKR_OK)
+			continue; /* Rejected by pkcs11_provision_check() */
+		rv = pkcs11_provision_run(ctx, session, batch->reqs + i,
+			batch->items[i].objects);
+		batch->reqs[i].rv = rv;
+	}
+	pkcs11_put_session_rv(slot, 1, session, rv);
+	return 0;
+}
+
+static void pkcs11_provision_lane_run(PKCS11_TASK *task)
+{
+	PKCS11_PROVISION_BATCH *batch = ((PKCS11_PROVISION_LANE *)task)->batch;
+
+	/* Worker threads never wait for a session */
+	pkcs11_provision_lane(batch, 0);
+	pthread_mutex_lock(&batch->lock);
+	if (--batch->running == 0)
+		pthread_cond_signal(&batch->cond);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/* Add the objects created for a request to the token */
+static CK_RV pkcs11_provision_add(PKCS11_TOKEN *token,
+		const PKCS11_PROVISION_REQ *req, PKCS11_PROVISION_ITEM *item)
+{
+	PKCS11_KEY *key = NULL;
+	PKCS11_CERT *cert = NULL;
+	int r;
+
+	switch (req->job) {
+	case PKCS11_PROVISION_GENERATE:
+		r = pkcs11_add_key(token, item->objects[1], CKO_PUBLIC_KEY,
+				CKK_RSA, req->label, req->id, req->id_len, NULL) ||
+			pkcs11_add_key(token, item->objects[0], CKO_PRIVATE_KEY,
+				CKK_RSA, req->label, req->id, req->id_len, &key);
+		break;
+	case PKCS11_PROVISION_CERT:
+		r = pkcs11_add_cert(token, item->objects[0], req->x509,
+			req->label, req->id, req->id_len, &cert);
+		break;
+	default:
+		r = pkcs11_add_key(token, item->objects[0],
+			req->job == PKCS11_PROVISION_PRIVATE_KEY ?
+				CKO_PRIVATE_KEY : CKO_PUBLIC_KEY,
+			CKK_RSA, req->label, req->id, req->id_len, &key);
+		break;
+	}
+	if (r || (!key && !cert))
+		return CKR_HOST_MEMORY;
+	item->key = key;
+	item->index = cert ? (int)(cert - PRIVTOKEN(token)->certs) : -1;
+	return CKR_OK;
+}
+
+/*
+ * Add the created objects to the token, and set the pointers of the
+ * requests once the certificate array is no longer reallocated
+ */
+static void pkcs11_provision_add_all(PKCS11_PROVISION_BATCH *batch)
+{
+	PKCS11_TOKEN_private *tpriv = PRIVTOKEN(batch->token);
+	PKCS11_PROVISION_REQ *req;
+	unsigned int i;
+
+	for (i = 0; i < batch->count; i++) {
+		req = batch->reqs + i;
+		if (req->rv == CKR_OK)
+			req->rv = pkcs11_provision_add(batch->token, req,
+				batch->items + i);
+	}
+	for (i = 0; i < batch->count; i++) {
+		req = batch->reqs + i;
+		req->key = NULL;
+		req->cert = NULL;
+		if (req->rv != CKR_OK)
+			continue;
+		if (req->job == PKCS11_PROVISION_CERT)
+			req->cert = tpriv->certs + batch->items[i].index;
+		else
+			req->key = batch->items[i].key;
+	}
+}
+
+/*
+ * Generate or store a vector of objects using as many read-write sessions
+ * as the slot allows
+ * Returns 0 if all the requests succeeded, or -1 otherwise
+ */
+int pkcs11_provision_batch(PKCS11_TOKEN *token,
+		PKCS11_PROVISION_REQ *reqs, unsigned int count)
+{
+	PKCS11_SLOT *slot = TOKEN2SLOT(token);
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	PKCS11_CTX *ctx = SLOT2CTX(slot);
+	PKCS11_PROVISION_BATCH batch;
+	PKCS11_PROVISION_LANE lanes[PKCS11_MAX_BATCH_LANES];
+	unsigned int i, nlanes;
+	int timed_out;
+
+	if (!count)
+		return 0;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.items = OPENSSL_malloc(count * sizeof(PKCS11_PROVISION_ITEM));
+	if (!batch.items) {
+		CKRerr(CKR_F_PKCS11_PROVISION_BATCH, CKR_HOST_MEMORY);
+		return -1;
+	}
+	/* The lanes only process the requests passing the checks */
+	for (i = 0; i < count; i++)
+		reqs[i].rv = pkcs11_provision_check(reqs + i);
+	batch.token = token;
+	batch.reqs = reqs;
+	batch.count = count;
+	pthread_mutex_init(&batch.lock, 0);
+	pthread_cond_init(&batch.cond, 0);
+
+	nlanes = SESSION_POOL(spriv, 1)->max_sessions;
+	if (nlanes > PKCS11_MAX_BATCH_LANES)
+		nlanes = PKCS11_MAX_BATCH_LANES;
+	if (nlanes > count)
+		nlanes = count;
+
+	/* The calling thread processes one of the lanes */
+	for (i = 1; i < nlanes; i++) {
+		lanes[i].task.run = pkcs11_provision_lane_run;
+		lanes[i].batch = &batch;
+		pthread_mutex_lock(&batch.lock);
+		batch.running++;
+		pthread_mutex_unlock(&batch.lock);
+		if (pkcs11_task_submit(ctx, &lanes[i].task) < 0) {
+			pthread_mutex_lock(&batch.lock);
+			batch.running--;
+			pthread_mutex_unlock(&batch.lock);
+			break;
+		}
+	}
+	timed_out = pkcs11_provision_lane(&batch,
+		p11_atomic_load(&PRIVCTX(ctx)->session_timeout));
+
+	pthread_mutex_lock(&batch.lock);
+	while (batch.running)
+		pthread_cond_wait(&batch.cond, &batch.lock);
+	pthread_mutex_unlock(&batch.lock);
+	pthread_mutex_destroy(&batch.lock);
+	pthread_cond_destroy(&batch.cond);
+
+	/* The requests left when no lane had a session or a login */
+	for (i = batch.next < count ? batch.next : count; i < count; i++)
+		if (reqs[i].rv == CKR_OK)
+			reqs[i].rv = CKR_GENERAL_ERROR;
+
+	pkcs11_provision_add_all(&batch);
+	OPENSSL_free(batch.items);
+
+	for (i = 0; i < count; i++) {
+		if (reqs[i].rv != CKR_OK) {
+			if (timed_out)
+				pkcs11_session_timeout(slot);
+			/* Report the first failure, see reqs[].rv for the others */
+			CKRerr(CKR_F_PKCS11_PROVISION_BATCH, reqs[i].rv);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* vim: set noexpandtab: */
@@ -29,6 +29,8 @@
 #endif
 
 #include <windows.h>
+#include <errno.h>
+#include <time.h>
 
 typedef CRITICAL_SECTION pthread_mutex_t;
 typedef void pthread_mutexattr_t;
@@ -81,14 +83,176 @@ static int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
 	return 0;
 }
 
+static int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+		const struct timespec *abstime)
+{
+	struct timespec now;
+	DWORD ms = 0;
+
+	timespec_get(&now, TIME_UTC);
+	if (abstime->tv_sec > now.tv_sec || (abstime->tv_sec == now.tv_sec &&
+			abstime->tv_nsec > now.tv_nsec))
+		ms = (DWORD)((abstime->tv_sec - now.tv_sec) * 1000 +
+			(abstime->tv_nsec - now.tv_nsec) / 1000000);
+	if (!SleepConditionVariableCS(cond, mutex, ms))
+		return GetLastError() == ERROR_TIMEOUT ? ETIMEDOUT : 1;
+	return 0;
+}
+
 static int pthread_cond_signal(pthread_cond_t *cond)
 {
 	WakeConditionVariable(cond);
 	return 0;
 }
 
+static int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+	WakeAllConditionVariable(cond);
+	return 0;
+}
+
+/* SRW locks are released with a call depending on the acquisition mode */
+typedef struct {
+	SRWLOCK lock;
+	int exclusive;
+} pthread_rwlock_t;
+typedef void pthread_rwlockattr_t;
+
+static int pthread_rwlock_init(pthread_rwlock_t *rwlock,
+		pthread_rwlockattr_t *attr)
+{
+	(void)attr;
+	InitializeSRWLock(&rwlock->lock);
+	rwlock->exclusive = 0;
+	return 0;
+}
+
+static int pthread_rwlock_destroy(pthread_rwlock_t *rwlock)
+{
+	(void)rwlock;
+	return 0;
+}
+
+static int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock)
+{
+	AcquireSRWLockShared(&rwlock->lock);
+	return 0;
+}
+
+static int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock)
+{
+	return TryAcquireSRWLockShared(&rwlock->lock) ? 0 : EBUSY;
+}
+
+static int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock)
+{
+	AcquireSRWLockExclusive(&rwlock->lock);
+	rwlock->exclusive = 1;
+	return 0;
+}
+
+static int pthread_rwlock_unlock(pthread_rwlock_t *rwlock)
+{
+	/* Only the writer can see exclusive set */
+	if (rwlock->exclusive) {
+		rwlock->exclusive = 0;
+		ReleaseSRWLockExclusive(&rwlock->lock);
+	} else {
+		ReleaseSRWLockShared(&rwlock->lock);
+	}
+	return 0;
+}
+
+typedef HANDLE pthread_t;
+typedef void pthread_attr_t;
+
+struct p11_thread_start {
+	void *(*start_routine)(void *);
+	void *arg;
+};
+
+static DWORD WINAPI p11_thread_start(LPVOID param)
+{
+	struct p11_thread_start start = *(struct p11_thread_start *)param;
+
+	HeapFree(GetProcessHeap(), 0, param);
+	start.start_routine(start.arg);
+	return 0;
+}
+
+static int pthread_create(pthread_t *thread, pthread_attr_t *attr,
+		void *(*start_routine)(void *), void *arg)
+{
+	struct p11_thread_start *start;
+
+	(void)attr;
+	start = HeapAlloc(GetProcessHeap(), 0, sizeof(struct p11_thread_start));
+	if (!start)
+		return 1;
+	start->start_routine = start_routine;
+	start->arg = arg;
+	*thread = CreateThread(NULL, 0, p11_thread_start, start, 0, NULL);
+	if (!*thread) {
+		HeapFree(GetProcessHeap(), 0, start);
+		return 1;
+	}
+	return 0;
+}
+
+static int pthread_detach(pthread_t thread)
+{
+	CloseHandle(thread);
+	return 0;
+}
+
+static int pthread_join(pthread_t thread, void **retval)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	if (retval)
+		*retval = NULL;
+	return 0;
+}
+
 #else
 
 #error Locking not supported on this platform.
 
 #endif
+
+/* Atomic operations on 32-bit (_WIN32) or native size integral values,
+ * and on pointers with the _ptr variants */
+#if defined(_MSC_VER)
+
+#define P11_THREAD_LOCAL __declspec(thread)
+#define p11_atomic_load(p) \
+	InterlockedCompareExchange((LONG volatile *)(p), 0, 0)
+#define p11_atomic_store(p, v) \
+	(void)InterlockedExchange((LONG volatile *)(p), (LONG)(v))
+#define p11_atomic_xchg(p, v) \
+	InterlockedExchange((LONG volatile *)(p), (LONG)(v))
+#define p11_atomic_cas(p, e, d) \
+	(InterlockedCompareExchange((LONG volatile *)(p), (LONG)(d), (LONG)(e)) == (LONG)(e))
+#define p11_atomic_add(p, v) \
+	(InterlockedExchangeAdd((LONG volatile *)(p), (LONG)(v)) + (v))
+#define p11_atomic_load_ptr(p) \
+	InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#define p11_atomic_store_ptr(p, v) \
+	(void)InterlockedExchangePointer((PVOID volatile *)(p), (PVOID)(v))
+#define p11_atomic_cas_ptr(p, e, d) \
+	(InterlockedCompareExchangePointer((PVOID volatile *)(p), \
+		(PVOID)(d), (PVOID)(e)) == (PVOID)(e))
+
+#else
+
+#define P11_THREAD_LOCAL __thread
+#define p11_atomic_load(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define p11_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define p11_atomic_xchg(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define p11_atomic_cas(p, e, d) __sync_bool_compare_and_swap((p), (e), (d))
+#define p11_atomic_add(p, v) __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define p11_atomic_load_ptr(p) p11_atomic_load(p)
+#define p11_atomic_store_ptr(p, v) p11_atomic_store((p), (v))
+#define p11_atomic_cas_ptr(p, e, d) p11_atomic_cas((p), (e), (d))
+
+#endif
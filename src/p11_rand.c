@@ -0,0 +1,208 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Per-slot buffer of the random numbers generated by the token
+ *
+ * The small pkcs11_generate_random() requests are served from a ring
+ * buffer, which is refilled with a single C_GenerateRandom() call by
+ * a worker thread when it drops below the watermark.  The larger
+ * requests, and the requests that the buffer cannot serve yet, are
+ * passed to the token.  The bytes are wiped from the buffer as soon as
+ * they are consumed, and discarded after fork(), so that the parent and
+ * the child never share them.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+
+/* Replace the buffer, called with the lock held and no refill running */
+static void pkcs11_rand_resize(PKCS11_RAND_BUFFER *rb, unsigned int size)
+{
+	if (rb->data) {
+		OPENSSL_cleanse(rb->data, rb->size);
+		OPENSSL_free(rb->data);
+	}
+	OPENSSL_free(rb->block);
+	rb->data = rb->block = NULL;
+	p11_atomic_store(&rb->size, 0);
+	rb->head = rb->count = 0;
+	if (!size)
+		return;
+	rb->data = OPENSSL_malloc(size);
+	rb->block = OPENSSL_malloc(size);
+	if (!rb->data || !rb->block) {
+		OPENSSL_free(rb->data);
+		OPENSSL_free(rb->block);
+		rb->data = rb->block = NULL;
+		return;
+	}
+	p11_atomic_store(&rb->size, size);
+}
+
+/* Fill the free space of the buffer, run by a worker thread */
+static void pkcs11_rand_refill(PKCS11_TASK *task)
+{
+	PKCS11_RAND_BUFFER *rb = (PKCS11_RAND_BUFFER *)task;
+	PKCS11_SLOT *slot = rb->slot;
+	CK_SESSION_HANDLE session;
+	CK_RV rv = CKR_GENERAL_ERROR;
+	unsigned int n, tail, chunk;
+
+	/* The buffer is not resized until the refill completes */
+	pthread_mutex_lock(&rb->lock);
+	n = rb->size - rb->count;
+	pthread_mutex_unlock(&rb->lock);
+
+	/* A failed refill is not reported, the requests go to the token */
+	ERR_set_mark();
+	if (n > 0 && pkcs11_get_session(slot, 0, &session) == 0) {
+		rv = CRYPTOKI_call(SLOT2CTX(slot),
+			C_GenerateRandom(session, rb->block, n));
+		pkcs11_put_session(slot, 0, session);
+	}
+	ERR_pop_to_mark();
+
+	pthread_mutex_lock(&rb->lock);
+	if (rv == CKR_OK) {
+		/* Bytes were only consumed in the meantime */
+		tail = (rb->head + rb->count) % rb->size;
+		chunk = rb->size - tail < n ? rb->size - tail : n;
+		memcpy(rb->data + tail, rb->block, chunk);
+		memcpy(rb->data, rb->block + chunk, n - chunk);
+		rb->count += n;
+	}
+	if (n > 0)
+		OPENSSL_cleanse(rb->block, n);
+	rb->refilling = 0;
+	pthread_cond_broadcast(&rb->cond);
+	pthread_mutex_unlock(&rb->lock);
+}
+
+void pkcs11_rand_init(PKCS11_SLOT *slot)
+{
+	PKCS11_RAND_BUFFER *rb = &PRIVSLOT(slot)->rand;
+
+	rb->task.run = pkcs11_rand_refill;
+	rb->slot = slot;
+	rb->data = rb->block = NULL;
+	rb->size = rb->head = rb->count = 0;
+	rb->refilling = 0;
+	pthread_mutex_init(&rb->lock, 0);
+	pthread_cond_init(&rb->cond, 0);
+}
+
+void pkcs11_rand_free(PKCS11_SLOT *slot)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	PKCS11_RAND_BUFFER *rb = &spriv->rand;
+
+	pthread_mutex_lock(&rb->lock);
+	/* The refill of the parent process is not running in the child */
+	if (spriv->forkid == get_forkid())
+		while (rb->refilling)
+			pthread_cond_wait(&rb->cond, &rb->lock);
+	pkcs11_rand_resize(rb, 0);
+	pthread_mutex_unlock(&rb->lock);
+	pthread_mutex_destroy(&rb->lock);
+	pthread_cond_destroy(&rb->cond);
+}
+
+/*
+ * Discard the random numbers after fork()
+ * The refill in progress, if any, belongs to the parent process.
+ */
+void pkcs11_rand_reset(PKCS11_SLOT *slot)
+{
+	PKCS11_RAND_BUFFER *rb = &PRIVSLOT(slot)->rand;
+
+	pthread_mutex_lock(&rb->lock);
+	rb->refilling = 0;
+	if (rb->data)
+		OPENSSL_cleanse(rb->data, rb->size);
+	rb->head = rb->count = 0;
+	pthread_mutex_unlock(&rb->lock);
+}
+
+/* Copy len bytes out of the buffer, called with the lock held */
+static int pkcs11_rand_take(PKCS11_RAND_BUFFER *rb, unsigned char *r,
+		unsigned int len)
+{
+	unsigned int chunk;
+
+	if (rb->count < len)
+		return -1;
+	chunk = rb->size - rb->head < len ? rb->size - rb->head : len;
+	memcpy(r, rb->data + rb->head, chunk);
+	OPENSSL_cleanse(rb->data + rb->head, chunk);
+	memcpy(r + chunk, rb->data, len - chunk);
+	OPENSSL_cleanse(rb->data, len - chunk);
+	rb->head = (rb->head + len) % rb->size;
+	rb->count -= len;
+	return 0;
+}
+
+/*
+ * Serve a request from the random buffer of the slot
+ * Returns 0 on success, or 1 if the caller has to use the token instead
+ */
+int pkcs11_rand_bytes(PKCS11_SLOT *slot, unsigned char *r, unsigned int len)
+{
+	PKCS11_CTX *ctx = SLOT2CTX(slot);
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+	PKCS11_RAND_BUFFER *rb = &PRIVSLOT(slot)->rand;
+	unsigned int size = p11_atomic_load(&cpriv->rand_buffer_size);
+	unsigned int watermark = p11_atomic_load(&cpriv->rand_watermark);
+	int served, refill = 0;
+
+	/* The large requests are streamed from the token */
+	if (len == 0 || len > size / 2) {
+		/* Release the buffer once disabled */
+		if (size == 0 && p11_atomic_load(&rb->size)) {
+			pthread_mutex_lock(&rb->lock);
+			if (!rb->refilling)
+				pkcs11_rand_resize(rb, 0);
+			pthread_mutex_unlock(&rb->lock);
+		}
+		return 1;
+	}
+	if (watermark == 0 || watermark > size)
+		watermark = size / 2;
+
+	pthread_mutex_lock(&rb->lock);
+	if (rb->size != size && !rb->refilling)
+		pkcs11_rand_resize(rb, size);
+	served = rb->size > 0 && pkcs11_rand_take(rb, r, len) == 0;
+	if (rb->size > 0 && !rb->refilling && rb->count < watermark) {
+		rb->refilling = refill = 1;
+		rb->slot = slot;
+	}
+	pthread_mutex_unlock(&rb->lock);
+
+	if (refill && pkcs11_task_submit(ctx, &rb->task)) {
+		/* No worker thread, so the caller waits for the refill */
+		pkcs11_rand_refill(&rb->task);
+		if (!served) {
+			pthread_mutex_lock(&rb->lock);
+			served = rb->size > 0 && pkcs11_rand_take(rb, r, len) == 0;
+			pthread_mutex_unlock(&rb->lock);
+		}
+	}
+	return served ? 0 : 1;
+}
+
+/* vim: set noexpandtab: */
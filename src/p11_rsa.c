@@ -26,6 +26,7 @@
 #include <string.h>
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
+#include <openssl/objects.h>
 
 static int rsa_ex_index = 0;
 
@@ -78,41 +79,29 @@ int pkcs11_private_encrypt(int flen,
 		const unsigned char *from, unsigned char *to,
 		PKCS11_KEY *key, int padding)
 {
-	PKCS11_SLOT *slot = KEY2SLOT(key);
-	PKCS11_CTX *ctx = KEY2CTX(key);
-	PKCS11_KEY_private *kpriv = PRIVKEY(key);
 	CK_MECHANISM mechanism;
 	CK_ULONG size;
-	CK_SESSION_HANDLE session;
-	int rv;
-
-	size = pkcs11_get_key_size(key);
+	int op = PKCS11_OP_SIGN;
+	CK_RV rv;
 
 	if (pkcs11_mechanism(&mechanism, padding) < 0)
 		return -1;
+	size = pkcs11_get_key_size(key);
 
-	if (pkcs11_get_session(slot, 0, &session))
-		return -1;
-
-	/* Try signing first, as applications are more likely to use it */
-	rv = CRYPTOKI_call(ctx,
-		C_SignInit(session, &mechanism, kpriv->object));
-	if (!rv && kpriv->always_authenticate == CK_TRUE)
-		rv = pkcs11_authenticate(key, session);
-	if (!rv)
-		rv = CRYPTOKI_call(ctx,
-			C_Sign(session, (CK_BYTE *)from, flen, to, &size));
-	if (rv == CKR_KEY_FUNCTION_NOT_PERMITTED) {
+	/* Sign, as applications are more likely to use it, unless the key
+	 * attributes or the token mechanisms only permit the encryption */
+	if (pkcs11_check_key_op(key, PKCS11_OP_SIGN, mechanism.mechanism) &&
+			!pkcs11_check_key_op(key, PKCS11_OP_ENCRYPT,
+				mechanism.mechanism))
+		op = PKCS11_OP_ENCRYPT;
+	rv = pkcs11_private_op(key, op, &mechanism,
+		from, flen, to, &size);
+	if (op == PKCS11_OP_SIGN && rv == CKR_KEY_FUNCTION_NOT_PERMITTED) {
 		/* OpenSSL may use it for encryption rather than signing */
-		rv = CRYPTOKI_call(ctx,
-			C_EncryptInit(session, &mechanism, kpriv->object));
-		if (!rv && kpriv->always_authenticate == CK_TRUE)
-			rv = pkcs11_authenticate(key, session);
-		if (!rv)
-			rv = CRYPTOKI_call(ctx,
-				C_Encrypt(session, (CK_BYTE *)from, flen, to, &size));
+		size = pkcs11_get_key_size(key);
+		rv = pkcs11_private_op(key, PKCS11_OP_ENCRYPT, &mechanism,
+			from, flen, to, &size);
 	}
-	pkcs11_put_session(slot, session);
 
 	if (rv) {
 		CKRerr(CKR_F_PKCS11_PRIVATE_ENCRYPT, rv);
@@ -126,10 +115,6 @@ int pkcs11_private_encrypt(int flen,
 int pkcs11_private_decrypt(int flen, const unsigned char *from, unsigned char *to,
 		PKCS11_KEY *key, int padding)
 {
-	PKCS11_SLOT *slot = KEY2SLOT(key);
-	PKCS11_CTX *ctx = KEY2CTX(key);
-	PKCS11_KEY_private *kpriv = PRIVKEY(key);
-	CK_SESSION_HANDLE session;
 	CK_MECHANISM mechanism;
 	CK_ULONG size = flen;
 	CK_RV rv;
@@ -137,18 +122,8 @@ int pkcs11_private_decrypt(int flen, const unsigned char *from, unsigned char *t
 	if (pkcs11_mechanism(&mechanism, padding) < 0)
 		return -1;
 
-	if (pkcs11_get_session(slot, 0, &session))
-		return -1;
-
-	rv = CRYPTOKI_call(ctx,
-		C_DecryptInit(session, &mechanism, kpriv->object));
-	if (!rv && kpriv->always_authenticate == CK_TRUE)
-		rv = pkcs11_authenticate(key, session);
-	if (!rv)
-		rv = CRYPTOKI_call(ctx,
-			C_Decrypt(session, (CK_BYTE *)from, size,
-				(CK_BYTE_PTR)to, &size));
-	pkcs11_put_session(slot, session);
+	rv = pkcs11_private_op(key, PKCS11_OP_DECRYPT, &mechanism,
+		from, size, to, &size);
 
 	if (rv) {
 		CKRerr(CKR_F_PKCS11_PRIVATE_DECRYPT, rv);
@@ -158,20 +133,92 @@ int pkcs11_private_decrypt(int flen, const unsigned char *from, unsigned char *t
 	return size;
 }
 
-/* TODO: remove this function in libp11 0.5.0 */
+/* DER-encoded DigestInfo of a PKCS#1 v1.5 signature */
+int pkcs11_digest_info(int type, const unsigned char *m,
+		unsigned int m_len, unsigned char **der)
+{
+	ASN1_OBJECT *obj = OBJ_nid2obj(type);
+	ASN1_OCTET_STRING *digest;
+	X509_ALGOR *algor;
+	X509_SIG *sig;
+	int len = -1;
+
+	if (type == NID_undef || !obj)
+		return -1;
+	sig = X509_SIG_new();
+	if (!sig)
+		return -1;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+	X509_SIG_getm(sig, &algor, &digest);
+#else
+	algor = sig->algor;
+	digest = sig->digest;
+#endif
+	if (X509_ALGOR_set0(algor, obj, V_ASN1_NULL, NULL) &&
+			ASN1_OCTET_STRING_set(digest, m, (int)m_len)) {
+		*der = NULL;
+		len = i2d_X509_SIG(sig, der);
+	}
+	X509_SIG_free(sig);
+	return len;
+}
+
+/* PKCS#1 v1.5 RSA signature verification with C_Verify() */
+static int pkcs11_verify_rsa_token(int type,
+		const unsigned char *m, unsigned int m_len,
+		unsigned char *signature, unsigned int siglen, PKCS11_KEY *key)
+{
+	CK_MECHANISM mechanism;
+	unsigned char *der;
+	int len, rv;
+
+	memset(&mechanism, 0, sizeof(CK_MECHANISM));
+	mechanism.mechanism = CKM_RSA_PKCS;
+
+	/* The TLS 1.0 MD5+SHA1 digest is signed without a DigestInfo */
+	if (type == NID_md5_sha1)
+		return pkcs11_verify_token(key, &mechanism, m, m_len,
+			signature, siglen);
+
+	len = pkcs11_digest_info(type, m, m_len, &der);
+	if (len <= 0) {
+		P11err(P11_F_PKCS11_VERIFY, P11_R_NOT_SUPPORTED);
+		return -1;
+	}
+	rv = pkcs11_verify_token(key, &mechanism, der, len, signature, siglen);
+	OPENSSL_free(der);
+	return rv;
+}
+
+/*
+ * Verify a PKCS#1 v1.5 RSA or an ECDSA signature
+ * The signature is verified by OpenSSL with the public key components
+ * cached in the EVP_PKEY object of the key, unless token-side
+ * verification was requested with pkcs11_CTX_set_token_verify().
+ * Returns 1 for a valid signature, 0 for an invalid one, or -1 on error
+ */
 int pkcs11_verify(int type, const unsigned char *m, unsigned int m_len,
 		unsigned char *signature, unsigned int siglen, PKCS11_KEY *key)
 {
-	(void)type;
-	(void)m;
-	(void)m_len;
-	(void)signature;
-	(void)siglen;
-	(void)key;
+	RSA *rsa;
 
-	/* PKCS11 calls go here */
-	P11err(P11_F_PKCS11_VERIFY, P11_R_NOT_SUPPORTED);
-	return -1;
+	switch (pkcs11_get_key_type(key)) {
+	case EVP_PKEY_RSA:
+		break;
+	case EVP_PKEY_EC:
+		return pkcs11_ecdsa_verify(m, m_len, signature, siglen, key);
+	default:
+		P11err(P11_F_PKCS11_VERIFY, P11_R_NOT_SUPPORTED);
+		return -1;
+	}
+
+	if (PRIVCTX(KEY2CTX(key))->token_verify)
+		return pkcs11_verify_rsa_token(type, m, m_len,
+			signature, siglen, key);
+	rsa = pkcs11_rsa(key);
+	if (!rsa)
+		return -1;
+	return RSA_verify(type, m, m_len, signature, siglen, rsa) == 1;
 }
 
 /*
@@ -179,11 +226,13 @@ int pkcs11_verify(int type, const unsigned char *m, unsigned int m_len,
  */
 static RSA *pkcs11_get_rsa(PKCS11_KEY *key)
 {
-	PKCS11_CTX *ctx = KEY2CTX(key);
 	PKCS11_SLOT *slot = KEY2SLOT(key);
 	PKCS11_KEY *keys;
-	CK_OBJECT_HANDLE object = PRIVKEY(key)->object;
 	CK_SESSION_HANDLE session;
+	CK_ATTRIBUTE attrs[] = {
+		{CKA_MODULUS, NULL, 0},
+		{CKA_PUBLIC_EXPONENT, NULL, 0}
+	};
 	RSA *rsa;
 	unsigned int i, count;
 	BIGNUM *rsa_n = NULL, *rsa_e = NULL;
@@ -191,32 +240,40 @@ static RSA *pkcs11_get_rsa(PKCS11_KEY *key)
 	if (pkcs11_get_session(slot, 0, &session))
 		return NULL;
 
-	/* Retrieve the modulus */
-	if (pkcs11_getattr_bn(ctx, session, object, CKA_MODULUS, &rsa_n))
+	/* Retrieve the modulus and the public exponent */
+	if (pkcs11_key_getattr(key, session, attrs, 2))
 		goto failure;
-
-	/* Retrieve the public exponent */
-	if (!pkcs11_getattr_bn(ctx, session, object, CKA_PUBLIC_EXPONENT, &rsa_e)) {
-		if (!BN_is_zero(rsa_e)) /* A valid public exponent */
+	if (pkcs11_attr_bn(&attrs[0], &rsa_n)) {
+		pkcs11_zap_attrs(attrs, 2);
+		goto failure;
+	}
+	if (!pkcs11_attr_bn(&attrs[1], &rsa_e)) {
+		if (!BN_is_zero(rsa_e)) { /* A valid public exponent */
+			pkcs11_zap_attrs(attrs, 2);
 			goto success;
+		}
 		BN_clear_free(rsa_e);
 		rsa_e = NULL;
 	}
+	pkcs11_zap_attrs(attrs, 2);
 
 	/* The public exponent was not found in the private key:
 	 * retrieve it from the corresponding public key */
 	if (!PKCS11_enumerate_public_keys(KEY2TOKEN(key), &keys, &count)) {
 		for (i = 0; i < count; i++) {
 			BIGNUM *pubmod = NULL;
-			if (!pkcs11_getattr_bn(ctx, session, PRIVKEY(&keys[i])->object,
-					CKA_MODULUS, &pubmod)) {
-				int found = BN_cmp(rsa_n, pubmod) == 0;
-				BN_clear_free(pubmod);
-				if (found && !pkcs11_getattr_bn(ctx, session,
-						PRIVKEY(&keys[i])->object,
-						CKA_PUBLIC_EXPONENT, &rsa_e))
-					goto success;
-			}
+			int found;
+
+			if (check_key_fork(&keys[i]) < 0 ||
+					pkcs11_key_getattr(&keys[i], session, attrs, 2))
+				continue;
+			found = !pkcs11_attr_bn(&attrs[0], &pubmod) &&
+				BN_cmp(rsa_n, pubmod) == 0 &&
+				!pkcs11_attr_bn(&attrs[1], &rsa_e);
+			BN_clear_free(pubmod);
+			pkcs11_zap_attrs(attrs, 2);
+			if (found)
+				goto success;
 		}
 	}
 
@@ -226,7 +283,7 @@ static RSA *pkcs11_get_rsa(PKCS11_KEY *key)
 		goto success;
 
 failure:
-	pkcs11_put_session(slot, session);
+	pkcs11_put_session(slot, 0, session);
 	if (rsa_n)
 		BN_clear_free(rsa_n);
 	if (rsa_e)
@@ -234,7 +291,7 @@ failure:
 	return NULL;
 
 success:
-	pkcs11_put_session(slot, session);
+	pkcs11_put_session(slot, 0, session);
 	rsa = RSA_new();
 	if (!rsa)
 		goto failure;
@@ -257,19 +314,24 @@ static void pkcs11_set_ex_data_rsa(RSA *rsa, PKCS11_KEY *key)
 	RSA_set_ex_data(rsa, rsa_ex_index, key);
 }
 
-static void pkcs11_update_ex_data_rsa(PKCS11_KEY *key)
+/*
+ * Precompute the parameters of the private key operations
+ */
+static void pkcs11_set_desc_rsa(PKCS11_KEY *key, RSA *rsa)
 {
-	EVP_PKEY *evp = key->evp_key;
-	RSA *rsa;
-	if (!evp)
-		return;
-	if (EVP_PKEY_base_id(evp) != EVP_PKEY_RSA)
-		return;
+	PKCS11_KEY_DESC *desc = &PRIVKEY(key)->desc;
+	const BIGNUM *rsa_n;
 
-	rsa = EVP_PKEY_get1_RSA(evp);
-	pkcs11_set_ex_data_rsa(rsa, key);
-	RSA_free(rsa);
+#if OPENSSL_VERSION_NUMBER >= 0x10100005L && !defined(LIBRESSL_VERSION_NUMBER)
+	RSA_get0_key(rsa, &rsa_n, NULL, NULL);
+#else
+	rsa_n = rsa->n;
+#endif
+	desc->bits = BN_num_bits(rsa_n);
+	desc->sig_size = RSA_size(rsa);
+	desc->size = desc->sig_size;
 }
+
 /*
  * Build an EVP_PKEY object
  */
@@ -302,6 +364,7 @@ static EVP_PKEY *pkcs11_get_evp_key_rsa(PKCS11_KEY *key)
 	rsa->flags |= RSA_FLAG_SIGN_VER;
 #endif
 	pkcs11_set_ex_data_rsa(rsa, key);
+	pkcs11_set_desc_rsa(key, rsa);
 
 	EVP_PKEY_set1_RSA(pk, rsa); /* Also increments the rsa ref count */
 	RSA_free(rsa); /* Drops our reference to it */
@@ -345,7 +408,11 @@ int pkcs11_get_key_exponent(PKCS11_KEY *key, BIGNUM **bn)
 /* TODO: make this function static in libp11 0.5.0 */
 int pkcs11_get_key_size(PKCS11_KEY *key)
 {
-	RSA *rsa = pkcs11_rsa(key);
+	RSA *rsa;
+
+	if (pkcs11_get_key_type(key) == EVP_PKEY_RSA && PRIVKEY(key)->desc.size)
+		return PRIVKEY(key)->desc.size;
+	rsa = pkcs11_rsa(key);
 	if (!rsa)
 		return 0;
 	return RSA_size(rsa);
@@ -525,8 +592,7 @@ void PKCS11_rsa_method_free(void)
 
 PKCS11_KEY_ops pkcs11_rsa_ops = {
 	EVP_PKEY_RSA,
-	pkcs11_get_evp_key_rsa,
-	pkcs11_update_ex_data_rsa
+	pkcs11_get_evp_key_rsa
 };
 
 /* vim: set noexpandtab: */
@@ -0,0 +1,190 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Multi-part signing with the private keys of a token
+ *
+ * The data is hashed by the token with a hash-and-sign mechanism, so
+ * that it does not need to be kept by the caller until the signature is
+ * computed.  The token keeps the state of the operation in the session,
+ * which is held from pkcs11_sign_init() until the operation is finished.
+ * Replicas of the key are not used.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+
+struct pkcs11_sign_st {
+	PKCS11_TOKEN *token; /* its slot may move to another slot list */
+	CK_SESSION_HANDLE session; /* CK_INVALID_HANDLE once returned */
+	unsigned int forkid;
+	CK_MECHANISM_TYPE mechanism;
+	unsigned long start;
+	int active;
+};
+#define SIGN2SLOT(sign)		TOKEN2SLOT((sign)->token)
+
+/*
+ * Set the maximum number of bytes passed with each C_SignUpdate() call
+ */
+void pkcs11_CTX_set_sign_chunk(PKCS11_CTX *ctx, unsigned int size)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+
+	p11_atomic_store(&cpriv->sign_chunk, size);
+}
+
+/* Record the operation and return the session */
+static void pkcs11_sign_done(PKCS11_SIGN *sign, CK_RV rv)
+{
+	pkcs11_stats_record(SIGN2SLOT(sign), PKCS11_STATS_SIGN,
+		sign->mechanism, rv, sign->start);
+	pkcs11_put_session_rv(SIGN2SLOT(sign), 0, sign->session, rv);
+	sign->session = CK_INVALID_HANDLE;
+	sign->active = 0;
+}
+
+/*
+ * Start a multi-part signature in a session of the slot of the key
+ * Returns the PKCS#11 return value; errors are not reported here, so
+ * that the callers can hash the data themselves instead.
+ */
+CK_RV pkcs11_sign_init(PKCS11_KEY *key, CK_MECHANISM *mechanism,
+		PKCS11_SIGN **signp)
+{
+	PKCS11_SLOT *slot = KEY2SLOT(key);
+	PKCS11_CTX *ctx = SLOT2CTX(slot);
+	PKCS11_SIGN *sign;
+	CK_RV rv;
+
+	*signp = NULL;
+	rv = pkcs11_check_key_op(key, PKCS11_OP_SIGN, mechanism->mechanism);
+	if (rv != CKR_OK)
+		return rv;
+	sign = OPENSSL_malloc(sizeof(PKCS11_SIGN));
+	if (!sign)
+		return CKR_HOST_MEMORY;
+	memset(sign, 0, sizeof(PKCS11_SIGN));
+	sign->token = KEY2TOKEN(key);
+	sign->forkid = get_forkid();
+	sign->mechanism = mechanism->mechanism;
+	if (pkcs11_get_session_class(slot, 0, &sign->session,
+			pkcs11_key_priority(key))) {
+		OPENSSL_free(sign);
+		return CKR_SESSION_COUNT;
+	}
+	sign->start = pkcs11_stats_time();
+	rv = CRYPTOKI_call(ctx,
+		C_SignInit(sign->session, mechanism, PRIVKEY(key)->object));
+	if (rv == CKR_OK && PRIVKEY(key)->always_authenticate == CK_TRUE)
+		rv = pkcs11_authenticate(key, slot, sign->session);
+	if (rv != CKR_OK) {
+		pkcs11_sign_done(sign, rv);
+		OPENSSL_free(sign);
+		return rv;
+	}
+	sign->active = 1;
+	*signp = sign;
+	return CKR_OK;
+}
+
+/*
+ * Pass the next part of the data to the token, in chunks of the size
+ * set with pkcs11_CTX_set_sign_chunk()
+ */
+CK_RV pkcs11_sign_update(PKCS11_SIGN *sign,
+		const unsigned char *in, size_t in_len)
+{
+	PKCS11_CTX *ctx = SLOT2CTX(SIGN2SLOT(sign));
+	size_t chunk = p11_atomic_load(&PRIVCTX(ctx)->sign_chunk);
+	size_t done = 0, n;
+	CK_RV rv = CKR_OK;
+
+	if (!sign->active || sign->forkid != get_forkid())
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (chunk == 0)
+		chunk = in_len;
+	while (done < in_len) {
+		n = in_len - done < chunk ? in_len - done : chunk;
+		rv = CRYPTOKI_call(ctx, C_SignUpdate(sign->session,
+			(CK_BYTE *)in + done, n));
+		if (rv != CKR_OK) {
+			/* The failed call terminated the operation */
+			pkcs11_sign_done(sign, rv);
+			break;
+		}
+		done += n;
+	}
+	return rv;
+}
+
+/*
+ * Finish the signature, which terminates the operation unless the buffer
+ * is too small.  The raw signature of ECDSA is returned as r|s.
+ */
+CK_RV pkcs11_sign_final(PKCS11_SIGN *sign,
+		unsigned char *sig, size_t *sig_len)
+{
+	CK_ULONG len = (CK_ULONG)*sig_len;
+	CK_RV rv;
+
+	if (!sign->active || sign->forkid != get_forkid())
+		return CKR_OPERATION_NOT_INITIALIZED;
+	rv = CRYPTOKI_call(SLOT2CTX(SIGN2SLOT(sign)),
+		C_SignFinal(sign->session, sig, &len));
+	if (rv == CKR_BUFFER_TOO_SMALL)
+		return rv;
+	pkcs11_sign_done(sign, rv);
+	*sig_len = len;
+	return rv;
+}
+
+/*
+ * Terminate the operation in progress, if any, and return the session
+ * PKCS#11 2.x cannot cancel an operation, so the signature is computed and
+ * discarded.  The session is closed if the operation cannot be finished.
+ */
+void pkcs11_sign_free(PKCS11_SIGN *sign)
+{
+	PKCS11_CTX *ctx;
+	unsigned char *buf = NULL;
+	CK_ULONG len = 0;
+	CK_RV rv;
+
+	if (!sign)
+		return;
+	/* The child process only releases the memory */
+	if (sign->active && sign->forkid == get_forkid()) {
+		ctx = SLOT2CTX(SIGN2SLOT(sign));
+		rv = CRYPTOKI_call(ctx, C_SignFinal(sign->session, NULL, &len));
+		if (rv == CKR_OK) {
+			buf = OPENSSL_malloc(len);
+			rv = buf ? CRYPTOKI_call(ctx,
+				C_SignFinal(sign->session, buf, &len)) :
+				CKR_HOST_MEMORY;
+			OPENSSL_free(buf);
+		}
+		if (rv == CKR_BUFFER_TOO_SMALL || rv == CKR_HOST_MEMORY) {
+			CRYPTOKI_call(ctx, C_CloseSession(sign->session));
+			rv = CKR_SESSION_CLOSED;
+		}
+		pkcs11_put_session_rv(SIGN2SLOT(sign), 0, sign->session, rv);
+	}
+	OPENSSL_free(sign);
+}
+
+/* vim: set noexpandtab: */
@@ -19,12 +19,23 @@
 
 #include "libp11-int.h"
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <openssl/buffer.h>
 
+static int pkcs11_init_session_pool(PKCS11_SESSION_POOL *, unsigned int);
+static void pkcs11_release_session_pool(PKCS11_SESSION_POOL *);
 static int pkcs11_init_slot(PKCS11_CTX *, PKCS11_SLOT *, CK_SLOT_ID);
 static void pkcs11_release_slot(PKCS11_CTX *, PKCS11_SLOT *);
 static int pkcs11_check_token(PKCS11_CTX *, PKCS11_SLOT *);
+static int pkcs11_new_token(PKCS11_CTX *, PKCS11_SLOT *, int);
+static void pkcs11_set_token_info(PKCS11_SLOT *, CK_TOKEN_INFO *);
+static void pkcs11_set_token_flags(PKCS11_TOKEN *, CK_FLAGS);
+static int pkcs11_refresh_slot(PKCS11_CTX *, PKCS11_SLOT *, unsigned int,
+	PKCS11_SLOT *);
+static int pkcs11_load_token_info_locked(PKCS11_SLOT *);
 static void pkcs11_destroy_token(PKCS11_TOKEN *);
+static void pkcs11_free_mechanisms_locked(PKCS11_SLOT_private *);
 
 /*
  * Get slotid from private
@@ -36,31 +47,152 @@ unsigned long pkcs11_get_slotid_from_slot(PKCS11_SLOT *slot)
 	return spriv->id;
 }
 
+/* Upper limit of the number of slots initialized concurrently */
+#define PKCS11_MAX_ENUM_LANES 32
+
+typedef struct pkcs11_enum_slots {
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots;
+	CK_SLOT_ID *slotid;
+	unsigned int count;
+	unsigned int next; /* next slot to be initialized */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int running; /* lanes submitted to the worker threads */
+} PKCS11_ENUM_SLOTS;
+
+typedef struct pkcs11_enum_lane {
+	PKCS11_TASK task;
+	PKCS11_ENUM_SLOTS *enum_slots;
+} PKCS11_ENUM_LANE;
+
 /*
- * Enumerate slots
+ * Initialize the pending slots
+ * The slots failing here are left empty, and initialized again by the
+ * calling thread so that the errors are reported in its error queue.
  */
-int pkcs11_enumerate_slots(PKCS11_CTX *ctx, PKCS11_SLOT **slotp,
-		unsigned int *countp)
+static void pkcs11_enum_slots_lane(PKCS11_ENUM_SLOTS *e)
+{
+	unsigned int i;
+
+	while ((i = p11_atomic_add(&e->next, 1) - 1) < e->count)
+		pkcs11_init_slot(e->ctx, e->slots + i, e->slotid[i]);
+}
+
+static void pkcs11_enum_slots_run(PKCS11_TASK *task)
+{
+	PKCS11_ENUM_SLOTS *e = ((PKCS11_ENUM_LANE *)task)->enum_slots;
+
+	pkcs11_enum_slots_lane(e);
+	ERR_clear_error(); /* Only the calling thread reports errors */
+	pthread_mutex_lock(&e->lock);
+	if (--e->running == 0)
+		pthread_cond_signal(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+}
+
+/*
+ * Initialize the slots concurrently with the context worker threads
+ */
+static void pkcs11_enum_slots_parallel(PKCS11_CTX *ctx, PKCS11_SLOT *slots,
+		CK_SLOT_ID *slotid, unsigned int count, unsigned int threads)
+{
+	PKCS11_ENUM_SLOTS e;
+	PKCS11_ENUM_LANE lanes[PKCS11_MAX_ENUM_LANES];
+	unsigned int i;
+
+	if (threads > PKCS11_MAX_ENUM_LANES)
+		threads = PKCS11_MAX_ENUM_LANES;
+	if (threads > count)
+		threads = count;
+
+	memset(&e, 0, sizeof(e));
+	e.ctx = ctx;
+	e.slots = slots;
+	e.slotid = slotid;
+	e.count = count;
+	pthread_mutex_init(&e.lock, 0);
+	pthread_cond_init(&e.cond, 0);
+
+	/* The calling thread is also one of the lanes */
+	for (i = 1; i < threads; i++) {
+		lanes[i].task.run = pkcs11_enum_slots_run;
+		lanes[i].enum_slots = &e;
+		pthread_mutex_lock(&e.lock);
+		e.running++;
+		pthread_mutex_unlock(&e.lock);
+		if (pkcs11_task_submit(ctx, &lanes[i].task) < 0) {
+			pthread_mutex_lock(&e.lock);
+			e.running--;
+			pthread_mutex_unlock(&e.lock);
+			break;
+		}
+	}
+	ERR_set_mark();
+	pkcs11_enum_slots_lane(&e);
+	ERR_pop_to_mark();
+
+	pthread_mutex_lock(&e.lock);
+	while (e.running)
+		pthread_cond_wait(&e.cond, &e.lock);
+	pthread_mutex_unlock(&e.lock);
+	pthread_mutex_destroy(&e.lock);
+	pthread_cond_destroy(&e.cond);
+}
+
+/*
+ * Get the IDs of the slots selected by pkcs11_CTX_set_enum_flags()
+ */
+static int pkcs11_get_slot_list(PKCS11_CTX *ctx, int function,
+		CK_SLOT_ID **slotidp, CK_ULONG *nslotsp)
 {
 	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+	CK_BBOOL present = (cpriv->enum_flags & PKCS11_ENUM_TOKEN_PRESENT) ?
+		CK_TRUE : CK_FALSE;
 	CK_SLOT_ID *slotid;
-	CK_ULONG nslots, n;
-	PKCS11_SLOT *slots;
+	CK_ULONG nslots;
 	size_t alloc_size;
 	int rv;
 
-	rv = cpriv->method->C_GetSlotList(FALSE, NULL_PTR, &nslots);
-	CRYPTOKI_checkerr(CKR_F_PKCS11_ENUMERATE_SLOTS, rv);
+	rv = cpriv->method->C_GetSlotList(present, NULL_PTR, &nslots);
+	CRYPTOKI_checkerr(function, rv);
 
-	alloc_size = nslots * sizeof(CK_SLOT_ID);
-	if (alloc_size / sizeof(CK_SLOT_ID) != nslots) /* integer overflow */
+	alloc_size = (nslots + 1) * sizeof(CK_SLOT_ID);
+	if (alloc_size / sizeof(CK_SLOT_ID) != nslots + 1) /* integer overflow */
 		return -1;
 	slotid = OPENSSL_malloc(alloc_size);
 	if (!slotid)
 		return -1;
 
-	rv = cpriv->method->C_GetSlotList(FALSE, slotid, &nslots);
-	CRYPTOKI_checkerr(CKR_F_PKCS11_ENUMERATE_SLOTS, rv);
+	rv = cpriv->method->C_GetSlotList(present, slotid, &nslots);
+	if (rv) {
+		OPENSSL_free(slotid);
+		CKRerr(function, rv);
+		return -1;
+	}
+	*slotidp = slotid;
+	*nslotsp = nslots;
+	return 0;
+}
+
+/*
+ * Enumerate slots
+ * With pkcs11_CTX_set_enum_threads() the slots are initialized
+ * concurrently, and pkcs11_CTX_set_enum_flags() selects the slots
+ * and the token information retrieved here.
+ */
+int pkcs11_enumerate_slots(PKCS11_CTX *ctx, PKCS11_SLOT **slotp,
+		unsigned int *countp)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+	CK_SLOT_ID *slotid;
+	CK_ULONG nslots, n;
+	PKCS11_SLOT *slots;
+	size_t alloc_size;
+
+	if (pkcs11_get_slot_list(ctx, CKR_F_PKCS11_ENUMERATE_SLOTS,
+			&slotid, &nslots))
+		return -1;
 
 	alloc_size = nslots * sizeof(PKCS11_SLOT);
 	if (alloc_size / sizeof(PKCS11_SLOT) != nslots) { /* integer overflow */
@@ -74,10 +206,16 @@ int pkcs11_enumerate_slots(PKCS11_CTX *ctx, PKCS11_SLOT **slotp,
 	}
 
 	memset(slots, 0, nslots * sizeof(PKCS11_SLOT));
+	if (cpriv->enum_threads > 1 && nslots > 1)
+		pkcs11_enum_slots_parallel(ctx, slots, slotid, nslots,
+			cpriv->enum_threads);
 	for (n = 0; n < nslots; n++) {
+		if (slots[n]._private) /* Initialized by the worker threads */
+			continue;
 		if (pkcs11_init_slot(ctx, &slots[n], slotid[n])) {
-			while (n--)
-				pkcs11_release_slot(ctx, slots + n);
+			for (n = 0; n < nslots; n++)
+				if (slots[n]._private)
+					pkcs11_release_slot(ctx, slots + n);
 			OPENSSL_free(slotid);
 			OPENSSL_free(slots);
 			return -1;
@@ -94,6 +232,205 @@ int pkcs11_enumerate_slots(PKCS11_CTX *ctx, PKCS11_SLOT **slotp,
 	return 0;
 }
 
+/* Index of the slot with this ID, or nslots if there is none */
+static unsigned int pkcs11_find_slot_id(PKCS11_SLOT *slots,
+		unsigned int nslots, CK_SLOT_ID id)
+{
+	unsigned int i;
+
+	for (i = 0; i < nslots; i++)
+		if (PRIVSLOT(slots + i)->id == id)
+			break;
+	return i;
+}
+
+/*
+ * Keep a replaced slot list, as the calls in progress may still read
+ * its slots through the parent of their token
+ * Only the PKCS11_RETIRED_SLOT_LISTS most recent lists are kept, since
+ * nothing refers to the slots of a list for longer than a call: the
+ * replicas are moved with their slots, and the ciphers, the multi-part
+ * signatures and the queued tasks look up the slot of their token.
+ * The fork_lock of the context is held by the caller.
+ */
+static void pkcs11_retire_slots(PKCS11_CTX_private *cpriv,
+		PKCS11_RETIRED_SLOTS *retired, PKCS11_SLOT *slots)
+{
+	PKCS11_RETIRED_SLOTS **prev, *old;
+	unsigned int n = 0;
+
+	retired->slots = slots;
+	retired->next = cpriv->retired_slots;
+	cpriv->retired_slots = retired;
+	for (prev = &cpriv->retired_slots; *prev &&
+			n < PKCS11_RETIRED_SLOT_LISTS; prev = &(*prev)->next)
+		n++;
+	while ((old = *prev) != NULL) {
+		*prev = old->next;
+		OPENSSL_free(old->slots);
+		OPENSSL_free(old);
+	}
+}
+
+/*
+ * Move the slots to a new list after slots appeared or disappeared
+ * The new slots are initialized first, so that the list is left
+ * unchanged when one of them fails.  The replicas of the keys are
+ * moved with their slots, and dropped when their slot disappeared.
+ */
+static int pkcs11_replace_slots(PKCS11_CTX *ctx, PKCS11_SLOT **slotsp,
+		unsigned int *nslotsp, CK_SLOT_ID *slotid, CK_ULONG count)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+	PKCS11_SLOT *slots = *slotsp, *new_slots;
+	PKCS11_RETIRED_SLOTS *retired;
+	unsigned int nslots = *nslotsp, i;
+	unsigned int *from; /* index in the previous list, nslots if new */
+	unsigned char *kept;
+	int changed = 0, failed = 0, rv;
+	CK_ULONG n, m;
+
+	if ((count + 1) * sizeof(PKCS11_SLOT) / sizeof(PKCS11_SLOT) != count + 1)
+		return -1; /* integer overflow */
+	new_slots = OPENSSL_malloc((count + 1) * sizeof(PKCS11_SLOT));
+	from = OPENSSL_malloc((count + 1) * sizeof(unsigned int));
+	kept = OPENSSL_malloc(nslots + 1);
+	retired = OPENSSL_malloc(sizeof(PKCS11_RETIRED_SLOTS));
+	if (!new_slots || !from || !kept || !retired)
+		goto fail;
+	memset(new_slots, 0, count * sizeof(PKCS11_SLOT));
+	memset(kept, 0, nslots);
+
+	for (n = 0; n < count; n++) {
+		from[n] = pkcs11_find_slot_id(slots, nslots, slotid[n]);
+		if (from[n] < nslots)
+			continue;
+		if (pkcs11_init_slot(ctx, new_slots + n, slotid[n])) {
+			for (m = 0; m < n; m++)
+				if (new_slots[m]._private)
+					pkcs11_release_slot(ctx, new_slots + m);
+			goto fail;
+		}
+		changed++;
+	}
+
+	for (n = 0; n < count; n++) {
+		if (from[n] == nslots)
+			continue;
+		new_slots[n] = slots[from[n]];
+		kept[from[n]] = 1;
+		if (new_slots[n].token)
+			PRIVTOKEN(new_slots[n].token)->parent = new_slots + n;
+	}
+
+	pthread_mutex_lock(&cpriv->fork_lock);
+	for (n = 0; n < count; n++)
+		if (from[n] < nslots)
+			pkcs11_move_replicas(new_slots, count,
+				slots + from[n], new_slots + n);
+	for (i = 0; i < nslots; i++)
+		if (!kept[i])
+			pkcs11_move_replicas(new_slots, count, slots + i, NULL);
+	pthread_mutex_unlock(&cpriv->fork_lock);
+
+	for (i = 0; i < nslots; i++) {
+		if (!kept[i]) {
+			pkcs11_release_slot(ctx, slots + i);
+			changed++;
+		}
+	}
+
+	pthread_mutex_lock(&cpriv->fork_lock);
+	if (cpriv->fork_slots == slots) {
+		cpriv->fork_slots = new_slots;
+		cpriv->fork_nslots = count;
+	}
+	pkcs11_retire_slots(cpriv, retired, slots);
+	pthread_mutex_unlock(&cpriv->fork_lock);
+	*slotsp = new_slots;
+	*nslotsp = count;
+
+	for (n = 0; n < count; n++) {
+		if (from[n] == nslots)
+			continue;
+		rv = pkcs11_refresh_slot(ctx, new_slots, count, new_slots + n);
+		if (rv < 0)
+			failed = 1;
+		else
+			changed += rv;
+	}
+	OPENSSL_free(from);
+	OPENSSL_free(kept);
+	return failed ? -1 : changed;
+
+fail:
+	OPENSSL_free(new_slots);
+	OPENSSL_free(from);
+	OPENSSL_free(kept);
+	OPENSSL_free(retired);
+	return -1;
+}
+
+/*
+ * Update a list of slots after tokens were inserted, removed or replaced
+ * The list is only reallocated when the slot IDs changed.
+ */
+int pkcs11_update_slots(PKCS11_CTX *ctx, PKCS11_SLOT **slotsp,
+		unsigned int *nslotsp)
+{
+	PKCS11_SLOT *slots = *slotsp;
+	CK_SLOT_ID *slotid;
+	CK_ULONG count, n;
+	int changed = 0, failed = 0, rv;
+
+	if (!slots) {
+		if (pkcs11_enumerate_slots(ctx, slotsp, nslotsp))
+			return -1;
+		return (int)*nslotsp;
+	}
+
+	if (pkcs11_get_slot_list(ctx, CKR_F_PKCS11_UPDATE_SLOTS,
+			&slotid, &count))
+		return -1;
+
+	for (n = 0; n < count && n < *nslotsp; n++)
+		if (PRIVSLOT(slots + n)->id != slotid[n])
+			break;
+	if (n < count || count != *nslotsp) {
+		rv = pkcs11_replace_slots(ctx, slotsp, nslotsp, slotid, count);
+		OPENSSL_free(slotid);
+		return rv;
+	}
+
+	/* Same slots: only reinitialize the changed tokens */
+	for (n = 0; n < count; n++) {
+		rv = pkcs11_refresh_slot(ctx, slots, count, slots + n);
+		if (rv < 0)
+			failed = 1;
+		else
+			changed += rv;
+	}
+	OPENSSL_free(slotid);
+	return failed ? -1 : changed;
+}
+
+/*
+ * Check for a slot event without blocking
+ */
+int pkcs11_get_slot_event(PKCS11_CTX *ctx, unsigned long *slotid)
+{
+	CK_SLOT_ID id;
+	int rv;
+
+	rv = CRYPTOKI_call(ctx, C_WaitForSlotEvent(CKF_DONT_BLOCK, &id, NULL_PTR));
+	if (rv == CKR_NO_EVENT)
+		return 0;
+	CRYPTOKI_checkerr(CKR_F_PKCS11_GET_SLOT_EVENT, rv);
+	if (slotid)
+		*slotid = id;
+	return 1;
+}
+
 /*
  * Find a slot with a token that looks "valuable"
  */
@@ -111,6 +448,8 @@ PKCS11_SLOT *pkcs11_find_token(PKCS11_CTX *ctx, PKCS11_SLOT *slots,
 
 	best = NULL;
 	for (n = 0, slot = slots; n < nslots; n++, slot++) {
+		if (pkcs11_load_token_info(slot))
+			continue;
 		if ((tok = slot->token) != NULL) {
 			if (!best ||
 					(tok->initialized > best->token->initialized &&
@@ -144,6 +483,143 @@ PKCS11_SLOT *pkcs11_find_next_token(PKCS11_CTX *ctx, PKCS11_SLOT *slots,
 	return pkcs11_find_token(ctx, slots + offset, nslots - offset);
 }
 
+/*
+ * Per-thread index used to select the preferred session cache entry
+ */
+static unsigned int pkcs11_thread_index(void)
+{
+	static unsigned int next_index = 0;
+	static P11_THREAD_LOCAL unsigned int thread_index = 0;
+
+	if (!thread_index)
+		thread_index = p11_atomic_add(&next_index, 1);
+	return thread_index - 1;
+}
+
+/* PKCS11_PRIORITY_xxx class of the operations of the thread */
+static P11_THREAD_LOCAL int thread_priority = PKCS11_PRIORITY_NORMAL;
+
+/*
+ * Set the priority class of the operations of the calling thread
+ * Returns the previous class, or -1 if the class is invalid
+ */
+int pkcs11_set_thread_priority(int priority)
+{
+	int prev = thread_priority;
+
+	if (priority < 0 || priority >= PKCS11_PRIORITIES)
+		return -1;
+	thread_priority = priority;
+	return prev;
+}
+
+int pkcs11_get_thread_priority(void)
+{
+	return thread_priority;
+}
+
+/*
+ * Find the tag of a session opened by pkcs11_open_pool_session()
+ * The entries are looked up without locking: an entry is never moved
+ * or emptied, and the entry of a session is only changed by the thread
+ * holding the session.
+ * Returns NULL if the session has no tag.
+ */
+static PKCS11_SESSION_TAG *pkcs11_session_tag(PKCS11_SLOT_private *spriv,
+		CK_SESSION_HANDLE session)
+{
+	PKCS11_SESSION_TAG *tag;
+	CK_SESSION_HANDLE handle;
+	unsigned int i, n;
+
+	i = session % PKCS11_SESSION_TAGS;
+	for (n = 0; n < PKCS11_SESSION_TAGS; n++) {
+		tag = spriv->tags + i;
+		handle = p11_atomic_load(&tag->session);
+		if (handle == session)
+			return tag;
+		if (handle == CK_INVALID_HANDLE)
+			return NULL;
+		i = (i + 1) % PKCS11_SESSION_TAGS;
+	}
+	return NULL;
+}
+
+/*
+ * Record the pool of a new session and the generation of the pools it
+ * was opened in, in the entry of a previous session with the same
+ * handle, or in the first entry no longer used
+ * The slot lock is held by the caller.
+ * Returns 0 on success, or -1 if all the entries are used.
+ */
+static int pkcs11_tag_session(PKCS11_SLOT_private *spriv,
+		CK_SESSION_HANDLE session, PKCS11_SESSION_POOL *pool,
+		unsigned int generation)
+{
+	PKCS11_SESSION_TAG *tag;
+	unsigned int i, n;
+
+	tag = pkcs11_session_tag(spriv, session);
+	i = session % PKCS11_SESSION_TAGS;
+	for (n = 0; !tag && n < PKCS11_SESSION_TAGS; n++) {
+		if (spriv->tags[i].session == CK_INVALID_HANDLE ||
+				spriv->tags[i].pool < 0)
+			tag = spriv->tags + i;
+		i = (i + 1) % PKCS11_SESSION_TAGS;
+	}
+	if (!tag)
+		return -1;
+	tag->pool = (int)(pool - spriv->pools);
+	tag->generation = generation;
+	p11_atomic_store(&tag->session, session);
+	return 0;
+}
+
+/* Mark the tag of a session closed, so that its entry can be reused
+ * The slot lock is held by the caller. */
+static void pkcs11_untag_session(PKCS11_SLOT_private *spriv,
+		CK_SESSION_HANDLE session)
+{
+	PKCS11_SESSION_TAG *tag = pkcs11_session_tag(spriv, session);
+
+	if (tag)
+		tag->pool = -1;
+}
+
+/* Whether a session was opened before the pools were last flushed */
+static int pkcs11_session_stale(PKCS11_SLOT_private *spriv,
+		PKCS11_SESSION_TAG *tag)
+{
+	return tag->generation != p11_atomic_load(&spriv->generation);
+}
+
+/*
+ * Forget all the pooled sessions
+ * The sessions in use are no longer counted in their pools either, so
+ * the generation of the pools is bumped for pkcs11_put_session() and
+ * pkcs11_put_session_rv() to recognize them when they are returned.
+ */
+static void pkcs11_flush_sessions(PKCS11_SLOT_private *spriv)
+{
+	PKCS11_SESSION_POOL *pool;
+	CK_SESSION_HANDLE session;
+	unsigned int i;
+
+	for (pool = spriv->pools; pool < spriv->pools + 2; pool++) {
+		for (i = 0; i < pool->cachesize; i++) {
+			session = p11_atomic_xchg(&pool->cache[i],
+				CK_INVALID_HANDLE);
+			if (session != CK_INVALID_HANDLE)
+				pkcs11_untag_session(spriv, session);
+		}
+		for (i = pool->head; i != pool->tail; i = (i + 1) % pool->size)
+			pkcs11_untag_session(spriv, pool->sessions[i]);
+		pool->num_sessions = 0;
+		pool->head = pool->tail = 0;
+	}
+	p11_atomic_add(&spriv->generation, 1);
+}
+
 /*
  * Open a session with this slot
  */
@@ -158,73 +634,703 @@ int pkcs11_open_session(PKCS11_SLOT *slot, int rw)
 		CRYPTOKI_call(ctx, C_CloseAllSessions(spriv->id));
 		spriv->rw_mode = rw;
 	}
-	spriv->num_sessions = 0;
-	spriv->session_head = spriv->session_tail = 0;
+	pkcs11_flush_sessions(spriv);
 	pthread_mutex_unlock(&spriv->lock);
 
 	return 0;
 }
 
-int pkcs11_get_session(PKCS11_SLOT * slot, int rw, CK_SESSION_HANDLE *sessionp)
+/* Absolute time after the timeout in milliseconds */
+static void pkcs11_get_deadline(struct timespec *deadline, long timeout)
+{
+#ifdef _WIN32
+	timespec_get(deadline, TIME_UTC);
+#else
+	clock_gettime(CLOCK_REALTIME, deadline);
+#endif
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ * Number of sessions of the pool that can be acquired without waiting:
+ * the idle sessions, including the ones cached for the threads, and the
+ * sessions that can still be opened.  The slot lock is held by the caller.
+ */
+static unsigned int pkcs11_session_available(PKCS11_SESSION_POOL *pool)
+{
+	unsigned int i, n;
+
+	n = (pool->tail + pool->size - pool->head) % pool->size;
+	if (pool->num_sessions < pool->max_sessions)
+		n += pool->max_sessions - pool->num_sessions;
+	for (i = 0; i < pool->cachesize; i++)
+		if (p11_atomic_load(&pool->cache[i]) != CK_INVALID_HANDLE)
+			n++;
+	return n;
+}
+
+/* Check whether an operation of the class may use one of the available
+ * sessions without taking a session reserved for PKCS11_PRIORITY_HIGH */
+static int pkcs11_session_allowed(PKCS11_SLOT_private *spriv,
+		PKCS11_SESSION_POOL *pool, int priority, unsigned int available)
+{
+	unsigned int reserve;
+
+	reserve = p11_atomic_load(&PRIVCTX(spriv->parent)->session_reserve);
+	if (priority == PKCS11_PRIORITY_HIGH || !reserve)
+		return available > 0;
+	/* At least one session remains usable by all the classes */
+	if (reserve >= pool->max_sessions)
+		reserve = pool->max_sessions ? pool->max_sessions - 1 : 0;
+	return available > reserve;
+}
+
+/*
+ * Select the class of the waiters served next: the highest class with
+ * waiters allowed to use the available sessions, unless a lower class
+ * has already been bypassed starvation_limit times.
+ * Returns PKCS11_PRIORITIES when no waiter can be served, and sets
+ * *starved when the selected class was bypassed too many times.
+ */
+static int pkcs11_session_turn(PKCS11_SLOT_private *spriv,
+		PKCS11_SESSION_POOL *pool, unsigned int available, int *starved)
+{
+	unsigned int limit;
+	int p, turn = PKCS11_PRIORITIES;
+
+	limit = p11_atomic_load(&PRIVCTX(spriv->parent)->starvation_limit);
+	*starved = 0;
+	for (p = PKCS11_PRIORITIES - 1; p >= 0; p--) {
+		if (!pool->queued[p] ||
+				!pkcs11_session_allowed(spriv, pool, p, available))
+			continue;
+		if (pool->bypassed[p] >= limit) {
+			*starved = 1;
+			return p;
+		}
+		turn = p;
+	}
+	return turn;
+}
+
+/* Check whether an operation of the class may acquire a session now,
+ * rather than wait for the waiters of the other classes to be served */
+static int pkcs11_session_may_take(PKCS11_SLOT_private *spriv,
+		PKCS11_SESSION_POOL *pool, int priority)
+{
+	unsigned int available = pkcs11_session_available(pool);
+	int turn, starved;
+
+	if (!pkcs11_session_allowed(spriv, pool, priority, available))
+		return 0;
+	turn = pkcs11_session_turn(spriv, pool, available, &starved);
+	return turn == PKCS11_PRIORITIES || turn == priority ||
+		(priority < turn && !starved);
+}
+
+/* Remove a waiter from the queue of its class */
+static void pkcs11_session_dequeue(PKCS11_SESSION_POOL *pool, int priority,
+		int queued)
+{
+	if (queued && --pool->queued[priority] == 0)
+		pool->bypassed[priority] = 0;
+}
+
+/* Account for a session acquired by an operation of the class */
+static void pkcs11_session_granted(PKCS11_SESSION_POOL *pool, int priority)
+{
+	int p;
+
+	pool->bypassed[priority] = 0;
+	for (p = priority + 1; p < PKCS11_PRIORITIES; p++)
+		if (pool->queued[p])
+			pool->bypassed[p]++;
+}
+
+/* Wake up a waiter of the class served next, if any can be served */
+static void pkcs11_session_signal(PKCS11_SLOT_private *spriv,
+		PKCS11_SESSION_POOL *pool)
+{
+	int p, turn, starved;
+
+	for (p = 0; p < PKCS11_PRIORITIES && !pool->queued[p]; p++)
+		;
+	if (p == PKCS11_PRIORITIES)
+		return;
+	turn = pkcs11_session_turn(spriv, pool,
+		pkcs11_session_available(pool), &starved);
+	if (turn < PKCS11_PRIORITIES)
+		pthread_cond_signal(&pool->cond[turn]);
+}
+
+/*
+ * Open a new session counted in the num_sessions of its pool
+ * The slot lock is held by the caller, and released while the session
+ * is opened, so that sessions of a slow token are opened concurrently.
+ */
+static CK_RV pkcs11_open_pool_session(PKCS11_SLOT *slot,
+		PKCS11_SESSION_POOL *pool, CK_SESSION_HANDLE *sessionp)
 {
 	PKCS11_CTX *ctx = SLOT2CTX(slot);
 	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
-	int rv = CKR_OK;
+	CK_FLAGS flags = CKF_SERIAL_SESSION;
+	unsigned int generation = spriv->generation;
+	CK_RV rv;
+
+	if (pool == &spriv->pools[1])
+		flags |= CKF_RW_SESSION;
+	pool->num_sessions++;
+	pthread_mutex_unlock(&spriv->lock);
+	rv = CRYPTOKI_call(ctx,
+		C_OpenSession(spriv->id, flags, NULL, NULL, sessionp));
+	pthread_mutex_lock(&spriv->lock);
+	/* Opened in the previous generation if the pools were flushed
+	 * meanwhile, so that the session is closed when it is returned */
+	if (rv == CKR_OK &&
+			pkcs11_tag_session(spriv, *sessionp, pool, generation)) {
+		CRYPTOKI_call(ctx, C_CloseSession(*sessionp));
+		rv = CKR_HOST_MEMORY;
+	}
+	if (rv != CKR_OK && generation != spriv->generation) {
+		pkcs11_session_signal(spriv, pool);
+	} else if (rv != CKR_OK) {
+		pool->num_sessions--;
+		/* Remember the maximum session count */
+		if (rv == CKR_SESSION_COUNT)
+			pool->max_sessions = pool->num_sessions;
+		/* A waiter may now open a session itself */
+		pkcs11_session_signal(spriv, pool);
+	}
+	return rv;
+}
+
+/*
+ * Read-only and read-write sessions are kept in separate pools with
+ * their own limits, so that a few write operations never hold up the
+ * sessions used for signing and decryption.  The session is returned
+ * by pkcs11_put_session() to the pool it was opened for, even if the
+ * login state changed in the meantime.
+ *
+ * Sessions are first looked up in a per-thread cache entry without
+ * locking, so that a thread normally gets back the session it has used
+ * last.  The slot mutex and the condition variables of the pool are only
+ * used for the shared ring buffer, for opening new sessions, and for
+ * waiting when all max_sessions sessions of the pool are in use.
+ * A waiter registers itself in waiters before it scans the cache
+ * entries, and pkcs11_put_session() checks waiters after it has
+ * published a session, so a returned session is never missed by a waiter.
+ *
+ * The waiters are queued by PKCS11_PRIORITY_xxx class, each class on its
+ * own condition variable, and the returned sessions are handed to the
+ * class selected by pkcs11_session_turn().  The fast path is skipped
+ * while operations are waiting, and by the classes subject to the
+ * session reserve, so that these rules also apply to the cached sessions.
+ *
+ * The timeout in milliseconds limits the wait: a negative value waits
+ * until a session is available, and 0 only tries to acquire a session.
+ * Returns 0 on success, 1 if no session was available before the timeout
+ * (nothing is reported), or -1 on error.
+ */
+int pkcs11_get_session_prio(PKCS11_SLOT *slot, int rw,
+		CK_SESSION_HANDLE *sessionp, long timeout, int priority)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	PKCS11_SESSION_POOL *pool;
+	struct timespec deadline;
+	unsigned long start;
+	unsigned int i;
+	int timed_out = 0, queued = 0;
+	CK_RV rv;
 
-	if (rw < 0)
+	if (rw < 0 || priority < 0 || priority >= PKCS11_PRIORITIES)
 		return -1;
+	pool = SESSION_POOL(spriv, rw);
+
+	/* Fast path: the session cached for this thread */
+	if (!p11_atomic_load(&pool->waiters) &&
+			(priority == PKCS11_PRIORITY_HIGH || !p11_atomic_load(
+				&PRIVCTX(spriv->parent)->session_reserve))) {
+		i = pkcs11_thread_index() % pool->cachesize;
+		*sessionp = p11_atomic_xchg(&pool->cache[i], CK_INVALID_HANDLE);
+		if (*sessionp != CK_INVALID_HANDLE)
+			return 0;
+	}
 
+	if (timeout > 0)
+		pkcs11_get_deadline(&deadline, timeout);
 	pthread_mutex_lock(&spriv->lock);
+	if (pkcs11_load_token_info_locked(slot)) {
+		pthread_mutex_unlock(&spriv->lock);
+		return -1;
+	}
 	if (spriv->rw_mode < 0)
 		spriv->rw_mode = rw;
-	rw = spriv->rw_mode;
+	p11_atomic_add(&pool->waiters, 1);
 	do {
-		/* Get session from the pool */
-		if (spriv->session_head != spriv->session_tail) {
-			*sessionp = spriv->session_pool[spriv->session_head];
-			spriv->session_head = (spriv->session_head + 1) % spriv->session_poolsize;
-			break;
-		}
+		if (pkcs11_session_may_take(spriv, pool, priority)) {
+			/* The session cached for this thread, if any */
+			i = pkcs11_thread_index() % pool->cachesize;
+			*sessionp = p11_atomic_xchg(&pool->cache[i],
+				CK_INVALID_HANDLE);
+			if (*sessionp != CK_INVALID_HANDLE)
+				break;
 
-		/* Check if new can be instantiated */
-		if (spriv->num_sessions < spriv->max_sessions) {
-			rv = CRYPTOKI_call(ctx,
-				C_OpenSession(spriv->id,
-					CKF_SERIAL_SESSION | (rw ? CKF_RW_SESSION : 0),
-					NULL, NULL, sessionp));
-			if (rv == CKR_OK) {
-				spriv->num_sessions++;
+			/* Get session from the pool */
+			if (pool->head != pool->tail) {
+				*sessionp = pool->sessions[pool->head];
+				pool->head = (pool->head + 1) % pool->size;
 				break;
 			}
 
-			/* Remember the maximum session count */
-			if (rv == CKR_SESSION_COUNT)
-				spriv->max_sessions = spriv->num_sessions;
+			/* Check if new can be instantiated */
+			rv = CKR_OK;
+			if (pool->num_sessions < pool->max_sessions) {
+				rv = pkcs11_open_pool_session(slot, pool, sessionp);
+				if (rv == CKR_OK)
+					break;
+				/* A session may have been returned meanwhile */
+				if (rv == CKR_SESSION_COUNT)
+					continue;
+			}
+
+			/* Take over a session cached for another thread */
+			for (i = 0; i < pool->cachesize; i++) {
+				*sessionp = p11_atomic_xchg(&pool->cache[i],
+					CK_INVALID_HANDLE);
+				if (*sessionp != CK_INVALID_HANDLE)
+					break;
+			}
+			if (i < pool->cachesize)
+				break;
+
+			/* The token failed to open a session: report the error
+			 * rather than retry it until the timeout */
+			if (rv != CKR_OK) {
+				pkcs11_session_dequeue(pool, priority, queued);
+				p11_atomic_add(&pool->waiters, -1);
+				pkcs11_session_signal(spriv, pool);
+				pthread_mutex_unlock(&spriv->lock);
+				CKRerr(CKR_F_PKCS11_GET_SESSION, rv);
+				return -1;
+			}
 		}
 
-		/* Wait for a session to become available */
-		pthread_cond_wait(&spriv->cond, &spriv->lock);
+		if (timeout == 0 || timed_out) {
+			pkcs11_session_dequeue(pool, priority, queued);
+			p11_atomic_add(&pool->waiters, -1);
+			/* The session may be for another class */
+			pkcs11_session_signal(spriv, pool);
+			pthread_mutex_unlock(&spriv->lock);
+			return 1;
+		}
+
+		/* Wait for a session to become available, and remain queued
+		 * until a session is acquired */
+		start = pkcs11_stats_time();
+		pool->last_wait = start;
+		if (!queued) {
+			pool->queued[priority]++;
+			queued = 1;
+		} else {
+			/* The wakeup may be for a session of another class */
+			pkcs11_session_signal(spriv, pool);
+		}
+		if (timeout < 0) {
+			pthread_cond_wait(&pool->cond[priority], &spriv->lock);
+		} else {
+			/* Check the pool once again after the timeout */
+			if (pthread_cond_timedwait(&pool->cond[priority],
+					&spriv->lock, &deadline) == ETIMEDOUT)
+				timed_out = 1;
+		}
+		pkcs11_stats_wait(slot, start);
 	} while (1);
+	pkcs11_session_dequeue(pool, priority, queued);
+	pkcs11_session_granted(pool, priority);
+	p11_atomic_add(&pool->waiters, -1);
+	/* More sessions may be available for the other waiters */
+	pkcs11_session_signal(spriv, pool);
 	pthread_mutex_unlock(&spriv->lock);
 
 	return 0;
 }
 
-void pkcs11_put_session(PKCS11_SLOT * slot, CK_SESSION_HANDLE session)
+/*
+ * Get a session for an operation of the calling thread
+ */
+int pkcs11_get_session_timed(PKCS11_SLOT * slot, int rw,
+		CK_SESSION_HANDLE *sessionp, long timeout)
+{
+	return pkcs11_get_session_prio(slot, rw, sessionp, timeout,
+		thread_priority);
+}
+
+/*
+ * Get a session for an operation of a priority class, waiting at most
+ * the session timeout of the context
+ */
+int pkcs11_get_session_class(PKCS11_SLOT *slot, int rw,
+		CK_SESSION_HANDLE *sessionp, int priority)
 {
+	int rv;
+
+	rv = pkcs11_get_session_prio(slot, rw, sessionp,
+		p11_atomic_load(&PRIVCTX(SLOT2CTX(slot))->session_timeout),
+		priority);
+	if (rv > 0)
+		pkcs11_session_timeout(slot);
+	return rv ? -1 : 0;
+}
+
+/*
+ * Get a session, waiting at most the session timeout of the context
+ */
+int pkcs11_get_session(PKCS11_SLOT * slot, int rw, CK_SESSION_HANDLE *sessionp)
+{
+	return pkcs11_get_session_class(slot, rw, sessionp, thread_priority);
+}
+
+/*
+ * Number of sessions pkcs11_get_session() may hand out for operations
+ * of the given mode, as limited by the token
+ */
+unsigned int pkcs11_session_limit(PKCS11_SLOT *slot, int rw)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	unsigned int limit;
+
+	pthread_mutex_lock(&spriv->lock);
+	limit = SESSION_POOL(spriv, rw)->max_sessions;
+	pthread_mutex_unlock(&spriv->lock);
+	return limit ? limit : 1;
+}
+
+typedef struct pkcs11_prewarm {
+	PKCS11_SLOT *slot;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int running; /* lanes submitted to the worker threads */
+} PKCS11_PREWARM;
+
+typedef struct pkcs11_prewarm_lane {
+	PKCS11_TASK task;
+	PKCS11_PREWARM *prewarm;
+} PKCS11_PREWARM_LANE;
+
+/* Add a new session to the pool used for the cryptographic operations,
+ * unless the pool has enough of them */
+static void pkcs11_prewarm_session(PKCS11_SLOT *slot)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	PKCS11_SESSION_POOL *pool;
+	CK_SESSION_HANDLE session;
+
+	pthread_mutex_lock(&spriv->lock);
+	pool = SESSION_POOL(spriv, 0);
+	if (pool->num_sessions < pool->min_sessions &&
+			pool->num_sessions < pool->max_sessions &&
+			pkcs11_open_pool_session(slot, pool, &session) == CKR_OK) {
+		pool->sessions[pool->tail] = session;
+		pool->tail = (pool->tail + 1) % pool->size;
+		pkcs11_session_signal(spriv, pool);
+	}
+	pthread_mutex_unlock(&spriv->lock);
+}
+
+static void pkcs11_prewarm_run(PKCS11_TASK *task)
+{
+	PKCS11_PREWARM *prewarm = ((PKCS11_PREWARM_LANE *)task)->prewarm;
+
+	pkcs11_prewarm_session(prewarm->slot);
+	pthread_mutex_lock(&prewarm->lock);
+	if (--prewarm->running == 0)
+		pthread_cond_signal(&prewarm->cond);
+	pthread_mutex_unlock(&prewarm->lock);
+}
+
+/*
+ * Open the sessions configured with pkcs11_CTX_set_session_prewarm()
+ * The sessions are opened concurrently by the worker threads,
+ * and the function returns when all of them are open.
+ */
+void pkcs11_prewarm_sessions(PKCS11_SLOT *slot)
+{
+	PKCS11_CTX *ctx = SLOT2CTX(slot);
 	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	PKCS11_SESSION_POOL *pool;
+	PKCS11_PREWARM prewarm;
+	PKCS11_PREWARM_LANE lanes[PKCS11_MAX_SESSIONS];
+	unsigned int count, i, n;
+
+	count = PRIVCTX(ctx)->session_prewarm;
+	if (count > PKCS11_MAX_SESSIONS)
+		count = PKCS11_MAX_SESSIONS;
+	pthread_mutex_lock(&spriv->lock);
+	pool = SESSION_POOL(spriv, 0);
+	pool->min_sessions = count;
+	n = count > pool->num_sessions ? count - pool->num_sessions : 0;
+	pthread_mutex_unlock(&spriv->lock);
+	if (!n)
+		return;
+
+	memset(&prewarm, 0, sizeof(prewarm));
+	prewarm.slot = slot;
+	pthread_mutex_init(&prewarm.lock, 0);
+	pthread_cond_init(&prewarm.cond, 0);
+
+	/* The calling thread opens the sessions not submitted */
+	for (i = 1; i < n; i++) {
+		lanes[i].task.run = pkcs11_prewarm_run;
+		lanes[i].prewarm = &prewarm;
+		pthread_mutex_lock(&prewarm.lock);
+		prewarm.running++;
+		pthread_mutex_unlock(&prewarm.lock);
+		if (pkcs11_task_submit(ctx, &lanes[i].task) < 0) {
+			pthread_mutex_lock(&prewarm.lock);
+			prewarm.running--;
+			pthread_mutex_unlock(&prewarm.lock);
+			break;
+		}
+	}
+	for (n -= i - 1; n > 0; n--)
+		pkcs11_prewarm_session(slot);
+
+	pthread_mutex_lock(&prewarm.lock);
+	while (prewarm.running)
+		pthread_cond_wait(&prewarm.cond, &prewarm.lock);
+	pthread_mutex_unlock(&prewarm.lock);
+	pthread_mutex_destroy(&prewarm.lock);
+	pthread_cond_destroy(&prewarm.cond);
+}
+
+/*
+ * Report a failure to acquire a session within the session timeout
+ */
+void pkcs11_session_timeout(PKCS11_SLOT *slot)
+{
+	p11_atomic_add(&PRIVSLOT(slot)->stats.session_timeouts, 1);
+	P11err(P11_F_PKCS11_GET_SESSION, P11_R_SESSION_TIMEOUT);
+}
+
+/*
+ * Return a session to the pool it was acquired from
+ * The pool is the one recorded when the session was opened, rather than
+ * the one selected by rw and the current login state, which may have
+ * changed while the session was in use.
+ */
+void pkcs11_put_session(PKCS11_SLOT * slot, int rw, CK_SESSION_HANDLE session)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	PKCS11_SESSION_TAG *tag = pkcs11_session_tag(spriv, session);
+	PKCS11_SESSION_POOL *pool;
+	unsigned int i;
+
+	(void)rw;
+	if (!tag || tag->pool < 0) {
+		/* Not opened by a pool */
+		CRYPTOKI_call(SLOT2CTX(slot), C_CloseSession(session));
+		return;
+	}
+	pool = spriv->pools + tag->pool;
+
+	/* Fast path: keep the session for this thread */
+	i = pkcs11_thread_index() % pool->cachesize;
+	if (!pkcs11_session_stale(spriv, tag) &&
+			!p11_atomic_load(&pool->waiters) &&
+			p11_atomic_cas(&pool->cache[i], CK_INVALID_HANDLE, session)) {
+		if (!p11_atomic_load(&pool->waiters))
+			return;
+		/* Somebody started waiting: hand the session over */
+		session = p11_atomic_xchg(&pool->cache[i], CK_INVALID_HANDLE);
+		if (session == CK_INVALID_HANDLE)
+			return; /* Already taken by the waiter */
+	}
 
 	pthread_mutex_lock(&spriv->lock);
 
-	spriv->session_pool[spriv->session_tail] = session;
-	spriv->session_tail = (spriv->session_tail + 1) % spriv->session_poolsize;
-	pthread_cond_signal(&spriv->cond);
+	/* Flushed since the session was opened: it is no longer counted */
+	if (pkcs11_session_stale(spriv, tag)) {
+		tag->pool = -1;
+		pthread_mutex_unlock(&spriv->lock);
+		CRYPTOKI_call(SLOT2CTX(slot), C_CloseSession(session));
+		return;
+	}
+
+	/* Close the surplus sessions when nobody had to wait for a while */
+	if (!p11_atomic_load(&pool->waiters) &&
+			pool->head != pool->tail &&
+			pool->num_sessions > pool->min_sessions &&
+			pkcs11_stats_time() - pool->last_wait > PKCS11_SESSION_IDLE_TIME) {
+		pool->num_sessions--;
+		pkcs11_untag_session(spriv, session);
+		pthread_mutex_unlock(&spriv->lock);
+		CRYPTOKI_call(SLOT2CTX(slot), C_CloseSession(session));
+		return;
+	}
+
+	pool->sessions[pool->tail] = session;
+	pool->tail = (pool->tail + 1) % pool->size;
+	pkcs11_session_signal(spriv, pool);
 
 	pthread_mutex_unlock(&spriv->lock);
 }
 
+/*
+ * Return a session after an operation
+ * The cached login state is updated with the result of the operation,
+ * and a session no longer valid is closed instead of being reused.
+ */
+void pkcs11_put_session_rv(PKCS11_SLOT *slot, int rw,
+		CK_SESSION_HANDLE session, CK_RV rv)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	PKCS11_SESSION_TAG *tag;
+	PKCS11_SESSION_POOL *pool;
+
+	switch (rv) {
+	case CKR_SESSION_HANDLE_INVALID:
+	case CKR_SESSION_CLOSED:
+		pthread_mutex_lock(&spriv->lock);
+		/* The login state may have been lost with the sessions */
+		spriv->logged_in = -1;
+		tag = pkcs11_session_tag(spriv, session);
+		if (tag && tag->pool >= 0) {
+			pool = spriv->pools + tag->pool;
+			tag->pool = -1;
+			/* Not counted any longer after a flush */
+			if (!pkcs11_session_stale(spriv, tag))
+				pool->num_sessions--;
+			/* A new one can be opened */
+			pkcs11_session_signal(spriv, pool);
+		}
+		pthread_mutex_unlock(&spriv->lock);
+		return;
+	case CKR_USER_NOT_LOGGED_IN:
+		/* Logged out by another application or by the token */
+		pthread_mutex_lock(&spriv->lock);
+		spriv->logged_in = -1;
+		pthread_mutex_unlock(&spriv->lock);
+		break;
+	}
+	pkcs11_put_session(slot, rw, session);
+}
+
+/* Destroy the queued objects, run by a worker thread */
+static void pkcs11_destroy_run(PKCS11_TASK *task)
+{
+	PKCS11_DESTROY_QUEUE *dq = (PKCS11_DESTROY_QUEUE *)task;
+	PKCS11_SLOT *slot = dq->slot;
+	PKCS11_DESTROY_ENTRY entry;
+	CK_RV rv;
+
+	pthread_mutex_lock(&dq->lock);
+	while (dq->count > 0) {
+		entry = dq->entries[--dq->count];
+		pthread_mutex_unlock(&dq->lock);
+		rv = CRYPTOKI_call(SLOT2CTX(slot),
+			C_DestroyObject(entry.session, entry.object));
+		pkcs11_put_session_rv(slot, 0, entry.session, rv);
+		pthread_mutex_lock(&dq->lock);
+	}
+	dq->running = 0;
+	pthread_cond_broadcast(&dq->cond);
+	pthread_mutex_unlock(&dq->lock);
+}
+
+/*
+ * Destroy a temporary session object after the caller got the result of
+ * the operation, and only then return the read-only session to the pool,
+ * so that the object handle cannot be reused in the meantime
+ * The object is destroyed immediately without worker threads.
+ */
+void pkcs11_destroy_later(PKCS11_SLOT *slot, CK_SESSION_HANDLE session,
+		CK_OBJECT_HANDLE object)
+{
+	PKCS11_DESTROY_QUEUE *dq = &PRIVSLOT(slot)->destroy;
+	PKCS11_DESTROY_ENTRY *entries;
+	unsigned int size;
+	int submit = 0;
+	CK_RV rv;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count == dq->size) {
+		size = dq->size ? 2 * dq->size : 16;
+		entries = OPENSSL_realloc(dq->entries,
+			size * sizeof(PKCS11_DESTROY_ENTRY));
+		if (!entries) {
+			pthread_mutex_unlock(&dq->lock);
+			rv = CRYPTOKI_call(SLOT2CTX(slot),
+				C_DestroyObject(session, object));
+			pkcs11_put_session_rv(slot, 0, session, rv);
+			return;
+		}
+		dq->entries = entries;
+		dq->size = size;
+	}
+	dq->entries[dq->count].session = session;
+	dq->entries[dq->count].object = object;
+	dq->count++;
+	if (!dq->running) {
+		dq->running = submit = 1;
+		dq->slot = slot; /* The slot may have moved to another list */
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	if (submit && pkcs11_task_submit(SLOT2CTX(slot), &dq->task))
+		pkcs11_destroy_run(&dq->task);
+}
+
+static void pkcs11_destroy_queue_init(PKCS11_SLOT *slot)
+{
+	PKCS11_DESTROY_QUEUE *dq = &PRIVSLOT(slot)->destroy;
+
+	dq->task.run = pkcs11_destroy_run;
+	dq->slot = slot;
+	dq->entries = NULL;
+	dq->count = dq->size = 0;
+	dq->running = 0;
+	pthread_mutex_init(&dq->lock, 0);
+	pthread_cond_init(&dq->cond, 0);
+}
+
+/* The sessions of the pending entries are closed by the caller */
+static void pkcs11_destroy_queue_free(PKCS11_SLOT *slot)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	PKCS11_DESTROY_QUEUE *dq = &spriv->destroy;
+
+	pthread_mutex_lock(&dq->lock);
+	/* The queue of the parent process is not drained in the child */
+	if (spriv->forkid == get_forkid())
+		while (dq->running)
+			pthread_cond_wait(&dq->cond, &dq->lock);
+	OPENSSL_free(dq->entries);
+	dq->entries = NULL;
+	dq->count = dq->size = 0;
+	pthread_mutex_unlock(&dq->lock);
+	pthread_mutex_destroy(&dq->lock);
+	pthread_cond_destroy(&dq->cond);
+}
+
+/* The sessions of the parent process are not valid after fork() */
+static void pkcs11_destroy_queue_reset(PKCS11_SLOT *slot)
+{
+	PKCS11_DESTROY_QUEUE *dq = &PRIVSLOT(slot)->destroy;
+
+	pthread_mutex_lock(&dq->lock);
+	dq->count = 0;
+	dq->running = 0;
+	pthread_mutex_unlock(&dq->lock);
+}
+
 /*
  * Determines if user is authenticated with token
+ * The login state is cached, and invalidated by pkcs11_put_session_rv().
  */
 int pkcs11_is_logged_in(PKCS11_SLOT *slot, int so, int *res)
 {
@@ -254,22 +1360,46 @@ int pkcs11_login(PKCS11_SLOT *slot, int so, const char *pin)
 	rv = CRYPTOKI_call(ctx,
 		C_Login(session, so ? CKU_SO : CKU_USER,
 			(CK_UTF8CHAR *) pin, pin ? (unsigned long) strlen(pin) : 0));
-	pkcs11_put_session(slot, session);
+	pkcs11_put_session(slot, so, session);
 
 	if (rv && rv != CKR_USER_ALREADY_LOGGED_IN) { /* logged in -> OK */
 		CRYPTOKI_checkerr(CKR_F_PKCS11_LOGIN, rv);
 	}
 	if (spriv->prev_pin != pin) {
-		if (spriv->prev_pin) {
-			OPENSSL_cleanse(spriv->prev_pin, strlen(spriv->prev_pin));
-			OPENSSL_free(spriv->prev_pin);
+		/* pkcs11_relogin() may be using the previous PIN */
+		char *prev_pin, *new_pin = OPENSSL_strdup(pin);
+
+		pthread_mutex_lock(&PRIVCTX(ctx)->fork_lock);
+		prev_pin = spriv->prev_pin;
+		spriv->prev_pin = new_pin;
+		pthread_mutex_unlock(&PRIVCTX(ctx)->fork_lock);
+		if (prev_pin) {
+			OPENSSL_cleanse(prev_pin, strlen(prev_pin));
+			OPENSSL_free(prev_pin);
 		}
-		spriv->prev_pin = OPENSSL_strdup(pin);
 	}
 	spriv->logged_in = so;
+	pkcs11_prewarm_sessions(slot);
 	return 0;
 }
 
+/*
+ * Log in again as the user with the previous PIN, after the login state
+ * was lost, e.g. when another application logged out of the token.
+ * Serialized with the reinitialization after fork(), which also uses
+ * the previous PIN.
+ */
+int pkcs11_relogin(PKCS11_SLOT *slot)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(SLOT2CTX(slot));
+	int rv;
+
+	pthread_mutex_lock(&cpriv->fork_lock);
+	rv = pkcs11_login(slot, 0, PRIVSLOT(slot)->prev_pin);
+	pthread_mutex_unlock(&cpriv->fork_lock);
+	return rv;
+}
+
 /*
  * Reopens the slot by creating a session and logging in if needed.
  */
@@ -278,8 +1408,9 @@ int pkcs11_reload_slot(PKCS11_SLOT *slot)
 	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
 	int logged_in = spriv->logged_in;
 
-	spriv->num_sessions = 0;
-	spriv->session_head = spriv->session_tail = 0;
+	pkcs11_flush_sessions(spriv);
+	pkcs11_rand_reset(slot);
+	pkcs11_destroy_queue_reset(slot);
 	if (logged_in >= 0) {
 		spriv->logged_in = -1;
 		if (pkcs11_login(slot, logged_in, spriv->prev_pin))
@@ -305,11 +1436,12 @@ int pkcs11_logout(PKCS11_SLOT *slot)
 		pkcs11_destroy_keys(slot->token, CKO_PRIVATE_KEY);
 		pkcs11_destroy_keys(slot->token, CKO_PUBLIC_KEY);
 		pkcs11_destroy_certs(slot->token);
+		pkcs11_metadata_free(slot->token);
 	}
 
 	if (pkcs11_get_session(slot, spriv->logged_in, &session) == 0) {
 		rv = CRYPTOKI_call(ctx, C_Logout(session));
-		pkcs11_put_session(slot, session);
+		pkcs11_put_session(slot, spriv->logged_in, session);
 	}
 	CRYPTOKI_checkerr(CKR_F_PKCS11_LOGOUT, rv);
 	spriv->logged_in = -1;
@@ -364,7 +1496,7 @@ int pkcs11_init_pin(PKCS11_TOKEN *token, const char *pin)
 
 	len = pin ? (int) strlen(pin) : 0;
 	rv = CRYPTOKI_call(ctx, C_InitPIN(session, (CK_UTF8CHAR *) pin, len));
-	pkcs11_put_session(slot, session);
+	pkcs11_put_session(slot, 1, session);
 	CRYPTOKI_checkerr(CKR_F_PKCS11_INIT_PIN, rv);
 
 	return pkcs11_check_token(ctx, TOKEN2SLOT(token));
@@ -390,7 +1522,7 @@ int pkcs11_change_pin(PKCS11_SLOT *slot, const char *old_pin,
 	rv = CRYPTOKI_call(ctx,
 		C_SetPIN(session, (CK_UTF8CHAR *) old_pin, old_len,
 			(CK_UTF8CHAR *) new_pin, new_len));
-	pkcs11_put_session(slot, session);
+	pkcs11_put_session(slot, 1, session);
 	CRYPTOKI_checkerr(CKR_F_PKCS11_CHANGE_PIN, rv);
 
 	return pkcs11_check_token(ctx, slot);
@@ -413,10 +1545,11 @@ int pkcs11_seed_random(PKCS11_SLOT *slot, const unsigned char *s,
 
 	rv = CRYPTOKI_call(ctx,
 		C_SeedRandom(session, (CK_BYTE_PTR) s, s_len));
-	pkcs11_put_session(slot, session);
+	pkcs11_put_session(slot, 0, session);
 	CRYPTOKI_checkerr(CKR_F_PKCS11_SEED_RANDOM, rv);
 
-	return pkcs11_check_token(ctx, slot);
+	/* Reloading the token would release the keys still in use */
+	return 0;
 }
 
 /*
@@ -429,6 +1562,8 @@ int pkcs11_generate_random(PKCS11_SLOT *slot, unsigned char *r,
 	CK_SESSION_HANDLE session;
 	int rv;
 
+	if (pkcs11_rand_bytes(slot, r, r_len) == 0)
+		return 0;
 	if (pkcs11_get_session(slot, 0, &session)) {
 		P11err(P11_F_PKCS11_GENERATE_RANDOM, P11_R_NO_SESSION);
 		return -1;
@@ -436,16 +1571,50 @@ int pkcs11_generate_random(PKCS11_SLOT *slot, unsigned char *r,
 
 	rv = CRYPTOKI_call(ctx,
 		C_GenerateRandom(session, (CK_BYTE_PTR) r, r_len));
-	pkcs11_put_session(slot, session);
+	pkcs11_put_session(slot, 0, session);
 
 	CRYPTOKI_checkerr(CKR_F_PKCS11_GENERATE_RANDOM, rv);
 
-	return pkcs11_check_token(ctx, slot);
+	/* Reloading the token would release the keys still in use */
+	return 0;
 }
 
 /*
  * Helper functions
  */
+static int pkcs11_init_session_pool(PKCS11_SESSION_POOL *pool,
+		unsigned int max_sessions)
+{
+	int i;
+
+	pool->max_sessions = max_sessions;
+	pool->last_wait = pkcs11_stats_time();
+	/* The pool grows up to the session count reported by the token */
+	pool->size = PKCS11_MAX_SESSIONS + 1;
+	pool->sessions = OPENSSL_malloc(pool->size * sizeof(CK_SESSION_HANDLE));
+	pool->cachesize = PKCS11_MAX_SESSIONS;
+	pool->cache = OPENSSL_malloc(pool->cachesize * sizeof(CK_SESSION_HANDLE));
+	if (!pool->sessions || !pool->cache) {
+		OPENSSL_free(pool->sessions);
+		OPENSSL_free(pool->cache);
+		return -1;
+	}
+	memset(pool->cache, 0, pool->cachesize * sizeof(CK_SESSION_HANDLE));
+	for (i = 0; i < PKCS11_PRIORITIES; i++)
+		pthread_cond_init(&pool->cond[i], 0);
+	return 0;
+}
+
+static void pkcs11_release_session_pool(PKCS11_SESSION_POOL *pool)
+{
+	int i;
+
+	OPENSSL_free(pool->sessions);
+	OPENSSL_free(pool->cache);
+	for (i = 0; i < PKCS11_PRIORITIES; i++)
+		pthread_cond_destroy(&pool->cond[i]);
+}
+
 static int pkcs11_init_slot(PKCS11_CTX *ctx, PKCS11_SLOT *slot, CK_SLOT_ID id)
 {
 	PKCS11_SLOT_private *spriv;
@@ -466,28 +1635,32 @@ static int pkcs11_init_slot(PKCS11_CTX *ctx, PKCS11_SLOT *slot, CK_SLOT_ID id)
 	spriv->prev_pin = NULL;
 	spriv->logged_in = -1;
 	spriv->rw_mode = -1;
-	spriv->max_sessions = 16;
-	spriv->session_poolsize = spriv->max_sessions + 1;
-	spriv->session_pool = OPENSSL_malloc(spriv->session_poolsize * sizeof(CK_SESSION_HANDLE));
+	if (pkcs11_init_session_pool(&spriv->pools[0], PKCS11_MAX_SESSIONS)) {
+		OPENSSL_free(spriv);
+		return -1;
+	}
+	if (pkcs11_init_session_pool(&spriv->pools[1], PKCS11_MAX_RW_SESSIONS)) {
+		pkcs11_release_session_pool(&spriv->pools[0]);
+		OPENSSL_free(spriv);
+		return -1;
+	}
 	pthread_mutex_init(&spriv->lock, 0);
-	pthread_cond_init(&spriv->cond, 0);
 
 	slot->description = PKCS11_DUP(info.slotDescription);
 	slot->manufacturer = PKCS11_DUP(info.manufacturerID);
 	slot->removable = (info.flags & CKF_REMOVABLE_DEVICE) ? 1 : 0;
 	slot->_private = spriv;
-
-	if ((info.flags & CKF_TOKEN_PRESENT) && pkcs11_check_token(ctx, slot)) {
-		if (spriv) {
-			if (spriv->prev_pin) {
-				OPENSSL_cleanse(spriv->prev_pin, strlen(spriv->prev_pin));
-				OPENSSL_free(spriv->prev_pin);
-			}
-			CRYPTOKI_call(ctx, C_CloseAllSessions(spriv->id));
-			OPENSSL_free(spriv->session_pool);
-			pthread_mutex_destroy(&spriv->lock);
-			pthread_cond_destroy(&spriv->cond);
+	pkcs11_rand_init(slot);
+	pkcs11_destroy_queue_init(slot);
+
+	if ((info.flags & CKF_TOKEN_PRESENT) && pkcs11_new_token(ctx, slot,
+			PRIVCTX(ctx)->enum_flags & PKCS11_ENUM_LAZY_TOKEN_INFO)) {
+		/* Only an allocated token can be destroyed */
+		if (slot->token && !slot->token->_private) {
+			OPENSSL_free(slot->token);
+			slot->token = NULL;
 		}
+		pkcs11_release_slot(ctx, slot);
 		return -1;
 	}
 	return 0;
@@ -496,8 +1669,15 @@ static int pkcs11_init_slot(PKCS11_CTX *ctx, PKCS11_SLOT *slot, CK_SLOT_ID id)
 void pkcs11_release_all_slots(PKCS11_CTX *ctx,  PKCS11_SLOT *slots,
 		unsigned int nslots)
 {
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
 	unsigned int i;
 
+	pthread_mutex_lock(&cpriv->fork_lock);
+	if (cpriv->fork_slots == slots) {
+		cpriv->fork_slots = NULL;
+		cpriv->fork_nslots = 0;
+	}
+	pthread_mutex_unlock(&cpriv->fork_lock);
 	for (i=0; i < nslots; i++)
 		pkcs11_release_slot(ctx, &slots[i]);
 	OPENSSL_free(slots);
@@ -508,14 +1688,18 @@ static void pkcs11_release_slot(PKCS11_CTX *ctx, PKCS11_SLOT *slot)
 	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
 
 	if (spriv) {
+		/* Waits for the tasks using the sessions */
+		pkcs11_rand_free(slot);
+		pkcs11_destroy_queue_free(slot);
 		if (spriv->prev_pin) {
 			OPENSSL_cleanse(spriv->prev_pin, strlen(spriv->prev_pin));
 			OPENSSL_free(spriv->prev_pin);
 		}
 		CRYPTOKI_call(ctx, C_CloseAllSessions(spriv->id));
-		OPENSSL_free(spriv->session_pool);
+		pkcs11_release_session_pool(&spriv->pools[0]);
+		pkcs11_release_session_pool(&spriv->pools[1]);
+		pkcs11_free_mechanisms_locked(spriv);
 		pthread_mutex_destroy(&spriv->lock);
-		pthread_cond_destroy(&spriv->cond);
 	}
 	OPENSSL_free(slot->_private);
 	OPENSSL_free(slot->description);
@@ -529,6 +1713,111 @@ static void pkcs11_release_slot(PKCS11_CTX *ctx, PKCS11_SLOT *slot)
 }
 
 static int pkcs11_check_token(PKCS11_CTX *ctx, PKCS11_SLOT *slot)
+{
+	return pkcs11_new_token(ctx, slot, 0);
+}
+
+/* Check whether the token information describes another token */
+static int pkcs11_token_changed(PKCS11_TOKEN *token, CK_TOKEN_INFO *info)
+{
+	char *label = PKCS11_DUP(info->label);
+	char *serialnr = PKCS11_DUP(info->serialNumber);
+	int changed;
+
+	changed = !label || !serialnr || !token->label || !token->serialnr ||
+		strcmp(label, token->label) || strcmp(serialnr, token->serialnr) ||
+		token->initialized != ((info->flags & CKF_TOKEN_INITIALIZED) ? 1 : 0);
+	OPENSSL_free(label);
+	OPENSSL_free(serialnr);
+	return changed;
+}
+
+/*
+ * Close the sessions of a slot whose token was removed or replaced,
+ * and forget the login state and the session limits of the token
+ */
+static void pkcs11_reset_slot(PKCS11_CTX *ctx, PKCS11_SLOT *slot)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+
+	pthread_mutex_lock(&spriv->lock);
+	CRYPTOKI_call(ctx, C_CloseAllSessions(spriv->id));
+	pkcs11_flush_sessions(spriv);
+	spriv->pools[0].max_sessions = PKCS11_MAX_SESSIONS;
+	spriv->pools[1].max_sessions = PKCS11_MAX_RW_SESSIONS;
+	spriv->pools[0].min_sessions = 0;
+	spriv->logged_in = -1;
+	if (spriv->prev_pin) {
+		OPENSSL_cleanse(spriv->prev_pin, strlen(spriv->prev_pin));
+		OPENSSL_free(spriv->prev_pin);
+		spriv->prev_pin = NULL;
+	}
+	pkcs11_free_mechanisms_locked(spriv);
+	pthread_mutex_unlock(&spriv->lock);
+}
+
+/*
+ * Reinitialize the token of a slot if it was inserted, removed or replaced
+ * The flags of an unchanged token are updated in place, and the replicas
+ * of the keys of the list on a changed token are dropped.
+ * Returns 1 if the token changed, 0 if it did not, or -1 on error
+ */
+static int pkcs11_refresh_slot(PKCS11_CTX *ctx, PKCS11_SLOT *slots,
+		unsigned int nslots, PKCS11_SLOT *slot)
+{
+	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	CK_SLOT_INFO info;
+	CK_TOKEN_INFO tinfo;
+	int present, rv;
+
+	rv = CRYPTOKI_call(ctx, C_GetSlotInfo(spriv->id, &info));
+	CRYPTOKI_checkerr(CKR_F_PKCS11_UPDATE_SLOTS, rv);
+	present = (info.flags & CKF_TOKEN_PRESENT) ? 1 : 0;
+	if (present && slot->token &&
+			p11_atomic_load(&spriv->token_info_pending))
+		return 0; /* Nothing was retrieved from the token yet */
+	if (present) {
+		rv = CRYPTOKI_call(ctx, C_GetTokenInfo(spriv->id, &tinfo));
+		if (rv == CKR_TOKEN_NOT_PRESENT || rv == CKR_TOKEN_NOT_RECOGNIZED)
+			present = 0;
+		else
+			CRYPTOKI_checkerr(CKR_F_PKCS11_UPDATE_SLOTS, rv);
+	}
+	if (!present && !slot->token)
+		return 0;
+	if (present && slot->token && !pkcs11_token_changed(slot->token, &tinfo)) {
+		pkcs11_set_token_flags(slot->token, tinfo.flags);
+		return 0;
+	}
+
+	pthread_mutex_lock(&cpriv->fork_lock);
+	pkcs11_move_replicas(slots, nslots, slot, NULL);
+	pthread_mutex_unlock(&cpriv->fork_lock);
+	pkcs11_reset_slot(ctx, slot);
+	if (!present) {
+		pkcs11_destroy_token(slot->token);
+		OPENSSL_free(slot->token);
+		slot->token = NULL;
+		return 1;
+	}
+	if (pkcs11_check_token(ctx, slot)) {
+		/* Only an allocated token can be destroyed */
+		if (slot->token && !slot->token->_private) {
+			OPENSSL_free(slot->token);
+			slot->token = NULL;
+		}
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * Allocate the token of a slot, or reinitialize the existing one
+ * Without the lazy flag the token information is also retrieved.
+ * Otherwise it is retrieved by pkcs11_load_token_info() on first use.
+ */
+static int pkcs11_new_token(PKCS11_CTX *ctx, PKCS11_SLOT *slot, int lazy)
 {
 	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
 	PKCS11_TOKEN_private *tpriv;
@@ -543,14 +1832,17 @@ static int pkcs11_check_token(PKCS11_CTX *ctx, PKCS11_SLOT *slot)
 			return -1;
 		memset(slot->token, 0, sizeof(PKCS11_TOKEN));
 	}
-
-	rv = CRYPTOKI_call(ctx, C_GetTokenInfo(spriv->id, &info));
-	if (rv == CKR_TOKEN_NOT_PRESENT || rv == CKR_TOKEN_NOT_RECOGNIZED) {
-		OPENSSL_free(slot->token);
-		slot->token = NULL;
-		return 0;
+	p11_atomic_store(&spriv->token_info_pending, 0);
+
+	if (!lazy) {
+		rv = CRYPTOKI_call(ctx, C_GetTokenInfo(spriv->id, &info));
+		if (rv == CKR_TOKEN_NOT_PRESENT || rv == CKR_TOKEN_NOT_RECOGNIZED) {
+			OPENSSL_free(slot->token);
+			slot->token = NULL;
+			return 0;
+		}
+		CRYPTOKI_checkerr(CKR_F_PKCS11_CHECK_TOKEN, rv);
 	}
-	CRYPTOKI_checkerr(CKR_F_PKCS11_CHECK_TOKEN, rv);
 
 	/* We have a token */
 	tpriv = OPENSSL_malloc(sizeof(PKCS11_TOKEN_private));
@@ -563,35 +1855,200 @@ static int pkcs11_check_token(PKCS11_CTX *ctx, PKCS11_SLOT *slot)
 	tpriv->pub.keys = NULL;
 	tpriv->pub.num = 0;
 	tpriv->ncerts = 0;
-
-	slot->token->label = PKCS11_DUP(info.label);
-	slot->token->manufacturer = PKCS11_DUP(info.manufacturerID);
-	slot->token->model = PKCS11_DUP(info.model);
-	slot->token->serialnr = PKCS11_DUP(info.serialNumber);
-	slot->token->initialized = (info.flags & CKF_TOKEN_INITIALIZED) ? 1 : 0;
-	slot->token->loginRequired = (info.flags & CKF_LOGIN_REQUIRED) ? 1 : 0;
-	slot->token->secureLogin = (info.flags & CKF_PROTECTED_AUTHENTICATION_PATH) ? 1 : 0;
-	slot->token->userPinSet = (info.flags & CKF_USER_PIN_INITIALIZED) ? 1 : 0;
-	slot->token->readOnly = (info.flags & CKF_WRITE_PROTECTED) ? 1 : 0;
-	slot->token->hasRng = (info.flags & CKF_RNG) ? 1 : 0;
-	slot->token->userPinCountLow = (info.flags & CKF_USER_PIN_COUNT_LOW) ? 1 : 0;
-	slot->token->userPinFinalTry = (info.flags & CKF_USER_PIN_FINAL_TRY) ? 1 : 0;
-	slot->token->userPinLocked = (info.flags & CKF_USER_PIN_LOCKED) ? 1 : 0;
-	slot->token->userPinToBeChanged = (info.flags & CKF_USER_PIN_TO_BE_CHANGED) ? 1 : 0;
-	slot->token->soPinCountLow = (info.flags & CKF_SO_PIN_COUNT_LOW) ? 1 : 0;
-	slot->token->soPinFinalTry = (info.flags & CKF_SO_PIN_FINAL_TRY) ? 1 : 0;
-	slot->token->soPinLocked = (info.flags & CKF_SO_PIN_LOCKED) ? 1 : 0;
-	slot->token->soPinToBeChanged = (info.flags & CKF_SO_PIN_TO_BE_CHANGED) ? 1 : 0;
 	slot->token->_private = tpriv;
 
+	if (lazy)
+		p11_atomic_store(&spriv->token_info_pending, 1);
+	else
+		pkcs11_set_token_info(slot, &info);
+	return 0;
+}
+
+/*
+ * Retrieve the token information postponed by PKCS11_ENUM_LAZY_TOKEN_INFO
+ * The slot lock is held by the caller.
+ */
+static int pkcs11_load_token_info_locked(PKCS11_SLOT *slot)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	CK_TOKEN_INFO info;
+	int rv;
+
+	if (!spriv->token_info_pending)
+		return 0;
+	rv = CRYPTOKI_call(SLOT2CTX(slot), C_GetTokenInfo(spriv->id, &info));
+	CRYPTOKI_checkerr(CKR_F_PKCS11_CHECK_TOKEN, rv);
+	pkcs11_set_token_info(slot, &info);
+	p11_atomic_store(&spriv->token_info_pending, 0);
 	return 0;
 }
 
+/*
+ * Retrieve the token information if it was not retrieved yet
+ */
+int pkcs11_load_token_info(PKCS11_SLOT *slot)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	int rv;
+
+	if (!p11_atomic_load(&spriv->token_info_pending))
+		return 0;
+	pthread_mutex_lock(&spriv->lock);
+	rv = pkcs11_load_token_info_locked(slot);
+	pthread_mutex_unlock(&spriv->lock);
+	return rv;
+}
+
+static int pkcs11_cmp_mechanism(const void *a, const void *b)
+{
+	CK_MECHANISM_TYPE x = ((const PKCS11_MECHANISM_INFO *)a)->type;
+	CK_MECHANISM_TYPE y = ((const PKCS11_MECHANISM_INFO *)b)->type;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Retrieve the list of mechanisms of the token, called with the lock held
+ * The flags of each mechanism are only queried when it is first checked.
+ * A token that does not report its mechanisms leaves the list empty.
+ */
+static void pkcs11_load_mechanisms_locked(PKCS11_SLOT *slot)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	PKCS11_CTX *ctx = SLOT2CTX(slot);
+	CK_MECHANISM_TYPE *types = NULL;
+	CK_ULONG i, n = 0;
+	CK_RV rv;
+
+	spriv->mechs_loaded = 1;
+	rv = CRYPTOKI_call(ctx, C_GetMechanismList(spriv->id, NULL, &n));
+	if (rv != CKR_OK || n == 0)
+		return;
+	types = OPENSSL_malloc(n * sizeof(CK_MECHANISM_TYPE));
+	spriv->mechs = OPENSSL_malloc(n * sizeof(PKCS11_MECHANISM_INFO));
+	if (!types || !spriv->mechs)
+		goto done;
+	rv = CRYPTOKI_call(ctx, C_GetMechanismList(spriv->id, types, &n));
+	if (rv != CKR_OK || n == 0)
+		goto done;
+	for (i = 0; i < n; i++) {
+		spriv->mechs[i].type = types[i];
+		spriv->mechs[i].flags = PKCS11_MECHANISM_FLAGS_UNSET;
+	}
+	qsort(spriv->mechs, n, sizeof(PKCS11_MECHANISM_INFO),
+		pkcs11_cmp_mechanism);
+	spriv->num_mechs = n;
+
+done:
+	OPENSSL_free(types);
+	if (!spriv->num_mechs) {
+		OPENSSL_free(spriv->mechs);
+		spriv->mechs = NULL;
+	}
+}
+
+/* Forget the mechanisms of a removed or replaced token */
+static void pkcs11_free_mechanisms_locked(PKCS11_SLOT_private *spriv)
+{
+	OPENSSL_free(spriv->mechs);
+	spriv->mechs = NULL;
+	spriv->num_mechs = 0;
+	spriv->mechs_loaded = 0;
+}
+
+/*
+ * Check whether the token supports a mechanism for the CKF_xxx function,
+ * so that the operations it would reject are not attempted at all.
+ * Tokens that do not report their mechanisms are assumed to support them.
+ * Returns CKR_OK, or CKR_MECHANISM_INVALID
+ */
+CK_RV pkcs11_check_mechanism(PKCS11_SLOT *slot, CK_MECHANISM_TYPE type,
+		CK_FLAGS function)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+	PKCS11_MECHANISM_INFO key, *mech;
+	CK_MECHANISM_INFO info;
+	CK_RV rv = CKR_OK;
+
+	pthread_mutex_lock(&spriv->lock);
+	if (!spriv->mechs_loaded)
+		pkcs11_load_mechanisms_locked(slot);
+	if (!spriv->num_mechs)
+		goto done;
+	key.type = type;
+	mech = bsearch(&key, spriv->mechs, spriv->num_mechs,
+		sizeof(PKCS11_MECHANISM_INFO), pkcs11_cmp_mechanism);
+	if (!mech) {
+		rv = CKR_MECHANISM_INVALID;
+		goto done;
+	}
+	if (mech->flags == PKCS11_MECHANISM_FLAGS_UNSET) {
+		if (CRYPTOKI_call(SLOT2CTX(slot),
+				C_GetMechanismInfo(spriv->id, type, &info)) == CKR_OK)
+			mech->flags = info.flags;
+		else /* Try the operations anyway */
+			mech->flags = CKF_ENCRYPT | CKF_DECRYPT |
+				CKF_SIGN | CKF_VERIFY | CKF_DERIVE;
+	}
+	if (!(mech->flags & function))
+		rv = CKR_MECHANISM_INVALID;
+
+done:
+	pthread_mutex_unlock(&spriv->lock);
+	return rv;
+}
+
+/*
+ * Fill the token properties from the token information
+ */
+static void pkcs11_set_token_info(PKCS11_SLOT *slot, CK_TOKEN_INFO *info)
+{
+	PKCS11_SLOT_private *spriv = PRIVSLOT(slot);
+
+	slot->token->label = PKCS11_DUP(info->label);
+	slot->token->manufacturer = PKCS11_DUP(info->manufacturerID);
+	slot->token->model = PKCS11_DUP(info->model);
+	slot->token->serialnr = PKCS11_DUP(info->serialNumber);
+	pkcs11_set_token_flags(slot->token, info->flags);
+
+	/* The session counts reported by the token limit the pools */
+	if (info->ulMaxSessionCount != CK_EFFECTIVELY_INFINITE &&
+			info->ulMaxSessionCount != CK_UNAVAILABLE_INFORMATION) {
+		if (info->ulMaxSessionCount < spriv->pools[0].max_sessions)
+			spriv->pools[0].max_sessions = info->ulMaxSessionCount;
+		if (info->ulMaxSessionCount < spriv->pools[1].max_sessions)
+			spriv->pools[1].max_sessions = info->ulMaxSessionCount;
+	}
+	if (info->ulMaxRwSessionCount != CK_EFFECTIVELY_INFINITE &&
+			info->ulMaxRwSessionCount != CK_UNAVAILABLE_INFORMATION &&
+			info->ulMaxRwSessionCount < spriv->pools[1].max_sessions)
+		spriv->pools[1].max_sessions = info->ulMaxRwSessionCount;
+}
+
+static void pkcs11_set_token_flags(PKCS11_TOKEN *token, CK_FLAGS flags)
+{
+	token->initialized = (flags & CKF_TOKEN_INITIALIZED) ? 1 : 0;
+	token->loginRequired = (flags & CKF_LOGIN_REQUIRED) ? 1 : 0;
+	token->secureLogin = (flags & CKF_PROTECTED_AUTHENTICATION_PATH) ? 1 : 0;
+	token->userPinSet = (flags & CKF_USER_PIN_INITIALIZED) ? 1 : 0;
+	token->readOnly = (flags & CKF_WRITE_PROTECTED) ? 1 : 0;
+	token->hasRng = (flags & CKF_RNG) ? 1 : 0;
+	token->userPinCountLow = (flags & CKF_USER_PIN_COUNT_LOW) ? 1 : 0;
+	token->userPinFinalTry = (flags & CKF_USER_PIN_FINAL_TRY) ? 1 : 0;
+	token->userPinLocked = (flags & CKF_USER_PIN_LOCKED) ? 1 : 0;
+	token->userPinToBeChanged = (flags & CKF_USER_PIN_TO_BE_CHANGED) ? 1 : 0;
+	token->soPinCountLow = (flags & CKF_SO_PIN_COUNT_LOW) ? 1 : 0;
+	token->soPinFinalTry = (flags & CKF_SO_PIN_FINAL_TRY) ? 1 : 0;
+	token->soPinLocked = (flags & CKF_SO_PIN_LOCKED) ? 1 : 0;
+	token->soPinToBeChanged = (flags & CKF_SO_PIN_TO_BE_CHANGED) ? 1 : 0;
+}
+
 static void pkcs11_destroy_token(PKCS11_TOKEN *token)
 {
 	pkcs11_destroy_keys(token, CKO_PRIVATE_KEY);
 	pkcs11_destroy_keys(token, CKO_PUBLIC_KEY);
 	pkcs11_destroy_certs(token);
+	pkcs11_metadata_free(token);
 
 	OPENSSL_free(token->label);
 	OPENSSL_free(token->manufacturer);
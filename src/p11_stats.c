@@ -0,0 +1,184 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Per-slot statistics of the PKCS#11 calls
+ *
+ * The counters are only updated with atomic operations, so that
+ * recording does not need any locking.  The per-mechanism and per-error
+ * entries are claimed with a compare-and-swap on their key, and are never
+ * released, so a snapshot may only miss the updates in progress.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/*
+ * Monotonic time in microseconds
+ * Only differences are meaningful, and they survive the wraparound
+ */
+unsigned long pkcs11_stats_time(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (unsigned long)(now.QuadPart * 1000000 / freq.QuadPart);
+#else
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+	return (unsigned long)ts.tv_sec * 1000000UL +
+		(unsigned long)ts.tv_nsec / 1000UL;
+#endif
+}
+
+/* The bucket i counts the durations shorter than 2^i microseconds */
+static void pkcs11_stats_latency(unsigned long *latency, unsigned long start)
+{
+	unsigned long usec = pkcs11_stats_time() - start;
+	unsigned int i = 0;
+
+	while (i < PKCS11_STATS_BUCKETS - 1 && usec >= (1UL << i))
+		i++;
+	p11_atomic_add(&latency[i], 1);
+}
+
+static void pkcs11_stats_op(PKCS11_OP_STATS *stats, CK_RV rv,
+		unsigned long start)
+{
+	p11_atomic_add(&stats->calls, 1);
+	if (rv != CKR_OK)
+		p11_atomic_add(&stats->errors, 1);
+	pkcs11_stats_latency(stats->latency, start);
+}
+
+/* Find or claim the entry with the key, or return NULL if all are in use */
+static unsigned long *pkcs11_stats_claim(unsigned long *key, size_t stride,
+		unsigned int n, unsigned long value)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++, key = (unsigned long *)((char *)key + stride)) {
+		unsigned long k = p11_atomic_load(key);
+
+		if (k == value)
+			return key;
+		if (!k && (p11_atomic_cas(key, 0, value) ||
+				p11_atomic_load(key) == value))
+			return key;
+	}
+	return NULL;
+}
+
+/*
+ * Record a call started at start (see pkcs11_stats_time())
+ * Use PKCS11_STATS_NO_MECHANISM for calls without a mechanism
+ */
+void pkcs11_stats_record(PKCS11_SLOT *slot, int op,
+		CK_MECHANISM_TYPE mechanism, CK_RV rv, unsigned long start)
+{
+	PKCS11_SLOT_STATS *stats = &PRIVSLOT(slot)->stats;
+	PKCS11_STATS_MECH *mech;
+	PKCS11_STATS_ERROR *error;
+
+	pkcs11_stats_op(&stats->ops[op], rv, start);
+	if (mechanism != PKCS11_STATS_NO_MECHANISM) {
+		mech = (PKCS11_STATS_MECH *)pkcs11_stats_claim(&stats->mechs[0].key,
+			sizeof(PKCS11_STATS_MECH), PKCS11_STATS_MECHS,
+			mechanism * PKCS11_STATS_OPS + op + 1);
+		if (mech)
+			pkcs11_stats_op(&mech->stats, rv, start);
+	}
+	if (rv != CKR_OK) {
+		error = (PKCS11_STATS_ERROR *)pkcs11_stats_claim(&stats->errors[0].key,
+			sizeof(PKCS11_STATS_ERROR), PKCS11_STATS_ERRORS, rv + 1);
+		if (error)
+			p11_atomic_add(&error->count, 1);
+	}
+}
+
+/*
+ * Record a wait for a session started at start
+ */
+void pkcs11_stats_wait(PKCS11_SLOT *slot, unsigned long start)
+{
+	PKCS11_SLOT_STATS *stats = &PRIVSLOT(slot)->stats;
+
+	p11_atomic_add(&stats->session_waits, 1);
+	pkcs11_stats_latency(stats->session_wait_latency, start);
+}
+
+static void pkcs11_stats_copy_op(PKCS11_OP_STATS *dst, PKCS11_OP_STATS *src)
+{
+	unsigned int i;
+
+	dst->calls = p11_atomic_load(&src->calls);
+	dst->errors = p11_atomic_load(&src->errors);
+	for (i = 0; i < PKCS11_STATS_BUCKETS; i++)
+		dst->latency[i] = p11_atomic_load(&src->latency[i]);
+}
+
+/*
+ * Take a snapshot of the statistics of a slot
+ */
+void pkcs11_get_stats(PKCS11_SLOT *slot, PKCS11_STATS *stats)
+{
+	PKCS11_SLOT_STATS *src = &PRIVSLOT(slot)->stats;
+	unsigned long key;
+	unsigned int i;
+
+	memset(stats, 0, sizeof(PKCS11_STATS));
+	for (i = 0; i < PKCS11_STATS_OPS; i++)
+		pkcs11_stats_copy_op(&stats->ops[i], &src->ops[i]);
+	for (i = 0; i < PKCS11_STATS_MECHS; i++) {
+		PKCS11_MECH_STATS *mech = &stats->mechs[stats->nmechs];
+
+		key = p11_atomic_load(&src->mechs[i].key);
+		if (!key)
+			continue;
+		mech->op = (int)((key - 1) % PKCS11_STATS_OPS);
+		mech->mechanism = (key - 1) / PKCS11_STATS_OPS;
+		pkcs11_stats_copy_op(&mech->stats, &src->mechs[i].stats);
+		stats->nmechs++;
+	}
+	for (i = 0; i < PKCS11_STATS_ERRORS; i++) {
+		key = p11_atomic_load(&src->errors[i].key);
+		if (!key)
+			continue;
+		stats->errors[stats->nerrors].rv = key - 1;
+		stats->errors[stats->nerrors].count =
+			p11_atomic_load(&src->errors[i].count);
+		stats->nerrors++;
+	}
+	stats->session_waits = p11_atomic_load(&src->session_waits);
+	for (i = 0; i < PKCS11_STATS_BUCKETS; i++)
+		stats->session_wait_latency[i] =
+			p11_atomic_load(&src->session_wait_latency[i]);
+	stats->session_timeouts = p11_atomic_load(&src->session_timeouts);
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,288 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * OpenSSL 3 provider.  The configuration of the provider section uses the
+ * names of the engine control commands, for example:
+ *
+ *   [pkcs11_sect]
+ *   module = /usr/lib/ossl-modules/pkcs11prov.so
+ *   MODULE_PATH = /usr/lib/opensc-pkcs11.so
+ *   FORCE_LOGIN = 1
+ *   activate = 1
+ */
+
+#include "provider.h"
+#include <stdlib.h>
+
+#define MAX_PIN_LENGTH   32
+
+/* The engine control commands accepted in the provider configuration */
+static const ENGINE_CMD_DEFN prov_cmd_defns[] = {
+	{CMD_MODULE_PATH, "MODULE_PATH", NULL, ENGINE_CMD_FLAG_STRING},
+	{CMD_PIN, "PIN", NULL, ENGINE_CMD_FLAG_STRING},
+	{CMD_INIT_ARGS, "INIT_ARGS", NULL, ENGINE_CMD_FLAG_STRING},
+	{CMD_VERBOSE, "VERBOSE", NULL, ENGINE_CMD_FLAG_NO_INPUT},
+	{CMD_QUIET, "QUIET", NULL, ENGINE_CMD_FLAG_NO_INPUT},
+	{CMD_FORCE_LOGIN, "FORCE_LOGIN", NULL, ENGINE_CMD_FLAG_NO_INPUT},
+	{CMD_LOAD_BALANCE, "LOAD_BALANCE", NULL, ENGINE_CMD_FLAG_NO_INPUT},
+	{CMD_FIND_BATCH, "FIND_BATCH", NULL, ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_CACHE_TTL, "CACHE_TTL", NULL, ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_SESSION_TIMEOUT, "SESSION_TIMEOUT", NULL, ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_SESSION_PREWARM, "SESSION_PREWARM", NULL, ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_ENUM_THREADS, "ENUM_THREADS", NULL, ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_WATCH_SLOTS, "WATCH_SLOTS", NULL, ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_AUTH_PIN_CACHE, "AUTH_PIN_CACHE", NULL, ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_AUTH_PIN_MAX_USES, "AUTH_PIN_MAX_USES", NULL,
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_PRELOAD, "PRELOAD", NULL, ENGINE_CMD_FLAG_STRING},
+	{CMD_METADATA_CACHE, "METADATA_CACHE", NULL, ENGINE_CMD_FLAG_STRING},
+	{CMD_METADATA_GENERATION, "METADATA_GENERATION", NULL,
+		ENGINE_CMD_FLAG_STRING},
+	{CMD_CIPHER_KEY, "CIPHER_KEY", NULL, ENGINE_CMD_FLAG_STRING},
+	{CMD_CIPHER_CHUNK, "CIPHER_CHUNK", NULL, ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_SIGN_CHUNK, "SIGN_CHUNK", NULL, ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_SESSION_RESERVE, "SESSION_RESERVE", NULL, ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_STARVATION_LIMIT, "STARVATION_LIMIT", NULL, ENGINE_CMD_FLAG_NUMERIC},
+	{0, NULL, NULL, 0}
+};
+
+static const OSSL_ALGORITHM prov_keymgmt[] = {
+	{"RSA:rsaEncryption:1.2.840.113549.1.1.1", PKCS11_PROVIDER_PROPS,
+		prov_rsa_keymgmt_functions, "PKCS#11 RSA key"},
+#ifndef OPENSSL_NO_EC
+	{"EC:id-ecPublicKey:1.2.840.10045.2.1", PKCS11_PROVIDER_PROPS,
+		prov_ec_keymgmt_functions, "PKCS#11 EC key"},
+#endif
+	{NULL, NULL, NULL, NULL}
+};
+
+static const OSSL_ALGORITHM prov_signature[] = {
+	{"RSA:rsaEncryption:1.2.840.113549.1.1.1", PKCS11_PROVIDER_PROPS,
+		prov_rsa_signature_functions, "PKCS#11 RSA signature"},
+#ifndef OPENSSL_NO_EC
+	{"ECDSA", PKCS11_PROVIDER_PROPS,
+		prov_ecdsa_signature_functions, "PKCS#11 ECDSA signature"},
+#endif
+	{NULL, NULL, NULL, NULL}
+};
+
+static const OSSL_ALGORITHM prov_asym_cipher[] = {
+	{"RSA:rsaEncryption:1.2.840.113549.1.1.1", PKCS11_PROVIDER_PROPS,
+		prov_rsa_asym_cipher_functions, "PKCS#11 RSA decryption"},
+	{NULL, NULL, NULL, NULL}
+};
+
+#ifndef OPENSSL_NO_EC
+static const OSSL_ALGORITHM prov_keyexch[] = {
+	{"ECDH", PKCS11_PROVIDER_PROPS,
+		prov_ecdh_keyexch_functions, "PKCS#11 ECDH key exchange"},
+	{NULL, NULL, NULL, NULL}
+};
+#endif
+
+static const OSSL_ALGORITHM prov_store[] = {
+	{"pkcs11", PKCS11_PROVIDER_PROPS,
+		prov_store_functions, "PKCS#11 URI store"},
+	{NULL, NULL, NULL, NULL}
+};
+
+/******************************************************************************/
+/* Passphrase callback                                                        */
+/******************************************************************************/
+
+/* Read the PIN with the passphrase callback passed to the store */
+static int prov_ui_read(UI *ui, UI_STRING *uis)
+{
+	PROV_PASSPHRASE *pass = UI_get0_user_data(ui);
+	char buf[MAX_PIN_LENGTH + 1];
+	OSSL_PARAM params[2];
+	size_t len = 0;
+	int rv;
+
+	if (UI_get_string_type(uis) != UIT_PROMPT)
+		return 1;
+	if (!pass || !pass->cb)
+		return 0;
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_PASSPHRASE_PARAM_INFO,
+		(char *)UI_get0_output_string(uis), 0);
+	params[1] = OSSL_PARAM_construct_end();
+	if (!pass->cb(buf, MAX_PIN_LENGTH, &len, params, pass->arg))
+		return 0;
+	buf[len] = '\0';
+	rv = UI_set_result_ex(ui, uis, buf, (int)len) == 0;
+	OPENSSL_cleanse(buf, sizeof(buf));
+	return rv;
+}
+
+/******************************************************************************/
+/* Provider functions                                                         */
+/******************************************************************************/
+
+static const OSSL_PARAM *prov_gettable_params(void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_utf8_ptr(OSSL_PROV_PARAM_NAME, NULL, 0),
+		OSSL_PARAM_utf8_ptr(OSSL_PROV_PARAM_VERSION, NULL, 0),
+		OSSL_PARAM_utf8_ptr(OSSL_PROV_PARAM_BUILDINFO, NULL, 0),
+		OSSL_PARAM_int(OSSL_PROV_PARAM_STATUS, NULL),
+		OSSL_PARAM_END
+	};
+
+	(void)provctx;
+	return params;
+}
+
+static int prov_get_params(void *provctx, OSSL_PARAM params[])
+{
+	OSSL_PARAM *p;
+
+	(void)provctx;
+	p = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_NAME);
+	if (p && !OSSL_PARAM_set_utf8_ptr(p, PKCS11_PROVIDER_NAME))
+		return 0;
+	p = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_VERSION);
+	if (p && !OSSL_PARAM_set_utf8_ptr(p, PACKAGE_VERSION))
+		return 0;
+	p = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_BUILDINFO);
+	if (p && !OSSL_PARAM_set_utf8_ptr(p, PACKAGE_STRING))
+		return 0;
+	p = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_STATUS);
+	if (p && !OSSL_PARAM_set_int(p, 1))
+		return 0;
+	return 1;
+}
+
+static const OSSL_ALGORITHM *prov_query_operation(void *provctx,
+		int operation_id, int *no_cache)
+{
+	(void)provctx;
+	*no_cache = 0;
+	switch (operation_id) {
+	case OSSL_OP_KEYMGMT:
+		return prov_keymgmt;
+	case OSSL_OP_SIGNATURE:
+		return prov_signature;
+	case OSSL_OP_ASYM_CIPHER:
+		return prov_asym_cipher;
+#ifndef OPENSSL_NO_EC
+	case OSSL_OP_KEYEXCH:
+		return prov_keyexch;
+#endif
+	case OSSL_OP_STORE:
+		return prov_store;
+	}
+	return NULL;
+}
+
+static void prov_teardown(void *vctx)
+{
+	PROV_CTX *provctx = vctx;
+
+	if (!provctx)
+		return;
+	if (provctx->ctx) {
+		ctx_finish(provctx->ctx);
+		ctx_destroy(provctx->ctx);
+	}
+	if (provctx->ui_method)
+		UI_destroy_method(provctx->ui_method);
+	OSSL_LIB_CTX_free(provctx->libctx);
+	OPENSSL_free(provctx);
+	ERR_unload_ENG_strings();
+}
+
+static const OSSL_DISPATCH prov_dispatch[] = {
+	{OSSL_FUNC_PROVIDER_TEARDOWN, (void (*)(void))prov_teardown},
+	{OSSL_FUNC_PROVIDER_GETTABLE_PARAMS,
+		(void (*)(void))prov_gettable_params},
+	{OSSL_FUNC_PROVIDER_GET_PARAMS, (void (*)(void))prov_get_params},
+	{OSSL_FUNC_PROVIDER_QUERY_OPERATION,
+		(void (*)(void))prov_query_operation},
+	{0, NULL}
+};
+
+/* Apply the engine control commands of the provider configuration */
+static int prov_configure(PROV_CTX *provctx,
+		OSSL_FUNC_core_get_params_fn *core_get_params)
+{
+	const ENGINE_CMD_DEFN *defn;
+	OSSL_PARAM params[2];
+	char *value;
+
+	if (!core_get_params)
+		return 1;
+	for (defn = prov_cmd_defns; defn->cmd_num; defn++) {
+		value = NULL;
+		params[0] = OSSL_PARAM_construct_utf8_ptr(defn->cmd_name, &value, 0);
+		params[1] = OSSL_PARAM_construct_end();
+		if (!core_get_params(provctx->handle, params) || !value)
+			continue;
+		switch (defn->cmd_flags) {
+		case ENGINE_CMD_FLAG_STRING:
+			if (!ctx_engine_ctrl(provctx->ctx, defn->cmd_num, 0, value, NULL))
+				return 0;
+			break;
+		case ENGINE_CMD_FLAG_NUMERIC:
+			if (!ctx_engine_ctrl(provctx->ctx, defn->cmd_num,
+					strtol(value, NULL, 0), NULL, NULL))
+				return 0;
+			break;
+		case ENGINE_CMD_FLAG_NO_INPUT:
+			if (!strcmp(value, "0") || !strcmp(value, "no"))
+				break;
+			if (!ctx_engine_ctrl(provctx->ctx, defn->cmd_num, 0, NULL, NULL))
+				return 0;
+			break;
+		}
+	}
+	return 1;
+}
+
+int OSSL_provider_init(const OSSL_CORE_HANDLE *handle,
+		const OSSL_DISPATCH *in, const OSSL_DISPATCH **out, void **vctx)
+{
+	OSSL_FUNC_core_get_params_fn *core_get_params = NULL;
+	const OSSL_DISPATCH *fn;
+	PROV_CTX *provctx;
+
+	for (fn = in; fn->function_id; fn++) {
+		if (fn->function_id == OSSL_FUNC_CORE_GET_PARAMS)
+			core_get_params = OSSL_FUNC_core_get_params(fn);
+	}
+
+	provctx = OPENSSL_zalloc(sizeof(PROV_CTX));
+	if (!provctx)
+		return 0;
+	provctx->handle = handle;
+	ERR_load_ENG_strings();
+	provctx->libctx = OSSL_LIB_CTX_new_child(handle, in);
+	provctx->ctx = ctx_new();
+	provctx->ui_method = UI_create_method("PKCS#11 provider");
+	if (!provctx->libctx || !provctx->ctx || !provctx->ui_method ||
+			UI_method_set_reader(provctx->ui_method, prov_ui_read) ||
+			!prov_configure(provctx, core_get_params) ||
+			!ctx_init(provctx->ctx)) {
+		prov_teardown(provctx);
+		return 0;
+	}
+	*out = prov_dispatch;
+	*vctx = provctx;
+	return 1;
+}
+
+/* vim: set noexpandtab: */
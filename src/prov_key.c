@@ -0,0 +1,1635 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * This file implements the key management, signature, asymmetric cipher
+ * and key exchange operations of the provider.  The private key operations
+ * are performed with pkcs11_private_op() in the session pool of the key,
+ * and the public key operations by OpenSSL with the public components.
+ */
+
+#include "provider.h"
+#include <string.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <openssl/rand.h>
+#include <openssl/param_build.h>
+#ifndef OPENSSL_NO_EC
+#include <openssl/ec.h>
+#endif
+
+/* The length of the TLS pre-master secret decrypted with RSA */
+#define TLS_PREMASTER_LENGTH 48
+
+/******************************************************************************/
+/* Key objects                                                                */
+/******************************************************************************/
+
+PROV_KEY *prov_key_new(PROV_CTX *provctx, int type, EVP_PKEY *pkey)
+{
+	PROV_KEY *key;
+
+	key = OPENSSL_zalloc(sizeof(PROV_KEY));
+	if (!key)
+		return NULL;
+	key->provctx = provctx;
+	key->refs = 1;
+	key->type = type;
+	key->pkey = pkey;
+	return key;
+}
+
+void prov_key_free(PROV_KEY *key)
+{
+	if (!key || p11_atomic_add(&key->refs, -1) > 0)
+		return;
+	EVP_PKEY_free(key->pkey);
+	OPENSSL_free(key);
+}
+
+static PROV_KEY *prov_key_up_ref(PROV_KEY *key)
+{
+	if (key)
+		p11_atomic_add(&key->refs, 1);
+	return key;
+}
+
+/* The libp11 private key object, or NULL for the public keys */
+PKCS11_KEY *prov_key_object(const PROV_KEY *key)
+{
+	PKCS11_KEY *obj = NULL;
+	const RSA *rsa;
+#ifndef OPENSSL_NO_EC
+	EC_KEY *ec;
+#endif
+
+	if (!key || !key->token)
+		return NULL;
+	switch (key->type) {
+	case EVP_PKEY_RSA:
+		rsa = EVP_PKEY_get0_RSA(key->pkey);
+		if (rsa)
+			obj = pkcs11_get_ex_data_rsa(rsa);
+		break;
+#ifndef OPENSSL_NO_EC
+	case EVP_PKEY_EC:
+		ec = (EC_KEY *)EVP_PKEY_get0_EC_KEY(key->pkey);
+		if (ec)
+			obj = pkcs11_get_ex_data_ec(ec);
+		break;
+#endif
+	}
+	if (!obj || check_key_fork(obj) < 0)
+		return NULL;
+	return obj;
+}
+
+/******************************************************************************/
+/* Key management                                                             */
+/******************************************************************************/
+
+static void *prov_rsa_new(void *provctx)
+{
+	return prov_key_new(provctx, EVP_PKEY_RSA, NULL);
+}
+
+static void prov_keymgmt_free(void *keydata)
+{
+	prov_key_free(keydata);
+}
+
+/* The reference passed by prov_store_load() is the address of the key */
+static void *prov_keymgmt_load(const void *reference, size_t reference_sz,
+		int type)
+{
+	PROV_KEY *key;
+
+	if (!reference || reference_sz != sizeof(key))
+		return NULL;
+	key = *(PROV_KEY **)reference;
+	if (!key || key->type != type)
+		return NULL;
+	return prov_key_up_ref(key);
+}
+
+static void *prov_rsa_load(const void *reference, size_t reference_sz)
+{
+	return prov_keymgmt_load(reference, reference_sz, EVP_PKEY_RSA);
+}
+
+static int prov_keymgmt_has(const void *keydata, int selection)
+{
+	const PROV_KEY *key = keydata;
+
+	if (!key)
+		return 0;
+	if ((selection & OSSL_KEYMGMT_SELECT_KEYPAIR) && !key->pkey)
+		return 0;
+	if ((selection & OSSL_KEYMGMT_SELECT_PRIVATE_KEY) && !key->token)
+		return 0;
+	return 1;
+}
+
+static int prov_keymgmt_match(const void *keydata1, const void *keydata2,
+		int selection)
+{
+	const PROV_KEY *key1 = keydata1, *key2 = keydata2;
+
+	(void)selection;
+	if (!key1->pkey || !key2->pkey)
+		return 0;
+	return EVP_PKEY_eq(key1->pkey, key2->pkey) == 1;
+}
+
+static int prov_keymgmt_get_params(PROV_KEY *key, OSSL_PARAM params[])
+{
+	OSSL_PARAM *p;
+
+	if (!key->pkey)
+		return 0;
+	p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_BITS);
+	if (p && !OSSL_PARAM_set_int(p, EVP_PKEY_get_bits(key->pkey)))
+		return 0;
+	p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_SECURITY_BITS);
+	if (p && !OSSL_PARAM_set_int(p, EVP_PKEY_get_security_bits(key->pkey)))
+		return 0;
+	p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_MAX_SIZE);
+	if (p && !OSSL_PARAM_set_int(p, EVP_PKEY_get_size(key->pkey)))
+		return 0;
+	p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_DEFAULT_DIGEST);
+	if (p && !OSSL_PARAM_set_utf8_string(p, "SHA256"))
+		return 0;
+	return 1;
+}
+
+static int prov_rsa_get_params(void *keydata, OSSL_PARAM params[])
+{
+	PROV_KEY *key = keydata;
+	const BIGNUM *n, *e;
+	OSSL_PARAM *p;
+
+	if (!prov_keymgmt_get_params(key, params))
+		return 0;
+	RSA_get0_key(EVP_PKEY_get0_RSA(key->pkey), &n, &e, NULL);
+	p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_RSA_N);
+	if (p && !OSSL_PARAM_set_BN(p, n))
+		return 0;
+	p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_RSA_E);
+	if (p && !OSSL_PARAM_set_BN(p, e))
+		return 0;
+	return 1;
+}
+
+static const OSSL_PARAM *prov_rsa_gettable_params(void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_int(OSSL_PKEY_PARAM_BITS, NULL),
+		OSSL_PARAM_int(OSSL_PKEY_PARAM_SECURITY_BITS, NULL),
+		OSSL_PARAM_int(OSSL_PKEY_PARAM_MAX_SIZE, NULL),
+		OSSL_PARAM_utf8_string(OSSL_PKEY_PARAM_DEFAULT_DIGEST, NULL, 0),
+		OSSL_PARAM_BN(OSSL_PKEY_PARAM_RSA_N, NULL, 0),
+		OSSL_PARAM_BN(OSSL_PKEY_PARAM_RSA_E, NULL, 0),
+		OSSL_PARAM_END
+	};
+
+	(void)provctx;
+	return params;
+}
+
+static const OSSL_PARAM *prov_rsa_key_types(int selection)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_BN(OSSL_PKEY_PARAM_RSA_N, NULL, 0),
+		OSSL_PARAM_BN(OSSL_PKEY_PARAM_RSA_E, NULL, 0),
+		OSSL_PARAM_END
+	};
+
+	return (selection & OSSL_KEYMGMT_SELECT_PUBLIC_KEY) ? params : NULL;
+}
+
+/* Only the public components are imported, e.g. to verify signatures */
+static int prov_rsa_import(void *keydata, int selection,
+		const OSSL_PARAM params[])
+{
+	PROV_KEY *key = keydata;
+	BIGNUM *n = NULL, *e = NULL;
+	EVP_PKEY *pkey;
+	RSA *rsa;
+	const OSSL_PARAM *p;
+
+	if (!key || key->pkey || !(selection & OSSL_KEYMGMT_SELECT_PUBLIC_KEY))
+		return 0;
+	p = OSSL_PARAM_locate_const(params, OSSL_PKEY_PARAM_RSA_N);
+	if (!p || !OSSL_PARAM_get_BN(p, &n))
+		goto err;
+	p = OSSL_PARAM_locate_const(params, OSSL_PKEY_PARAM_RSA_E);
+	if (!p || !OSSL_PARAM_get_BN(p, &e))
+		goto err;
+	rsa = RSA_new();
+	if (!rsa)
+		goto err;
+	if (!RSA_set0_key(rsa, n, e, NULL)) {
+		RSA_free(rsa);
+		goto err;
+	}
+	pkey = EVP_PKEY_new();
+	if (!pkey || !EVP_PKEY_assign_RSA(pkey, rsa)) {
+		EVP_PKEY_free(pkey);
+		RSA_free(rsa);
+		return 0;
+	}
+	key->pkey = pkey;
+	return 1;
+
+err:
+	BN_free(n);
+	BN_free(e);
+	return 0;
+}
+
+/* The private key components never leave the token */
+static int prov_rsa_export(void *keydata, int selection,
+		OSSL_CALLBACK *param_cb, void *cbarg)
+{
+	PROV_KEY *key = keydata;
+	OSSL_PARAM_BLD *bld;
+	OSSL_PARAM *params = NULL;
+	const BIGNUM *n, *e;
+	int rv = 0;
+
+	if (!key || !key->pkey || !(selection & OSSL_KEYMGMT_SELECT_PUBLIC_KEY))
+		return 0;
+	/* Keep the operations with the private keys in this provider */
+	if (key->token && (selection & OSSL_KEYMGMT_SELECT_PRIVATE_KEY))
+		return 0;
+	RSA_get0_key(EVP_PKEY_get0_RSA(key->pkey), &n, &e, NULL);
+	bld = OSSL_PARAM_BLD_new();
+	if (!bld)
+		return 0;
+	if (OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_N, n) &&
+			OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_E, e))
+		params = OSSL_PARAM_BLD_to_param(bld);
+	if (params)
+		rv = param_cb(params, cbarg);
+	OSSL_PARAM_free(params);
+	OSSL_PARAM_BLD_free(bld);
+	return rv;
+}
+
+static const char *prov_rsa_query_operation_name(int operation_id)
+{
+	(void)operation_id;
+	return "RSA";
+}
+
+const OSSL_DISPATCH prov_rsa_keymgmt_functions[] = {
+	{OSSL_FUNC_KEYMGMT_NEW, (void (*)(void))prov_rsa_new},
+	{OSSL_FUNC_KEYMGMT_FREE, (void (*)(void))prov_keymgmt_free},
+	{OSSL_FUNC_KEYMGMT_LOAD, (void (*)(void))prov_rsa_load},
+	{OSSL_FUNC_KEYMGMT_HAS, (void (*)(void))prov_keymgmt_has},
+	{OSSL_FUNC_KEYMGMT_MATCH, (void (*)(void))prov_keymgmt_match},
+	{OSSL_FUNC_KEYMGMT_GET_PARAMS, (void (*)(void))prov_rsa_get_params},
+	{OSSL_FUNC_KEYMGMT_GETTABLE_PARAMS,
+		(void (*)(void))prov_rsa_gettable_params},
+	{OSSL_FUNC_KEYMGMT_IMPORT, (void (*)(void))prov_rsa_import},
+	{OSSL_FUNC_KEYMGMT_IMPORT_TYPES, (void (*)(void))prov_rsa_key_types},
+	{OSSL_FUNC_KEYMGMT_EXPORT, (void (*)(void))prov_rsa_export},
+	{OSSL_FUNC_KEYMGMT_EXPORT_TYPES, (void (*)(void))prov_rsa_key_types},
+	{OSSL_FUNC_KEYMGMT_QUERY_OPERATION_NAME,
+		(void (*)(void))prov_rsa_query_operation_name},
+	{0, NULL}
+};
+
+#ifndef OPENSSL_NO_EC
+
+static void *prov_ec_new(void *provctx)
+{
+	return prov_key_new(provctx, EVP_PKEY_EC, NULL);
+}
+
+static void *prov_ec_load(const void *reference, size_t reference_sz)
+{
+	return prov_keymgmt_load(reference, reference_sz, EVP_PKEY_EC);
+}
+
+/* The uncompressed public point, to be freed with OPENSSL_free() */
+static size_t prov_ec_point(const EC_KEY *ec, unsigned char **buf)
+{
+	return EC_POINT_point2buf(EC_KEY_get0_group(ec),
+		EC_KEY_get0_public_key(ec), POINT_CONVERSION_UNCOMPRESSED,
+		buf, NULL);
+}
+
+static int prov_ec_get_params(void *keydata, OSSL_PARAM params[])
+{
+	PROV_KEY *key = keydata;
+	const EC_KEY *ec;
+	unsigned char *buf = NULL;
+	size_t len;
+	OSSL_PARAM *p;
+	int rv = 1;
+
+	if (!prov_keymgmt_get_params(key, params))
+		return 0;
+	ec = EVP_PKEY_get0_EC_KEY(key->pkey);
+	p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_GROUP_NAME);
+	if (p && !OSSL_PARAM_set_utf8_string(p, OSSL_EC_curve_nid2name(
+			EC_GROUP_get_curve_name(EC_KEY_get0_group(ec)))))
+		return 0;
+	if (!OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_PUB_KEY) &&
+			!OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_ENCODED_PUBLIC_KEY))
+		return 1;
+	len = prov_ec_point(ec, &buf);
+	if (len == 0)
+		return 0;
+	p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_PUB_KEY);
+	if (p && !OSSL_PARAM_set_octet_string(p, buf, len))
+		rv = 0;
+	p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_ENCODED_PUBLIC_KEY);
+	if (p && !OSSL_PARAM_set_octet_string(p, buf, len))
+		rv = 0;
+	OPENSSL_free(buf);
+	return rv;
+}
+
+static const OSSL_PARAM *prov_ec_gettable_params(void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_int(OSSL_PKEY_PARAM_BITS, NULL),
+		OSSL_PARAM_int(OSSL_PKEY_PARAM_SECURITY_BITS, NULL),
+		OSSL_PARAM_int(OSSL_PKEY_PARAM_MAX_SIZE, NULL),
+		OSSL_PARAM_utf8_string(OSSL_PKEY_PARAM_DEFAULT_DIGEST, NULL, 0),
+		OSSL_PARAM_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME, NULL, 0),
+		OSSL_PARAM_octet_string(OSSL_PKEY_PARAM_PUB_KEY, NULL, 0),
+		OSSL_PARAM_octet_string(OSSL_PKEY_PARAM_ENCODED_PUBLIC_KEY, NULL, 0),
+		OSSL_PARAM_END
+	};
+
+	(void)provctx;
+	return params;
+}
+
+static const OSSL_PARAM *prov_ec_key_types(int selection)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME, NULL, 0),
+		OSSL_PARAM_octet_string(OSSL_PKEY_PARAM_PUB_KEY, NULL, 0),
+		OSSL_PARAM_END
+	};
+
+	return (selection & OSSL_KEYMGMT_SELECT_PUBLIC_KEY) ? params : NULL;
+}
+
+/* Only the public components are imported, e.g. of the ECDH peer keys */
+static int prov_ec_import(void *keydata, int selection,
+		const OSSL_PARAM params[])
+{
+	PROV_KEY *key = keydata;
+	const OSSL_PARAM *p;
+	const char *name;
+	const void *buf;
+	size_t len;
+	EC_KEY *ec;
+	EC_POINT *point;
+	EVP_PKEY *pkey;
+	int nid;
+
+	if (!key || key->pkey || !(selection & OSSL_KEYMGMT_SELECT_PUBLIC_KEY))
+		return 0;
+	p = OSSL_PARAM_locate_const(params, OSSL_PKEY_PARAM_GROUP_NAME);
+	if (!p || !OSSL_PARAM_get_utf8_string_ptr(p, &name))
+		return 0;
+	nid = OBJ_txt2nid(name);
+	if (nid == NID_undef)
+		nid = EC_curve_nist2nid(name);
+	p = OSSL_PARAM_locate_const(params, OSSL_PKEY_PARAM_PUB_KEY);
+	if (nid == NID_undef || !p ||
+			!OSSL_PARAM_get_octet_string_ptr(p, &buf, &len))
+		return 0;
+	ec = EC_KEY_new_by_curve_name(nid);
+	if (!ec)
+		return 0;
+	point = EC_POINT_new(EC_KEY_get0_group(ec));
+	if (!point || !EC_POINT_oct2point(EC_KEY_get0_group(ec),
+			point, buf, len, NULL) ||
+			!EC_KEY_set_public_key(ec, point)) {
+		EC_POINT_free(point);
+		EC_KEY_free(ec);
+		return 0;
+	}
+	EC_POINT_free(point);
+	pkey = EVP_PKEY_new();
+	if (!pkey || !EVP_PKEY_assign_EC_KEY(pkey, ec)) {
+		EVP_PKEY_free(pkey);
+		EC_KEY_free(ec);
+		return 0;
+	}
+	key->pkey = pkey;
+	return 1;
+}
+
+static int prov_ec_export(void *keydata, int selection,
+		OSSL_CALLBACK *param_cb, void *cbarg)
+{
+	PROV_KEY *key = keydata;
+	OSSL_PARAM_BLD *bld;
+	OSSL_PARAM *params = NULL;
+	const EC_KEY *ec;
+	unsigned char *buf = NULL;
+	size_t len;
+	int rv = 0;
+
+	if (!key || !key->pkey || !(selection & OSSL_KEYMGMT_SELECT_PUBLIC_KEY))
+		return 0;
+	if (key->token && (selection & OSSL_KEYMGMT_SELECT_PRIVATE_KEY))
+		return 0;
+	ec = EVP_PKEY_get0_EC_KEY(key->pkey);
+	len = prov_ec_point(ec, &buf);
+	if (len == 0)
+		return 0;
+	bld = OSSL_PARAM_BLD_new();
+	if (bld && OSSL_PARAM_BLD_push_utf8_string(bld,
+				OSSL_PKEY_PARAM_GROUP_NAME, OSSL_EC_curve_nid2name(
+				EC_GROUP_get_curve_name(EC_KEY_get0_group(ec))), 0) &&
+			OSSL_PARAM_BLD_push_octet_string(bld,
+				OSSL_PKEY_PARAM_PUB_KEY, buf, len))
+		params = OSSL_PARAM_BLD_to_param(bld);
+	if (params)
+		rv = param_cb(params, cbarg);
+	OSSL_PARAM_free(params);
+	OSSL_PARAM_BLD_free(bld);
+	OPENSSL_free(buf);
+	return rv;
+}
+
+static const char *prov_ec_query_operation_name(int operation_id)
+{
+	switch (operation_id) {
+	case OSSL_OP_SIGNATURE:
+		return "ECDSA";
+	case OSSL_OP_KEYEXCH:
+		return "ECDH";
+	}
+	return NULL;
+}
+
+const OSSL_DISPATCH prov_ec_keymgmt_functions[] = {
+	{OSSL_FUNC_KEYMGMT_NEW, (void (*)(void))prov_ec_new},
+	{OSSL_FUNC_KEYMGMT_FREE, (void (*)(void))prov_keymgmt_free},
+	{OSSL_FUNC_KEYMGMT_LOAD, (void (*)(void))prov_ec_load},
+	{OSSL_FUNC_KEYMGMT_HAS, (void (*)(void))prov_keymgmt_has},
+	{OSSL_FUNC_KEYMGMT_MATCH, (void (*)(void))prov_keymgmt_match},
+	{OSSL_FUNC_KEYMGMT_GET_PARAMS, (void (*)(void))prov_ec_get_params},
+	{OSSL_FUNC_KEYMGMT_GETTABLE_PARAMS,
+		(void (*)(void))prov_ec_gettable_params},
+	{OSSL_FUNC_KEYMGMT_IMPORT, (void (*)(void))prov_ec_import},
+	{OSSL_FUNC_KEYMGMT_IMPORT_TYPES, (void (*)(void))prov_ec_key_types},
+	{OSSL_FUNC_KEYMGMT_EXPORT, (void (*)(void))prov_ec_export},
+	{OSSL_FUNC_KEYMGMT_EXPORT_TYPES, (void (*)(void))prov_ec_key_types},
+	{OSSL_FUNC_KEYMGMT_QUERY_OPERATION_NAME,
+		(void (*)(void))prov_ec_query_operation_name},
+	{0, NULL}
+};
+
+#endif /* OPENSSL_NO_EC */
+
+/******************************************************************************/
+/* Parameter helpers                                                          */
+/******************************************************************************/
+
+static const struct {
+	int pad_mode;
+	const char *name;
+} prov_pad_modes[] = {
+	{RSA_PKCS1_PADDING, OSSL_PKEY_RSA_PAD_MODE_PKCSV15},
+	{RSA_NO_PADDING, OSSL_PKEY_RSA_PAD_MODE_NONE},
+	{RSA_PKCS1_OAEP_PADDING, OSSL_PKEY_RSA_PAD_MODE_OAEP},
+	{RSA_PKCS1_PSS_PADDING, OSSL_PKEY_RSA_PAD_MODE_PSS},
+	{0, NULL}
+};
+
+/* The padding mode is passed either as an integer or as a name */
+static int prov_get_pad_mode(const OSSL_PARAM *p, int *pad_mode)
+{
+	int n;
+
+	if (p->data_type == OSSL_PARAM_UTF8_STRING) {
+		for (n = 0; prov_pad_modes[n].name; n++) {
+			if (!strcmp(p->data, prov_pad_modes[n].name)) {
+				*pad_mode = prov_pad_modes[n].pad_mode;
+				return 1;
+			}
+		}
+		return 0;
+	}
+	return OSSL_PARAM_get_int(p, pad_mode);
+}
+
+/* Replace *md with the digest named by the parameter */
+static int prov_get_md(PROV_CTX *provctx, const OSSL_PARAM *p,
+		const char *propq, EVP_MD **md)
+{
+	const char *name;
+	EVP_MD *new_md;
+
+	if (!OSSL_PARAM_get_utf8_string_ptr(p, &name))
+		return 0;
+	new_md = EVP_MD_fetch(provctx->libctx, name, propq);
+	if (!new_md)
+		return 0;
+	EVP_MD_free(*md);
+	*md = new_md;
+	return 1;
+}
+
+static int prov_set_md_name(OSSL_PARAM params[], const char *key,
+		const EVP_MD *md)
+{
+	OSSL_PARAM *p = OSSL_PARAM_locate(params, key);
+
+	if (p && md && !OSSL_PARAM_set_utf8_string(p, EVP_MD_get0_name(md)))
+		return 0;
+	return 1;
+}
+
+static int prov_set_propq(const OSSL_PARAM *p, char **propq)
+{
+	const char *value;
+	char *new_propq;
+
+	if (!OSSL_PARAM_get_utf8_string_ptr(p, &value))
+		return 0;
+	new_propq = OPENSSL_strdup(value);
+	if (!new_propq)
+		return 0;
+	OPENSSL_free(*propq);
+	*propq = new_propq;
+	return 1;
+}
+
+/******************************************************************************/
+/* Signatures                                                                 */
+/******************************************************************************/
+
+typedef struct st_prov_sig_ctx {
+	PROV_CTX *provctx;
+	char *propq;
+	PROV_KEY *key;
+	int pad_mode;
+	int saltlen;
+	EVP_MD *md, *mgf1_md;
+	EVP_MD_CTX *mdctx; /* for the digest sign and verify operations */
+} PROV_SIG_CTX;
+
+static void *prov_sig_newctx(void *provctx, const char *propq)
+{
+	PROV_SIG_CTX *ctx;
+
+	ctx = OPENSSL_zalloc(sizeof(PROV_SIG_CTX));
+	if (!ctx)
+		return NULL;
+	if (propq) {
+		ctx->propq = OPENSSL_strdup(propq);
+		if (!ctx->propq) {
+			OPENSSL_free(ctx);
+			return NULL;
+		}
+	}
+	ctx->provctx = provctx;
+	ctx->pad_mode = RSA_PKCS1_PADDING;
+	ctx->saltlen = RSA_PSS_SALTLEN_AUTO;
+	return ctx;
+}
+
+static void prov_sig_freectx(void *vctx)
+{
+	PROV_SIG_CTX *ctx = vctx;
+
+	if (!ctx)
+		return;
+	EVP_MD_CTX_free(ctx->mdctx);
+	EVP_MD_free(ctx->md);
+	EVP_MD_free(ctx->mgf1_md);
+	prov_key_free(ctx->key);
+	OPENSSL_free(ctx->propq);
+	OPENSSL_free(ctx);
+}
+
+static void *prov_sig_dupctx(void *vctx)
+{
+	PROV_SIG_CTX *src = vctx, *ctx;
+
+	ctx = prov_sig_newctx(src->provctx, src->propq);
+	if (!ctx)
+		return NULL;
+	ctx->key = prov_key_up_ref(src->key);
+	ctx->pad_mode = src->pad_mode;
+	ctx->saltlen = src->saltlen;
+	if ((src->md && !EVP_MD_up_ref(src->md)) ||
+			(src->mgf1_md && !EVP_MD_up_ref(src->mgf1_md))) {
+		prov_sig_freectx(ctx);
+		return NULL;
+	}
+	ctx->md = src->md;
+	ctx->mgf1_md = src->mgf1_md;
+	if (src->mdctx) {
+		ctx->mdctx = EVP_MD_CTX_new();
+		if (!ctx->mdctx || !EVP_MD_CTX_copy_ex(ctx->mdctx, src->mdctx)) {
+			prov_sig_freectx(ctx);
+			return NULL;
+		}
+	}
+	return ctx;
+}
+
+static int prov_sig_set_ctx_params(void *vctx, const OSSL_PARAM params[])
+{
+	PROV_SIG_CTX *ctx = vctx;
+	const OSSL_PARAM *p;
+	const char *value;
+
+	if (!params)
+		return 1;
+	p = OSSL_PARAM_locate_const(params, OSSL_SIGNATURE_PARAM_PROPERTIES);
+	if (p && !prov_set_propq(p, &ctx->propq))
+		return 0;
+	p = OSSL_PARAM_locate_const(params, OSSL_SIGNATURE_PARAM_DIGEST);
+	if (p && !prov_get_md(ctx->provctx, p, ctx->propq, &ctx->md))
+		return 0;
+	p = OSSL_PARAM_locate_const(params, OSSL_SIGNATURE_PARAM_MGF1_DIGEST);
+	if (p && !prov_get_md(ctx->provctx, p, ctx->propq, &ctx->mgf1_md))
+		return 0;
+	p = OSSL_PARAM_locate_const(params, OSSL_SIGNATURE_PARAM_PAD_MODE);
+	if (p && !prov_get_pad_mode(p, &ctx->pad_mode))
+		return 0;
+	p = OSSL_PARAM_locate_const(params, OSSL_SIGNATURE_PARAM_PSS_SALTLEN);
+	if (p) {
+		if (p->data_type != OSSL_PARAM_UTF8_STRING) {
+			if (!OSSL_PARAM_get_int(p, &ctx->saltlen))
+				return 0;
+		} else {
+			value = p->data;
+			if (!strcmp(value, OSSL_PKEY_RSA_PSS_SALT_LEN_DIGEST))
+				ctx->saltlen = RSA_PSS_SALTLEN_DIGEST;
+			else if (!strcmp(value, OSSL_PKEY_RSA_PSS_SALT_LEN_MAX))
+				ctx->saltlen = RSA_PSS_SALTLEN_MAX;
+			else if (!strcmp(value, OSSL_PKEY_RSA_PSS_SALT_LEN_AUTO))
+				ctx->saltlen = RSA_PSS_SALTLEN_AUTO;
+			else
+				ctx->saltlen = atoi(value);
+		}
+	}
+	return 1;
+}
+
+static const OSSL_PARAM *prov_rsa_sig_settable_ctx_params(void *vctx,
+		void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_DIGEST, NULL, 0),
+		OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_PROPERTIES, NULL, 0),
+		OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_PAD_MODE, NULL, 0),
+		OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_PSS_SALTLEN, NULL, 0),
+		OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_MGF1_DIGEST, NULL, 0),
+		OSSL_PARAM_END
+	};
+
+	(void)vctx;
+	(void)provctx;
+	return params;
+}
+
+/* DER-encoded AlgorithmIdentifier of the PKCS#1 v1.5 and ECDSA signatures */
+static int prov_sig_get_algorithm_id(PROV_SIG_CTX *ctx, OSSL_PARAM *p)
+{
+	X509_ALGOR *algor;
+	unsigned char *der = NULL;
+	int nid, len, rv = 0;
+
+	if (!ctx->md || !ctx->key || (ctx->key->type == EVP_PKEY_RSA &&
+			ctx->pad_mode != RSA_PKCS1_PADDING))
+		return 1; /* not available */
+	if (!OBJ_find_sigid_by_algs(&nid, EVP_MD_get_type(ctx->md),
+			EVP_PKEY_get_base_id(ctx->key->pkey)))
+		return 1;
+	algor = X509_ALGOR_new();
+	if (!algor)
+		return 0;
+	if (X509_ALGOR_set0(algor, OBJ_nid2obj(nid),
+			ctx->key->type == EVP_PKEY_RSA ? V_ASN1_NULL : V_ASN1_UNDEF,
+			NULL)) {
+		len = i2d_X509_ALGOR(algor, &der);
+		if (len > 0)
+			rv = OSSL_PARAM_set_octet_string(p, der, len);
+	}
+	OPENSSL_free(der);
+	X509_ALGOR_free(algor);
+	return rv;
+}
+
+static int prov_sig_get_ctx_params(void *vctx, OSSL_PARAM params[])
+{
+	PROV_SIG_CTX *ctx = vctx;
+	OSSL_PARAM *p;
+
+	p = OSSL_PARAM_locate(params, OSSL_SIGNATURE_PARAM_ALGORITHM_ID);
+	if (p && !prov_sig_get_algorithm_id(ctx, p))
+		return 0;
+	if (!prov_set_md_name(params, OSSL_SIGNATURE_PARAM_DIGEST, ctx->md))
+		return 0;
+	if (ctx->key && ctx->key->type != EVP_PKEY_RSA)
+		return 1;
+	p = OSSL_PARAM_locate(params, OSSL_SIGNATURE_PARAM_PAD_MODE);
+	if (p && !OSSL_PARAM_set_int(p, ctx->pad_mode))
+		return 0;
+	p = OSSL_PARAM_locate(params, OSSL_SIGNATURE_PARAM_PSS_SALTLEN);
+	if (p && !OSSL_PARAM_set_int(p, ctx->saltlen))
+		return 0;
+	return prov_set_md_name(params, OSSL_SIGNATURE_PARAM_MGF1_DIGEST,
+		ctx->mgf1_md);
+}
+
+static const OSSL_PARAM *prov_rsa_sig_gettable_ctx_params(void *vctx,
+		void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_octet_string(OSSL_SIGNATURE_PARAM_ALGORITHM_ID, NULL, 0),
+		OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_DIGEST, NULL, 0),
+		OSSL_PARAM_int(OSSL_SIGNATURE_PARAM_PAD_MODE, NULL),
+		OSSL_PARAM_int(OSSL_SIGNATURE_PARAM_PSS_SALTLEN, NULL),
+		OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_MGF1_DIGEST, NULL, 0),
+		OSSL_PARAM_END
+	};
+
+	(void)vctx;
+	(void)provctx;
+	return params;
+}
+
+static int prov_sig_init(void *vctx, void *provkey, const OSSL_PARAM params[])
+{
+	PROV_SIG_CTX *ctx = vctx;
+
+	if (provkey) {
+		prov_key_free(ctx->key);
+		ctx->key = prov_key_up_ref(provkey);
+	}
+	if (!ctx->key || !ctx->key->pkey)
+		return 0;
+	return prov_sig_set_ctx_params(ctx, params);
+}
+
+/* Salt lengths as expected by CKM_RSA_PKCS_PSS */
+static int prov_sig_pss_params(PROV_SIG_CTX *ctx,
+		CK_RSA_PKCS_PSS_PARAMS *pss)
+{
+	const EVP_MD *mgf1_md = ctx->mgf1_md ? ctx->mgf1_md : ctx->md;
+	EVP_PKEY *pkey = ctx->key->pkey;
+	int saltlen = ctx->saltlen;
+
+	if (!ctx->md)
+		return -1;
+	switch (saltlen) {
+	case RSA_PSS_SALTLEN_DIGEST:
+		saltlen = EVP_MD_get_size(ctx->md);
+		break;
+	case RSA_PSS_SALTLEN_AUTO:
+	case RSA_PSS_SALTLEN_MAX:
+		saltlen = EVP_PKEY_get_size(pkey) - EVP_MD_get_size(ctx->md) - 2;
+		if (((EVP_PKEY_get_bits(pkey) - 1) & 0x7) == 0)
+			saltlen--;
+		break;
+	}
+	if (saltlen < 0)
+		return -1;
+	memset(pss, 0, sizeof(CK_RSA_PKCS_PSS_PARAMS));
+	pss->hashAlg = pkcs11_md2ckm(ctx->md);
+	pss->mgf = pkcs11_md2ckg(mgf1_md);
+	if (!pss->hashAlg || !pss->mgf)
+		return -1;
+	pss->sLen = saltlen;
+	return 0;
+}
+
+static int prov_rsa_sign(PROV_SIG_CTX *ctx, PKCS11_KEY *obj,
+		unsigned char *sig, size_t *siglen, size_t sigsize,
+		const unsigned char *tbs, size_t tbslen)
+{
+	CK_MECHANISM mechanism;
+	CK_RSA_PKCS_PSS_PARAMS pss;
+	CK_ULONG size = sigsize;
+	unsigned char *der = NULL;
+	int len;
+	CK_RV rv;
+
+	memset(&mechanism, 0, sizeof(mechanism));
+	switch (ctx->pad_mode) {
+	case RSA_PKCS1_PADDING:
+		mechanism.mechanism = CKM_RSA_PKCS;
+		/* The TLS 1.0 MD5+SHA1 digest is signed without a DigestInfo */
+		if (!ctx->md || EVP_MD_get_type(ctx->md) == NID_md5_sha1)
+			break;
+		if (tbslen != (size_t)EVP_MD_get_size(ctx->md))
+			return 0;
+		len = pkcs11_digest_info(EVP_MD_get_type(ctx->md),
+			tbs, (unsigned int)tbslen, &der);
+		if (len <= 0)
+			return 0;
+		tbs = der;
+		tbslen = len;
+		break;
+	case RSA_NO_PADDING:
+		mechanism.mechanism = CKM_RSA_X_509;
+		break;
+	case RSA_PKCS1_PSS_PADDING:
+		if (prov_sig_pss_params(ctx, &pss) < 0 ||
+				tbslen != (size_t)EVP_MD_get_size(ctx->md))
+			return 0;
+		mechanism.mechanism = CKM_RSA_PKCS_PSS;
+		mechanism.pParameter = &pss;
+		mechanism.ulParameterLen = sizeof(pss);
+		break;
+	default:
+		P11err(P11_F_PKCS11_MECHANISM, P11_R_UNSUPPORTED_PADDING_TYPE);
+		return 0;
+	}
+
+	rv = pkcs11_private_op(obj, PKCS11_OP_SIGN, &mechanism,
+		tbs, tbslen, sig, &size);
+	OPENSSL_free(der);
+	if (rv != CKR_OK) {
+		CKRerr(CKR_F_PKCS11_PRIVATE_ENCRYPT, rv);
+		return 0;
+	}
+	*siglen = size;
+	return 1;
+}
+
+#ifndef OPENSSL_NO_EC
+
+/* The raw signature of the token is returned DER-encoded */
+static int prov_ecdsa_sign(PKCS11_KEY *obj,
+		unsigned char *sig, size_t *siglen, size_t sigsize,
+		const unsigned char *tbs, size_t tbslen)
+{
+	unsigned char raw[512]; /* more than enough for any curve */
+	CK_MECHANISM mechanism;
+	CK_ULONG size = sizeof(raw);
+	ECDSA_SIG *ecsig;
+	BIGNUM *r, *s;
+	int len;
+	CK_RV rv;
+
+	if (PRIVKEY(obj)->desc.sig_size)
+		size = PRIVKEY(obj)->desc.sig_size;
+	memset(&mechanism, 0, sizeof(mechanism));
+	mechanism.mechanism = CKM_ECDSA;
+	rv = pkcs11_private_op(obj, PKCS11_OP_SIGN, &mechanism,
+		tbs, tbslen, raw, &size);
+	if (rv != CKR_OK) {
+		CKRerr(CKR_F_PKCS11_ECDSA_SIGN, rv);
+		return 0;
+	}
+
+	ecsig = ECDSA_SIG_new();
+	if (!ecsig)
+		return 0;
+	r = BN_bin2bn(raw, size/2, NULL);
+	s = BN_bin2bn(raw + size/2, size/2, NULL);
+	if (!r || !s || !ECDSA_SIG_set0(ecsig, r, s)) {
+		BN_free(r);
+		BN_free(s);
+		ECDSA_SIG_free(ecsig);
+		return 0;
+	}
+	len = i2d_ECDSA_SIG(ecsig, NULL);
+	if (len > 0 && (size_t)len <= sigsize)
+		len = i2d_ECDSA_SIG(ecsig, &sig);
+	else
+		len = 0;
+	ECDSA_SIG_free(ecsig);
+	if (len <= 0)
+		return 0;
+	*siglen = len;
+	return 1;
+}
+
+#endif /* OPENSSL_NO_EC */
+
+static int prov_sig_sign(void *vctx, unsigned char *sig, size_t *siglen,
+		size_t sigsize, const unsigned char *tbs, size_t tbslen)
+{
+	PROV_SIG_CTX *ctx = vctx;
+	size_t size = EVP_PKEY_get_size(ctx->key->pkey);
+	PKCS11_KEY *obj;
+
+	if (!sig) {
+		*siglen = size;
+		return 1;
+	}
+	obj = prov_key_object(ctx->key);
+	if (!obj)
+		return 0;
+	switch (ctx->key->type) {
+	case EVP_PKEY_RSA:
+		if (sigsize < size)
+			return 0;
+		return prov_rsa_sign(ctx, obj, sig, siglen, sigsize, tbs, tbslen);
+#ifndef OPENSSL_NO_EC
+	case EVP_PKEY_EC:
+		return prov_ecdsa_sign(obj, sig, siglen, sigsize, tbs, tbslen);
+#endif
+	}
+	return 0;
+}
+
+/* The signatures are verified by OpenSSL with the public key components */
+static int prov_rsa_verify(PROV_SIG_CTX *ctx, RSA *rsa,
+		const unsigned char *sig, size_t siglen,
+		const unsigned char *tbs, size_t tbslen)
+{
+	unsigned char *buf;
+	int len, rv = 0;
+
+	if (ctx->pad_mode == RSA_PKCS1_PADDING && ctx->md)
+		return RSA_verify(EVP_MD_get_type(ctx->md), tbs, (unsigned int)tbslen,
+			sig, (unsigned int)siglen, rsa) == 1;
+
+	buf = OPENSSL_malloc(RSA_size(rsa));
+	if (!buf)
+		return 0;
+	switch (ctx->pad_mode) {
+	case RSA_PKCS1_PADDING:
+	case RSA_NO_PADDING:
+		len = RSA_public_decrypt((int)siglen, sig, buf, rsa, ctx->pad_mode);
+		rv = len >= 0 && (size_t)len == tbslen && !memcmp(buf, tbs, tbslen);
+		break;
+	case RSA_PKCS1_PSS_PADDING:
+		if (!ctx->md || tbslen != (size_t)EVP_MD_get_size(ctx->md))
+			break;
+		len = RSA_public_decrypt((int)siglen, sig, buf, rsa, RSA_NO_PADDING);
+		rv = len > 0 && RSA_verify_PKCS1_PSS_mgf1(rsa, tbs, ctx->md,
+			ctx->mgf1_md ? ctx->mgf1_md : ctx->md, buf,
+			ctx->saltlen == RSA_PSS_SALTLEN_MAX ?
+				RSA_PSS_SALTLEN_AUTO : ctx->saltlen) == 1;
+		break;
+	}
+	OPENSSL_free(buf);
+	return rv;
+}
+
+static int prov_sig_verify(void *vctx, const unsigned char *sig, size_t siglen,
+		const unsigned char *tbs, size_t tbslen)
+{
+	PROV_SIG_CTX *ctx = vctx;
+
+	switch (ctx->key->type) {
+	case EVP_PKEY_RSA:
+		return prov_rsa_verify(ctx, (RSA *)EVP_PKEY_get0_RSA(ctx->key->pkey),
+			sig, siglen, tbs, tbslen);
+#ifndef OPENSSL_NO_EC
+	case EVP_PKEY_EC:
+		return ECDSA_verify(0, tbs, (int)tbslen, sig, (int)siglen,
+			(EC_KEY *)EVP_PKEY_get0_EC_KEY(ctx->key->pkey)) == 1;
+#endif
+	}
+	return 0;
+}
+
+static int prov_sig_digest_init(void *vctx, const char *mdname,
+		void *provkey, const OSSL_PARAM params[])
+{
+	PROV_SIG_CTX *ctx = vctx;
+	EVP_MD *md;
+
+	if (!prov_sig_init(ctx, provkey, params))
+		return 0;
+	if (mdname && *mdname) {
+		md = EVP_MD_fetch(ctx->provctx->libctx, mdname, ctx->propq);
+		if (!md)
+			return 0;
+		EVP_MD_free(ctx->md);
+		ctx->md = md;
+	}
+	if (!ctx->md) {
+		ctx->md = EVP_MD_fetch(ctx->provctx->libctx, "SHA256", ctx->propq);
+		if (!ctx->md)
+			return 0;
+	}
+	if (!ctx->mdctx) {
+		ctx->mdctx = EVP_MD_CTX_new();
+		if (!ctx->mdctx)
+			return 0;
+	}
+	return EVP_DigestInit_ex2(ctx->mdctx, ctx->md, NULL);
+}
+
+static int prov_sig_digest_update(void *vctx,
+		const unsigned char *data, size_t datalen)
+{
+	PROV_SIG_CTX *ctx = vctx;
+
+	return ctx->mdctx && EVP_DigestUpdate(ctx->mdctx, data, datalen);
+}
+
+static int prov_sig_digest_sign_final(void *vctx,
+		unsigned char *sig, size_t *siglen, size_t sigsize)
+{
+	PROV_SIG_CTX *ctx = vctx;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int len;
+
+	if (!sig)
+		return prov_sig_sign(ctx, NULL, siglen, sigsize, NULL, 0);
+	if (!ctx->mdctx || !EVP_DigestFinal_ex(ctx->mdctx, digest, &len))
+		return 0;
+	return prov_sig_sign(ctx, sig, siglen, sigsize, digest, len);
+}
+
+static int prov_sig_digest_verify_final(void *vctx,
+		const unsigned char *sig, size_t siglen)
+{
+	PROV_SIG_CTX *ctx = vctx;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int len;
+
+	if (!ctx->mdctx || !EVP_DigestFinal_ex(ctx->mdctx, digest, &len))
+		return 0;
+	return prov_sig_verify(ctx, sig, siglen, digest, len);
+}
+
+const OSSL_DISPATCH prov_rsa_signature_functions[] = {
+	{OSSL_FUNC_SIGNATURE_NEWCTX, (void (*)(void))prov_sig_newctx},
+	{OSSL_FUNC_SIGNATURE_FREECTX, (void (*)(void))prov_sig_freectx},
+	{OSSL_FUNC_SIGNATURE_DUPCTX, (void (*)(void))prov_sig_dupctx},
+	{OSSL_FUNC_SIGNATURE_SIGN_INIT, (void (*)(void))prov_sig_init},
+	{OSSL_FUNC_SIGNATURE_SIGN, (void (*)(void))prov_sig_sign},
+	{OSSL_FUNC_SIGNATURE_VERIFY_INIT, (void (*)(void))prov_sig_init},
+	{OSSL_FUNC_SIGNATURE_VERIFY, (void (*)(void))prov_sig_verify},
+	{OSSL_FUNC_SIGNATURE_DIGEST_SIGN_INIT,
+		(void (*)(void))prov_sig_digest_init},
+	{OSSL_FUNC_SIGNATURE_DIGEST_SIGN_UPDATE,
+		(void (*)(void))prov_sig_digest_update},
+	{OSSL_FUNC_SIGNATURE_DIGEST_SIGN_FINAL,
+		(void (*)(void))prov_sig_digest_sign_final},
+	{OSSL_FUNC_SIGNATURE_DIGEST_VERIFY_INIT,
+		(void (*)(void))prov_sig_digest_init},
+	{OSSL_FUNC_SIGNATURE_DIGEST_VERIFY_UPDATE,
+		(void (*)(void))prov_sig_digest_update},
+	{OSSL_FUNC_SIGNATURE_DIGEST_VERIFY_FINAL,
+		(void (*)(void))prov_sig_digest_verify_final},
+	{OSSL_FUNC_SIGNATURE_GET_CTX_PARAMS,
+		(void (*)(void))prov_sig_get_ctx_params},
+	{OSSL_FUNC_SIGNATURE_GETTABLE_CTX_PARAMS,
+		(void (*)(void))prov_rsa_sig_gettable_ctx_params},
+	{OSSL_FUNC_SIGNATURE_SET_CTX_PARAMS,
+		(void (*)(void))prov_sig_set_ctx_params},
+	{OSSL_FUNC_SIGNATURE_SETTABLE_CTX_PARAMS,
+		(void (*)(void))prov_rsa_sig_settable_ctx_params},
+	{0, NULL}
+};
+
+#ifndef OPENSSL_NO_EC
+
+static const OSSL_PARAM *prov_ecdsa_sig_settable_ctx_params(void *vctx,
+		void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_DIGEST, NULL, 0),
+		OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_PROPERTIES, NULL, 0),
+		OSSL_PARAM_END
+	};
+
+	(void)vctx;
+	(void)provctx;
+	return params;
+}
+
+static const OSSL_PARAM *prov_ecdsa_sig_gettable_ctx_params(void *vctx,
+		void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_octet_string(OSSL_SIGNATURE_PARAM_ALGORITHM_ID, NULL, 0),
+		OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_DIGEST, NULL, 0),
+		OSSL_PARAM_END
+	};
+
+	(void)vctx;
+	(void)provctx;
+	return params;
+}
+
+const OSSL_DISPATCH prov_ecdsa_signature_functions[] = {
+	{OSSL_FUNC_SIGNATURE_NEWCTX, (void (*)(void))prov_sig_newctx},
+	{OSSL_FUNC_SIGNATURE_FREECTX, (void (*)(void))prov_sig_freectx},
+	{OSSL_FUNC_SIGNATURE_DUPCTX, (void (*)(void))prov_sig_dupctx},
+	{OSSL_FUNC_SIGNATURE_SIGN_INIT, (void (*)(void))prov_sig_init},
+	{OSSL_FUNC_SIGNATURE_SIGN, (void (*)(void))prov_sig_sign},
+	{OSSL_FUNC_SIGNATURE_VERIFY_INIT, (void (*)(void))prov_sig_init},
+	{OSSL_FUNC_SIGNATURE_VERIFY, (void (*)(void))prov_sig_verify},
+	{OSSL_FUNC_SIGNATURE_DIGEST_SIGN_INIT,
+		(void (*)(void))prov_sig_digest_init},
+	{OSSL_FUNC_SIGNATURE_DIGEST_SIGN_UPDATE,
+		(void (*)(void))prov_sig_digest_update},
+	{OSSL_FUNC_SIGNATURE_DIGEST_SIGN_FINAL,
+		(void (*)(void))prov_sig_digest_sign_final},
+	{OSSL_FUNC_SIGNATURE_DIGEST_VERIFY_INIT,
+		(void (*)(void))prov_sig_digest_init},
+	{OSSL_FUNC_SIGNATURE_DIGEST_VERIFY_UPDATE,
+		(void (*)(void))prov_sig_digest_update},
+	{OSSL_FUNC_SIGNATURE_DIGEST_VERIFY_FINAL,
+		(void (*)(void))prov_sig_digest_verify_final},
+	{OSSL_FUNC_SIGNATURE_GET_CTX_PARAMS,
+		(void (*)(void))prov_sig_get_ctx_params},
+	{OSSL_FUNC_SIGNATURE_GETTABLE_CTX_PARAMS,
+		(void (*)(void))prov_ecdsa_sig_gettable_ctx_params},
+	{OSSL_FUNC_SIGNATURE_SET_CTX_PARAMS,
+		(void (*)(void))prov_sig_set_ctx_params},
+	{OSSL_FUNC_SIGNATURE_SETTABLE_CTX_PARAMS,
+		(void (*)(void))prov_ecdsa_sig_settable_ctx_params},
+	{0, NULL}
+};
+
+#endif /* OPENSSL_NO_EC */
+
+/******************************************************************************/
+/* RSA encryption and decryption                                              */
+/******************************************************************************/
+
+typedef struct st_prov_cipher_ctx {
+	PROV_CTX *provctx;
+	char *propq;
+	PROV_KEY *key;
+	int pad_mode;
+	EVP_MD *oaep_md, *mgf1_md;
+	unsigned int client_version, alt_version; /* TLS pre-master secret */
+} PROV_CIPHER_CTX;
+
+static void *prov_cipher_newctx(void *provctx)
+{
+	PROV_CIPHER_CTX *ctx;
+
+	ctx = OPENSSL_zalloc(sizeof(PROV_CIPHER_CTX));
+	if (!ctx)
+		return NULL;
+	ctx->provctx = provctx;
+	ctx->pad_mode = RSA_PKCS1_PADDING;
+	return ctx;
+}
+
+static void prov_cipher_freectx(void *vctx)
+{
+	PROV_CIPHER_CTX *ctx = vctx;
+
+	if (!ctx)
+		return;
+	EVP_MD_free(ctx->oaep_md);
+	EVP_MD_free(ctx->mgf1_md);
+	prov_key_free(ctx->key);
+	OPENSSL_free(ctx->propq);
+	OPENSSL_free(ctx);
+}
+
+static void *prov_cipher_dupctx(void *vctx)
+{
+	PROV_CIPHER_CTX *src = vctx, *ctx;
+
+	ctx = prov_cipher_newctx(src->provctx);
+	if (!ctx)
+		return NULL;
+	ctx->key = prov_key_up_ref(src->key);
+	ctx->pad_mode = src->pad_mode;
+	ctx->client_version = src->client_version;
+	ctx->alt_version = src->alt_version;
+	if ((src->propq && !(ctx->propq = OPENSSL_strdup(src->propq))) ||
+			(src->oaep_md && !EVP_MD_up_ref(src->oaep_md)) ||
+			(src->mgf1_md && !EVP_MD_up_ref(src->mgf1_md))) {
+		prov_cipher_freectx(ctx);
+		return NULL;
+	}
+	ctx->oaep_md = src->oaep_md;
+	ctx->mgf1_md = src->mgf1_md;
+	return ctx;
+}
+
+static int prov_cipher_set_ctx_params(void *vctx, const OSSL_PARAM params[])
+{
+	PROV_CIPHER_CTX *ctx = vctx;
+	const OSSL_PARAM *p;
+
+	if (!params)
+		return 1;
+	p = OSSL_PARAM_locate_const(params, OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST_PROPS);
+	if (p && !prov_set_propq(p, &ctx->propq))
+		return 0;
+	p = OSSL_PARAM_locate_const(params, OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST);
+	if (p && !prov_get_md(ctx->provctx, p, ctx->propq, &ctx->oaep_md))
+		return 0;
+	p = OSSL_PARAM_locate_const(params, OSSL_ASYM_CIPHER_PARAM_MGF1_DIGEST);
+	if (p && !prov_get_md(ctx->provctx, p, ctx->propq, &ctx->mgf1_md))
+		return 0;
+	p = OSSL_PARAM_locate_const(params, OSSL_ASYM_CIPHER_PARAM_PAD_MODE);
+	if (p && (p->data_type == OSSL_PARAM_UTF8_STRING ||
+			!OSSL_PARAM_get_int(p, &ctx->pad_mode)) &&
+			!prov_get_pad_mode(p, &ctx->pad_mode))
+		return 0;
+	p = OSSL_PARAM_locate_const(params, OSSL_ASYM_CIPHER_PARAM_OAEP_LABEL);
+	if (p && p->data_size > 0) /* not supported by CKM_RSA_PKCS_OAEP here */
+		return 0;
+	p = OSSL_PARAM_locate_const(params,
+		OSSL_ASYM_CIPHER_PARAM_TLS_CLIENT_VERSION);
+	if (p && !OSSL_PARAM_get_uint(p, &ctx->client_version))
+		return 0;
+	p = OSSL_PARAM_locate_const(params,
+		OSSL_ASYM_CIPHER_PARAM_TLS_NEGOTIATED_VERSION);
+	if (p && !OSSL_PARAM_get_uint(p, &ctx->alt_version))
+		return 0;
+	return 1;
+}
+
+static const OSSL_PARAM *prov_cipher_settable_ctx_params(void *vctx,
+		void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_utf8_string(OSSL_ASYM_CIPHER_PARAM_PAD_MODE, NULL, 0),
+		OSSL_PARAM_utf8_string(OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST, NULL, 0),
+		OSSL_PARAM_utf8_string(OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST_PROPS,
+			NULL, 0),
+		OSSL_PARAM_utf8_string(OSSL_ASYM_CIPHER_PARAM_MGF1_DIGEST, NULL, 0),
+		OSSL_PARAM_octet_string(OSSL_ASYM_CIPHER_PARAM_OAEP_LABEL, NULL, 0),
+		OSSL_PARAM_uint(OSSL_ASYM_CIPHER_PARAM_TLS_CLIENT_VERSION, NULL),
+		OSSL_PARAM_uint(OSSL_ASYM_CIPHER_PARAM_TLS_NEGOTIATED_VERSION, NULL),
+		OSSL_PARAM_END
+	};
+
+	(void)vctx;
+	(void)provctx;
+	return params;
+}
+
+static int prov_cipher_get_ctx_params(void *vctx, OSSL_PARAM params[])
+{
+	PROV_CIPHER_CTX *ctx = vctx;
+	OSSL_PARAM *p;
+
+	p = OSSL_PARAM_locate(params, OSSL_ASYM_CIPHER_PARAM_PAD_MODE);
+	if (p && !OSSL_PARAM_set_int(p, ctx->pad_mode))
+		return 0;
+	if (!prov_set_md_name(params, OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST,
+			ctx->oaep_md))
+		return 0;
+	return prov_set_md_name(params, OSSL_ASYM_CIPHER_PARAM_MGF1_DIGEST,
+		ctx->mgf1_md);
+}
+
+static const OSSL_PARAM *prov_cipher_gettable_ctx_params(void *vctx,
+		void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_int(OSSL_ASYM_CIPHER_PARAM_PAD_MODE, NULL),
+		OSSL_PARAM_utf8_string(OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST, NULL, 0),
+		OSSL_PARAM_utf8_string(OSSL_ASYM_CIPHER_PARAM_MGF1_DIGEST, NULL, 0),
+		OSSL_PARAM_END
+	};
+
+	(void)vctx;
+	(void)provctx;
+	return params;
+}
+
+static int prov_cipher_init(void *vctx, void *provkey,
+		const OSSL_PARAM params[])
+{
+	PROV_CIPHER_CTX *ctx = vctx;
+
+	if (provkey) {
+		prov_key_free(ctx->key);
+		ctx->key = prov_key_up_ref(provkey);
+	}
+	if (!ctx->key || !ctx->key->pkey)
+		return 0;
+	return prov_cipher_set_ctx_params(ctx, params);
+}
+
+/* The OAEP digests default to SHA-1 */
+static int prov_cipher_oaep_mds(PROV_CIPHER_CTX *ctx)
+{
+	if (!ctx->oaep_md) {
+		ctx->oaep_md = EVP_MD_fetch(ctx->provctx->libctx, "SHA1", ctx->propq);
+		if (!ctx->oaep_md)
+			return 0;
+	}
+	return 1;
+}
+
+static int prov_cipher_encrypt(void *vctx, unsigned char *out, size_t *outlen,
+		size_t outsize, const unsigned char *in, size_t inlen)
+{
+	PROV_CIPHER_CTX *ctx = vctx;
+	RSA *rsa = (RSA *)EVP_PKEY_get0_RSA(ctx->key->pkey);
+	size_t size = RSA_size(rsa);
+	unsigned char *buf;
+	int len = -1;
+
+	if (!out) {
+		*outlen = size;
+		return 1;
+	}
+	if (outsize < size)
+		return 0;
+	switch (ctx->pad_mode) {
+	case RSA_PKCS1_PADDING:
+	case RSA_NO_PADDING:
+		len = RSA_public_encrypt((int)inlen, in, out, rsa, ctx->pad_mode);
+		break;
+	case RSA_PKCS1_OAEP_PADDING:
+		if (!prov_cipher_oaep_mds(ctx))
+			return 0;
+		buf = OPENSSL_malloc(size);
+		if (!buf)
+			return 0;
+		if (RSA_padding_add_PKCS1_OAEP_mgf1(buf, (int)size, in, (int)inlen,
+				NULL, 0, ctx->oaep_md,
+				ctx->mgf1_md ? ctx->mgf1_md : ctx->oaep_md))
+			len = RSA_public_encrypt((int)size, buf, out, rsa,
+				RSA_NO_PADDING);
+		OPENSSL_free(buf);
+		break;
+	}
+	if (len < 0)
+		return 0;
+	*outlen = len;
+	return 1;
+}
+
+/*
+ * The pre-master secret of the TLS RSA key exchange is replaced with
+ * random bytes when the decryption or the version check fails, so that
+ * the handshake fails later without revealing the cause.
+ */
+static int prov_cipher_tls_premaster(PROV_CIPHER_CTX *ctx, CK_RV rv,
+		const unsigned char *buf, CK_ULONG len,
+		unsigned char *out, size_t *outlen, size_t outsize)
+{
+	unsigned int version;
+
+	if (outsize < TLS_PREMASTER_LENGTH)
+		return 0;
+	if (rv == CKR_OK && len == TLS_PREMASTER_LENGTH) {
+		version = buf[0] << 8 | buf[1];
+		if (version == ctx->client_version ||
+				(ctx->alt_version && version == ctx->alt_version)) {
+			memcpy(out, buf, TLS_PREMASTER_LENGTH);
+			*outlen = TLS_PREMASTER_LENGTH;
+			return 1;
+		}
+	}
+	ERR_clear_error();
+	if (RAND_priv_bytes_ex(ctx->provctx->libctx, out,
+			TLS_PREMASTER_LENGTH, 0) <= 0)
+		return 0;
+	*outlen = TLS_PREMASTER_LENGTH;
+	return 1;
+}
+
+static int prov_cipher_decrypt(void *vctx, unsigned char *out, size_t *outlen,
+		size_t outsize, const unsigned char *in, size_t inlen)
+{
+	PROV_CIPHER_CTX *ctx = vctx;
+	size_t size = EVP_PKEY_get_size(ctx->key->pkey);
+	CK_MECHANISM mechanism;
+	CK_RSA_PKCS_OAEP_PARAMS oaep;
+	CK_ULONG len;
+	unsigned char *buf;
+	PKCS11_KEY *obj;
+	CK_RV rv;
+	int ret;
+
+	if (!out) {
+		*outlen = size;
+		return 1;
+	}
+	obj = prov_key_object(ctx->key);
+	if (!obj)
+		return 0;
+
+	memset(&mechanism, 0, sizeof(mechanism));
+	switch (ctx->pad_mode) {
+	case RSA_PKCS1_PADDING:
+	case RSA_PKCS1_WITH_TLS_PADDING:
+		mechanism.mechanism = CKM_RSA_PKCS;
+		break;
+	case RSA_NO_PADDING:
+		mechanism.mechanism = CKM_RSA_X_509;
+		break;
+	case RSA_PKCS1_OAEP_PADDING:
+		if (!prov_cipher_oaep_mds(ctx))
+			return 0;
+		memset(&oaep, 0, sizeof(oaep));
+		oaep.hashAlg = pkcs11_md2ckm(ctx->oaep_md);
+		oaep.mgf = pkcs11_md2ckg(ctx->mgf1_md ? ctx->mgf1_md : ctx->oaep_md);
+		if (!oaep.hashAlg || !oaep.mgf)
+			return 0;
+		mechanism.mechanism = CKM_RSA_PKCS_OAEP;
+		mechanism.pParameter = &oaep;
+		mechanism.ulParameterLen = sizeof(oaep);
+		break;
+	default:
+		P11err(P11_F_PKCS11_MECHANISM, P11_R_UNSUPPORTED_PADDING_TYPE);
+		return 0;
+	}
+
+	/* The token may need the full modulus length for the output */
+	buf = OPENSSL_malloc(size);
+	if (!buf)
+		return 0;
+	len = size;
+	rv = pkcs11_private_op(obj, PKCS11_OP_DECRYPT, &mechanism,
+		in, inlen, buf, &len);
+	if (ctx->pad_mode == RSA_PKCS1_WITH_TLS_PADDING) {
+		ret = prov_cipher_tls_premaster(ctx, rv, buf, len,
+			out, outlen, outsize);
+	} else if (rv != CKR_OK) {
+		CKRerr(CKR_F_PKCS11_PRIVATE_DECRYPT, rv);
+		ret = 0;
+	} else if (len > outsize) {
+		ret = 0;
+	} else {
+		memcpy(out, buf, len);
+		*outlen = len;
+		ret = 1;
+	}
+	OPENSSL_clear_free(buf, size);
+	return ret;
+}
+
+const OSSL_DISPATCH prov_rsa_asym_cipher_functions[] = {
+	{OSSL_FUNC_ASYM_CIPHER_NEWCTX, (void (*)(void))prov_cipher_newctx},
+	{OSSL_FUNC_ASYM_CIPHER_FREECTX, (void (*)(void))prov_cipher_freectx},
+	{OSSL_FUNC_ASYM_CIPHER_DUPCTX, (void (*)(void))prov_cipher_dupctx},
+	{OSSL_FUNC_ASYM_CIPHER_ENCRYPT_INIT, (void (*)(void))prov_cipher_init},
+	{OSSL_FUNC_ASYM_CIPHER_ENCRYPT, (void (*)(void))prov_cipher_encrypt},
+	{OSSL_FUNC_ASYM_CIPHER_DECRYPT_INIT, (void (*)(void))prov_cipher_init},
+	{OSSL_FUNC_ASYM_CIPHER_DECRYPT, (void (*)(void))prov_cipher_decrypt},
+	{OSSL_FUNC_ASYM_CIPHER_GET_CTX_PARAMS,
+		(void (*)(void))prov_cipher_get_ctx_params},
+	{OSSL_FUNC_ASYM_CIPHER_GETTABLE_CTX_PARAMS,
+		(void (*)(void))prov_cipher_gettable_ctx_params},
+	{OSSL_FUNC_ASYM_CIPHER_SET_CTX_PARAMS,
+		(void (*)(void))prov_cipher_set_ctx_params},
+	{OSSL_FUNC_ASYM_CIPHER_SETTABLE_CTX_PARAMS,
+		(void (*)(void))prov_cipher_settable_ctx_params},
+	{0, NULL}
+};
+
+/******************************************************************************/
+/* ECDH key exchange                                                          */
+/******************************************************************************/
+
+#ifndef OPENSSL_NO_EC
+
+typedef struct st_prov_ecdh_ctx {
+	PROV_CTX *provctx;
+	PROV_KEY *key, *peer;
+} PROV_ECDH_CTX;
+
+static void *prov_ecdh_newctx(void *provctx)
+{
+	PROV_ECDH_CTX *ctx;
+
+	ctx = OPENSSL_zalloc(sizeof(PROV_ECDH_CTX));
+	if (!ctx)
+		return NULL;
+	ctx->provctx = provctx;
+	return ctx;
+}
+
+static void prov_ecdh_freectx(void *vctx)
+{
+	PROV_ECDH_CTX *ctx = vctx;
+
+	if (!ctx)
+		return;
+	prov_key_free(ctx->key);
+	prov_key_free(ctx->peer);
+	OPENSSL_free(ctx);
+}
+
+static void *prov_ecdh_dupctx(void *vctx)
+{
+	PROV_ECDH_CTX *src = vctx, *ctx;
+
+	ctx = prov_ecdh_newctx(src->provctx);
+	if (!ctx)
+		return NULL;
+	ctx->key = prov_key_up_ref(src->key);
+	ctx->peer = prov_key_up_ref(src->peer);
+	return ctx;
+}
+
+static int prov_ecdh_init(void *vctx, void *provkey, const OSSL_PARAM params[])
+{
+	PROV_ECDH_CTX *ctx = vctx;
+
+	(void)params;
+	if (!provkey || !((PROV_KEY *)provkey)->pkey)
+		return 0;
+	prov_key_free(ctx->key);
+	ctx->key = prov_key_up_ref(provkey);
+	return 1;
+}
+
+static int prov_ecdh_set_peer(void *vctx, void *provkey)
+{
+	PROV_ECDH_CTX *ctx = vctx;
+
+	if (!provkey || !((PROV_KEY *)provkey)->pkey)
+		return 0;
+	prov_key_free(ctx->peer);
+	ctx->peer = prov_key_up_ref(provkey);
+	return 1;
+}
+
+static int prov_ecdh_derive(void *vctx, unsigned char *secret,
+		size_t *secretlen, size_t outlen)
+{
+	PROV_ECDH_CTX *ctx = vctx;
+	const EC_KEY *ec, *peer;
+	unsigned char *buf = NULL;
+	size_t buflen = 0;
+	PKCS11_KEY *obj;
+	int rv = 0;
+
+	if (!ctx->key || !ctx->peer)
+		return 0;
+	ec = EVP_PKEY_get0_EC_KEY(ctx->key->pkey);
+	if (!secret) {
+		*secretlen = (EC_GROUP_get_degree(EC_KEY_get0_group(ec)) + 7) / 8;
+		return 1;
+	}
+	obj = prov_key_object(ctx->key);
+	peer = EVP_PKEY_get0_EC_KEY(ctx->peer->pkey);
+	if (!obj || !peer)
+		return 0;
+	if (pkcs11_ecdh_compute_key(&buf, &buflen,
+			EC_KEY_get0_public_key(peer), ec, obj) < 0)
+		return 0;
+	if (buflen <= outlen) {
+		memcpy(secret, buf, buflen);
+		*secretlen = buflen;
+		rv = 1;
+	}
+	OPENSSL_clear_free(buf, buflen);
+	return rv;
+}
+
+static int prov_ecdh_set_ctx_params(void *vctx, const OSSL_PARAM params[])
+{
+	(void)vctx;
+	(void)params;
+	return 1;
+}
+
+static const OSSL_PARAM *prov_ecdh_settable_ctx_params(void *vctx,
+		void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_END
+	};
+
+	(void)vctx;
+	(void)provctx;
+	return params;
+}
+
+const OSSL_DISPATCH prov_ecdh_keyexch_functions[] = {
+	{OSSL_FUNC_KEYEXCH_NEWCTX, (void (*)(void))prov_ecdh_newctx},
+	{OSSL_FUNC_KEYEXCH_FREECTX, (void (*)(void))prov_ecdh_freectx},
+	{OSSL_FUNC_KEYEXCH_DUPCTX, (void (*)(void))prov_ecdh_dupctx},
+	{OSSL_FUNC_KEYEXCH_INIT, (void (*)(void))prov_ecdh_init},
+	{OSSL_FUNC_KEYEXCH_SET_PEER, (void (*)(void))prov_ecdh_set_peer},
+	{OSSL_FUNC_KEYEXCH_DERIVE, (void (*)(void))prov_ecdh_derive},
+	{OSSL_FUNC_KEYEXCH_SET_CTX_PARAMS,
+		(void (*)(void))prov_ecdh_set_ctx_params},
+	{OSSL_FUNC_KEYEXCH_SETTABLE_CTX_PARAMS,
+		(void (*)(void))prov_ecdh_settable_ctx_params},
+	{0, NULL}
+};
+
+#endif /* OPENSSL_NO_EC */
+
+/* vim: set noexpandtab: */
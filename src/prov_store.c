@@ -0,0 +1,265 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * The "pkcs11:" URI store.  The objects are located and logged in to with
+ * the engine code, and the keys are passed to OpenSSL by reference, so
+ * that the private key operations are performed by this provider.
+ */
+
+#include "provider.h"
+#include <string.h>
+#include <openssl/store.h>
+#include <openssl/x509.h>
+
+#define STORE_MAX_STEPS 2
+
+typedef struct st_prov_store_ctx {
+	PROV_CTX *provctx;
+	char *uri;
+	int expect; /* OSSL_STORE_INFO_* type, or 0 for any */
+	int steps[STORE_MAX_STEPS]; /* OSSL_STORE_INFO_* types to be loaded */
+	int step_count, step, loaded;
+} PROV_STORE_CTX;
+
+/* The object type requested with the "type" attribute of the URI */
+static int prov_store_uri_type(const char *uri)
+{
+	const char *p, *end;
+
+	end = strchr(uri, '?');
+	if (!end)
+		end = uri + strlen(uri);
+	for (p = uri + strlen("pkcs11:"); p < end; p++) {
+		if (strncmp(p, "type=", 5) || (p[-1] != ':' && p[-1] != ';'))
+			continue;
+		p += 5;
+		if (!strncmp(p, "private", 7))
+			return OSSL_STORE_INFO_PKEY;
+		if (!strncmp(p, "public", 6))
+			return OSSL_STORE_INFO_PUBKEY;
+		if (!strncmp(p, "cert", 4))
+			return OSSL_STORE_INFO_CERT;
+		break;
+	}
+	return 0;
+}
+
+/* The objects are loaded on the first prov_store_load() call */
+static void prov_store_set_steps(PROV_STORE_CTX *ctx)
+{
+	int type = ctx->expect ? ctx->expect : prov_store_uri_type(ctx->uri);
+
+	ctx->step_count = 0;
+	switch (type) {
+	case OSSL_STORE_INFO_PKEY:
+	case OSSL_STORE_INFO_PUBKEY:
+	case OSSL_STORE_INFO_CERT:
+		ctx->steps[ctx->step_count++] = type;
+		break;
+	case 0:
+		ctx->steps[ctx->step_count++] = OSSL_STORE_INFO_PKEY;
+		ctx->steps[ctx->step_count++] = OSSL_STORE_INFO_CERT;
+		break;
+	}
+}
+
+static void *prov_store_open(void *provctx, const char *uri)
+{
+	PROV_STORE_CTX *ctx;
+
+	if (!uri || strncmp(uri, "pkcs11:", 7))
+		return NULL;
+	ctx = OPENSSL_zalloc(sizeof(PROV_STORE_CTX));
+	if (!ctx)
+		return NULL;
+	ctx->provctx = provctx;
+	ctx->uri = OPENSSL_strdup(uri);
+	if (!ctx->uri) {
+		OPENSSL_free(ctx);
+		return NULL;
+	}
+	prov_store_set_steps(ctx);
+	return ctx;
+}
+
+static const OSSL_PARAM *prov_store_settable_ctx_params(void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_int(OSSL_STORE_PARAM_EXPECT, NULL),
+		OSSL_PARAM_END
+	};
+
+	(void)provctx;
+	return params;
+}
+
+static int prov_store_set_ctx_params(void *vctx, const OSSL_PARAM params[])
+{
+	PROV_STORE_CTX *ctx = vctx;
+	const OSSL_PARAM *p;
+
+	p = OSSL_PARAM_locate_const(params, OSSL_STORE_PARAM_EXPECT);
+	if (p) {
+		if (!OSSL_PARAM_get_int(p, &ctx->expect))
+			return 0;
+		if (ctx->step == 0)
+			prov_store_set_steps(ctx);
+	}
+	return 1;
+}
+
+/* Pass a key to OpenSSL, which loads it with prov_keymgmt_load() */
+static int prov_store_key(PROV_STORE_CTX *ctx, EVP_PKEY *pkey, int token,
+		OSSL_CALLBACK *object_cb, void *object_cbarg)
+{
+	OSSL_PARAM params[4];
+	int object_type = OSSL_OBJECT_PKEY;
+	const char *data_type;
+	PROV_KEY *key;
+	int type, rv;
+
+	type = EVP_PKEY_get_base_id(pkey);
+	switch (type) {
+	case EVP_PKEY_RSA:
+		data_type = "RSA";
+		break;
+#ifndef OPENSSL_NO_EC
+	case EVP_PKEY_EC:
+		data_type = "EC";
+		break;
+#endif
+	default:
+		EVP_PKEY_free(pkey);
+		return 0;
+	}
+	key = prov_key_new(ctx->provctx, type, pkey);
+	if (!key) {
+		EVP_PKEY_free(pkey);
+		return 0;
+	}
+	key->token = token;
+	params[0] = OSSL_PARAM_construct_int(OSSL_OBJECT_PARAM_TYPE, &object_type);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_OBJECT_PARAM_DATA_TYPE,
+		(char *)data_type, 0);
+	params[2] = OSSL_PARAM_construct_octet_string(OSSL_OBJECT_PARAM_REFERENCE,
+		&key, sizeof(key));
+	params[3] = OSSL_PARAM_construct_end();
+	rv = object_cb(params, object_cbarg);
+	prov_key_free(key); /* referenced by the EVP_PKEY object if loaded */
+	return rv;
+}
+
+static int prov_store_cert(X509 *cert,
+		OSSL_CALLBACK *object_cb, void *object_cbarg)
+{
+	OSSL_PARAM params[3];
+	int object_type = OSSL_OBJECT_CERT;
+	unsigned char *der = NULL;
+	int len, rv = 0;
+
+	len = i2d_X509(cert, &der);
+	X509_free(cert);
+	if (len <= 0)
+		return 0;
+	params[0] = OSSL_PARAM_construct_int(OSSL_OBJECT_PARAM_TYPE, &object_type);
+	params[1] = OSSL_PARAM_construct_octet_string(OSSL_OBJECT_PARAM_DATA,
+		der, len);
+	params[2] = OSSL_PARAM_construct_end();
+	rv = object_cb(params, object_cbarg);
+	OPENSSL_free(der);
+	return rv;
+}
+
+static int prov_store_load(void *vctx,
+		OSSL_CALLBACK *object_cb, void *object_cbarg,
+		OSSL_PASSPHRASE_CALLBACK *pw_cb, void *pw_cbarg)
+{
+	PROV_STORE_CTX *ctx = vctx;
+	ENGINE_CTX *engine_ctx = ctx->provctx->ctx;
+	UI_METHOD *ui_method = ctx->provctx->ui_method;
+	PROV_PASSPHRASE pass;
+	EVP_PKEY *pkey = NULL;
+	X509 *cert = NULL;
+	int type, quiet;
+
+	pass.cb = pw_cb;
+	pass.arg = pw_cbarg;
+	while (ctx->step < ctx->step_count) {
+		type = ctx->steps[ctx->step++];
+		/* Only report the errors if nothing at all was found */
+		quiet = ctx->step < ctx->step_count || ctx->loaded;
+		if (quiet)
+			ERR_set_mark();
+		switch (type) {
+		case OSSL_STORE_INFO_PKEY:
+			pkey = ctx_load_privkey(engine_ctx, ctx->uri, ui_method, &pass);
+			break;
+		case OSSL_STORE_INFO_PUBKEY:
+			pkey = ctx_load_pubkey(engine_ctx, ctx->uri, ui_method, &pass);
+			break;
+		case OSSL_STORE_INFO_CERT:
+			cert = ctx_load_cert(engine_ctx, ctx->uri, ui_method, &pass);
+			break;
+		}
+		if (quiet) {
+			if (pkey || cert)
+				ERR_clear_last_mark();
+			else
+				ERR_pop_to_mark();
+		}
+		if (pkey || cert)
+			ctx->loaded++;
+		if (pkey)
+			return prov_store_key(ctx, pkey, type == OSSL_STORE_INFO_PKEY,
+				object_cb, object_cbarg);
+		if (cert)
+			return prov_store_cert(cert, object_cb, object_cbarg);
+	}
+	return 0;
+}
+
+static int prov_store_eof(void *vctx)
+{
+	PROV_STORE_CTX *ctx = vctx;
+
+	return ctx->step >= ctx->step_count;
+}
+
+static int prov_store_close(void *vctx)
+{
+	PROV_STORE_CTX *ctx = vctx;
+
+	if (!ctx)
+		return 1;
+	OPENSSL_free(ctx->uri);
+	OPENSSL_free(ctx);
+	return 1;
+}
+
+const OSSL_DISPATCH prov_store_functions[] = {
+	{OSSL_FUNC_STORE_OPEN, (void (*)(void))prov_store_open},
+	{OSSL_FUNC_STORE_SETTABLE_CTX_PARAMS,
+		(void (*)(void))prov_store_settable_ctx_params},
+	{OSSL_FUNC_STORE_SET_CTX_PARAMS, (void (*)(void))prov_store_set_ctx_params},
+	{OSSL_FUNC_STORE_LOAD, (void (*)(void))prov_store_load},
+	{OSSL_FUNC_STORE_EOF, (void (*)(void))prov_store_eof},
+	{OSSL_FUNC_STORE_CLOSE, (void (*)(void))prov_store_close},
+	{0, NULL}
+};
+
+/* vim: set noexpandtab: */
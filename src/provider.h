@@ -0,0 +1,77 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef _PROVIDER_PKCS11_H
+#define _PROVIDER_PKCS11_H
+
+#include "libp11-int.h"
+#include "engine.h"
+#include <openssl/core.h>
+#include <openssl/core_dispatch.h>
+#include <openssl/core_names.h>
+#include <openssl/core_object.h>
+#include <openssl/params.h>
+#include <openssl/provider.h>
+
+#define PKCS11_PROVIDER_NAME "libp11 PKCS#11 provider"
+#define PKCS11_PROVIDER_PROPS "provider=pkcs11"
+
+/* The provider context shares the object loading with the engine */
+typedef struct st_prov_ctx {
+	const OSSL_CORE_HANDLE *handle;
+	OSSL_LIB_CTX *libctx; /* child of the application library context */
+	ENGINE_CTX *ctx;
+	UI_METHOD *ui_method; /* invokes the passphrase callback of OpenSSL */
+} PROV_CTX;
+
+/* A key of the provider, also used for the imported public keys */
+typedef struct st_prov_key {
+	PROV_CTX *provctx;
+	int refs;
+	int type; /* EVP_PKEY_RSA or EVP_PKEY_EC */
+	int token; /* pkey is an EVP_PKEY object of a libp11 private key */
+	EVP_PKEY *pkey; /* NULL until imported */
+} PROV_KEY;
+
+/* The passphrase callback of a store load, the UI data of ui_method */
+typedef struct st_prov_passphrase {
+	OSSL_PASSPHRASE_CALLBACK *cb;
+	void *arg;
+} PROV_PASSPHRASE;
+
+/* defined in prov_key.c */
+
+PROV_KEY *prov_key_new(PROV_CTX *provctx, int type, EVP_PKEY *pkey);
+
+void prov_key_free(PROV_KEY *key);
+
+PKCS11_KEY *prov_key_object(const PROV_KEY *key);
+
+extern const OSSL_DISPATCH prov_rsa_keymgmt_functions[];
+extern const OSSL_DISPATCH prov_ec_keymgmt_functions[];
+extern const OSSL_DISPATCH prov_rsa_signature_functions[];
+extern const OSSL_DISPATCH prov_ecdsa_signature_functions[];
+extern const OSSL_DISPATCH prov_rsa_asym_cipher_functions[];
+extern const OSSL_DISPATCH prov_ecdh_keyexch_functions[];
+
+/* defined in prov_store.c */
+
+extern const OSSL_DISPATCH prov_store_functions[];
+
+#endif
+
+/* vim: set noexpandtab: */
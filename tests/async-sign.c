@@ -0,0 +1,280 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: async-sign.c
+ *
+ * Signs within an OpenSSL ASYNC_JOB, so that the signature is computed
+ * by a worker thread while the job is paused, and resumed when the
+ * async wait fd becomes readable:
+ * - "sign": the signature is verified with the certificate
+ * - "error": the token fails to open a session, and the error reported
+ *   by the worker thread is found in the error queue of the caller
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libp11.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/x509.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER) && !defined(_WIN32)
+#include <openssl/async.h>
+#include <poll.h>
+
+#define DIGEST_SIZE 32
+#define MAX_SIGSIZE 1024
+#define CKR_DEVICE_ERROR 0x00000030UL
+
+typedef struct {
+	EVP_PKEY *pkey;
+	const unsigned char *md;
+	unsigned char *sig;
+	size_t siglen;
+} SIGN_ARGS;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int sign_job(void *arg)
+{
+	SIGN_ARGS *args = *(SIGN_ARGS **)arg;
+	EVP_PKEY_CTX *pctx;
+	int ok;
+
+	pctx = EVP_PKEY_CTX_new(args->pkey, NULL);
+	if (!pctx)
+		return 0;
+	ok = EVP_PKEY_sign_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+		EVP_PKEY_sign(pctx, args->sig, &args->siglen,
+			args->md, DIGEST_SIZE) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	return ok;
+}
+
+/* Wait until a wait fd of the paused job is readable */
+static int wait_job(ASYNC_WAIT_CTX *waitctx)
+{
+	OSSL_ASYNC_FD fds[4];
+	struct pollfd pfds[4];
+	size_t i, numfds;
+
+	if (!ASYNC_WAIT_CTX_get_all_fds(waitctx, NULL, &numfds) ||
+			numfds == 0 || numfds > 4 ||
+			!ASYNC_WAIT_CTX_get_all_fds(waitctx, fds, &numfds))
+		return -1;
+	for (i = 0; i < numfds; i++) {
+		pfds[i].fd = fds[i];
+		pfds[i].events = POLLIN;
+	}
+	return poll(pfds, numfds, 10000) > 0 ? 0 : -1;
+}
+
+/*
+ * Sign within an ASYNC_JOB, and count the pauses of the job
+ * Returns 1 on success, 0 if the signing failed, or -1 on job errors
+ */
+static int async_sign(SIGN_ARGS *args, int *pauses)
+{
+	ASYNC_WAIT_CTX *waitctx;
+	ASYNC_JOB *job = NULL;
+	int ret = 0, rv = -1;
+
+	waitctx = ASYNC_WAIT_CTX_new();
+	if (!waitctx)
+		return -1;
+	*pauses = 0;
+	for (;;) {
+		switch (ASYNC_start_job(&job, waitctx, &ret, sign_job,
+				&args, sizeof args)) {
+		case ASYNC_PAUSE:
+			(*pauses)++;
+			if (wait_job(waitctx) == 0)
+				continue;
+			fprintf(stderr, "the wait fd did not become readable\n");
+			break;
+		case ASYNC_FINISH:
+			rv = ret ? 1 : 0;
+			break;
+		default:
+			fprintf(stderr, "cannot start the job\n");
+			break;
+		}
+		break;
+	}
+	ASYNC_WAIT_CTX_free(waitctx);
+	return rv;
+}
+
+static int test_sign(EVP_PKEY *pkey, EVP_PKEY *pubkey)
+{
+	unsigned char md[DIGEST_SIZE], sig[MAX_SIGSIZE];
+	SIGN_ARGS args;
+	EVP_PKEY_CTX *pctx;
+	int pauses, ok;
+
+	RAND_bytes(md, sizeof md);
+	args.pkey = pkey;
+	args.md = md;
+	args.sig = sig;
+	args.siglen = sizeof sig;
+	if (async_sign(&args, &pauses) != 1) {
+		error_queue("EVP_PKEY_sign");
+		return -1;
+	}
+	if (!pauses) {
+		fprintf(stderr, "the job was not paused\n");
+		return -1;
+	}
+	pctx = EVP_PKEY_CTX_new(pubkey, NULL);
+	ok = pctx && EVP_PKEY_verify_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+		EVP_PKEY_verify(pctx, sig, args.siglen, md, sizeof md) == 1;
+	EVP_PKEY_CTX_free(pctx);
+	if (!ok) {
+		error_queue("EVP_PKEY_verify");
+		fprintf(stderr, "invalid signature\n");
+		return -1;
+	}
+	printf("signed within a job paused %d times\n", pauses);
+	return 0;
+}
+
+static int test_error(PKCS11_SLOT *slot, EVP_PKEY *pkey)
+{
+	unsigned char md[DIGEST_SIZE], sig[MAX_SIGSIZE];
+	SIGN_ARGS args;
+	unsigned long err;
+	int pauses, rv, found = 0;
+
+	RAND_bytes(md, sizeof md);
+	args.pkey = pkey;
+	args.md = md;
+	args.sig = sig;
+	args.siglen = sizeof sig;
+	/* Forget the pooled sessions, and fail to open new ones */
+	PKCS11_open_session(slot, 0);
+	setenv("MOCK_PKCS11_FAIL_OPEN", "1", 1);
+	rv = async_sign(&args, &pauses);
+	unsetenv("MOCK_PKCS11_FAIL_OPEN");
+	if (rv != 0) {
+		fprintf(stderr, "signing did not fail\n");
+		return -1;
+	}
+	if (!pauses) {
+		fprintf(stderr, "the job was not paused\n");
+		return -1;
+	}
+	while ((err = ERR_get_error()) != 0)
+		if ((unsigned long)ERR_GET_REASON(err) == CKR_DEVICE_ERROR)
+			found = 1;
+	if (!found) {
+		fprintf(stderr, "the error of the worker thread was lost\n");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_CERT *certs;
+	PKCS11_KEY *key;
+	EVP_PKEY *pkey = NULL, *pubkey = NULL;
+	unsigned int nslots, ncerts;
+	int rc = 1;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN "
+			"sign|error\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		goto notoken;
+	}
+	if (PKCS11_login(slot, 0, argv[2])) {
+		error_queue("PKCS11_login");
+		goto notoken;
+	}
+	if (PKCS11_enumerate_certs(slot->token, &certs, &ncerts) || !ncerts) {
+		fprintf(stderr, "no certificates found\n");
+		goto notoken;
+	}
+	key = PKCS11_find_key(&certs[0]);
+	if (!key) {
+		fprintf(stderr, "no key matching certificate available\n");
+		goto notoken;
+	}
+	pkey = PKCS11_get_private_key(key);
+	pubkey = X509_get_pubkey(PKCS11_get_x509(&certs[0]));
+	if (!pkey || !pubkey) {
+		error_queue("PKCS11_get_private_key");
+		goto nokey;
+	}
+
+	if (strcmp(argv[3], "sign") == 0) {
+		if (test_sign(pkey, pubkey) == 0)
+			rc = 0;
+	} else if (strcmp(argv[3], "error") == 0) {
+		if (test_error(slot, pkey) == 0)
+			rc = 0;
+	} else {
+		fprintf(stderr, "unknown test %s\n", argv[3]);
+	}
+
+nokey:
+	EVP_PKEY_free(pkey);
+	EVP_PKEY_free(pubkey);
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+#else
+
+int main(void)
+{
+	fprintf(stderr, "ASYNC_JOB is not supported\n");
+	return 77;
+}
+
+#endif
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,188 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: auth-pin.c
+ *
+ * Signs with a key requiring a context-specific login, and counts the
+ * PIN prompts of the UI_METHOD:
+ * - "none": without the PIN cache, the PIN is requested for each signature
+ * - "uses": the cached PIN is used up to its use limit
+ * - "ttl": the cached PIN expires after its lifetime
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <libp11.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ui.h>
+
+#define DIGEST_SIZE 32
+#define MAX_SIGSIZE 1024
+
+static const char *ui_pin;
+static int ui_prompts;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+/* Answer the PIN prompts, and count them */
+static int ui_read(UI *ui, UI_STRING *uis)
+{
+	switch (UI_get_string_type(uis)) {
+	case UIT_PROMPT:
+	case UIT_VERIFY:
+		ui_prompts++;
+		return UI_set_result(ui, uis, ui_pin) == 0;
+	default:
+		return 1;
+	}
+}
+
+static int sign(EVP_PKEY *pkey, int count)
+{
+	EVP_PKEY_CTX *pctx;
+	unsigned char md[DIGEST_SIZE], sig[MAX_SIGSIZE];
+	size_t siglen;
+	int i, ok = 1;
+
+	for (i = 0; ok && i < count; i++) {
+		RAND_bytes(md, sizeof md);
+		siglen = sizeof sig;
+		pctx = EVP_PKEY_CTX_new(pkey, NULL);
+		ok = pctx && EVP_PKEY_sign_init(pctx) > 0 &&
+			EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+			EVP_PKEY_sign(pctx, sig, &siglen, md, DIGEST_SIZE) > 0;
+		EVP_PKEY_CTX_free(pctx);
+	}
+	if (!ok)
+		error_queue("EVP_PKEY_sign");
+	return ok ? 0 : -1;
+}
+
+/* Sign the first batch, wait, sign the second one, and count the prompts */
+static int test_cache(PKCS11_CTX *ctx, EVP_PKEY *pkey, long ttl,
+		unsigned int max_uses, int first, unsigned int pause,
+		int second, int expected)
+{
+	PKCS11_CTX_set_auth_pin_cache(ctx, ttl, max_uses);
+	ui_prompts = 0;
+	if (sign(pkey, first))
+		return -1;
+	if (pause)
+		sleep(pause);
+	if (sign(pkey, second))
+		return -1;
+	printf("%d signatures, %d PIN prompts\n", first + second, ui_prompts);
+	if (ui_prompts != expected) {
+		fprintf(stderr, "%d PIN prompts instead of %d\n",
+			ui_prompts, expected);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_CERT *certs;
+	PKCS11_KEY *key;
+	UI_METHOD *ui_method;
+	EVP_PKEY *pkey = NULL;
+	unsigned int nslots, ncerts;
+	int rc = 1;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN "
+			"none|uses|ttl\n", argv[0]);
+		return 1;
+	}
+
+	ui_pin = argv[2];
+	ui_method = UI_create_method("PIN prompt counter");
+	if (!ui_method || UI_method_set_reader(ui_method, ui_read)) {
+		fprintf(stderr, "cannot create the UI_METHOD\n");
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	PKCS11_set_ui_method(ctx, ui_method, NULL);
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		goto notoken;
+	}
+	if (PKCS11_login(slot, 0, argv[2])) {
+		error_queue("PKCS11_login");
+		goto notoken;
+	}
+	if (PKCS11_enumerate_certs(slot->token, &certs, &ncerts) || !ncerts) {
+		fprintf(stderr, "no certificates found\n");
+		goto notoken;
+	}
+	key = PKCS11_find_key(&certs[0]);
+	if (!key) {
+		fprintf(stderr, "no key matching certificate available\n");
+		goto notoken;
+	}
+	pkey = PKCS11_get_private_key(key);
+	if (!pkey) {
+		error_queue("PKCS11_get_private_key");
+		goto notoken;
+	}
+
+	if (strcmp(argv[3], "none") == 0) {
+		if (test_cache(ctx, pkey, 0, 0, 5, 0, 0, 5) == 0)
+			rc = 0;
+	} else if (strcmp(argv[3], "uses") == 0) {
+		/* 10 signatures with 3 uses per PIN */
+		if (test_cache(ctx, pkey, 3600, 3, 10, 0, 0, 4) == 0)
+			rc = 0;
+	} else if (strcmp(argv[3], "ttl") == 0) {
+		/* The PIN cached for 1 second expires between the batches */
+		if (test_cache(ctx, pkey, 1, 0, 3, 2, 3, 2) == 0)
+			rc = 0;
+	} else {
+		fprintf(stderr, "unknown test %s\n", argv[3]);
+	}
+
+	EVP_PKEY_free(pkey);
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	UI_destroy_method(ui_method);
+	return rc;
+}
+
+/* vim: set noexpandtab: */
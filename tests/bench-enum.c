@@ -0,0 +1,195 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 benchmark: bench-enum.c
+ *
+ * Fills the token with public keys, and measures the time needed to
+ * look up a single key by its ID on a fresh context, to enumerate all
+ * the keys, and to enumerate them again.  The results are printed as
+ * a JSON line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libp11.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static PKCS11_SLOT *open_token(PKCS11_CTX *ctx, const char *module,
+		const char *pin, PKCS11_SLOT **slots, unsigned int *nslots)
+{
+	PKCS11_SLOT *slot;
+
+	if (PKCS11_CTX_load(ctx, module)) {
+		error_queue("PKCS11_CTX_load");
+		return NULL;
+	}
+	if (PKCS11_enumerate_slots(ctx, slots, nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		return NULL;
+	}
+	slot = PKCS11_find_token(ctx, *slots, *nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "No token available\n");
+		return NULL;
+	}
+	if (PKCS11_login(slot, 0, pin)) {
+		error_queue("PKCS11_login");
+		return NULL;
+	}
+	return slot;
+}
+
+static void set_id(unsigned char *id, unsigned int n)
+{
+	id[0] = 0xbe;
+	id[1] = (unsigned char)(n >> 16);
+	id[2] = (unsigned char)(n >> 8);
+	id[3] = (unsigned char)n;
+}
+
+/* Store public keys until the token holds at least nobjects of them */
+static int fill_token(const char *module, const char *pin,
+		unsigned int nobjects, const char *der)
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys;
+	EVP_PKEY *pkey;
+	unsigned char id[4];
+	char label[32];
+	unsigned int nslots, nkeys, i;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(der, "rb");
+	if (!f) {
+		fprintf(stderr, "Cannot open %s\n", der);
+		return 0;
+	}
+	pkey = d2i_PUBKEY_fp(f, NULL);
+	fclose(f);
+	if (!pkey) {
+		error_queue("d2i_PUBKEY_fp");
+		return 0;
+	}
+
+	ctx = PKCS11_CTX_new();
+	slot = open_token(ctx, module, pin, &slots, &nslots);
+	if (!slot)
+		goto end;
+	if (PKCS11_enumerate_public_keys(slot->token, &keys, &nkeys)) {
+		error_queue("PKCS11_enumerate_public_keys");
+		goto end;
+	}
+	for (i = nkeys; i < nobjects; i++) {
+		set_id(id, i);
+		snprintf(label, sizeof label, "bench-%u", i);
+		if (PKCS11_store_public_key(slot->token, pkey, label, id, sizeof id)) {
+			error_queue("PKCS11_store_public_key");
+			goto end;
+		}
+	}
+	ret = 1;
+end:
+	if (slot)
+		PKCS11_release_all_slots(ctx, slots, nslots);
+	PKCS11_CTX_unload(ctx);
+	PKCS11_CTX_free(ctx);
+	EVP_PKEY_free(pkey);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys, template;
+	unsigned char id[4];
+	unsigned int nslots, nkeys, nfound, nobjects;
+	double start, cold, warm, lookup;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN OBJECTS "
+			"[pubkey.der]\n", argv[0]);
+		return 1;
+	}
+	nobjects = atoi(argv[3]);
+	if (argc > 4 && !fill_token(argv[1], argv[2], nobjects, argv[4]))
+		return 1;
+
+	ctx = PKCS11_CTX_new();
+	slot = open_token(ctx, argv[1], argv[2], &slots, &nslots);
+	if (!slot)
+		return 1;
+
+	/* The returned array also contains the keys found previously,
+	 * so the lookup is done before the whole token is enumerated */
+	memset(&template, 0, sizeof template);
+	set_id(id, nobjects / 2);
+	template.id = id;
+	template.id_len = sizeof id;
+	start = now();
+	if (PKCS11_enumerate_public_keys_ext(slot->token, &template,
+			&keys, &nfound)) {
+		error_queue("PKCS11_enumerate_public_keys_ext");
+		return 1;
+	}
+	lookup = now() - start;
+
+	start = now();
+	if (PKCS11_enumerate_public_keys(slot->token, &keys, &nkeys)) {
+		error_queue("PKCS11_enumerate_public_keys");
+		return 1;
+	}
+	cold = now() - start;
+
+	start = now();
+	if (PKCS11_enumerate_public_keys(slot->token, &keys, &nkeys)) {
+		error_queue("PKCS11_enumerate_public_keys");
+		return 1;
+	}
+	warm = now() - start;
+
+	printf("{\"bench\":\"enum\",\"objects\":%u,\"keys\":%u,"
+		"\"enum_cold_ms\":%.3f,\"enum_warm_ms\":%.3f,"
+		"\"lookup_ms\":%.3f,\"lookup_found\":%u}\n",
+		nobjects, nkeys, cold * 1e3, warm * 1e3, lookup * 1e3, nfound);
+
+	PKCS11_release_all_slots(ctx, slots, nslots);
+	PKCS11_CTX_unload(ctx);
+	PKCS11_CTX_free(ctx);
+	return nkeys < nobjects;
+}
+
+/* vim: set noexpandtab: */
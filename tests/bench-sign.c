@@ -0,0 +1,389 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 benchmark: bench-sign.c
+ *
+ * Runs private key operations from multiple threads for a fixed time,
+ * either with the keys returned by libp11 or with the keys loaded by
+ * the engine, and prints the throughput and the latency percentiles
+ * as a JSON line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <libp11.h>
+#include <openssl/conf.h>
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+#define MAX_SAMPLES (1 << 20) /* per thread */
+#define DIGEST_SIZE 32
+
+enum { OP_RSA_PKCS1, OP_RSA_PSS, OP_RSA_OAEP, OP_ECDSA, OP_ECDH };
+
+static const struct {
+	const char *name;
+	const char *label; /* key to be used */
+} ops[] = {
+	{"rsa-pkcs1", "server-key"},
+	{"rsa-pss", "server-key"},
+	{"rsa-oaep", "server-key"},
+	{"ecdsa", "ec-key"},
+	{"ecdh", "ec-key"},
+	{NULL, NULL}
+};
+
+typedef struct {
+	pthread_t thread;
+	unsigned long *samples; /* latencies in microseconds */
+	unsigned long count, errors;
+} BENCH_THREAD;
+
+static int op;
+static EVP_PKEY *private_key, *public_key, *peer_key;
+static unsigned char ciphertext[1024];
+static size_t ciphertext_len;
+static double deadline;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_op(const unsigned char *digest)
+{
+	EVP_PKEY_CTX *pctx;
+	unsigned char out[1024];
+	size_t outlen = sizeof out;
+	int ok = 0;
+
+	pctx = EVP_PKEY_CTX_new(private_key, NULL);
+	if (!pctx)
+		return 0;
+	switch (op) {
+	case OP_RSA_PKCS1:
+		ok = EVP_PKEY_sign_init(pctx) > 0 &&
+			EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PADDING) > 0 &&
+			EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+			EVP_PKEY_sign(pctx, out, &outlen, digest, DIGEST_SIZE) > 0;
+		break;
+	case OP_RSA_PSS:
+		ok = EVP_PKEY_sign_init(pctx) > 0 &&
+			EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PSS_PADDING) > 0 &&
+			EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+			EVP_PKEY_CTX_set_rsa_pss_saltlen(pctx, -1) > 0 &&
+			EVP_PKEY_sign(pctx, out, &outlen, digest, DIGEST_SIZE) > 0;
+		break;
+	case OP_RSA_OAEP:
+		ok = EVP_PKEY_decrypt_init(pctx) > 0 &&
+			EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_OAEP_PADDING) > 0 &&
+			EVP_PKEY_CTX_set_rsa_oaep_md(pctx, EVP_sha256()) > 0 &&
+			EVP_PKEY_CTX_set_rsa_mgf1_md(pctx, EVP_sha256()) > 0 &&
+			EVP_PKEY_decrypt(pctx, out, &outlen,
+				ciphertext, ciphertext_len) > 0;
+		break;
+	case OP_ECDSA:
+		ok = EVP_PKEY_sign_init(pctx) > 0 &&
+			EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+			EVP_PKEY_sign(pctx, out, &outlen, digest, DIGEST_SIZE) > 0;
+		break;
+	case OP_ECDH:
+		ok = EVP_PKEY_derive_init(pctx) > 0 &&
+			EVP_PKEY_derive_set_peer(pctx, peer_key) > 0 &&
+			EVP_PKEY_derive(pctx, out, &outlen) > 0;
+		break;
+	}
+	EVP_PKEY_CTX_free(pctx);
+	return ok;
+}
+
+static void *bench_thread(void *arg)
+{
+	BENCH_THREAD *t = arg;
+	unsigned char digest[DIGEST_SIZE];
+	double start, end;
+
+	RAND_bytes(digest, sizeof digest);
+	do {
+		start = now();
+		if (!run_op(digest))
+			t->errors++;
+		end = now();
+		if (t->count < MAX_SAMPLES)
+			t->samples[t->count] = (unsigned long)((end - start) * 1e6);
+		t->count++;
+	} while (end < deadline);
+	return NULL;
+}
+
+/* Encrypt a message with the public key to be decrypted by the benchmark */
+static int prepare_oaep(void)
+{
+	EVP_PKEY_CTX *pctx;
+	unsigned char msg[DIGEST_SIZE];
+	int ok;
+
+	RAND_bytes(msg, sizeof msg);
+	pctx = EVP_PKEY_CTX_new(public_key, NULL);
+	if (!pctx)
+		return 0;
+	ciphertext_len = sizeof ciphertext;
+	ok = EVP_PKEY_encrypt_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_OAEP_PADDING) > 0 &&
+		EVP_PKEY_CTX_set_rsa_oaep_md(pctx, EVP_sha256()) > 0 &&
+		EVP_PKEY_CTX_set_rsa_mgf1_md(pctx, EVP_sha256()) > 0 &&
+		EVP_PKEY_encrypt(pctx, ciphertext, &ciphertext_len,
+			msg, sizeof msg) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	return ok;
+}
+
+/* Generate an ephemeral key on the same curve */
+static int prepare_ecdh(void)
+{
+	EVP_PKEY_CTX *pctx;
+	int ok;
+
+	pctx = EVP_PKEY_CTX_new(public_key, NULL);
+	if (!pctx)
+		return 0;
+	ok = EVP_PKEY_keygen_init(pctx) > 0 &&
+		EVP_PKEY_keygen(pctx, &peer_key) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	return ok;
+}
+
+static int load_libp11(PKCS11_CTX *ctx, const char *module, const char *pin,
+		const char *label)
+{
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys;
+	unsigned int nslots, nkeys, i;
+
+	if (PKCS11_CTX_load(ctx, module)) {
+		error_queue("PKCS11_CTX_load");
+		return 0;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		return 0;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "No token available\n");
+		return 0;
+	}
+	if (PKCS11_login(slot, 0, pin)) {
+		error_queue("PKCS11_login");
+		return 0;
+	}
+	if (PKCS11_enumerate_keys(slot->token, &keys, &nkeys)) {
+		error_queue("PKCS11_enumerate_keys");
+		return 0;
+	}
+	for (i = 0; i < nkeys; i++) {
+		if (keys[i].label && !strcmp(keys[i].label, label)) {
+			private_key = PKCS11_get_private_key(&keys[i]);
+			public_key = PKCS11_get_public_key(&keys[i]);
+			break;
+		}
+	}
+	return private_key && public_key;
+}
+
+static int load_engine(ENGINE **e, const char *conf, const char *module,
+		const char *pin, const char *label)
+{
+	char uri[256];
+
+	if (conf && CONF_modules_load_file(conf, "engines", 0) <= 0) {
+		fprintf(stderr, "cannot load %s\n", conf);
+		error_queue("CONF_modules_load_file");
+		return 0;
+	}
+	ENGINE_load_builtin_engines();
+	*e = ENGINE_by_id("pkcs11");
+	if (!*e) {
+		error_queue("ENGINE_by_id");
+		return 0;
+	}
+	if (!ENGINE_ctrl_cmd_string(*e, "MODULE_PATH", module, 0) ||
+			!ENGINE_ctrl_cmd_string(*e, "PIN", pin, 0) ||
+			!ENGINE_init(*e)) {
+		error_queue("ENGINE_init");
+		return 0;
+	}
+	snprintf(uri, sizeof uri, "pkcs11:object=%s;type=private", label);
+	private_key = ENGINE_load_private_key(*e, uri, NULL, NULL);
+	snprintf(uri, sizeof uri, "pkcs11:object=%s;type=public", label);
+	public_key = ENGINE_load_public_key(*e, uri, NULL, NULL);
+	if (!private_key || !public_key) {
+		error_queue("ENGINE_load_private_key");
+		return 0;
+	}
+	return 1;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long percentile(unsigned long *samples, unsigned long n,
+		double p)
+{
+	unsigned long i;
+
+	if (!n)
+		return 0;
+	i = (unsigned long)(p * n);
+	return samples[i < n ? i : n - 1];
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx = NULL;
+	ENGINE *e = NULL;
+	BENCH_THREAD *threads;
+	unsigned long *samples, nsamples = 0, count = 0, errors = 0;
+	unsigned int nthreads, seconds, i;
+	double start, elapsed;
+	int engine;
+
+	if (argc < 7) {
+		fprintf(stderr, "usage: %s libp11|engine OPERATION THREADS SECONDS "
+			"/usr/lib/opensc-pkcs11.so PIN [CONF]\n", argv[0]);
+		fprintf(stderr, "OPERATION is one of:");
+		for (i = 0; ops[i].name; i++)
+			fprintf(stderr, " %s", ops[i].name);
+		fprintf(stderr, "\n");
+		return 1;
+	}
+	engine = !strcmp(argv[1], "engine");
+	for (op = 0; ops[op].name; op++)
+		if (!strcmp(argv[2], ops[op].name))
+			break;
+	if (!ops[op].name) {
+		fprintf(stderr, "Unknown operation %s\n", argv[2]);
+		return 1;
+	}
+	nthreads = atoi(argv[3]);
+	seconds = atoi(argv[4]);
+	if (!nthreads || !seconds) {
+		fprintf(stderr, "Invalid number of threads or seconds\n");
+		return 1;
+	}
+
+	if (engine) {
+		if (!load_engine(&e, argc > 7 ? argv[7] : NULL,
+				argv[5], argv[6], ops[op].label))
+			return 1;
+	} else {
+		ctx = PKCS11_CTX_new();
+		if (!load_libp11(ctx, argv[5], argv[6], ops[op].label))
+			return 1;
+	}
+	if ((op == OP_RSA_OAEP && !prepare_oaep()) ||
+			(op == OP_ECDH && !prepare_ecdh())) {
+		error_queue("prepare");
+		return 1;
+	}
+
+	threads = calloc(nthreads, sizeof(BENCH_THREAD));
+	if (!threads)
+		return 1;
+	for (i = 0; i < nthreads; i++) {
+		threads[i].samples = malloc(MAX_SAMPLES * sizeof(unsigned long));
+		if (!threads[i].samples)
+			return 1;
+	}
+
+	start = now();
+	deadline = start + seconds;
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i].thread, NULL,
+				bench_thread, &threads[i]))
+			return 1;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = now() - start;
+
+	for (i = 0; i < nthreads; i++) {
+		count += threads[i].count;
+		errors += threads[i].errors;
+		nsamples += threads[i].count < MAX_SAMPLES ?
+			threads[i].count : MAX_SAMPLES;
+	}
+	samples = malloc((nsamples ? nsamples : 1) * sizeof(unsigned long));
+	if (!samples)
+		return 1;
+	nsamples = 0;
+	for (i = 0; i < nthreads; i++) {
+		unsigned long n = threads[i].count < MAX_SAMPLES ?
+			threads[i].count : MAX_SAMPLES;
+
+		memcpy(samples + nsamples, threads[i].samples,
+			n * sizeof(unsigned long));
+		nsamples += n;
+		free(threads[i].samples);
+	}
+	free(threads);
+	qsort(samples, nsamples, sizeof(unsigned long), compare_samples);
+
+	printf("{\"bench\":\"sign\",\"api\":\"%s\",\"op\":\"%s\",\"threads\":%u,"
+		"\"ops\":%lu,\"errors\":%lu,\"seconds\":%.3f,\"ops_per_sec\":%.1f,"
+		"\"p50_us\":%lu,\"p99_us\":%lu,\"p999_us\":%lu}\n",
+		engine ? "engine" : "libp11", ops[op].name, nthreads,
+		count, errors, elapsed, count / elapsed,
+		percentile(samples, nsamples, 0.5),
+		percentile(samples, nsamples, 0.99),
+		percentile(samples, nsamples, 0.999));
+	free(samples);
+
+	EVP_PKEY_free(peer_key);
+	EVP_PKEY_free(public_key);
+	EVP_PKEY_free(private_key);
+	if (e) {
+		ENGINE_finish(e);
+		ENGINE_free(e);
+		CONF_modules_unload(1);
+	}
+	if (ctx) {
+		PKCS11_CTX_unload(ctx);
+		PKCS11_CTX_free(ctx);
+	}
+	return errors != 0;
+}
+
+/* vim: set noexpandtab: */
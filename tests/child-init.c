@@ -0,0 +1,191 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: child-init.c
+ *
+ * Signs in a child process forked after PKCS11_CTX_prepare_fork(), while
+ * the token fails to open new sessions: PKCS11_CTX_child_init() opened
+ * the session of the child in advance, so signing succeeds
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <libp11.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define DIGEST_SIZE 32
+#define MAX_SIGSIZE 1024
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int sign(EVP_PKEY *pkey)
+{
+	EVP_PKEY_CTX *pctx;
+	unsigned char md[DIGEST_SIZE], sig[MAX_SIGSIZE];
+	size_t siglen = sizeof sig;
+	int ok;
+
+	RAND_bytes(md, sizeof md);
+	pctx = EVP_PKEY_CTX_new(pkey, NULL);
+	if (!pctx)
+		return 0;
+	ok = EVP_PKEY_sign_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+		EVP_PKEY_sign(pctx, sig, &siglen, md, DIGEST_SIZE) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	return ok;
+}
+
+/* The child process, returns its exit status */
+static int child(PKCS11_CTX *ctx, EVP_PKEY *pkey)
+{
+	if (PKCS11_CTX_child_init(ctx) < 0) {
+		error_queue("PKCS11_CTX_child_init");
+		return 1;
+	}
+	/* The sessions opened from now on fail */
+	setenv("MOCK_PKCS11_FAIL_OPEN", "1", 1);
+	if (!sign(pkey)) {
+		error_queue("EVP_PKEY_sign");
+		fprintf(stderr, "child: signing failed without opening a session\n");
+		return 1;
+	}
+	printf("child: signed with the session opened by PKCS11_CTX_child_init()\n");
+	return 0;
+}
+
+static int test_fork(PKCS11_CTX *ctx, PKCS11_SLOT *slots,
+		unsigned int nslots, EVP_PKEY *pkey)
+{
+	pid_t pid;
+	int status;
+
+	/* The parent has used the slot */
+	if (!sign(pkey)) {
+		error_queue("EVP_PKEY_sign");
+		return -1;
+	}
+	PKCS11_CTX_prepare_fork(ctx, slots, nslots);
+	fflush(stdout);
+	fflush(stderr);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0)
+		exit(child(ctx, pkey));
+	if (waitpid(pid, &status, 0) != pid) {
+		perror("waitpid");
+		return -1;
+	}
+	if (WIFSIGNALED(status)) {
+		fprintf(stderr, "the child process was killed by signal %d\n",
+			WTERMSIG(status));
+		return -1;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "the child process failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_CERT *certs;
+	PKCS11_KEY *key;
+	EVP_PKEY *pkey = NULL;
+	unsigned int nslots, ncerts;
+	int rc = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n",
+			argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		goto notoken;
+	}
+	if (PKCS11_login(slot, 0, argv[2])) {
+		error_queue("PKCS11_login");
+		goto notoken;
+	}
+	if (PKCS11_enumerate_certs(slot->token, &certs, &ncerts) || !ncerts) {
+		fprintf(stderr, "no certificates found\n");
+		goto notoken;
+	}
+	key = PKCS11_find_key(&certs[0]);
+	if (!key) {
+		fprintf(stderr, "no key matching certificate available\n");
+		goto notoken;
+	}
+	pkey = PKCS11_get_private_key(key);
+	if (!pkey) {
+		error_queue("PKCS11_get_private_key");
+		goto notoken;
+	}
+
+	if (test_fork(ctx, slots, nslots, pkey) == 0)
+		rc = 0;
+
+	EVP_PKEY_free(pkey);
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+#else
+
+int main(void)
+{
+	fprintf(stderr, "fork() is not supported\n");
+	return 77;
+}
+
+#endif
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,166 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: ecdh-derive.c
+ *
+ * Derives shared secrets with the EC private key of the token and peer
+ * keys generated by OpenSSL, and compares them with the secrets derived
+ * by OpenSSL.  The C_DeriveKey(), C_GetAttributeValue() and
+ * C_DestroyObject() calls are counted by the caller.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libp11.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+#define EC_KEY_LABEL "ec-key"
+#define MAX_SECRET 128
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+/* Derive the shared secret of a private key and a peer key */
+static int derive(EVP_PKEY *pkey, EVP_PKEY *peer,
+		unsigned char *secret, size_t *len)
+{
+	EVP_PKEY_CTX *pctx;
+	int ok;
+
+	pctx = EVP_PKEY_CTX_new(pkey, NULL);
+	ok = pctx && EVP_PKEY_derive_init(pctx) > 0 &&
+		EVP_PKEY_derive_set_peer(pctx, peer) > 0 &&
+		EVP_PKEY_derive(pctx, secret, len) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	if (!ok)
+		error_queue("EVP_PKEY_derive");
+	return ok ? 0 : -1;
+}
+
+/* Generate a peer key on the curve of the public key */
+static EVP_PKEY *generate_peer(EVP_PKEY *pubkey)
+{
+	EVP_PKEY_CTX *pctx;
+	EVP_PKEY *peer = NULL;
+
+	pctx = EVP_PKEY_CTX_new(pubkey, NULL);
+	if (!pctx || EVP_PKEY_keygen_init(pctx) <= 0 ||
+			EVP_PKEY_keygen(pctx, &peer) <= 0)
+		error_queue("EVP_PKEY_keygen");
+	EVP_PKEY_CTX_free(pctx);
+	return peer;
+}
+
+static int test_derive(EVP_PKEY *pkey, EVP_PKEY *pubkey, int count)
+{
+	unsigned char secret[MAX_SECRET], expected[MAX_SECRET];
+	size_t len, expected_len;
+	EVP_PKEY *peer;
+	int i, rv;
+
+	for (i = 0; i < count; i++) {
+		peer = generate_peer(pubkey);
+		if (!peer)
+			return -1;
+		len = sizeof secret;
+		expected_len = sizeof expected;
+		rv = derive(pkey, peer, secret, &len) ||
+			derive(peer, pubkey, expected, &expected_len);
+		EVP_PKEY_free(peer);
+		if (rv)
+			return -1;
+		if (len != expected_len || memcmp(secret, expected, len)) {
+			fprintf(stderr, "the shared secrets differ\n");
+			return -1;
+		}
+	}
+	printf("%d %zu-byte secrets derived\n", count, len);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys, *key = NULL;
+	EVP_PKEY *pkey = NULL, *pubkey = NULL;
+	unsigned int nslots, nkeys, i;
+	int rc = 1;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN COUNT\n",
+			argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		goto notoken;
+	}
+	if (PKCS11_login(slot, 0, argv[2])) {
+		error_queue("PKCS11_login");
+		goto notoken;
+	}
+	if (PKCS11_enumerate_keys(slot->token, &keys, &nkeys)) {
+		error_queue("PKCS11_enumerate_keys");
+		goto notoken;
+	}
+	for (i = 0; i < nkeys; i++)
+		if (keys[i].label && !strcmp(keys[i].label, EC_KEY_LABEL))
+			key = &keys[i];
+	if (!key) {
+		fprintf(stderr, "no %s private key\n", EC_KEY_LABEL);
+		goto notoken;
+	}
+	pkey = PKCS11_get_private_key(key);
+	pubkey = PKCS11_get_public_key(key);
+	if (!pkey || !pubkey) {
+		error_queue("PKCS11_get_private_key");
+		goto nokey;
+	}
+
+	if (test_derive(pkey, pubkey, atoi(argv[3])) == 0)
+		rc = 0;
+
+nokey:
+	EVP_PKEY_free(pubkey);
+	EVP_PKEY_free(pkey);
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+/* vim: set noexpandtab: */
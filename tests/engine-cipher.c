@@ -0,0 +1,304 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: engine-cipher.c
+ *
+ * Encrypts and decrypts a large buffer in several parts with the
+ * AES-256-CBC and AES-256-GCM ciphers of the engine, and compares the
+ * results with the ciphers of OpenSSL.  With a key URI, the engine uses
+ * the AES key of the token, which has the value 00 01 02 ... 1f, and with
+ * "import" the keys passed to EVP_CipherInit_ex() are imported.
+ *
+ * With "default", the engine is the default of all the methods while it
+ * has no key source, so that AES remains the software one of OpenSSL, and
+ * then with CIPHER_IMPORT, when the ciphers of the mock token using the
+ * engine fail instead of recursing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/conf.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+#define DATA_LEN	(256 * 1024)
+#define PART_LEN	100000
+#define TAG_LEN		16
+
+static void display_openssl_errors(int l)
+{
+	const char *file;
+	char buf[120];
+	int e, line;
+
+	if (ERR_peek_error() == 0)
+		return;
+	fprintf(stderr, "At engine-cipher.c:%d:\n", l);
+
+	while ((e = ERR_get_error_line(&file, &line))) {
+		ERR_error_string(e, buf);
+		fprintf(stderr, "- SSL %s: %s:%d\n", buf, file, line);
+	}
+}
+
+/* Encrypt or decrypt the input in parts, returns the output length */
+static int run_cipher(ENGINE *engine, const EVP_CIPHER *type, int enc,
+		const unsigned char *key, const unsigned char *iv,
+		const unsigned char *aad, int aad_len, unsigned char *tag,
+		const unsigned char *in, int in_len, unsigned char *out)
+{
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	int gcm = EVP_CIPHER_mode(type) == EVP_CIPH_GCM_MODE;
+	int done, n, len, total = -1;
+
+	if (!ctx || !EVP_CipherInit_ex(ctx, type, engine, key, iv, enc))
+		goto end;
+	if (gcm && aad && !EVP_CipherUpdate(ctx, NULL, &len, aad, aad_len))
+		goto end;
+	if (gcm && !enc && !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG,
+			TAG_LEN, tag))
+		goto end;
+	len = 0;
+	for (done = 0; done < in_len; done += n) {
+		n = in_len - done < PART_LEN ? in_len - done : PART_LEN;
+		if (!EVP_CipherUpdate(ctx, out + len, &total, in + done, n)) {
+			total = -1;
+			goto end;
+		}
+		len += total;
+	}
+	if (!EVP_CipherFinal_ex(ctx, out + len, &total)) {
+		total = -1;
+		goto end;
+	}
+	len += total;
+	if (gcm && enc && !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG,
+			TAG_LEN, tag)) {
+		total = -1;
+		goto end;
+	}
+	total = len;
+end:
+	EVP_CIPHER_CTX_free(ctx);
+	return total;
+}
+
+/* Compare the engine with OpenSSL, and decrypt with the engine */
+static int test_cipher(ENGINE *engine, const EVP_CIPHER *type,
+		const unsigned char *engine_key, const unsigned char *key,
+		const unsigned char *data)
+{
+	static const unsigned char aad[] = "additional authenticated data";
+	unsigned char iv[16], tag[TAG_LEN], expected_tag[TAG_LEN];
+	unsigned char *out, *expected, *plain;
+	int gcm = EVP_CIPHER_mode(type) == EVP_CIPH_GCM_MODE;
+	int len, expected_len, rv = -1;
+
+	memset(iv, 0x5a, sizeof iv);
+	out = malloc(DATA_LEN + 16);
+	expected = malloc(DATA_LEN + 16);
+	plain = malloc(DATA_LEN + 16);
+	if (!out || !expected || !plain)
+		goto end;
+
+	len = run_cipher(engine, type, 1, engine_key, iv, aad, sizeof aad, tag,
+		data, DATA_LEN, out);
+	expected_len = run_cipher(NULL, type, 1, key, iv, aad, sizeof aad,
+		expected_tag, data, DATA_LEN, expected);
+	if (len < 0 || len != expected_len || memcmp(out, expected, len) ||
+			(gcm && memcmp(tag, expected_tag, TAG_LEN))) {
+		fprintf(stderr, "%s: the encryption differs from OpenSSL\n",
+			EVP_CIPHER_name(type));
+		goto end;
+	}
+
+	len = run_cipher(engine, type, 0, engine_key, iv, aad, sizeof aad, tag,
+		expected, expected_len, plain);
+	if (len != DATA_LEN || memcmp(plain, data, DATA_LEN)) {
+		fprintf(stderr, "%s: the decryption failed\n",
+			EVP_CIPHER_name(type));
+		goto end;
+	}
+
+	if (gcm) {
+		tag[0] ^= 1;
+		if (run_cipher(engine, type, 0, engine_key, iv, aad, sizeof aad, tag,
+				expected, expected_len, plain) >= 0) {
+			fprintf(stderr, "%s: an invalid tag was accepted\n",
+				EVP_CIPHER_name(type));
+			goto end;
+		}
+		ERR_clear_error();
+	}
+	printf("%s: %d bytes\n", EVP_CIPHER_name(type), DATA_LEN);
+	rv = 0;
+end:
+	free(out);
+	free(expected);
+	free(plain);
+	return rv;
+}
+
+/* The engine set as the default of all the methods */
+static int test_default(ENGINE *engine)
+{
+	/* AES-128-CBC of NIST SP 800-38A F.2.1, first block */
+	static const unsigned char key[16] = {
+		0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+		0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+	static const unsigned char iv[16] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+	static const unsigned char plain[16] = {
+		0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+		0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a};
+	static const unsigned char cipher[16] = {
+		0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46,
+		0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d};
+	unsigned char out[32];
+	ENGINE *aes_engine;
+
+	if (!ENGINE_set_default(engine, ENGINE_METHOD_ALL)) {
+		fprintf(stderr, "ENGINE_set_default() failed\n");
+		return -1;
+	}
+	aes_engine = ENGINE_get_cipher_engine(NID_aes_128_cbc);
+	if (aes_engine) {
+		fprintf(stderr, "the engine provides AES without a key source\n");
+		ENGINE_free(aes_engine);
+		return -1;
+	}
+	if (run_cipher(NULL, EVP_aes_128_cbc(), 1, key, iv, NULL, 0, NULL,
+			plain, sizeof plain, out) != sizeof out ||
+			memcmp(out, cipher, sizeof cipher)) {
+		fprintf(stderr, "the software AES-128-CBC failed\n");
+		return -1;
+	}
+	printf("AES-128-CBC: software with the default engine\n");
+
+	if (!ENGINE_ctrl_cmd_string(engine, "CIPHER_IMPORT", NULL, 0) ||
+			!ENGINE_set_default(engine, ENGINE_METHOD_CIPHERS)) {
+		fprintf(stderr, "cannot set the ciphers of the engine\n");
+		return -1;
+	}
+	aes_engine = ENGINE_get_cipher_engine(NID_aes_128_cbc);
+	if (aes_engine != engine) {
+		fprintf(stderr, "the engine does not provide AES\n");
+		ENGINE_free(aes_engine);
+		return -1;
+	}
+	ENGINE_free(aes_engine);
+	/* The mock token encrypts with EVP_aes_128_cbc() of the engine */
+	if (run_cipher(NULL, EVP_aes_128_cbc(), 1, key, iv, NULL, 0, NULL,
+			plain, sizeof plain, out) >= 0) {
+		fprintf(stderr, "the engine recursed into itself\n");
+		return -1;
+	}
+	ERR_clear_error();
+	ENGINE_unregister_ciphers(engine);
+	printf("AES-128-CBC: the engine did not recurse into itself\n");
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	ENGINE *engine;
+	unsigned char key[32], engine_key[32], *data;
+	const char *key_uri = NULL;
+	int i, import = 0, rv = 1;
+
+	if (argc < 6) {
+		fprintf(stderr,
+			"usage: %s [CONF] [module] [PIN] [chunk] "
+			"[import | default | key URI]\n",
+			argv[0]);
+		return 1;
+	}
+	if (!strcmp(argv[5], "import"))
+		import = 1;
+	else if (strcmp(argv[5], "default"))
+		key_uri = argv[5];
+
+	if (CONF_modules_load_file(argv[1], NULL, 0) <= 0) {
+		fprintf(stderr, "cannot load %s\n", argv[1]);
+		display_openssl_errors(__LINE__);
+		return 1;
+	}
+	ENGINE_add_conf_module();
+	OPENSSL_init_crypto(OPENSSL_INIT_ADD_ALL_CIPHERS
+		| OPENSSL_INIT_ADD_ALL_DIGESTS
+		| OPENSSL_INIT_LOAD_CONFIG, NULL);
+	ERR_clear_error();
+
+	ENGINE_load_builtin_engines();
+	engine = ENGINE_by_id("pkcs11");
+	if (!engine) {
+		display_openssl_errors(__LINE__);
+		return 1;
+	}
+	if (!ENGINE_ctrl_cmd_string(engine, "MODULE_PATH", argv[2], 0) ||
+			!ENGINE_ctrl_cmd_string(engine, "PIN", argv[3], 0) ||
+			!ENGINE_ctrl_cmd_string(engine, "CIPHER_CHUNK", argv[4], 0) ||
+			(key_uri && !ENGINE_ctrl_cmd_string(engine,
+				"CIPHER_KEY", key_uri, 0)) ||
+			(import && !ENGINE_ctrl_cmd_string(engine,
+				"CIPHER_IMPORT", NULL, 0)) ||
+			!ENGINE_init(engine)) {
+		display_openssl_errors(__LINE__);
+		ENGINE_free(engine);
+		return 1;
+	}
+
+	if (!key_uri && !import) {
+		if (test_default(engine) == 0)
+			rv = 0;
+		display_openssl_errors(__LINE__);
+		ENGINE_finish(engine);
+		ENGINE_free(engine);
+		return rv;
+	}
+
+	for (i = 0; i < (int)sizeof key; i++)
+		key[i] = (unsigned char)i;
+	/* The key passed to the engine is ignored with a key URI */
+	if (key_uri)
+		memset(engine_key, 0, sizeof engine_key);
+	else
+		memcpy(engine_key, key, sizeof key);
+
+	data = malloc(DATA_LEN);
+	if (!data)
+		goto end;
+	for (i = 0; i < DATA_LEN; i++)
+		data[i] = (unsigned char)(i * 7 + (i >> 8));
+
+	if (test_cipher(engine, EVP_aes_256_cbc(), engine_key, key, data) ||
+			test_cipher(engine, EVP_aes_256_gcm(),
+				engine_key, key, data)) {
+		display_openssl_errors(__LINE__);
+		goto end;
+	}
+	rv = 0;
+
+end:
+	free(data);
+	ENGINE_finish(engine);
+	ENGINE_free(engine);
+	return rv;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,187 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: engine-digestsign.c
+ *
+ * Signs a large buffer passed in several parts to EVP_DigestSignUpdate()
+ * with the RSA and EC keys of the token, with RSA PKCS#1 v1.5, RSA-PSS and
+ * ECDSA, and verifies the signatures with OpenSSL.  SHA-1 is not
+ * supported by the mock token, so these data are hashed by OpenSSL.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/conf.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+
+#define DATA_LEN	(4 * 1024 * 1024)
+#define PART_LEN	100000
+
+static void display_openssl_errors(int l)
+{
+	const char *file;
+	char buf[120];
+	int e, line;
+
+	if (ERR_peek_error() == 0)
+		return;
+	fprintf(stderr, "At engine-digestsign.c:%d:\n", l);
+
+	while ((e = ERR_get_error_line(&file, &line))) {
+		ERR_error_string(e, buf);
+		fprintf(stderr, "- SSL %s: %s:%d\n", buf, file, line);
+	}
+}
+
+/* Sign the data in parts, and verify the signature with OpenSSL */
+static int test_sign(const char *name, EVP_PKEY *private_key,
+		EVP_PKEY *public_key, const EVP_MD *md, int padding,
+		const unsigned char *data)
+{
+	EVP_MD_CTX *ctx;
+	EVP_PKEY_CTX *pctx;
+	unsigned char *sig = NULL;
+	size_t sig_len, done, n;
+	int rv = -1;
+
+	ctx = EVP_MD_CTX_new();
+	/* The engine of the key provides its EVP_PKEY_METHOD */
+	if (!ctx || EVP_DigestSignInit(ctx, &pctx, md, NULL,
+			private_key) <= 0)
+		goto end;
+	if (padding && (EVP_PKEY_CTX_set_rsa_padding(pctx, padding) <= 0 ||
+			(padding == RSA_PKCS1_PSS_PADDING &&
+			EVP_PKEY_CTX_set_rsa_pss_saltlen(pctx, -1) <= 0)))
+		goto end;
+	for (done = 0; done < DATA_LEN; done += n) {
+		n = DATA_LEN - done < PART_LEN ? DATA_LEN - done : PART_LEN;
+		if (EVP_DigestSignUpdate(ctx, data + done, n) <= 0)
+			goto end;
+	}
+	if (EVP_DigestSignFinal(ctx, NULL, &sig_len) <= 0)
+		goto end;
+	sig = OPENSSL_malloc(sig_len);
+	if (!sig || EVP_DigestSignFinal(ctx, sig, &sig_len) <= 0)
+		goto end;
+	EVP_MD_CTX_free(ctx);
+
+	ctx = EVP_MD_CTX_new();
+	if (!ctx || EVP_DigestVerifyInit(ctx, &pctx, md, NULL,
+			public_key) <= 0)
+		goto end;
+	if (padding && EVP_PKEY_CTX_set_rsa_padding(pctx, padding) <= 0)
+		goto end;
+	if (EVP_DigestVerifyUpdate(ctx, data, DATA_LEN) <= 0 ||
+			EVP_DigestVerifyFinal(ctx, sig, sig_len) <= 0) {
+		fprintf(stderr, "%s: the signature is invalid\n", name);
+		goto end;
+	}
+	printf("%s: %d bytes\n", name, DATA_LEN);
+	rv = 0;
+end:
+	OPENSSL_free(sig);
+	EVP_MD_CTX_free(ctx);
+	return rv;
+}
+
+int main(int argc, char *argv[])
+{
+	ENGINE *engine;
+	EVP_PKEY *rsa_key = NULL, *rsa_pub = NULL;
+	EVP_PKEY *ec_key = NULL, *ec_pub = NULL;
+	unsigned char *data = NULL;
+	int i, rv = 1;
+
+	if (argc < 5) {
+		fprintf(stderr, "usage: %s [CONF] [module] [PIN] [chunk]\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (CONF_modules_load_file(argv[1], NULL, 0) <= 0) {
+		fprintf(stderr, "cannot load %s\n", argv[1]);
+		display_openssl_errors(__LINE__);
+		return 1;
+	}
+	ENGINE_add_conf_module();
+	OPENSSL_init_crypto(OPENSSL_INIT_ADD_ALL_CIPHERS
+		| OPENSSL_INIT_ADD_ALL_DIGESTS
+		| OPENSSL_INIT_LOAD_CONFIG, NULL);
+	ERR_clear_error();
+
+	ENGINE_load_builtin_engines();
+	engine = ENGINE_by_id("pkcs11");
+	if (!engine) {
+		display_openssl_errors(__LINE__);
+		return 1;
+	}
+	if (!ENGINE_ctrl_cmd_string(engine, "MODULE_PATH", argv[2], 0) ||
+			!ENGINE_ctrl_cmd_string(engine, "PIN", argv[3], 0) ||
+			!ENGINE_ctrl_cmd_string(engine, "SIGN_CHUNK", argv[4], 0) ||
+			!ENGINE_init(engine)) {
+		display_openssl_errors(__LINE__);
+		ENGINE_free(engine);
+		return 1;
+	}
+
+	rsa_key = ENGINE_load_private_key(engine,
+		"pkcs11:object=server-key;type=private", NULL, NULL);
+	rsa_pub = ENGINE_load_public_key(engine,
+		"pkcs11:object=server-key;type=public", NULL, NULL);
+	ec_key = ENGINE_load_private_key(engine,
+		"pkcs11:object=ec-key;type=private", NULL, NULL);
+	ec_pub = ENGINE_load_public_key(engine,
+		"pkcs11:object=ec-key;type=public", NULL, NULL);
+	if (!rsa_key || !rsa_pub || !ec_key || !ec_pub) {
+		fprintf(stderr, "cannot load the keys\n");
+		display_openssl_errors(__LINE__);
+		goto end;
+	}
+
+	data = malloc(DATA_LEN);
+	if (!data)
+		goto end;
+	for (i = 0; i < DATA_LEN; i++)
+		data[i] = (unsigned char)(i * 7 + (i >> 8));
+
+	if (test_sign("RSA PKCS#1 SHA-256", rsa_key, rsa_pub,
+				EVP_sha256(), RSA_PKCS1_PADDING, data) ||
+			test_sign("RSA-PSS SHA-256", rsa_key, rsa_pub,
+				EVP_sha256(), RSA_PKCS1_PSS_PADDING, data) ||
+			test_sign("ECDSA SHA-256", ec_key, ec_pub,
+				EVP_sha256(), 0, data) ||
+			test_sign("RSA PKCS#1 SHA-1", rsa_key, rsa_pub,
+				EVP_sha1(), RSA_PKCS1_PADDING, data)) {
+		display_openssl_errors(__LINE__);
+		goto end;
+	}
+	rv = 0;
+
+end:
+	free(data);
+	EVP_PKEY_free(rsa_key);
+	EVP_PKEY_free(rsa_pub);
+	EVP_PKEY_free(ec_key);
+	EVP_PKEY_free(ec_pub);
+	ENGINE_finish(engine);
+	ENGINE_free(engine);
+	return rv;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,479 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: engine-load.c
+ *
+ * Loads the keys of the mock module with the engine, configured with the
+ * NAME=VALUE control commands following the name of the test:
+ * - "cache": the objects loaded again are the cached ones, until the
+ *   token is replaced, or until the cache lifetime expired
+ * - "threads": the uncached loads from different tokens run concurrently
+ * - "modules": the signatures with a key load balanced over two modules
+ *   are performed by the tokens of both modules
+ * - "fork": the key loaded with PRELOAD signs in a child process, and
+ *   the child loads it again
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <openssl/bio.h>
+#include <openssl/conf.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+#define RSA_KEY_URI	"pkcs11:object=server-key;type=private"
+
+/* The serial number of the mock token of a slot */
+#define SLOT_KEY_URI	"pkcs11:serial=%015x1;object=server-key;type=private"
+#define THREADS		4
+#define SIGNATURES	4
+
+typedef struct {
+	ENGINE *engine;
+	char uri[128];
+	int rv;
+} LOAD_THREAD;
+
+static void display_openssl_errors(int l)
+{
+	const char *file;
+	char buf[120];
+	int e, line;
+
+	if (ERR_peek_error() == 0)
+		return;
+	fprintf(stderr, "At engine-load.c:%d:\n", l);
+
+	while ((e = ERR_get_error_line(&file, &line))) {
+		ERR_error_string(e, buf);
+		fprintf(stderr, "- SSL %s: %s:%d\n", buf, file, line);
+	}
+}
+
+/* Replace the token of the first slot with the generation of the token */
+static int replace_token(char generation)
+{
+	const char *path = getenv("MOCK_PKCS11_TOKEN_STATE");
+	FILE *file;
+
+	if (!path) {
+		fprintf(stderr, "MOCK_PKCS11_TOKEN_STATE is not set\n");
+		return -1;
+	}
+	file = fopen(path, "w");
+	if (!file || fputc(generation, file) == EOF || fclose(file)) {
+		fprintf(stderr, "cannot write %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static EVP_PKEY *load_key(ENGINE *engine, const char *uri)
+{
+	EVP_PKEY *pkey = ENGINE_load_private_key(engine, uri, NULL, NULL);
+
+	if (!pkey) {
+		display_openssl_errors(__LINE__);
+		fprintf(stderr, "cannot load %s\n", uri);
+	}
+	return pkey;
+}
+
+/*
+ * The calls of an operation on the slots of a module, or of all the
+ * modules if module is negative, as printed by GET_STATS
+ */
+static long op_calls(ENGINE *engine, const char *op, int module)
+{
+	BIO *out = BIO_new(BIO_s_mem());
+	char line[512], key[32], prefix[32], *p;
+	long calls = 0;
+
+	if (!out)
+		return -1;
+	if (!ENGINE_ctrl_cmd(engine, "GET_STATS", 0, out, NULL, 0)) {
+		BIO_free(out);
+		return -1;
+	}
+	snprintf(key, sizeof key, " op %s calls ", op);
+	snprintf(prefix, sizeof prefix, "module %d ", module);
+	while (BIO_gets(out, line, sizeof line) > 0) {
+		if (module >= 0 && strncmp(line, prefix, strlen(prefix)))
+			continue;
+		p = strstr(line, key);
+		if (p && !strstr(line, " mechanism "))
+			calls += strtol(p + strlen(key), NULL, 10);
+	}
+	BIO_free(out);
+	return calls;
+}
+
+/* The C_FindObjects() calls of the slots */
+static long find_calls(ENGINE *engine)
+{
+	return op_calls(engine, "find", -1);
+}
+
+/*
+ * Load the key again after the action, and check whether the cached key
+ * was returned without searching the token
+ */
+static int test_reload(ENGINE *engine, const char *action, int cached)
+{
+	EVP_PKEY *pkey;
+	long before, after;
+
+	pkey = load_key(engine, RSA_KEY_URI);
+	if (!pkey)
+		return -1;
+	EVP_PKEY_free(pkey);
+	if (!strcmp(action, "replace")) {
+		/* The slot watcher flushes the cache on the slot event */
+		if (replace_token('2'))
+			return -1;
+		sleep(1);
+	} else if (!strcmp(action, "expire")) {
+		sleep(2);
+	}
+	before = find_calls(engine);
+	pkey = load_key(engine, RSA_KEY_URI);
+	if (!pkey)
+		return -1;
+	EVP_PKEY_free(pkey);
+	after = find_calls(engine);
+	if (before < 0 || after < 0) {
+		fprintf(stderr, "GET_STATS failed\n");
+		return -1;
+	}
+	if ((after == before) != cached) {
+		fprintf(stderr, "%s: the key was %s\n", action,
+			cached ? "searched again" : "cached");
+		return -1;
+	}
+	printf("%s: the key was %s\n", action,
+		cached ? "cached" : "searched again");
+	return 0;
+}
+
+static int test_cache(ENGINE *engine)
+{
+	if (test_reload(engine, "none", 1) ||
+			test_reload(engine, "replace", 0))
+		return -1;
+	/* The next loads are cached for 1 second */
+	if (!ENGINE_ctrl_cmd(engine, "CACHE_TTL", 1, NULL, NULL, 0))
+		return -1;
+	return test_reload(engine, "expire", 0);
+}
+
+static void *load_thread(void *arg)
+{
+	LOAD_THREAD *load = arg;
+	EVP_PKEY *pkey = load_key(load->engine, load->uri);
+
+	load->rv = pkey ? 0 : -1;
+	EVP_PKEY_free(pkey);
+	return NULL;
+}
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - start->tv_sec) +
+		(double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Load the key of each token one at a time, then concurrently, with the
+ * cache disabled and a slow C_FindObjects()
+ */
+static int test_threads(ENGINE *engine)
+{
+	LOAD_THREAD loads[THREADS];
+	pthread_t threads[THREADS];
+	struct timespec start;
+	double sequential, concurrent;
+	int i, n, rv = 0;
+
+	if (!ENGINE_ctrl_cmd(engine, "CACHE_TTL", 0, NULL, NULL, 0))
+		return -1;
+	for (i = 0; i < THREADS; i++) {
+		loads[i].engine = engine;
+		snprintf(loads[i].uri, sizeof loads[i].uri, SLOT_KEY_URI, i);
+		/* Log into each token before measuring the loads */
+		load_thread(&loads[i]);
+		if (loads[i].rv)
+			return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < THREADS; i++) {
+		load_thread(&loads[i]);
+		if (loads[i].rv)
+			return -1;
+	}
+	sequential = elapsed(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < THREADS; n++)
+		if (pthread_create(&threads[n], NULL, load_thread, &loads[n]))
+			break;
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i], NULL);
+		if (loads[i].rv)
+			rv = -1;
+	}
+	concurrent = elapsed(&start);
+	if (n < THREADS || rv) {
+		fprintf(stderr, "the concurrent loads failed\n");
+		return -1;
+	}
+
+	printf("%d loads: %.3fs one at a time, %.3fs concurrently\n",
+		THREADS, sequential, concurrent);
+	/* The serialized loads would take as long as the sequential ones */
+	if (concurrent > sequential / 2) {
+		fprintf(stderr, "the loads were serialized\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int sign(EVP_PKEY *pkey, int count)
+{
+	EVP_PKEY_CTX *pctx;
+	unsigned char md[32], sig[1024];
+	size_t siglen;
+	int i, ok = 1;
+
+	memset(md, 0x5a, sizeof md);
+	for (i = 0; ok && i < count; i++) {
+		siglen = sizeof sig;
+		pctx = EVP_PKEY_CTX_new(pkey, NULL);
+		ok = pctx && EVP_PKEY_sign_init(pctx) > 0 &&
+			EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+			EVP_PKEY_sign(pctx, sig, &siglen, md, sizeof md) > 0;
+		EVP_PKEY_CTX_free(pctx);
+	}
+	return ok ? 0 : -1;
+}
+
+static void *sign_thread(void *arg)
+{
+	EVP_PKEY *pkey = arg;
+
+	return sign(pkey, SIGNATURES) ? NULL : pkey;
+}
+
+/* Sign concurrently, so that the busy tokens leave the load to the others */
+static int test_modules(ENGINE *engine)
+{
+	pthread_t threads[THREADS];
+	EVP_PKEY *pkey;
+	void *ret;
+	long calls[2];
+	int i, n, rv = 0;
+
+	pkey = load_key(engine, RSA_KEY_URI);
+	if (!pkey)
+		return -1;
+	for (n = 0; n < THREADS; n++)
+		if (pthread_create(&threads[n], NULL, sign_thread, pkey))
+			break;
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i], &ret);
+		if (!ret)
+			rv = -1;
+	}
+	EVP_PKEY_free(pkey);
+	if (n < THREADS || rv) {
+		display_openssl_errors(__LINE__);
+		fprintf(stderr, "the concurrent signatures failed\n");
+		return -1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		calls[i] = op_calls(engine, "sign", i);
+		if (calls[i] <= 0) {
+			fprintf(stderr, "no signature with the module %d\n", i);
+			return -1;
+		}
+	}
+	if (calls[0] + calls[1] != THREADS * SIGNATURES) {
+		fprintf(stderr, "%ld signatures instead of %d\n",
+			calls[0] + calls[1], THREADS * SIGNATURES);
+		return -1;
+	}
+	printf("%ld signatures with the module 0, %ld with the module 1\n",
+		calls[0], calls[1]);
+	return 0;
+}
+
+/* The child process, returns its exit status */
+static int child(ENGINE *engine, EVP_PKEY *pkey)
+{
+	EVP_PKEY *reloaded;
+
+	if (sign(pkey, SIGNATURES)) {
+		display_openssl_errors(__LINE__);
+		fprintf(stderr, "child: the key of the parent failed\n");
+		return 1;
+	}
+	reloaded = load_key(engine, RSA_KEY_URI);
+	if (!reloaded)
+		return 1;
+	if (sign(reloaded, SIGNATURES)) {
+		display_openssl_errors(__LINE__);
+		fprintf(stderr, "child: the reloaded key failed\n");
+		EVP_PKEY_free(reloaded);
+		return 1;
+	}
+	EVP_PKEY_free(reloaded);
+	printf("child: signed with the preloaded and the reloaded keys\n");
+	fflush(stdout);
+	return 0;
+}
+
+static int test_fork(ENGINE *engine)
+{
+	EVP_PKEY *pkey;
+	pid_t pid;
+	int status, rv = -1;
+
+	/* Waits for the preload of the key */
+	pkey = load_key(engine, RSA_KEY_URI);
+	if (!pkey)
+		return -1;
+	fflush(stdout);
+	fflush(stderr);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		goto end;
+	}
+	if (pid == 0)
+		_exit(child(engine, pkey));
+	if (waitpid(pid, &status, 0) != pid) {
+		perror("waitpid");
+		goto end;
+	}
+	if (WIFSIGNALED(status)) {
+		fprintf(stderr, "the child process was killed by signal %d\n",
+			WTERMSIG(status));
+		goto end;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "the child process failed\n");
+		goto end;
+	}
+	/* The parent still uses its own sessions */
+	if (sign(pkey, SIGNATURES)) {
+		display_openssl_errors(__LINE__);
+		fprintf(stderr, "the key of the parent failed after the fork\n");
+		goto end;
+	}
+	printf("parent: signed after the fork\n");
+	rv = 0;
+end:
+	EVP_PKEY_free(pkey);
+	return rv;
+}
+
+int main(int argc, char *argv[])
+{
+	ENGINE *engine;
+	char *name, *value;
+	int i, rv = 1;
+
+	if (argc < 5) {
+		fprintf(stderr,
+			"usage: %s [CONF] [module] [PIN] [test] [NAME=VALUE]...\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (CONF_modules_load_file(argv[1], NULL, 0) <= 0) {
+		fprintf(stderr, "cannot load %s\n", argv[1]);
+		display_openssl_errors(__LINE__);
+		return 1;
+	}
+	ENGINE_add_conf_module();
+	OPENSSL_init_crypto(OPENSSL_INIT_ADD_ALL_CIPHERS
+		| OPENSSL_INIT_ADD_ALL_DIGESTS
+		| OPENSSL_INIT_LOAD_CONFIG, NULL);
+	ERR_clear_error();
+
+	ENGINE_load_builtin_engines();
+	engine = ENGINE_by_id("pkcs11");
+	if (!engine) {
+		display_openssl_errors(__LINE__);
+		return 1;
+	}
+	if (!ENGINE_ctrl_cmd_string(engine, "MODULE_PATH", argv[2], 0) ||
+			!ENGINE_ctrl_cmd_string(engine, "PIN", argv[3], 0)) {
+		display_openssl_errors(__LINE__);
+		ENGINE_free(engine);
+		return 1;
+	}
+	for (i = 5; i < argc; i++) {
+		name = argv[i];
+		value = strchr(name, '=');
+		if (value)
+			*value++ = '\0';
+		if (!ENGINE_ctrl_cmd_string(engine, name, value, 0)) {
+			fprintf(stderr, "cannot set %s\n", name);
+			display_openssl_errors(__LINE__);
+			ENGINE_free(engine);
+			return 1;
+		}
+	}
+	if (!ENGINE_init(engine)) {
+		display_openssl_errors(__LINE__);
+		ENGINE_free(engine);
+		return 1;
+	}
+
+	if (strcmp(argv[4], "cache") == 0) {
+		if (test_cache(engine) == 0)
+			rv = 0;
+	} else if (strcmp(argv[4], "threads") == 0) {
+		if (test_threads(engine) == 0)
+			rv = 0;
+	} else if (strcmp(argv[4], "modules") == 0) {
+		if (test_modules(engine) == 0)
+			rv = 0;
+	} else if (strcmp(argv[4], "fork") == 0) {
+		if (test_fork(engine) == 0)
+			rv = 0;
+	} else {
+		fprintf(stderr, "unknown test %s\n", argv[4]);
+	}
+	display_openssl_errors(__LINE__);
+
+	ENGINE_finish(engine);
+	ENGINE_free(engine);
+	return rv;
+}
+
+/* vim: set noexpandtab: */
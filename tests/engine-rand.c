@@ -0,0 +1,133 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: engine-rand.c
+ *
+ * Generates random numbers with RAND_bytes() once the engine is the
+ * default RAND engine, and checks that the output is neither constant
+ * nor repeated.  The calls of the token are counted by the caller.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/conf.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+
+#define RAND_LEN	64
+#define RAND_ROUNDS	16
+
+static void display_openssl_errors(int l)
+{
+	const char *file;
+	char buf[120];
+	int e, line;
+
+	if (ERR_peek_error() == 0)
+		return;
+	fprintf(stderr, "At engine-rand.c:%d:\n", l);
+
+	while ((e = ERR_get_error_line(&file, &line))) {
+		ERR_error_string(e, buf);
+		fprintf(stderr, "- SSL %s: %s:%d\n", buf, file, line);
+	}
+}
+
+static int test_rand(void)
+{
+	unsigned char buf[RAND_ROUNDS][RAND_LEN], zero[RAND_LEN];
+	int i, j;
+
+	memset(zero, 0, sizeof zero);
+	for (i = 0; i < RAND_ROUNDS; i++) {
+		if (RAND_bytes(buf[i], RAND_LEN) != 1) {
+			fprintf(stderr, "RAND_bytes failed\n");
+			return -1;
+		}
+		if (!memcmp(buf[i], zero, RAND_LEN)) {
+			fprintf(stderr, "RAND_bytes returned zeros\n");
+			return -1;
+		}
+		for (j = 0; j < i; j++) {
+			if (!memcmp(buf[i], buf[j], RAND_LEN)) {
+				fprintf(stderr, "RAND_bytes repeated its output\n");
+				return -1;
+			}
+		}
+	}
+	if (RAND_status() != 1) {
+		fprintf(stderr, "RAND_status failed\n");
+		return -1;
+	}
+	printf("%d x %d random bytes\n", RAND_ROUNDS, RAND_LEN);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	ENGINE *engine;
+	int rv = 1;
+
+	if (argc < 5) {
+		fprintf(stderr,
+			"usage: %s [CONF] [module] [PIN] [buffer size]\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (CONF_modules_load_file(argv[1], NULL, 0) <= 0) {
+		fprintf(stderr, "cannot load %s\n", argv[1]);
+		display_openssl_errors(__LINE__);
+		return 1;
+	}
+	ENGINE_add_conf_module();
+	OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CONFIG, NULL);
+	ERR_clear_error();
+
+	ENGINE_load_builtin_engines();
+	engine = ENGINE_by_id("pkcs11");
+	if (!engine) {
+		display_openssl_errors(__LINE__);
+		return 1;
+	}
+	if (!ENGINE_ctrl_cmd_string(engine, "MODULE_PATH", argv[2], 0) ||
+			!ENGINE_ctrl_cmd_string(engine, "PIN", argv[3], 0) ||
+			!ENGINE_ctrl_cmd_string(engine, "RAND_BUFFER", argv[4], 0) ||
+			!ENGINE_init(engine)) {
+		display_openssl_errors(__LINE__);
+		ENGINE_free(engine);
+		return 1;
+	}
+	if (!ENGINE_set_default_RAND(engine)) {
+		display_openssl_errors(__LINE__);
+		goto end;
+	}
+
+	if (test_rand()) {
+		display_openssl_errors(__LINE__);
+		goto end;
+	}
+	rv = 0;
+
+end:
+	ENGINE_unregister_RAND(engine);
+	ENGINE_finish(engine);
+	ENGINE_free(engine);
+	return rv;
+}
+
+/* vim: set noexpandtab: */
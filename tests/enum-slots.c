@@ -0,0 +1,166 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: enum-slots.c
+ *
+ * Enumerates the slots of the mock module with the PKCS11_ENUM_xxx flags,
+ * one slot at a time or concurrently:
+ * - "eager": the token information of each slot is retrieved up front
+ * - "lazy": the token information is only retrieved for the slot
+ *   passed to PKCS11_load_token_info()
+ * - "present": only the slots with a token are listed
+ * The C_GetTokenInfo() calls are counted by the caller.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libp11.h>
+#include <openssl/err.h>
+
+#define LABEL "libp11-test"
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+/* Check whether the token information of a slot was retrieved */
+static int check_token(PKCS11_SLOT *slot, int loaded)
+{
+	if (!slot->token) {
+		fprintf(stderr, "%s: no token\n", slot->description);
+		return -1;
+	}
+	if (!loaded && slot->token->label) {
+		fprintf(stderr, "%s: token information retrieved\n",
+			slot->description);
+		return -1;
+	}
+	if (loaded && (!slot->token->label ||
+			strcmp(slot->token->label, LABEL) ||
+			!slot->token->serialnr || !slot->token->initialized)) {
+		fprintf(stderr, "%s: token information missing\n",
+			slot->description);
+		return -1;
+	}
+	return 0;
+}
+
+static int test_eager(PKCS11_SLOT *slots, unsigned int nslots)
+{
+	unsigned int i;
+
+	for (i = 0; i < nslots; i++)
+		if (check_token(&slots[i], 1))
+			return -1;
+	return 0;
+}
+
+static int test_lazy(PKCS11_SLOT *slots, unsigned int nslots)
+{
+	unsigned int i;
+
+	if (nslots < 2) {
+		fprintf(stderr, "%u slots instead of at least 2\n", nslots);
+		return -1;
+	}
+	for (i = 0; i < nslots; i++)
+		if (check_token(&slots[i], 0))
+			return -1;
+	if (PKCS11_load_token_info(&slots[1])) {
+		error_queue("PKCS11_load_token_info");
+		return -1;
+	}
+	for (i = 0; i < nslots; i++)
+		if (check_token(&slots[i], i == 1))
+			return -1;
+	return 0;
+}
+
+/* The slots with a token are the ones with an even ID */
+static int test_present(PKCS11_SLOT *slots, unsigned int nslots,
+		unsigned int expected)
+{
+	unsigned int i;
+
+	if (nslots != expected) {
+		fprintf(stderr, "%u slots instead of %u\n", nslots, expected);
+		return -1;
+	}
+	for (i = 0; i < nslots; i++) {
+		if (PKCS11_get_slotid_from_slot(&slots[i]) % 2 ||
+				check_token(&slots[i], 1))
+			return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots;
+	unsigned int nslots, flags = 0;
+	int rc = 1;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so "
+			"eager|lazy|present THREADS [SLOTS]\n", argv[0]);
+		return 1;
+	}
+	if (strcmp(argv[2], "lazy") == 0)
+		flags = PKCS11_ENUM_LAZY_TOKEN_INFO;
+	else if (strcmp(argv[2], "present") == 0)
+		flags = PKCS11_ENUM_TOKEN_PRESENT;
+
+	ctx = PKCS11_CTX_new();
+	PKCS11_CTX_set_enum_threads(ctx, atoi(argv[3]));
+	PKCS11_CTX_set_enum_flags(ctx, flags);
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+
+	if (strcmp(argv[2], "eager") == 0) {
+		if (test_eager(slots, nslots) == 0)
+			rc = 0;
+	} else if (strcmp(argv[2], "lazy") == 0) {
+		if (test_lazy(slots, nslots) == 0)
+			rc = 0;
+	} else if (strcmp(argv[2], "present") == 0) {
+		if (argc > 4 && test_present(slots, nslots, atoi(argv[4])) == 0)
+			rc = 0;
+	} else {
+		fprintf(stderr, "unknown test %s\n", argv[2]);
+	}
+	if (rc == 0)
+		printf("%s: %u slots\n", argv[2], nslots);
+
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,187 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: iterate-objects.c
+ *
+ * Checks that the key and certificate iterators return the same
+ * objects as PKCS11_enumerate_keys() and PKCS11_enumerate_certs(),
+ * and that the key of a certificate keeps its address while the
+ * other keys are enumerated.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libp11.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int same_id(const unsigned char *id1, size_t id1_len,
+		const unsigned char *id2, size_t id2_len)
+{
+	return id1_len == id2_len && (!id1_len || !memcmp(id1, id2, id1_len));
+}
+
+/* Returns the number of iterated keys also found in the list, or -1 */
+static int check_keys(PKCS11_KEY_ITER *iter, PKCS11_KEY *keys,
+		unsigned int nkeys)
+{
+	PKCS11_KEY *key;
+	unsigned int i;
+	int n = 0;
+
+	if (!iter)
+		return -1;
+	while (PKCS11_key_iter_next(iter, &key) == 0) {
+		if (!key) {
+			PKCS11_key_iter_free(iter);
+			return n;
+		}
+		for (i = 0; i < nkeys; i++)
+			if (same_id(key->id, key->id_len, keys[i].id, keys[i].id_len))
+				break;
+		if (i == nkeys) {
+			fprintf(stderr, "key %s not enumerated\n", key->label);
+			break;
+		}
+		n++;
+	}
+	PKCS11_key_iter_free(iter);
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys, *key;
+	PKCS11_CERT *certs, *cert;
+	PKCS11_CERT_ITER *iter;
+	unsigned int nslots, nkeys, ncerts;
+	int n, rc = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n",
+			argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		goto notoken;
+	}
+	if (PKCS11_login(slot, 0, argv[2])) {
+		error_queue("PKCS11_login");
+		goto notoken;
+	}
+
+	/* Only the key of the first certificate is searched */
+	if (PKCS11_enumerate_certs(slot->token, &certs, &ncerts) || !ncerts) {
+		fprintf(stderr, "no certificates found\n");
+		goto notoken;
+	}
+	key = PKCS11_find_key(&certs[0]);
+	if (!key) {
+		fprintf(stderr, "no key matching certificate available\n");
+		goto notoken;
+	}
+
+	if (PKCS11_enumerate_keys(slot->token, &keys, &nkeys) || !nkeys) {
+		fprintf(stderr, "no private keys found\n");
+		goto notoken;
+	}
+	if (PKCS11_find_key(&certs[0]) != key) {
+		fprintf(stderr, "the key moved while the keys were enumerated\n");
+		goto notoken;
+	}
+	n = check_keys(PKCS11_key_iter_new(slot->token, NULL), keys, nkeys);
+	if (n != (int)nkeys) {
+		error_queue("PKCS11_key_iter_next");
+		fprintf(stderr, "%d of %u private keys iterated\n", n, nkeys);
+		goto notoken;
+	}
+	/* Only the keys with the same ID as the first one */
+	n = check_keys(PKCS11_key_iter_new(slot->token, &keys[0]), keys, 1);
+	if (n < 1 || (unsigned int)n > nkeys) {
+		error_queue("PKCS11_key_iter_next");
+		fprintf(stderr, "%d private keys matching the template\n", n);
+		goto notoken;
+	}
+
+	if (PKCS11_enumerate_public_keys(slot->token, &keys, &nkeys)) {
+		error_queue("PKCS11_enumerate_public_keys");
+		goto notoken;
+	}
+	n = check_keys(PKCS11_public_key_iter_new(slot->token, NULL), keys, nkeys);
+	if (n != (int)nkeys) {
+		error_queue("PKCS11_key_iter_next");
+		fprintf(stderr, "%d of %u public keys iterated\n", n, nkeys);
+		goto notoken;
+	}
+
+	if (PKCS11_enumerate_certs(slot->token, &certs, &ncerts) || !ncerts) {
+		fprintf(stderr, "no certificates found\n");
+		goto notoken;
+	}
+	iter = PKCS11_cert_iter_new(slot->token, NULL);
+	if (!iter) {
+		error_queue("PKCS11_cert_iter_new");
+		goto notoken;
+	}
+	n = 0;
+	while (PKCS11_cert_iter_next(iter, &cert) == 0 && cert) {
+		if (!cert->x509 || X509_cmp(cert->x509, certs[n].x509)) {
+			fprintf(stderr, "certificate %d does not match\n", n);
+			break;
+		}
+		if (++n == (int)ncerts)
+			break;
+	}
+	PKCS11_cert_iter_free(iter);
+	if (n != (int)ncerts) {
+		error_queue("PKCS11_cert_iter_next");
+		fprintf(stderr, "%d of %u certificates iterated\n", n, ncerts);
+		goto notoken;
+	}
+	printf("%u certificates iterated\n", ncerts);
+	rc = 0;
+
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+/* vim: set noexpandtab: */
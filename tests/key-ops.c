@@ -0,0 +1,214 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: key-ops.c
+ *
+ * Signs and decrypts with the key of the first certificate:
+ * - "permitted": the operations succeed
+ * - "denied": the key does not permit the decryption, which fails with
+ *   CKR_KEY_FUNCTION_NOT_PERMITTED
+ * The C_GetMechanismList(), C_GetMechanismInfo() and C_DecryptInit()
+ * calls are counted by the caller.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libp11.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+#define DIGEST_SIZE 32
+#define MAX_SIGSIZE 1024
+#define OPERATIONS 5
+
+#define CKR_KEY_FUNCTION_NOT_PERMITTED 0x00000068UL
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int sign(EVP_PKEY *pkey)
+{
+	EVP_PKEY_CTX *pctx;
+	unsigned char md[DIGEST_SIZE], sig[MAX_SIGSIZE];
+	size_t siglen = sizeof sig;
+	int ok;
+
+	RAND_bytes(md, sizeof md);
+	pctx = EVP_PKEY_CTX_new(pkey, NULL);
+	ok = pctx && EVP_PKEY_sign_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+		EVP_PKEY_sign(pctx, sig, &siglen, md, DIGEST_SIZE) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	if (!ok)
+		error_queue("EVP_PKEY_sign");
+	return ok ? 0 : -1;
+}
+
+/* Encrypt with the public key, and decrypt with the private key */
+static int decrypt(EVP_PKEY *pkey, EVP_PKEY *pubkey)
+{
+	EVP_PKEY_CTX *pctx;
+	unsigned char data[DIGEST_SIZE], enc[MAX_SIGSIZE], dec[MAX_SIGSIZE];
+	size_t enclen = sizeof enc, declen = sizeof dec;
+	int ok;
+
+	RAND_bytes(data, sizeof data);
+	pctx = EVP_PKEY_CTX_new(pubkey, NULL);
+	ok = pctx && EVP_PKEY_encrypt_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PADDING) > 0 &&
+		EVP_PKEY_encrypt(pctx, enc, &enclen, data, sizeof data) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	if (!ok) {
+		error_queue("EVP_PKEY_encrypt");
+		return -1;
+	}
+	pctx = EVP_PKEY_CTX_new(pkey, NULL);
+	ok = pctx && EVP_PKEY_decrypt_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PADDING) > 0 &&
+		EVP_PKEY_decrypt(pctx, dec, &declen, enc, enclen) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	if (!ok)
+		return -1;
+	if (declen != sizeof data || memcmp(dec, data, declen)) {
+		fprintf(stderr, "the decrypted data differ\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Check that the last decryption was rejected by libp11 */
+static int check_denied(void)
+{
+	unsigned long e;
+	int denied = 0;
+
+	while ((e = ERR_get_error()))
+		if (ERR_GET_LIB(e) == ERR_get_CKR_code() &&
+				ERR_GET_REASON(e) == CKR_KEY_FUNCTION_NOT_PERMITTED)
+			denied = 1;
+	if (!denied) {
+		fprintf(stderr, "the decryption was not denied\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int test_ops(EVP_PKEY *pkey, EVP_PKEY *pubkey, int permitted)
+{
+	int i;
+
+	for (i = 0; i < OPERATIONS; i++) {
+		if (sign(pkey))
+			return -1;
+		if (permitted) {
+			if (decrypt(pkey, pubkey)) {
+				error_queue("EVP_PKEY_decrypt");
+				return -1;
+			}
+		} else {
+			if (!decrypt(pkey, pubkey)) {
+				fprintf(stderr, "the key decrypted\n");
+				return -1;
+			}
+			if (check_denied())
+				return -1;
+		}
+	}
+	printf("%d signatures, %d decryptions %s\n", OPERATIONS, OPERATIONS,
+		permitted ? "permitted" : "denied");
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_CERT *certs;
+	PKCS11_KEY *key;
+	EVP_PKEY *pkey = NULL, *pubkey = NULL;
+	unsigned int nslots, ncerts;
+	int rc = 1;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN "
+			"permitted|denied\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		goto notoken;
+	}
+	if (PKCS11_login(slot, 0, argv[2])) {
+		error_queue("PKCS11_login");
+		goto notoken;
+	}
+	if (PKCS11_enumerate_certs(slot->token, &certs, &ncerts) || !ncerts) {
+		fprintf(stderr, "no certificates found\n");
+		goto notoken;
+	}
+	key = PKCS11_find_key(&certs[0]);
+	if (!key) {
+		fprintf(stderr, "no key matching certificate available\n");
+		goto notoken;
+	}
+	pkey = PKCS11_get_private_key(key);
+	pubkey = PKCS11_get_public_key(key);
+	if (!pkey || !pubkey) {
+		error_queue("PKCS11_get_private_key");
+		goto nokey;
+	}
+
+	if (strcmp(argv[3], "permitted") == 0) {
+		if (test_ops(pkey, pubkey, 1) == 0)
+			rc = 0;
+	} else if (strcmp(argv[3], "denied") == 0) {
+		if (test_ops(pkey, pubkey, 0) == 0)
+			rc = 0;
+	} else {
+		fprintf(stderr, "unknown test %s\n", argv[3]);
+	}
+
+nokey:
+	EVP_PKEY_free(pubkey);
+	EVP_PKEY_free(pkey);
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,312 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: key-replica.c
+ *
+ * Signs with a key replicated on the second slot of the mock module:
+ * - "balance": concurrent operations are spread over both slots
+ * - "failover": the slot of the key fails in the middle of the run,
+ *   and the operations continue on the replica
+ * - "remove": the token of the replica is removed, and the slots are
+ *   updated as the slot watcher of the engine does; the operations
+ *   continue on the key alone
+ * - "eject": the same, with the slots without a token enumerated
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libp11.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/x509.h>
+
+#define DIGEST_SIZE 32
+#define MAX_SIGSIZE 1024
+#define ROUNDS 10
+#define THREADS 4
+
+static EVP_PKEY *pkey, *pubkey;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+/* Sign a random digest, and verify the signature with the certificate */
+static int sign_verify(void)
+{
+	unsigned char md[DIGEST_SIZE], sig[MAX_SIGSIZE];
+	size_t siglen = sizeof sig;
+	EVP_PKEY_CTX *pctx;
+	int ok;
+
+	RAND_bytes(md, sizeof md);
+	pctx = EVP_PKEY_CTX_new(pkey, NULL);
+	ok = pctx && EVP_PKEY_sign_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+		EVP_PKEY_sign(pctx, sig, &siglen, md, sizeof md) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	if (!ok) {
+		error_queue("EVP_PKEY_sign");
+		return -1;
+	}
+	pctx = EVP_PKEY_CTX_new(pubkey, NULL);
+	ok = pctx && EVP_PKEY_verify_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+		EVP_PKEY_verify(pctx, sig, siglen, md, sizeof md) == 1;
+	EVP_PKEY_CTX_free(pctx);
+	if (!ok) {
+		error_queue("EVP_PKEY_verify");
+		fprintf(stderr, "invalid signature\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Number of signatures computed on a slot */
+static unsigned long sign_calls(PKCS11_SLOT *slot)
+{
+	PKCS11_STATS stats;
+
+	if (PKCS11_get_stats(slot, &stats))
+		return 0;
+	return stats.ops[PKCS11_STATS_SIGN].calls -
+		stats.ops[PKCS11_STATS_SIGN].errors;
+}
+
+static void *sign_thread(void *arg)
+{
+	int i;
+
+	*(int *)arg = 0;
+	for (i = 0; i < ROUNDS; i++)
+		if (sign_verify())
+			*(int *)arg = -1;
+	return NULL;
+}
+
+static int run_threads(void)
+{
+	pthread_t threads[THREADS];
+	int rvs[THREADS], i, n, rv = 0;
+
+	for (n = 0; n < THREADS; n++)
+		if (pthread_create(&threads[n], NULL, sign_thread, &rvs[n]))
+			break;
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i], NULL);
+		if (rvs[i])
+			rv = -1;
+	}
+	if (n < THREADS || rv) {
+		fprintf(stderr, "signing failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int test_balance(PKCS11_SLOT *slot, PKCS11_SLOT *other)
+{
+	if (run_threads())
+		return -1;
+	printf("%lu signed on the key, %lu on the replica\n",
+		sign_calls(slot), sign_calls(other));
+	if (!sign_calls(slot) || !sign_calls(other)) {
+		fprintf(stderr, "the operations were not distributed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int test_failover(PKCS11_SLOT *slot, PKCS11_SLOT *other)
+{
+	char slotid[32];
+	unsigned long before;
+	int i;
+
+	for (i = 0; i < ROUNDS; i++)
+		if (sign_verify())
+			return -1;
+	/* The slot of the key fails from now on */
+	snprintf(slotid, sizeof slotid, "%lu", PKCS11_get_slotid_from_slot(slot));
+	setenv("MOCK_PKCS11_FAIL_SLOT", slotid, 1);
+	before = sign_calls(other);
+	for (i = 0; i < ROUNDS; i++) {
+		if (sign_verify()) {
+			fprintf(stderr, "signing failed after %d operations\n", i);
+			return -1;
+		}
+	}
+	unsetenv("MOCK_PKCS11_FAIL_SLOT");
+	if (sign_calls(other) - before != ROUNDS) {
+		fprintf(stderr, "%lu operations on the replica instead of %d\n",
+			sign_calls(other) - before, ROUNDS);
+		return -1;
+	}
+	return 0;
+}
+
+static int test_remove(PKCS11_CTX *ctx, PKCS11_SLOT **slots,
+		unsigned int *nslots, unsigned long slotid)
+{
+	const char *path = getenv("MOCK_PKCS11_TOKEN_STATE");
+	PKCS11_SLOT *slot;
+	unsigned long before, slotevent;
+	unsigned int i;
+	FILE *file;
+	int rv;
+
+	if (!path) {
+		fprintf(stderr, "MOCK_PKCS11_TOKEN_STATE is not set\n");
+		return -1;
+	}
+	if (run_threads())
+		return -1;
+	/* Remove the token of the replica */
+	file = fopen(path, "w");
+	if (!file || fputs(slotid ? "01" : "10", file) < 0 || fclose(file)) {
+		fprintf(stderr, "cannot write %s\n", path);
+		return -1;
+	}
+	/* Update the slots as the slot watcher of the engine */
+	rv = PKCS11_get_slot_event(ctx, &slotevent);
+	while (rv > 0)
+		rv = PKCS11_get_slot_event(ctx, &slotevent);
+	if (PKCS11_update_slots(ctx, slots, nslots) < 0) {
+		error_queue("PKCS11_update_slots");
+		return -1;
+	}
+	for (slot = NULL, i = 0; i < *nslots; i++)
+		if (PKCS11_get_slotid_from_slot(*slots + i) == slotid)
+			slot = *slots + i;
+	if (!slot || !slot->token) {
+		fprintf(stderr, "the token of the key was lost\n");
+		return -1;
+	}
+	before = sign_calls(slot);
+	if (run_threads())
+		return -1;
+	if (sign_calls(slot) - before != THREADS * ROUNDS) {
+		fprintf(stderr, "%lu operations on the key instead of %d\n",
+			sign_calls(slot) - before, THREADS * ROUNDS);
+		return -1;
+	}
+	return 0;
+}
+
+/* Log in and find the key of the first certificate of the token */
+static PKCS11_KEY *find_key(PKCS11_SLOT *slot, const char *pin,
+		PKCS11_CERT **cert)
+{
+	PKCS11_CERT *certs;
+	PKCS11_KEY *key;
+	unsigned int ncerts;
+
+	if (PKCS11_login(slot, 0, pin)) {
+		error_queue("PKCS11_login");
+		return NULL;
+	}
+	if (PKCS11_enumerate_certs(slot->token, &certs, &ncerts) || !ncerts) {
+		fprintf(stderr, "no certificates found\n");
+		return NULL;
+	}
+	key = PKCS11_find_key(&certs[0]);
+	if (!key)
+		fprintf(stderr, "no key matching certificate available\n");
+	*cert = &certs[0];
+	return key;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot, *other;
+	PKCS11_CERT *cert;
+	PKCS11_KEY *key, *replica;
+	unsigned int nslots;
+	int rc = 1;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN "
+			"balance|failover|remove|eject\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (strcmp(argv[3], "remove") == 0)
+		PKCS11_CTX_set_enum_flags(ctx, PKCS11_ENUM_TOKEN_PRESENT);
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	other = slot ? PKCS11_find_next_token(ctx, slots, nslots, slot) : NULL;
+	if (!other) {
+		fprintf(stderr, "two tokens are required\n");
+		goto notoken;
+	}
+	replica = find_key(other, argv[2], &cert);
+	key = find_key(slot, argv[2], &cert);
+	if (!key || !replica)
+		goto notoken;
+	if (PKCS11_add_key_replica(key, replica)) {
+		error_queue("PKCS11_add_key_replica");
+		goto notoken;
+	}
+	pkey = PKCS11_get_private_key(key);
+	pubkey = X509_get_pubkey(PKCS11_get_x509(cert));
+	if (!pkey || !pubkey) {
+		error_queue("PKCS11_get_private_key");
+		goto nokey;
+	}
+
+	if (strcmp(argv[3], "balance") == 0) {
+		if (test_balance(slot, other) == 0)
+			rc = 0;
+	} else if (strcmp(argv[3], "failover") == 0) {
+		if (test_failover(slot, other) == 0)
+			rc = 0;
+	} else if (strcmp(argv[3], "remove") == 0 ||
+			strcmp(argv[3], "eject") == 0) {
+		if (test_remove(ctx, &slots, &nslots,
+				PKCS11_get_slotid_from_slot(slot)) == 0)
+			rc = 0;
+	} else {
+		fprintf(stderr, "unknown test %s\n", argv[3]);
+	}
+
+nokey:
+	EVP_PKEY_free(pkey);
+	EVP_PKEY_free(pubkey);
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+/* vim: set noexpandtab: */
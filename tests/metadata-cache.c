@@ -0,0 +1,161 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: metadata-cache.c
+ *
+ * Enumerates the keys and the certificates of a token with the metadata
+ * cache enabled, and uses each private key and certificate, so that the
+ * number of calls of a process with and without a valid cache file can
+ * be compared.  Prints the number of objects and of usable objects.
+ * The optional number of threads enumerate the private keys at once
+ * first, and must all find the same keys.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libp11.h>
+#include <openssl/err.h>
+
+#define MAX_THREADS 16
+
+typedef struct {
+	PKCS11_TOKEN *token;
+	unsigned int nkeys;
+	int rv;
+} ENUM_ARGS;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static void *enum_thread(void *arg)
+{
+	ENUM_ARGS *args = arg;
+	PKCS11_KEY *keys;
+
+	args->rv = PKCS11_enumerate_keys(args->token, &keys, &args->nkeys);
+	return NULL;
+}
+
+/* Enumerate the private keys of a token in concurrent threads */
+static int enum_threads(PKCS11_TOKEN *token, int count)
+{
+	pthread_t threads[MAX_THREADS];
+	ENUM_ARGS args[MAX_THREADS];
+	int i, n, rv = 0;
+
+	for (n = 0; n < count && n < MAX_THREADS; n++) {
+		args[n].token = token;
+		if (pthread_create(&threads[n], NULL, enum_thread, &args[n]))
+			break;
+	}
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i], NULL);
+		if (args[i].rv || args[i].nkeys != args[0].nkeys) {
+			fprintf(stderr, "thread %d found %u private keys instead of %u\n",
+				i, args[i].nkeys, args[0].nkeys);
+			rv = -1;
+		}
+	}
+	return n == count ? rv : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys, *pubkeys;
+	PKCS11_CERT *certs;
+	EVP_PKEY *pkey;
+	unsigned int nslots, nkeys, npubkeys, ncerts, usable = 0, i;
+	int rc = 1;
+
+	if (argc < 5) {
+		fprintf(stderr,
+			"usage: %s /usr/lib/opensc-pkcs11.so PIN CACHEDIR GENERATION "
+			"[THREADS]\n",
+			argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_CTX_set_metadata_cache(ctx, argv[3], argv[4])) {
+		error_queue("PKCS11_CTX_set_metadata_cache");
+		goto noctx;
+	}
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto noctx;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		goto notoken;
+	}
+	if (PKCS11_login(slot, 0, argv[2])) {
+		error_queue("PKCS11_login");
+		goto notoken;
+	}
+
+	if (argc > 5 && enum_threads(slot->token, atoi(argv[5]))) {
+		error_queue("PKCS11_enumerate_keys");
+		goto notoken;
+	}
+	if (PKCS11_enumerate_keys(slot->token, &keys, &nkeys) ||
+			PKCS11_enumerate_public_keys(slot->token,
+				&pubkeys, &npubkeys) ||
+			PKCS11_enumerate_certs(slot->token, &certs, &ncerts)) {
+		error_queue("enumeration");
+		goto notoken;
+	}
+
+	/* The keys removed from the token are not usable */
+	for (i = 0; i < nkeys; i++) {
+		pkey = PKCS11_get_private_key(&keys[i]);
+		if (pkey)
+			usable++;
+		EVP_PKEY_free(pkey);
+	}
+	ERR_clear_error();
+	for (i = 0; i < ncerts; i++) {
+		if (!PKCS11_get_x509(&certs[i])) {
+			error_queue("PKCS11_get_x509");
+			goto notoken;
+		}
+	}
+	printf("private keys: %u usable: %u public keys: %u certificates: %u\n",
+		nkeys, usable, npubkeys, ncerts);
+	rc = 0;
+
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+noctx:
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,41 @@
+#!/bin/sh
+
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Common initialization of the tests using the mock PKCS#11 module
+# built from mock-pkcs11.c instead of SoftHSM
+
+echo "Current directory: $(pwd)"
+echo "Source directory: ${srcdir}"
+echo "Output directory: ${outdir}"
+
+mkdir -p $outdir
+
+MODULE="$(pwd)/.libs/mock-pkcs11.so"
+if ! test -f "${MODULE}"; then
+	echo "Could not find the mock module"
+	exit 77
+fi
+
+PIN=1234
+
+# The tokens hold the keys and the certificates of the SoftHSM tests
+export MOCK_PKCS11_KEYDIR="${srcdir}"
+export MOCK_PKCS11_PIN="${PIN}"
+
+# The number of calls of a function, as recorded in MOCK_PKCS11_STATS
+mock_calls () {
+	calls=$(sed -n "s/.*\"$1\":\([0-9]*\).*/\1/p" "${MOCK_PKCS11_STATS}" | tail -1)
+	echo ${calls:-0}
+}
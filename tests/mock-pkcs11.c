@@ -0,0 +1,2272 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: mock-pkcs11.c
+ *
+ * A mock PKCS#11 module with configurable latency, used to measure the
+ * round trips to remote tokens in a repeatable way.
+ *
+ * The module emulates one or more tokens with the same RSA and EC key
+ * material.  The keys are loaded from the DER files in the directory
+ * specified with MOCK_PKCS11_KEYDIR, or generated when it is not set.
+ * The synthetic objects are labelled "bench-N", with the 4-byte ID
+ * 0xbe followed by N, like the objects stored by bench-enum.
+ *
+ * Environment variables:
+ *   MOCK_PKCS11_KEYDIR      directory with rsa-prvkey.der, rsa-cert.der,
+ *                           ec-prvkey.der and ec-cert.der
+ *   MOCK_PKCS11_SLOTS       number of slots with a token (default: 1)
+ *   MOCK_PKCS11_PIN         user PIN (default: 1234)
+ *   MOCK_PKCS11_SESSIONS    maximum number of sessions per token
+ *                           (default: unlimited)
+ *   MOCK_PKCS11_RW_SESSIONS maximum number of read-write sessions per
+ *                           token (default: MOCK_PKCS11_SESSIONS)
+ *   MOCK_PKCS11_HIDE_LIMITS the session limits are enforced, but not
+ *                           reported by C_GetTokenInfo()
+ *   MOCK_PKCS11_OBJECTS     number of synthetic RSA public keys created
+ *                           on each token (default: 0)
+ *   MOCK_PKCS11_KEYS        number of synthetic RSA private keys
+ *   MOCK_PKCS11_CERTS       number of synthetic certificates, only
+ *                           created with the keys of MOCK_PKCS11_KEYDIR
+ *   MOCK_PKCS11_LATENCY     latency of the cryptographic operations,
+ *                           C_Login() and C_GenerateRandom() in
+ *                           microseconds (default: 0)
+ *   MOCK_PKCS11_JITTER      maximum random latency added to
+ *                           MOCK_PKCS11_LATENCY in microseconds
+ *   MOCK_PKCS11_CALL_LATENCY latency of all the other calls in
+ *                           microseconds (default: 0)
+ *   MOCK_PKCS11_CALL_JITTER maximum random latency added to
+ *                           MOCK_PKCS11_CALL_LATENCY in microseconds
+ *   MOCK_PKCS11_LATENCY_<function>, MOCK_PKCS11_JITTER_<function>
+ *                           latency and jitter of a single function,
+ *                           e.g. MOCK_PKCS11_LATENCY_C_FindObjects
+ *   MOCK_PKCS11_STATS       file the numbers of calls of each function
+ *                           are appended to when the process exits, as
+ *                           a JSON object on a single line, with the
+ *                           successful C_Login() calls of each user type
+ *                           as C_Login_SO, C_Login_USER and
+ *                           C_Login_CONTEXT_SPECIFIC
+ *   MOCK_PKCS11_FAIL_SLOT   slot failing the cryptographic operations
+ *                           with CKR_DEVICE_ERROR
+ *   MOCK_PKCS11_FAIL_OPEN   C_OpenSession() fails with CKR_DEVICE_ERROR
+ *   MOCK_PKCS11_TOKEN_STATE file with a character per slot: '0' for no
+ *                           token, any other one is the generation of the
+ *                           token (the last character of its serial)
+ *   MOCK_PKCS11_NO_EVENTS   C_WaitForSlotEvent() is not supported
+ *   MOCK_PKCS11_ALWAYS_AUTH the private keys require a context-specific
+ *                           login (CKA_ALWAYS_AUTHENTICATE)
+ *   MOCK_PKCS11_NO_DECRYPT  the private keys do not permit the decryption
+ *                           (CKA_DECRYPT is false)
+ */
+
+#include "pkcs11.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
+#define RSA_get0_key(r, pn, pe, pd) \
+	do { *(pn) = (r)->n; *(pe) = (r)->e; } while (0)
+#define ECDSA_SIG_get0(sig, pr, ps) \
+	do { *(pr) = (sig)->r; *(ps) = (sig)->s; } while (0)
+#define EVP_PKEY_get0_RSA(pkey) ((pkey)->pkey.rsa)
+#define EVP_PKEY_get0_EC_KEY(pkey) ((pkey)->pkey.ec)
+#endif
+
+#define MOCK_MAX_SLOTS		16
+#define MOCK_MAX_ATTRS		24
+#define MOCK_LABEL_LEN		32
+
+typedef struct mock_object {
+	CK_OBJECT_HANDLE handle;
+	CK_SLOT_ID slot;
+	CK_SESSION_HANDLE owner; /* 0 for token objects */
+	CK_OBJECT_CLASS class;
+	CK_BBOOL private;
+	EVP_PKEY *pkey; /* a reference to the key material */
+	CK_ATTRIBUTE attrs[MOCK_MAX_ATTRS];
+	CK_ULONG nattrs;
+} MOCK_OBJECT;
+
+typedef struct mock_session {
+	int used;
+	CK_SLOT_ID slot;
+	CK_FLAGS flags;
+	/* active search */
+	int finding;
+	CK_OBJECT_HANDLE *found;
+	CK_ULONG nfound, pos;
+	/* active cryptographic operation */
+	int op;
+	CK_MECHANISM_TYPE mechanism;
+	unsigned char param[64];
+	CK_OBJECT_HANDLE key;
+	EVP_MD_CTX *mdctx; /* multi-part signing */
+	EVP_CIPHER_CTX *cctx; /* multi-part encryption and decryption */
+	CK_ULONG buffered; /* input bytes kept by cctx */
+	unsigned char tail[16]; /* the last bytes of a GCM decryption */
+	CK_ULONG tail_len;
+} MOCK_SESSION;
+
+enum { OP_NONE, OP_SIGN, OP_DECRYPT, OP_ENCRYPT, OP_VERIFY };
+
+/* The functions with a latency, and whether they are operations */
+#define MOCK_FUNCTIONS(F) \
+	F(C_GetSlotList, 0) \
+	F(C_GetSlotInfo, 0) \
+	F(C_GetTokenInfo, 0) \
+	F(C_GetMechanismList, 0) \
+	F(C_GetMechanismInfo, 0) \
+	F(C_OpenSession, 0) \
+	F(C_CloseSession, 0) \
+	F(C_CloseAllSessions, 0) \
+	F(C_GetSessionInfo, 0) \
+	F(C_Login, 1) \
+	F(C_Logout, 0) \
+	F(C_CreateObject, 0) \
+	F(C_DestroyObject, 0) \
+	F(C_GetAttributeValue, 0) \
+	F(C_FindObjectsInit, 0) \
+	F(C_FindObjects, 0) \
+	F(C_FindObjectsFinal, 0) \
+	F(C_EncryptInit, 0) \
+	F(C_Encrypt, 1) \
+	F(C_EncryptUpdate, 1) \
+	F(C_EncryptFinal, 0) \
+	F(C_DecryptInit, 0) \
+	F(C_Decrypt, 1) \
+	F(C_DecryptUpdate, 1) \
+	F(C_DecryptFinal, 0) \
+	F(C_SignInit, 0) \
+	F(C_Sign, 1) \
+	F(C_SignUpdate, 0) \
+	F(C_SignFinal, 1) \
+	F(C_VerifyInit, 0) \
+	F(C_Verify, 1) \
+	F(C_GenerateKeyPair, 1) \
+	F(C_DeriveKey, 1) \
+	F(C_SeedRandom, 0) \
+	F(C_GenerateRandom, 1)
+
+#define MOCK_FN_ENUM(name, op) FN_ ## name,
+enum { MOCK_FUNCTIONS(MOCK_FN_ENUM) FN_COUNT };
+#undef MOCK_FN_ENUM
+
+#define MOCK_FN_INFO(name, op) {#name, op},
+static const struct {
+	const char *name;
+	int op; /* uses MOCK_PKCS11_LATENCY rather than MOCK_PKCS11_CALL_LATENCY */
+} mock_fn_info[FN_COUNT] = {
+	MOCK_FUNCTIONS(MOCK_FN_INFO)
+};
+#undef MOCK_FN_INFO
+
+typedef struct mock_token {
+	int logged_in; /* -1 or CKU_USER/CKU_SO */
+	CK_ULONG sessions, rw_sessions;
+} MOCK_TOKEN;
+
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mock_initialized;
+static CK_ULONG mock_nslots = 1;
+static CK_ULONG mock_max_sessions, mock_max_rw_sessions;
+static int mock_hide_limits;
+static unsigned long mock_latency[FN_COUNT], mock_jitter[FN_COUNT];
+static unsigned long mock_calls[FN_COUNT];
+static unsigned long mock_logins[CKU_CONTEXT_SPECIFIC + 1];
+static pthread_mutex_t mock_delay_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int mock_seed = 1;
+static int mock_stats_registered;
+static char mock_pin[64] = "1234";
+static MOCK_TOKEN mock_tokens[MOCK_MAX_SLOTS];
+
+static MOCK_OBJECT **mock_objects;
+static CK_ULONG mock_nobjects, mock_objects_size;
+
+static MOCK_SESSION *mock_sessions;
+static CK_ULONG mock_nsessions;
+
+static EVP_PKEY *mock_rsa_key, *mock_ec_key;
+static unsigned char *mock_rsa_cert, *mock_ec_cert;
+static int mock_rsa_cert_len, mock_ec_cert_len;
+
+static CK_MECHANISM_TYPE mock_mechanisms[] = {
+	CKM_RSA_PKCS, CKM_RSA_X_509, CKM_RSA_PKCS_PSS, CKM_RSA_PKCS_OAEP,
+	CKM_SHA256_RSA_PKCS, CKM_SHA384_RSA_PKCS, CKM_SHA512_RSA_PKCS,
+	CKM_SHA256_RSA_PKCS_PSS, CKM_SHA384_RSA_PKCS_PSS, CKM_SHA512_RSA_PKCS_PSS,
+	CKM_ECDSA, CKM_ECDSA_SHA256, CKM_ECDH1_DERIVE,
+	CKM_AES_CBC, CKM_AES_CBC_PAD, CKM_AES_GCM
+};
+
+/******************************************************************************/
+/* Helpers                                                                    */
+/******************************************************************************/
+
+static unsigned long mock_env(const char *name, unsigned long def)
+{
+	const char *value = getenv(name);
+
+	return value ? strtoul(value, NULL, 0) : def;
+}
+
+static void mock_sleep(unsigned long usec)
+{
+	struct timespec ts;
+
+	if (!usec)
+		return;
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0)
+		;
+}
+
+/*
+ * State of the token of a slot read from MOCK_PKCS11_TOKEN_STATE:
+ * one character per slot, '0' for no token, any other character is
+ * the generation of the token, included in its serial number
+ */
+static char mock_token_state(CK_SLOT_ID slot)
+{
+	const char *path = getenv("MOCK_PKCS11_TOKEN_STATE");
+	char state[MOCK_MAX_SLOTS + 1];
+	size_t len = 0;
+	FILE *file;
+
+	if (!path || !(file = fopen(path, "r")))
+		return '1';
+	len = fread(state, 1, sizeof state - 1, file);
+	fclose(file);
+	return slot < len && state[slot] > ' ' ? state[slot] : '1';
+}
+
+/* Token states last reported by C_WaitForSlotEvent() */
+static char mock_last_state[MOCK_MAX_SLOTS];
+
+/* Read the latency and the jitter of each function */
+static void mock_init_delays(void)
+{
+	unsigned long latency = mock_env("MOCK_PKCS11_LATENCY", 0);
+	unsigned long jitter = mock_env("MOCK_PKCS11_JITTER", 0);
+	unsigned long call_latency = mock_env("MOCK_PKCS11_CALL_LATENCY", 0);
+	unsigned long call_jitter = mock_env("MOCK_PKCS11_CALL_JITTER", 0);
+	char name[64];
+	int fn;
+
+	for (fn = 0; fn < FN_COUNT; fn++) {
+		snprintf(name, sizeof name, "MOCK_PKCS11_LATENCY_%s",
+			mock_fn_info[fn].name);
+		mock_latency[fn] = mock_env(name,
+			mock_fn_info[fn].op ? latency : call_latency);
+		snprintf(name, sizeof name, "MOCK_PKCS11_JITTER_%s",
+			mock_fn_info[fn].name);
+		mock_jitter[fn] = mock_env(name,
+			mock_fn_info[fn].op ? jitter : call_jitter);
+	}
+}
+
+/* Count a call and wait for the latency of the function */
+static void mock_delay(int fn)
+{
+	unsigned long usec = mock_latency[fn];
+
+	pthread_mutex_lock(&mock_delay_lock);
+	mock_calls[fn]++;
+	if (mock_jitter[fn])
+		usec += (unsigned long)rand_r(&mock_seed) % (mock_jitter[fn] + 1);
+	pthread_mutex_unlock(&mock_delay_lock);
+	mock_sleep(usec);
+}
+
+/* Append the numbers of calls to the MOCK_PKCS11_STATS file on exit */
+static void mock_write_stats(void)
+{
+	const char *path = getenv("MOCK_PKCS11_STATS");
+	static const char *users[] = {"SO", "USER", "CONTEXT_SPECIFIC"};
+	FILE *file;
+	CK_USER_TYPE user;
+	int fn;
+
+	if (!path || !(file = fopen(path, "a")))
+		return;
+	fprintf(file, "{\"bench\":\"mock-calls\"");
+	for (fn = 0; fn < FN_COUNT; fn++)
+		if (mock_calls[fn])
+			fprintf(file, ",\"%s\":%lu",
+				mock_fn_info[fn].name, mock_calls[fn]);
+	for (user = 0; user <= CKU_CONTEXT_SPECIFIC; user++)
+		if (mock_logins[user])
+			fprintf(file, ",\"C_Login_%s\":%lu",
+				users[user], mock_logins[user]);
+	fprintf(file, "}\n");
+	fclose(file);
+}
+
+static void mock_padded(unsigned char *dst, size_t len, const char *src)
+{
+	size_t n = strlen(src);
+
+	memset(dst, ' ', len);
+	memcpy(dst, src, n < len ? n : len);
+}
+
+static EVP_PKEY *mock_load_key(const char *dir, const char *name)
+{
+	char path[1024];
+	unsigned char buf[8192];
+	const unsigned char *p = buf;
+	FILE *f;
+	size_t len;
+
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+	len = fread(buf, 1, sizeof buf, f);
+	fclose(f);
+	return d2i_AutoPrivateKey(NULL, &p, (long)len);
+}
+
+static unsigned char *mock_load_file(const char *dir, const char *name,
+		int *lenp)
+{
+	char path[1024];
+	unsigned char *buf;
+	FILE *f;
+
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+	buf = malloc(8192);
+	if (buf)
+		*lenp = (int)fread(buf, 1, 8192, f);
+	fclose(f);
+	return buf;
+}
+
+static EVP_PKEY *mock_generate_key(int type)
+{
+	EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(type, NULL);
+	EVP_PKEY *pkey = NULL;
+
+	if (!pctx)
+		return NULL;
+	if (EVP_PKEY_keygen_init(pctx) <= 0)
+		goto done;
+	if (type == EVP_PKEY_RSA &&
+			EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, 2048) <= 0)
+		goto done;
+	if (type == EVP_PKEY_EC &&
+			EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx,
+				NID_X9_62_prime256v1) <= 0)
+		goto done;
+	EVP_PKEY_keygen(pctx, &pkey);
+done:
+	EVP_PKEY_CTX_free(pctx);
+	return pkey;
+}
+
+/******************************************************************************/
+/* Objects                                                                    */
+/******************************************************************************/
+
+static void mock_attr(MOCK_OBJECT *obj, CK_ATTRIBUTE_TYPE type,
+		const void *value, CK_ULONG len)
+{
+	CK_ATTRIBUTE *attr = &obj->attrs[obj->nattrs++];
+
+	attr->type = type;
+	attr->pValue = malloc(len ? len : 1);
+	if (len)
+		memcpy(attr->pValue, value, len);
+	attr->ulValueLen = len;
+}
+
+static void mock_attr_ulong(MOCK_OBJECT *obj, CK_ATTRIBUTE_TYPE type,
+		CK_ULONG value)
+{
+	mock_attr(obj, type, &value, sizeof value);
+}
+
+static void mock_attr_bool(MOCK_OBJECT *obj, CK_ATTRIBUTE_TYPE type,
+		CK_BBOOL value)
+{
+	mock_attr(obj, type, &value, sizeof value);
+}
+
+static void mock_attr_bn(MOCK_OBJECT *obj, CK_ATTRIBUTE_TYPE type,
+		const BIGNUM *bn)
+{
+	unsigned char buf[1024];
+	int len = BN_bn2bin(bn, buf);
+
+	mock_attr(obj, type, buf, (CK_ULONG)len);
+}
+
+static CK_ATTRIBUTE *mock_find_attr(MOCK_OBJECT *obj, CK_ATTRIBUTE_TYPE type)
+{
+	CK_ULONG i;
+
+	for (i = 0; i < obj->nattrs; i++)
+		if (obj->attrs[i].type == type)
+			return &obj->attrs[i];
+	return NULL;
+}
+
+static MOCK_OBJECT *mock_new_object(CK_SLOT_ID slot, CK_OBJECT_CLASS class,
+		CK_SESSION_HANDLE owner)
+{
+	MOCK_OBJECT *obj;
+
+	if (mock_nobjects == mock_objects_size) {
+		CK_ULONG size = mock_objects_size ? 2 * mock_objects_size : 64;
+		MOCK_OBJECT **tmp = realloc(mock_objects, size * sizeof(*tmp));
+
+		if (!tmp)
+			return NULL;
+		mock_objects = tmp;
+		mock_objects_size = size;
+	}
+	obj = calloc(1, sizeof(MOCK_OBJECT));
+	if (!obj)
+		return NULL;
+	obj->handle = mock_nobjects + 1;
+	obj->slot = slot;
+	obj->owner = owner;
+	obj->class = class;
+	mock_objects[mock_nobjects++] = obj;
+	mock_attr_ulong(obj, CKA_CLASS, class);
+	mock_attr_bool(obj, CKA_TOKEN, owner ? CK_FALSE : CK_TRUE);
+	return obj;
+}
+
+static void mock_free_object(MOCK_OBJECT *obj)
+{
+	CK_ULONG i;
+
+	for (i = 0; i < obj->nattrs; i++)
+		free(obj->attrs[i].pValue);
+	mock_objects[obj->handle - 1] = NULL;
+	free(obj);
+}
+
+static MOCK_OBJECT *mock_get_object(CK_SLOT_ID slot, CK_OBJECT_HANDLE handle)
+{
+	MOCK_OBJECT *obj;
+
+	if (handle < 1 || handle > mock_nobjects)
+		return NULL;
+	obj = mock_objects[handle - 1];
+	if (!obj || obj->slot != slot)
+		return NULL;
+	if (obj->private && mock_tokens[slot].logged_in != CKU_USER)
+		return NULL;
+	return obj;
+}
+
+static void mock_add_key_attrs(MOCK_OBJECT *obj, EVP_PKEY *pkey,
+		const char *label, const unsigned char *id, size_t id_len)
+{
+	obj->pkey = pkey;
+	mock_attr(obj, CKA_LABEL, label, strlen(label));
+	mock_attr(obj, CKA_ID, id, id_len);
+	if (EVP_PKEY_base_id(pkey) == EVP_PKEY_RSA) {
+		const RSA *rsa = EVP_PKEY_get0_RSA(pkey);
+		const BIGNUM *n, *e, *d;
+
+		RSA_get0_key(rsa, &n, &e, &d);
+		mock_attr_ulong(obj, CKA_KEY_TYPE, CKK_RSA);
+		mock_attr_bn(obj, CKA_MODULUS, n);
+		mock_attr_bn(obj, CKA_PUBLIC_EXPONENT, e);
+		mock_attr_ulong(obj, CKA_MODULUS_BITS, (CK_ULONG)BN_num_bits(n));
+	} else {
+		const EC_KEY *ec = EVP_PKEY_get0_EC_KEY(pkey);
+		unsigned char buf[512], *p = buf, point[256];
+		int len;
+		size_t plen;
+
+		mock_attr_ulong(obj, CKA_KEY_TYPE, CKK_EC);
+		len = i2d_ECPKParameters(EC_KEY_get0_group(ec), &p);
+		mock_attr(obj, CKA_EC_PARAMS, buf, (CK_ULONG)len);
+		if (obj->class == CKO_PUBLIC_KEY) {
+			ASN1_OCTET_STRING *os = ASN1_OCTET_STRING_new();
+
+			plen = EC_POINT_point2oct(EC_KEY_get0_group(ec),
+				EC_KEY_get0_public_key(ec),
+				POINT_CONVERSION_UNCOMPRESSED,
+				point, sizeof point, NULL);
+			ASN1_OCTET_STRING_set(os, point, (int)plen);
+			p = buf;
+			len = i2d_ASN1_OCTET_STRING(os, &p);
+			ASN1_OCTET_STRING_free(os);
+			mock_attr(obj, CKA_EC_POINT, buf, (CK_ULONG)len);
+		}
+	}
+}
+
+static int mock_add_keypair(CK_SLOT_ID slot, EVP_PKEY *pkey,
+		const unsigned char *cert, int cert_len, const char *label,
+		const unsigned char *id, size_t id_len)
+{
+	MOCK_OBJECT *obj;
+	int rsa = EVP_PKEY_base_id(pkey) == EVP_PKEY_RSA;
+
+	obj = mock_new_object(slot, CKO_PRIVATE_KEY, 0);
+	if (!obj)
+		return -1;
+	obj->private = CK_TRUE;
+	mock_add_key_attrs(obj, pkey, label, id, id_len);
+	mock_attr_bool(obj, CKA_PRIVATE, CK_TRUE);
+	mock_attr_bool(obj, CKA_SENSITIVE, CK_TRUE);
+	mock_attr_bool(obj, CKA_EXTRACTABLE, CK_FALSE);
+	mock_attr_bool(obj, CKA_SIGN, CK_TRUE);
+	mock_attr_bool(obj, CKA_DECRYPT, rsa &&
+		!getenv("MOCK_PKCS11_NO_DECRYPT") ? CK_TRUE : CK_FALSE);
+	mock_attr_bool(obj, CKA_DERIVE, rsa ? CK_FALSE : CK_TRUE);
+	mock_attr_bool(obj, CKA_ALWAYS_AUTHENTICATE,
+		getenv("MOCK_PKCS11_ALWAYS_AUTH") ? CK_TRUE : CK_FALSE);
+
+	obj = mock_new_object(slot, CKO_PUBLIC_KEY, 0);
+	if (!obj)
+		return -1;
+	mock_add_key_attrs(obj, pkey, label, id, id_len);
+	mock_attr_bool(obj, CKA_PRIVATE, CK_FALSE);
+	mock_attr_bool(obj, CKA_VERIFY, CK_TRUE);
+	mock_attr_bool(obj, CKA_ENCRYPT, rsa ? CK_TRUE : CK_FALSE);
+
+	if (cert) {
+		obj = mock_new_object(slot, CKO_CERTIFICATE, 0);
+		if (!obj)
+			return -1;
+		mock_attr(obj, CKA_LABEL, label, strlen(label));
+		mock_attr(obj, CKA_ID, id, id_len);
+		mock_attr_bool(obj, CKA_PRIVATE, CK_FALSE);
+		mock_attr_ulong(obj, CKA_CERTIFICATE_TYPE, CKC_X_509);
+		mock_attr(obj, CKA_VALUE, cert, (CK_ULONG)cert_len);
+	}
+	return 0;
+}
+
+/* An AES-256 key with the value 00 01 02 ... 1f */
+static int mock_add_secret_key(CK_SLOT_ID slot, const char *label,
+		const unsigned char *id, size_t id_len)
+{
+	MOCK_OBJECT *obj;
+	unsigned char value[32];
+	size_t i;
+
+	for (i = 0; i < sizeof value; i++)
+		value[i] = (unsigned char)i;
+	obj = mock_new_object(slot, CKO_SECRET_KEY, 0);
+	if (!obj)
+		return -1;
+	obj->private = CK_TRUE;
+	mock_attr(obj, CKA_LABEL, label, strlen(label));
+	mock_attr(obj, CKA_ID, id, id_len);
+	mock_attr_ulong(obj, CKA_KEY_TYPE, CKK_AES);
+	mock_attr(obj, CKA_VALUE, value, sizeof value);
+	mock_attr_ulong(obj, CKA_VALUE_LEN, sizeof value);
+	mock_attr_bool(obj, CKA_PRIVATE, CK_TRUE);
+	mock_attr_bool(obj, CKA_SENSITIVE, CK_TRUE);
+	mock_attr_bool(obj, CKA_ENCRYPT, CK_TRUE);
+	mock_attr_bool(obj, CKA_DECRYPT, CK_TRUE);
+	return 0;
+}
+
+/* A synthetic object labelled "bench-N", with the ID of bench-enum */
+static MOCK_OBJECT *mock_new_synthetic(CK_SLOT_ID slot, CK_OBJECT_CLASS class,
+		unsigned long n)
+{
+	MOCK_OBJECT *obj;
+	unsigned char id[4];
+	char label[MOCK_LABEL_LEN];
+
+	id[0] = 0xbe;
+	id[1] = (unsigned char)(n >> 16);
+	id[2] = (unsigned char)(n >> 8);
+	id[3] = (unsigned char)n;
+	snprintf(label, sizeof label, "bench-%lu", n);
+	obj = mock_new_object(slot, class, 0);
+	if (!obj)
+		return NULL;
+	if (class == CKO_CERTIFICATE) {
+		mock_attr(obj, CKA_LABEL, label, strlen(label));
+		mock_attr(obj, CKA_ID, id, sizeof id);
+		mock_attr_bool(obj, CKA_PRIVATE, CK_FALSE);
+		mock_attr_ulong(obj, CKA_CERTIFICATE_TYPE, CKC_X_509);
+		mock_attr(obj, CKA_VALUE, mock_rsa_cert,
+			(CK_ULONG)mock_rsa_cert_len);
+	} else if (class == CKO_PRIVATE_KEY) {
+		obj->private = CK_TRUE;
+		mock_add_key_attrs(obj, mock_rsa_key, label, id, sizeof id);
+		mock_attr_bool(obj, CKA_PRIVATE, CK_TRUE);
+		mock_attr_bool(obj, CKA_SENSITIVE, CK_TRUE);
+		mock_attr_bool(obj, CKA_EXTRACTABLE, CK_FALSE);
+		mock_attr_bool(obj, CKA_SIGN, CK_TRUE);
+		mock_attr_bool(obj, CKA_DECRYPT, CK_TRUE);
+		mock_attr_bool(obj, CKA_DERIVE, CK_FALSE);
+		mock_attr_bool(obj, CKA_ALWAYS_AUTHENTICATE, CK_FALSE);
+	} else {
+		mock_add_key_attrs(obj, mock_rsa_key, label, id, sizeof id);
+		mock_attr_bool(obj, CKA_PRIVATE, CK_FALSE);
+		mock_attr_bool(obj, CKA_VERIFY, CK_TRUE);
+		mock_attr_bool(obj, CKA_ENCRYPT, CK_TRUE);
+	}
+	return obj;
+}
+
+static int mock_create_objects(void)
+{
+	static const unsigned char rsa_id[] = {0x00, 0x01, 0x02, 0x03};
+	static const unsigned char ec_id[] = {0x00, 0x01, 0x02, 0x04};
+	static const unsigned char aes_id[] = {0x00, 0x01, 0x02, 0x05};
+	const char *dir = getenv("MOCK_PKCS11_KEYDIR");
+	unsigned long pubkeys = mock_env("MOCK_PKCS11_OBJECTS", 0);
+	unsigned long keys = mock_env("MOCK_PKCS11_KEYS", 0);
+	unsigned long certs = mock_env("MOCK_PKCS11_CERTS", 0), n;
+	CK_SLOT_ID slot;
+
+	if (!mock_rsa_key) {
+		if (dir) {
+			mock_rsa_key = mock_load_key(dir, "rsa-prvkey.der");
+			mock_ec_key = mock_load_key(dir, "ec-prvkey.der");
+			mock_rsa_cert = mock_load_file(dir, "rsa-cert.der",
+				&mock_rsa_cert_len);
+			mock_ec_cert = mock_load_file(dir, "ec-cert.der",
+				&mock_ec_cert_len);
+		} else {
+			mock_rsa_key = mock_generate_key(EVP_PKEY_RSA);
+			mock_ec_key = mock_generate_key(EVP_PKEY_EC);
+		}
+		if (!mock_rsa_key || !mock_ec_key)
+			return -1;
+	}
+	if (!mock_rsa_cert)
+		certs = 0;
+
+	for (slot = 0; slot < mock_nslots; slot++) {
+		if (mock_add_keypair(slot, mock_rsa_key, mock_rsa_cert,
+				mock_rsa_cert_len, "server-key",
+				rsa_id, sizeof rsa_id) < 0)
+			return -1;
+		if (mock_add_keypair(slot, mock_ec_key, mock_ec_cert,
+				mock_ec_cert_len, "ec-key",
+				ec_id, sizeof ec_id) < 0)
+			return -1;
+		if (mock_add_secret_key(slot, "aes-key",
+				aes_id, sizeof aes_id) < 0)
+			return -1;
+		for (n = 0; n < keys; n++)
+			if (!mock_new_synthetic(slot, CKO_PRIVATE_KEY, n))
+				return -1;
+		for (n = 0; n < pubkeys; n++)
+			if (!mock_new_synthetic(slot, CKO_PUBLIC_KEY, n))
+				return -1;
+		for (n = 0; n < certs; n++)
+			if (!mock_new_synthetic(slot, CKO_CERTIFICATE, n))
+				return -1;
+	}
+	return 0;
+}
+
+static void mock_destroy_objects(CK_SESSION_HANDLE owner)
+{
+	CK_ULONG i;
+
+	for (i = 0; i < mock_nobjects; i++) {
+		MOCK_OBJECT *obj = mock_objects[i];
+
+		if (obj && (owner == 0 || obj->owner == owner))
+			mock_free_object(obj);
+	}
+}
+
+/******************************************************************************/
+/* Sessions                                                                   */
+/******************************************************************************/
+
+static void mock_end_op(MOCK_SESSION *sess)
+{
+	sess->op = OP_NONE;
+	if (sess->mdctx) {
+		EVP_MD_CTX_destroy(sess->mdctx);
+		sess->mdctx = NULL;
+	}
+	if (sess->cctx) {
+		EVP_CIPHER_CTX_free(sess->cctx);
+		sess->cctx = NULL;
+	}
+	sess->buffered = 0;
+	sess->tail_len = 0;
+}
+
+static void mock_close(CK_SESSION_HANDLE handle)
+{
+	MOCK_SESSION *sess = &mock_sessions[handle - 1];
+	MOCK_TOKEN *token = &mock_tokens[sess->slot];
+
+	mock_end_op(sess);
+	free(sess->found);
+	sess->found = NULL;
+	mock_destroy_objects(handle);
+	token->sessions--;
+	if (sess->flags & CKF_RW_SESSION)
+		token->rw_sessions--;
+	if (!token->sessions)
+		token->logged_in = -1;
+	memset(sess, 0, sizeof(*sess));
+}
+
+static MOCK_SESSION *mock_get_session(CK_SESSION_HANDLE handle)
+{
+	if (!mock_initialized || handle < 1 || handle > mock_nsessions ||
+			!mock_sessions[handle - 1].used)
+		return NULL;
+	return &mock_sessions[handle - 1];
+}
+
+#define MOCK_LOCK_SESSION(handle, sess) \
+	do { \
+		pthread_mutex_lock(&mock_lock); \
+		if (!mock_initialized) { \
+			pthread_mutex_unlock(&mock_lock); \
+			return CKR_CRYPTOKI_NOT_INITIALIZED; \
+		} \
+		sess = mock_get_session(handle); \
+		if (!sess) { \
+			pthread_mutex_unlock(&mock_lock); \
+			return CKR_SESSION_HANDLE_INVALID; \
+		} \
+	} while (0)
+
+/******************************************************************************/
+/* General purpose functions                                                  */
+/******************************************************************************/
+
+static CK_RV mock_C_Initialize(CK_VOID_PTR args)
+{
+	CK_SLOT_ID i;
+
+	(void)args;
+	pthread_mutex_lock(&mock_lock);
+	if (mock_initialized) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_CRYPTOKI_ALREADY_INITIALIZED;
+	}
+	mock_nslots = mock_env("MOCK_PKCS11_SLOTS", 1);
+	if (mock_nslots > MOCK_MAX_SLOTS)
+		mock_nslots = MOCK_MAX_SLOTS;
+	for (i = 0; i < mock_nslots; i++)
+		mock_last_state[i] = mock_token_state(i);
+	mock_max_sessions = mock_env("MOCK_PKCS11_SESSIONS", 0);
+	mock_max_rw_sessions = mock_env("MOCK_PKCS11_RW_SESSIONS",
+		mock_max_sessions);
+	mock_hide_limits = getenv("MOCK_PKCS11_HIDE_LIMITS") != NULL;
+	mock_init_delays();
+	/* Also when the application does not call C_Finalize() */
+	if (!mock_stats_registered && getenv("MOCK_PKCS11_STATS"))
+		mock_stats_registered = atexit(mock_write_stats) == 0;
+	if (getenv("MOCK_PKCS11_PIN"))
+		snprintf(mock_pin, sizeof mock_pin, "%s", getenv("MOCK_PKCS11_PIN"));
+	memset(mock_tokens, 0, sizeof mock_tokens);
+	for (i = 0; i < MOCK_MAX_SLOTS; i++)
+		mock_tokens[i].logged_in = -1;
+	mock_nsessions = 4096;
+	mock_sessions = calloc(mock_nsessions, sizeof(MOCK_SESSION));
+	if (!mock_sessions || mock_create_objects() < 0) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_HOST_MEMORY;
+	}
+	mock_initialized = 1;
+	pthread_mutex_unlock(&mock_lock);
+	return CKR_OK;
+}
+
+static CK_RV mock_C_Finalize(CK_VOID_PTR reserved)
+{
+	CK_ULONG i;
+
+	(void)reserved;
+	pthread_mutex_lock(&mock_lock);
+	if (!mock_initialized) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+	for (i = 0; i < mock_nsessions; i++)
+		if (mock_sessions[i].used)
+			mock_close(i + 1);
+	free(mock_sessions);
+	mock_sessions = NULL;
+	mock_destroy_objects(0);
+	free(mock_objects);
+	mock_objects = NULL;
+	mock_nobjects = mock_objects_size = 0;
+	mock_initialized = 0;
+	pthread_mutex_unlock(&mock_lock);
+	return CKR_OK;
+}
+
+static CK_RV mock_C_GetInfo(CK_INFO_PTR info)
+{
+	memset(info, 0, sizeof(*info));
+	info->cryptokiVersion.major = 2;
+	info->cryptokiVersion.minor = 20;
+	mock_padded(info->manufacturerID, sizeof info->manufacturerID, "libp11");
+	mock_padded(info->libraryDescription, sizeof info->libraryDescription,
+		"Mock PKCS#11 module");
+	info->libraryVersion.major = 1;
+	return CKR_OK;
+}
+
+static CK_RV mock_C_GetSlotList(CK_BBOOL present, CK_SLOT_ID_PTR list,
+		CK_ULONG_PTR count)
+{
+	CK_SLOT_ID slots[MOCK_MAX_SLOTS];
+	CK_ULONG i, n = 0;
+
+	if (!mock_initialized)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	mock_delay(FN_C_GetSlotList);
+	for (i = 0; i < mock_nslots; i++)
+		if (!present || mock_token_state(i) != '0')
+			slots[n++] = i;
+	if (list) {
+		if (*count < n) {
+			*count = n;
+			return CKR_BUFFER_TOO_SMALL;
+		}
+		for (i = 0; i < n; i++)
+			list[i] = slots[i];
+	}
+	*count = n;
+	return CKR_OK;
+}
+
+static CK_RV mock_C_GetSlotInfo(CK_SLOT_ID slot, CK_SLOT_INFO_PTR info)
+{
+	char desc[64];
+
+	if (!mock_initialized)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	if (slot >= mock_nslots)
+		return CKR_SLOT_ID_INVALID;
+	mock_delay(FN_C_GetSlotInfo);
+	memset(info, 0, sizeof(*info));
+	snprintf(desc, sizeof desc, "Mock slot %lu", slot);
+	mock_padded(info->slotDescription, sizeof info->slotDescription, desc);
+	mock_padded(info->manufacturerID, sizeof info->manufacturerID, "libp11");
+	info->flags = mock_token_state(slot) != '0' ? CKF_TOKEN_PRESENT : 0;
+	return CKR_OK;
+}
+
+static CK_RV mock_C_GetTokenInfo(CK_SLOT_ID slot, CK_TOKEN_INFO_PTR info)
+{
+	char serial[32];
+
+	if (!mock_initialized)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	if (slot >= mock_nslots)
+		return CKR_SLOT_ID_INVALID;
+	mock_delay(FN_C_GetTokenInfo);
+	if (mock_token_state(slot) == '0')
+		return CKR_TOKEN_NOT_PRESENT;
+	memset(info, 0, sizeof(*info));
+	snprintf(serial, sizeof serial, "%015lx%c", slot, mock_token_state(slot));
+	mock_padded(info->label, sizeof info->label, "libp11-test");
+	mock_padded(info->manufacturerID, sizeof info->manufacturerID, "libp11");
+	mock_padded(info->model, sizeof info->model, "mock");
+	mock_padded(info->serialNumber, sizeof info->serialNumber, serial);
+	info->flags = CKF_TOKEN_INITIALIZED | CKF_USER_PIN_INITIALIZED |
+		CKF_LOGIN_REQUIRED | CKF_RNG;
+	info->ulMaxSessionCount = mock_max_sessions && !mock_hide_limits ?
+		mock_max_sessions : CK_EFFECTIVELY_INFINITE;
+	info->ulSessionCount = mock_tokens[slot].sessions;
+	info->ulMaxRwSessionCount = mock_max_rw_sessions && !mock_hide_limits ?
+		mock_max_rw_sessions : CK_EFFECTIVELY_INFINITE;
+	info->ulRwSessionCount = mock_tokens[slot].rw_sessions;
+	info->ulMaxPinLen = 64;
+	info->ulMinPinLen = 4;
+	info->ulTotalPublicMemory = CK_UNAVAILABLE_INFORMATION;
+	info->ulFreePublicMemory = CK_UNAVAILABLE_INFORMATION;
+	info->ulTotalPrivateMemory = CK_UNAVAILABLE_INFORMATION;
+	info->ulFreePrivateMemory = CK_UNAVAILABLE_INFORMATION;
+	return CKR_OK;
+}
+
+static CK_RV mock_C_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR slot,
+		CK_VOID_PTR reserved)
+{
+	CK_ULONG i;
+	char state;
+
+	(void)reserved;
+	if (!mock_initialized)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	if (!(flags & CKF_DONT_BLOCK) || getenv("MOCK_PKCS11_NO_EVENTS"))
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	for (i = 0; i < mock_nslots; i++) {
+		state = mock_token_state(i);
+		if (state != mock_last_state[i]) {
+			mock_last_state[i] = state;
+			*slot = i;
+			return CKR_OK;
+		}
+	}
+	return CKR_NO_EVENT;
+}
+
+static CK_RV mock_C_GetMechanismList(CK_SLOT_ID slot,
+		CK_MECHANISM_TYPE_PTR list, CK_ULONG_PTR count)
+{
+	CK_ULONG n = sizeof mock_mechanisms / sizeof *mock_mechanisms;
+
+	if (!mock_initialized)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	if (slot >= mock_nslots)
+		return CKR_SLOT_ID_INVALID;
+	mock_delay(FN_C_GetMechanismList);
+	if (list) {
+		if (*count < n) {
+			*count = n;
+			return CKR_BUFFER_TOO_SMALL;
+		}
+		memcpy(list, mock_mechanisms, sizeof mock_mechanisms);
+	}
+	*count = n;
+	return CKR_OK;
+}
+
+static CK_RV mock_C_GetMechanismInfo(CK_SLOT_ID slot, CK_MECHANISM_TYPE type,
+		CK_MECHANISM_INFO_PTR info)
+{
+	if (!mock_initialized)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	if (slot >= mock_nslots)
+		return CKR_SLOT_ID_INVALID;
+	mock_delay(FN_C_GetMechanismInfo);
+	memset(info, 0, sizeof(*info));
+	switch (type) {
+	case CKM_RSA_PKCS:
+	case CKM_RSA_X_509:
+		info->flags = CKF_SIGN | CKF_VERIFY | CKF_ENCRYPT | CKF_DECRYPT;
+		break;
+	case CKM_RSA_PKCS_OAEP:
+		info->flags = CKF_ENCRYPT | CKF_DECRYPT;
+		break;
+	case CKM_RSA_PKCS_PSS:
+	case CKM_SHA256_RSA_PKCS:
+	case CKM_SHA384_RSA_PKCS:
+	case CKM_SHA512_RSA_PKCS:
+	case CKM_SHA256_RSA_PKCS_PSS:
+	case CKM_SHA384_RSA_PKCS_PSS:
+	case CKM_SHA512_RSA_PKCS_PSS:
+		info->flags = CKF_SIGN | CKF_VERIFY;
+		break;
+	case CKM_ECDSA:
+	case CKM_ECDSA_SHA256:
+		info->flags = CKF_SIGN | CKF_VERIFY;
+		info->ulMinKeySize = 256;
+		info->ulMaxKeySize = 521;
+		return CKR_OK;
+	case CKM_ECDH1_DERIVE:
+		info->flags = CKF_DERIVE;
+		info->ulMinKeySize = 256;
+		info->ulMaxKeySize = 521;
+		return CKR_OK;
+	case CKM_AES_CBC:
+	case CKM_AES_CBC_PAD:
+	case CKM_AES_GCM:
+		info->flags = CKF_ENCRYPT | CKF_DECRYPT;
+		info->ulMinKeySize = 16;
+		info->ulMaxKeySize = 32;
+		return CKR_OK;
+	default:
+		return CKR_MECHANISM_INVALID;
+	}
+	info->ulMinKeySize = 1024;
+	info->ulMaxKeySize = 4096;
+	return CKR_OK;
+}
+
+/******************************************************************************/
+/* Session management                                                         */
+/******************************************************************************/
+
+static CK_RV mock_C_OpenSession(CK_SLOT_ID slot, CK_FLAGS flags,
+		CK_VOID_PTR app, CK_NOTIFY notify, CK_SESSION_HANDLE_PTR handle)
+{
+	MOCK_TOKEN *token;
+	CK_ULONG i;
+
+	(void)app;
+	(void)notify;
+	mock_delay(FN_C_OpenSession);
+	pthread_mutex_lock(&mock_lock);
+	if (!mock_initialized) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+	if (slot >= mock_nslots) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_SLOT_ID_INVALID;
+	}
+	if (getenv("MOCK_PKCS11_FAIL_OPEN")) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_DEVICE_ERROR;
+	}
+	token = &mock_tokens[slot];
+	if ((mock_max_sessions && token->sessions >= mock_max_sessions) ||
+			((flags & CKF_RW_SESSION) && mock_max_rw_sessions &&
+				token->rw_sessions >= mock_max_rw_sessions)) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_SESSION_COUNT;
+	}
+	for (i = 0; i < mock_nsessions; i++)
+		if (!mock_sessions[i].used)
+			break;
+	if (i == mock_nsessions) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_SESSION_COUNT;
+	}
+	memset(&mock_sessions[i], 0, sizeof(MOCK_SESSION));
+	mock_sessions[i].used = 1;
+	mock_sessions[i].slot = slot;
+	mock_sessions[i].flags = flags;
+	token->sessions++;
+	if (flags & CKF_RW_SESSION)
+		token->rw_sessions++;
+	*handle = i + 1;
+	pthread_mutex_unlock(&mock_lock);
+	return CKR_OK;
+}
+
+static CK_RV mock_C_CloseSession(CK_SESSION_HANDLE handle)
+{
+	MOCK_SESSION *sess;
+
+	mock_delay(FN_C_CloseSession);
+	MOCK_LOCK_SESSION(handle, sess);
+	(void)sess;
+	mock_close(handle);
+	pthread_mutex_unlock(&mock_lock);
+	return CKR_OK;
+}
+
+static CK_RV mock_C_CloseAllSessions(CK_SLOT_ID slot)
+{
+	CK_ULONG i;
+
+	mock_delay(FN_C_CloseAllSessions);
+	pthread_mutex_lock(&mock_lock);
+	if (!mock_initialized) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+	for (i = 0; i < mock_nsessions; i++)
+		if (mock_sessions[i].used && mock_sessions[i].slot == slot)
+			mock_close(i + 1);
+	pthread_mutex_unlock(&mock_lock);
+	return CKR_OK;
+}
+
+static CK_RV mock_C_GetSessionInfo(CK_SESSION_HANDLE handle,
+		CK_SESSION_INFO_PTR info)
+{
+	MOCK_SESSION *sess;
+	int rw;
+
+	mock_delay(FN_C_GetSessionInfo);
+	MOCK_LOCK_SESSION(handle, sess);
+	rw = (sess->flags & CKF_RW_SESSION) != 0;
+	info->slotID = sess->slot;
+	info->flags = sess->flags;
+	info->ulDeviceError = 0;
+	switch (mock_tokens[sess->slot].logged_in) {
+	case CKU_USER:
+		info->state = rw ? CKS_RW_USER_FUNCTIONS : CKS_RO_USER_FUNCTIONS;
+		break;
+	case CKU_SO:
+		info->state = CKS_RW_SO_FUNCTIONS;
+		break;
+	default:
+		info->state = rw ? CKS_RW_PUBLIC_SESSION : CKS_RO_PUBLIC_SESSION;
+	}
+	pthread_mutex_unlock(&mock_lock);
+	return CKR_OK;
+}
+
+static CK_RV mock_C_Login(CK_SESSION_HANDLE handle, CK_USER_TYPE user,
+		CK_UTF8CHAR_PTR pin, CK_ULONG pin_len)
+{
+	MOCK_SESSION *sess;
+	MOCK_TOKEN *token;
+	CK_RV rv = CKR_OK;
+
+	mock_delay(FN_C_Login);
+	MOCK_LOCK_SESSION(handle, sess);
+	token = &mock_tokens[sess->slot];
+	if (user == CKU_CONTEXT_SPECIFIC) {
+		if (token->logged_in != CKU_USER)
+			rv = CKR_USER_NOT_LOGGED_IN;
+		else if (!pin || pin_len != strlen(mock_pin) ||
+				memcmp(pin, mock_pin, pin_len))
+			rv = CKR_PIN_INCORRECT;
+	} else if (token->logged_in >= 0) {
+		rv = CKR_USER_ALREADY_LOGGED_IN;
+	} else if (!pin || pin_len != strlen(mock_pin) ||
+			memcmp(pin, mock_pin, pin_len)) {
+		rv = CKR_PIN_INCORRECT;
+	} else {
+		token->logged_in = (int)user;
+	}
+	if (rv == CKR_OK && user <= CKU_CONTEXT_SPECIFIC)
+		mock_logins[user]++;
+	pthread_mutex_unlock(&mock_lock);
+	return rv;
+}
+
+static CK_RV mock_C_Logout(CK_SESSION_HANDLE handle)
+{
+	MOCK_SESSION *sess;
+	CK_RV rv = CKR_OK;
+
+	mock_delay(FN_C_Logout);
+	MOCK_LOCK_SESSION(handle, sess);
+	if (mock_tokens[sess->slot].logged_in < 0)
+		rv = CKR_USER_NOT_LOGGED_IN;
+	mock_tokens[sess->slot].logged_in = -1;
+	pthread_mutex_unlock(&mock_lock);
+	return rv;
+}
+
+/******************************************************************************/
+/* Object management                                                          */
+/******************************************************************************/
+
+/* Copy the attributes of a template that the object does not have yet */
+static CK_RV mock_attr_template(MOCK_OBJECT *obj, CK_ATTRIBUTE_PTR templ,
+		CK_ULONG count)
+{
+	CK_ULONG i;
+
+	for (i = 0; i < count; i++) {
+		if (mock_find_attr(obj, templ[i].type))
+			continue;
+		if (obj->nattrs == MOCK_MAX_ATTRS)
+			return CKR_TEMPLATE_INCONSISTENT;
+		mock_attr(obj, templ[i].type, templ[i].pValue,
+			templ[i].ulValueLen);
+	}
+	return CKR_OK;
+}
+
+/* The value of a CK_ULONG or CK_BBOOL attribute of a template */
+static CK_ULONG mock_template_value(CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+		CK_ATTRIBUTE_TYPE type, CK_ULONG def)
+{
+	CK_ULONG i;
+
+	for (i = 0; i < count; i++) {
+		if (templ[i].type != type || !templ[i].pValue)
+			continue;
+		if (templ[i].ulValueLen == sizeof(CK_ULONG))
+			return *(CK_ULONG *)templ[i].pValue;
+		if (templ[i].ulValueLen == sizeof(CK_BBOOL))
+			return *(CK_BBOOL *)templ[i].pValue;
+	}
+	return def;
+}
+
+/* Create a token or session object with the attributes of a template */
+static CK_RV mock_create(MOCK_SESSION *sess, CK_SESSION_HANDLE handle,
+		CK_OBJECT_CLASS class, CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+		MOCK_OBJECT **objp)
+{
+	CK_BBOOL private = (CK_BBOOL)mock_template_value(templ, count,
+		CKA_PRIVATE, class == CKO_PRIVATE_KEY);
+	CK_BBOOL token = (CK_BBOOL)mock_template_value(templ, count,
+		CKA_TOKEN, CK_FALSE);
+	MOCK_OBJECT *obj;
+	CK_RV rv;
+
+	if (token && !(sess->flags & CKF_RW_SESSION))
+		return CKR_SESSION_READ_ONLY;
+	if (private && mock_tokens[sess->slot].logged_in != CKU_USER)
+		return CKR_USER_NOT_LOGGED_IN;
+	obj = mock_new_object(sess->slot, class, token ? 0 : handle);
+	if (!obj)
+		return CKR_HOST_MEMORY;
+	obj->private = private;
+	rv = mock_attr_template(obj, templ, count);
+	if (rv != CKR_OK) {
+		mock_free_object(obj);
+		return rv;
+	}
+	*objp = obj;
+	return CKR_OK;
+}
+
+/*
+ * Create an object without key material: the imported private keys are
+ * listed, but not used for cryptographic operations, while the secret
+ * keys are used with their CKA_VALUE
+ */
+static CK_RV mock_C_CreateObject(CK_SESSION_HANDLE handle,
+		CK_ATTRIBUTE_PTR templ, CK_ULONG count, CK_OBJECT_HANDLE_PTR object)
+{
+	MOCK_SESSION *sess;
+	MOCK_OBJECT *obj;
+	CK_OBJECT_CLASS class;
+	CK_RV rv;
+
+	mock_delay(FN_C_CreateObject);
+	MOCK_LOCK_SESSION(handle, sess);
+	class = mock_template_value(templ, count, CKA_CLASS,
+		CK_UNAVAILABLE_INFORMATION);
+	if (class == CK_UNAVAILABLE_INFORMATION) {
+		rv = CKR_TEMPLATE_INCOMPLETE;
+	} else {
+		rv = mock_create(sess, handle, class, templ, count, &obj);
+		if (rv == CKR_OK)
+			*object = obj->handle;
+	}
+	pthread_mutex_unlock(&mock_lock);
+	return rv;
+}
+
+/* The generated key pairs all use the RSA key of the token */
+static CK_RV mock_C_GenerateKeyPair(CK_SESSION_HANDLE handle,
+		CK_MECHANISM_PTR mechanism,
+		CK_ATTRIBUTE_PTR pub_templ, CK_ULONG pub_count,
+		CK_ATTRIBUTE_PTR prv_templ, CK_ULONG prv_count,
+		CK_OBJECT_HANDLE_PTR pub_object, CK_OBJECT_HANDLE_PTR prv_object)
+{
+	MOCK_SESSION *sess;
+	MOCK_OBJECT *pub, *prv;
+	const BIGNUM *n, *e, *d;
+	CK_RV rv;
+
+	mock_delay(FN_C_GenerateKeyPair);
+	MOCK_LOCK_SESSION(handle, sess);
+	if (mechanism->mechanism != CKM_RSA_PKCS_KEY_PAIR_GEN) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_MECHANISM_INVALID;
+	}
+	rv = mock_create(sess, handle, CKO_PUBLIC_KEY, pub_templ, pub_count,
+		&pub);
+	if (rv != CKR_OK) {
+		pthread_mutex_unlock(&mock_lock);
+		return rv;
+	}
+	rv = mock_create(sess, handle, CKO_PRIVATE_KEY, prv_templ, prv_count,
+		&prv);
+	if (rv != CKR_OK) {
+		mock_free_object(pub);
+		pthread_mutex_unlock(&mock_lock);
+		return rv;
+	}
+	RSA_get0_key(EVP_PKEY_get0_RSA(mock_rsa_key), &n, &e, &d);
+	pub->pkey = prv->pkey = mock_rsa_key;
+	mock_attr_ulong(pub, CKA_KEY_TYPE, CKK_RSA);
+	mock_attr_ulong(prv, CKA_KEY_TYPE, CKK_RSA);
+	mock_attr_bn(pub, CKA_MODULUS, n);
+	mock_attr_bn(prv, CKA_MODULUS, n);
+	if (!mock_find_attr(pub, CKA_PUBLIC_EXPONENT))
+		mock_attr_bn(pub, CKA_PUBLIC_EXPONENT, e);
+	mock_attr_bn(prv, CKA_PUBLIC_EXPONENT, e);
+	*pub_object = pub->handle;
+	*prv_object = prv->handle;
+	pthread_mutex_unlock(&mock_lock);
+	return CKR_OK;
+}
+
+static CK_RV mock_C_DestroyObject(CK_SESSION_HANDLE handle,
+		CK_OBJECT_HANDLE object)
+{
+	MOCK_SESSION *sess;
+	MOCK_OBJECT *obj;
+	CK_RV rv = CKR_OK;
+
+	mock_delay(FN_C_DestroyObject);
+	MOCK_LOCK_SESSION(handle, sess);
+	obj = mock_get_object(sess->slot, object);
+	if (obj)
+		mock_free_object(obj);
+	else
+		rv = CKR_OBJECT_HANDLE_INVALID;
+	pthread_mutex_unlock(&mock_lock);
+	return rv;
+}
+
+static CK_RV mock_C_GetAttributeValue(CK_SESSION_HANDLE handle,
+		CK_OBJECT_HANDLE object, CK_ATTRIBUTE_PTR templ, CK_ULONG count)
+{
+	MOCK_SESSION *sess;
+	MOCK_OBJECT *obj;
+	CK_ULONG i;
+	CK_RV rv = CKR_OK;
+
+	mock_delay(FN_C_GetAttributeValue);
+	MOCK_LOCK_SESSION(handle, sess);
+	obj = mock_get_object(sess->slot, object);
+	if (!obj) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_OBJECT_HANDLE_INVALID;
+	}
+	for (i = 0; i < count; i++) {
+		CK_ATTRIBUTE *attr = mock_find_attr(obj, templ[i].type);
+
+		if (!attr) {
+			templ[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
+			rv = CKR_ATTRIBUTE_TYPE_INVALID;
+		} else if (!templ[i].pValue) {
+			templ[i].ulValueLen = attr->ulValueLen;
+		} else if (templ[i].ulValueLen < attr->ulValueLen) {
+			templ[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
+			rv = CKR_BUFFER_TOO_SMALL;
+		} else {
+			memcpy(templ[i].pValue, attr->pValue, attr->ulValueLen);
+			templ[i].ulValueLen = attr->ulValueLen;
+		}
+	}
+	pthread_mutex_unlock(&mock_lock);
+	return rv;
+}
+
+static int mock_match(MOCK_OBJECT *obj, CK_ATTRIBUTE_PTR templ, CK_ULONG count)
+{
+	CK_ULONG i;
+
+	for (i = 0; i < count; i++) {
+		CK_ATTRIBUTE *attr = mock_find_attr(obj, templ[i].type);
+
+		if (!attr || attr->ulValueLen != templ[i].ulValueLen ||
+				memcmp(attr->pValue, templ[i].pValue,
+					attr->ulValueLen))
+			return 0;
+	}
+	return 1;
+}
+
+static CK_RV mock_C_FindObjectsInit(CK_SESSION_HANDLE handle,
+		CK_ATTRIBUTE_PTR templ, CK_ULONG count)
+{
+	MOCK_SESSION *sess;
+	CK_ULONG i;
+
+	mock_delay(FN_C_FindObjectsInit);
+	MOCK_LOCK_SESSION(handle, sess);
+	if (sess->finding) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_OPERATION_ACTIVE;
+	}
+	free(sess->found);
+	sess->found = malloc((mock_nobjects + 1) * sizeof(CK_OBJECT_HANDLE));
+	sess->nfound = sess->pos = 0;
+	for (i = 0; i < mock_nobjects; i++) {
+		MOCK_OBJECT *obj = mock_objects[i];
+
+		if (!obj || !mock_get_object(sess->slot, obj->handle))
+			continue;
+		if (mock_match(obj, templ, count))
+			sess->found[sess->nfound++] = obj->handle;
+	}
+	sess->finding = 1;
+	pthread_mutex_unlock(&mock_lock);
+	return CKR_OK;
+}
+
+static CK_RV mock_C_FindObjects(CK_SESSION_HANDLE handle,
+		CK_OBJECT_HANDLE_PTR objects, CK_ULONG max, CK_ULONG_PTR count)
+{
+	MOCK_SESSION *sess;
+	CK_ULONG n;
+
+	mock_delay(FN_C_FindObjects);
+	MOCK_LOCK_SESSION(handle, sess);
+	if (!sess->finding) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_OPERATION_NOT_INITIALIZED;
+	}
+	n = sess->nfound - sess->pos;
+	if (n > max)
+		n = max;
+	memcpy(objects, sess->found + sess->pos, n * sizeof(CK_OBJECT_HANDLE));
+	sess->pos += n;
+	*count = n;
+	pthread_mutex_unlock(&mock_lock);
+	return CKR_OK;
+}
+
+static CK_RV mock_C_FindObjectsFinal(CK_SESSION_HANDLE handle)
+{
+	MOCK_SESSION *sess;
+
+	mock_delay(FN_C_FindObjectsFinal);
+	MOCK_LOCK_SESSION(handle, sess);
+	if (!sess->finding) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_OPERATION_NOT_INITIALIZED;
+	}
+	sess->finding = 0;
+	free(sess->found);
+	sess->found = NULL;
+	pthread_mutex_unlock(&mock_lock);
+	return CKR_OK;
+}
+
+/******************************************************************************/
+/* Cryptographic operations                                                   */
+/******************************************************************************/
+
+static const EVP_MD *mock_md(CK_MECHANISM_TYPE type)
+{
+	switch (type) {
+	case CKM_SHA_1:
+	case CKG_MGF1_SHA1:
+		return EVP_sha1();
+	case CKM_SHA224:
+	case CKG_MGF1_SHA224:
+		return EVP_sha224();
+	case CKM_SHA256:
+	case CKG_MGF1_SHA256:
+	case CKM_SHA256_RSA_PKCS:
+	case CKM_SHA256_RSA_PKCS_PSS:
+	case CKM_ECDSA_SHA256:
+		return EVP_sha256();
+	case CKM_SHA384:
+	case CKG_MGF1_SHA384:
+	case CKM_SHA384_RSA_PKCS:
+	case CKM_SHA384_RSA_PKCS_PSS:
+		return EVP_sha384();
+	case CKM_SHA512:
+	case CKG_MGF1_SHA512:
+	case CKM_SHA512_RSA_PKCS:
+	case CKM_SHA512_RSA_PKCS_PSS:
+		return EVP_sha512();
+	}
+	return NULL;
+}
+
+static const EVP_CIPHER *mock_aes(CK_MECHANISM_TYPE type, CK_ULONG key_len)
+{
+	int gcm = type == CKM_AES_GCM;
+
+	if (type != CKM_AES_CBC && type != CKM_AES_CBC_PAD && !gcm)
+		return NULL;
+	switch (key_len) {
+	case 16:
+		return gcm ? EVP_aes_128_gcm() : EVP_aes_128_cbc();
+	case 24:
+		return gcm ? EVP_aes_192_gcm() : EVP_aes_192_cbc();
+	case 32:
+		return gcm ? EVP_aes_256_gcm() : EVP_aes_256_cbc();
+	}
+	return NULL;
+}
+
+/* Start a multi-part AES operation with the CKA_VALUE of a secret key */
+static CK_RV mock_cipher_init(MOCK_SESSION *sess, MOCK_OBJECT *obj, int op,
+		CK_MECHANISM_PTR mechanism)
+{
+	CK_ATTRIBUTE *value = mock_find_attr(obj, CKA_VALUE);
+	CK_GCM_PARAMS *gcm = NULL;
+	const EVP_CIPHER *cipher;
+	const unsigned char *iv = mechanism->pParameter;
+	int enc = op == OP_ENCRYPT, len;
+
+	if (op != OP_ENCRYPT && op != OP_DECRYPT)
+		return CKR_KEY_FUNCTION_NOT_PERMITTED;
+	if (!value)
+		return CKR_KEY_TYPE_INCONSISTENT;
+	cipher = mock_aes(mechanism->mechanism, value->ulValueLen);
+	if (!cipher)
+		return CKR_MECHANISM_INVALID;
+	if (mechanism->mechanism == CKM_AES_GCM) {
+		if (mechanism->ulParameterLen != sizeof(CK_GCM_PARAMS))
+			return CKR_MECHANISM_PARAM_INVALID;
+		gcm = mechanism->pParameter;
+		if (gcm->ulTagBits != 128 || !gcm->ulIvLen)
+			return CKR_MECHANISM_PARAM_INVALID;
+		iv = gcm->pIv;
+	} else if (mechanism->ulParameterLen != 16) {
+		return CKR_MECHANISM_PARAM_INVALID;
+	}
+
+	sess->cctx = EVP_CIPHER_CTX_new();
+	if (!sess->cctx ||
+			!EVP_CipherInit_ex(sess->cctx, cipher, NULL, NULL, NULL, enc) ||
+			(gcm && !EVP_CIPHER_CTX_ctrl(sess->cctx,
+				EVP_CTRL_GCM_SET_IVLEN, (int)gcm->ulIvLen, NULL)) ||
+			!EVP_CipherInit_ex(sess->cctx, NULL, NULL,
+				value->pValue, iv, enc) ||
+			(gcm && gcm->ulAADLen && !EVP_CipherUpdate(sess->cctx,
+				NULL, &len, gcm->pAAD, (int)gcm->ulAADLen)))
+		return CKR_FUNCTION_FAILED;
+	if (mechanism->mechanism == CKM_AES_CBC)
+		EVP_CIPHER_CTX_set_padding(sess->cctx, 0);
+	return CKR_OK;
+}
+
+static CK_RV mock_op_init(CK_SESSION_HANDLE handle, int op, int fn,
+		CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE key)
+{
+	MOCK_SESSION *sess;
+	MOCK_OBJECT *obj;
+	CK_ATTRIBUTE *attr;
+	CK_ATTRIBUTE_TYPE usage;
+	CK_RV rv = CKR_OK;
+
+	mock_delay(fn);
+	MOCK_LOCK_SESSION(handle, sess);
+	obj = mock_get_object(sess->slot, key);
+	switch (op) {
+	case OP_SIGN:
+		usage = CKA_SIGN;
+		break;
+	case OP_DECRYPT:
+		usage = CKA_DECRYPT;
+		break;
+	case OP_ENCRYPT:
+		usage = CKA_ENCRYPT;
+		break;
+	default:
+		usage = CKA_VERIFY;
+	}
+	if (getenv("MOCK_PKCS11_FAIL_SLOT") &&
+			sess->slot == mock_env("MOCK_PKCS11_FAIL_SLOT", 0)) {
+		rv = CKR_DEVICE_ERROR;
+	} else if (sess->op != OP_NONE) {
+		rv = CKR_OPERATION_ACTIVE;
+	} else if (!obj && key >= 1 && key <= mock_nobjects &&
+			mock_objects[key - 1] &&
+			mock_objects[key - 1]->slot == sess->slot) {
+		rv = CKR_USER_NOT_LOGGED_IN; /* A private key, like SoftHSM */
+	} else if (!obj || (!obj->pkey && obj->class != CKO_SECRET_KEY)) {
+		rv = CKR_KEY_HANDLE_INVALID;
+	} else if (!(attr = mock_find_attr(obj, usage)) ||
+			!*(CK_BBOOL *)attr->pValue) {
+		rv = CKR_KEY_FUNCTION_NOT_PERMITTED;
+	} else if (mechanism->ulParameterLen > sizeof sess->param) {
+		rv = CKR_MECHANISM_PARAM_INVALID;
+	} else {
+		sess->op = op;
+		sess->mechanism = mechanism->mechanism;
+		sess->key = key;
+		if (mechanism->pParameter)
+			memcpy(sess->param, mechanism->pParameter,
+				mechanism->ulParameterLen);
+		switch (mechanism->mechanism) {
+		case CKM_SHA256_RSA_PKCS:
+		case CKM_SHA384_RSA_PKCS:
+		case CKM_SHA512_RSA_PKCS:
+		case CKM_SHA256_RSA_PKCS_PSS:
+		case CKM_SHA384_RSA_PKCS_PSS:
+		case CKM_SHA512_RSA_PKCS_PSS:
+		case CKM_ECDSA_SHA256:
+			/* Hash-and-sign mechanisms */
+			sess->mdctx = EVP_MD_CTX_create();
+			EVP_DigestInit_ex(sess->mdctx,
+				mock_md(mechanism->mechanism), NULL);
+			break;
+		}
+		if (obj->class == CKO_SECRET_KEY) {
+			rv = mock_cipher_init(sess, obj, op, mechanism);
+			if (rv != CKR_OK)
+				mock_end_op(sess);
+		}
+	}
+	pthread_mutex_unlock(&mock_lock);
+	return rv;
+}
+
+/* Called with mock_lock held, returns with mock_lock released */
+static CK_RV mock_op_run(MOCK_SESSION *sess, int fn,
+		CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	MOCK_OBJECT *obj = mock_get_object(sess->slot, sess->key);
+	EVP_PKEY *pkey = obj ? obj->pkey : NULL;
+	CK_MECHANISM_TYPE mechanism = sess->mechanism;
+	int op = sess->op;
+	EVP_PKEY_CTX *pctx = NULL;
+	unsigned char param[64];
+	unsigned char buf[1024];
+	size_t len = sizeof buf;
+	int ok = 0;
+	CK_RV rv = CKR_OK;
+
+	memcpy(param, sess->param, sizeof param);
+	if (!pkey) {
+		mock_end_op(sess);
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_KEY_HANDLE_INVALID;
+	}
+	if (!out) { /* Size inquiry */
+		*out_len = (CK_ULONG)EVP_PKEY_size(pkey);
+		if (EVP_PKEY_base_id(pkey) == EVP_PKEY_EC)
+			*out_len = 2 * (CK_ULONG)((EC_GROUP_get_degree(
+				EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(pkey))) + 7) / 8);
+		pthread_mutex_unlock(&mock_lock);
+		mock_delay(fn); /* The size inquiry is a round trip, too */
+		return CKR_OK;
+	}
+	mock_end_op(sess);
+	pthread_mutex_unlock(&mock_lock);
+
+	mock_delay(fn);
+
+	pctx = EVP_PKEY_CTX_new(pkey, NULL);
+	if (!pctx)
+		return CKR_HOST_MEMORY;
+	switch (op) {
+	case OP_SIGN:
+		ok = EVP_PKEY_sign_init(pctx) > 0;
+		break;
+	case OP_DECRYPT:
+		ok = EVP_PKEY_decrypt_init(pctx) > 0;
+		break;
+	case OP_ENCRYPT:
+		ok = EVP_PKEY_encrypt_init(pctx) > 0;
+		break;
+	default:
+		ok = EVP_PKEY_verify_init(pctx) > 0;
+	}
+	switch (mechanism) {
+	case CKM_RSA_PKCS:
+		ok = ok && EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PADDING) > 0;
+		break;
+	case CKM_SHA256_RSA_PKCS:
+	case CKM_SHA384_RSA_PKCS:
+	case CKM_SHA512_RSA_PKCS:
+		ok = ok && EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PADDING) > 0 &&
+			EVP_PKEY_CTX_set_signature_md(pctx, mock_md(mechanism)) > 0;
+		break;
+	case CKM_RSA_X_509:
+		ok = ok && EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_NO_PADDING) > 0;
+		break;
+	case CKM_RSA_PKCS_PSS:
+	case CKM_SHA256_RSA_PKCS_PSS:
+	case CKM_SHA384_RSA_PKCS_PSS:
+	case CKM_SHA512_RSA_PKCS_PSS: {
+		CK_RSA_PKCS_PSS_PARAMS *pss = (CK_RSA_PKCS_PSS_PARAMS *)param;
+
+		ok = ok && EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PSS_PADDING) > 0 &&
+			EVP_PKEY_CTX_set_signature_md(pctx, mock_md(pss->hashAlg)) > 0 &&
+			EVP_PKEY_CTX_set_rsa_mgf1_md(pctx, mock_md(pss->mgf)) > 0 &&
+			EVP_PKEY_CTX_set_rsa_pss_saltlen(pctx, (int)pss->sLen) > 0;
+		break;
+	}
+	case CKM_RSA_PKCS_OAEP: {
+		CK_RSA_PKCS_OAEP_PARAMS *oaep = (CK_RSA_PKCS_OAEP_PARAMS *)param;
+
+		ok = ok && EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_OAEP_PADDING) > 0 &&
+			EVP_PKEY_CTX_set_rsa_oaep_md(pctx, mock_md(oaep->hashAlg)) > 0 &&
+			EVP_PKEY_CTX_set_rsa_mgf1_md(pctx, mock_md(oaep->mgf)) > 0;
+		break;
+	}
+	case CKM_ECDSA:
+	case CKM_ECDSA_SHA256:
+		break;
+	default:
+		ok = 0;
+	}
+	if (!ok) {
+		EVP_PKEY_CTX_free(pctx);
+		return CKR_MECHANISM_INVALID;
+	}
+	switch (op) {
+	case OP_SIGN:
+		ok = EVP_PKEY_sign(pctx, buf, &len, in, in_len) > 0;
+		break;
+	case OP_DECRYPT:
+		ok = EVP_PKEY_decrypt(pctx, buf, &len, in, in_len) > 0;
+		break;
+	case OP_ENCRYPT:
+		ok = EVP_PKEY_encrypt(pctx, buf, &len, in, in_len) > 0;
+		break;
+	default:
+		ok = EVP_PKEY_verify(pctx, out, *out_len, in, in_len) > 0;
+		EVP_PKEY_CTX_free(pctx);
+		return ok ? CKR_OK : CKR_SIGNATURE_INVALID;
+	}
+	EVP_PKEY_CTX_free(pctx);
+	if (!ok)
+		return op == OP_DECRYPT ? CKR_ENCRYPTED_DATA_INVALID : CKR_DATA_INVALID;
+
+	if (EVP_PKEY_base_id(pkey) == EVP_PKEY_EC) {
+		/* Convert the DER signature into r|s */
+		const unsigned char *p = buf;
+		ECDSA_SIG *sig = d2i_ECDSA_SIG(NULL, &p, (long)len);
+		const BIGNUM *r, *s;
+		size_t n = (size_t)(EC_GROUP_get_degree(
+			EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(pkey))) + 7) / 8;
+
+		if (!sig)
+			return CKR_GENERAL_ERROR;
+		ECDSA_SIG_get0(sig, &r, &s);
+		memset(buf, 0, 2 * n);
+		BN_bn2bin(r, buf + n - (size_t)BN_num_bytes(r));
+		BN_bn2bin(s, buf + 2 * n - (size_t)BN_num_bytes(s));
+		ECDSA_SIG_free(sig);
+		len = 2 * n;
+	}
+	if (*out_len < len) {
+		rv = CKR_BUFFER_TOO_SMALL;
+	} else {
+		memcpy(out, buf, len);
+	}
+	*out_len = len;
+	return rv;
+}
+
+static CK_RV mock_op(CK_SESSION_HANDLE handle, int op, int fn,
+		CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	MOCK_SESSION *sess;
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+
+	MOCK_LOCK_SESSION(handle, sess);
+	if (sess->op != op) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_OPERATION_NOT_INITIALIZED;
+	}
+	if (sess->mdctx && out) {
+		/* Single-part hash-and-sign mechanism */
+		EVP_DigestUpdate(sess->mdctx, in, in_len);
+		EVP_DigestFinal_ex(sess->mdctx, md, &md_len);
+		return mock_op_run(sess, fn, md, md_len, out, out_len);
+	}
+	return mock_op_run(sess, fn, in, in_len, out, out_len);
+}
+
+static CK_RV mock_C_SignInit(CK_SESSION_HANDLE handle,
+		CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE key)
+{
+	return mock_op_init(handle, OP_SIGN, FN_C_SignInit,
+		mechanism, key);
+}
+
+static CK_RV mock_C_Sign(CK_SESSION_HANDLE handle, CK_BYTE_PTR data,
+		CK_ULONG data_len, CK_BYTE_PTR sig, CK_ULONG_PTR sig_len)
+{
+	return mock_op(handle, OP_SIGN, FN_C_Sign,
+		data, data_len, sig, sig_len);
+}
+
+static CK_RV mock_C_SignUpdate(CK_SESSION_HANDLE handle, CK_BYTE_PTR part,
+		CK_ULONG part_len)
+{
+	MOCK_SESSION *sess;
+	CK_RV rv = CKR_OK;
+
+	mock_delay(FN_C_SignUpdate);
+	MOCK_LOCK_SESSION(handle, sess);
+	if (sess->op != OP_SIGN || !sess->mdctx)
+		rv = CKR_OPERATION_NOT_INITIALIZED;
+	else
+		EVP_DigestUpdate(sess->mdctx, part, part_len);
+	pthread_mutex_unlock(&mock_lock);
+	return rv;
+}
+
+static CK_RV mock_C_SignFinal(CK_SESSION_HANDLE handle, CK_BYTE_PTR sig,
+		CK_ULONG_PTR sig_len)
+{
+	MOCK_SESSION *sess;
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+
+	MOCK_LOCK_SESSION(handle, sess);
+	if (sess->op != OP_SIGN || !sess->mdctx) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_OPERATION_NOT_INITIALIZED;
+	}
+	if (!sig)
+		return mock_op_run(sess, FN_C_SignFinal, NULL, 0, NULL, sig_len);
+	EVP_DigestFinal_ex(sess->mdctx, md, &md_len);
+	return mock_op_run(sess, FN_C_SignFinal, md, md_len, sig, sig_len);
+}
+
+static CK_RV mock_C_VerifyInit(CK_SESSION_HANDLE handle,
+		CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE key)
+{
+	return mock_op_init(handle, OP_VERIFY, FN_C_VerifyInit,
+		mechanism, key);
+}
+
+static CK_RV mock_C_Verify(CK_SESSION_HANDLE handle, CK_BYTE_PTR data,
+		CK_ULONG data_len, CK_BYTE_PTR sig, CK_ULONG sig_len)
+{
+	return mock_op(handle, OP_VERIFY, FN_C_Verify,
+		data, data_len, sig, &sig_len);
+}
+
+static CK_RV mock_C_DecryptInit(CK_SESSION_HANDLE handle,
+		CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE key)
+{
+	return mock_op_init(handle, OP_DECRYPT, FN_C_DecryptInit,
+		mechanism, key);
+}
+
+static CK_RV mock_C_Decrypt(CK_SESSION_HANDLE handle, CK_BYTE_PTR in,
+		CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	return mock_op(handle, OP_DECRYPT, FN_C_Decrypt,
+		in, in_len, out, out_len);
+}
+
+static CK_RV mock_C_EncryptInit(CK_SESSION_HANDLE handle,
+		CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE key)
+{
+	return mock_op_init(handle, OP_ENCRYPT, FN_C_EncryptInit,
+		mechanism, key);
+}
+
+static CK_RV mock_C_Encrypt(CK_SESSION_HANDLE handle, CK_BYTE_PTR in,
+		CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	return mock_op(handle, OP_ENCRYPT, FN_C_Encrypt,
+		in, in_len, out, out_len);
+}
+
+/* The exact output length of the next C_EncryptUpdate/C_DecryptUpdate */
+static CK_ULONG mock_cipher_out_len(MOCK_SESSION *sess, CK_ULONG in_len)
+{
+	CK_ULONG total = sess->buffered + in_len;
+
+	if (sess->mechanism == CKM_AES_GCM) {
+		if (sess->op == OP_ENCRYPT)
+			return in_len;
+		total = sess->tail_len + in_len;
+		return total > sizeof sess->tail ? total - sizeof sess->tail : 0;
+	}
+	/* OpenSSL keeps the last block of a padded decryption */
+	if (sess->mechanism == CKM_AES_CBC_PAD && sess->op == OP_DECRYPT)
+		return total ? (total - 1) / 16 * 16 : 0;
+	return total / 16 * 16;
+}
+
+/*
+ * The tag at the end of the input of a GCM decryption is only known
+ * when the operation is finished, so the last 16 bytes are kept back
+ */
+static CK_RV mock_cipher_update(CK_SESSION_HANDLE handle, int op, int fn,
+		CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	MOCK_SESSION *sess;
+	unsigned char *buf, *data;
+	CK_ULONG need, total, keep;
+	int len = 0;
+	CK_RV rv = CKR_OK;
+
+	mock_delay(fn);
+	MOCK_LOCK_SESSION(handle, sess);
+	if (sess->op != op || !sess->cctx) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_OPERATION_NOT_INITIALIZED;
+	}
+	need = mock_cipher_out_len(sess, in_len);
+	if (!out || *out_len < need) {
+		*out_len = need;
+		pthread_mutex_unlock(&mock_lock);
+		return out ? CKR_BUFFER_TOO_SMALL : CKR_OK;
+	}
+	total = sess->tail_len + in_len;
+	buf = malloc(total + 16);
+	data = malloc(total + 1);
+	if (!buf || !data) {
+		rv = CKR_HOST_MEMORY;
+	} else if (sess->mechanism == CKM_AES_GCM && op == OP_DECRYPT) {
+		memcpy(data, sess->tail, sess->tail_len);
+		memcpy(data + sess->tail_len, in, in_len);
+		keep = total < sizeof sess->tail ? total : sizeof sess->tail;
+		if (!EVP_CipherUpdate(sess->cctx, buf, &len,
+				data, (int)(total - keep)))
+			rv = CKR_FUNCTION_FAILED;
+		memcpy(sess->tail, data + total - keep, keep);
+		sess->tail_len = keep;
+	} else if (!EVP_CipherUpdate(sess->cctx, buf, &len, in, (int)in_len)) {
+		rv = CKR_FUNCTION_FAILED;
+	} else {
+		sess->buffered += in_len - (CK_ULONG)len;
+	}
+	if (rv == CKR_OK) {
+		memcpy(out, buf, (size_t)len);
+		*out_len = (CK_ULONG)len;
+	} else {
+		mock_end_op(sess);
+	}
+	free(buf);
+	free(data);
+	pthread_mutex_unlock(&mock_lock);
+	return rv;
+}
+
+static CK_RV mock_cipher_final(CK_SESSION_HANDLE handle, int op, int fn,
+		CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	MOCK_SESSION *sess;
+	unsigned char buf[32];
+	CK_ULONG need;
+	int gcm, len = 0;
+	CK_RV rv = CKR_OK;
+
+	mock_delay(fn);
+	MOCK_LOCK_SESSION(handle, sess);
+	if (sess->op != op || !sess->cctx) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_OPERATION_NOT_INITIALIZED;
+	}
+	gcm = sess->mechanism == CKM_AES_GCM;
+	if (gcm)
+		need = op == OP_ENCRYPT ? 16 : 0;
+	else if (sess->mechanism == CKM_AES_CBC_PAD)
+		need = op == OP_ENCRYPT ? 16 : sess->buffered;
+	else
+		need = 0;
+	if (!out || *out_len < need) {
+		*out_len = need;
+		pthread_mutex_unlock(&mock_lock);
+		return out ? CKR_BUFFER_TOO_SMALL : CKR_OK;
+	}
+	if (gcm && op == OP_DECRYPT && (sess->tail_len != sizeof sess->tail ||
+			!EVP_CIPHER_CTX_ctrl(sess->cctx, EVP_CTRL_GCM_SET_TAG,
+				16, sess->tail))) {
+		rv = CKR_ENCRYPTED_DATA_LEN_RANGE;
+	} else if (!EVP_CipherFinal_ex(sess->cctx, buf, &len)) {
+		if (op == OP_ENCRYPT)
+			rv = CKR_DATA_LEN_RANGE;
+		else if (gcm || sess->mechanism == CKM_AES_CBC_PAD)
+			rv = CKR_ENCRYPTED_DATA_INVALID;
+		else
+			rv = CKR_ENCRYPTED_DATA_LEN_RANGE;
+	} else if (gcm && op == OP_ENCRYPT && !EVP_CIPHER_CTX_ctrl(sess->cctx,
+			EVP_CTRL_GCM_GET_TAG, 16, buf + len)) {
+		rv = CKR_FUNCTION_FAILED;
+	} else {
+		if (gcm && op == OP_ENCRYPT)
+			len += 16;
+		memcpy(out, buf, (size_t)len);
+		*out_len = (CK_ULONG)len;
+	}
+	mock_end_op(sess);
+	pthread_mutex_unlock(&mock_lock);
+	return rv;
+}
+
+static CK_RV mock_C_EncryptUpdate(CK_SESSION_HANDLE handle, CK_BYTE_PTR in,
+		CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	return mock_cipher_update(handle, OP_ENCRYPT, FN_C_EncryptUpdate,
+		in, in_len, out, out_len);
+}
+
+static CK_RV mock_C_EncryptFinal(CK_SESSION_HANDLE handle, CK_BYTE_PTR out,
+		CK_ULONG_PTR out_len)
+{
+	return mock_cipher_final(handle, OP_ENCRYPT, FN_C_EncryptFinal,
+		out, out_len);
+}
+
+static CK_RV mock_C_DecryptUpdate(CK_SESSION_HANDLE handle, CK_BYTE_PTR in,
+		CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	return mock_cipher_update(handle, OP_DECRYPT, FN_C_DecryptUpdate,
+		in, in_len, out, out_len);
+}
+
+static CK_RV mock_C_DecryptFinal(CK_SESSION_HANDLE handle, CK_BYTE_PTR out,
+		CK_ULONG_PTR out_len)
+{
+	return mock_cipher_final(handle, OP_DECRYPT, FN_C_DecryptFinal,
+		out, out_len);
+}
+
+static CK_RV mock_C_DeriveKey(CK_SESSION_HANDLE handle,
+		CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE base,
+		CK_ATTRIBUTE_PTR templ, CK_ULONG count, CK_OBJECT_HANDLE_PTR key)
+{
+	MOCK_SESSION *sess;
+	MOCK_OBJECT *obj;
+	CK_ECDH1_DERIVE_PARAMS *params;
+	const EC_KEY *ec;
+	EC_POINT *point;
+	unsigned char secret[256];
+	int len;
+	CK_ULONG i;
+
+	(void)templ;
+	(void)count;
+	if (mechanism->mechanism != CKM_ECDH1_DERIVE ||
+			mechanism->ulParameterLen != sizeof(CK_ECDH1_DERIVE_PARAMS))
+		return CKR_MECHANISM_INVALID;
+	params = mechanism->pParameter;
+
+	mock_delay(FN_C_DeriveKey);
+	MOCK_LOCK_SESSION(handle, sess);
+	obj = mock_get_object(sess->slot, base);
+	if (!obj || !obj->pkey || EVP_PKEY_base_id(obj->pkey) != EVP_PKEY_EC) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_KEY_HANDLE_INVALID;
+	}
+	ec = EVP_PKEY_get0_EC_KEY(obj->pkey);
+	point = EC_POINT_new(EC_KEY_get0_group(ec));
+	if (!point || !EC_POINT_oct2point(EC_KEY_get0_group(ec), point,
+			params->pPublicData, params->ulPublicDataLen, NULL)) {
+		EC_POINT_free(point);
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_MECHANISM_PARAM_INVALID;
+	}
+	len = ECDH_compute_key(secret, sizeof secret, point, ec, NULL);
+	EC_POINT_free(point);
+	if (len <= 0) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_FUNCTION_FAILED;
+	}
+	obj = mock_new_object(sess->slot, CKO_SECRET_KEY, handle);
+	if (!obj) {
+		pthread_mutex_unlock(&mock_lock);
+		return CKR_HOST_MEMORY;
+	}
+	for (i = 0; i < count; i++) /* Honour CKA_VALUE_LEN */
+		if (templ[i].type == CKA_VALUE_LEN &&
+				*(CK_ULONG *)templ[i].pValue < (CK_ULONG)len)
+			len = (int)*(CK_ULONG *)templ[i].pValue;
+	mock_attr_ulong(obj, CKA_KEY_TYPE, CKK_GENERIC_SECRET);
+	mock_attr(obj, CKA_VALUE, secret, (CK_ULONG)len);
+	mock_attr_ulong(obj, CKA_VALUE_LEN, (CK_ULONG)len);
+	*key = obj->handle;
+	pthread_mutex_unlock(&mock_lock);
+	return CKR_OK;
+}
+
+static CK_RV mock_C_SeedRandom(CK_SESSION_HANDLE handle, CK_BYTE_PTR seed,
+		CK_ULONG seed_len)
+{
+	MOCK_SESSION *sess;
+
+	mock_delay(FN_C_SeedRandom);
+	MOCK_LOCK_SESSION(handle, sess);
+	(void)sess;
+	RAND_seed(seed, (int)seed_len);
+	pthread_mutex_unlock(&mock_lock);
+	return CKR_OK;
+}
+
+static CK_RV mock_C_GenerateRandom(CK_SESSION_HANDLE handle, CK_BYTE_PTR data,
+		CK_ULONG len)
+{
+	MOCK_SESSION *sess;
+
+	mock_delay(FN_C_GenerateRandom);
+	MOCK_LOCK_SESSION(handle, sess);
+	(void)sess;
+	pthread_mutex_unlock(&mock_lock);
+	return RAND_bytes(data, (int)len) > 0 ? CKR_OK : CKR_FUNCTION_FAILED;
+}
+
+/******************************************************************************/
+/* Unsupported functions                                                      */
+/******************************************************************************/
+
+#define MOCK_NOT_SUPPORTED(name, args, unused) \
+	static CK_RV mock_ ## name args \
+	{ \
+		unused; \
+		return CKR_FUNCTION_NOT_SUPPORTED; \
+	}
+
+MOCK_NOT_SUPPORTED(C_InitToken, (CK_SLOT_ID a, CK_UTF8CHAR_PTR b, CK_ULONG c,
+	CK_UTF8CHAR_PTR d),
+	((void)a, (void)b, (void)c, (void)d))
+MOCK_NOT_SUPPORTED(C_InitPIN, (CK_SESSION_HANDLE a, CK_UTF8CHAR_PTR b,
+	CK_ULONG c),
+	((void)a, (void)b, (void)c))
+MOCK_NOT_SUPPORTED(C_SetPIN, (CK_SESSION_HANDLE a, CK_UTF8CHAR_PTR b,
+	CK_ULONG c, CK_UTF8CHAR_PTR d, CK_ULONG e),
+	((void)a, (void)b, (void)c, (void)d, (void)e))
+MOCK_NOT_SUPPORTED(C_GetOperationState, (CK_SESSION_HANDLE a, CK_BYTE_PTR b,
+	CK_ULONG_PTR c),
+	((void)a, (void)b, (void)c))
+MOCK_NOT_SUPPORTED(C_SetOperationState, (CK_SESSION_HANDLE a, CK_BYTE_PTR b,
+	CK_ULONG c, CK_OBJECT_HANDLE d, CK_OBJECT_HANDLE e),
+	((void)a, (void)b, (void)c, (void)d, (void)e))
+MOCK_NOT_SUPPORTED(C_CopyObject, (CK_SESSION_HANDLE a, CK_OBJECT_HANDLE b,
+	CK_ATTRIBUTE_PTR c, CK_ULONG d, CK_OBJECT_HANDLE_PTR e),
+	((void)a, (void)b, (void)c, (void)d, (void)e))
+MOCK_NOT_SUPPORTED(C_GetObjectSize, (CK_SESSION_HANDLE a, CK_OBJECT_HANDLE b,
+	CK_ULONG_PTR c),
+	((void)a, (void)b, (void)c))
+MOCK_NOT_SUPPORTED(C_SetAttributeValue, (CK_SESSION_HANDLE a,
+	CK_OBJECT_HANDLE b, CK_ATTRIBUTE_PTR c, CK_ULONG d),
+	((void)a, (void)b, (void)c, (void)d))
+MOCK_NOT_SUPPORTED(C_DigestInit, (CK_SESSION_HANDLE a, CK_MECHANISM_PTR b),
+	((void)a, (void)b))
+MOCK_NOT_SUPPORTED(C_Digest, (CK_SESSION_HANDLE a, CK_BYTE_PTR b, CK_ULONG c,
+	CK_BYTE_PTR d, CK_ULONG_PTR e),
+	((void)a, (void)b, (void)c, (void)d, (void)e))
+MOCK_NOT_SUPPORTED(C_DigestUpdate, (CK_SESSION_HANDLE a, CK_BYTE_PTR b,
+	CK_ULONG c),
+	((void)a, (void)b, (void)c))
+MOCK_NOT_SUPPORTED(C_DigestKey, (CK_SESSION_HANDLE a, CK_OBJECT_HANDLE b),
+	((void)a, (void)b))
+MOCK_NOT_SUPPORTED(C_DigestFinal, (CK_SESSION_HANDLE a, CK_BYTE_PTR b,
+	CK_ULONG_PTR c),
+	((void)a, (void)b, (void)c))
+MOCK_NOT_SUPPORTED(C_SignRecoverInit, (CK_SESSION_HANDLE a,
+	CK_MECHANISM_PTR b, CK_OBJECT_HANDLE c),
+	((void)a, (void)b, (void)c))
+MOCK_NOT_SUPPORTED(C_SignRecover, (CK_SESSION_HANDLE a, CK_BYTE_PTR b,
+	CK_ULONG c, CK_BYTE_PTR d, CK_ULONG_PTR e),
+	((void)a, (void)b, (void)c, (void)d, (void)e))
+MOCK_NOT_SUPPORTED(C_VerifyUpdate, (CK_SESSION_HANDLE a, CK_BYTE_PTR b,
+	CK_ULONG c),
+	((void)a, (void)b, (void)c))
+MOCK_NOT_SUPPORTED(C_VerifyFinal, (CK_SESSION_HANDLE a, CK_BYTE_PTR b,
+	CK_ULONG c),
+	((void)a, (void)b, (void)c))
+MOCK_NOT_SUPPORTED(C_VerifyRecoverInit, (CK_SESSION_HANDLE a,
+	CK_MECHANISM_PTR b, CK_OBJECT_HANDLE c),
+	((void)a, (void)b, (void)c))
+MOCK_NOT_SUPPORTED(C_VerifyRecover, (CK_SESSION_HANDLE a, CK_BYTE_PTR b,
+	CK_ULONG c, CK_BYTE_PTR d, CK_ULONG_PTR e),
+	((void)a, (void)b, (void)c, (void)d, (void)e))
+MOCK_NOT_SUPPORTED(C_DigestEncryptUpdate, (CK_SESSION_HANDLE a, CK_BYTE_PTR b,
+	CK_ULONG c, CK_BYTE_PTR d, CK_ULONG_PTR e),
+	((void)a, (void)b, (void)c, (void)d, (void)e))
+MOCK_NOT_SUPPORTED(C_DecryptDigestUpdate, (CK_SESSION_HANDLE a, CK_BYTE_PTR b,
+	CK_ULONG c, CK_BYTE_PTR d, CK_ULONG_PTR e),
+	((void)a, (void)b, (void)c, (void)d, (void)e))
+MOCK_NOT_SUPPORTED(C_SignEncryptUpdate, (CK_SESSION_HANDLE a, CK_BYTE_PTR b,
+	CK_ULONG c, CK_BYTE_PTR d, CK_ULONG_PTR e),
+	((void)a, (void)b, (void)c, (void)d, (void)e))
+MOCK_NOT_SUPPORTED(C_DecryptVerifyUpdate, (CK_SESSION_HANDLE a, CK_BYTE_PTR b,
+	CK_ULONG c, CK_BYTE_PTR d, CK_ULONG_PTR e),
+	((void)a, (void)b, (void)c, (void)d, (void)e))
+MOCK_NOT_SUPPORTED(C_GenerateKey, (CK_SESSION_HANDLE a, CK_MECHANISM_PTR b,
+	CK_ATTRIBUTE_PTR c, CK_ULONG d, CK_OBJECT_HANDLE_PTR e),
+	((void)a, (void)b, (void)c, (void)d, (void)e))
+MOCK_NOT_SUPPORTED(C_WrapKey, (CK_SESSION_HANDLE a, CK_MECHANISM_PTR b,
+	CK_OBJECT_HANDLE c, CK_OBJECT_HANDLE d, CK_BYTE_PTR e, CK_ULONG_PTR f),
+	((void)a, (void)b, (void)c, (void)d, (void)e, (void)f))
+MOCK_NOT_SUPPORTED(C_UnwrapKey, (CK_SESSION_HANDLE a, CK_MECHANISM_PTR b,
+	CK_OBJECT_HANDLE c, CK_BYTE_PTR d, CK_ULONG e, CK_ATTRIBUTE_PTR f,
+	CK_ULONG g, CK_OBJECT_HANDLE_PTR h),
+	((void)a, (void)b, (void)c, (void)d, (void)e, (void)f, (void)g, (void)h))
+MOCK_NOT_SUPPORTED(C_GetFunctionStatus, (CK_SESSION_HANDLE a),
+	((void)a))
+MOCK_NOT_SUPPORTED(C_CancelFunction, (CK_SESSION_HANDLE a),
+	((void)a))
+
+/******************************************************************************/
+/* Entry point                                                                */
+/******************************************************************************/
+
+static CK_FUNCTION_LIST mock_function_list;
+
+CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR list)
+{
+	CK_FUNCTION_LIST *f = &mock_function_list;
+
+	f->version.major = 2;
+	f->version.minor = 20;
+#define MOCK_FUNCTION(name) f->name = mock_ ## name
+	MOCK_FUNCTION(C_Initialize);
+	MOCK_FUNCTION(C_Finalize);
+	MOCK_FUNCTION(C_GetInfo);
+	f->C_GetFunctionList = C_GetFunctionList;
+	MOCK_FUNCTION(C_GetSlotList);
+	MOCK_FUNCTION(C_GetSlotInfo);
+	MOCK_FUNCTION(C_GetTokenInfo);
+	MOCK_FUNCTION(C_GetMechanismList);
+	MOCK_FUNCTION(C_GetMechanismInfo);
+	MOCK_FUNCTION(C_InitToken);
+	MOCK_FUNCTION(C_InitPIN);
+	MOCK_FUNCTION(C_SetPIN);
+	MOCK_FUNCTION(C_OpenSession);
+	MOCK_FUNCTION(C_CloseSession);
+	MOCK_FUNCTION(C_CloseAllSessions);
+	MOCK_FUNCTION(C_GetSessionInfo);
+	MOCK_FUNCTION(C_GetOperationState);
+	MOCK_FUNCTION(C_SetOperationState);
+	MOCK_FUNCTION(C_Login);
+	MOCK_FUNCTION(C_Logout);
+	MOCK_FUNCTION(C_CreateObject);
+	MOCK_FUNCTION(C_CopyObject);
+	MOCK_FUNCTION(C_DestroyObject);
+	MOCK_FUNCTION(C_GetObjectSize);
+	MOCK_FUNCTION(C_GetAttributeValue);
+	MOCK_FUNCTION(C_SetAttributeValue);
+	MOCK_FUNCTION(C_FindObjectsInit);
+	MOCK_FUNCTION(C_FindObjects);
+	MOCK_FUNCTION(C_FindObjectsFinal);
+	MOCK_FUNCTION(C_EncryptInit);
+	MOCK_FUNCTION(C_Encrypt);
+	MOCK_FUNCTION(C_EncryptUpdate);
+	MOCK_FUNCTION(C_EncryptFinal);
+	MOCK_FUNCTION(C_DecryptInit);
+	MOCK_FUNCTION(C_Decrypt);
+	MOCK_FUNCTION(C_DecryptUpdate);
+	MOCK_FUNCTION(C_DecryptFinal);
+	MOCK_FUNCTION(C_DigestInit);
+	MOCK_FUNCTION(C_Digest);
+	MOCK_FUNCTION(C_DigestUpdate);
+	MOCK_FUNCTION(C_DigestKey);
+	MOCK_FUNCTION(C_DigestFinal);
+	MOCK_FUNCTION(C_SignInit);
+	MOCK_FUNCTION(C_Sign);
+	MOCK_FUNCTION(C_SignUpdate);
+	MOCK_FUNCTION(C_SignFinal);
+	MOCK_FUNCTION(C_SignRecoverInit);
+	MOCK_FUNCTION(C_SignRecover);
+	MOCK_FUNCTION(C_VerifyInit);
+	MOCK_FUNCTION(C_Verify);
+	MOCK_FUNCTION(C_VerifyUpdate);
+	MOCK_FUNCTION(C_VerifyFinal);
+	MOCK_FUNCTION(C_VerifyRecoverInit);
+	MOCK_FUNCTION(C_VerifyRecover);
+	MOCK_FUNCTION(C_DigestEncryptUpdate);
+	MOCK_FUNCTION(C_DecryptDigestUpdate);
+	MOCK_FUNCTION(C_SignEncryptUpdate);
+	MOCK_FUNCTION(C_DecryptVerifyUpdate);
+	MOCK_FUNCTION(C_GenerateKey);
+	MOCK_FUNCTION(C_GenerateKeyPair);
+	MOCK_FUNCTION(C_WrapKey);
+	MOCK_FUNCTION(C_UnwrapKey);
+	MOCK_FUNCTION(C_DeriveKey);
+	MOCK_FUNCTION(C_SeedRandom);
+	MOCK_FUNCTION(C_GenerateRandom);
+	MOCK_FUNCTION(C_GetFunctionStatus);
+	MOCK_FUNCTION(C_CancelFunction);
+	MOCK_FUNCTION(C_WaitForSlotEvent);
+#undef MOCK_FUNCTION
+	*list = f;
+	return CKR_OK;
+}
+
+/* vim: set noexpandtab: */
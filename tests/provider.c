@@ -0,0 +1,340 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: provider.c
+ *
+ * Uses the keys of the pkcs11 provider activated by the OPENSSL_CONF
+ * configuration file, and loaded from their "pkcs11:" URIs:
+ * - "sign": RSA and ECDSA signatures verified with the public keys
+ * - "decrypt": RSA PKCS#1 v1.5 and OAEP decryption of the data encrypted
+ *   with the public key
+ * - "derive": ECDH with a key generated by OpenSSL, compared with the
+ *   secret derived by OpenSSL
+ * - "store": the objects of a URI without type, and a missing object
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(LIBRESSL_VERSION_NUMBER)
+#include <openssl/core_names.h>
+#include <openssl/provider.h>
+#include <openssl/rsa.h>
+#include <openssl/store.h>
+#include <openssl/x509.h>
+
+#define RSA_URI		"pkcs11:object=server-key"
+#define EC_URI		"pkcs11:object=ec-key"
+#define MAX_SIGSIZE	1024
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+/* Load the objects of a URI, and count them by type */
+static int load_objects(const char *uri, EVP_PKEY **pkey, EVP_PKEY **pubkey,
+		X509 **cert)
+{
+	OSSL_STORE_CTX *store;
+	OSSL_STORE_INFO *info;
+	int count = 0;
+
+	store = OSSL_STORE_open(uri, NULL, NULL, NULL, NULL);
+	if (!store) {
+		error_queue("OSSL_STORE_open");
+		return -1;
+	}
+	while (!OSSL_STORE_eof(store)) {
+		info = OSSL_STORE_load(store);
+		if (!info)
+			continue;
+		switch (OSSL_STORE_INFO_get_type(info)) {
+		case OSSL_STORE_INFO_PKEY:
+			if (pkey && !*pkey)
+				*pkey = OSSL_STORE_INFO_get1_PKEY(info);
+			break;
+		case OSSL_STORE_INFO_PUBKEY:
+			if (pubkey && !*pubkey)
+				*pubkey = OSSL_STORE_INFO_get1_PUBKEY(info);
+			break;
+		case OSSL_STORE_INFO_CERT:
+			if (cert && !*cert)
+				*cert = OSSL_STORE_INFO_get1_CERT(info);
+			break;
+		}
+		OSSL_STORE_INFO_free(info);
+		count++;
+	}
+	OSSL_STORE_close(store);
+	return count;
+}
+
+/* The private key and the public key of a URI */
+static int load_keypair(const char *uri, EVP_PKEY **pkey, EVP_PKEY **pubkey)
+{
+	char name[128];
+	const char *provider;
+
+	*pkey = NULL;
+	*pubkey = NULL;
+	snprintf(name, sizeof name, "%s;type=private", uri);
+	load_objects(name, pkey, NULL, NULL);
+	snprintf(name, sizeof name, "%s;type=public", uri);
+	load_objects(name, NULL, pubkey, NULL);
+	if (!*pkey || !*pubkey) {
+		error_queue("OSSL_STORE_load");
+		fprintf(stderr, "%s: the keys were not loaded\n", uri);
+		return -1;
+	}
+	provider = OSSL_PROVIDER_get0_name(EVP_PKEY_get0_provider(*pkey));
+	if (!provider || strcmp(provider, "pkcs11")) {
+		fprintf(stderr, "%s: the key of the %s provider was loaded\n",
+			uri, provider ? provider : "unknown");
+		return -1;
+	}
+	return 0;
+}
+
+static int test_sign_key(const char *uri)
+{
+	static const unsigned char data[] = "data signed by the provider";
+	unsigned char sig[MAX_SIGSIZE];
+	size_t siglen = sizeof sig;
+	EVP_PKEY *pkey, *pubkey;
+	EVP_MD_CTX *mdctx = NULL;
+	int rv = -1;
+
+	if (load_keypair(uri, &pkey, &pubkey))
+		goto end;
+	mdctx = EVP_MD_CTX_new();
+	if (!mdctx || EVP_DigestSignInit_ex(mdctx, NULL, "SHA256",
+			NULL, NULL, pkey, NULL) <= 0 ||
+			EVP_DigestSign(mdctx, sig, &siglen,
+				data, sizeof data) <= 0) {
+		error_queue("EVP_DigestSign");
+		goto end;
+	}
+	EVP_MD_CTX_free(mdctx);
+	mdctx = EVP_MD_CTX_new();
+	if (!mdctx || EVP_DigestVerifyInit_ex(mdctx, NULL, "SHA256",
+			NULL, NULL, pubkey, NULL) <= 0 ||
+			EVP_DigestVerify(mdctx, sig, siglen,
+				data, sizeof data) != 1) {
+		error_queue("EVP_DigestVerify");
+		fprintf(stderr, "%s: invalid signature\n", uri);
+		goto end;
+	}
+	printf("%s: %zu-byte signature verified\n", uri, siglen);
+	rv = 0;
+end:
+	EVP_MD_CTX_free(mdctx);
+	EVP_PKEY_free(pkey);
+	EVP_PKEY_free(pubkey);
+	return rv;
+}
+
+static int test_sign(void)
+{
+	if (test_sign_key(RSA_URI) || test_sign_key(EC_URI))
+		return -1;
+	return 0;
+}
+
+static int test_decrypt_padding(EVP_PKEY *pkey, EVP_PKEY *pubkey, int padding)
+{
+	static const unsigned char data[] = "data decrypted by the provider";
+	unsigned char enc[MAX_SIGSIZE], dec[MAX_SIGSIZE];
+	size_t enclen = sizeof enc, declen = sizeof dec;
+	EVP_PKEY_CTX *pctx;
+	int ok;
+
+	pctx = EVP_PKEY_CTX_new_from_pkey(NULL, pubkey, NULL);
+	ok = pctx && EVP_PKEY_encrypt_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_rsa_padding(pctx, padding) > 0 &&
+		EVP_PKEY_encrypt(pctx, enc, &enclen, data, sizeof data) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	if (!ok) {
+		error_queue("EVP_PKEY_encrypt");
+		return -1;
+	}
+	pctx = EVP_PKEY_CTX_new_from_pkey(NULL, pkey, NULL);
+	ok = pctx && EVP_PKEY_decrypt_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_rsa_padding(pctx, padding) > 0 &&
+		EVP_PKEY_decrypt(pctx, dec, &declen, enc, enclen) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	if (!ok) {
+		error_queue("EVP_PKEY_decrypt");
+		return -1;
+	}
+	if (declen != sizeof data || memcmp(dec, data, declen)) {
+		fprintf(stderr, "padding %d: the decrypted data differs\n",
+			padding);
+		return -1;
+	}
+	printf("padding %d: %zu bytes decrypted\n", padding, declen);
+	return 0;
+}
+
+static int test_decrypt(void)
+{
+	EVP_PKEY *pkey, *pubkey;
+	int rv = -1;
+
+	if (load_keypair(RSA_URI, &pkey, &pubkey) == 0 &&
+			test_decrypt_padding(pkey, pubkey, RSA_PKCS1_PADDING) == 0 &&
+			test_decrypt_padding(pkey, pubkey,
+				RSA_PKCS1_OAEP_PADDING) == 0)
+		rv = 0;
+	EVP_PKEY_free(pkey);
+	EVP_PKEY_free(pubkey);
+	return rv;
+}
+
+/* Derive the shared secret of a private key and a peer key */
+static int derive(EVP_PKEY *pkey, EVP_PKEY *peer,
+		unsigned char *secret, size_t *len)
+{
+	EVP_PKEY_CTX *pctx;
+	int ok;
+
+	pctx = EVP_PKEY_CTX_new_from_pkey(NULL, pkey, NULL);
+	ok = pctx && EVP_PKEY_derive_init(pctx) > 0 &&
+		EVP_PKEY_derive_set_peer(pctx, peer) > 0 &&
+		EVP_PKEY_derive(pctx, secret, len) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	if (!ok)
+		error_queue("EVP_PKEY_derive");
+	return ok ? 0 : -1;
+}
+
+static int test_derive(void)
+{
+	unsigned char secret[128], expected[128];
+	size_t len = sizeof secret, expected_len = sizeof expected;
+	EVP_PKEY *pkey, *pubkey, *peer = NULL;
+	char group[64];
+	int rv = -1;
+
+	if (load_keypair(EC_URI, &pkey, &pubkey))
+		goto end;
+	if (!EVP_PKEY_get_utf8_string_param(pubkey,
+			OSSL_PKEY_PARAM_GROUP_NAME, group, sizeof group, NULL)) {
+		error_queue("EVP_PKEY_get_utf8_string_param");
+		goto end;
+	}
+	peer = EVP_PKEY_Q_keygen(NULL, NULL, "EC", group);
+	if (!peer) {
+		error_queue("EVP_PKEY_Q_keygen");
+		goto end;
+	}
+	if (derive(pkey, peer, secret, &len) ||
+			derive(peer, pubkey, expected, &expected_len))
+		goto end;
+	if (len != expected_len || memcmp(secret, expected, len)) {
+		fprintf(stderr, "the shared secrets differ\n");
+		goto end;
+	}
+	printf("%s: %zu-byte secret derived\n", group, len);
+	rv = 0;
+end:
+	EVP_PKEY_free(pkey);
+	EVP_PKEY_free(pubkey);
+	EVP_PKEY_free(peer);
+	return rv;
+}
+
+static int test_store(void)
+{
+	EVP_PKEY *pkey = NULL;
+	X509 *cert = NULL;
+	int count, rv = -1;
+
+	/* The private key and the certificate of a URI without type */
+	count = load_objects(RSA_URI, &pkey, NULL, &cert);
+	if (count != 2 || !pkey || !cert) {
+		error_queue("OSSL_STORE_load");
+		fprintf(stderr, "%d objects loaded instead of the key "
+			"and the certificate\n", count);
+		goto end;
+	}
+	if (EVP_PKEY_eq(pkey, X509_get0_pubkey(cert)) != 1) {
+		fprintf(stderr, "the key does not match the certificate\n");
+		goto end;
+	}
+	/* Nothing is found for a missing object */
+	count = load_objects("pkcs11:object=missing-key", NULL, NULL, NULL);
+	if (count != 0) {
+		fprintf(stderr, "%d objects loaded for a missing key\n", count);
+		goto end;
+	}
+	ERR_clear_error();
+	printf("key and certificate loaded\n");
+	rv = 0;
+end:
+	EVP_PKEY_free(pkey);
+	X509_free(cert);
+	return rv;
+}
+
+int main(int argc, char *argv[])
+{
+	int rc = 1;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s sign|decrypt|derive|store\n", argv[0]);
+		return 1;
+	}
+	OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CONFIG, NULL);
+	if (!OSSL_PROVIDER_available(NULL, "pkcs11")) {
+		error_queue("OSSL_PROVIDER_available");
+		fprintf(stderr, "the pkcs11 provider is not configured\n");
+		return 1;
+	}
+
+	if (strcmp(argv[1], "sign") == 0) {
+		if (test_sign() == 0)
+			rc = 0;
+	} else if (strcmp(argv[1], "decrypt") == 0) {
+		if (test_decrypt() == 0)
+			rc = 0;
+	} else if (strcmp(argv[1], "derive") == 0) {
+		if (test_derive() == 0)
+			rc = 0;
+	} else if (strcmp(argv[1], "store") == 0) {
+		if (test_store() == 0)
+			rc = 0;
+	} else {
+		fprintf(stderr, "unknown test %s\n", argv[1]);
+	}
+	return rc;
+}
+
+#else
+
+int main(void)
+{
+	fprintf(stderr, "OpenSSL providers are not supported\n");
+	return 77;
+}
+
+#endif
+
+/* vim: set noexpandtab: */
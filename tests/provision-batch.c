@@ -0,0 +1,193 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: provision-batch.c
+ *
+ * Generates key pairs and stores private keys, public keys and
+ * certificates with PKCS11_provision_batch(), and checks the keys and
+ * certificates added to the token against the requests.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libp11.h>
+#include <openssl/x509.h>
+
+#define NUM_EACH 16
+#define NUM_REQS (4 * NUM_EACH)
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static unsigned char *load_file(const char *dir, const char *name, long *len)
+{
+	char path[1024];
+	unsigned char *buf;
+	FILE *f;
+
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+	buf = OPENSSL_malloc(8192);
+	if (buf)
+		*len = (long)fread(buf, 1, 8192, f);
+	fclose(f);
+	return buf;
+}
+
+static int check_req(PKCS11_PROVISION_REQ *req, unsigned int i)
+{
+	const char *label = req->job == PKCS11_PROVISION_CERT ?
+		(req->cert ? req->cert->label : NULL) :
+		(req->key ? req->key->label : NULL);
+	const unsigned char *id = req->job == PKCS11_PROVISION_CERT ?
+		(req->cert ? req->cert->id : NULL) :
+		(req->key ? req->key->id : NULL);
+
+	if (req->rv != 0) {
+		fprintf(stderr, "request %u failed: 0x%lx\n", i, req->rv);
+		return 0;
+	}
+	if (!label || strcmp(label, req->label) ||
+			!id || memcmp(id, req->id, req->id_len)) {
+		fprintf(stderr, "request %u: wrong object\n", i);
+		return 0;
+	}
+	if (req->job != PKCS11_PROVISION_CERT &&
+			req->key->isPrivate !=
+				(req->job != PKCS11_PROVISION_PUBLIC_KEY)) {
+		fprintf(stderr, "request %u: wrong key class\n", i);
+		return 0;
+	}
+	if (req->job == PKCS11_PROVISION_CERT &&
+			X509_cmp(PKCS11_get_x509(req->cert), req->x509)) {
+		fprintf(stderr, "request %u: wrong certificate\n", i);
+		return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_PROVISION_REQ reqs[NUM_REQS];
+	char labels[NUM_REQS][32];
+	unsigned char ids[NUM_REQS][4];
+	unsigned char *der = NULL;
+	const unsigned char *p;
+	EVP_PKEY *pkey = NULL, *pubkey = NULL;
+	X509 *x509 = NULL;
+	unsigned int nslots, i;
+	long len;
+	int rc = 1;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN DERDIR\n",
+			argv[0]);
+		return 1;
+	}
+
+	der = load_file(argv[3], "rsa-prvkey.der", &len);
+	p = der;
+	if (der)
+		pkey = d2i_AutoPrivateKey(NULL, &p, len);
+	OPENSSL_free(der);
+	der = load_file(argv[3], "rsa-cert.der", &len);
+	p = der;
+	if (der)
+		x509 = d2i_X509(NULL, &p, len);
+	OPENSSL_free(der);
+	if (!pkey || !x509) {
+		fprintf(stderr, "could not load the key and the certificate\n");
+		goto nolib;
+	}
+	pubkey = X509_get_pubkey(x509);
+
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto noctx;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		goto notoken;
+	}
+	if (PKCS11_login(slot, 0, argv[2])) {
+		error_queue("PKCS11_login");
+		goto notoken;
+	}
+
+	memset(reqs, 0, sizeof reqs);
+	for (i = 0; i < NUM_REQS; i++) {
+		reqs[i].job = (int)(i % 4);
+		switch (reqs[i].job) {
+		case PKCS11_PROVISION_GENERATE:
+			reqs[i].bits = 2048;
+			break;
+		case PKCS11_PROVISION_PRIVATE_KEY:
+			reqs[i].pkey = pkey;
+			break;
+		case PKCS11_PROVISION_PUBLIC_KEY:
+			reqs[i].pkey = pubkey;
+			break;
+		default:
+			reqs[i].x509 = x509;
+		}
+		snprintf(labels[i], sizeof labels[i], "provision-%u", i);
+		ids[i][0] = 0x70;
+		ids[i][1] = 0x72;
+		ids[i][2] = (unsigned char)(i >> 8);
+		ids[i][3] = (unsigned char)i;
+		reqs[i].label = labels[i];
+		reqs[i].id = ids[i];
+		reqs[i].id_len = sizeof ids[i];
+	}
+
+	if (PKCS11_provision_batch(slot->token, reqs, NUM_REQS)) {
+		error_queue("PKCS11_provision_batch");
+		goto notoken;
+	}
+	for (i = 0; i < NUM_REQS; i++)
+		if (!check_req(&reqs[i], i))
+			goto notoken;
+	printf("%u objects provisioned\n", NUM_REQS);
+	rc = 0;
+
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+noctx:
+	PKCS11_CTX_free(ctx);
+nolib:
+	EVP_PKEY_free(pkey);
+	EVP_PKEY_free(pubkey);
+	X509_free(x509);
+	return rc;
+}
+
+/* vim: set noexpandtab: */
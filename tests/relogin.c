@@ -0,0 +1,159 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: relogin.c
+ *
+ * Logs out of the token and closes all its sessions with a second
+ * context of the same module, and checks that signing with a key of
+ * the first context still succeeds after logging in again.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libp11.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#define DIGEST_SIZE 32
+#define MAX_SIGSIZE 1024
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int sign(const char *step, EVP_PKEY *pkey)
+{
+	EVP_PKEY_CTX *pctx;
+	unsigned char md[DIGEST_SIZE], sig[MAX_SIGSIZE];
+	size_t siglen = sizeof sig;
+	int ok;
+
+	RAND_bytes(md, sizeof md);
+	pctx = EVP_PKEY_CTX_new(pkey, NULL);
+	if (!pctx)
+		return 0;
+	ok = EVP_PKEY_sign_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+		EVP_PKEY_sign(pctx, sig, &siglen, md, DIGEST_SIZE) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	if (!ok) {
+		error_queue("EVP_PKEY_sign");
+		fprintf(stderr, "%s: signing failed\n", step);
+	}
+	return ok;
+}
+
+static PKCS11_SLOT *find_token(PKCS11_CTX *ctx, const char *module,
+		PKCS11_SLOT **slots, unsigned int *nslots)
+{
+	PKCS11_SLOT *slot;
+
+	if (PKCS11_CTX_load(ctx, module)) {
+		error_queue("PKCS11_CTX_load");
+		return NULL;
+	}
+	if (PKCS11_enumerate_slots(ctx, slots, nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		*slots = NULL;
+		*nslots = 0;
+		return NULL;
+	}
+	slot = PKCS11_find_token(ctx, *slots, *nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		return NULL;
+	}
+	return slot;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx, *ctx2;
+	PKCS11_SLOT *slots = NULL, *slots2 = NULL, *slot, *slot2;
+	PKCS11_KEY *keys;
+	EVP_PKEY *pkey = NULL;
+	unsigned int nslots = 0, nslots2 = 0, nkeys;
+	int logged_in, rc = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n",
+			argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	ctx2 = PKCS11_CTX_new();
+	slot = find_token(ctx, argv[1], &slots, &nslots);
+	if (!slot)
+		goto done;
+	if (PKCS11_login(slot, 0, argv[2])) {
+		error_queue("PKCS11_login");
+		goto done;
+	}
+	if (PKCS11_enumerate_keys(slot->token, &keys, &nkeys) || !nkeys) {
+		fprintf(stderr, "no private keys found\n");
+		goto done;
+	}
+	pkey = PKCS11_get_private_key(&keys[0]);
+	if (!pkey) {
+		error_queue("PKCS11_get_private_key");
+		goto done;
+	}
+	if (!sign("initial login", pkey))
+		goto done;
+
+	/* The login state of the token is shared by both contexts */
+	slot2 = find_token(ctx2, argv[1], &slots2, &nslots2);
+	if (!slot2)
+		goto done;
+	if (PKCS11_login(slot2, 0, argv[2]) || PKCS11_logout(slot2)) {
+		error_queue("PKCS11_logout");
+		goto done;
+	}
+	if (!sign("after logout", pkey))
+		goto done;
+	if (PKCS11_is_logged_in(slot, 0, &logged_in) || !logged_in) {
+		fprintf(stderr, "the login state was not restored\n");
+		goto done;
+	}
+
+	/* Releasing the slots closes all the sessions of the token */
+	PKCS11_release_all_slots(ctx2, slots2, nslots2);
+	slots2 = NULL;
+	nslots2 = 0;
+	if (!sign("after closing the sessions", pkey))
+		goto done;
+	printf("signed after the login state was lost\n");
+	rc = 0;
+
+done:
+	EVP_PKEY_free(pkey);
+	if (slots)
+		PKCS11_release_all_slots(ctx, slots, nslots);
+	if (slots2)
+		PKCS11_release_all_slots(ctx2, slots2, nslots2);
+	PKCS11_CTX_unload(ctx2);
+	PKCS11_CTX_unload(ctx);
+	PKCS11_CTX_free(ctx2);
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+/* vim: set noexpandtab: */
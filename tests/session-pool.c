@@ -0,0 +1,402 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: session-pool.c
+ *
+ * Checks the session pools of a slot with the mock module:
+ * - "cache": consecutive operations of a thread reuse the session cached
+ *   for the thread, so a single session is opened
+ * - "prewarm": PKCS11_login() opens PREWARM sessions in advance, as
+ *   many as the token allows, checked by the script
+ * - "timeout": the only session of the token is in use, and the
+ *   operations fail after the session timeout, or at once with no timeout
+ * - "open-error": the token fails to open a session while the other
+ *   sessions are in use, and the error is reported at once
+ * - "rw": the security officer logs in and out while a read-only
+ *   session is in use, and the session still returns to the read-only
+ *   pool, so that the read-only operations do not run out of sessions
+ * - "flush": the sessions are closed while one of them is in use, and
+ *   returning the invalidated session does not corrupt the session count
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <libp11.h>
+#include <openssl/rand.h>
+
+#define CKM_RSA_PKCS 0x00000001UL
+#define CKR_DEVICE_ERROR 0x00000030UL
+
+#define RANDOM_SIZE 16
+#define DIGEST_SIZE 32
+#define MAX_SIGSIZE 1024
+#define SIGNATURES 20
+#define PREWARM 4
+
+static PKCS11_SLOT *slot;
+static PKCS11_KEY *key;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static void sleep_ms(long ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
+/* Log in as the user and find the key of the first certificate */
+static int find_key(const char *pin)
+{
+	PKCS11_CERT *certs;
+	unsigned int ncerts;
+
+	if (PKCS11_login(slot, 0, pin)) {
+		error_queue("PKCS11_login");
+		return -1;
+	}
+	if (PKCS11_enumerate_certs(slot->token, &certs, &ncerts) || !ncerts) {
+		fprintf(stderr, "no certificates found\n");
+		return -1;
+	}
+	key = PKCS11_find_key(&certs[0]);
+	if (!key) {
+		fprintf(stderr, "no key matching certificate available\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Sign a random digest, the errors are reported by the caller */
+static int sign_one(void)
+{
+	unsigned char digest[DIGEST_SIZE], sig[MAX_SIGSIZE];
+	PKCS11_SIGN_REQ req;
+
+	RAND_bytes(digest, sizeof digest);
+	req.tbs = digest;
+	req.tbslen = sizeof digest;
+	req.sig = sig;
+	req.siglen = sizeof sig;
+	return PKCS11_sign_batch(key, CKM_RSA_PKCS, &req, 1);
+}
+
+/* The numbers of sessions opened are checked by the script */
+static int test_cache(const char *pin)
+{
+	int i;
+
+	if (find_key(pin))
+		return -1;
+	for (i = 0; i < SIGNATURES; i++) {
+		if (sign_one()) {
+			error_queue("PKCS11_sign_batch");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int test_prewarm(PKCS11_CTX *ctx, const char *pin)
+{
+	PKCS11_CTX_set_session_prewarm(ctx, PREWARM);
+	if (find_key(pin))
+		return -1;
+	if (sign_one()) {
+		error_queue("PKCS11_sign_batch");
+		return -1;
+	}
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *sign_thread(void *arg)
+{
+	*(int *)arg = sign_one();
+	return NULL;
+}
+
+/* Sign while another thread holds the only session, and check that
+ * the operation failed after the timeout in milliseconds */
+static int sign_timeout(PKCS11_CTX *ctx, long timeout)
+{
+	PKCS11_STATS before, after;
+	double start, elapsed;
+	int rv;
+
+	PKCS11_CTX_set_session_timeout(ctx, timeout);
+	PKCS11_get_stats(slot, &before);
+	start = now();
+	rv = sign_one();
+	elapsed = (now() - start) * 1000;
+	PKCS11_get_stats(slot, &after);
+	ERR_clear_error();
+	if (rv == 0) {
+		fprintf(stderr, "signed with no session available\n");
+		return -1;
+	}
+	if (elapsed < timeout * 0.9 || elapsed > timeout + 300) {
+		fprintf(stderr, "failed after %.0f ms with a %ld ms timeout\n",
+			elapsed, timeout);
+		return -1;
+	}
+	if (after.session_timeouts != before.session_timeouts + 1) {
+		fprintf(stderr, "the session timeout was not counted\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int test_timeout(PKCS11_CTX *ctx, const char *pin)
+{
+	pthread_t thread;
+	int rv = -1, ret = -1;
+
+	if (find_key(pin))
+		return -1;
+	/* C_Sign() of the thread takes one second */
+	if (pthread_create(&thread, NULL, sign_thread, &rv)) {
+		fprintf(stderr, "cannot create a thread\n");
+		return -1;
+	}
+	sleep_ms(100);
+	if (sign_timeout(ctx, 200) == 0 && sign_timeout(ctx, 0) == 0)
+		ret = 0;
+	pthread_join(thread, NULL);
+	if (rv) {
+		error_queue("PKCS11_sign_batch");
+		fprintf(stderr, "signing with the session failed\n");
+		return -1;
+	}
+	/* The session is available again */
+	PKCS11_CTX_set_session_timeout(ctx, 2000);
+	if (ret == 0 && sign_one()) {
+		error_queue("PKCS11_sign_batch");
+		ret = -1;
+	}
+	return ret;
+}
+
+/* Check whether the error queue holds a PKCS#11 error code */
+static int error_reported(unsigned long rv)
+{
+	unsigned long err;
+	int found = 0;
+
+	while ((err = ERR_get_error()) != 0)
+		if ((unsigned long)ERR_GET_REASON(err) == rv)
+			found = 1;
+	return found;
+}
+
+static int test_open_error(const char *pin)
+{
+	pthread_t thread;
+	double start, elapsed;
+	int rv = -1, signed_ok;
+
+	if (find_key(pin))
+		return -1;
+	/* Forget the session of this thread, still logged in on the token */
+	PKCS11_open_session(slot, 0);
+	/* C_Sign() of the thread takes one second */
+	if (pthread_create(&thread, NULL, sign_thread, &rv)) {
+		fprintf(stderr, "cannot create a thread\n");
+		return -1;
+	}
+	sleep_ms(100);
+	setenv("MOCK_PKCS11_FAIL_OPEN", "1", 1);
+	start = now();
+	signed_ok = sign_one() == 0;
+	elapsed = (now() - start) * 1000;
+	unsetenv("MOCK_PKCS11_FAIL_OPEN");
+	pthread_join(thread, NULL);
+	if (rv) {
+		error_queue("PKCS11_sign_batch");
+		fprintf(stderr, "signing with the session failed\n");
+		return -1;
+	}
+	if (signed_ok || elapsed > 500) {
+		fprintf(stderr, "waited %.0f ms for the session in use\n", elapsed);
+		return -1;
+	}
+	if (!error_reported(CKR_DEVICE_ERROR)) {
+		fprintf(stderr, "the error of C_OpenSession() was not reported\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void *random_thread(void *arg)
+{
+	unsigned char buf[RANDOM_SIZE];
+
+	*(int *)arg = PKCS11_generate_random(slot, buf, sizeof buf);
+	return NULL;
+}
+
+/* The pool of a session in use does not follow the login state */
+static int test_rw(const char *pin)
+{
+	unsigned char buf[RANDOM_SIZE];
+	pthread_t thread;
+	int i, rv = -1;
+
+	/* C_GenerateRandom() is slow enough to log in meanwhile */
+	if (pthread_create(&thread, NULL, random_thread, &rv)) {
+		fprintf(stderr, "cannot create a thread\n");
+		return -1;
+	}
+	sleep_ms(100);
+	if (PKCS11_login(slot, 1, pin)) {
+		error_queue("PKCS11_login");
+		pthread_join(thread, NULL);
+		return -1;
+	}
+	pthread_join(thread, NULL);
+	if (rv) {
+		error_queue("PKCS11_generate_random");
+		return -1;
+	}
+	if (PKCS11_logout(slot)) {
+		error_queue("PKCS11_logout");
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		if (PKCS11_generate_random(slot, buf, sizeof buf)) {
+			error_queue("PKCS11_generate_random");
+			fprintf(stderr, "no read-only session after logout\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* A session in use is invalidated by PKCS11_open_session() */
+static int test_flush(const char *pin)
+{
+	pthread_t thread;
+	int i, rv = -1;
+
+	if (find_key(pin))
+		return -1;
+	/* C_SignInit() of the thread takes half a second */
+	if (pthread_create(&thread, NULL, sign_thread, &rv)) {
+		fprintf(stderr, "cannot create a thread\n");
+		return -1;
+	}
+	sleep_ms(100);
+	/* Close all the sessions, including the one of the thread */
+	PKCS11_open_session(slot, 1);
+	pthread_join(thread, NULL);
+	ERR_clear_error();
+	if (rv == 0) {
+		fprintf(stderr, "signed with a closed session\n");
+		return -1;
+	}
+	if (PKCS11_login(slot, 0, pin)) {
+		error_queue("PKCS11_login");
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		if (sign_one()) {
+			error_queue("PKCS11_sign_batch");
+			fprintf(stderr, "no session after the flush\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots;
+	unsigned int nslots;
+	int rc = 1;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN "
+			"cache|prewarm|timeout|open-error|rw|flush\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	/* Fail rather than hang when the sessions are lost */
+	PKCS11_CTX_set_session_timeout(ctx, 2000);
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		goto notoken;
+	}
+
+	if (strcmp(argv[3], "cache") == 0) {
+		if (test_cache(argv[2]) == 0)
+			rc = 0;
+	} else if (strcmp(argv[3], "prewarm") == 0) {
+		if (test_prewarm(ctx, argv[2]) == 0)
+			rc = 0;
+	} else if (strcmp(argv[3], "timeout") == 0) {
+		if (test_timeout(ctx, argv[2]) == 0)
+			rc = 0;
+	} else if (strcmp(argv[3], "open-error") == 0) {
+		if (test_open_error(argv[2]) == 0)
+			rc = 0;
+	} else if (strcmp(argv[3], "rw") == 0) {
+		if (test_rw(argv[2]) == 0)
+			rc = 0;
+	} else if (strcmp(argv[3], "flush") == 0) {
+		if (test_flush(argv[2]) == 0)
+			rc = 0;
+	} else {
+		fprintf(stderr, "unknown test %s\n", argv[3]);
+	}
+
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+/* vim: set noexpandtab: */
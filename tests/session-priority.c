@@ -0,0 +1,244 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: session-priority.c
+ *
+ * Signs with threads of different priority classes while all the
+ * sessions of the token are busy:
+ * - "reserve": low-priority threads saturate the sessions, and a
+ *   high-priority thread uses the session reserved for it
+ * - "starvation": high-priority threads saturate the sessions, and
+ *   a low-priority thread is still served
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <libp11.h>
+#include <openssl/rand.h>
+
+#define CKM_RSA_PKCS 0x00000001UL
+
+#define DIGEST_SIZE 32
+#define MAX_SIGSIZE 1024
+#define NUM_THREADS 6
+#define HIGH_SIGNATURES 50
+#define LOW_SIGNATURES 20
+#define TIME_LIMIT 30.0 /* seconds */
+
+typedef struct {
+	pthread_t thread;
+	int priority;
+	unsigned long count, errors;
+	double elapsed;
+} PRIORITY_THREAD;
+
+static PKCS11_KEY *key;
+static volatile int stop;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Sign a random digest, and add the latency to the thread */
+static int sign_one(PRIORITY_THREAD *t)
+{
+	unsigned char digest[DIGEST_SIZE], sig[MAX_SIGSIZE];
+	PKCS11_SIGN_REQ req;
+	double start;
+	int rv;
+
+	RAND_bytes(digest, sizeof digest);
+	req.tbs = digest;
+	req.tbslen = sizeof digest;
+	req.sig = sig;
+	req.siglen = sizeof sig;
+	start = now();
+	rv = PKCS11_sign_batch(key, CKM_RSA_PKCS, &req, 1);
+	t->elapsed += now() - start;
+	if (rv)
+		t->errors++;
+	else
+		t->count++;
+	return rv;
+}
+
+static void *sign_thread(void *arg)
+{
+	PRIORITY_THREAD *t = arg;
+
+	PKCS11_set_thread_priority(t->priority);
+	while (!stop)
+		sign_one(t);
+	return NULL;
+}
+
+/* Average latency in milliseconds */
+static double average(double elapsed, unsigned long count)
+{
+	return count ? elapsed * 1000 / count : 0;
+}
+
+/*
+ * Sign with the calling thread while the busy threads saturate the
+ * sessions, and return the average latencies of both
+ */
+static int run(int busy_priority, int priority, unsigned long signatures,
+		double *latency, double *busy_latency)
+{
+	PRIORITY_THREAD threads[NUM_THREADS], self;
+	struct timespec pause = {0, 1000000};
+	double busy = 0, deadline = now() + TIME_LIMIT;
+	unsigned long count = 0;
+	int i, n, rv = -1;
+
+	memset(threads, 0, sizeof threads);
+	memset(&self, 0, sizeof self);
+	for (n = 0; n < NUM_THREADS; n++) {
+		threads[n].priority = busy_priority;
+		if (pthread_create(&threads[n].thread, NULL,
+				sign_thread, &threads[n])) {
+			fprintf(stderr, "cannot create a thread\n");
+			stop = 1;
+			break;
+		}
+	}
+	/* Wait until all the busy threads are signing */
+	while (!stop && count < NUM_THREADS && now() < deadline) {
+		nanosleep(&pause, NULL);
+		for (count = 0, i = 0; i < n; i++)
+			count += threads[i].count ? 1 : 0;
+	}
+	PKCS11_set_thread_priority(priority);
+	while (!stop && self.count < signatures && !self.errors &&
+			now() < deadline)
+		sign_one(&self);
+	PKCS11_set_thread_priority(PKCS11_PRIORITY_NORMAL);
+	stop = 1;
+	for (count = 0, i = 0; i < n; i++) {
+		pthread_join(threads[i].thread, NULL);
+		count += threads[i].count;
+		busy += threads[i].elapsed;
+		self.errors += threads[i].errors;
+	}
+	*latency = average(self.elapsed, self.count);
+	*busy_latency = average(busy, count);
+	printf("%lu signatures in %.2f ms, %lu busy thread signatures in %.2f ms\n",
+		self.count, *latency, count, *busy_latency);
+	if (self.errors) {
+		error_queue("PKCS11_sign_batch");
+		fprintf(stderr, "signing failed\n");
+	} else if (self.count < signatures) {
+		fprintf(stderr, "only %lu of %lu signatures within %.0f s\n",
+			self.count, signatures, TIME_LIMIT);
+	} else {
+		rv = 0;
+	}
+	return rv;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_CERT *certs;
+	unsigned int nslots, ncerts;
+	double latency, busy_latency;
+	int rc = 1;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN "
+			"reserve|starvation\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (strcmp(argv[3], "reserve") == 0)
+		PKCS11_CTX_set_session_reserve(ctx, 1, 0);
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		goto notoken;
+	}
+	if (PKCS11_login(slot, 0, argv[2])) {
+		error_queue("PKCS11_login");
+		goto notoken;
+	}
+	if (PKCS11_enumerate_certs(slot->token, &certs, &ncerts) || !ncerts) {
+		fprintf(stderr, "no certificates found\n");
+		goto notoken;
+	}
+	key = PKCS11_find_key(&certs[0]);
+	if (!key) {
+		fprintf(stderr, "no key matching certificate available\n");
+		goto notoken;
+	}
+	if (PKCS11_set_thread_priority(3) != -1 ||
+			PKCS11_set_key_priority(key, 3) != -1) {
+		fprintf(stderr, "an invalid priority was accepted\n");
+		goto notoken;
+	}
+	ERR_clear_error();
+
+	if (strcmp(argv[3], "reserve") == 0) {
+		/* The reserved session is not used by the busy threads */
+		if (run(PKCS11_PRIORITY_LOW, PKCS11_PRIORITY_HIGH,
+				HIGH_SIGNATURES, &latency, &busy_latency) == 0) {
+			if (latency < busy_latency / 2)
+				rc = 0;
+			else
+				fprintf(stderr, "the high priority waited\n");
+		}
+	} else if (strcmp(argv[3], "starvation") == 0) {
+		/* The busy threads do not starve the low priority */
+		if (run(PKCS11_PRIORITY_HIGH, PKCS11_PRIORITY_LOW,
+				LOW_SIGNATURES, &latency, &busy_latency) == 0)
+			rc = 0;
+	} else {
+		fprintf(stderr, "unknown test %s\n", argv[3]);
+	}
+
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,217 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: sign-batch.c
+ *
+ * Signs a batch of random digests with PKCS11_sign_batch()
+ * and verifies each signature with the certificate public key.
+ * With the mock module and two slots, the key has a replica on the
+ * second slot:
+ * - "replicas": the requests are signed on both slots
+ * - "failover": the slot of the replica fails, and its requests are
+ *   signed on the first slot
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libp11.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+#define CKM_RSA_PKCS 0x00000001UL
+
+#define NUM_REQS 64
+#define DIGEST_SIZE 32
+#define MAX_SIGSIZE 1024
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int verify(EVP_PKEY *pubkey, PKCS11_SIGN_REQ *req)
+{
+	EVP_PKEY_CTX *pctx;
+	int ok;
+
+	pctx = EVP_PKEY_CTX_new(pubkey, NULL);
+	if (!pctx)
+		return 0;
+	ok = EVP_PKEY_verify_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PADDING) > 0 &&
+		EVP_PKEY_verify(pctx, req->sig, req->siglen,
+			req->tbs, req->tbslen) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	return ok;
+}
+
+/* Add the key of the first certificate of another token as a replica */
+static PKCS11_SLOT *add_replica(PKCS11_CTX *ctx, PKCS11_SLOT *slots,
+		unsigned int nslots, PKCS11_SLOT *slot, PKCS11_KEY *key,
+		const char *pin)
+{
+	PKCS11_SLOT *other;
+	PKCS11_CERT *certs;
+	PKCS11_KEY *replica;
+	unsigned int ncerts;
+
+	other = PKCS11_find_next_token(ctx, slots, nslots, slot);
+	if (!other) {
+		fprintf(stderr, "no other token available\n");
+		return NULL;
+	}
+	if (PKCS11_login(other, 0, pin)) {
+		error_queue("PKCS11_login");
+		return NULL;
+	}
+	if (PKCS11_enumerate_certs(other->token, &certs, &ncerts) || !ncerts) {
+		fprintf(stderr, "no certificates found\n");
+		return NULL;
+	}
+	replica = PKCS11_find_key(&certs[0]);
+	if (!replica || PKCS11_add_key_replica(key, replica)) {
+		error_queue("PKCS11_add_key_replica");
+		return NULL;
+	}
+	return other;
+}
+
+/* Number of signatures computed on a slot */
+static unsigned long sign_calls(PKCS11_SLOT *slot)
+{
+	PKCS11_STATS stats;
+
+	if (PKCS11_get_stats(slot, &stats))
+		return 0;
+	return stats.ops[PKCS11_STATS_SIGN].calls -
+		stats.ops[PKCS11_STATS_SIGN].errors;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot, *other = NULL;
+	char slotid[32];
+	PKCS11_CERT *certs;
+	PKCS11_KEY *key;
+	EVP_PKEY *pubkey = NULL;
+	PKCS11_SIGN_REQ reqs[NUM_REQS];
+	unsigned char digests[NUM_REQS][DIGEST_SIZE];
+	unsigned char sigs[NUM_REQS][MAX_SIGSIZE];
+	unsigned int nslots, ncerts, i;
+	int rc = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN "
+			"[replicas|failover]\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		goto notoken;
+	}
+	if (PKCS11_login(slot, 0, argv[2])) {
+		error_queue("PKCS11_login");
+		goto notoken;
+	}
+	if (PKCS11_enumerate_certs(slot->token, &certs, &ncerts) || !ncerts) {
+		fprintf(stderr, "no certificates found\n");
+		goto notoken;
+	}
+	key = PKCS11_find_key(&certs[0]);
+	if (!key) {
+		fprintf(stderr, "no key matching certificate available\n");
+		goto notoken;
+	}
+	pubkey = X509_get_pubkey(certs[0].x509);
+	if (!pubkey) {
+		fprintf(stderr, "could not extract the public key\n");
+		goto notoken;
+	}
+
+	if (argc > 3) {
+		other = add_replica(ctx, slots, nslots, slot, key, argv[2]);
+		if (!other)
+			goto notoken;
+	}
+	if (argc > 3 && strcmp(argv[3], "failover") == 0) {
+		snprintf(slotid, sizeof slotid, "%lu",
+			PKCS11_get_slotid_from_slot(other));
+		setenv("MOCK_PKCS11_FAIL_SLOT", slotid, 1);
+	}
+
+	if (RAND_bytes(&digests[0][0], sizeof digests) <= 0)
+		goto notoken;
+	for (i = 0; i < NUM_REQS; i++) {
+		reqs[i].tbs = digests[i];
+		reqs[i].tbslen = DIGEST_SIZE;
+		reqs[i].sig = sigs[i];
+		reqs[i].siglen = MAX_SIGSIZE;
+	}
+
+	if (PKCS11_sign_batch(key, CKM_RSA_PKCS, reqs, NUM_REQS)) {
+		error_queue("PKCS11_sign_batch");
+		goto notoken;
+	}
+	for (i = 0; i < NUM_REQS; i++) {
+		if (reqs[i].rv != 0 || !verify(pubkey, &reqs[i])) {
+			fprintf(stderr, "signature %u verification failed\n", i);
+			error_queue("EVP_PKEY_verify");
+			goto notoken;
+		}
+	}
+	printf("%u signatures verified\n", NUM_REQS);
+	if (other) {
+		printf("%lu signed on the key, %lu on the replica\n",
+			sign_calls(slot), sign_calls(other));
+		if (strcmp(argv[3], "replicas") == 0 &&
+				(!sign_calls(slot) || !sign_calls(other))) {
+			fprintf(stderr, "the lanes were not distributed\n");
+			goto notoken;
+		}
+		if (strcmp(argv[3], "failover") == 0 &&
+				sign_calls(slot) != NUM_REQS) {
+			fprintf(stderr, "the failed replica was used\n");
+			goto notoken;
+		}
+	}
+	rc = 0;
+
+notoken:
+	EVP_PKEY_free(pubkey);
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+/* vim: set noexpandtab: */
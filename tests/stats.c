@@ -0,0 +1,218 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: stats.c
+ *
+ * Signs with the key of the first certificate, then with the slot failing
+ * the cryptographic operations, and checks the calls, the errors and the
+ * latency histograms returned by PKCS11_get_stats()
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <libp11.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#define DIGEST_SIZE 32
+#define MAX_SIGSIZE 1024
+
+#define SIGNATURES 5
+#define FAILURES 2
+
+#define CKM_RSA_PKCS 0x00000001UL
+#define CKR_DEVICE_ERROR 0x00000030UL
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int sign(EVP_PKEY *pkey)
+{
+	EVP_PKEY_CTX *pctx;
+	unsigned char md[DIGEST_SIZE], sig[MAX_SIGSIZE];
+	size_t siglen = sizeof sig;
+	int ok;
+
+	RAND_bytes(md, sizeof md);
+	pctx = EVP_PKEY_CTX_new(pkey, NULL);
+	if (!pctx)
+		return 0;
+	ok = EVP_PKEY_sign_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+		EVP_PKEY_sign(pctx, sig, &siglen, md, DIGEST_SIZE) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	return ok;
+}
+
+static unsigned long histogram(const unsigned long *latency)
+{
+	unsigned long count = 0;
+	int i;
+
+	for (i = 0; i < PKCS11_STATS_BUCKETS; i++)
+		count += latency[i];
+	return count;
+}
+
+/* Check the calls of an operation, and that each one was timed */
+static int check_op(const char *name, const PKCS11_OP_STATS *op,
+		unsigned long calls, unsigned long errors)
+{
+	if (op->calls != calls || op->errors != errors ||
+			histogram(op->latency) != calls) {
+		fprintf(stderr, "%s: %lu calls, %lu errors, %lu timed calls "
+			"instead of %lu calls, %lu errors\n", name, op->calls,
+			op->errors, histogram(op->latency), calls, errors);
+		return -1;
+	}
+	return 0;
+}
+
+static int check_stats(PKCS11_SLOT *slot, unsigned long calls,
+		unsigned long errors)
+{
+	PKCS11_STATS stats;
+	const PKCS11_MECH_STATS *mech = NULL;
+	unsigned long failed = 0;
+	unsigned int i;
+
+	if (PKCS11_get_stats(slot, &stats)) {
+		error_queue("PKCS11_get_stats");
+		return -1;
+	}
+	if (check_op("sign", &stats.ops[PKCS11_STATS_SIGN], calls, errors) ||
+			check_op("decrypt", &stats.ops[PKCS11_STATS_DECRYPT], 0, 0))
+		return -1;
+	for (i = 0; i < stats.nmechs; i++)
+		if (stats.mechs[i].op == PKCS11_STATS_SIGN &&
+				stats.mechs[i].mechanism == CKM_RSA_PKCS)
+			mech = &stats.mechs[i];
+	if (!mech && calls) {
+		fprintf(stderr, "no statistics of CKM_RSA_PKCS\n");
+		return -1;
+	}
+	if (mech && check_op("sign CKM_RSA_PKCS", &mech->stats, calls, errors))
+		return -1;
+	for (i = 0; i < stats.nerrors; i++)
+		if (stats.errors[i].rv == CKR_DEVICE_ERROR)
+			failed = stats.errors[i].count;
+	if (failed != errors) {
+		fprintf(stderr, "%lu CKR_DEVICE_ERROR instead of %lu\n",
+			failed, errors);
+		return -1;
+	}
+	printf("%lu signatures, %lu errors\n", calls, errors);
+	return 0;
+}
+
+static int test_stats(PKCS11_SLOT *slot, EVP_PKEY *pkey)
+{
+	char slotid[32];
+	int i;
+
+	if (check_stats(slot, 0, 0))
+		return -1;
+	for (i = 0; i < SIGNATURES; i++) {
+		if (!sign(pkey)) {
+			error_queue("EVP_PKEY_sign");
+			return -1;
+		}
+	}
+	if (check_stats(slot, SIGNATURES, 0))
+		return -1;
+
+	snprintf(slotid, sizeof slotid, "%lu",
+		PKCS11_get_slotid_from_slot(slot));
+	setenv("MOCK_PKCS11_FAIL_SLOT", slotid, 1);
+	for (i = 0; i < FAILURES; i++) {
+		if (sign(pkey)) {
+			fprintf(stderr, "the failing slot signed\n");
+			return -1;
+		}
+	}
+	unsetenv("MOCK_PKCS11_FAIL_SLOT");
+	ERR_clear_error();
+	return check_stats(slot, SIGNATURES + FAILURES, FAILURES);
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_CERT *certs;
+	PKCS11_KEY *key;
+	EVP_PKEY *pkey = NULL;
+	unsigned int nslots, ncerts;
+	int rc = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n",
+			argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		goto notoken;
+	}
+	if (PKCS11_login(slot, 0, argv[2])) {
+		error_queue("PKCS11_login");
+		goto notoken;
+	}
+	if (PKCS11_enumerate_certs(slot->token, &certs, &ncerts) || !ncerts) {
+		fprintf(stderr, "no certificates found\n");
+		goto notoken;
+	}
+	key = PKCS11_find_key(&certs[0]);
+	if (!key) {
+		fprintf(stderr, "no key matching certificate available\n");
+		goto notoken;
+	}
+	pkey = PKCS11_get_private_key(key);
+	if (!pkey) {
+		error_queue("PKCS11_get_private_key");
+		goto notoken;
+	}
+
+	if (test_stats(slot, pkey) == 0)
+		rc = 0;
+
+	EVP_PKEY_free(pkey);
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+/* vim: set noexpandtab: */
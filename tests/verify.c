@@ -0,0 +1,152 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* libp11 test code: verify.c
+ *
+ * Signs a digest with the first private key, and checks that
+ * PKCS11_verify() accepts the signature and rejects a modified one,
+ * both with OpenSSL and with the token.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libp11.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+#define DIGEST_SIZE 32
+#define MAX_SIGSIZE 1024
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int sign(EVP_PKEY *pkey, const unsigned char *md,
+		unsigned char *sig, size_t *siglen)
+{
+	EVP_PKEY_CTX *pctx;
+	int ok;
+
+	pctx = EVP_PKEY_CTX_new(pkey, NULL);
+	if (!pctx)
+		return 0;
+	ok = EVP_PKEY_sign_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+		EVP_PKEY_sign(pctx, sig, siglen, md, DIGEST_SIZE) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	return ok;
+}
+
+/* Returns 0 if the signature is only accepted unmodified */
+static int check(const char *mode, PKCS11_KEY *key, const unsigned char *md,
+		unsigned char *sig, unsigned int siglen)
+{
+	int rv;
+
+	rv = PKCS11_verify(NID_sha256, md, DIGEST_SIZE, sig, siglen, key);
+	if (rv != 1) {
+		error_queue("PKCS11_verify");
+		fprintf(stderr, "%s: valid signature rejected (%d)\n", mode, rv);
+		return 1;
+	}
+	sig[siglen - 1] ^= 1;
+	rv = PKCS11_verify(NID_sha256, md, DIGEST_SIZE, sig, siglen, key);
+	sig[siglen - 1] ^= 1;
+	if (rv != 0) {
+		fprintf(stderr, "%s: invalid signature accepted (%d)\n", mode, rv);
+		return 1;
+	}
+	ERR_clear_error();
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys;
+	EVP_PKEY *pkey;
+	unsigned char md[DIGEST_SIZE], sig[MAX_SIGSIZE];
+	unsigned int nslots, nkeys;
+	size_t siglen = sizeof sig;
+	int rc = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n",
+			argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_CTX_load(ctx, argv[1])) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token) {
+		fprintf(stderr, "no token available\n");
+		goto notoken;
+	}
+	if (PKCS11_login(slot, 0, argv[2])) {
+		error_queue("PKCS11_login");
+		goto notoken;
+	}
+	if (PKCS11_enumerate_keys(slot->token, &keys, &nkeys) || !nkeys) {
+		fprintf(stderr, "no private keys found\n");
+		goto notoken;
+	}
+
+	pkey = PKCS11_get_private_key(&keys[0]);
+	if (!pkey) {
+		error_queue("PKCS11_get_private_key");
+		goto notoken;
+	}
+	RAND_bytes(md, sizeof md);
+	if (!sign(pkey, md, sig, &siglen)) {
+		error_queue("EVP_PKEY_sign");
+		EVP_PKEY_free(pkey);
+		goto notoken;
+	}
+	EVP_PKEY_free(pkey);
+
+	if (check("OpenSSL", &keys[0], md, sig, (unsigned int)siglen))
+		goto notoken;
+	PKCS11_CTX_set_token_verify(ctx, 1);
+	if (check("token", &keys[0], md, sig, (unsigned int)siglen))
+		goto notoken;
+	printf("signature verified with OpenSSL and with the token\n");
+	rc = 0;
+
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return rc;
+}
+
+/* vim: set noexpandtab: */